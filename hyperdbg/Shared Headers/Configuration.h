@@ -44,3 +44,38 @@
  * UseDbgPrintInsteadOfUsermodeMessageTracking to FALSE
  */
 #define UseImmediateMessaging FALSE
+
+/**
+ * @brief Use binary messages in vmx-root mode (means that the arguments are
+ * stored with an ID of the format string and the formatting is done in
+ * user-mode) it works only if you set
+ * UseDbgPrintInsteadOfUsermodeMessageTracking to FALSE
+ */
+#define UseBinaryMessagesInVmxRoot TRUE
+
+/**
+ * @brief Map the log buffers of the kernel to the user-mode app and read the
+ * messages in place instead of reading them with IRP Pending, it works only if
+ * you set UseDbgPrintInsteadOfUsermodeMessageTracking to FALSE
+ */
+#define UseSharedMemoryForUsermodeMessages TRUE
+
+/**
+ * @brief The default policy of the log buffers when they are full (one of the
+ * LOG_BUFFER_OVERFLOW_POLICY values), it can be changed from user-mode with
+ * IOCTL_SET_LOG_BUFFERS_POLICY
+ */
+#define LogBuffersDefaultOverflowPolicy LOG_OVERFLOW_SUMMARIZE
+
+/**
+ * @brief Count the vm-exits of each exit reason and measure their cycles, the
+ * statistics are read from user-mode with IOCTL_QUERY_VMEXIT_STATISTICS
+ */
+#define CollectVmexitStatistics TRUE
+
+/**
+ * @brief Keep the last vm-exits of each core (reason, qualification, RIP, time
+ * stamp counter and cycles), they are read with IOCTL_DUMP_FLIGHT_RECORDER and
+ * saved in the crash dump in the case of bugcheck
+ */
+#define CollectVmexitFlightRecorder TRUE
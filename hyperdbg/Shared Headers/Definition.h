@@ -11,6 +11,7 @@
  * @copyright This project is released under the GNU Public License v3.
  *
  */
+#pragma once
 
 //////////////////////////////////////////////////
 //				Message Tracing                 //
@@ -25,15 +26,769 @@
       1 /* Becausee of Opeation code at the start of the buffer + 1 for        \
            null-termminating */
 #define LogBufferSize                                                          \
-  MaximumPacketsCapacity *(PacketChunkSize + sizeof(BUFFER_HEADER))
+  0x100000 // Size of each ring in bytes (should be a power of two)
 #define SIZEOF_REGISTER_EVENT sizeof(REGISTER_NOTIFY_BUFFER)
 #define DbgPrintLimitation 512
+/* Maximum microseconds that a non-immediate message waits before being sent */
+#define NonImmediateMessagesFlushInterval 100000
+/* Maximum count of IRPs that wait for new messages at the same time */
+#define MaximumPendingIrps 64
+/* Count of the overlapped requests that user-mode keeps pending in kernel */
+#define LogConsumerInFlightRequests 16
+/* Timeout (ms) of user-mode for the cancelled requests to be completed */
+#define LogConsumerCancelTimeout 1000
+/* Buffer of user-mode for batched reads (IOCTL_READ_LOG_BUFFERS_BATCH) */
+#define LogBatchBufferSize                                                     \
+  (64 * (sizeof(LOG_BATCH_PACKET_HEADER) + PacketChunkSize))
+
+/* Alignment of the records in the log buffers */
+#define LogRecordAlignment 8
+
+/* Size of a record (header + body) in the log buffers */
+#define LOG_RECORD_SIZE(BodyLength)                                            \
+  ((sizeof(BUFFER_HEADER) + (BodyLength) + LogRecordAlignment - 1) &          \
+   ~((UINT64)LogRecordAlignment - 1))
+
+/**
+ * @brief Message buffer structure (header of each record of the log buffers)
+ * @details Records are variable-length and placed one after another, a record
+ * never wraps around the end of the buffer, instead the producer skips the
+ * tail of the buffer (it writes an OPERATION_LOG_PADDING header there if the
+ * tail is not smaller than this header)
+ *
+ */
+typedef struct _BUFFER_HEADER {
+  UINT32 OpeationNumber;   // Operation ID to user-mode
+  UINT32 BufferLength;     // The actual length
+  UINT64 TimeStampCounter; // TSC of the time that the buffer is written (used
+                           // to merge the rings)
+
+} BUFFER_HEADER, *PBUFFER_HEADER;
+
+/**
+ * @brief Body of an OPERATION_LOG_TIME_CALIBRATION record
+ * @details The messages only have the time stamp counter, the user-mode
+ * converts it to the local time based on this record
+ *
+ */
+typedef struct _LOG_TIME_CALIBRATION {
+  UINT64 TimeStampCounterFrequency; // Ticks per second
+  UINT64 TimeStampCounter;          // The anchor (TSC)
+  UINT64 LocalTime; // The anchor (local time in 100-nanosecond intervals since
+                    // January 1, 1601)
+
+} LOG_TIME_CALIBRATION, *PLOG_TIME_CALIBRATION;
+
+/**
+ * @brief Header of each packet in the result of IOCTL_READ_LOG_BUFFERS_BATCH
+ * @details The packets are placed one after another, each one is this header
+ * plus Length bytes of body, the body follows OperationCode without any gap
+ *
+ */
+typedef struct _LOG_BATCH_PACKET_HEADER {
+  UINT32 Length;           // Length of the body
+  UINT32 BufferIndex;      // Index of the log buffer (core * 2 + vmx-root?)
+  UINT64 TimeStampCounter; // When the message is written to the log buffer
+  UINT32 Reserved;
+  UINT32 OperationCode; // Operation ID to user-mode (should be the last field)
+
+} LOG_BATCH_PACKET_HEADER, *PLOG_BATCH_PACKET_HEADER;
+
+//////////////////////////////////////////////////
+//			   Shared Log Buffers               //
+//////////////////////////////////////////////////
+
+/* Maximum number of log rings that can be mapped to user-mode (2 per core) */
+#define LOG_MAXIMUM_SHARED_BUFFERS 256
+
+/* Count of unread bytes of a ring that makes kernel signal user-mode */
+#define SharedMemoryFillThreshold 0x2000
+
+/* Timeout (ms) of user-mode for checking the packets below the threshold */
+#define SharedMemoryPollingInterval 100
+
+/**
+ * @brief Request to map the log rings to user-mode
+ *
+ */
+typedef struct _LOG_MAP_BUFFERS_REQUEST {
+  UINT64 hEvent;        // The event that is signaled when a ring is filled
+  UINT32 FillThreshold; // Count of unread bytes of a ring to signal the event
+
+} LOG_MAP_BUFFERS_REQUEST, *PLOG_MAP_BUFFERS_REQUEST;
+
+/**
+ * @brief Counters of each ring (shared with user-mode if the rings are mapped)
+ * @details The counters are in bytes, offset of a record in the ring is
+ * (Count % BufferSize), the kernel only changes WrittenCount and the consumer
+ * only changes ReadCount
+ *
+ */
+typedef struct _LOG_SHARED_RING_CONTROL {
+  volatile UINT64 WrittenCount;
+  volatile UINT64 ReadCount;
+  UINT64 Reserved[6]; // Each ring has its own cache line
+
+} LOG_SHARED_RING_CONTROL, *PLOG_SHARED_RING_CONTROL;
+
+/**
+ * @brief The result of mapping the log rings to user-mode
+ *
+ */
+typedef struct _LOG_MAPPED_BUFFERS_INFORMATION {
+  UINT32 BufferCount;          // Count of rings
+  UINT32 BufferSize;           // Size of each ring in bytes
+  UINT64 SharedControlAddress; // Array of LOG_SHARED_RING_CONTROL (writable)
+  UINT64 BufferAddresses[LOG_MAXIMUM_SHARED_BUFFERS]; // Rings (read-only)
+
+} LOG_MAPPED_BUFFERS_INFORMATION, *PLOG_MAPPED_BUFFERS_INFORMATION;
+
+//////////////////////////////////////////////////
+//			   Log Buffers Statistics           //
+//////////////////////////////////////////////////
+
+/**
+ * @brief What to do when a log ring is full
+ *
+ */
+typedef enum _LOG_BUFFER_OVERFLOW_POLICY {
+  LOG_OVERFLOW_DROP_NEWEST,      // The new record is dropped
+  LOG_OVERFLOW_OVERWRITE_OLDEST, // The oldest unread records are overwritten
+  LOG_OVERFLOW_SUMMARIZE // The new record is dropped, then a "N records lost"
+                         // record is sent when there is space again
+
+} LOG_BUFFER_OVERFLOW_POLICY;
+
+/**
+ * @brief Body of an OPERATION_LOG_RECORDS_LOST record
+ *
+ */
+typedef struct _LOG_RECORDS_LOST {
+  UINT64 LostRecords; // Count of records of this ring that are dropped
+
+} LOG_RECORDS_LOST, *PLOG_RECORDS_LOST;
+
+/**
+ * @brief Statistics of each log ring
+ *
+ */
+typedef struct _LOG_RING_STATISTICS {
+  UINT64 WrittenRecords;     // Count of records that are written to the ring
+  UINT64 DroppedRecords;     // Count of records that are dropped (ring is full)
+  UINT64 OverwrittenRecords; // Count of unread records that are overwritten
+  UINT64 UnreadBytes;        // Bytes of the ring that are not read yet
+
+} LOG_RING_STATISTICS, *PLOG_RING_STATISTICS;
+
+/**
+ * @brief The result of IOCTL_QUERY_LOG_BUFFERS_STATISTICS
+ *
+ */
+typedef struct _LOG_BUFFERS_STATISTICS {
+  UINT32 BufferCount; // Count of rings (two for each core, non-root and root)
+  LOG_BUFFER_OVERFLOW_POLICY Policy; // Current policy of the rings
+  LOG_RING_STATISTICS Rings[LOG_MAXIMUM_SHARED_BUFFERS];
+
+} LOG_BUFFERS_STATISTICS, *PLOG_BUFFERS_STATISTICS;
+
+/**
+ * @brief The request of IOCTL_SET_LOG_BUFFERS_POLICY
+ *
+ */
+typedef struct _LOG_BUFFERS_POLICY_REQUEST {
+  LOG_BUFFER_OVERFLOW_POLICY Policy;
+
+} LOG_BUFFERS_POLICY_REQUEST, *PLOG_BUFFERS_POLICY_REQUEST;
+
+//////////////////////////////////////////////////
+//			     Log Subscriptions              //
+//////////////////////////////////////////////////
+
+/* Maximum count of the subscribers (each one has two rings for each core) */
+#define LOG_MAXIMUM_SUBSCRIBERS 4
+
+/* Maximum count of the tags of a subscription */
+#define LOG_SUBSCRIPTION_MAXIMUM_TAGS 32
+
+/* The default consumer (IOCTL_READ_LOG_BUFFERS_BATCH and the mapped rings) */
+#define LOG_SUBSCRIBER_DEFAULT 0
+
+/* SubscriberId of IOCTL_LOG_SUBSCRIBE to create a new subscriber */
+#define LOG_SUBSCRIBER_NEW 0xffffffff
+
+/* Bit of OperationCodes for the operation codes after 62 (e.g. the results of
+ * the custom codes, their operation code is the tag of the event) */
+#define LOG_SUBSCRIPTION_OTHER_OPERATIONS 63
+
+/* Flags of IOCTL_LOG_SUBSCRIBE */
+#define LOG_SUBSCRIPTION_EXCLUSIVE                                             \
+  0x1 // The matching records are not written to the default rings
+#define LOG_SUBSCRIPTION_REMOVE                                                \
+  0x2 // Remove the subscriber (the filter of the default consumer)
+
+/**
+ * @brief The request (and the result) of IOCTL_LOG_SUBSCRIBE
+ * @details A record is written to the rings of a subscriber if it matches
+ * all the filters of the subscription (a zero filter matches everything),
+ * the time calibration and the binary formats are always written to all
+ * the subscribers, the filter of the default consumer is changed by
+ * LOG_SUBSCRIBER_DEFAULT
+ *
+ */
+typedef struct _LOG_SUBSCRIPTION_REQUEST {
+  UINT32 SubscriberId;   // LOG_SUBSCRIBER_NEW (the new ID is returned),
+                         // LOG_SUBSCRIBER_DEFAULT or an existing subscriber
+  UINT32 Flags;          // LOG_SUBSCRIPTION_*
+  UINT64 OperationCodes; // Bit n for operation code n (binary messages use
+                         // their log level), zero means all
+  UINT64 CoreMask;       // Bit n for core n, zero means all (the cores after
+                         // 63 only match zero)
+  UINT32 CountOfTags;    // Zero means all the records (also the records
+                         // without a tag)
+  UINT32 Status;         // NTSTATUS of the request (filled by the driver)
+  UINT64 Tags[LOG_SUBSCRIPTION_MAXIMUM_TAGS]; // Tags of the events
+                                              // (OPERATION_LOG_WITH_TAG and
+                                              // OPERATION_LOG_STATES)
+
+} LOG_SUBSCRIPTION_REQUEST, *PLOG_SUBSCRIPTION_REQUEST;
+
+/**
+ * @brief The input of IOCTL_READ_SUBSCRIBED_LOG_BUFFERS
+ * @details The output is the same as IOCTL_READ_LOG_BUFFERS_BATCH (the
+ * request is pending until there is a record of the subscriber)
+ *
+ */
+typedef struct _LOG_SUBSCRIBER_READ_REQUEST {
+  UINT32 SubscriberId;
+  UINT32 Reserved;
+
+} LOG_SUBSCRIBER_READ_REQUEST, *PLOG_SUBSCRIBER_READ_REQUEST;
+
+//////////////////////////////////////////////////
+//			   VM-Exit Statistics               //
+//////////////////////////////////////////////////
+
+/* Count of the exit reasons that are counted (0 to EXIT_REASON_PCOMMIT) */
+#define VMEXIT_STATISTICS_MAXIMUM_REASONS 66
+
+/* Bucket i of the histograms counts the vm-exits of 2^i to 2^(i+1)-1 cycles */
+#define VMEXIT_STATISTICS_HISTOGRAM_BUCKETS 24
+
+/* Sum the statistics of all the cores */
+#define VMEXIT_STATISTICS_ALL_CORES 0xffffffff
+
+/**
+ * @brief Statistics of one exit reason
+ * @details Cycles are measured from AsmVmexitHandler (after saving the
+ * registers) to the end of VmxVmexitHandler (before VMRESUME)
+ *
+ */
+typedef struct _VMEXIT_REASON_STATISTICS {
+  UINT64 Count;
+  UINT64 TotalCycles;
+  UINT64 MaximumCycles;
+  UINT64 Histogram[VMEXIT_STATISTICS_HISTOGRAM_BUCKETS];
+
+} VMEXIT_REASON_STATISTICS, *PVMEXIT_REASON_STATISTICS;
+
+/**
+ * @brief The request of IOCTL_QUERY_VMEXIT_STATISTICS
+ *
+ */
+typedef struct _VMEXIT_STATISTICS_REQUEST {
+  UINT32 CoreIndex; // Index of the core or VMEXIT_STATISTICS_ALL_CORES
+  BOOLEAN Reset;    // Zero the statistics after reading them
+
+} VMEXIT_STATISTICS_REQUEST, *PVMEXIT_STATISTICS_REQUEST;
+
+/**
+ * @brief The result of IOCTL_QUERY_VMEXIT_STATISTICS
+ *
+ */
+typedef struct _VMEXIT_STATISTICS {
+  UINT32 CoreCount; // Count of the cores of the system
+  UINT32 CoreIndex; // Same as the request
+  VMEXIT_REASON_STATISTICS Reasons[VMEXIT_STATISTICS_MAXIMUM_REASONS];
+
+} VMEXIT_STATISTICS, *PVMEXIT_STATISTICS;
+
+//////////////////////////////////////////////////
+//			  Guest RIP Sampling                //
+//////////////////////////////////////////////////
+
+/* Count of the samples of the ring of each core */
+#define SAMPLING_MAXIMUM_SAMPLES_PER_CORE 0x4000
+
+/* Default count of samples of each core per second */
+#define SAMPLING_DEFAULT_FREQUENCY 1000
+
+/**
+ * @brief Each sample of the VMX-preemption timer
+ *
+ */
+typedef struct _GUEST_RIP_SAMPLE {
+  UINT64 Rip;
+  UINT64 Cr3;
+  UINT64 TimeStampCounter;
+  UINT32 CoreIndex;
+  UINT32 Cpl; // Current privilege level of the guest (DPL of SS)
+
+} GUEST_RIP_SAMPLE, *PGUEST_RIP_SAMPLE;
+
+/**
+ * @brief The request of IOCTL_CONTROL_SAMPLING
+ *
+ */
+typedef struct _SAMPLING_CONTROL_REQUEST {
+  BOOLEAN Start;     // Start (TRUE) or stop (FALSE) the sampling
+  UINT32 Frequency;  // Samples of each core per second (if Start)
+
+} SAMPLING_CONTROL_REQUEST, *PSAMPLING_CONTROL_REQUEST;
+
+/**
+ * @brief The result of IOCTL_READ_SAMPLES
+ * @details The output buffer is this header followed by CountOfSamples
+ * samples, the samples are removed from the rings of the cores
+ *
+ */
+typedef struct _SAMPLING_READ_RESULT {
+  UINT32 CountOfSamples;
+  UINT32 Reserved;
+  UINT64 LostSamples; // Samples that are dropped as the rings were full (since
+                      // the previous read)
+
+} SAMPLING_READ_RESULT, *PSAMPLING_READ_RESULT;
+
+//////////////////////////////////////////////////
+//			  VM-Exit Flight Recorder           //
+//////////////////////////////////////////////////
+
+/* Count of the last vm-exits that are kept for each core (power of 2) */
+#define FLIGHT_RECORDER_ENTRIES_PER_CORE 64
+
+/**
+ * @brief Each vm-exit in the flight recorder
+ * @details HandlerCycles is zero while the vm-exit is not handled yet
+ *
+ */
+typedef struct _VMEXIT_FLIGHT_RECORD {
+  UINT32 ExitReason;
+  UINT32 Reserved;
+  UINT64 ExitQualification;
+  UINT64 GuestRip;
+  UINT64 TimeStampCounter; // Time stamp counter at the start of the handler
+  UINT64 HandlerCycles;
+
+} VMEXIT_FLIGHT_RECORD, *PVMEXIT_FLIGHT_RECORD;
+
+/**
+ * @brief The flight recorder of each core
+ * @details The next vm-exit is saved in
+ * Records[CountOfVmexits % FLIGHT_RECORDER_ENTRIES_PER_CORE]
+ *
+ */
+typedef struct _VMEXIT_FLIGHT_RECORDER_CORE {
+  UINT64 CountOfVmexits;
+  VMEXIT_FLIGHT_RECORD Records[FLIGHT_RECORDER_ENTRIES_PER_CORE];
+
+} VMEXIT_FLIGHT_RECORDER_CORE, *PVMEXIT_FLIGHT_RECORDER_CORE;
+
+/**
+ * @brief The result of IOCTL_DUMP_FLIGHT_RECORDER
+ * @details The output buffer is this header followed by CoreCount
+ * VMEXIT_FLIGHT_RECORDER_CORE
+ *
+ */
+typedef struct _VMEXIT_FLIGHT_RECORDER_DUMP {
+  UINT32 CoreCount;
+  UINT32 EntriesPerCore;
+
+} VMEXIT_FLIGHT_RECORDER_DUMP, *PVMEXIT_FLIGHT_RECORDER_DUMP;
+
+//////////////////////////////////////////////////
+//				  Batch EPT Hooks               //
+//////////////////////////////////////////////////
+
+/* Maximum count of the entries in each IOCTL_EPT_HOOK_BATCH */
+#define EPT_HOOK_BATCH_MAXIMUM_ENTRIES 512
+
+/* The accesses that are hooked (same as PAGE_ATTRIB_* of the hypervisor) */
+#define EPT_HOOK_BATCH_ATTRIB_READ 0x2
+#define EPT_HOOK_BATCH_ATTRIB_WRITE 0x4
+#define EPT_HOOK_BATCH_ATTRIB_EXEC 0x8
+
+/* Deliver the accesses as virtualization exceptions without vm-exits (read/write hooks, if it's supported) */
+#define EPT_HOOK_BATCH_ATTRIB_VE 0x20
+
+/**
+ * @brief Each page of a batch of EPT hooks
+ * @details HookFunction and OrigFunction are only used for the execution
+ * hooks of the kernel callers, they're ignored in IOCTL_EPT_HOOK_BATCH, a
+ * write watch of a byte range (WatchLength) might only hook the writes, the
+ * hooks of a process (ProcessId) are only armed while the process is running
+ * and all the scoped hooks should be of the same process
+ *
+ */
+typedef struct _EPT_HOOK_BATCH_ENTRY {
+  UINT64 Address;      // Target virtual address
+  UINT64 HookFunction; // The function that will be called when hook triggered
+  UINT64 OrigFunction; // A pointer to write the restore point on it
+  UINT32 Attributes;   // EPT_HOOK_BATCH_ATTRIB_* of the accesses to hook
+  UINT32 Status;       // NTSTATUS of this entry (filled by the driver)
+  UINT32 WatchLength;  // Count of the watched bytes from Address (in the same page), zero means the whole page
+  UINT32 ProcessId;    // The process that the hook is armed in, zero means all the processes
+
+} EPT_HOOK_BATCH_ENTRY, *PEPT_HOOK_BATCH_ENTRY;
+
+/**
+ * @brief The request and the result of IOCTL_EPT_HOOK_BATCH
+ * @details The input and the output buffers are this header followed by
+ * CountOfEntries EPT_HOOK_BATCH_ENTRY
+ *
+ */
+typedef struct _EPT_HOOK_BATCH_REQUEST {
+  UINT32 CountOfEntries;
+  UINT32 CountOfSucceeded; // Filled by the driver
+
+} EPT_HOOK_BATCH_REQUEST, *PEPT_HOOK_BATCH_REQUEST;
+
+//////////////////////////////////////////////////
+//			  Dirty Page Tracking               //
+//////////////////////////////////////////////////
+
+/**
+ * @brief The request of IOCTL_CONTROL_DIRTY_PAGE_TRACKING
+ *
+ */
+typedef struct _DIRTY_PAGE_TRACKING_REQUEST {
+  BOOLEAN Start; // Start (TRUE) or stop (FALSE) the tracking
+
+} DIRTY_PAGE_TRACKING_REQUEST, *PDIRTY_PAGE_TRACKING_REQUEST;
+
+/**
+ * @brief The request of IOCTL_QUERY_DIRTY_PAGES
+ *
+ */
+typedef struct _DIRTY_PAGE_QUERY_REQUEST {
+  BOOLEAN Reset; // Clear the bitmap after reading it (the next query only shows
+                 // the pages that are dirtied after this one)
+
+} DIRTY_PAGE_QUERY_REQUEST, *PDIRTY_PAGE_QUERY_REQUEST;
+
+/**
+ * @brief The result of IOCTL_QUERY_DIRTY_PAGES
+ * @details The output buffer is this header followed by the bitmap (bit i of
+ * UINT64 j is the physical page j * 64 + i), if the buffer is smaller than the
+ * bitmap then only the header is filled and the bitmap is not reset
+ *
+ */
+typedef struct _DIRTY_PAGE_BITMAP {
+  UINT64 CountOfPages;      // Count of the physical pages of the bitmap (from zero)
+  UINT64 CountOfDirtyPages; // Count of the set bits of the bitmap
+  BOOLEAN IsBitmapIncluded; // Whether the bitmap follows the header or not
+
+} DIRTY_PAGE_BITMAP, *PDIRTY_PAGE_BITMAP;
+
+//////////////////////////////////////////////////
+//		  Access Pattern Aggregation          //
+//////////////////////////////////////////////////
+
+/**
+ * @brief Count of the (RIP, address, access type) counters of each core
+ * (power of 2)
+ *
+ */
+#define ACCESS_AGGREGATION_ENTRIES_PER_CORE 1024
+
+/**
+ * @brief Type of the aggregated accesses
+ *
+ */
+typedef enum _ACCESS_AGGREGATION_TYPE {
+  ACCESS_AGGREGATION_TYPE_READ,
+  ACCESS_AGGREGATION_TYPE_WRITE,
+  ACCESS_AGGREGATION_TYPE_EXECUTE
+
+} ACCESS_AGGREGATION_TYPE;
+
+/**
+ * @brief The counter of the accesses of a guest RIP to an address of a hooked
+ * page
+ *
+ */
+typedef struct _ACCESS_AGGREGATION_ENTRY {
+  UINT64 Address;     // The accessed virtual address (hooked page + offset)
+  UINT64 GuestRip;    // RIP of the instruction that accessed the address
+  UINT64 Count;       // Count of the accesses (zero for the empty entries)
+  UINT32 AccessType;  // ACCESS_AGGREGATION_TYPE
+  UINT32 CoreIndex;   // Index of the core that counted the accesses
+
+} ACCESS_AGGREGATION_ENTRY, *PACCESS_AGGREGATION_ENTRY;
+
+/**
+ * @brief The request of IOCTL_CONTROL_ACCESS_AGGREGATION
+ *
+ */
+typedef struct _ACCESS_AGGREGATION_CONTROL_REQUEST {
+  BOOLEAN Start;      // Start (TRUE) or stop (FALSE) counting the accesses
+  UINT32 FlushPeriod; // Milliseconds between logging the counters of each core
+                      // as summaries (zero means only on demand)
+
+} ACCESS_AGGREGATION_CONTROL_REQUEST, *PACCESS_AGGREGATION_CONTROL_REQUEST;
+
+/**
+ * @brief The request of IOCTL_QUERY_ACCESS_AGGREGATION
+ *
+ */
+typedef struct _ACCESS_AGGREGATION_QUERY_REQUEST {
+  BOOLEAN Reset; // Clear the counters after reading them
+
+} ACCESS_AGGREGATION_QUERY_REQUEST, *PACCESS_AGGREGATION_QUERY_REQUEST;
+
+/**
+ * @brief The result of IOCTL_QUERY_ACCESS_AGGREGATION
+ * @details The output buffer is this header followed by the entries of all
+ * the cores, the entries that don't fit in the buffer are counted in
+ * CountOfMissedEntries (and cleared if the counters are reset)
+ *
+ */
+typedef struct _ACCESS_AGGREGATION_RESULT {
+  UINT32 CountOfEntries;       // Count of the entries that follow the header
+  UINT32 CountOfMissedEntries; // Count of the entries that don't fit
+  UINT64 FlushedAccesses;      // Count of the accesses that are logged as
+                               // summaries since the start
+
+} ACCESS_AGGREGATION_RESULT, *PACCESS_AGGREGATION_RESULT;
+
+//////////////////////////////////////////////////
+//			     Pool Manager                   //
+//////////////////////////////////////////////////
+
+/* Maximum count of the intentions in the result of IOCTL_QUERY_POOL_STATISTICS */
+#define POOL_STATISTICS_MAXIMUM_INTENTIONS 16
+
+/**
+ * @brief The counters of the pools of an intention
+ * @details The pools that are neither free nor busy are kept in the magazines
+ * of the cores
+ *
+ */
+typedef struct _POOL_INTENTION_STATISTICS {
+  UINT64 Size;            // Size of the pools (zero if nothing is allocated)
+  UINT64 ReplenishedPools; // Pools that are allocated by the replenishments
+  UINT32 Pools;           // Count of all the pools
+  UINT32 FreePools;       // Pools in the free list
+  UINT32 BusyPools;       // Pools that are given and not returned
+  UINT32 FailedRequests;  // Requests that found no pool
+  UINT32 LowWatermark;
+  UINT32 HighWatermark;
+
+} POOL_INTENTION_STATISTICS, *PPOOL_INTENTION_STATISTICS;
+
+/**
+ * @brief The result of IOCTL_QUERY_POOL_STATISTICS
+ *
+ */
+typedef struct _POOL_MANAGER_STATISTICS {
+  UINT32 CountOfIntentions; // Index of each intention is its
+                            // POOL_ALLOCATION_INTENTION
+  UINT32 CountOfReplenishments;
+  UINT64 LockAcquisitions; // Counters of the lock of the pools
+  UINT64 LockContendedAcquisitions;
+  UINT64 LockSpinCycles;
+  POOL_INTENTION_STATISTICS Intentions[POOL_STATISTICS_MAXIMUM_INTENTIONS];
+
+} POOL_MANAGER_STATISTICS, *PPOOL_MANAGER_STATISTICS;
+
+//////////////////////////////////////////////////
+//			     Syscall Hook                   //
+//////////////////////////////////////////////////
+
+/* Count of the syscall numbers in the filter (covers the nt and the win32k
+ * tables) */
+#define SYSCALL_HOOK_FILTER_MAXIMUM_SYSCALLS 0x2000
+
+/**
+ * @brief The request of IOCTL_SET_SYSCALL_HOOK_FILTER
+ * @details Only the syscalls that match the filter trigger the
+ * SYSCALL_HOOK_EFER events, the others are only emulated
+ *
+ */
+typedef struct _SYSCALL_HOOK_FILTER_REQUEST {
+  BOOLEAN FilterSyscallNumbers; // If FALSE, all the syscall numbers match
+  UINT32 ProcessId;             // Zero means all the processes
+  UINT64 Cr3;                   // Zero means all the address spaces
+  UINT8 Bitmap[SYSCALL_HOOK_FILTER_MAXIMUM_SYSCALLS / 8]; // Bit of each
+                                                          // syscall number
+
+} SYSCALL_HOOK_FILTER_REQUEST, *PSYSCALL_HOOK_FILTER_REQUEST;
+
+/* Count of the argument registers in each OPERATION_LOG_SYSCALL_TRACE record */
+#define SYSCALL_TRACE_ARGUMENTS 4
+
+/**
+ * @brief Body of an OPERATION_LOG_SYSCALL_TRACE record
+ * @details A record is sent for each syscall that matches the filter and, if
+ * the return values are captured, for its sysret (the returns are matched to
+ * their syscalls by the thread id)
+ *
+ */
+typedef struct _SYSCALL_TRACE_RECORD {
+  UINT64 TimeStampCounter;
+  UINT64 Arguments[SYSCALL_TRACE_ARGUMENTS]; // r10, rdx, r8 and r9 (zero in
+                                             // the returns)
+  UINT64 ReturnValue;                        // rax at the sysret (only in the
+                                             // returns)
+  UINT32 ProcessId;
+  UINT32 ThreadId;
+  UINT32 SyscallNumber;
+  UINT16 CoreId;
+  BOOLEAN IsReturn;
+
+} SYSCALL_TRACE_RECORD, *PSYSCALL_TRACE_RECORD;
+
+/**
+ * @brief The request of IOCTL_CONTROL_SYSCALL_TRACE
+ *
+ */
+typedef struct _SYSCALL_TRACE_CONTROL_REQUEST {
+  BOOLEAN Start;              // Start or stop the trace
+  BOOLEAN CaptureReturnValue; // Also send a record for the sysret of each
+                              // traced syscall
+
+} SYSCALL_TRACE_CONTROL_REQUEST, *PSYSCALL_TRACE_CONTROL_REQUEST;
+
+/* The first syscall number of the win32k table */
+#define SYSCALL_WIN32K_FIRST_NUMBER 0x1000
+
+/**
+ * @brief The result of IOCTL_QUERY_SYSCALL_SERVICE_TABLES
+ * @details The addresses of the services of the nt table follow the header
+ * (one UINT64 for each syscall number) and then the addresses of the services
+ * of the win32k table (from SYSCALL_WIN32K_FIRST_NUMBER)
+ *
+ */
+typedef struct _SYSCALL_SERVICE_TABLES_RESULT {
+  UINT64 KernelBase;
+  UINT64 NtTable;     // Address of KeServiceDescriptorTable
+  UINT64 Win32kTable; // Address of the win32k entry of
+                      // KeServiceDescriptorTableShadow
+  UINT32 KernelSize;
+  UINT32 CountOfNtServices;
+  UINT32 CountOfWin32kServices; // Zero if the win32k table is not mapped in the
+                                // session of the caller
+  UINT32 CountOfMissedServices; // The services that don't fit in the buffer
+
+} SYSCALL_SERVICE_TABLES_RESULT, *PSYSCALL_SERVICE_TABLES_RESULT;
+
+//////////////////////////////////////////////////
+//			    Startup Timing                  //
+//////////////////////////////////////////////////
+
+/**
+ * @brief The cycles of the bring-up of a core
+ *
+ */
+typedef struct _VMX_STARTUP_CORE_TIMING {
+  UINT64 RegionsCycles; // Allocating the VMXON, VMCS, stack and bitmaps
+  UINT64 LaunchCycles;  // Setting up the VMCS and VMLAUNCH
+
+} VMX_STARTUP_CORE_TIMING, *PVMX_STARTUP_CORE_TIMING;
+
+/**
+ * @brief The result of IOCTL_QUERY_STARTUP_TIMING
+ * @details The phases are measured in the time-stamp counter of the core that
+ * initializes the vmx and the timing of each core follows the header (the
+ * phases of the cores are done in parallel)
+ *
+ */
+typedef struct _VMX_STARTUP_TIMING {
+  UINT64 TimeStampCounterFrequency; // Ticks of the time-stamp counter in a
+                                    // second
+  UINT64 MtrrCycles;                // Building the MTRR map
+  UINT64 PoolManagerCycles;         // Pre-allocating the pools
+  UINT64 EptCycles;                 // Building the identity map and the views
+  UINT64 RegionsCycles;             // All the cores allocate their regions
+  UINT64 MemoryMapperCycles;        // Reserving the addresses of the mappers
+  UINT64 LaunchCycles;              // All the cores execute VMLAUNCH
+  UINT64 TotalCycles;
+  UINT32 CountOfCores;
+  UINT32 CountOfMissedCores; // The cores that don't fit in the buffer
+
+} VMX_STARTUP_TIMING, *PVMX_STARTUP_TIMING;
+
+/**
+ * @brief The request (and the result) of IOCTL_SUSPEND_VMX
+ * @details The suspended cores are not in vmx operation but their regions, the
+ * EPT tables, the pools and the hooks are kept, so resuming is only VMXON and
+ * VMLAUNCH on each core
+ *
+ */
+typedef struct _VMX_SUSPEND_REQUEST {
+  BOOLEAN Suspend;                  // Suspend or resume the virtualization
+  UINT64 Cycles;                    // Cycles of suspending or resuming (output)
+  UINT64 TimeStampCounterFrequency; // Ticks of the time-stamp counter in a
+                                    // second (output)
+
+} VMX_SUSPEND_REQUEST, *PVMX_SUSPEND_REQUEST;
+
+//////////////////////////////////////////////////
+//				    Benchmarks                  //
+//////////////////////////////////////////////////
+
+/* Maximum count of the samples of each IOCTL_PERFORM_BENCHMARK */
+#define BENCHMARK_MAXIMUM_SAMPLES 0x10000
+
+/**
+ * @brief The operations that are measured by IOCTL_PERFORM_BENCHMARK
+ * @details The syscalls can only be measured in user-mode, so the EFER
+ * syscall hook is only enabled or disabled for measuring them (no samples)
+ *
+ */
+typedef enum _BENCHMARK_TEST {
+  BENCHMARK_TEST_BASELINE,                 // Nothing between the time stamps
+  BENCHMARK_TEST_CPUID,                    // CPUID (always a vm-exit)
+  BENCHMARK_TEST_RDMSR_BITMAP_HIT,         // RDMSR of an MSR that is set in the MSR bitmap
+  BENCHMARK_TEST_RDMSR_BITMAP_MISS,        // RDMSR of an MSR that is not set in the MSR bitmap
+  BENCHMARK_TEST_VMCALL,                   // A VMCALL that does nothing in vmx-root
+  BENCHMARK_TEST_EPT_READ_HOOK_HIT,        // Read of a page with a read hook
+  BENCHMARK_TEST_EPT_WRITE_HOOK_HIT,       // Write of a page with a write hook
+  BENCHMARK_TEST_EPT_EXEC_HOOK_HIT,        // Read of a page with a hidden execution hook and executing it again
+  BENCHMARK_TEST_DETOUR_HOOK_CALL,         // Call of a function with a hidden execution hook
+  BENCHMARK_TEST_ENABLE_SYSCALL_HOOK_EFER, // Enable the EFER syscall hook on all the cores
+  BENCHMARK_TEST_DISABLE_SYSCALL_HOOK_EFER // Disable the EFER syscall hook if it was enabled by the benchmark
+
+} BENCHMARK_TEST;
+
+/**
+ * @brief The request (and the header of the result) of IOCTL_PERFORM_BENCHMARK
+ * @details The operation is performed on the pinned core at DISPATCH_LEVEL,
+ * the warmups are not sampled, the cycles between the time stamps of each
+ * sample follow the header in the result (CountOfSamples UINT64 entries)
+ *
+ */
+typedef struct _BENCHMARK_REQUEST {
+  UINT32 Test;                      // BENCHMARK_TEST
+  UINT32 CoreId;                    // The core that the test is performed on
+  UINT32 CountOfWarmups;            // Iterations before the samples
+  UINT32 CountOfSamples;            // Samples to take (up to
+                                    // BENCHMARK_MAXIMUM_SAMPLES), the taken
+                                    // samples in the result
+  UINT64 TimeStampCounterFrequency; // Ticks of the time-stamp counter in a
+                                    // second (output)
+
+} BENCHMARK_REQUEST, *PBENCHMARK_REQUEST;
 
 //////////////////////////////////////////////////
 //					Events                      //
 //////////////////////////////////////////////////
 
-typedef enum _NOTIFY_TYPE { IRP_BASED, EVENT_BASED } NOTIFY_TYPE;
+typedef enum _NOTIFY_TYPE {
+  IRP_BASED,
+  EVENT_BASED,
+  IRP_BASED_BATCH // Used by IOCTL_READ_LOG_BUFFERS_BATCH
+
+} NOTIFY_TYPE;
 
 typedef struct _REGISTER_NOTIFY_BUFFER {
   NOTIFY_TYPE Type;
@@ -58,6 +813,49 @@ typedef struct _REGISTER_NOTIFY_BUFFER {
 #define OPERATION_LOG_ERROR_MESSAGE 0x3
 #define OPERATION_LOG_NON_IMMEDIATE_MESSAGE 0x4
 #define OPERATION_LOG_WITH_TAG 0x5
+#define OPERATION_LOG_BINARY_MESSAGE 0x6
+#define OPERATION_LOG_BINARY_FORMAT_DEFINITION 0x7
+#define OPERATION_LOG_PADDING 0x8 // Skipped tail of a log buffer (never sent)
+#define OPERATION_LOG_RECORDS_LOST 0x9
+#define OPERATION_LOG_TIME_CALIBRATION 0xa
+#define OPERATION_LOG_EXCEPTION_HIT 0xb
+#define OPERATION_LOG_STATES 0xc
+#define OPERATION_LOG_SYSCALL_TRACE 0xd
+
+//////////////////////////////////////////////////
+//				Binary Messages                 //
+//////////////////////////////////////////////////
+
+/* Maximum number of 64-bit arguments in a binary message */
+#define LOG_BINARY_MAXIMUM_ARGUMENTS 8
+
+/**
+ * @brief Sent once for each format string (call site) before the first binary
+ * message that uses it, user-mode should keep it to format the next messages
+ *
+ */
+typedef struct _LOG_BINARY_FORMAT_DEFINITION {
+  UINT32 FormatId;
+  UINT32 ArgumentCount;
+  char Format[1]; // null-terminated, continues to the end of the packet
+
+} LOG_BINARY_FORMAT_DEFINITION, *PLOG_BINARY_FORMAT_DEFINITION;
+
+/**
+ * @brief A message that its formatting is deferred to user-mode, only the
+ * used arguments are sent to user-mode
+ *
+ */
+typedef struct _LOG_BINARY_MESSAGE {
+  UINT32 FormatId;
+  UINT32 OperationCode; // OPERATION_LOG_INFO_MESSAGE, WARNING or ERROR
+  UINT32 CoreId;
+  UINT32 ArgumentCount;
+  UINT32 ShowTimeStampCounter;
+  UINT64 TimeStampCounter;
+  UINT64 Arguments[LOG_BINARY_MAXIMUM_ARGUMENTS];
+
+} LOG_BINARY_MESSAGE, *PLOG_BINARY_MESSAGE;
 
 //////////////////////////////////////////////////
 //		    	Callback Definitions			//
@@ -65,12 +863,69 @@ typedef struct _REGISTER_NOTIFY_BUFFER {
 
 typedef int(__stdcall *Callback)(const char *Text);
 
+/* Flags of HyperdbgSetBatchMessageCallback */
+#define HYPERDBG_BATCH_CALLBACK_RAW_RECORDS                                    \
+  0x1 // The kernel records are delivered as they are instead of their text
+
+/* Flags of each entry of the batch callback */
+#define HYPERDBG_MESSAGE_ENTRY_BINARY 0x1 // Data is the body of a kernel record
+
+/**
+ * @brief Each entry of a batch of HyperdbgSetBatchMessageCallback
+ * @details Data is only valid in the callback, the consecutive texts of a
+ * record (or of the library itself) are in one entry
+ *
+ */
+typedef struct _HYPERDBG_MESSAGE_ENTRY {
+  UINT32 OperationCode; // OPERATION_LOG_* of the record, zero for the messages
+                        // of the library itself
+  UINT32 Flags;         // HYPERDBG_MESSAGE_ENTRY_*
+  UINT64 Tag;           // Tag of the event of the record (zero if there isn't)
+  UINT64 TimeStampCounter; // Zero for the messages of the library itself
+  UINT32 Length;           // Length of Data (a text is null-terminated too)
+  UINT32 Reserved;
+  const char *Data;
+
+} HYPERDBG_MESSAGE_ENTRY, *PHYPERDBG_MESSAGE_ENTRY;
+
+typedef int(__stdcall *BatchCallback)(PHYPERDBG_MESSAGE_ENTRY Entries,
+                                      UINT32 Count);
+
 //////////////////////////////////////////////////
 //				Debugger Structs                //
 //////////////////////////////////////////////////
 
 #define DEBUGGER_EVENT_APPLY_TO_ALL_CORES 0xffffffff
 
+/** OptionalParam1 of the RDMSR_INSTRUCTION_EXECUTION and
+ * WRMSR_INSTRUCTION_EXECUTION events to watch all the MSRs */
+#define DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS 0xffffffff
+
+/** OptionalParam1 of the IN_INSTRUCTION_EXECUTION and
+ * OUT_INSTRUCTION_EXECUTION events to watch all the I/O ports */
+#define DEBUGGER_EVENT_ALL_IO_PORTS 0xffffffff
+
+/** OptionalParam1 of the BREAKPOINT_EXCEPTION and DEBUG_EXCEPTION events to
+ * watch the exceptions of all the addresses */
+#define DEBUGGER_EVENT_ALL_ADDRESSES 0xffffffffffffffff
+
+/**
+ * @brief Body of an OPERATION_LOG_EXCEPTION_HIT record
+ * @details Sent for each #BP or #DB that its address is watched by an event
+ * (the unwatched ones are re-injected without any message)
+ *
+ */
+typedef struct _DEBUGGER_EXCEPTION_HIT_RECORD {
+  UINT64 GuestRip;
+  UINT64 GuestCr3;
+  UINT64 TimeStampCounter;
+  UINT64 ExitQualification; // The DR6 bits of the #DB (B0-B3, BD and BS)
+  UINT32 ProcessId;
+  UINT16 CoreId;
+  UINT16 Vector; // EXCEPTION_VECTOR_BREAKPOINT or EXCEPTION_VECTOR_DEBUG_BREAKPOINT
+
+} DEBUGGER_EXCEPTION_HIT_RECORD, *PDEBUGGER_EXCEPTION_HIT_RECORD;
+
 //
 // Pseudo Regs Mask (It's a mask not a value)
 //
@@ -164,6 +1019,32 @@ typedef struct _DEBUGGER_EVENT_ACTION_LOG_CONFIGURATION {
 } DEBUGGER_EVENT_ACTION_LOG_CONFIGURATION,
     *PDEBUGGER_EVENT_ACTION_LOG_CONFIGURATION;
 
+/** Maximum bytes of the guest memory in each OPERATION_LOG_STATES record */
+#define DEBUGGER_LOG_STATES_MAXIMUM_MEMORY 256
+
+/**
+ * @brief Header of an OPERATION_LOG_STATES record
+ * @details The values of the registers of RegisterMask follow the header (one
+ * UINT64 for each bit, from the lowest bit) and then MemoryLength bytes of the
+ * memory at Address, the registers are formatted in user-mode
+ *
+ */
+typedef struct _DEBUGGER_LOG_STATES_RECORD {
+  UINT64 Tag;
+  UINT64 TimeStampCounter;
+  UINT64 GuestRip;
+  UINT64 Address;         // Address of the memory (if any memory is logged)
+  UINT64 SuppressedHits;  // Hits of the event on this core that are suppressed
+                          // by the sampling or the rate limit since the last
+                          // record
+  UINT32 RegisterMask;    // GUEST_GP_REG_* bits of the logged registers
+  UINT32 MemoryLength;    // Zero if the memory is not requested or not valid
+  UINT32 ActionOrderCode; // The action that this record belongs to
+  UINT16 CoreId;
+  BOOLEAN IsMemoryRequested;
+
+} DEBUGGER_LOG_STATES_RECORD, *PDEBUGGER_LOG_STATES_RECORD;
+
 typedef struct _DEBUGGER_EVENT_REQUEST_BUFFER {
   BOOLEAN EnabledRequestBuffer;
   UINT32 RequestBufferSize;
@@ -210,24 +1091,282 @@ typedef enum _DEBUGGER_EVENT_TYPE_ENUM {
   HIDDEN_HOOK_EXEC_DETOUR,
   HIDDEN_HOOK_EXEC_CC,
   SYSCALL_HOOK_EFER,
+  RDMSR_INSTRUCTION_EXECUTION,
+  WRMSR_INSTRUCTION_EXECUTION,
+  IN_INSTRUCTION_EXECUTION,
+  OUT_INSTRUCTION_EXECUTION,
+  BREAKPOINT_EXCEPTION,
+  DEBUG_EXCEPTION,
 
 } DEBUGGER_EVENT_TYPE_ENUM;
 
+/* Count of the event types (the events of each core are indexed by the type) */
+#define DEBUGGER_EVENT_TYPES_COUNT (DEBUG_EXCEPTION + 1)
+
+//
+// Checks of the filter of an event (DEBUGGER_EVENT_FILTER.Flags)
+//
+#define DEBUGGER_EVENT_FILTER_CORE_MASK 0x1
+#define DEBUGGER_EVENT_FILTER_PROCESS_ID 0x2
+#define DEBUGGER_EVENT_FILTER_CR3 0x4
+#define DEBUGGER_EVENT_FILTER_RIP_RANGE 0x8
+#define DEBUGGER_EVENT_FILTER_REGISTERS 0x10
+
+/* Maximum count of the register comparisons of a filter */
+#define DEBUGGER_EVENT_FILTER_MAXIMUM_REGISTERS 4
+
+/**
+ * @brief Compare a register of the guest with a range
+ * @details The event is triggered if (register & Mask) is in [Minimum, Maximum]
+ *
+ */
+typedef struct _DEBUGGER_EVENT_REGISTER_FILTER {
+  UINT32 Register; // One of the GUEST_GP_REG_* bits
+  UINT64 Mask;
+  UINT64 Minimum;
+  UINT64 Maximum;
+
+} DEBUGGER_EVENT_REGISTER_FILTER, *PDEBUGGER_EVENT_REGISTER_FILTER;
+
+/**
+ * @brief The declarative filter of an event
+ * @details It's checked in vmx-root before the condition code, the event is
+ * only triggered if all the checks of Flags pass
+ *
+ */
+typedef struct _DEBUGGER_EVENT_FILTER {
+  UINT32 Flags;     // DEBUGGER_EVENT_FILTER_* (zero means no filter)
+  UINT32 ProcessId; // DEBUGGER_EVENT_FILTER_PROCESS_ID
+  UINT64 CoreMask;  // DEBUGGER_EVENT_FILTER_CORE_MASK (bit i is the core i)
+  UINT64 Cr3;       // DEBUGGER_EVENT_FILTER_CR3
+  UINT64 RipStart;  // DEBUGGER_EVENT_FILTER_RIP_RANGE (e.g, the range of a
+  UINT64 RipEnd;    // module, RipEnd is not in the range)
+  UINT32 CountOfRegisterFilters; // DEBUGGER_EVENT_FILTER_REGISTERS
+  DEBUGGER_EVENT_REGISTER_FILTER
+  RegisterFilters[DEBUGGER_EVENT_FILTER_MAXIMUM_REGISTERS];
+
+} DEBUGGER_EVENT_FILTER, *PDEBUGGER_EVENT_FILTER;
+
+/**
+ * @brief The sampling and the rate limit of an event
+ * @details Both are enforced by each core for its own hits after the filter
+ * and before the condition code, the suppressed hits are counted in the next
+ * OPERATION_LOG_STATES record of the event on the same core
+ *
+ */
+typedef struct _DEBUGGER_EVENT_RATE_LIMIT {
+  UINT32 SampleRate;    // One of each SampleRate hits is triggered (zero or one
+                        // means all the hits)
+  UINT32 HitsPerSecond; // Refill rate of the token bucket of each core (zero
+                        // means no rate limit)
+  UINT32 Burst;         // Size of the token bucket of each core
+  UINT64 CyclesPerToken; // Time stamp counter cycles of each token (computed
+                         // from HitsPerSecond by the driver)
+
+} DEBUGGER_EVENT_RATE_LIMIT, *PDEBUGGER_EVENT_RATE_LIMIT;
+
+/**
+ * @brief The counters and the rate limit state of an event on a core
+ * @details Only changed by vmx-root of the same core, each core has its own
+ * cache line so the counters are not shared between the cores
+ *
+ */
+typedef struct _DEBUGGER_EVENT_STATISTICS {
+  UINT64 Hits;                // Hits that passed the parameters and the filter
+  UINT64 ConditionRejections; // Hits that the condition code rejected
+  UINT64 ActionsRun;          // Count of the performed actions
+  UINT64 ConditionCycles;     // Time stamp counter cycles of the conditions
+  UINT64 ActionCycles;        // Time stamp counter cycles of the actions
+  UINT64 SuppressedHits; // Hits that the sampling or the rate limit suppressed
+                         // since the last OPERATION_LOG_STATES record
+  UINT64 LastRefillTime; // Time stamp counter of the last refill of the bucket
+  UINT32 Tokens;         // Tokens of the bucket
+  UINT32 SampleCounter;  // Hits since the last sampled hit
+
+} DEBUGGER_EVENT_STATISTICS, *PDEBUGGER_EVENT_STATISTICS;
+
 typedef struct _DEBUGGER_EVENT {
   UINT64 Tag;
-  LIST_ENTRY EventsOfSameTypeList; // Linked-list of events of a same type
   DEBUGGER_EVENT_TYPE_ENUM EventType;
   BOOLEAN Enabled;
   UINT32 CoreId; // determines the core index to apply this event to, if it's
                  // 0xffffffff means that we have to apply it to all cores
+  UINT64 OptionalParam1; // the MSR index for the msr events (or
+                         // DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS) and
+                         // the port for the I/O events (or
+                         // DEBUGGER_EVENT_ALL_IO_PORTS) and the address for
+                         // the #BP and #DB events (or
+                         // DEBUGGER_EVENT_ALL_ADDRESSES)
+  DEBUGGER_EVENT_FILTER Filter; // Checked before the conditions
+  DEBUGGER_EVENT_RATE_LIMIT RateLimit; // Checked after the filter
   LIST_ENTRY ActionsListHead;   // Each entry is in DEBUGGER_EVENT_ACTION struct
   UINT32 CountOfActions;        // The total count of actions
   UINT32 ConditionsBufferSize;  // if null, means uncoditional
   PVOID ConditionBufferAddress; // Address of the condition buffer (most of the
                                 // time at the end of this buffer)
+  PDEBUGGER_EVENT_STATISTICS
+      Statistics; // The counters of each core (at the end of this buffer)
 
 } DEBUGGER_EVENT, *PDEBUGGER_EVENT;
 
+/**
+ * @brief The counters of an event in the result of
+ * IOCTL_QUERY_EVENT_STATISTICS (the counters of all the cores are added)
+ *
+ */
+typedef struct _DEBUGGER_EVENT_STATISTICS_ENTRY {
+  UINT64 Tag;
+  DEBUGGER_EVENT_TYPE_ENUM EventType;
+  UINT32 CoreId; // The core of the event or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+  BOOLEAN Enabled;
+  UINT32 CountOfActions;
+  DEBUGGER_EVENT_STATISTICS Statistics;
+
+} DEBUGGER_EVENT_STATISTICS_ENTRY, *PDEBUGGER_EVENT_STATISTICS_ENTRY;
+
+/**
+ * @brief The result of IOCTL_QUERY_EVENT_STATISTICS
+ * @details The output buffer is this header followed by an entry for each
+ * registered event, the events that don't fit in the buffer are counted in
+ * CountOfMissedEvents
+ *
+ */
+typedef struct _DEBUGGER_EVENT_STATISTICS_RESULT {
+  UINT32 CountOfEvents;
+  UINT32 CountOfMissedEvents;
+
+} DEBUGGER_EVENT_STATISTICS_RESULT, *PDEBUGGER_EVENT_STATISTICS_RESULT;
+
+/* Maximum count of the events of each IOCTL_REGISTER_EVENT_BATCH */
+#define DEBUGGER_EVENT_BATCH_MAXIMUM_EVENTS 256
+
+/* Maximum size of the buffer of each IOCTL_REGISTER_EVENT_BATCH */
+#define DEBUGGER_EVENT_BATCH_MAXIMUM_SIZE 0x100000
+
+/* Alignment of the entries and the actions of a batch of events */
+#define DEBUGGER_EVENT_BATCH_ALIGNMENT 8
+
+/* Size of a part of a batch of events rounded up to the alignment */
+#define DEBUGGER_EVENT_BATCH_ALIGN(Size)                                       \
+  (((Size) + DEBUGGER_EVENT_BATCH_ALIGNMENT - 1) &                             \
+   ~((UINT64)DEBUGGER_EVENT_BATCH_ALIGNMENT - 1))
+
+/* FailedEventIndex of a batch that all its entries are valid */
+#define DEBUGGER_EVENT_BATCH_NO_FAILED_EVENT 0xffffffff
+
+/**
+ * @brief The request (and the result) of IOCTL_REGISTER_EVENT_BATCH
+ * @details The buffer is this header followed by CountOfEvents
+ * DEBUGGER_EVENT_BATCH_ENTRY, nothing is registered if any of the entries is
+ * not valid (FailedEventIndex), the output buffer is the same as the input
+ * (the status of each entry is filled)
+ *
+ */
+typedef struct _DEBUGGER_EVENT_BATCH_REQUEST {
+  UINT32 BufferSize;        // This header and all the entries
+  UINT32 CountOfEvents;     // Count of the entries
+  UINT32 CountOfRegistered; // Filled by the driver
+  UINT32 FailedEventIndex;  // The first entry that is not valid (filled by the
+                            // driver)
+  UINT32 Status;            // NTSTATUS of the batch (filled by the driver)
+
+} DEBUGGER_EVENT_BATCH_REQUEST, *PDEBUGGER_EVENT_BATCH_REQUEST;
+
+/**
+ * @brief Each event of a batch of events
+ * @details The condition code (ConditionsBufferSize bytes) follows the entry
+ * and then CountOfActions DEBUGGER_EVENT_BATCH_ACTION from the next aligned
+ * offset, Size is a multiple of DEBUGGER_EVENT_BATCH_ALIGNMENT
+ *
+ */
+typedef struct _DEBUGGER_EVENT_BATCH_ENTRY {
+  UINT32 Size;     // This entry, its condition code and its actions
+  UINT32 Status;   // NTSTATUS of this entry (filled by the driver)
+  UINT64 Tag;
+  UINT64 OptionalParam1; // Same as DEBUGGER_EVENT (the hooked function for
+                         // the HIDDEN_HOOK_EXEC_DETOUR events)
+  UINT32 EventType;      // DEBUGGER_EVENT_TYPE_ENUM
+  UINT32 CoreId;         // The core or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+  BOOLEAN Enabled;
+  UINT32 SampleRate;    // Same as DEBUGGER_EVENT_RATE_LIMIT
+  UINT32 HitsPerSecond; // Same as DEBUGGER_EVENT_RATE_LIMIT
+  UINT32 Burst;         // Same as DEBUGGER_EVENT_RATE_LIMIT
+  DEBUGGER_EVENT_FILTER Filter; // Zero flags means no filter
+  UINT32 ConditionsBufferSize;  // Zero means unconditional
+  UINT32 CountOfActions;
+
+} DEBUGGER_EVENT_BATCH_ENTRY, *PDEBUGGER_EVENT_BATCH_ENTRY;
+
+/**
+ * @brief Each action of an event in a batch of events
+ * @details The custom code (CustomCodeBufferSize bytes) follows the action,
+ * Size is a multiple of DEBUGGER_EVENT_BATCH_ALIGNMENT
+ *
+ */
+typedef struct _DEBUGGER_EVENT_BATCH_ACTION {
+  UINT32 Size;       // This action and its custom code
+  UINT32 ActionType; // DEBUGGER_EVENT_ACTION_TYPE_ENUM
+  BOOLEAN ImmediatelySendTheResults;
+  DEBUGGER_EVENT_ACTION_LOG_CONFIGURATION
+  LogConfiguration; // If it's LOG_THE_STATES
+  UINT32 CustomCodeBufferSize;        // If it's RUN_CUSTOM_CODE
+  UINT32 OptionalRequestedBufferSize; // If it's RUN_CUSTOM_CODE
+
+} DEBUGGER_EVENT_BATCH_ACTION, *PDEBUGGER_EVENT_BATCH_ACTION;
+
+//////////////////////////////////////////////////
+//			    Guest Memory Access             //
+//////////////////////////////////////////////////
+
+/* Maximum count of the entries of each IOCTL_GUEST_MEMORY_ACCESS */
+#define DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES 0x1000
+
+/* Maximum size of the user buffer of each IOCTL_GUEST_MEMORY_ACCESS */
+#define DEBUGGER_GUEST_MEMORY_MAXIMUM_BUFFER_SIZE 0x4000000
+
+/* Flags of IOCTL_GUEST_MEMORY_ACCESS */
+#define DEBUGGER_GUEST_MEMORY_WRITE                                            \
+  0x1 // Copy the user buffer to the guest (otherwise the guest is read)
+#define DEBUGGER_GUEST_MEMORY_PHYSICAL                                         \
+  0x2 // The addresses are physical (otherwise they're virtual)
+
+/**
+ * @brief The request (and the result) of IOCTL_GUEST_MEMORY_ACCESS
+ * @details The buffer is this header followed by CountOfEntries
+ * DEBUGGER_GUEST_MEMORY_ENTRY, the data is in the user buffer which is
+ * locked and mapped by the driver, the output buffer is the same as the
+ * input (the transferred length of each entry is filled)
+ *
+ */
+typedef struct _DEBUGGER_GUEST_MEMORY_REQUEST {
+  UINT64 UserBuffer;       // The data of all the entries
+  UINT32 UserBufferLength;
+  UINT32 Flags;            // DEBUGGER_GUEST_MEMORY_*
+  UINT32 ProcessId;        // The address space of the virtual addresses (zero
+                           // means Cr3)
+  UINT32 CountOfEntries;
+  UINT64 Cr3;              // The address space if ProcessId is zero (zero
+                           // means the system process)
+  UINT64 TransferredLength; // Filled by the driver
+  UINT32 Status;            // NTSTATUS of the request (filled by the driver)
+  UINT32 Reserved;
+
+} DEBUGGER_GUEST_MEMORY_REQUEST, *PDEBUGGER_GUEST_MEMORY_REQUEST;
+
+/**
+ * @brief Each range of a guest memory request
+ * @details The copy of a range stops at its first page that is not present
+ *
+ */
+typedef struct _DEBUGGER_GUEST_MEMORY_ENTRY {
+  UINT64 Address;           // Guest virtual or physical address
+  UINT32 Length;
+  UINT32 BufferOffset;      // Offset of the data in the user buffer
+  UINT32 TransferredLength; // Filled by the driver
+  UINT32 Reserved;
+
+} DEBUGGER_GUEST_MEMORY_ENTRY, *PDEBUGGER_GUEST_MEMORY_ENTRY;
+
 //////////////////////////////////////////////////
 //					IOCTLs                      //
 //////////////////////////////////////////////////
@@ -241,6 +1380,81 @@ typedef struct _DEBUGGER_EVENT {
 #define IOCTL_TERMINATE_VMX                                                    \
   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+#define IOCTL_MAP_LOG_BUFFERS                                                  \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_READ_LOG_BUFFERS_BATCH                                           \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_LOG_BUFFERS_STATISTICS                                     \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SET_LOG_BUFFERS_POLICY                                           \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_VMEXIT_STATISTICS                                          \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_CONTROL_SAMPLING                                                 \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_READ_SAMPLES                                                     \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_DUMP_FLIGHT_RECORDER                                             \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80a, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_EPT_HOOK_BATCH                                                   \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_CONTROL_DIRTY_PAGE_TRACKING                                      \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_DIRTY_PAGES                                                \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80d, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_CONTROL_ACCESS_AGGREGATION                                       \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80e, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_ACCESS_AGGREGATION                                         \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80f, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_EVENT_STATISTICS                                           \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_POOL_STATISTICS                                            \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x811, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SET_SYSCALL_HOOK_FILTER                                          \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x812, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_CONTROL_SYSCALL_TRACE                                            \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_SYSCALL_SERVICE_TABLES                                     \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x814, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_QUERY_STARTUP_TIMING                                             \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SUSPEND_VMX                                                      \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_PERFORM_BENCHMARK                                                \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x817, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_REGISTER_EVENT_BATCH                                             \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_GUEST_MEMORY_ACCESS                                              \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_LOG_SUBSCRIBE                                                    \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81a, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_READ_SUBSCRIBED_LOG_BUFFERS                                      \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 #define IOCTL_DEBUGGER_EPT_SYSCALL_HOOK_EFER                                   \
   CTL_CODE(FILE_DEVICE_UNKNOWN, DEBUGGER_EPT_SYSCALL_HOOK_EFER,                \
            METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -15,10 +15,82 @@
 
 using namespace std;
 
+// These structures are copied from Process Hacker source code (ntldr.h)
+
+typedef struct _RTL_PROCESS_MODULE_INFORMATION
+{
+	HANDLE Section;
+	PVOID MappedBase;
+	PVOID ImageBase;
+	ULONG ImageSize;
+	ULONG Flags;
+	USHORT LoadOrderIndex;
+	USHORT InitOrderIndex;
+	USHORT LoadCount;
+	USHORT OffsetToFileName;
+	UCHAR FullPathName[256];
+} RTL_PROCESS_MODULE_INFORMATION, * PRTL_PROCESS_MODULE_INFORMATION;
+
+typedef struct _RTL_PROCESS_MODULES
+{
+	ULONG NumberOfModules;
+	RTL_PROCESS_MODULE_INFORMATION Modules[1];
+} RTL_PROCESS_MODULES, * PRTL_PROCESS_MODULES;
+
+/**
+ * @brief A kernel module in the table of the modules (lm.cpp)
+ *
+ */
+typedef struct _LM_MODULE
+{
+	UINT64 Base;
+	ULONG Size;
+	string Name;
+	string Path;
+	BOOLEAN IsSymbolLoaded;    // The module is loaded in the symbol handler
+	BOOLEAN IsSymbolLoadTried; // The module is not loaded again if it fails
+
+} LM_MODULE, * PLM_MODULE;
+
 int ReadCpuDetails();
 std::string ReadVendorString();
 void ShowMessages(const char* Fmt, ...);
 int CommandLm(vector<string> SplittedCommand);
+void CommandLogBuffers(vector<string> SplittedCommand);
+void CommandTraceFile(vector<string> SplittedCommand);
+void CommandExitStats(vector<string> SplittedCommand);
+void CommandSampling(vector<string> SplittedCommand);
+void CommandFlightRecorder(vector<string> SplittedCommand);
+void CommandDirtyPages(vector<string> SplittedCommand);
+void CommandAccesses(vector<string> SplittedCommand);
+void CommandEventStats(vector<string> SplittedCommand);
+void CommandPools(vector<string> SplittedCommand);
+void CommandSyscallFilter(vector<string> SplittedCommand);
+void CommandSyscallTrace(vector<string> SplittedCommand);
+void ShowSyscallTraceRecord(PSYSCALL_TRACE_RECORD Record);
+const char* SyscallTraceGetName(UINT32 SyscallNumber);
+void CommandSsdt(vector<string> SplittedCommand);
+void CommandStartup(vector<string> SplittedCommand);
+void CommandSuspend(vector<string> SplittedCommand);
+void CommandResume(vector<string> SplittedCommand);
+void CommandScript(vector<string> SplittedCommand);
+void CommandListen(vector<string> SplittedCommand);
+void CommandDump(vector<string> SplittedCommand);
+void CommandSubscribe(vector<string> SplittedCommand);
+BOOLEAN ScriptParseHexValue(const string& Token, UINT64& Value);
+void ShowKernelMessage(PLOG_BATCH_PACKET_HEADER PacketHeader, char* Buffer);
+BOOL DeviceIoControlSynchronous(HANDLE Device, DWORD IoControlCode, LPVOID InBuffer, DWORD InBufferSize,
+	LPVOID OutBuffer, DWORD OutBufferSize, LPDWORD BytesReturned);
+void BatchCallbackSetContext(UINT32 OperationCode, UINT64 Tag, UINT64 TimeStampCounter);
+BOOLEAN BatchCallbackSaveMessage(const char* Message, UINT32 Length);
+BOOLEAN BatchCallbackSaveRecord(UINT32 OperationCode, UINT64 Tag, UINT64 TimeStampCounter, const char* Body, UINT32 Length);
+bool IsNumber(const string& str);
+const vector<string> Split(const string& s, const char& c);
+std::string TimeStampCounterToString(UINT64 TimeStampCounter);
+PRTL_PROCESS_MODULES LmQueryKernelModules();
+BOOLEAN LmRefreshModules();
+BOOLEAN LmFindModule(UINT64 Address, PLM_MODULE Module);
+string LmResolveAddress(UINT64 Address);
 
 
 // Exports
@@ -30,6 +102,8 @@ extern "C"
     __declspec (dllexport) int __cdecl  HyperdbgInstallDriver();
     __declspec (dllexport) int __cdecl  HyperdbgUninstallDriver();
     __declspec (dllexport) void __stdcall HyperdbgSetTextMessageCallback(Callback handler);
+    __declspec (dllexport) void __stdcall HyperdbgSetBatchMessageCallback(BatchCallback handler, UINT32 Flags);
+    __declspec (dllexport) int __cdecl  HyperdbgInterpreter(const char* Command);
 
 }
 
@@ -0,0 +1,212 @@
+/**
+ * @file accesses.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Control the aggregation of the accesses to the hooked pages
+ * @details
+ * @version 0.1
+ * @date 2020-05-15
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandAccessesHelp() {
+	ShowMessages(".accesses : counts the accesses to the hooked pages by (address, guest RIP, access type) instead of logging each of them.\n\n");
+	ShowMessages("syntax : \t.accesses [start [flush period (decimal milliseconds)]] [stop] [report [count (decimal value)]] [diff [count (decimal value)]]\n");
+	ShowMessages("\t\te.g : .accesses start\n");
+	ShowMessages("\t\t\tdescription : clears the counters and starts counting, the counters are only shown on demand\n");
+	ShowMessages("\t\te.g : .accesses start 1000\n");
+	ShowMessages("\t\t\tdescription : also logs the summary of the counters of each core every 1000 milliseconds (and clears them)\n");
+	ShowMessages("\t\te.g : .accesses report 10\n");
+	ShowMessages("\t\t\tdescription : shows the 10 most frequent accessors of each page\n");
+	ShowMessages("\t\te.g : .accesses diff\n");
+	ShowMessages("\t\t\tdescription : shows the accessors and clears the counters\n");
+	ShowMessages("\t\te.g : .accesses stop\n");
+	ShowMessages("\t\t\tdescription : stops counting, the counters can still be reported\n");
+}
+
+/**
+ * @brief Show the accessors of each page
+ *
+ * @param Reset Clear the counters after reading them
+ * @param TopCount Count of the accessors to show for each page
+ * @return VOID
+ */
+void AccessesShowReport(BOOLEAN Reset, UINT32 TopCount) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	ACCESS_AGGREGATION_QUERY_REQUEST Request = { 0 };
+	PACCESS_AGGREGATION_RESULT Result;
+	PACCESS_AGGREGATION_ENTRY Entries;
+	SYSTEM_INFO SystemInfo;
+	SIZE_T BufferSize;
+	map<pair<UINT64, pair<UINT64, UINT32>>, UINT64> Counters;
+	map<UINT64, vector<pair<UINT64, pair<UINT64, pair<UINT64, UINT32>>>>> Pages;
+	const char* AccessNames[] = { "read", "write", "execute" };
+
+	GetSystemInfo(&SystemInfo);
+
+	BufferSize = sizeof(ACCESS_AGGREGATION_RESULT) + (SIZE_T)SystemInfo.dwNumberOfProcessors * ACCESS_AGGREGATION_ENTRIES_PER_CORE * sizeof(ACCESS_AGGREGATION_ENTRY);
+
+	Result = (PACCESS_AGGREGATION_RESULT)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the access counters\n");
+		return;
+	}
+
+	Request.Reset = Reset;
+
+	Status = DeviceIoControlSynchronous(
+		Handle,										// Handle to device
+		IOCTL_QUERY_ACCESS_AGGREGATION,				// IO Control code
+		&Request,									// Input Buffer to driver.
+		sizeof(ACCESS_AGGREGATION_QUERY_REQUEST),	// Length of input buffer in bytes.
+		Result,										// Output Buffer from driver.
+		(DWORD)BufferSize,							// Length of output buffer in bytes.
+		&ReturnedLength 							// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(ACCESS_AGGREGATION_RESULT)) {
+		ShowMessages("Ioctl failed with code 0x%x (probably the aggregation is never started)\n", GetLastError());
+		free(Result);
+		return;
+	}
+
+	Entries = (PACCESS_AGGREGATION_ENTRY)((UINT64)Result + sizeof(ACCESS_AGGREGATION_RESULT));
+
+	//
+	// Merge the counters of the cores, then group them by the page
+	//
+	for (UINT32 i = 0; i < Result->CountOfEntries; i++)
+	{
+		Counters[make_pair(Entries[i].Address, make_pair(Entries[i].GuestRip, Entries[i].AccessType))] += Entries[i].Count;
+	}
+
+	for (auto& Counter : Counters)
+	{
+		Pages[Counter.first.first & ~0xfffULL].push_back(make_pair(Counter.second, Counter.first));
+	}
+
+	ShowMessages("%d distinct accesses", Counters.size());
+
+	if (Result->CountOfMissedEntries != 0)
+	{
+		ShowMessages(", %d counters are missed", Result->CountOfMissedEntries);
+	}
+
+	if (Result->FlushedAccesses != 0)
+	{
+		ShowMessages(", %llu accesses are logged as summaries", Result->FlushedAccesses);
+	}
+
+	ShowMessages("\n");
+
+	for (auto& Page : Pages)
+	{
+		UINT64 Total = 0;
+
+		for (auto& Accessor : Page.second)
+		{
+			Total += Accessor.first;
+		}
+
+		sort(Page.second.begin(), Page.second.end(), greater<pair<UINT64, pair<UINT64, pair<UINT64, UINT32>>>>());
+
+		ShowMessages("\npage %016llx : %llu accesses\n", Page.first, Total);
+		ShowMessages("%-20s%-10s%-10s%s\n", "guest rip", "offset", "type", "count");
+
+		for (size_t j = 0; j < Page.second.size() && j < TopCount; j++)
+		{
+			ShowMessages("%016llx    %-10llx%-10s%llu\n",
+				Page.second[j].second.second.first,
+				Page.second[j].second.first & 0xfff,
+				AccessNames[Page.second[j].second.second.second],
+				Page.second[j].first);
+		}
+
+		if (Page.second.size() > TopCount)
+		{
+			ShowMessages("... (%d more)\n", Page.second.size() - TopCount);
+		}
+	}
+
+	free(Result);
+}
+
+void CommandAccesses(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	ACCESS_AGGREGATION_CONTROL_REQUEST Request = { 0 };
+	UINT32 TopCount = 10;
+
+	if (SplittedCommand.size() < 2 || SplittedCommand.size() > 3)
+	{
+		ShowMessages("incorrect use of '.accesses'\n\n");
+		CommandAccessesHelp();
+		return;
+	}
+
+	if (SplittedCommand.size() == 3 && SplittedCommand.at(2).find_first_not_of("0123456789") != string::npos)
+	{
+		ShowMessages("incorrect use of '.accesses'\n\n");
+		CommandAccessesHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	if (!SplittedCommand.at(1).compare("report") || !SplittedCommand.at(1).compare("diff")) {
+
+		if (SplittedCommand.size() == 3) {
+			TopCount = stoul(SplittedCommand.at(2), nullptr, 10);
+		}
+
+		AccessesShowReport(!SplittedCommand.at(1).compare("diff"), TopCount);
+		return;
+	}
+	else if (!SplittedCommand.at(1).compare("start")) {
+		Request.Start = TRUE;
+
+		if (SplittedCommand.size() == 3) {
+			Request.FlushPeriod = stoul(SplittedCommand.at(2), nullptr, 10);
+		}
+	}
+	else if (!SplittedCommand.at(1).compare("stop") && SplittedCommand.size() == 2) {
+		Request.Start = FALSE;
+	}
+	else {
+		ShowMessages("incorrect use of '.accesses'\n\n");
+		CommandAccessesHelp();
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,										// Handle to device
+		IOCTL_CONTROL_ACCESS_AGGREGATION,			// IO Control code
+		&Request,									// Input Buffer to driver.
+		sizeof(ACCESS_AGGREGATION_CONTROL_REQUEST),	// Length of input buffer in bytes.
+		NULL,										// Output Buffer from driver.
+		0,											// Length of output buffer in bytes.
+		&ReturnedLength 							// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	ShowMessages(Request.Start ? "access aggregation is started\n" : "access aggregation is stopped\n");
+}
@@ -0,0 +1,332 @@
+/**
+ * @file batchcallback.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Deliver the messages to the batch callback (HyperdbgSetBatchMessageCallback)
+ * @details The messages are coalesced in a batch, and the batch is delivered
+ * when it's full or after BATCH_CALLBACK_FLUSH_INTERVAL, so an application
+ * (e.g. the GUI) is called once for many messages instead of each line
+ * @version 0.1
+ * @date 2020-05-26
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+/* Maximum count of the entries and the bytes of the data of each batch */
+#define BATCH_CALLBACK_MAXIMUM_ENTRIES 4096
+#define BATCH_CALLBACK_PAYLOAD_SIZE 0x40000
+
+/* A batch that is not full is delivered after this time (milliseconds) */
+#define BATCH_CALLBACK_FLUSH_INTERVAL 50
+
+/**
+ * @brief A batch of the entries, Data of the entries is in the Payload
+ *
+ */
+typedef struct _BATCH_CALLBACK_BUFFER {
+	UINT32 CountOfEntries;
+	UINT32 PayloadLength;
+	HYPERDBG_MESSAGE_ENTRY Entries[BATCH_CALLBACK_MAXIMUM_ENTRIES];
+	char Payload[BATCH_CALLBACK_PAYLOAD_SIZE];
+
+} BATCH_CALLBACK_BUFFER, * PBATCH_CALLBACK_BUFFER;
+
+/**
+ * @brief The record that its messages are being shown (in each thread)
+ *
+ */
+typedef struct _BATCH_CALLBACK_CONTEXT {
+	UINT32 OperationCode;
+	UINT64 Tag;
+	UINT64 TimeStampCounter;
+
+} BATCH_CALLBACK_CONTEXT, * PBATCH_CALLBACK_CONTEXT;
+
+BatchCallback BatchHandler = NULL;
+UINT32 BatchHandlerFlags;
+SRWLOCK BatchCallbackFillLock = SRWLOCK_INIT;		// The threads of the messages fill a batch
+SRWLOCK BatchCallbackDeliveryLock = SRWLOCK_INIT;	// Only one batch is delivered at a time (in order)
+PBATCH_CALLBACK_BUFFER BatchCallbackBuffers[2];
+UINT32 BatchCallbackFillIndex;						// The batch that is being filled (the other one might be delivered)
+HANDLE BatchCallbackThread;							// Delivers the batches that are not full
+HANDLE BatchCallbackStopEvent;
+
+thread_local BATCH_CALLBACK_CONTEXT BatchCallbackContext;
+thread_local BOOLEAN BatchCallbackIsDelivering;	// The callback is called in this thread (it might show messages too)
+
+/**
+ * @brief Set the record that the next messages of this thread are made for
+ *
+ * @param OperationCode
+ * @param Tag
+ * @param TimeStampCounter
+ * @return VOID
+ */
+void BatchCallbackSetContext(UINT32 OperationCode, UINT64 Tag, UINT64 TimeStampCounter) {
+
+	BatchCallbackContext.OperationCode = OperationCode;
+	BatchCallbackContext.Tag = Tag;
+	BatchCallbackContext.TimeStampCounter = TimeStampCounter;
+}
+
+/**
+ * @brief Deliver the batch that is being filled
+ * @details It's not delivered in the callback itself, the next flush delivers it
+ *
+ * @return VOID
+ */
+void BatchCallbackFlush() {
+
+	if (BatchCallbackIsDelivering)
+	{
+		return;
+	}
+
+	AcquireSRWLockExclusive(&BatchCallbackDeliveryLock);
+
+	//
+	// The other batch is filled while this one is delivered
+	//
+	AcquireSRWLockExclusive(&BatchCallbackFillLock);
+
+	PBATCH_CALLBACK_BUFFER Buffer = BatchCallbackBuffers[BatchCallbackFillIndex];
+	BatchCallbackFillIndex ^= 1;
+
+	ReleaseSRWLockExclusive(&BatchCallbackFillLock);
+
+	if (Buffer != NULL && Buffer->CountOfEntries != 0)
+	{
+		if (BatchHandler != NULL)
+		{
+			BatchCallbackIsDelivering = TRUE;
+			BatchHandler(Buffer->Entries, Buffer->CountOfEntries);
+			BatchCallbackIsDelivering = FALSE;
+		}
+
+		Buffer->CountOfEntries = 0;
+		Buffer->PayloadLength = 0;
+	}
+
+	ReleaseSRWLockExclusive(&BatchCallbackDeliveryLock);
+}
+
+/**
+ * @brief Add an entry to the batch that is being filled
+ * @details A text is appended to the previous entry if it's the text of the
+ * same record, if the batch is full it's delivered first
+ *
+ * @param OperationCode
+ * @param Flags HYPERDBG_MESSAGE_ENTRY_*
+ * @param Tag
+ * @param TimeStampCounter
+ * @param Data
+ * @param Length Length of the data (without the null of a text)
+ * @return BOOLEAN Whether the message is saved for the batch callback or not
+ */
+BOOLEAN BatchCallbackSaveEntry(UINT32 OperationCode, UINT32 Flags, UINT64 Tag, UINT64 TimeStampCounter, const char* Data, UINT32 Length) {
+
+	PHYPERDBG_MESSAGE_ENTRY Entry;
+
+	if (BatchHandler == NULL)
+	{
+		return FALSE;
+	}
+
+	if (Length + 1 > BATCH_CALLBACK_PAYLOAD_SIZE)
+	{
+		Length = BATCH_CALLBACK_PAYLOAD_SIZE - 1;
+	}
+
+	AcquireSRWLockExclusive(&BatchCallbackFillLock);
+
+	PBATCH_CALLBACK_BUFFER Buffer = BatchCallbackBuffers[BatchCallbackFillIndex];
+
+	if (Buffer->CountOfEntries != 0 && !(Flags & HYPERDBG_MESSAGE_ENTRY_BINARY))
+	{
+		Entry = &Buffer->Entries[Buffer->CountOfEntries - 1];
+
+		if (!(Entry->Flags & HYPERDBG_MESSAGE_ENTRY_BINARY) && Entry->OperationCode == OperationCode && Entry->Tag == Tag &&
+			Entry->TimeStampCounter == TimeStampCounter && Buffer->PayloadLength + Length <= BATCH_CALLBACK_PAYLOAD_SIZE)
+		{
+			//
+			// The text of the previous entry is at the end of the payload, its null is replaced
+			//
+			memcpy(Buffer->Payload + Buffer->PayloadLength - 1, Data, Length);
+			Buffer->PayloadLength += Length;
+			Buffer->Payload[Buffer->PayloadLength - 1] = '\0';
+			Entry->Length += Length;
+
+			ReleaseSRWLockExclusive(&BatchCallbackFillLock);
+			return TRUE;
+		}
+	}
+
+	if (Buffer->CountOfEntries == BATCH_CALLBACK_MAXIMUM_ENTRIES || Buffer->PayloadLength + Length + 1 > BATCH_CALLBACK_PAYLOAD_SIZE)
+	{
+		ReleaseSRWLockExclusive(&BatchCallbackFillLock);
+
+		//
+		// The messages that are shown by the callback itself are dropped
+		// if the batch is full (it can't be delivered in the callback)
+		//
+		if (BatchCallbackIsDelivering)
+		{
+			return TRUE;
+		}
+
+		BatchCallbackFlush();
+
+		AcquireSRWLockExclusive(&BatchCallbackFillLock);
+		Buffer = BatchCallbackBuffers[BatchCallbackFillIndex];
+
+		//
+		// Other threads might fill the batch again in the meantime
+		//
+		if (Buffer->CountOfEntries == BATCH_CALLBACK_MAXIMUM_ENTRIES || Buffer->PayloadLength + Length + 1 > BATCH_CALLBACK_PAYLOAD_SIZE)
+		{
+			ReleaseSRWLockExclusive(&BatchCallbackFillLock);
+			return TRUE;
+		}
+	}
+
+	Entry = &Buffer->Entries[Buffer->CountOfEntries++];
+	Entry->OperationCode = OperationCode;
+	Entry->Flags = Flags;
+	Entry->Tag = Tag;
+	Entry->TimeStampCounter = TimeStampCounter;
+	Entry->Length = Length;
+	Entry->Reserved = 0;
+	Entry->Data = Buffer->Payload + Buffer->PayloadLength;
+
+	memcpy(Buffer->Payload + Buffer->PayloadLength, Data, Length);
+	Buffer->PayloadLength += Length;
+	Buffer->Payload[Buffer->PayloadLength++] = '\0';
+
+	ReleaseSRWLockExclusive(&BatchCallbackFillLock);
+
+	return TRUE;
+}
+
+/**
+ * @brief Save a formatted message for the batch callback (if there is any)
+ * @details It's called by ShowMessages
+ *
+ * @param Message
+ * @param Length
+ * @return BOOLEAN Whether the message is saved (it shouldn't be shown) or not
+ */
+BOOLEAN BatchCallbackSaveMessage(const char* Message, UINT32 Length) {
+
+	return BatchCallbackSaveEntry(BatchCallbackContext.OperationCode, 0, BatchCallbackContext.Tag,
+		BatchCallbackContext.TimeStampCounter, Message, Length);
+}
+
+/**
+ * @brief Save a kernel record for the batch callback as it is
+ *
+ * @param OperationCode
+ * @param Tag
+ * @param TimeStampCounter
+ * @param Body Body of the record
+ * @param Length
+ * @return BOOLEAN Whether the record is saved (its text shouldn't be made) or not
+ */
+BOOLEAN BatchCallbackSaveRecord(UINT32 OperationCode, UINT64 Tag, UINT64 TimeStampCounter, const char* Body, UINT32 Length) {
+
+	if (!(BatchHandlerFlags & HYPERDBG_BATCH_CALLBACK_RAW_RECORDS))
+	{
+		return FALSE;
+	}
+
+	return BatchCallbackSaveEntry(OperationCode, HYPERDBG_MESSAGE_ENTRY_BINARY, Tag, TimeStampCounter, Body, Length);
+}
+
+/**
+ * @brief Deliver the batches that are not full
+ *
+ * @param Data
+ * @return DWORD
+ */
+DWORD WINAPI BatchCallbackFlushThread(void* Data) {
+
+	while (WaitForSingleObject(BatchCallbackStopEvent, BATCH_CALLBACK_FLUSH_INTERVAL) == WAIT_TIMEOUT)
+	{
+		BatchCallbackFlush();
+	}
+
+	//
+	// The messages that are not delivered yet
+	//
+	BatchCallbackFlush();
+
+	return 0;
+}
+
+/**
+ * @brief Set the function callback that will be called with the batches of the messages
+ * @details The text callback is not called while there is a batch callback, it
+ * shouldn't be called in the callback itself
+ *
+ * @param handler Function that handles the batches (NULL to remove it)
+ * @param Flags HYPERDBG_BATCH_CALLBACK_*
+ */
+void __stdcall HyperdbgSetBatchMessageCallback(BatchCallback handler, UINT32 Flags) {
+
+	if (BatchCallbackThread != NULL)
+	{
+		//
+		// Deliver the messages of the previous callback
+		//
+		SetEvent(BatchCallbackStopEvent);
+		WaitForSingleObject(BatchCallbackThread, INFINITE);
+		CloseHandle(BatchCallbackThread);
+		CloseHandle(BatchCallbackStopEvent);
+		BatchCallbackThread = NULL;
+		BatchCallbackStopEvent = NULL;
+	}
+
+	BatchHandler = NULL;
+
+	if (handler == NULL)
+	{
+		return;
+	}
+
+	for (UINT32 i = 0; i < 2; i++)
+	{
+		if (BatchCallbackBuffers[i] == NULL)
+		{
+			BatchCallbackBuffers[i] = (PBATCH_CALLBACK_BUFFER)calloc(1, sizeof(BATCH_CALLBACK_BUFFER));
+
+			if (BatchCallbackBuffers[i] == NULL)
+			{
+				ShowMessages("insufficient memory for the batches of the messages\n");
+				return;
+			}
+		}
+	}
+
+	BatchCallbackStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (BatchCallbackStopEvent == NULL)
+	{
+		ShowMessages("unable to create the event of the batches (%x)\n", GetLastError());
+		return;
+	}
+
+	BatchCallbackThread = CreateThread(NULL, 0, BatchCallbackFlushThread, NULL, 0, NULL);
+
+	if (BatchCallbackThread == NULL)
+	{
+		ShowMessages("unable to create the thread of the batches (%x)\n", GetLastError());
+		CloseHandle(BatchCallbackStopEvent);
+		BatchCallbackStopEvent = NULL;
+		return;
+	}
+
+	BatchHandlerFlags = Flags;
+	BatchHandler = handler;
+}
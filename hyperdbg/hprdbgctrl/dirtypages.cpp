@@ -0,0 +1,248 @@
+/**
+ * @file dirtypages.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Control the dirty page tracking and show the dirty physical pages
+ * @details
+ * @version 0.1
+ * @date 2020-05-14
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandDirtyPagesHelp() {
+	ShowMessages(".dirtypages : tracks the physical pages that are written by all the cores using the page-modification logging.\n\n");
+	ShowMessages("syntax : \t.dirtypages [start] [stop] [show [count (decimal value)]] [diff [count (decimal value)]] [save [file path]]\n");
+	ShowMessages("\t\te.g : .dirtypages start\n");
+	ShowMessages("\t\t\tdescription : clears the dirty pages and starts tracking\n");
+	ShowMessages("\t\te.g : .dirtypages show 20\n");
+	ShowMessages("\t\t\tdescription : shows the first 20 ranges of the dirty pages\n");
+	ShowMessages("\t\te.g : .dirtypages diff\n");
+	ShowMessages("\t\t\tdescription : shows the dirty pages and clears them, so the next diff only shows the newly dirtied pages\n");
+	ShowMessages("\t\te.g : .dirtypages save c:\\dirty.bin\n");
+	ShowMessages("\t\t\tdescription : saves the bitmap of the dirty pages (bit i of byte j is the page j * 8 + i)\n");
+	ShowMessages("\t\te.g : .dirtypages stop\n");
+	ShowMessages("\t\t\tdescription : stops tracking\n");
+}
+
+/**
+ * @brief Read the bitmap of the dirty pages from the driver
+ *
+ * @param Reset Clear the bitmap after reading it
+ * @return PDIRTY_PAGE_BITMAP The header and the bitmap (should be freed), or NULL
+ */
+PDIRTY_PAGE_BITMAP DirtyPagesQuery(BOOLEAN Reset) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	DIRTY_PAGE_QUERY_REQUEST Request = { 0 };
+	DIRTY_PAGE_BITMAP Header = { 0 };
+	PDIRTY_PAGE_BITMAP Result;
+	SIZE_T BufferSize;
+
+	//
+	// Query the size of the bitmap first
+	//
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_DIRTY_PAGES,			// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(DIRTY_PAGE_QUERY_REQUEST),	// Length of input buffer in bytes.
+		&Header,							// Output Buffer from driver.
+		sizeof(DIRTY_PAGE_BITMAP),			// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(DIRTY_PAGE_BITMAP)) {
+		ShowMessages("Ioctl failed with code 0x%x (probably the tracking is not started)\n", GetLastError());
+		return NULL;
+	}
+
+	BufferSize = sizeof(DIRTY_PAGE_BITMAP) + ((Header.CountOfPages + 63) / 64) * sizeof(UINT64);
+
+	Result = (PDIRTY_PAGE_BITMAP)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the dirty page bitmap\n");
+		return NULL;
+	}
+
+	Request.Reset = Reset;
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_DIRTY_PAGES,			// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(DIRTY_PAGE_QUERY_REQUEST),	// Length of input buffer in bytes.
+		Result,								// Output Buffer from driver.
+		(DWORD)BufferSize,					// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(DIRTY_PAGE_BITMAP) || !Result->IsBitmapIncluded) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Result);
+		return NULL;
+	}
+
+	return Result;
+}
+
+/**
+ * @brief Show the ranges of the contiguous dirty pages
+ *
+ * @param Result The header and the bitmap
+ * @param MaximumRanges Count of the ranges to show
+ * @return VOID
+ */
+void DirtyPagesShowRanges(PDIRTY_PAGE_BITMAP Result, UINT32 MaximumRanges) {
+
+	UINT64* Bitmap = (UINT64*)((UINT64)Result + sizeof(DIRTY_PAGE_BITMAP));
+	UINT32 CountOfRanges = 0;
+	UINT64 Page = 0;
+
+	ShowMessages("%llu dirty pages (%llu KB) of %llu pages\n\n", Result->CountOfDirtyPages, Result->CountOfDirtyPages * 4, Result->CountOfPages);
+
+	while (Page < Result->CountOfPages)
+	{
+		UINT64 First;
+
+		//
+		// Skip the clean words
+		//
+		if ((Page % 64) == 0 && Bitmap[Page / 64] == 0) {
+			Page += 64;
+			continue;
+		}
+
+		if (!(Bitmap[Page / 64] & (1ULL << (Page % 64)))) {
+			Page++;
+			continue;
+		}
+
+		First = Page;
+
+		while (Page < Result->CountOfPages && (Bitmap[Page / 64] & (1ULL << (Page % 64)))) {
+			Page++;
+		}
+
+		if (CountOfRanges++ == MaximumRanges) {
+			ShowMessages("...\n");
+			break;
+		}
+
+		ShowMessages("%016llx - %016llx (%llu pages)\n", First * 0x1000, Page * 0x1000 - 1, Page - First);
+	}
+}
+
+void CommandDirtyPages(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	DIRTY_PAGE_TRACKING_REQUEST Request = { 0 };
+	PDIRTY_PAGE_BITMAP Result;
+	UINT32 MaximumRanges = 32;
+
+	if (SplittedCommand.size() < 2 || SplittedCommand.size() > 3)
+	{
+		ShowMessages("incorrect use of '.dirtypages'\n\n");
+		CommandDirtyPagesHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	if (!SplittedCommand.at(1).compare("show") || !SplittedCommand.at(1).compare("diff")) {
+
+		if (SplittedCommand.size() == 3) {
+
+			if (SplittedCommand.at(2).find_first_not_of("0123456789") != string::npos) {
+				ShowMessages("incorrect use of '.dirtypages'\n\n");
+				CommandDirtyPagesHelp();
+				return;
+			}
+
+			MaximumRanges = stoul(SplittedCommand.at(2), nullptr, 10);
+		}
+
+		Result = DirtyPagesQuery(!SplittedCommand.at(1).compare("diff"));
+
+		if (Result) {
+			DirtyPagesShowRanges(Result, MaximumRanges);
+			free(Result);
+		}
+		return;
+	}
+	else if (!SplittedCommand.at(1).compare("save") && SplittedCommand.size() == 3) {
+
+		Result = DirtyPagesQuery(FALSE);
+
+		if (Result) {
+
+			HANDLE File = CreateFileA(SplittedCommand.at(2).c_str(),
+				GENERIC_WRITE,
+				FILE_SHARE_READ,
+				NULL,
+				CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL,
+				NULL);
+
+			if (File == INVALID_HANDLE_VALUE) {
+				ShowMessages("unable to create '%s' (error code : 0x%x)\n", SplittedCommand.at(2).c_str(), GetLastError());
+			}
+			else {
+				DWORD WrittenLength = 0;
+
+				if (WriteFile(File, (PVOID)((UINT64)Result + sizeof(DIRTY_PAGE_BITMAP)), (DWORD)((Result->CountOfPages + 7) / 8), &WrittenLength, NULL)) {
+					ShowMessages("%llu dirty pages are saved\n", Result->CountOfDirtyPages);
+				}
+				else {
+					ShowMessages("unable to write to '%s' (error code : 0x%x)\n", SplittedCommand.at(2).c_str(), GetLastError());
+				}
+
+				CloseHandle(File);
+			}
+
+			free(Result);
+		}
+		return;
+	}
+	else if (!SplittedCommand.at(1).compare("start") && SplittedCommand.size() == 2) {
+		Request.Start = TRUE;
+	}
+	else if (!SplittedCommand.at(1).compare("stop") && SplittedCommand.size() == 2) {
+		Request.Start = FALSE;
+	}
+	else {
+		ShowMessages("incorrect use of '.dirtypages'\n\n");
+		CommandDirtyPagesHelp();
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,									// Handle to device
+		IOCTL_CONTROL_DIRTY_PAGE_TRACKING,		// IO Control code
+		&Request,								// Input Buffer to driver.
+		sizeof(DIRTY_PAGE_TRACKING_REQUEST),	// Length of input buffer in bytes.
+		NULL,									// Output Buffer from driver.
+		0,										// Length of output buffer in bytes.
+		&ReturnedLength 						// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	ShowMessages(Request.Start ? "dirty page tracking is started\n" : "dirty page tracking is stopped\n");
+}
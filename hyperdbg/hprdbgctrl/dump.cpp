@@ -0,0 +1,198 @@
+/**
+ * @file dump.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Dump a range of the guest memory to a file (IOCTL_GUEST_MEMORY_ACCESS)
+ * @details Each request reads DUMP_CHUNK_SIZE bytes directly to the user
+ * buffer, the range is split into page entries so the pages that are not
+ * present don't stop the other pages of the chunk
+ * @version 0.1
+ * @date 2020-05-27
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+#define DUMP_PAGE_SIZE 0x1000
+
+/* Size of the data of each request (DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES pages) */
+#define DUMP_CHUNK_SIZE (DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES * DUMP_PAGE_SIZE)
+
+/* NTSTATUS of a request that some of its pages are not present */
+#define DUMP_STATUS_PARTIAL_COPY 0x8000000d
+
+void CommandDumpHelp() {
+	ShowMessages(".dump : saves a range of the memory of the guest to a file.\n\n");
+	ShowMessages("syntax : \t.dump [address (hex value)] [length (hex value)] [file path] [physical] [pid (hex value)]\n");
+	ShowMessages("\t\te.g : .dump fffff80126551000 100000 c:\\dumps\\nt.bin\n");
+	ShowMessages("\t\t\tdescription : saves 1 MB of the virtual memory of the system process\n");
+	ShowMessages("\t\te.g : .dump 1000 4000000 c:\\dumps\\ram.bin physical\n");
+	ShowMessages("\t\t\tdescription : saves 64 MB of the physical memory\n");
+	ShowMessages("\t\te.g : .dump 7ff6a1230000 2000 c:\\dumps\\image.bin pid 1f4\n");
+	ShowMessages("\t\t\tdescription : saves the memory of the process 0x1f4\n\n");
+	ShowMessages("the pages that are not present (or not ram) are saved as zeros.\n");
+}
+
+void CommandDump(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	UINT64 Address;
+	UINT64 Length;
+	UINT64 Value;
+	UINT32 Flags = 0;
+	UINT32 ProcessId = 0;
+	UINT64 TotalTransferred = 0;
+	UINT64 Offset;
+	HANDLE File;
+	DWORD WrittenLength;
+	PDEBUGGER_GUEST_MEMORY_REQUEST Request;
+	PDEBUGGER_GUEST_MEMORY_ENTRY Entries;
+	PBYTE Buffer;
+	SIZE_T RequestSize = sizeof(DEBUGGER_GUEST_MEMORY_REQUEST) + DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES * sizeof(DEBUGGER_GUEST_MEMORY_ENTRY);
+
+	if (SplittedCommand.size() < 4 ||
+		!ScriptParseHexValue(SplittedCommand.at(1), Address) ||
+		!ScriptParseHexValue(SplittedCommand.at(2), Length) || Length == 0) {
+		ShowMessages("incorrect use of '.dump'\n\n");
+		CommandDumpHelp();
+		return;
+	}
+
+	for (size_t i = 4; i < SplittedCommand.size(); i++)
+	{
+		if (!SplittedCommand.at(i).compare("physical")) {
+			Flags |= DEBUGGER_GUEST_MEMORY_PHYSICAL;
+		}
+		else if (!SplittedCommand.at(i).compare("pid") && i + 1 < SplittedCommand.size() &&
+			ScriptParseHexValue(SplittedCommand.at(i + 1), Value) && Value != 0 && Value <= MAXUINT32) {
+			ProcessId = (UINT32)Value;
+			i++;
+		}
+		else {
+			ShowMessages("incorrect use of '.dump'\n\n");
+			CommandDumpHelp();
+			return;
+		}
+	}
+
+	if ((Flags & DEBUGGER_GUEST_MEMORY_PHYSICAL) && ProcessId != 0) {
+		ShowMessages("a process can't be specified for the physical memory\n");
+		return;
+	}
+
+	if (Address + Length < Address) {
+		ShowMessages("the range is not valid\n");
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Request = (PDEBUGGER_GUEST_MEMORY_REQUEST)malloc(RequestSize);
+	Buffer = (PBYTE)VirtualAlloc(NULL, DUMP_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (!Request || !Buffer)
+	{
+		ShowMessages("Unable to allocate memory for the dump\n");
+		free(Request);
+		if (Buffer) {
+			VirtualFree(Buffer, 0, MEM_RELEASE);
+		}
+		return;
+	}
+
+	File = CreateFileA(SplittedCommand.at(3).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (File == INVALID_HANDLE_VALUE) {
+		ShowMessages("unable to create the file (%x)\n", GetLastError());
+		free(Request);
+		VirtualFree(Buffer, 0, MEM_RELEASE);
+		return;
+	}
+
+	Entries = (PDEBUGGER_GUEST_MEMORY_ENTRY)((PBYTE)Request + sizeof(DEBUGGER_GUEST_MEMORY_REQUEST));
+
+	for (Offset = 0; Offset < Length; ) {
+
+		UINT32 ChunkLength = (UINT32)min(Length - Offset, (UINT64)DUMP_CHUNK_SIZE);
+		UINT32 EntryOffset = 0;
+		UINT32 CountOfEntries = 0;
+
+		RtlZeroMemory(Request, RequestSize);
+
+		//
+		// Each entry is a page (the first and the last ones might be a part of a page)
+		//
+		while (EntryOffset < ChunkLength) {
+
+			UINT64 EntryAddress = Address + Offset + EntryOffset;
+			UINT32 EntryLength = (UINT32)min((UINT64)(ChunkLength - EntryOffset), DUMP_PAGE_SIZE - (EntryAddress & (DUMP_PAGE_SIZE - 1)));
+
+			Entries[CountOfEntries].Address = EntryAddress;
+			Entries[CountOfEntries].Length = EntryLength;
+			Entries[CountOfEntries].BufferOffset = EntryOffset;
+
+			EntryOffset += EntryLength;
+
+			if (++CountOfEntries == DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES) {
+				ChunkLength = EntryOffset;
+				break;
+			}
+		}
+
+		Request->UserBuffer = (UINT64)Buffer;
+		Request->UserBufferLength = ChunkLength;
+		Request->Flags = Flags;
+		Request->ProcessId = ProcessId;
+		Request->CountOfEntries = CountOfEntries;
+
+		//
+		// The pages that are not copied stay zero in the file
+		//
+		RtlZeroMemory(Buffer, ChunkLength);
+
+		Status = DeviceIoControlSynchronous(
+			Handle,								// Handle to device
+			IOCTL_GUEST_MEMORY_ACCESS,			// IO Control code
+			Request,							// Input Buffer to driver.
+			(DWORD)RequestSize,					// Length of input buffer in bytes.
+			Request,							// Output Buffer from driver.
+			(DWORD)RequestSize,					// Length of output buffer in bytes.
+			&ReturnedLength 					// Bytes placed in buffer.
+		);
+
+		if (!Status) {
+			ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+			break;
+		}
+
+		if (Request->Status != 0 && Request->Status != DUMP_STATUS_PARTIAL_COPY) {
+			ShowMessages("the memory is not read (status : 0x%x)\n", Request->Status);
+			break;
+		}
+
+		TotalTransferred += Request->TransferredLength;
+
+		if (!WriteFile(File, Buffer, ChunkLength, &WrittenLength, NULL) || WrittenLength != ChunkLength) {
+			ShowMessages("unable to write to the file (%x)\n", GetLastError());
+			break;
+		}
+
+		Offset += ChunkLength;
+	}
+
+	CloseHandle(File);
+	free(Request);
+	VirtualFree(Buffer, 0, MEM_RELEASE);
+
+	ShowMessages("0x%llx bytes are saved, 0x%llx bytes are read from the guest (0x%llx bytes are not present)\n",
+		Offset, TotalTransferred, Offset - TotalTransferred);
+}
@@ -0,0 +1,123 @@
+/**
+ * @file eventstats.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the hits and the cycles of the registered events
+ * @details
+ * @version 0.1
+ * @date 2020-05-16
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief Names of the event types (index is DEBUGGER_EVENT_TYPE_ENUM)
+ *
+ */
+const char* EventTypeNames[DEBUGGER_EVENT_TYPES_COUNT] = {
+	"hidden hook (rw)", "hidden hook (detour)", "hidden hook (cc)", "syscall hook", "rdmsr", "wrmsr", "in", "out", "#BP", "#DB"
+};
+
+void CommandEventStatsHelp() {
+	ShowMessages(".eventstats : shows the hits and the cycles of the conditions and the actions of each registered event (the busiest first).\n\n");
+	ShowMessages("syntax : \t.eventstats\n");
+	ShowMessages("\t\te.g : .eventstats\n");
+	ShowMessages("\t\t\tdescription : shows the counters of all the events (the counters of all the cores are added)\n");
+}
+
+void CommandEventStats(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	PDEBUGGER_EVENT_STATISTICS_RESULT Result;
+	PDEBUGGER_EVENT_STATISTICS_ENTRY Entries;
+	vector<PDEBUGGER_EVENT_STATISTICS_ENTRY> SortedEntries;
+	SIZE_T BufferSize = sizeof(DEBUGGER_EVENT_STATISTICS_RESULT) + 1024 * sizeof(DEBUGGER_EVENT_STATISTICS_ENTRY);
+
+	if (SplittedCommand.size() != 1)
+	{
+		ShowMessages("incorrect use of '.eventstats'\n\n");
+		CommandEventStatsHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Result = (PDEBUGGER_EVENT_STATISTICS_RESULT)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the statistics\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_EVENT_STATISTICS,		// IO Control code
+		NULL,								// Input Buffer to driver.
+		0,									// Length of input buffer in bytes.
+		Result,								// Output Buffer from driver.
+		(DWORD)BufferSize,					// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(DEBUGGER_EVENT_STATISTICS_RESULT)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Result);
+		return;
+	}
+
+	Entries = (PDEBUGGER_EVENT_STATISTICS_ENTRY)((UINT64)Result + sizeof(DEBUGGER_EVENT_STATISTICS_RESULT));
+
+	for (UINT32 i = 0; i < Result->CountOfEvents; i++)
+	{
+		SortedEntries.push_back(&Entries[i]);
+	}
+
+	sort(SortedEntries.begin(), SortedEntries.end(), [](PDEBUGGER_EVENT_STATISTICS_ENTRY A, PDEBUGGER_EVENT_STATISTICS_ENTRY B) {
+		return A->Statistics.ConditionCycles + A->Statistics.ActionCycles > B->Statistics.ConditionCycles + B->Statistics.ActionCycles;
+	});
+
+	ShowMessages("%d events", Result->CountOfEvents);
+
+	if (Result->CountOfMissedEvents != 0)
+	{
+		ShowMessages(", %d events are not shown", Result->CountOfMissedEvents);
+	}
+
+	ShowMessages("\n\n%-18s%-22s%-6s%-10s%-14s%-14s%-14s%-18s%s\n", "tag", "type", "core", "state", "hits", "rejected", "actions", "condition cycles", "action cycles");
+
+	for (auto Entry : SortedEntries)
+	{
+		char Core[16];
+
+		if (Entry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES) {
+			sprintf_s(Core, sizeof(Core), "all");
+		}
+		else {
+			sprintf_s(Core, sizeof(Core), "%x", Entry->CoreId);
+		}
+
+		ShowMessages("%016llx  %-22s%-6s%-10s%-14llu%-14llu%-14llu%-18llu%llu\n",
+			Entry->Tag,
+			(UINT32)Entry->EventType < DEBUGGER_EVENT_TYPES_COUNT ? EventTypeNames[Entry->EventType] : "unknown",
+			Core,
+			Entry->Enabled ? "enabled" : "disabled",
+			Entry->Statistics.Hits,
+			Entry->Statistics.ConditionRejections,
+			Entry->Statistics.ActionsRun,
+			Entry->Statistics.ConditionCycles,
+			Entry->Statistics.ActionCycles);
+	}
+
+	free(Result);
+}
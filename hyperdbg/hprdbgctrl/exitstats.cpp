@@ -0,0 +1,149 @@
+/**
+ * @file exitstats.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the vm-exit counters and latency histograms
+ * @details
+ * @version 0.1
+ * @date 2020-05-04
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief Names of the exit reasons (index is the basic exit reason)
+ *
+ */
+const char* VmexitReasonNames[VMEXIT_STATISTICS_MAXIMUM_REASONS] = {
+	"EXCEPTION_NMI", "EXTERNAL_INTERRUPT", "TRIPLE_FAULT", "INIT", "SIPI", "IO_SMI", "OTHER_SMI", "PENDING_VIRT_INTR",
+	"PENDING_VIRT_NMI", "TASK_SWITCH", "CPUID", "GETSEC", "HLT", "INVD", "INVLPG", "RDPMC",
+	"RDTSC", "RSM", "VMCALL", "VMCLEAR", "VMLAUNCH", "VMPTRLD", "VMPTRST", "VMREAD",
+	"VMRESUME", "VMWRITE", "VMXOFF", "VMXON", "CR_ACCESS", "DR_ACCESS", "IO_INSTRUCTION", "MSR_READ",
+	"MSR_WRITE", "INVALID_GUEST_STATE", "MSR_LOADING", "RESERVED_35", "MWAIT_INSTRUCTION", "MONITOR_TRAP_FLAG", "RESERVED_38", "MONITOR_INSTRUCTION",
+	"PAUSE_INSTRUCTION", "MCE_DURING_VMENTRY", "RESERVED_42", "TPR_BELOW_THRESHOLD", "APIC_ACCESS", "VIRTUALIZED_EOI", "ACCESS_GDTR_OR_IDTR", "ACCESS_LDTR_OR_TR",
+	"EPT_VIOLATION", "EPT_MISCONFIG", "INVEPT", "RDTSCP", "PREEMPTION_TIMER", "INVVPID", "WBINVD", "XSETBV",
+	"APIC_WRITE", "RDRAND", "INVPCID", "VMFUNC", "ENCLS", "RDSEED", "PML_FULL", "XSAVES",
+	"XRSTORS", "PCOMMIT"
+};
+
+void CommandExitStatsHelp() {
+	ShowMessages(".exitstats : shows the count and the cycles of the vm-exits of each exit reason.\n\n");
+	ShowMessages("syntax : \t.exitstats [core (hex value)] [reset]\n");
+	ShowMessages("\t\te.g : .exitstats\n");
+	ShowMessages("\t\t\tdescription : shows the vm-exits of all the cores\n");
+	ShowMessages("\t\te.g : .exitstats 2\n");
+	ShowMessages("\t\t\tdescription : shows the vm-exits of the core 2\n");
+	ShowMessages("\t\te.g : .exitstats reset\n");
+	ShowMessages("\t\t\tdescription : shows the vm-exits of all the cores then resets them\n");
+}
+
+void CommandExitStats(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	VMEXIT_STATISTICS_REQUEST Request = { 0 };
+	PVMEXIT_STATISTICS Statistics;
+	UINT64 TotalCount = 0;
+	UINT64 TotalCycles = 0;
+
+	Request.CoreIndex = VMEXIT_STATISTICS_ALL_CORES;
+
+	for (size_t i = 1; i < SplittedCommand.size(); i++)
+	{
+		if (!SplittedCommand.at(i).compare("reset")) {
+			Request.Reset = TRUE;
+		}
+		else if (SplittedCommand.at(i).find_first_not_of("0123456789abcdefABCDEF") == string::npos && Request.CoreIndex == VMEXIT_STATISTICS_ALL_CORES) {
+			Request.CoreIndex = stoul(SplittedCommand.at(i), nullptr, 16);
+		}
+		else {
+			ShowMessages("incorrect use of '.exitstats'\n\n");
+			CommandExitStatsHelp();
+			return;
+		}
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Statistics = (PVMEXIT_STATISTICS)malloc(sizeof(VMEXIT_STATISTICS));
+
+	if (!Statistics)
+	{
+		ShowMessages("Unable to allocate memory for the statistics\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_VMEXIT_STATISTICS,		// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(VMEXIT_STATISTICS_REQUEST),	// Length of input buffer in bytes.
+		Statistics,							// Output Buffer from driver.
+		sizeof(VMEXIT_STATISTICS),			// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(VMEXIT_STATISTICS)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Statistics);
+		return;
+	}
+
+	if (Statistics->CoreIndex == VMEXIT_STATISTICS_ALL_CORES) {
+		ShowMessages("vm-exits of all the cores (%d cores)\n\n", Statistics->CoreCount);
+	}
+	else {
+		ShowMessages("vm-exits of core %x\n\n", Statistics->CoreIndex);
+	}
+
+	ShowMessages("%-24s%-16s%-16s%-16s%s\n", "reason", "count", "avg cycles", "max cycles", "histogram (log2 of cycles : count)");
+
+	for (UINT32 i = 0; i < VMEXIT_STATISTICS_MAXIMUM_REASONS; i++)
+	{
+		PVMEXIT_REASON_STATISTICS Reason = &Statistics->Reasons[i];
+		string Histogram;
+		char Bucket[64];
+
+		if (Reason->Count == 0)
+		{
+			continue;
+		}
+
+		TotalCount += Reason->Count;
+		TotalCycles += Reason->TotalCycles;
+
+		for (UINT32 j = 0; j < VMEXIT_STATISTICS_HISTOGRAM_BUCKETS; j++)
+		{
+			if (Reason->Histogram[j] != 0)
+			{
+				sprintf_s(Bucket, sizeof(Bucket), "%s%d:%llu", j == VMEXIT_STATISTICS_HISTOGRAM_BUCKETS - 1 ? ">=" : "", j, Reason->Histogram[j]);
+				Histogram += Histogram.empty() ? Bucket : string(" ") + Bucket;
+			}
+		}
+
+		ShowMessages("%-24s%-16llu%-16llu%-16llu%s\n",
+			VmexitReasonNames[i],
+			Reason->Count,
+			Reason->TotalCycles / Reason->Count,
+			Reason->MaximumCycles,
+			Histogram.c_str());
+	}
+
+	ShowMessages("\ntotal : %llu vm-exits, %llu cycles\n", TotalCount, TotalCycles);
+
+	if (Request.Reset)
+	{
+		ShowMessages("the statistics are reset\n");
+	}
+
+	free(Statistics);
+}
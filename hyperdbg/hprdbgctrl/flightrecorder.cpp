@@ -0,0 +1,136 @@
+/**
+ * @file flightrecorder.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the last vm-exits of each core
+ * @details
+ * @version 0.1
+ * @date 2020-05-06
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+extern const char* VmexitReasonNames[VMEXIT_STATISTICS_MAXIMUM_REASONS];
+
+void CommandFlightRecorderHelp() {
+	ShowMessages(".flightrecorder : shows the last %d vm-exits of each core (from the oldest one).\n\n", FLIGHT_RECORDER_ENTRIES_PER_CORE);
+	ShowMessages("syntax : \t.flightrecorder [core (hex value)]\n");
+	ShowMessages("\t\te.g : .flightrecorder\n");
+	ShowMessages("\t\t\tdescription : shows the last vm-exits of all the cores\n");
+	ShowMessages("\t\te.g : .flightrecorder 2\n");
+	ShowMessages("\t\t\tdescription : shows the last vm-exits of the core 2\n");
+}
+
+void CommandFlightRecorder(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	ULONG BufferSize;
+	UINT32 CoreIndex = VMEXIT_STATISTICS_ALL_CORES;
+	PVMEXIT_FLIGHT_RECORDER_DUMP Dump;
+	PVMEXIT_FLIGHT_RECORDER_CORE Recorders;
+
+	if (SplittedCommand.size() > 2 ||
+		(SplittedCommand.size() == 2 && SplittedCommand.at(1).find_first_not_of("0123456789abcdefABCDEF") != string::npos))
+	{
+		ShowMessages("incorrect use of '.flightrecorder'\n\n");
+		CommandFlightRecorderHelp();
+		return;
+	}
+
+	if (SplittedCommand.size() == 2) {
+		CoreIndex = stoul(SplittedCommand.at(1), nullptr, 16);
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	//
+	// The driver needs a recorder for each core
+	//
+	BufferSize = sizeof(VMEXIT_FLIGHT_RECORDER_DUMP) + GetActiveProcessorCount(ALL_PROCESSOR_GROUPS) * sizeof(VMEXIT_FLIGHT_RECORDER_CORE);
+
+	Dump = (PVMEXIT_FLIGHT_RECORDER_DUMP)malloc(BufferSize);
+
+	if (!Dump)
+	{
+		ShowMessages("Unable to allocate memory for the flight recorders\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,							// Handle to device
+		IOCTL_DUMP_FLIGHT_RECORDER,		// IO Control code
+		NULL,							// Input Buffer to driver.
+		0,								// Length of input buffer in bytes.
+		Dump,							// Output Buffer from driver.
+		BufferSize,						// Length of output buffer in bytes.
+		&ReturnedLength 				// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(VMEXIT_FLIGHT_RECORDER_DUMP)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Dump);
+		return;
+	}
+
+	if (CoreIndex != VMEXIT_STATISTICS_ALL_CORES && CoreIndex >= Dump->CoreCount) {
+		ShowMessages("invalid core index, the system has %d cores\n", Dump->CoreCount);
+		free(Dump);
+		return;
+	}
+
+	Recorders = (PVMEXIT_FLIGHT_RECORDER_CORE)((UINT64)Dump + sizeof(VMEXIT_FLIGHT_RECORDER_DUMP));
+
+	for (UINT32 i = 0; i < Dump->CoreCount; i++)
+	{
+		PVMEXIT_FLIGHT_RECORDER_CORE Recorder = &Recorders[i];
+		UINT64 Start;
+
+		if (CoreIndex != VMEXIT_STATISTICS_ALL_CORES && CoreIndex != i)
+		{
+			continue;
+		}
+
+		Start = Recorder->CountOfVmexits > Dump->EntriesPerCore ? Recorder->CountOfVmexits - Dump->EntriesPerCore : 0;
+
+		ShowMessages("core %x (%llu vm-exits)\n\n", i, Recorder->CountOfVmexits);
+		ShowMessages("%-24s%-20s%-20s%-20s%s\n", "reason", "qualification", "rip", "tsc", "cycles");
+
+		for (UINT64 j = Start; j < Recorder->CountOfVmexits; j++)
+		{
+			PVMEXIT_FLIGHT_RECORD Record = &Recorder->Records[j % Dump->EntriesPerCore];
+			char Reason[24];
+
+			if (Record->ExitReason < VMEXIT_STATISTICS_MAXIMUM_REASONS) {
+				sprintf_s(Reason, sizeof(Reason), "%s", VmexitReasonNames[Record->ExitReason]);
+			}
+			else {
+				sprintf_s(Reason, sizeof(Reason), "0x%x", Record->ExitReason);
+			}
+
+			ShowMessages("%-24s%-20llx%-20llx%-20llx", Reason, Record->ExitQualification, Record->GuestRip, Record->TimeStampCounter);
+
+			//
+			// Zero means it's not handled yet (or it's the current vm-exit of the core)
+			//
+			if (Record->HandlerCycles == 0) {
+				ShowMessages("in progress\n");
+			}
+			else {
+				ShowMessages("%llu\n", Record->HandlerCycles);
+			}
+		}
+
+		ShowMessages("\n");
+	}
+
+	free(Dump);
+}
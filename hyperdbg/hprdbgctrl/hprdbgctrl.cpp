@@ -20,6 +20,9 @@ HANDLE Handle;
 BOOLEAN IsVmxOffProcessStart; // Show whether the vmxoff process start or not
 Callback Handler = 0;
 TCHAR driverLocation[MAX_PATH] = { 0 };
+map<UINT32, string> BinaryMessageFormats; // Format strings of binary messages (key is the format id)
+LOG_TIME_CALIBRATION TimeCalibration = { 0 }; // Anchor to convert the time stamp counters of kernel to time (zero frequency if not received)
+SRWLOCK KernelMessageLock = SRWLOCK_INIT; // The consumers of the messages share the binary formats and the time calibration
 
 
 
@@ -50,7 +53,19 @@ void ShowMessages(const char* Fmt, ...) {
 
 	if (sprintfresult != -1)
 	{
-		if (Handler != NULL)
+		if (RemoteCaptureOutput(TempMessage))
+		{
+			//
+			// It's a result of a command of the remote debugger
+			//
+		}
+		else if (BatchCallbackSaveMessage(TempMessage, (UINT32)sprintfresult))
+		{
+			//
+			// It's delivered with the next batch of messages
+			//
+		}
+		else if (Handler != NULL)
 		{
 			Handler(TempMessage);
 		}
@@ -65,6 +80,58 @@ void ShowMessages(const char* Fmt, ...) {
 	}
 }
 
+/**
+ * @brief Send an IOCTL to the driver and wait for its result
+ * @details The handle of the driver is overlapped and bound to the completion
+ * port of the kernel messages, so a request without an OVERLAPPED is not
+ * valid and its completion would be queued to the port, the low bit of the
+ * event prevents the completion packet
+ *
+ * @param Device Driver handle
+ * @param IoControlCode
+ * @param InBuffer
+ * @param InBufferSize
+ * @param OutBuffer
+ * @param OutBufferSize
+ * @param BytesReturned Bytes placed in the output buffer (can be NULL)
+ * @return BOOL Same as DeviceIoControl (GetLastError gives the error)
+ */
+BOOL DeviceIoControlSynchronous(HANDLE Device, DWORD IoControlCode, LPVOID InBuffer, DWORD InBufferSize,
+	LPVOID OutBuffer, DWORD OutBufferSize, LPDWORD BytesReturned) {
+
+	OVERLAPPED Overlapped = { 0 };
+	DWORD ReturnedLength = 0;
+	DWORD LastError;
+	BOOL Status;
+
+	HANDLE Event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (Event == NULL)
+	{
+		return FALSE;
+	}
+
+	Overlapped.hEvent = (HANDLE)((ULONG_PTR)Event | 1);
+
+	Status = DeviceIoControl(Device, IoControlCode, InBuffer, InBufferSize, OutBuffer, OutBufferSize, NULL, &Overlapped);
+
+	if (Status || GetLastError() == ERROR_IO_PENDING)
+	{
+		Status = GetOverlappedResult(Device, &Overlapped, &ReturnedLength, TRUE);
+	}
+
+	LastError = GetLastError();
+	CloseHandle(Event);
+	SetLastError(LastError);
+
+	if (BytesReturned != NULL)
+	{
+		*BytesReturned = ReturnedLength;
+	}
+
+	return Status;
+}
+
 /**
  * @brief Detect VMX support
  * 
@@ -116,96 +183,780 @@ BOOL SetPrivilege(HANDLE hToken, LPCTSTR lpszPrivilege, BOOL bEnablePrivilege)
 #if !UseDbgPrintInsteadOfUsermodeMessageTracking 
 
 /**
- * @brief Read kernel buffers using IRP Pending
- * 
+ * @brief Convert a time stamp counter of kernel to the local time
+ * @details If the calibration is not received from kernel, the time
+ * stamp counter itself is shown
+ *
+ * @param TimeStampCounter The time stamp counter
+ * @return string The local time (with microseconds)
+ */
+string TimeStampCounterToString(UINT64 TimeStampCounter) {
+
+	char Result[64];
+	UINT64 Frequency = TimeCalibration.TimeStampCounterFrequency;
+
+	if (Frequency == 0)
+	{
+		sprintf_s(Result, sizeof(Result), "tsc : %llx", TimeStampCounter);
+		return Result;
+	}
+
+	//
+	// Convert the distance from the anchor to 100-nanosecond intervals
+	//
+	INT64 Delta = (INT64)(TimeStampCounter - TimeCalibration.TimeStampCounter);
+	UINT64 AbsoluteDelta = Delta < 0 ? -Delta : Delta;
+	UINT64 Intervals = (AbsoluteDelta / Frequency) * 10000000 + ((AbsoluteDelta % Frequency) * 10000000) / Frequency;
+
+	ULARGE_INTEGER LocalTime;
+	LocalTime.QuadPart = Delta < 0 ? TimeCalibration.LocalTime - Intervals : TimeCalibration.LocalTime + Intervals;
+
+	FILETIME FileTime;
+	SYSTEMTIME Time;
+	FileTime.dwLowDateTime = LocalTime.LowPart;
+	FileTime.dwHighDateTime = LocalTime.HighPart;
+
+	if (!FileTimeToSystemTime(&FileTime, &Time))
+	{
+		sprintf_s(Result, sizeof(Result), "tsc : %llx", TimeStampCounter);
+		return Result;
+	}
+
+	sprintf_s(Result, sizeof(Result), "%02hd:%02hd:%02hd.%06llu", Time.wHour, Time.wMinute, Time.wSecond, (LocalTime.QuadPart / 10) % 1000000);
+	return Result;
+}
+
+/**
+ * @brief Show a text message of kernel
+ * @details The kernel puts the time stamp counter in the messages as
+ * "(tsc : hex", it's converted to the local time here
+ *
+ * @param Buffer The message (null-terminated)
+ */
+void ShowTextMessage(const char* Buffer) {
+
+	const string Marker = "(tsc : ";
+	string Message(Buffer);
+	size_t Position = 0;
+
+	while ((Position = Message.find(Marker, Position)) != string::npos) {
+
+		const char* Start = Message.c_str() + Position + Marker.size();
+		char* End;
+		UINT64 TimeStampCounter = strtoull(Start, &End, 16);
+
+		if (End == Start) {
+			Position += Marker.size();
+			continue;
+		}
+
+		size_t Length = End - (Message.c_str() + Position + 1);
+		string Time = TimeStampCounterToString(TimeStampCounter);
+
+		Message.replace(Position + 1, Length, Time);
+		Position += 1 + Time.size();
+	}
+
+	ShowMessages("%s\n", Message.c_str());
+}
+
+/**
+ * @brief Save the format of binary messages that is received from kernel
+ *
+ * @param Definition The definition packet
+ * @param Length Length of the packet
+ */
+void SaveBinaryMessageFormat(PLOG_BINARY_FORMAT_DEFINITION Definition, UINT32 Length) {
+
+	if (Length <= FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format))
+	{
+		return;
+	}
+
+	BinaryMessageFormats[Definition->FormatId] = string(Definition->Format, strnlen_s(Definition->Format, Length - FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format)));
+}
+
+/**
+ * @brief Format and show binary messages (the kernel deferred the formatting to us)
+ *
+ * @param Message The binary message
+ */
+void ShowBinaryMessage(PLOG_BINARY_MESSAGE Message) {
+
+	char FormattedMessage[PacketChunkSize];
+	UINT64 Arguments[LOG_BINARY_MAXIMUM_ARGUMENTS] = { 0 };
+
+	auto Format = BinaryMessageFormats.find(Message->FormatId);
+
+	if (Format == BinaryMessageFormats.end())
+	{
+		//
+		// The definition is lost (or it's not received yet), the driver sends it
+		// again with the next messages of the call site
+		//
+		ShowMessages("Binary message with unknown format id : 0x%x (core : %d)\n", Message->FormatId, Message->CoreId);
+		return;
+	}
+
+	//
+	// All the arguments are 64-bit slots, so we can pass them as a va_list
+	//
+	memcpy(Arguments, Message->Arguments, min(Message->ArgumentCount, LOG_BINARY_MAXIMUM_ARGUMENTS) * sizeof(UINT64));
+
+	if (vsprintf_s(FormattedMessage, PacketChunkSize - 1, Format->second.c_str(), (va_list)Arguments) == -1)
+	{
+		return;
+	}
+
+	switch (Message->OperationCode)
+	{
+	case OPERATION_LOG_INFO_MESSAGE:
+		ShowMessages("Information log (OPERATION_LOG_INFO_MESSAGE) :\n");
+		break;
+	case OPERATION_LOG_ERROR_MESSAGE:
+		ShowMessages("Error log (OPERATION_LOG_ERROR_MESSAGE) :\n");
+		break;
+	case OPERATION_LOG_WARNING_MESSAGE:
+		ShowMessages("Warning log (OPERATION_LOG_WARNING_MESSAGE) :\n");
+		break;
+	default:
+		break;
+	}
+
+	if (Message->ShowTimeStampCounter)
+	{
+		ShowMessages("(%s - core : %d - vmx-root? yes)\t %s\n", TimeStampCounterToString(Message->TimeStampCounter).c_str(), Message->CoreId, FormattedMessage);
+	}
+	else
+	{
+		ShowMessages("%s\n", FormattedMessage);
+	}
+}
+
+/**
+ * @brief Get the tag of the event that made a packet
+ *
+ * @param OperationCode Operation code of the packet
+ * @param Buffer Body of the packet (null-terminated)
+ * @param Length Length of the body
+ * @return UINT64 The tag or zero if it's not made by an event
+ */
+UINT64 GetKernelMessageTag(UINT32 OperationCode, const char* Buffer, UINT32 Length) {
+
+	char Tag[17] = { 0 };
+
+	switch (OperationCode)
+	{
+	case OPERATION_LOG_WITH_TAG:
+		//
+		// The text starts with the hex of the tag
+		//
+		memcpy(Tag, Buffer, min(Length, (UINT32)16));
+		return strtoull(Tag, NULL, 16);
+	case OPERATION_LOG_STATES:
+		return Length >= sizeof(DEBUGGER_LOG_STATES_RECORD) ? ((PDEBUGGER_LOG_STATES_RECORD)Buffer)->Tag : 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Show a packet that is received from kernel
+ * @details The caller should hold KernelMessageLock
+ *
+ * @param PacketHeader Header of the packet
+ * @param Buffer Body of the packet (null-terminated)
+ */
+void ShowKernelMessageWithoutLock(PLOG_BATCH_PACKET_HEADER PacketHeader, char* Buffer) {
+
+	UINT32 OperationCode = PacketHeader->OperationCode;
+	UINT32 Length = PacketHeader->Length;
+	UINT64 Tag = GetKernelMessageTag(OperationCode, Buffer, Length);
+
+	//
+	// The batch callback might want the records as they are, the formats
+	// and the calibration are still needed to decode the next records
+	//
+	if (OperationCode != OPERATION_LOG_BINARY_FORMAT_DEFINITION && OperationCode != OPERATION_LOG_TIME_CALIBRATION &&
+		BatchCallbackSaveRecord(OperationCode, Tag, PacketHeader->TimeStampCounter, Buffer, Length))
+	{
+		return;
+	}
+
+	//
+	// The messages of the packet are in one entry of the batch callback
+	//
+	BatchCallbackSetContext(OperationCode, Tag, PacketHeader->TimeStampCounter);
+
+	switch (OperationCode)
+	{
+	case OPERATION_LOG_NON_IMMEDIATE_MESSAGE:
+		ShowMessages("A buffer of messages (OPERATION_LOG_NON_IMMEDIATE_MESSAGE) :\n");
+		ShowTextMessage(Buffer);
+		break;
+	case OPERATION_LOG_INFO_MESSAGE:
+		ShowMessages("Information log (OPERATION_LOG_INFO_MESSAGE) :\n");
+		ShowTextMessage(Buffer);
+		break;
+	case OPERATION_LOG_ERROR_MESSAGE:
+		ShowMessages("Error log (OPERATION_LOG_ERROR_MESSAGE) :\n");
+		ShowTextMessage(Buffer);
+		break;
+	case OPERATION_LOG_WARNING_MESSAGE:
+		ShowMessages("Warning log (OPERATION_LOG_WARNING_MESSAGE) :\n");
+		ShowTextMessage(Buffer);
+		break;
+	case OPERATION_LOG_WITH_TAG:
+		ShowMessages("Event log (OPERATION_LOG_WITH_TAG) :\n");
+		ShowTextMessage(Buffer);
+		break;
+	case OPERATION_LOG_BINARY_FORMAT_DEFINITION:
+		SaveBinaryMessageFormat((PLOG_BINARY_FORMAT_DEFINITION)Buffer, Length);
+		break;
+	case OPERATION_LOG_BINARY_MESSAGE:
+		ShowBinaryMessage((PLOG_BINARY_MESSAGE)Buffer);
+		break;
+	case OPERATION_LOG_TIME_CALIBRATION:
+		if (Length >= sizeof(LOG_TIME_CALIBRATION))
+		{
+			memcpy(&TimeCalibration, Buffer, sizeof(LOG_TIME_CALIBRATION));
+		}
+		break;
+	case OPERATION_LOG_RECORDS_LOST:
+		ShowMessages("%llu messages of a kernel buffer are lost (the buffer was full)\n", ((PLOG_RECORDS_LOST)Buffer)->LostRecords);
+		break;
+	case OPERATION_LOG_EXCEPTION_HIT:
+		if (Length >= sizeof(DEBUGGER_EXCEPTION_HIT_RECORD))
+		{
+			PDEBUGGER_EXCEPTION_HIT_RECORD Record = (PDEBUGGER_EXCEPTION_HIT_RECORD)Buffer;
+
+			ShowMessages("(%s - core : %d) %s hit at : %s (process id : 0x%x, cr3 : %llx",
+				TimeStampCounterToString(Record->TimeStampCounter).c_str(),
+				Record->CoreId,
+				Record->Vector == 3 ? "#BP" : "#DB",
+				LmResolveAddress(Record->GuestRip).c_str(),
+				Record->ProcessId,
+				Record->GuestCr3);
+
+			if (Record->Vector == 3) {
+				ShowMessages(")\n");
+			}
+			else {
+				ShowMessages(", dr6 : %llx)\n", Record->ExitQualification);
+			}
+		}
+		break;
+	case OPERATION_LOG_STATES:
+		if (Length >= sizeof(DEBUGGER_LOG_STATES_RECORD))
+		{
+			PDEBUGGER_LOG_STATES_RECORD Record = (PDEBUGGER_LOG_STATES_RECORD)Buffer;
+			PUINT64 Values = (PUINT64)((UINT64)Buffer + sizeof(DEBUGGER_LOG_STATES_RECORD));
+			PUCHAR Memory;
+			const char* RegisterNames[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rflags" };
+			UINT32 CountOfRegisters = 0;
+
+			for (UINT32 i = 0; i < 17; i++) {
+				if (Record->RegisterMask & (1 << i)) {
+					CountOfRegisters++;
+				}
+			}
+
+			if (Length < sizeof(DEBUGGER_LOG_STATES_RECORD) + CountOfRegisters * sizeof(UINT64) + Record->MemoryLength) {
+				break;
+			}
+
+			ShowMessages("(%s - core : %d) event %llx (action %d) at : %s\n",
+				TimeStampCounterToString(Record->TimeStampCounter).c_str(),
+				Record->CoreId,
+				Record->Tag,
+				Record->ActionOrderCode,
+				LmResolveAddress(Record->GuestRip).c_str());
+
+			if (Record->SuppressedHits != 0) {
+				ShowMessages("(%llu hits are suppressed since the previous record)\n", Record->SuppressedHits);
+			}
+
+			for (UINT32 i = 0, j = 0; i < 17; i++) {
+				if (Record->RegisterMask & (1 << i)) {
+					ShowMessages("%s=%016llx", RegisterNames[i], Values[j]);
+					j++;
+					ShowMessages((j % 4) && j != CountOfRegisters ? " " : "\n");
+				}
+			}
+
+			if (Record->IsMemoryRequested && Record->MemoryLength == 0) {
+				ShowMessages("%016llx  ????????\n", Record->Address);
+			}
+
+			Memory = (PUCHAR)&Values[CountOfRegisters];
+
+			for (UINT32 i = 0; i < Record->MemoryLength; i += 16) {
+				ShowMessages("%016llx ", Record->Address + i);
+
+				for (UINT32 j = i; j < i + 16 && j < Record->MemoryLength; j++) {
+					ShowMessages(" %02x", Memory[j]);
+				}
+
+				ShowMessages("\n");
+			}
+		}
+		break;
+	case OPERATION_LOG_SYSCALL_TRACE:
+		if (Length >= sizeof(SYSCALL_TRACE_RECORD))
+		{
+			ShowSyscallTraceRecord((PSYSCALL_TRACE_RECORD)Buffer);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	BatchCallbackSetContext(0, 0, 0);
+}
+
+/**
+ * @brief Show a packet that is received from kernel
+ * @details The packets of the subscribers are shown by other threads,
+ * the binary formats and the time calibration are shared by all of them
+ *
+ * @param PacketHeader Header of the packet
+ * @param Buffer Body of the packet (null-terminated)
+ */
+void ShowKernelMessage(PLOG_BATCH_PACKET_HEADER PacketHeader, char* Buffer) {
+
+	AcquireSRWLockExclusive(&KernelMessageLock);
+	ShowKernelMessageWithoutLock(PacketHeader, Buffer);
+	ReleaseSRWLockExclusive(&KernelMessageLock);
+}
+
+/**
+ * @brief An overlapped request of the kernel messages
+ * @details Overlapped should be the first member, the completion packets
+ * give us the address of it
+ */
+typedef struct _LOG_CONSUMER_REQUEST {
+	OVERLAPPED Overlapped;
+	char Buffer[LogBatchBufferSize];
+} LOG_CONSUMER_REQUEST, * PLOG_CONSUMER_REQUEST;
+
+HANDLE LogConsumerReceivePort;		// Completions of the requests (from the driver)
+HANDLE LogConsumerFormatPort;		// Completed requests that should be shown (to the worker)
+volatile LONG LogConsumerPendingRequests; // Count of the requests that the driver not yet completed
+
+/**
+ * @brief Send a request of the kernel messages, the driver pends it
+ * until there is at least one message
+ *
  * @param Device Driver handle
+ * @param Request The request
+ * @return BOOLEAN Whether the request is sent or not
+ */
+BOOLEAN SendLogConsumerRequest(HANDLE Device, PLOG_CONSUMER_REQUEST Request) {
+
+	BOOL Status;
+
+	memset(&Request->Overlapped, 0, sizeof(OVERLAPPED));
+
+	InterlockedIncrement(&LogConsumerPendingRequests);
+
+	Status = DeviceIoControl(
+		Device,							// Handle to device
+		IOCTL_READ_LOG_BUFFERS_BATCH,	// IO Control code
+		NULL,							// Input Buffer to driver.
+		0,								// Length of input buffer in bytes.
+		Request->Buffer,				// Output Buffer from driver.
+		LogBatchBufferSize,				// Length of output buffer in bytes.
+		NULL,							// Bytes placed in buffer (in the completion packet).
+		&Request->Overlapped			// asynchronous call
+	);
+
+	if (!Status && GetLastError() != ERROR_IO_PENDING) {
+		InterlockedDecrement(&LogConsumerPendingRequests);
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return FALSE;
+	}
+
+	//
+	// Even if it's completed synchronously, the completion packet is
+	// queued to the port
+	//
+	return TRUE;
+}
+
+/**
+ * @brief Decode and show the completed requests, then send them again
+ * @details Only one worker shows the messages as the binary formats and
+ * the time calibration should be processed in order
+ *
+ * @param Data Driver handle
+ * @return DWORD
+ */
+DWORD WINAPI LogConsumerFormatThread(void* Data) {
+
+	HANDLE Device = (HANDLE)Data;
+	DWORD ReturnedLength;
+	ULONG_PTR CompletionKey;
+	LPOVERLAPPED Overlapped;
+	ULONG Offset;
+	LOG_BATCH_PACKET_HEADER PacketHeader;
+
+	//
+	// each body is copied here to be null-terminated
+	//
+	char* MessageBuffer = (char*)malloc(PacketChunkSize + 1);
+
+	while (GetQueuedCompletionStatus(LogConsumerFormatPort, &ReturnedLength, &CompletionKey, &Overlapped, INFINITE)) {
+
+		if (Overlapped == NULL)
+		{
+			//
+			// The receiver asks us to quit
+			//
+			break;
+		}
+
+		PLOG_CONSUMER_REQUEST Request = (PLOG_CONSUMER_REQUEST)Overlapped;
+
+		try
+		{
+			Offset = 0;
+
+			while (Offset + sizeof(LOG_BATCH_PACKET_HEADER) <= ReturnedLength) {
+
+				memcpy(&PacketHeader, Request->Buffer + Offset, sizeof(LOG_BATCH_PACKET_HEADER));
+				Offset += sizeof(LOG_BATCH_PACKET_HEADER);
+
+				if (PacketHeader.Length > PacketChunkSize || Offset + PacketHeader.Length > ReturnedLength) {
+					ShowMessages("Invalid packet in the batch of kernel messages\n");
+					break;
+				}
+
+				memcpy(MessageBuffer, Request->Buffer + Offset, PacketHeader.Length);
+				MessageBuffer[PacketHeader.Length] = '\0';
+				Offset += PacketHeader.Length;
+
+				BOOLEAN Show = TraceFileSaveRecord(&PacketHeader, MessageBuffer);
+				Show = RemoteSendRecord(&PacketHeader, MessageBuffer) && Show;
+
+				if (Show) {
+					ShowKernelMessage(&PacketHeader, MessageBuffer);
+				}
+			}
+		}
+		catch (const std::exception&)
+		{
+			ShowMessages(" Exception !\n");
+		}
+
+		//
+		// The buffer is free now, give it back to the driver
+		//
+		if (IsVmxOffProcessStart || !SendLogConsumerRequest(Device, Request))
+		{
+			free(Request);
+		}
+	}
+
+	free(MessageBuffer);
+	return 0;
+}
+
+/**
+ * @brief Read kernel buffers using IRP Pending
+ * @details Multiple overlapped requests are pending in the driver, so the
+ * driver never waits for us to show the previous messages, the completed
+ * requests are shown by another thread (LogConsumerFormatThread)
+ *
+ * @param Device Driver handle (opened with FILE_FLAG_OVERLAPPED)
  */
 void ReadIrpBasedBuffer(HANDLE  Device) {
 
-	BOOL    Status;
-	ULONG   ReturnedLength;
-	REGISTER_NOTIFY_BUFFER RegisterEvent;
-	UINT32 OperationCode;
+	DWORD ReturnedLength;
+	ULONG_PTR CompletionKey;
+	LPOVERLAPPED Overlapped;
+	HANDLE FormatThread;
 
 	ShowMessages(" =============================== Kernel-Mode Logs (Driver) ===============================\n");
-	RegisterEvent.hEvent = NULL;
-	RegisterEvent.Type = IRP_BASED;
+
+	LogConsumerReceivePort = CreateIoCompletionPort(Device, NULL, 0, 1);
+	LogConsumerFormatPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+
+	if (LogConsumerReceivePort == NULL || LogConsumerFormatPort == NULL)
+	{
+		ShowMessages("CreateIoCompletionPort failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	FormatThread = CreateThread(NULL, 0, LogConsumerFormatThread, Device, 0, NULL);
+
+	if (FormatThread == NULL)
+	{
+		ShowMessages("CreateThread failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	//
+	// Send all the requests, the driver fills them in order
+	//
+	for (UINT32 i = 0; i < LogConsumerInFlightRequests; i++)
+	{
+		PLOG_CONSUMER_REQUEST Request = (PLOG_CONSUMER_REQUEST)malloc(sizeof(LOG_CONSUMER_REQUEST));
+
+		if (Request == NULL || !SendLogConsumerRequest(Device, Request))
+		{
+			free(Request);
+			break;
+		}
+	}
+
+	while (!IsVmxOffProcessStart) {
+
+		//
+		// Timeout is for checking whether we should quit or not
+		//
+		if (!GetQueuedCompletionStatus(LogConsumerReceivePort, &ReturnedLength, &CompletionKey, &Overlapped, SharedMemoryPollingInterval))
+		{
+			if (Overlapped == NULL)
+			{
+				//
+				// Timeout
+				//
+				continue;
+			}
+
+			//
+			// The request is failed (e.g. cancelled), nothing is in the buffer
+			//
+			ReturnedLength = 0;
+		}
+
+		InterlockedDecrement(&LogConsumerPendingRequests);
+
+		//
+		// Pass it to the worker, we're free to receive the next one
+		//
+		PostQueuedCompletionStatus(LogConsumerFormatPort, ReturnedLength, CompletionKey, Overlapped);
+	}
+
+	//
+	// Cancel the requests that are pending in the driver, and wait for them
+	// (the driver might still write to them)
+	//
+	CancelIoEx(Device, NULL);
+
+	while (LogConsumerPendingRequests > 0) {
+
+		if (!GetQueuedCompletionStatus(LogConsumerReceivePort, &ReturnedLength, &CompletionKey, &Overlapped, LogConsumerCancelTimeout) && Overlapped == NULL)
+		{
+			//
+			// The remaining requests are not freed as the driver might use them
+			//
+			break;
+		}
+
+		InterlockedDecrement(&LogConsumerPendingRequests);
+		free(Overlapped);
+	}
 
 	//
-	// allocate buffer for transfering messages
+	// Tell the worker to quit after showing the remaining messages
 	//
-	char* OutputBuffer = (char*)malloc(UsermodeBufferSize);
+	PostQueuedCompletionStatus(LogConsumerFormatPort, 0, 0, NULL);
+	WaitForSingleObject(FormatThread, INFINITE);
+
+	CloseHandle(FormatThread);
+	CloseHandle(LogConsumerFormatPort);
+	CloseHandle(LogConsumerReceivePort);
+}
 
-	try
+#if UseSharedMemoryForUsermodeMessages
+
+/**
+ * @brief Get the header of the next unread record of a mapped ring
+ * @details The skipped tail of the ring is consumed by this function
+ *
+ * @param Control Counters of the ring
+ * @param BufferAddress Address of the ring
+ * @param BufferSize Size of the ring
+ * @param ReadCount [Out] The ReadCount of the record (to consume the record)
+ * @return PBUFFER_HEADER Returns the header or NULL if there is nothing to read
+ */
+PBUFFER_HEADER GetSharedRingHeader(PLOG_SHARED_RING_CONTROL Control, UINT64 BufferAddress, UINT32 BufferSize, UINT64* ReadCount) {
+
+	while (TRUE)
 	{
+		*ReadCount = Control->ReadCount;
+		UINT64 WrittenCount = Control->WrittenCount;
+
+		if (*ReadCount >= WrittenCount)
+		{
+			return NULL;
+		}
+
+		//
+		// Make sure that we see the contents that kernel wrote before increasing the counter
+		//
+		MemoryBarrier();
+
+		UINT64 Offset = *ReadCount & (BufferSize - 1);
+		UINT64 TailLength = BufferSize - Offset;
+		PBUFFER_HEADER Header = (PBUFFER_HEADER)(BufferAddress + Offset);
+
+		if (TailLength < sizeof(BUFFER_HEADER) || Header->OpeationNumber == OPERATION_LOG_PADDING)
+		{
+			//
+			// Kernel skipped the tail, the next record is at the start of the ring
+			//
+			InterlockedCompareExchange64((volatile LONG64*)&Control->ReadCount, *ReadCount + TailLength, *ReadCount);
+			continue;
+		}
 
-		while (TRUE) {
-			if (!IsVmxOffProcessStart)
+		if (Header->BufferLength > PacketChunkSize || *ReadCount + LOG_RECORD_SIZE(Header->BufferLength) > WrittenCount)
+		{
+			//
+			// Kernel is overwriting this record, or the counters are invalid
+			//
+			if (InterlockedCompareExchange64((volatile LONG64*)&Control->ReadCount, WrittenCount, *ReadCount) == *ReadCount)
 			{
-				ZeroMemory(OutputBuffer, UsermodeBufferSize);
-
-				Sleep(200);							// we're not trying to eat all of the CPU ;)
-
-				Status = DeviceIoControl(
-					Device,							// Handle to device
-					IOCTL_REGISTER_EVENT,			// IO Control code
-					&RegisterEvent,					// Input Buffer to driver.
-					SIZEOF_REGISTER_EVENT * 2,		// Length of input buffer in bytes. (x 2 is bcuz as the driver is x64 and has 64 bit values)
-					OutputBuffer,					// Output Buffer from driver.
-					UsermodeBufferSize,				// Length of output buffer in bytes.
-					&ReturnedLength,				// Bytes placed in buffer.
-					NULL							// synchronous call
-				);
-
-				if (!Status) {
-					ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
-					break;
-				}
-				ShowMessages("========================= Kernel Mode (Buffer) =========================\n");
+				ShowMessages("Invalid record in the kernel buffers\n");
+			}
+			continue;
+		}
+
+		return Header;
+	}
+}
+
+/**
+ * @brief Read kernel buffers in place (the buffers are mapped to this process)
+ * @details We wait for the event that kernel signals when a buffer is filled
+ * to the threshold, or for a timeout for the messages below the threshold
+ *
+ * @param Device Driver handle
+ */
+void ReadSharedMemoryBuffer(HANDLE Device) {
 
-				OperationCode = 0;
-				memcpy(&OperationCode, OutputBuffer, sizeof(UINT32));
+	BOOL Status;
+	ULONG ReturnedLength;
+	HANDLE Event;
+	LOG_MAP_BUFFERS_REQUEST MapRequest = { 0 };
+	LOG_MAPPED_BUFFERS_INFORMATION MappedBuffers = { 0 };
+	PLOG_SHARED_RING_CONTROL SharedControl;
+	char* OutputBuffer;
 
-				ShowMessages("Returned Length : 0x%x \n", ReturnedLength);
-				ShowMessages("Operation Code : 0x%x \n", OperationCode);
+	Event = CreateEvent(NULL, FALSE, FALSE, NULL);
 
-				switch (OperationCode)
+	if (Event == NULL)
+	{
+		ShowMessages("CreateEvent failed with code 0x%x\n", GetLastError());
+		ReadIrpBasedBuffer(Device);
+		return;
+	}
+
+	MapRequest.hEvent = (UINT64)Event;
+	MapRequest.FillThreshold = SharedMemoryFillThreshold;
+
+	Status = DeviceIoControlSynchronous(
+		Device,							// Handle to device
+		IOCTL_MAP_LOG_BUFFERS,			// IO Control code
+		&MapRequest,					// Input Buffer to driver.
+		sizeof(LOG_MAP_BUFFERS_REQUEST),	// Length of input buffer in bytes.
+		&MappedBuffers,					// Output Buffer from driver.
+		sizeof(LOG_MAPPED_BUFFERS_INFORMATION), // Length of output buffer in bytes.
+		&ReturnedLength 				// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(LOG_MAPPED_BUFFERS_INFORMATION))
+	{
+		//
+		// Use the IRP Pending mechanism instead
+		//
+		ShowMessages("Mapping kernel buffers failed with code 0x%x, using IRP Pending instead\n", GetLastError());
+		CloseHandle(Event);
+		ReadIrpBasedBuffer(Device);
+		return;
+	}
+
+	ShowMessages(" =============================== Kernel-Mode Logs (Driver) ===============================\n");
+
+	SharedControl = (PLOG_SHARED_RING_CONTROL)MappedBuffers.SharedControlAddress;
+	OutputBuffer = (char*)malloc(UsermodeBufferSize);
+
+	while (!IsVmxOffProcessStart)
+	{
+		WaitForSingleObject(Event, SharedMemoryPollingInterval);
+
+		while (!IsVmxOffProcessStart)
+		{
+			PBUFFER_HEADER Header = NULL;
+			UINT32 RingIndex = 0;
+			UINT64 ReadCount = 0;
+			UINT64 CurrentReadCount;
+
+			//
+			// Merge the buffers of all cores, the oldest message is shown first
+			//
+			for (UINT32 i = 0; i < MappedBuffers.BufferCount; i++)
+			{
+				PBUFFER_HEADER CurrentHeader = GetSharedRingHeader(&SharedControl[i], MappedBuffers.BufferAddresses[i], MappedBuffers.BufferSize, &CurrentReadCount);
+
+				if (CurrentHeader == NULL)
 				{
-				case OPERATION_LOG_NON_IMMEDIATE_MESSAGE:
-					ShowMessages("A buffer of messages (OPERATION_LOG_NON_IMMEDIATE_MESSAGE) :\n");
-					ShowMessages("%s\n", OutputBuffer + sizeof(UINT32));
-					break;
-				case OPERATION_LOG_INFO_MESSAGE:
-					ShowMessages("Information log (OPERATION_LOG_INFO_MESSAGE) :\n");
-					ShowMessages("%s\n", OutputBuffer + sizeof(UINT32));
-					break;
-				case OPERATION_LOG_ERROR_MESSAGE:
-					ShowMessages("Error log (OPERATION_LOG_ERROR_MESSAGE) :\n");
-					ShowMessages("%s\n", OutputBuffer + sizeof(UINT32));
-					break;
-				case OPERATION_LOG_WARNING_MESSAGE:
-					ShowMessages("Warning log (OPERATION_LOG_WARNING_MESSAGE) :\n");
-					ShowMessages("%s\n", OutputBuffer + sizeof(UINT32));
-					break;
+					continue;
+				}
 
-				default:
-					break;
+				if (Header == NULL || CurrentHeader->TimeStampCounter < Header->TimeStampCounter)
+				{
+					Header = CurrentHeader;
+					RingIndex = i;
+					ReadCount = CurrentReadCount;
 				}
 			}
-			else
+
+			if (Header == NULL)
 			{
 				//
-				// the thread should not work anymore
+				// Nothing to read
 				//
-				return;
+				break;
+			}
+
+			LOG_BATCH_PACKET_HEADER PacketHeader = { 0 };
+			PacketHeader.OperationCode = Header->OpeationNumber;
+			PacketHeader.Length = Header->BufferLength;
+			PacketHeader.TimeStampCounter = Header->TimeStampCounter;
+			PacketHeader.BufferIndex = RingIndex;
+
+			UINT32 Length = PacketHeader.Length;
+
+			memcpy(OutputBuffer, (char*)Header + sizeof(BUFFER_HEADER), Length);
+			OutputBuffer[Length] = '\0';
+
+			//
+			// The record can be reused by kernel, if kernel overwrote the record
+			// while we're copying it (LOG_OVERFLOW_OVERWRITE_OLDEST) then it's not valid
+			//
+			MemoryBarrier();
+
+			if (InterlockedCompareExchange64((volatile LONG64*)&SharedControl[RingIndex].ReadCount, ReadCount + LOG_RECORD_SIZE(Length), ReadCount) != ReadCount)
+			{
+				continue;
+			}
+
+			BOOLEAN Show = TraceFileSaveRecord(&PacketHeader, OutputBuffer);
+			Show = RemoteSendRecord(&PacketHeader, OutputBuffer) && Show;
+
+			if (Show) {
+				ShowKernelMessage(&PacketHeader, OutputBuffer);
 			}
 		}
 	}
-	catch (const std::exception&)
-	{
-		ShowMessages(" Exception !\n");
-	}
+
+	free(OutputBuffer);
+	CloseHandle(Event);
 }
+#endif
 
 /**
  * @brief Create a thread for pending buffers
@@ -219,7 +970,11 @@ DWORD WINAPI ThreadFunc(void* Data) {
 	// When this function returns, the thread goes away.  See MSDN for more details.
 	// Test Irp Based Notifications
 	//
+#if UseSharedMemoryForUsermodeMessages
+	ReadSharedMemoryBuffer(Data);
+#else
 	ReadIrpBasedBuffer(Data);
+#endif
 
 	return 0;
 }
@@ -390,15 +1145,14 @@ HPRDBGCTRL_API int HyperdbgUnload()
 	//
 	// Send IOCTL to mark complete all IRP Pending 
 	//
-	Status = DeviceIoControl(
+	Status = DeviceIoControlSynchronous(
 		Handle,															// Handle to device
 		IOCTL_TERMINATE_VMX,											// IO Control code
 		NULL,															// Input Buffer to driver.
 		0,																// Length of input buffer in bytes. (x 2 is bcuz as the driver is x64 and has 64 bit values)
 		NULL,															// Output Buffer from driver.
 		0,																// Length of output buffer in bytes.
-		NULL,															// Bytes placed in buffer.
-		NULL															// synchronous call
+		NULL 															// Bytes placed in buffer.
 	);
 
 	//
@@ -411,15 +1165,14 @@ HPRDBGCTRL_API int HyperdbgUnload()
 	//
 	// Send IOCTL to mark complete all IRP Pending 
 	//
-	Status = DeviceIoControl(
+	Status = DeviceIoControlSynchronous(
 		Handle,															// Handle to device
 		IOCTL_RETURN_IRP_PENDING_PACKETS_AND_DISALLOW_IOCTL,			// IO Control code
 		NULL,															// Input Buffer to driver.
 		0,																// Length of input buffer in bytes. (x 2 is bcuz as the driver is x64 and has 64 bit values)
 		NULL,															// Output Buffer from driver.
 		0,																// Length of output buffer in bytes.
-		NULL,															// Bytes placed in buffer.
-		NULL															// synchronous call
+		NULL 															// Bytes placed in buffer.
 	);
 
 	//
@@ -436,6 +1189,11 @@ HPRDBGCTRL_API int HyperdbgUnload()
 
 	Sleep(1000); // Wait so next thread can return from IRP Pending
 
+	//
+	// Write the index of the trace file (if there is any)
+	//
+	TraceFileClose();
+
 	//
 	// Send IRP_MJ_CLOSE to driver to terminate Vmxs
 	//
@@ -135,8 +135,11 @@ void CommandHiddenHook(vector<string> SplittedCommand) {
 
 void CommandConnectHelp() {
 	ShowMessages(".connect : connects to a remote or local machine to start debugging.\n\n");
-	ShowMessages("syntax : \t.connect [ip] [port]\n");
-	ShowMessages("\t\te.g : .connect 192.168.1.5 50000\n");
+	ShowMessages("syntax : \t.connect [ip] [port] [compress] key [key]\n");
+	ShowMessages("\t\te.g : .connect 192.168.1.5 50000 key 8f2d61c0a9b7\n");
+	ShowMessages("\t\t\tdescription : the key is shown by the debuggee ('.listen 50000 external') or specified by it ('.listen 50000 external key 8f2d61c0a9b7')\n");
+	ShowMessages("\t\te.g : .connect 192.168.1.5 50000 compress key 8f2d61c0a9b7\n");
+	ShowMessages("\t\t\tdescription : the debuggee compresses the messages\n");
 	ShowMessages("\t\te.g : .connect local\n");
 }
 void CommandConnect(vector<string> SplittedCommand) {
@@ -160,10 +163,12 @@ void CommandConnect(vector<string> SplittedCommand) {
 
 		return;
 	}
-	else if (SplittedCommand.size() == 3) {
+	else if ((SplittedCommand.size() == 5 && SplittedCommand.at(3) == "key") ||
+		(SplittedCommand.size() == 6 && SplittedCommand.at(3) == "compress" && SplittedCommand.at(4) == "key")) {
 
 		string ip = SplittedCommand.at(1);
 		string port = SplittedCommand.at(2);
+		string key = SplittedCommand.back();
 
 		//
 		// means that probably wants to connect to a remote 
@@ -182,9 +187,15 @@ void CommandConnect(vector<string> SplittedCommand) {
 		}
 
 		//
-		// connect to remote debugger
+		// connect to remote debugger, the next commands are executed by
+		// the debuggee
 		//
-		ShowMessages("local debug remote system\n");
+		if (!RemoteConnect(ip, port, SplittedCommand.size() == 6, key))
+		{
+			return;
+		}
+
+		ShowMessages("connected to the remote system at %s:%s\n", ip.c_str(), port.c_str());
 		g_IsConnectedToDebugger = true;
 
 
@@ -219,6 +230,11 @@ void CommandDisconnect(vector<string> SplittedCommand) {
 	//
 	// Disconnect the session
 	//
+	if (RemoteIsConnected())
+	{
+		RemoteDisconnect();
+	}
+
 	g_IsConnectedToDebugger = false;
 	ShowMessages("successfully disconnected\n");
 
@@ -380,6 +396,16 @@ int _cdecl HyperdbgInterpreter(const char* Command) {
 
 	string FirstCommand = SplittedCommand.front();
 
+	//
+	// The commands are executed by the remote debuggee, except the commands
+	// of the session itself (the messages can be saved to a local trace file)
+	//
+	if (RemoteIsConnected() && FirstCommand.compare(".connect") && FirstCommand.compare(".disconnect") &&
+		FirstCommand.compare("exit") && FirstCommand.compare(".exit") && FirstCommand.compare("clear") &&
+		FirstCommand.compare("cls") && FirstCommand.compare(".cls") && FirstCommand.compare(".tracefile")) {
+		return RemoteSendCommand(Command);
+	}
+
 	if (!FirstCommand.compare("clear") || !FirstCommand.compare("cls") ||
 		!FirstCommand.compare(".cls")) {
 		CommandClearScreen();
@@ -411,6 +437,63 @@ int _cdecl HyperdbgInterpreter(const char* Command) {
 	else if (!FirstCommand.compare("lm")) {
 		CommandLm(SplittedCommand);
 	}
+	else if (!FirstCommand.compare(".logbuffers")) {
+		CommandLogBuffers(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".tracefile")) {
+		CommandTraceFile(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".exitstats")) {
+		CommandExitStats(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".sampling")) {
+		CommandSampling(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".flightrecorder")) {
+		CommandFlightRecorder(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".dirtypages")) {
+		CommandDirtyPages(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".accesses")) {
+		CommandAccesses(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".eventstats")) {
+		CommandEventStats(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".pools")) {
+		CommandPools(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".syscallfilter")) {
+		CommandSyscallFilter(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".syscalltrace")) {
+		CommandSyscallTrace(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".ssdt")) {
+		CommandSsdt(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".startup")) {
+		CommandStartup(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".suspend")) {
+		CommandSuspend(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".resume")) {
+		CommandResume(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".script")) {
+		CommandScript(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".listen")) {
+		CommandListen(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".dump")) {
+		CommandDump(SplittedCommand);
+	}
+	else if (!FirstCommand.compare(".subscribe")) {
+		CommandSubscribe(SplittedCommand);
+	}
 	else if (!FirstCommand.compare("!hiddenhook") ||
 		!FirstCommand.compare("bh")) {
 		CommandHiddenHook(SplittedCommand);
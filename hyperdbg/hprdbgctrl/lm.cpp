@@ -1,31 +1,343 @@
-#include"pch.h"
+/**
+ * @file lm.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief The table of the kernel modules and the resolution of the addresses
+ * @details The modules are cached and sorted by their base, so each address
+ * is resolved with a binary search, the symbols of a module are only loaded
+ * when an address in it is resolved for the first time
+ * @version 0.1
+ * @date 2020-05-24
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+#include <DbgHelp.h>
 
 using namespace std;
 
 #pragma comment(lib,"ntdll.lib")
+#pragma comment(lib,"dbghelp.lib")
 
-// These structures are copied from Process Hacker source code (ntldr.h)
-
-typedef struct _RTL_PROCESS_MODULE_INFORMATION
-{
-	HANDLE Section;
-	PVOID MappedBase;
-	PVOID ImageBase;
-	ULONG ImageSize;
-	ULONG Flags;
-	USHORT LoadOrderIndex;
-	USHORT InitOrderIndex;
-	USHORT LoadCount;
-	USHORT OffsetToFileName;
-	UCHAR FullPathName[256];
-} RTL_PROCESS_MODULE_INFORMATION, * PRTL_PROCESS_MODULE_INFORMATION;
-
-typedef struct _RTL_PROCESS_MODULES
-{
-	ULONG NumberOfModules;
-	RTL_PROCESS_MODULE_INFORMATION Modules[1];
-} RTL_PROCESS_MODULES, * PRTL_PROCESS_MODULES;
+/* Minimum milliseconds between the refreshes of the table because of the unknown addresses */
+#define LM_REFRESH_INTERVAL 1000
 
+/* Start of the kernel addresses (the others are not searched in the table) */
+#define LM_KERNEL_ADDRESS_START 0xffff800000000000
+
+/* Maximum length of the name of a symbol */
+#define LM_MAXIMUM_SYMBOL_NAME 256
+
+//
+// The modules sorted by their base
+//
+vector<LM_MODULE> g_LmModules;
+
+//
+// The resolved addresses (cleared if the table is changed)
+//
+map<UINT64, string> g_LmResolvedAddresses;
+
+//
+// Tick of the last refresh of the table
+//
+ULONGLONG g_LmLastRefreshTick = 0;
+
+//
+// Shows whether the symbol handler is initialized or not
+//
+BOOLEAN g_LmIsSymbolHandlerInitialized = FALSE;
+
+SRWLOCK g_LmLock = SRWLOCK_INIT; // The commands and the thread of messages use the table
+
+/**
+ * @brief Query the list of the kernel modules
+ *
+ * @return PRTL_PROCESS_MODULES The modules (should be freed using VirtualFree)
+ * or NULL if it fails
+ */
+PRTL_PROCESS_MODULES LmQueryKernelModules() {
+
+	NTSTATUS status;
+	PRTL_PROCESS_MODULES ModuleInfo;
+	ULONG BufferSize = 0x10000;
+	ULONG RequiredSize = 0;
+
+	//
+	// The list might grow between the queries, so try again with the
+	// required size
+	//
+	while (TRUE) {
+
+		ModuleInfo = (PRTL_PROCESS_MODULES)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); // Allocate memory for the module list
+
+		if (!ModuleInfo)
+		{
+			ShowMessages("\nUnable to allocate memory for module list (%d)\n", GetLastError());
+			return NULL;
+		}
+
+		status = NtQuerySystemInformation((SYSTEM_INFORMATION_CLASS)11, ModuleInfo, BufferSize, &RequiredSize); // 11 = SystemModuleInformation
+
+		if (NT_SUCCESS(status))
+		{
+			return ModuleInfo;
+		}
+
+		VirtualFree(ModuleInfo, 0, MEM_RELEASE);
+
+		if (status != (NTSTATUS)0xC0000004 || RequiredSize == 0) // 0xC0000004 = STATUS_INFO_LENGTH_MISMATCH
+		{
+			ShowMessages("\nError: Unable to query module list (%#x)\n", status);
+			return NULL;
+		}
+
+		BufferSize = RequiredSize + 0x1000;
+	}
+}
+
+/**
+ * @brief Convert the path of a kernel module to a path in the file system
+ *
+ * @param Path The path (e.g, \SystemRoot\system32\ntoskrnl.exe)
+ * @return string The path in the file system
+ */
+string LmGetFileSystemPath(const string& Path) {
+
+	char Expanded[MAX_PATH];
+
+	if (!Path.compare(0, 12, "\\SystemRoot\\")) {
+		if (ExpandEnvironmentStringsA(("%SystemRoot%" + Path.substr(11)).c_str(), Expanded, sizeof(Expanded)) != 0) {
+			return Expanded;
+		}
+	}
+	else if (!Path.compare(0, 4, "\\??\\")) {
+		return Path.substr(4);
+	}
+
+	return Path;
+}
+
+/**
+ * @brief Refresh the table of the kernel modules
+ * @details The modules that are not changed keep their symbols, the symbols of
+ * the unloaded modules are unloaded and the new modules are added (their
+ * symbols are loaded when they are used), should be called with g_LmLock
+ *
+ * @return BOOLEAN Whether the table is refreshed or not
+ */
+BOOLEAN LmRefreshModulesLocked() {
+
+	PRTL_PROCESS_MODULES ModuleInfo;
+	vector<LM_MODULE> Modules;
+	BOOLEAN IsChanged;
+
+	g_LmLastRefreshTick = GetTickCount64();
+
+	ModuleInfo = LmQueryKernelModules();
+
+	if (!ModuleInfo)
+	{
+		return FALSE;
+	}
+
+	for (ULONG i = 0; i < ModuleInfo->NumberOfModules; i++)
+	{
+		LM_MODULE Module;
+
+		Module.Base = (UINT64)ModuleInfo->Modules[i].ImageBase;
+		Module.Size = ModuleInfo->Modules[i].ImageSize;
+		Module.Name = (char*)ModuleInfo->Modules[i].FullPathName + ModuleInfo->Modules[i].OffsetToFileName;
+		Module.Path = (char*)ModuleInfo->Modules[i].FullPathName;
+		Module.IsSymbolLoaded = FALSE;
+		Module.IsSymbolLoadTried = FALSE;
+
+		Modules.push_back(Module);
+	}
+
+	VirtualFree(ModuleInfo, 0, MEM_RELEASE);
+
+	sort(Modules.begin(), Modules.end(),
+		[](const LM_MODULE& A, const LM_MODULE& B) { return A.Base < B.Base; });
+
+	//
+	// Both of the tables are sorted, so they're merged in one pass
+	//
+	IsChanged = Modules.size() != g_LmModules.size();
+
+	for (size_t i = 0, j = 0; i < g_LmModules.size(); i++)
+	{
+		while (j < Modules.size() && Modules[j].Base < g_LmModules[i].Base) {
+			j++;
+		}
+
+		if (j < Modules.size() && Modules[j].Base == g_LmModules[i].Base &&
+			Modules[j].Size == g_LmModules[i].Size && !Modules[j].Path.compare(g_LmModules[i].Path)) {
+			Modules[j].IsSymbolLoaded = g_LmModules[i].IsSymbolLoaded;
+			Modules[j].IsSymbolLoadTried = g_LmModules[i].IsSymbolLoadTried;
+			continue;
+		}
+
+		IsChanged = TRUE;
+
+		if (g_LmModules[i].IsSymbolLoaded) {
+			SymUnloadModule64(GetCurrentProcess(), g_LmModules[i].Base);
+		}
+	}
+
+	g_LmModules.swap(Modules);
+
+	if (IsChanged) {
+		g_LmResolvedAddresses.clear();
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Refresh the table of the kernel modules
+ *
+ * @return BOOLEAN Whether the table is refreshed or not
+ */
+BOOLEAN LmRefreshModules() {
+
+	BOOLEAN Result;
+
+	AcquireSRWLockExclusive(&g_LmLock);
+	Result = LmRefreshModulesLocked();
+	ReleaseSRWLockExclusive(&g_LmLock);
+
+	return Result;
+}
+
+/**
+ * @brief Find the module of an address
+ * @details The table is refreshed if a kernel address is not in any module
+ * (at most once in each LM_REFRESH_INTERVAL), should be called with g_LmLock
+ *
+ * @param Address The address
+ * @return PLM_MODULE The module or NULL if it's not found
+ */
+PLM_MODULE LmFindModuleLocked(UINT64 Address) {
+
+	for (int Try = 0; Try < 2; Try++)
+	{
+		auto Next = upper_bound(g_LmModules.begin(), g_LmModules.end(), Address,
+			[](UINT64 Value, const LM_MODULE& Module) { return Value < Module.Base; });
+
+		if (Next != g_LmModules.begin() && Address - prev(Next)->Base < prev(Next)->Size) {
+			return &*prev(Next);
+		}
+
+		if (Address < LM_KERNEL_ADDRESS_START ||
+			(g_LmLastRefreshTick != 0 && GetTickCount64() - g_LmLastRefreshTick < LM_REFRESH_INTERVAL) ||
+			!LmRefreshModulesLocked()) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Find the module of an address
+ *
+ * @param Address The address
+ * @param Module The module (copied)
+ * @return BOOLEAN Whether the module is found or not
+ */
+BOOLEAN LmFindModule(UINT64 Address, PLM_MODULE Module) {
+
+	PLM_MODULE Found;
+
+	AcquireSRWLockExclusive(&g_LmLock);
+
+	Found = LmFindModuleLocked(Address);
+
+	if (Found) {
+		*Module = *Found;
+	}
+
+	ReleaseSRWLockExclusive(&g_LmLock);
+
+	return Found != NULL;
+}
+
+/**
+ * @brief Resolve an address to its module and its symbol
+ *
+ * @param Address The address
+ * @return string module!symbol+offset, module+offset (if there is no
+ * symbol) or the address (if there is no module)
+ */
+string LmResolveAddress(UINT64 Address) {
+
+	char Location[MAX_PATH + LM_MAXIMUM_SYMBOL_NAME];
+	CHAR SymbolBuffer[sizeof(SYMBOL_INFO) + LM_MAXIMUM_SYMBOL_NAME];
+	PSYMBOL_INFO Symbol = (PSYMBOL_INFO)SymbolBuffer;
+	DWORD64 Displacement = 0;
+	PLM_MODULE Module;
+
+	//
+	// The addresses of a remote debuggee are not in the modules of this system
+	//
+	if (RemoteIsConnected()) {
+		sprintf_s(Location, sizeof(Location), "%llx", Address);
+		return Location;
+	}
+
+	AcquireSRWLockExclusive(&g_LmLock);
+
+	auto Resolved = g_LmResolvedAddresses.find(Address);
+
+	if (Resolved != g_LmResolvedAddresses.end()) {
+		string Result = Resolved->second;
+
+		ReleaseSRWLockExclusive(&g_LmLock);
+		return Result;
+	}
+
+	Module = LmFindModuleLocked(Address);
+
+	if (!Module) {
+		ReleaseSRWLockExclusive(&g_LmLock);
+
+		sprintf_s(Location, sizeof(Location), "%llx", Address);
+		return Location;
+	}
+
+	//
+	// The symbols are deferred, so loading a module is cheap and its PDB is
+	// only read for the first symbol
+	//
+	if (!g_LmIsSymbolHandlerInitialized) {
+		SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_FAIL_CRITICAL_ERRORS);
+		g_LmIsSymbolHandlerInitialized = SymInitialize(GetCurrentProcess(), NULL, FALSE);
+	}
+
+	if (g_LmIsSymbolHandlerInitialized && !Module->IsSymbolLoadTried) {
+		Module->IsSymbolLoadTried = TRUE;
+		Module->IsSymbolLoaded = SymLoadModuleEx(GetCurrentProcess(), NULL, LmGetFileSystemPath(Module->Path).c_str(),
+			Module->Name.c_str(), Module->Base, Module->Size, NULL, 0) != 0;
+	}
+
+	RtlZeroMemory(SymbolBuffer, sizeof(SymbolBuffer));
+	Symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	Symbol->MaxNameLen = LM_MAXIMUM_SYMBOL_NAME;
+
+	if (Module->IsSymbolLoaded && SymFromAddr(GetCurrentProcess(), Address, &Displacement, Symbol)) {
+		sprintf_s(Location, sizeof(Location), "%s!%s+%llx", Module->Name.c_str(), Symbol->Name, Displacement);
+	}
+	else {
+		sprintf_s(Location, sizeof(Location), "%s+%llx", Module->Name.c_str(), Address - Module->Base);
+	}
+
+	g_LmResolvedAddresses[Address] = Location;
+
+	ReleaseSRWLockExclusive(&g_LmLock);
+
+	return Location;
+}
 
 void CommandLmHelp() {
 	ShowMessages("lm : list kernel modules' base address, size, name and path.\n\n");
@@ -39,10 +351,6 @@ void CommandLmHelp() {
 
 int CommandLm(vector<string> SplittedCommand) {
 
-	NTSTATUS status;
-	ULONG i;
-	char* Search;
-
 	if (SplittedCommand.size() >= 3)
 	{
 		ShowMessages("incorrect use of 'lm'\n\n");
@@ -50,36 +358,32 @@ int CommandLm(vector<string> SplittedCommand) {
 		return -1;
 	}
 
+	AcquireSRWLockExclusive(&g_LmLock);
 
-	PRTL_PROCESS_MODULES ModuleInfo;
-
-	ModuleInfo = (PRTL_PROCESS_MODULES)VirtualAlloc(NULL, 1024 * 1024, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); // Allocate memory for the module list
-
-	if (!ModuleInfo)
-	{
-		ShowMessages("\nUnable to allocate memory for module list (%d)\n", GetLastError());
-		return -1;
-	}
-
-	if (!NT_SUCCESS(status = NtQuerySystemInformation((SYSTEM_INFORMATION_CLASS)11, ModuleInfo, 1024 * 1024, NULL))) // 11 = SystemModuleInformation
+	//
+	// The modules might be loaded or unloaded since the last refresh
+	//
+	if (!LmRefreshModulesLocked())
 	{
-		ShowMessages("\nError: Unable to query module list (%#x)\n", status);
-
-		VirtualFree(ModuleInfo, 0, MEM_RELEASE);
+		ReleaseSRWLockExclusive(&g_LmLock);
 		return -1;
 	}
 
 	ShowMessages("start\t\t\tsize\tname\t\tpath\n\n");
 
-	for (i = 0; i < ModuleInfo->NumberOfModules; i++)
+	for (auto& Module : g_LmModules)
 	{
 		//
 		// Check if we need to search for the module or not
-		// 
+		//
 		if (SplittedCommand.size() == 2)
 		{
-			Search = strstr((char*)ModuleInfo->Modules[i].FullPathName, SplittedCommand.at(1).c_str());
-			if (Search == NULL)
+			string Path = Module.Path;
+
+			transform(Path.begin(), Path.end(), Path.begin(),
+				[](unsigned char c) { return std::tolower(c); });
+
+			if (Path.find(SplittedCommand.at(1)) == string::npos)
 			{
 				//
 				// not found
@@ -88,13 +392,14 @@ int CommandLm(vector<string> SplittedCommand) {
 			}
 		}
 
-		ShowMessages("%16llx\t", ModuleInfo->Modules[i].ImageBase);
-		ShowMessages("%d\t", ModuleInfo->Modules[i].ImageSize);
+		ShowMessages("%16llx\t", Module.Base);
+		ShowMessages("%d\t", Module.Size);
 
-		ShowMessages("%s\t", ModuleInfo->Modules[i].FullPathName + ModuleInfo->Modules[i].OffsetToFileName);
-		ShowMessages("%s\n", ModuleInfo->Modules[i].FullPathName);
+		ShowMessages("%s\t", Module.Name.c_str());
+		ShowMessages("%s\n", Module.Path.c_str());
 	}
 
-	VirtualFree(ModuleInfo, 0, MEM_RELEASE);
+	ReleaseSRWLockExclusive(&g_LmLock);
+
 	return 0;
-}
\ No newline at end of file
+}
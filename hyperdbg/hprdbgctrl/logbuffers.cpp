@@ -0,0 +1,125 @@
+/**
+ * @file logbuffers.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Statistics and policy of the kernel log buffers
+ * @details
+ * @version 0.1
+ * @date 2020-05-02
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandLogBuffersHelp() {
+	ShowMessages(".logbuffers : shows the statistics of the kernel log buffers or changes their policy when they are full.\n\n");
+	ShowMessages("syntax : \t.logbuffers [policy (drop/overwrite/summarize)]\n");
+	ShowMessages("\t\te.g : .logbuffers\n");
+	ShowMessages("\t\t\tdescription : shows the written, dropped and overwritten messages of each buffer\n");
+	ShowMessages("\t\te.g : .logbuffers overwrite\n");
+	ShowMessages("\t\t\tdescription : overwrite the oldest unread messages when a buffer is full\n");
+}
+
+void CommandLogBuffers(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	LOG_BUFFERS_POLICY_REQUEST PolicyRequest = { };
+	PLOG_BUFFERS_STATISTICS Statistics;
+
+	if (SplittedCommand.size() > 2)
+	{
+		ShowMessages("incorrect use of '.logbuffers'\n\n");
+		CommandLogBuffersHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	if (SplittedCommand.size() == 2)
+	{
+		if (!SplittedCommand.at(1).compare("drop")) {
+			PolicyRequest.Policy = LOG_OVERFLOW_DROP_NEWEST;
+		}
+		else if (!SplittedCommand.at(1).compare("overwrite")) {
+			PolicyRequest.Policy = LOG_OVERFLOW_OVERWRITE_OLDEST;
+		}
+		else if (!SplittedCommand.at(1).compare("summarize")) {
+			PolicyRequest.Policy = LOG_OVERFLOW_SUMMARIZE;
+		}
+		else {
+			ShowMessages("incorrect policy '%s'\n\n", SplittedCommand.at(1).c_str());
+			CommandLogBuffersHelp();
+			return;
+		}
+
+		Status = DeviceIoControlSynchronous(
+			Handle,								// Handle to device
+			IOCTL_SET_LOG_BUFFERS_POLICY,		// IO Control code
+			&PolicyRequest,						// Input Buffer to driver.
+			sizeof(LOG_BUFFERS_POLICY_REQUEST),	// Length of input buffer in bytes.
+			NULL,								// Output Buffer from driver.
+			0,									// Length of output buffer in bytes.
+			&ReturnedLength 					// Bytes placed in buffer.
+		);
+
+		if (!Status) {
+			ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		}
+		return;
+	}
+
+	//
+	// The statistics are too big to be on the stack
+	//
+	Statistics = (PLOG_BUFFERS_STATISTICS)malloc(sizeof(LOG_BUFFERS_STATISTICS));
+
+	if (!Statistics)
+	{
+		ShowMessages("Unable to allocate memory for the statistics\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_LOG_BUFFERS_STATISTICS,	// IO Control code
+		NULL,								// Input Buffer to driver.
+		0,									// Length of input buffer in bytes.
+		Statistics,							// Output Buffer from driver.
+		sizeof(LOG_BUFFERS_STATISTICS),		// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(LOG_BUFFERS_STATISTICS)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Statistics);
+		return;
+	}
+
+	ShowMessages("policy : %s\n\n",
+		Statistics->Policy == LOG_OVERFLOW_DROP_NEWEST ? "drop" :
+		Statistics->Policy == LOG_OVERFLOW_OVERWRITE_OLDEST ? "overwrite" : "summarize");
+
+	ShowMessages("core\tmode\t\twritten\t\tdropped\t\toverwritten\tunread bytes\n\n");
+
+	for (UINT32 i = 0; i < Statistics->BufferCount; i++)
+	{
+		ShowMessages("%d\t%s\t%llu\t\t%llu\t\t%llu\t\t%llu\n",
+			i / 2,
+			i % 2 ? "vmx-root" : "non-root",
+			Statistics->Rings[i].WrittenRecords,
+			Statistics->Rings[i].DroppedRecords,
+			Statistics->Rings[i].OverwrittenRecords,
+			Statistics->Rings[i].UnreadBytes);
+	}
+
+	free(Statistics);
+}
@@ -37,6 +37,7 @@
 #include <algorithm>
 #include <iterator>
 #include <vector>
+#include <map>
 #include <time.h>
 #include <string>
 
@@ -46,6 +47,8 @@
 #include "framework.h"
 #include "hprdbgctrl.h"
 #include "Commands.h"
+#include "tracefile.h"
+#include "remote.h"
 
 
 #endif //PCH_H
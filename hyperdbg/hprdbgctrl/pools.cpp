@@ -0,0 +1,93 @@
+/**
+ * @file pools.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the pre-allocated pools of the pool manager
+ * @details
+ * @version 0.1
+ * @date 2020-05-17
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief Names of the intentions of the pools (index is POOL_ALLOCATION_INTENTION)
+ *
+ */
+const char* PoolIntentionNames[] = {
+	"TRACKING_HOOKED_PAGES", "EXEC_TRAMPOLINE", "SPLIT_2MB_PAGING_TO_4KB_PAGE", "DETOUR_HOOK_DETAILS",
+	"EPT_CORE_VIEW_PML2_TABLE", "SPLIT_1GB_PAGING_TO_2MB_PAGE", "SPP_TABLE"
+};
+
+void CommandPoolsHelp() {
+	ShowMessages(".pools : shows the pre-allocated pools of each intention, their watermarks and the failed requests.\n\n");
+	ShowMessages("syntax : \t.pools\n");
+	ShowMessages("\t\te.g : .pools\n");
+	ShowMessages("\t\t\tdescription : shows the pools (the pools that are neither free nor busy are kept by the cores)\n");
+}
+
+void CommandPools(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	POOL_MANAGER_STATISTICS Statistics = { 0 };
+
+	if (SplittedCommand.size() != 1)
+	{
+		ShowMessages("incorrect use of '.pools'\n\n");
+		CommandPoolsHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_POOL_STATISTICS,		// IO Control code
+		NULL,								// Input Buffer to driver.
+		0,									// Length of input buffer in bytes.
+		&Statistics,						// Output Buffer from driver.
+		sizeof(POOL_MANAGER_STATISTICS),	// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(POOL_MANAGER_STATISTICS)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	ShowMessages("%-32s%-10s%-8s%-8s%-8s%-8s%-12s%s\n", "intention", "size", "pools", "free", "busy", "failed", "watermarks", "replenished");
+
+	for (UINT32 i = 0; i < Statistics.CountOfIntentions; i++)
+	{
+		PPOOL_INTENTION_STATISTICS Intention = &Statistics.Intentions[i];
+		char Watermarks[32];
+
+		sprintf_s(Watermarks, sizeof(Watermarks), "%d-%d", Intention->LowWatermark, Intention->HighWatermark);
+
+		ShowMessages("%-32s%-10llx%-8d%-8d%-8d%-8d%-12s%llu\n",
+			i < sizeof(PoolIntentionNames) / sizeof(PoolIntentionNames[0]) ? PoolIntentionNames[i] : "unknown",
+			Intention->Size,
+			Intention->Pools,
+			Intention->FreePools,
+			Intention->BusyPools,
+			Intention->FailedRequests,
+			Watermarks,
+			Intention->ReplenishedPools);
+	}
+
+	ShowMessages("\n%d replenishments are performed\n", Statistics.CountOfReplenishments);
+	ShowMessages("the lock of the pools is acquired %llu times, %llu of them waited for %llu cycles\n",
+		Statistics.LockAcquisitions,
+		Statistics.LockContendedAcquisitions,
+		Statistics.LockSpinCycles);
+}
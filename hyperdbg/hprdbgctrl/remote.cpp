@@ -0,0 +1,1269 @@
+/**
+ * @file remote.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Remote debugging over TCP (the agent of the target and the debugger)
+ * @details The agent (.listen) streams the kernel messages in big frames on
+ * the data channel, and executes the commands of the command channel, the
+ * debugger (.connect [ip] [port]) shows the messages of the frames and sends
+ * the commands to the agent, the agent only listens on the loopback unless
+ * it's external, and only accepts the connections that know its key
+ * @version 0.1
+ * @date 2020-05-25
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <bcrypt.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "bcrypt.lib")
+
+using namespace std;
+
+extern bool g_IsConnectedToDebugger;
+
+BOOLEAN RemoteIsWinsockInitialized;
+
+//
+// The agent (target), the threads of the messages fill a frame while the
+// stream thread sends the other one
+//
+SRWLOCK RemoteAgentLock = SRWLOCK_INIT;				// The threads of messages, the stream thread and the listen thread use the frames
+CONDITION_VARIABLE RemoteAgentFrameSent = CONDITION_VARIABLE_INIT;
+SOCKET RemoteAgentListenSocket = INVALID_SOCKET;
+SOCKET RemoteAgentDataSocket = INVALID_SOCKET;
+SOCKET RemoteAgentCommandSocket = INVALID_SOCKET;
+HANDLE RemoteAgentThreads[2];						// The listen thread and the stream thread
+HANDLE RemoteAgentFrameReady;						// A frame is queued to be sent
+USHORT RemoteAgentPort;
+BOOLEAN RemoteAgentIsExternal;						// Listens on all the addresses instead of the loopback
+string RemoteAgentKey;								// The debugger should prove that it knows this key
+BOOLEAN RemoteAgentQuiet;							// Don't show the messages that are sent to the debugger
+BOOLEAN RemoteAgentCompress;
+BOOLEAN RemoteAgentNeedsPreamble;					// The known binary formats should be sent before the first record
+BOOLEAN RemoteAgentStopping;
+char* RemoteAgentFrames[2];
+BYTE* RemoteAgentCompressBuffer;
+UINT32 RemoteAgentFillIndex;						// The frame that is being filled (the other one is being sent)
+UINT32 RemoteAgentFillLength;
+UINT32 RemoteAgentFillCount;
+UINT32 RemoteAgentPendingLength;					// Length of the frame that is being sent (zero if there isn't any)
+UINT32 RemoteAgentPendingCount;
+UINT64 RemoteAgentFrameCount;
+UINT64 RemoteAgentRecordCount;
+
+thread_local SOCKET RemoteAgentOutputSocket = INVALID_SOCKET; // Set in the thread that executes a command of the debugger
+thread_local string* RemoteAgentOutput;						// The result of that command which is not sent yet
+
+//
+// The debugger
+//
+SRWLOCK RemoteDebuggerLock = SRWLOCK_INIT;			// The sockets are changed or a command is sent
+SOCKET RemoteDebuggerDataSocket = INVALID_SOCKET;
+SOCKET RemoteDebuggerCommandSocket = INVALID_SOCKET;
+HANDLE RemoteDebuggerReceiveThread;
+
+/**
+ * @brief Initialize winsock (once)
+ *
+ * @return BOOLEAN Whether winsock is initialized or not
+ */
+BOOLEAN RemoteInitializeWinsock() {
+
+	WSADATA WsaData;
+
+	if (!RemoteIsWinsockInitialized)
+	{
+		if (WSAStartup(MAKEWORD(2, 2), &WsaData) != 0)
+		{
+			ShowMessages("unable to initialize winsock\n");
+			return FALSE;
+		}
+
+		RemoteIsWinsockInitialized = TRUE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Send a buffer completely
+ *
+ * @param Socket
+ * @param Buffer
+ * @param Length
+ * @return BOOLEAN Whether the buffer is sent or not
+ */
+BOOLEAN RemoteSendAll(SOCKET Socket, const void* Buffer, UINT32 Length) {
+
+	const char* Current = (const char*)Buffer;
+
+	while (Length != 0)
+	{
+		int Sent = send(Socket, Current, (int)min(Length, (UINT32)MAXINT), 0);
+
+		if (Sent <= 0)
+		{
+			return FALSE;
+		}
+
+		Current += Sent;
+		Length -= Sent;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Receive a buffer completely
+ *
+ * @param Socket
+ * @param Buffer
+ * @param Length
+ * @return BOOLEAN Whether the buffer is received or not (the connection is closed)
+ */
+BOOLEAN RemoteReceiveAll(SOCKET Socket, void* Buffer, UINT32 Length) {
+
+	char* Current = (char*)Buffer;
+
+	while (Length != 0)
+	{
+		int Received = recv(Socket, Current, (int)min(Length, (UINT32)MAXINT), 0);
+
+		if (Received <= 0)
+		{
+			return FALSE;
+		}
+
+		Current += Received;
+		Length -= Received;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Send a packet of the command channel
+ *
+ * @param Socket
+ * @param Type REMOTE_PACKET_*
+ * @param Status
+ * @param Text
+ * @param Length Length of the text (at most REMOTE_MAXIMUM_COMMAND_LENGTH)
+ * @return BOOLEAN Whether the packet is sent or not
+ */
+BOOLEAN RemoteSendPacket(SOCKET Socket, UINT32 Type, UINT32 Status, const char* Text, UINT32 Length) {
+
+	char Packet[sizeof(REMOTE_PACKET_HEADER) + REMOTE_MAXIMUM_COMMAND_LENGTH];
+	PREMOTE_PACKET_HEADER Header = (PREMOTE_PACKET_HEADER)Packet;
+
+	Header->Magic = REMOTE_MAGIC;
+	Header->Type = Type;
+	Header->Length = Length;
+	Header->Status = Status;
+
+	if (Length != 0)
+	{
+		memcpy(Packet + sizeof(REMOTE_PACKET_HEADER), Text, Length);
+	}
+
+	//
+	// One send for the packet, the channel is TCP_NODELAY
+	//
+	return RemoteSendAll(Socket, Packet, sizeof(REMOTE_PACKET_HEADER) + Length);
+}
+
+/**
+ * @brief Compute the proof of a hello
+ *
+ * @param Key The key of the agent
+ * @param Nonce The nonce of the challenge
+ * @param Channel The channel of the hello
+ * @param Flags The flags of the hello
+ * @param Proof [Out] HMAC-SHA256 of the nonce, the channel and the flags
+ * @return BOOLEAN Whether the proof is computed or not
+ */
+BOOLEAN RemoteComputeProof(const string& Key, const BYTE* Nonce, UINT32 Channel, UINT32 Flags, BYTE* Proof) {
+
+	BCRYPT_ALG_HANDLE Algorithm = NULL;
+	BCRYPT_HASH_HANDLE Hash = NULL;
+	BOOLEAN Result = FALSE;
+
+	if (BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&Algorithm, BCRYPT_SHA256_ALGORITHM, NULL, BCRYPT_ALG_HANDLE_HMAC_FLAG)) &&
+		BCRYPT_SUCCESS(BCryptCreateHash(Algorithm, &Hash, NULL, 0, (PUCHAR)Key.c_str(), (ULONG)Key.size(), 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(Hash, (PUCHAR)Nonce, REMOTE_NONCE_SIZE, 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(Hash, (PUCHAR)&Channel, sizeof(Channel), 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(Hash, (PUCHAR)&Flags, sizeof(Flags), 0)) &&
+		BCRYPT_SUCCESS(BCryptFinishHash(Hash, Proof, REMOTE_PROOF_SIZE, 0)))
+	{
+		Result = TRUE;
+	}
+
+	if (Hash != NULL)
+	{
+		BCryptDestroyHash(Hash);
+	}
+
+	if (Algorithm != NULL)
+	{
+		BCryptCloseAlgorithmProvider(Algorithm, 0);
+	}
+
+	return Result;
+}
+
+//////////////////////////////////////////////////
+//				    The Agent                   //
+//////////////////////////////////////////////////
+
+/**
+ * @brief Queue the frame that is being filled to be sent
+ * @details The caller should hold RemoteAgentLock and there shouldn't be
+ * any pending frame
+ *
+ * @return VOID
+ */
+void RemoteAgentQueueFrame() {
+
+	RemoteAgentPendingLength = RemoteAgentFillLength;
+	RemoteAgentPendingCount = RemoteAgentFillCount;
+	RemoteAgentFillIndex ^= 1;
+	RemoteAgentFillLength = 0;
+	RemoteAgentFillCount = 0;
+
+	SetEvent(RemoteAgentFrameReady);
+}
+
+/**
+ * @brief Add a record to the frame that is being filled
+ * @details The caller should hold RemoteAgentLock
+ *
+ * @param PacketHeader Header of the record
+ * @param Body Body of the record
+ * @return VOID
+ */
+void RemoteAgentAppendRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body) {
+
+	UINT32 Length = sizeof(LOG_BATCH_PACKET_HEADER) + PacketHeader->Length;
+
+	if (RemoteAgentFillLength + Length > REMOTE_FRAME_SIZE)
+	{
+		//
+		// Wait for the previous frame, so the messages remain in the kernel
+		// buffers (and their overflow policy is applied) instead of losing them here
+		//
+		while (RemoteAgentPendingLength != 0 && RemoteAgentDataSocket != INVALID_SOCKET)
+		{
+			SleepConditionVariableSRW(&RemoteAgentFrameSent, &RemoteAgentLock, INFINITE, 0);
+		}
+
+		if (RemoteAgentDataSocket == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		RemoteAgentQueueFrame();
+	}
+
+	char* Frame = RemoteAgentFrames[RemoteAgentFillIndex];
+
+	memcpy(Frame + RemoteAgentFillLength, PacketHeader, sizeof(LOG_BATCH_PACKET_HEADER));
+	memcpy(Frame + RemoteAgentFillLength + sizeof(LOG_BATCH_PACKET_HEADER), Body, PacketHeader->Length);
+
+	RemoteAgentFillLength += Length;
+	RemoteAgentFillCount++;
+}
+
+/**
+ * @brief Send a kernel message to the remote debugger (if there is any)
+ *
+ * @param PacketHeader Header of the message
+ * @param Body Body of the message
+ * @return BOOLEAN Whether the message should be shown too or not
+ */
+BOOLEAN RemoteSendRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body) {
+
+	BOOLEAN Show = TRUE;
+
+	//
+	// Nothing to do if there is no debugger, the socket is checked without
+	// the lock as most of the time there is no debugger
+	//
+	if (RemoteAgentDataSocket == INVALID_SOCKET)
+	{
+		return TRUE;
+	}
+
+	AcquireSRWLockExclusive(&RemoteAgentLock);
+
+	if (RemoteAgentDataSocket != INVALID_SOCKET)
+	{
+		if (RemoteAgentNeedsPreamble)
+		{
+			RemoteAgentNeedsPreamble = FALSE;
+			TraceFileBuildPreamble(RemoteAgentAppendRecord);
+		}
+
+		RemoteAgentAppendRecord(PacketHeader, Body);
+
+		//
+		// The formats and the calibration are still needed for the next messages
+		//
+		Show = !RemoteAgentQuiet ||
+			PacketHeader->OperationCode == OPERATION_LOG_BINARY_FORMAT_DEFINITION ||
+			PacketHeader->OperationCode == OPERATION_LOG_TIME_CALIBRATION;
+	}
+
+	ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+	return Show;
+}
+
+/**
+ * @brief Send the frames to the debugger
+ * @details The frame that is being filled is sent if it's not sent in
+ * REMOTE_FLUSH_INTERVAL, so the messages are not delayed when there are a few
+ *
+ * @param Data
+ * @return DWORD
+ */
+DWORD WINAPI RemoteAgentStreamThread(void* Data) {
+
+	REMOTE_FRAME_HEADER Header = { 0 };
+	WSABUF Buffers[2];
+	DWORD Sent;
+
+	while (!RemoteAgentStopping)
+	{
+		WaitForSingleObject(RemoteAgentFrameReady, REMOTE_FLUSH_INTERVAL);
+
+		AcquireSRWLockExclusive(&RemoteAgentLock);
+
+		if (RemoteAgentPendingLength == 0 && RemoteAgentFillLength != 0 && RemoteAgentDataSocket != INVALID_SOCKET)
+		{
+			RemoteAgentQueueFrame();
+		}
+
+		SOCKET Socket = RemoteAgentDataSocket;
+		char* Frame = RemoteAgentFrames[RemoteAgentFillIndex ^ 1];
+		UINT32 Length = RemoteAgentPendingLength;
+		BOOLEAN Compress = RemoteAgentCompress;
+
+		Header.Magic = REMOTE_MAGIC;
+		Header.Flags = 0;
+		Header.RecordCount = RemoteAgentPendingCount;
+		Header.UncompressedLength = Length;
+
+		ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+		if (Length == 0)
+		{
+			continue;
+		}
+
+		if (Socket != INVALID_SOCKET)
+		{
+			UINT32 StoredLength = 0;
+
+			if (Compress)
+			{
+				StoredLength = TraceFileCompressBlock((BYTE*)Frame, Length, RemoteAgentCompressBuffer, LZ4_COMPRESS_BOUND(REMOTE_FRAME_SIZE));
+			}
+
+			if (StoredLength != 0 && StoredLength < Length)
+			{
+				Header.Flags = REMOTE_FLAG_COMPRESSED;
+				Buffers[1].buf = (char*)RemoteAgentCompressBuffer;
+			}
+			else
+			{
+				StoredLength = Length;
+				Buffers[1].buf = Frame;
+			}
+
+			Header.StoredLength = StoredLength;
+			Buffers[0].buf = (char*)&Header;
+			Buffers[0].len = sizeof(REMOTE_FRAME_HEADER);
+			Buffers[1].len = StoredLength;
+
+			//
+			// The socket is blocking, so all of the frame is sent or it fails
+			//
+			if (WSASend(Socket, Buffers, 2, &Sent, 0, NULL, NULL) != 0)
+			{
+				BOOLEAN IsDisconnected = FALSE;
+
+				AcquireSRWLockExclusive(&RemoteAgentLock);
+
+				//
+				// The socket might be replaced by a new connection of the debugger
+				//
+				if (RemoteAgentDataSocket == Socket)
+				{
+					RemoteAgentDataSocket = INVALID_SOCKET;
+					IsDisconnected = TRUE;
+				}
+
+				ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+				if (IsDisconnected)
+				{
+					closesocket(Socket);
+					ShowMessages("the remote debugger is disconnected\n");
+				}
+			}
+			else
+			{
+				RemoteAgentFrameCount++;
+				RemoteAgentRecordCount += Header.RecordCount;
+			}
+		}
+
+		AcquireSRWLockExclusive(&RemoteAgentLock);
+
+		RemoteAgentPendingLength = 0;
+		RemoteAgentPendingCount = 0;
+		WakeAllConditionVariable(&RemoteAgentFrameSent);
+
+		ReleaseSRWLockExclusive(&RemoteAgentLock);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send the result of the command that is being executed
+ *
+ * @param All Whether the whole result should be sent or only the full pieces
+ * @return VOID
+ */
+void RemoteAgentFlushOutput(BOOLEAN All) {
+
+	size_t Offset = 0;
+
+	while (RemoteAgentOutput->size() - Offset >= (All ? 1 : REMOTE_MAXIMUM_COMMAND_LENGTH))
+	{
+		UINT32 Length = (UINT32)min(RemoteAgentOutput->size() - Offset, (size_t)REMOTE_MAXIMUM_COMMAND_LENGTH);
+
+		RemoteSendPacket(RemoteAgentOutputSocket, REMOTE_PACKET_OUTPUT, 0, RemoteAgentOutput->c_str() + Offset, Length);
+		Offset += Length;
+	}
+
+	RemoteAgentOutput->erase(0, Offset);
+}
+
+/**
+ * @brief Keep a message if it's a result of a command of the remote debugger
+ * @details It's called by ShowMessages, only the thread that executes
+ * the commands of the debugger keeps its messages
+ *
+ * @param Message
+ * @return BOOLEAN Whether the message is kept (it shouldn't be shown) or not
+ */
+BOOLEAN RemoteCaptureOutput(const char* Message) {
+
+	if (RemoteAgentOutputSocket == INVALID_SOCKET)
+	{
+		return FALSE;
+	}
+
+	RemoteAgentOutput->append(Message);
+
+	if (RemoteAgentOutput->size() >= REMOTE_MAXIMUM_COMMAND_LENGTH)
+	{
+		RemoteAgentFlushOutput(FALSE);
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Execute the commands of the debugger
+ *
+ * @param Data The socket of the command channel
+ * @return DWORD
+ */
+DWORD WINAPI RemoteAgentCommandThread(void* Data) {
+
+	SOCKET Socket = (SOCKET)Data;
+	REMOTE_PACKET_HEADER Header;
+	char Command[REMOTE_MAXIMUM_COMMAND_LENGTH + 1];
+	string Output;
+
+	while (RemoteReceiveAll(Socket, &Header, sizeof(REMOTE_PACKET_HEADER)))
+	{
+		if (Header.Magic != REMOTE_MAGIC || Header.Type != REMOTE_PACKET_COMMAND || Header.Length > REMOTE_MAXIMUM_COMMAND_LENGTH)
+		{
+			ShowMessages("invalid packet from the remote debugger\n");
+			break;
+		}
+
+		if (!RemoteReceiveAll(Socket, Command, Header.Length))
+		{
+			break;
+		}
+
+		Command[Header.Length] = '\0';
+
+		//
+		// The messages of the command are sent to the debugger instead of showing them
+		//
+		RemoteAgentOutput = &Output;
+		RemoteAgentOutputSocket = Socket;
+
+		int Status = HyperdbgInterpreter(Command);
+
+		RemoteAgentFlushOutput(TRUE);
+		RemoteAgentOutputSocket = INVALID_SOCKET;
+		RemoteAgentOutput = NULL;
+
+		if (!RemoteSendPacket(Socket, REMOTE_PACKET_COMPLETE, (UINT32)Status, NULL, 0))
+		{
+			break;
+		}
+	}
+
+	AcquireSRWLockExclusive(&RemoteAgentLock);
+
+	if (RemoteAgentCommandSocket == Socket)
+	{
+		RemoteAgentCommandSocket = INVALID_SOCKET;
+	}
+
+	ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+	closesocket(Socket);
+	return 0;
+}
+
+/**
+ * @brief Accept the connections of the debugger
+ * @details A new connection of a channel replaces the previous one, so
+ * a debugger can connect again if its connection is lost, the connections
+ * that don't answer the challenge by the key are closed
+ *
+ * @param Data
+ * @return DWORD
+ */
+DWORD WINAPI RemoteAgentListenThread(void* Data) {
+
+	REMOTE_CHALLENGE Challenge = { 0 };
+	REMOTE_HELLO Hello;
+	BYTE Proof[REMOTE_PROOF_SIZE];
+	BYTE Difference;
+	DWORD Timeout;
+	SOCKET OldSocket;
+
+	Challenge.Magic = REMOTE_MAGIC;
+	Challenge.Version = REMOTE_VERSION;
+
+	while (!RemoteAgentStopping)
+	{
+		SOCKET Socket = accept(RemoteAgentListenSocket, NULL, NULL);
+
+		if (Socket == INVALID_SOCKET)
+		{
+			//
+			// The listen socket is closed (.listen close)
+			//
+			break;
+		}
+
+		//
+		// The debugger should answer the challenge immediately
+		//
+		Timeout = REMOTE_HELLO_TIMEOUT;
+		setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+
+		if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, Challenge.Nonce, REMOTE_NONCE_SIZE, BCRYPT_USE_SYSTEM_PREFERRED_RNG)) ||
+			!RemoteSendAll(Socket, &Challenge, sizeof(REMOTE_CHALLENGE)) ||
+			!RemoteReceiveAll(Socket, &Hello, sizeof(REMOTE_HELLO)) || Hello.Magic != REMOTE_MAGIC || Hello.Version != REMOTE_VERSION ||
+			!RemoteComputeProof(RemoteAgentKey, Challenge.Nonce, Hello.Channel, Hello.Flags, Proof))
+		{
+			closesocket(Socket);
+			continue;
+		}
+
+		//
+		// Compared in constant time
+		//
+		Difference = 0;
+
+		for (UINT32 i = 0; i < REMOTE_PROOF_SIZE; i++)
+		{
+			Difference |= Proof[i] ^ Hello.Proof[i];
+		}
+
+		//
+		// The debugger waits for the magic before using the channel
+		//
+		if (Difference != 0 || !RemoteSendAll(Socket, &Challenge.Magic, sizeof(UINT32)))
+		{
+			ShowMessages("a connection with an incorrect key is rejected\n");
+			closesocket(Socket);
+			continue;
+		}
+
+		Timeout = 0;
+		setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+
+		if (Hello.Channel == REMOTE_CHANNEL_DATA)
+		{
+			int BufferSize = REMOTE_SOCKET_BUFFER_SIZE;
+			setsockopt(Socket, SOL_SOCKET, SO_SNDBUF, (const char*)&BufferSize, sizeof(BufferSize));
+
+			AcquireSRWLockExclusive(&RemoteAgentLock);
+
+			OldSocket = RemoteAgentDataSocket;
+			RemoteAgentDataSocket = Socket;
+			RemoteAgentCompress = (Hello.Flags & REMOTE_FLAG_COMPRESSED) != 0;
+			RemoteAgentNeedsPreamble = TRUE;
+			RemoteAgentFillLength = 0;
+			RemoteAgentFillCount = 0;
+
+			ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+			if (OldSocket != INVALID_SOCKET)
+			{
+				closesocket(OldSocket);
+			}
+
+			ShowMessages("the remote debugger is connected\n");
+		}
+		else if (Hello.Channel == REMOTE_CHANNEL_COMMAND)
+		{
+			BOOL NoDelay = TRUE;
+			setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+
+			AcquireSRWLockExclusive(&RemoteAgentLock);
+
+			OldSocket = RemoteAgentCommandSocket;
+			RemoteAgentCommandSocket = Socket;
+
+			ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+			//
+			// The thread of the previous connection closes its socket
+			//
+			if (OldSocket != INVALID_SOCKET)
+			{
+				shutdown(OldSocket, SD_BOTH);
+			}
+
+			HANDLE Thread = CreateThread(NULL, 0, RemoteAgentCommandThread, (void*)Socket, 0, NULL);
+
+			if (Thread == NULL)
+			{
+				AcquireSRWLockExclusive(&RemoteAgentLock);
+				RemoteAgentCommandSocket = INVALID_SOCKET;
+				ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+				closesocket(Socket);
+				continue;
+			}
+
+			//
+			// The commands (e.g. breakpoints) shouldn't wait for the threads of messages
+			//
+			SetThreadPriority(Thread, THREAD_PRIORITY_ABOVE_NORMAL);
+			CloseHandle(Thread);
+		}
+		else
+		{
+			closesocket(Socket);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the agent and disconnect the debugger
+ *
+ * @return VOID
+ */
+void RemoteAgentStop() {
+
+	SOCKET DataSocket;
+	SOCKET CommandSocket;
+
+	RemoteAgentStopping = TRUE;
+
+	if (RemoteAgentListenSocket != INVALID_SOCKET)
+	{
+		closesocket(RemoteAgentListenSocket);
+		RemoteAgentListenSocket = INVALID_SOCKET;
+	}
+
+	AcquireSRWLockExclusive(&RemoteAgentLock);
+
+	DataSocket = RemoteAgentDataSocket;
+	CommandSocket = RemoteAgentCommandSocket;
+	RemoteAgentDataSocket = INVALID_SOCKET;
+	RemoteAgentCommandSocket = INVALID_SOCKET;
+	WakeAllConditionVariable(&RemoteAgentFrameSent);
+
+	ReleaseSRWLockExclusive(&RemoteAgentLock);
+
+	if (DataSocket != INVALID_SOCKET)
+	{
+		closesocket(DataSocket);
+	}
+
+	if (CommandSocket != INVALID_SOCKET)
+	{
+		shutdown(CommandSocket, SD_BOTH);
+	}
+
+	if (RemoteAgentFrameReady != NULL)
+	{
+		SetEvent(RemoteAgentFrameReady);
+	}
+
+	for (UINT32 i = 0; i < 2; i++)
+	{
+		if (RemoteAgentThreads[i] != NULL)
+		{
+			WaitForSingleObject(RemoteAgentThreads[i], INFINITE);
+			CloseHandle(RemoteAgentThreads[i]);
+			RemoteAgentThreads[i] = NULL;
+		}
+	}
+
+	if (RemoteAgentFrameReady != NULL)
+	{
+		CloseHandle(RemoteAgentFrameReady);
+		RemoteAgentFrameReady = NULL;
+	}
+
+	free(RemoteAgentFrames[0]);
+	free(RemoteAgentFrames[1]);
+	free(RemoteAgentCompressBuffer);
+	RemoteAgentFrames[0] = RemoteAgentFrames[1] = NULL;
+	RemoteAgentCompressBuffer = NULL;
+	RemoteAgentKey.clear();
+	RemoteAgentFillLength = RemoteAgentFillCount = 0;
+	RemoteAgentPendingLength = RemoteAgentPendingCount = 0;
+
+	RemoteAgentStopping = FALSE;
+}
+
+/**
+ * @brief Start the agent
+ *
+ * @param Port The port that the debugger connects to
+ * @param Quiet Whether the sent messages should be shown too
+ * @param External Whether to listen on all the addresses instead of the loopback
+ * @param Key The key that the debugger should know
+ * @return BOOLEAN Whether the agent is started or not
+ */
+BOOLEAN RemoteAgentStart(USHORT Port, BOOLEAN Quiet, BOOLEAN External, const string& Key) {
+
+	SOCKADDR_IN Address = { 0 };
+
+	if (!RemoteInitializeWinsock())
+	{
+		return FALSE;
+	}
+
+	RemoteAgentFrames[0] = (char*)malloc(REMOTE_FRAME_SIZE);
+	RemoteAgentFrames[1] = (char*)malloc(REMOTE_FRAME_SIZE);
+	RemoteAgentCompressBuffer = (BYTE*)malloc(LZ4_COMPRESS_BOUND(REMOTE_FRAME_SIZE));
+	RemoteAgentFrameReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (!RemoteAgentFrames[0] || !RemoteAgentFrames[1] || !RemoteAgentCompressBuffer || !RemoteAgentFrameReady)
+	{
+		ShowMessages("insufficient memory for the frames of the messages\n");
+		RemoteAgentStop();
+		return FALSE;
+	}
+
+	//
+	// The key is set before the listen thread uses it
+	//
+	RemoteAgentKey = Key;
+
+	RemoteAgentListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	Address.sin_family = AF_INET;
+	Address.sin_addr.s_addr = htonl(External ? INADDR_ANY : INADDR_LOOPBACK);
+	Address.sin_port = htons(Port);
+
+	if (RemoteAgentListenSocket == INVALID_SOCKET ||
+		bind(RemoteAgentListenSocket, (SOCKADDR*)&Address, sizeof(Address)) != 0 ||
+		listen(RemoteAgentListenSocket, SOMAXCONN) != 0)
+	{
+		ShowMessages("unable to listen on port %d (%x)\n", Port, WSAGetLastError());
+		RemoteAgentStop();
+		return FALSE;
+	}
+
+	RemoteAgentPort = Port;
+	RemoteAgentQuiet = Quiet;
+	RemoteAgentIsExternal = External;
+	RemoteAgentFrameCount = 0;
+	RemoteAgentRecordCount = 0;
+
+	RemoteAgentThreads[0] = CreateThread(NULL, 0, RemoteAgentListenThread, NULL, 0, NULL);
+	RemoteAgentThreads[1] = CreateThread(NULL, 0, RemoteAgentStreamThread, NULL, 0, NULL);
+
+	if (RemoteAgentThreads[0] == NULL || RemoteAgentThreads[1] == NULL)
+	{
+		ShowMessages("unable to create the threads of the agent (%x)\n", GetLastError());
+		RemoteAgentStop();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void CommandListenHelp() {
+	ShowMessages(".listen : waits for a remote debugger to debug this system (the debugger uses '.connect [ip] [port] key [key]').\n\n");
+	ShowMessages("syntax : \t.listen [port] [quiet] [external] [key [key]]\n");
+	ShowMessages("syntax : \t.listen close\n");
+	ShowMessages("\t\te.g : .listen 50000\n");
+	ShowMessages("\t\t\tdescription : the debugger connects to port 50000 of the loopback (it's also the default port), with the key that is shown\n");
+	ShowMessages("\t\te.g : .listen 50000 quiet\n");
+	ShowMessages("\t\t\tdescription : the messages are only sent to the debugger without showing them\n");
+	ShowMessages("\t\te.g : .listen 50000 external key 8f2d61c0a9b7\n");
+	ShowMessages("\t\t\tdescription : the debugger connects from another system with the key 8f2d61c0a9b7\n");
+	ShowMessages("\t\te.g : .listen close\n");
+	ShowMessages("\t\t\tdescription : disconnects the debugger and stops listening\n");
+}
+
+void CommandListen(vector<string> SplittedCommand) {
+
+	UINT32 Port = REMOTE_DEFAULT_PORT;
+	BOOLEAN Quiet = FALSE;
+	BOOLEAN External = FALSE;
+	string Key;
+	BYTE Random[REMOTE_GENERATED_KEY_SIZE];
+	char Hex[3];
+
+	if (SplittedCommand.size() == 2 && !SplittedCommand.at(1).compare("close"))
+	{
+		if (RemoteAgentThreads[0] == NULL)
+		{
+			ShowMessages("the agent is not listening\n");
+			return;
+		}
+
+		RemoteAgentStop();
+		ShowMessages("the agent is stopped\n");
+		return;
+	}
+
+	for (size_t i = 1; i < SplittedCommand.size(); i++)
+	{
+		if (!SplittedCommand.at(i).compare("quiet")) {
+			Quiet = TRUE;
+		}
+		else if (!SplittedCommand.at(i).compare("external")) {
+			External = TRUE;
+		}
+		else if (!SplittedCommand.at(i).compare("key") && i + 1 < SplittedCommand.size()) {
+			Key = SplittedCommand.at(++i);
+		}
+		else if (i == 1 && IsNumber(SplittedCommand.at(i)) && stoi(SplittedCommand.at(i)) > 0 && stoi(SplittedCommand.at(i)) <= 65535) {
+			Port = stoi(SplittedCommand.at(i));
+		}
+		else {
+			ShowMessages("incorrect use of '.listen'\n\n");
+			CommandListenHelp();
+			return;
+		}
+	}
+
+	if (RemoteAgentThreads[0] != NULL)
+	{
+		ShowMessages("listening on port %d of %s, %s, %llu frames (%llu messages) are sent\n", RemoteAgentPort,
+			RemoteAgentIsExternal ? "all the addresses" : "the loopback",
+			RemoteAgentDataSocket != INVALID_SOCKET ? "the debugger is connected" : "there is no debugger",
+			RemoteAgentFrameCount, RemoteAgentRecordCount);
+		return;
+	}
+
+	//
+	// The connections are always authenticated, a random key is made if
+	// it's not specified
+	//
+	if (Key.empty())
+	{
+		if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, Random, sizeof(Random), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+		{
+			ShowMessages("unable to generate the key of the agent\n");
+			return;
+		}
+
+		for (UINT32 i = 0; i < sizeof(Random); i++)
+		{
+			sprintf_s(Hex, sizeof(Hex), "%02x", Random[i]);
+			Key.append(Hex);
+		}
+	}
+
+	if (RemoteAgentStart((USHORT)Port, Quiet, External, Key))
+	{
+		//
+		// The commands of the debugger are executed on this system
+		//
+		g_IsConnectedToDebugger = true;
+		ShowMessages("listening on port %d of %s, the key of the debugger is %s\n", Port,
+			External ? "all the addresses" : "the loopback", Key.c_str());
+	}
+}
+
+//////////////////////////////////////////////////
+//				   The Debugger                 //
+//////////////////////////////////////////////////
+
+/**
+ * @brief Open a channel to the agent
+ *
+ * @param Address Address of the agent
+ * @param Channel REMOTE_CHANNEL_DATA or REMOTE_CHANNEL_COMMAND
+ * @param Flags Flags of the hello
+ * @param Key The key of the agent (the challenge is answered by it)
+ * @return SOCKET The socket of the channel or INVALID_SOCKET
+ */
+SOCKET RemoteOpenChannel(PADDRINFOA Address, UINT32 Channel, UINT32 Flags, const string& Key) {
+
+	REMOTE_CHALLENGE Challenge;
+	REMOTE_HELLO Hello = { 0 };
+	UINT32 Accepted = 0;
+	DWORD Timeout = REMOTE_HELLO_TIMEOUT;
+	SOCKET Socket = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+
+	if (Socket == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	//
+	// The buffer is set before connecting, so it's used for the window of the connection
+	//
+	if (Channel == REMOTE_CHANNEL_DATA)
+	{
+		int BufferSize = REMOTE_SOCKET_BUFFER_SIZE;
+		setsockopt(Socket, SOL_SOCKET, SO_RCVBUF, (const char*)&BufferSize, sizeof(BufferSize));
+	}
+	else
+	{
+		BOOL NoDelay = TRUE;
+		setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+	}
+
+	Hello.Magic = REMOTE_MAGIC;
+	Hello.Version = REMOTE_VERSION;
+	Hello.Channel = Channel;
+	Hello.Flags = Flags;
+
+	setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+
+	if (connect(Socket, Address->ai_addr, (int)Address->ai_addrlen) != 0 ||
+		!RemoteReceiveAll(Socket, &Challenge, sizeof(REMOTE_CHALLENGE)) ||
+		Challenge.Magic != REMOTE_MAGIC || Challenge.Version != REMOTE_VERSION ||
+		!RemoteComputeProof(Key, Challenge.Nonce, Channel, Flags, Hello.Proof) ||
+		!RemoteSendAll(Socket, &Hello, sizeof(REMOTE_HELLO)) ||
+		!RemoteReceiveAll(Socket, &Accepted, sizeof(UINT32)) || Accepted != REMOTE_MAGIC)
+	{
+		closesocket(Socket);
+		return INVALID_SOCKET;
+	}
+
+	Timeout = 0;
+	setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+
+	return Socket;
+}
+
+/**
+ * @brief Show the messages of the frames of the agent
+ *
+ * @param Data The socket of the data channel
+ * @return DWORD
+ */
+DWORD WINAPI RemoteDebuggerReceiveThread(void* Data) {
+
+	SOCKET Socket = (SOCKET)Data;
+	REMOTE_FRAME_HEADER Header;
+	LOG_BATCH_PACKET_HEADER PacketHeader;
+	UINT32 Offset;
+
+	BYTE* StoredFrame = (BYTE*)malloc(LZ4_COMPRESS_BOUND(REMOTE_FRAME_SIZE));
+	BYTE* Frame = (BYTE*)malloc(REMOTE_FRAME_SIZE);
+
+	//
+	// each body is copied here to be null-terminated
+	//
+	char* MessageBuffer = (char*)malloc(PacketChunkSize + 1);
+
+	while (StoredFrame && Frame && MessageBuffer && RemoteReceiveAll(Socket, &Header, sizeof(REMOTE_FRAME_HEADER)))
+	{
+		if (Header.Magic != REMOTE_MAGIC || Header.UncompressedLength > REMOTE_FRAME_SIZE ||
+			Header.StoredLength > LZ4_COMPRESS_BOUND(REMOTE_FRAME_SIZE))
+		{
+			ShowMessages("invalid frame from the remote debuggee\n");
+			break;
+		}
+
+		if (!RemoteReceiveAll(Socket, StoredFrame, Header.StoredLength))
+		{
+			break;
+		}
+
+		BYTE* Records = StoredFrame;
+
+		if (Header.Flags & REMOTE_FLAG_COMPRESSED)
+		{
+			if (TraceFileDecompressBlock(StoredFrame, Header.StoredLength, Frame, REMOTE_FRAME_SIZE) != Header.UncompressedLength)
+			{
+				ShowMessages("invalid frame from the remote debuggee\n");
+				break;
+			}
+
+			Records = Frame;
+		}
+		else if (Header.StoredLength != Header.UncompressedLength)
+		{
+			ShowMessages("invalid frame from the remote debuggee\n");
+			break;
+		}
+
+		try
+		{
+			Offset = 0;
+
+			while (Offset + sizeof(LOG_BATCH_PACKET_HEADER) <= Header.UncompressedLength) {
+
+				memcpy(&PacketHeader, Records + Offset, sizeof(LOG_BATCH_PACKET_HEADER));
+				Offset += sizeof(LOG_BATCH_PACKET_HEADER);
+
+				if (PacketHeader.Length > PacketChunkSize || Offset + PacketHeader.Length > Header.UncompressedLength) {
+					ShowMessages("Invalid packet in the frame of the remote debuggee\n");
+					break;
+				}
+
+				memcpy(MessageBuffer, Records + Offset, PacketHeader.Length);
+				MessageBuffer[PacketHeader.Length] = '\0';
+				Offset += PacketHeader.Length;
+
+				//
+				// The messages of the debuggee can be saved to a trace file here
+				//
+				if (TraceFileSaveRecord(&PacketHeader, MessageBuffer)) {
+					ShowKernelMessage(&PacketHeader, MessageBuffer);
+				}
+			}
+		}
+		catch (const std::exception&)
+		{
+			ShowMessages(" Exception !\n");
+		}
+	}
+
+	free(StoredFrame);
+	free(Frame);
+	free(MessageBuffer);
+
+	//
+	// Nothing to show if it's closed by '.disconnect'
+	//
+	AcquireSRWLockShared(&RemoteDebuggerLock);
+
+	if (RemoteDebuggerDataSocket == Socket)
+	{
+		ShowMessages("the connection to the remote debuggee is closed\n");
+	}
+
+	ReleaseSRWLockShared(&RemoteDebuggerLock);
+
+	return 0;
+}
+
+/**
+ * @brief Whether this system is the debugger of a remote debuggee
+ *
+ * @return BOOLEAN
+ */
+BOOLEAN RemoteIsConnected() {
+
+	return RemoteDebuggerCommandSocket != INVALID_SOCKET;
+}
+
+/**
+ * @brief Connect to the agent of a remote debuggee
+ *
+ * @param Ip
+ * @param Port
+ * @param Compress Whether the agent should compress the frames
+ * @param Key The key of the agent
+ * @return BOOLEAN Whether the channels are connected or not
+ */
+BOOLEAN RemoteConnect(const string& Ip, const string& Port, BOOLEAN Compress, const string& Key) {
+
+	ADDRINFOA Hints = { 0 };
+	PADDRINFOA Address;
+	SOCKET DataSocket;
+	SOCKET CommandSocket;
+
+	if (RemoteIsConnected())
+	{
+		ShowMessages("already connected to a remote debuggee, use '.disconnect' first\n");
+		return FALSE;
+	}
+
+	if (!RemoteInitializeWinsock())
+	{
+		return FALSE;
+	}
+
+	Hints.ai_family = AF_INET;
+	Hints.ai_socktype = SOCK_STREAM;
+	Hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(Ip.c_str(), Port.c_str(), &Hints, &Address) != 0)
+	{
+		ShowMessages("incorrect address of the remote debuggee (%x)\n", WSAGetLastError());
+		return FALSE;
+	}
+
+	DataSocket = RemoteOpenChannel(Address, REMOTE_CHANNEL_DATA, Compress ? REMOTE_FLAG_COMPRESSED : 0, Key);
+	CommandSocket = DataSocket == INVALID_SOCKET ? INVALID_SOCKET : RemoteOpenChannel(Address, REMOTE_CHANNEL_COMMAND, 0, Key);
+
+	freeaddrinfo(Address);
+
+	if (CommandSocket == INVALID_SOCKET)
+	{
+		ShowMessages("unable to connect to the remote debuggee, is the key correct? (%x)\n", WSAGetLastError());
+
+		if (DataSocket != INVALID_SOCKET)
+		{
+			closesocket(DataSocket);
+		}
+		return FALSE;
+	}
+
+	AcquireSRWLockExclusive(&RemoteDebuggerLock);
+
+	RemoteDebuggerDataSocket = DataSocket;
+	RemoteDebuggerCommandSocket = CommandSocket;
+	RemoteDebuggerReceiveThread = CreateThread(NULL, 0, RemoteDebuggerReceiveThread, (void*)DataSocket, 0, NULL);
+
+	ReleaseSRWLockExclusive(&RemoteDebuggerLock);
+
+	if (RemoteDebuggerReceiveThread == NULL)
+	{
+		ShowMessages("unable to create the thread of messages (%x)\n", GetLastError());
+		RemoteDisconnect();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Disconnect from the remote debuggee
+ *
+ * @return VOID
+ */
+void RemoteDisconnect() {
+
+	AcquireSRWLockExclusive(&RemoteDebuggerLock);
+
+	SOCKET DataSocket = RemoteDebuggerDataSocket;
+	SOCKET CommandSocket = RemoteDebuggerCommandSocket;
+	HANDLE Thread = RemoteDebuggerReceiveThread;
+
+	RemoteDebuggerDataSocket = INVALID_SOCKET;
+	RemoteDebuggerCommandSocket = INVALID_SOCKET;
+	RemoteDebuggerReceiveThread = NULL;
+
+	ReleaseSRWLockExclusive(&RemoteDebuggerLock);
+
+	if (DataSocket != INVALID_SOCKET)
+	{
+		shutdown(DataSocket, SD_BOTH);
+	}
+
+	if (Thread != NULL)
+	{
+		WaitForSingleObject(Thread, INFINITE);
+		CloseHandle(Thread);
+	}
+
+	if (DataSocket != INVALID_SOCKET)
+	{
+		closesocket(DataSocket);
+	}
+
+	if (CommandSocket != INVALID_SOCKET)
+	{
+		closesocket(CommandSocket);
+	}
+}
+
+/**
+ * @brief Execute a command on the remote debuggee
+ * @details The result of the command is shown until the agent finishes it,
+ * the messages of the debuggee are shown by the thread of the data channel
+ * in the meantime
+ *
+ * @param Command The text of command
+ * @return int The result of the interpreter of the debuggee
+ */
+int RemoteSendCommand(const char* Command) {
+
+	REMOTE_PACKET_HEADER Header;
+	char Output[REMOTE_MAXIMUM_COMMAND_LENGTH + 1];
+	UINT32 Length = (UINT32)strlen(Command);
+	BOOLEAN IsCompleted = FALSE;
+	int Status = 1;
+
+	if (Length > REMOTE_MAXIMUM_COMMAND_LENGTH)
+	{
+		ShowMessages("the command is too long\n");
+		return 1;
+	}
+
+	AcquireSRWLockExclusive(&RemoteDebuggerLock);
+
+	SOCKET Socket = RemoteDebuggerCommandSocket;
+
+	if (Socket != INVALID_SOCKET && RemoteSendPacket(Socket, REMOTE_PACKET_COMMAND, 0, Command, Length))
+	{
+		while (RemoteReceiveAll(Socket, &Header, sizeof(REMOTE_PACKET_HEADER)))
+		{
+			if (Header.Magic != REMOTE_MAGIC || Header.Length > REMOTE_MAXIMUM_COMMAND_LENGTH ||
+				!RemoteReceiveAll(Socket, Output, Header.Length))
+			{
+				break;
+			}
+
+			Output[Header.Length] = '\0';
+
+			if (Header.Type == REMOTE_PACKET_OUTPUT)
+			{
+				ShowMessages("%s", Output);
+			}
+			else if (Header.Type == REMOTE_PACKET_COMPLETE)
+			{
+				Status = (int)Header.Status;
+				IsCompleted = TRUE;
+				break;
+			}
+		}
+	}
+
+	ReleaseSRWLockExclusive(&RemoteDebuggerLock);
+
+	if (!IsCompleted)
+	{
+		ShowMessages("the connection to the remote debuggee is lost, use '.disconnect'\n");
+	}
+
+	return Status;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file remote.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Protocol of the remote debugging over TCP
+ * @details The debugger makes two connections to the agent on the target
+ * (.listen), the first one is the data channel, the kernel messages are sent
+ * on it in big frames (the records are the same as the result of
+ * IOCTL_READ_LOG_BUFFERS_BATCH and might be compressed in LZ4 block format),
+ * the second one is the command channel, it's a TCP_NODELAY connection that
+ * the commands and their results are sent on it, so the commands never wait
+ * for the frames of the messages. Each connection starts with a challenge of
+ * the agent, the hello of the debugger proves that it knows the key of the
+ * agent (HMAC-SHA256 of the challenge), then the agent sends the magic if
+ * the hello is accepted.
+ * @version 0.1
+ * @date 2020-05-25
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+
+//////////////////////////////////////////////////
+//				  Remote Debugging              //
+//////////////////////////////////////////////////
+
+#define REMOTE_MAGIC 0x4d455244 // "DREM"
+#define REMOTE_VERSION 2
+#define REMOTE_DEFAULT_PORT 50000
+
+/* Size of the nonce of the challenge and the proof of the hello (HMAC-SHA256) */
+#define REMOTE_NONCE_SIZE 32
+#define REMOTE_PROOF_SIZE 32
+
+/* Random bytes of the key that the agent generates if it's not specified (shown in hex) */
+#define REMOTE_GENERATED_KEY_SIZE 16
+
+/* The debugger should answer the challenge in this time (milliseconds) */
+#define REMOTE_HELLO_TIMEOUT 5000
+
+/* Maximum size of the records of each frame (before compression) */
+#define REMOTE_FRAME_SIZE 0x100000
+
+/* The agent sends the frame that is being filled after this time (milliseconds) */
+#define REMOTE_FLUSH_INTERVAL 50
+
+/* Size of the socket buffers of the data channel */
+#define REMOTE_SOCKET_BUFFER_SIZE 0x400000
+
+/* Maximum length of a command or each piece of the result of a command */
+#define REMOTE_MAXIMUM_COMMAND_LENGTH (PacketChunkSize - 1)
+
+/* Channels of a connection */
+#define REMOTE_CHANNEL_DATA 1
+#define REMOTE_CHANNEL_COMMAND 2
+
+/* Flags of the hello and the frames */
+#define REMOTE_FLAG_COMPRESSED 0x1
+
+/* Types of the packets of the command channel */
+#define REMOTE_PACKET_COMMAND 1			// Debugger -> agent, the text of the command
+#define REMOTE_PACKET_OUTPUT 2			// Agent -> debugger, a piece of the result of the command
+#define REMOTE_PACKET_COMPLETE 3		// Agent -> debugger, the command is finished (Status is the result of the interpreter)
+
+/**
+ * @brief The first packet of each connection (agent -> debugger)
+ *
+ */
+typedef struct _REMOTE_CHALLENGE {
+	UINT32 Magic;
+	UINT32 Version;
+	BYTE Nonce[REMOTE_NONCE_SIZE];		// Random bytes of this connection
+
+} REMOTE_CHALLENGE, * PREMOTE_CHALLENGE;
+
+/**
+ * @brief The answer of the challenge (debugger -> agent)
+ *
+ */
+typedef struct _REMOTE_HELLO {
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 Channel;				// REMOTE_CHANNEL_DATA or REMOTE_CHANNEL_COMMAND
+	UINT32 Flags;				// REMOTE_FLAG_COMPRESSED if the frames should be compressed
+	BYTE Proof[REMOTE_PROOF_SIZE];		// HMAC-SHA256 of the nonce, the channel and the flags by the key
+
+} REMOTE_HELLO, * PREMOTE_HELLO;
+
+/**
+ * @brief Header of each frame of the data channel, StoredLength bytes of records follow it
+ *
+ */
+typedef struct _REMOTE_FRAME_HEADER {
+	UINT32 Magic;
+	UINT32 Flags;				// REMOTE_FLAG_COMPRESSED if the records are compressed
+	UINT32 RecordCount;
+	UINT32 UncompressedLength;
+	UINT32 StoredLength;
+	UINT32 Reserved;
+
+} REMOTE_FRAME_HEADER, * PREMOTE_FRAME_HEADER;
+
+/**
+ * @brief Header of each packet of the command channel, Length bytes of text follow it
+ *
+ */
+typedef struct _REMOTE_PACKET_HEADER {
+	UINT32 Magic;
+	UINT32 Type;
+	UINT32 Length;
+	UINT32 Status;
+
+} REMOTE_PACKET_HEADER, * PREMOTE_PACKET_HEADER;
+
+BOOLEAN RemoteSendRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body);
+BOOLEAN RemoteCaptureOutput(const char* Message);
+BOOLEAN RemoteIsConnected();
+BOOLEAN RemoteConnect(const string& Ip, const string& Port, BOOLEAN Compress, const string& Key);
+void RemoteDisconnect();
+int RemoteSendCommand(const char* Command);
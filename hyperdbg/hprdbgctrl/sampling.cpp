@@ -0,0 +1,265 @@
+/**
+ * @file sampling.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Control the guest RIP sampling and show the flat profile
+ * @details
+ * @version 0.1
+ * @date 2020-05-05
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief Count of the samples that are read in each IOCTL
+ *
+ */
+#define SAMPLING_SAMPLES_PER_READ 0x4000
+
+/**
+ * @brief Samples of the kernel-mode (RIP : count) from the last start
+ *
+ */
+map<UINT64, UINT64> SamplingKernelRips;
+
+/**
+ * @brief Samples of the user-mode (CR3 : count) from the last start
+ *
+ */
+map<UINT64, UINT64> SamplingUserCr3s;
+
+UINT64 SamplingTotalSamples = 0;
+UINT64 SamplingLostSamples = 0;
+
+void CommandSamplingHelp() {
+	ShowMessages(".sampling : samples the guest RIP of all the cores using the VMX-preemption timer.\n\n");
+	ShowMessages("syntax : \t.sampling [start [frequency (decimal value)]] [stop] [report [count (decimal value)]]\n");
+	ShowMessages("\t\te.g : .sampling start\n");
+	ShowMessages("\t\t\tdescription : starts sampling with %d samples per second in each core\n", SAMPLING_DEFAULT_FREQUENCY);
+	ShowMessages("\t\te.g : .sampling start 5000\n");
+	ShowMessages("\t\t\tdescription : starts sampling with 5000 samples per second in each core\n");
+	ShowMessages("\t\te.g : .sampling report 20\n");
+	ShowMessages("\t\t\tdescription : shows the modules and the 20 most sampled addresses\n");
+	ShowMessages("\t\te.g : .sampling stop\n");
+	ShowMessages("\t\t\tdescription : stops sampling (the samples that are not reported are lost)\n");
+}
+
+/**
+ * @brief Move the samples from the kernel rings to the maps
+ *
+ * @return BOOLEAN Whether the samples are read or not
+ */
+BOOLEAN SamplingDrainSamples() {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	PSAMPLING_READ_RESULT Result;
+	PGUEST_RIP_SAMPLE Samples;
+	UINT32 BufferSize = sizeof(SAMPLING_READ_RESULT) + SAMPLING_SAMPLES_PER_READ * sizeof(GUEST_RIP_SAMPLE);
+
+	Result = (PSAMPLING_READ_RESULT)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the samples\n");
+		return FALSE;
+	}
+
+	Samples = (PGUEST_RIP_SAMPLE)((UINT64)Result + sizeof(SAMPLING_READ_RESULT));
+
+	do
+	{
+		Status = DeviceIoControlSynchronous(
+			Handle,							// Handle to device
+			IOCTL_READ_SAMPLES,				// IO Control code
+			NULL,							// Input Buffer to driver.
+			0,								// Length of input buffer in bytes.
+			Result,							// Output Buffer from driver.
+			BufferSize,						// Length of output buffer in bytes.
+			&ReturnedLength 				// Bytes placed in buffer.
+		);
+
+		if (!Status || ReturnedLength < sizeof(SAMPLING_READ_RESULT)) {
+			ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+			free(Result);
+			return FALSE;
+		}
+
+		for (UINT32 i = 0; i < Result->CountOfSamples; i++)
+		{
+			if (Samples[i].Cpl == 0) {
+				SamplingKernelRips[Samples[i].Rip]++;
+			}
+			else {
+				SamplingUserCr3s[Samples[i].Cr3]++;
+			}
+		}
+
+		SamplingTotalSamples += Result->CountOfSamples;
+		SamplingLostSamples += Result->LostSamples;
+
+		//
+		// The driver returns less than the buffer when the rings are empty
+		//
+	} while (Result->CountOfSamples == SAMPLING_SAMPLES_PER_READ);
+
+	free(Result);
+	return TRUE;
+}
+
+/**
+ * @brief Show the flat profile of the samples
+ *
+ * @param TopCount Count of the addresses to show
+ * @return VOID
+ */
+void SamplingShowReport(UINT32 TopCount) {
+
+	map<string, UINT64> ModuleSamples;
+	vector<pair<UINT64, UINT64>> TopRips;
+	UINT64 UnknownSamples = 0;
+	UINT64 UserSamples = 0;
+
+	if (SamplingTotalSamples == 0)
+	{
+		ShowMessages("there is no sample\n");
+		return;
+	}
+
+	if (!LmRefreshModules())
+	{
+		return;
+	}
+
+	//
+	// Find the module of each address, and sort the addresses by the count
+	//
+	for (auto& Rip : SamplingKernelRips)
+	{
+		LM_MODULE Module;
+
+		if (LmFindModule(Rip.first, &Module))
+		{
+			ModuleSamples[Module.Name] += Rip.second;
+		}
+		else
+		{
+			UnknownSamples += Rip.second;
+		}
+
+		TopRips.push_back(make_pair(Rip.second, Rip.first));
+	}
+
+	for (auto& Cr3 : SamplingUserCr3s)
+	{
+		UserSamples += Cr3.second;
+	}
+
+	sort(TopRips.begin(), TopRips.end(), greater<pair<UINT64, UINT64>>());
+
+	ShowMessages("total : %llu samples, %llu lost samples\n\n", SamplingTotalSamples, SamplingLostSamples);
+
+	ShowMessages("%-32s%-16s%s\n", "module", "samples", "percent");
+
+	for (auto& Module : ModuleSamples)
+	{
+		ShowMessages("%-32s%-16llu%.2f%%\n",
+			Module.first.c_str(),
+			Module.second,
+			(double)Module.second * 100 / SamplingTotalSamples);
+	}
+
+	if (UnknownSamples != 0)
+	{
+		ShowMessages("%-32s%-16llu%.2f%%\n", "[unknown kernel]", UnknownSamples, (double)UnknownSamples * 100 / SamplingTotalSamples);
+	}
+
+	if (UserSamples != 0)
+	{
+		ShowMessages("%-32s%-16llu%.2f%% (%d address spaces)\n", "[user-mode]", UserSamples, (double)UserSamples * 100 / SamplingTotalSamples, SamplingUserCr3s.size());
+	}
+
+	ShowMessages("\n%-48s%-16s%s\n", "address", "samples", "percent");
+
+	for (size_t j = 0; j < TopRips.size() && j < TopCount; j++)
+	{
+		ShowMessages("%-48s%-16llu%.2f%%\n", LmResolveAddress(TopRips[j].second).c_str(), TopRips[j].first, (double)TopRips[j].first * 100 / SamplingTotalSamples);
+	}
+}
+
+void CommandSampling(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	SAMPLING_CONTROL_REQUEST Request = { 0 };
+	UINT32 TopCount = 10;
+
+	if (SplittedCommand.size() < 2 || SplittedCommand.size() > 3 ||
+		(SplittedCommand.size() == 3 && SplittedCommand.at(2).find_first_not_of("0123456789") != string::npos))
+	{
+		ShowMessages("incorrect use of '.sampling'\n\n");
+		CommandSamplingHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	if (!SplittedCommand.at(1).compare("report")) {
+
+		if (SplittedCommand.size() == 3) {
+			TopCount = stoul(SplittedCommand.at(2), nullptr, 10);
+		}
+
+		if (SamplingDrainSamples()) {
+			SamplingShowReport(TopCount);
+		}
+		return;
+	}
+	else if (!SplittedCommand.at(1).compare("start")) {
+
+		Request.Start = TRUE;
+		Request.Frequency = SplittedCommand.size() == 3 ? stoul(SplittedCommand.at(2), nullptr, 10) : SAMPLING_DEFAULT_FREQUENCY;
+
+		//
+		// Start a new profile
+		//
+		SamplingKernelRips.clear();
+		SamplingUserCr3s.clear();
+		SamplingTotalSamples = 0;
+		SamplingLostSamples = 0;
+	}
+	else if (!SplittedCommand.at(1).compare("stop") && SplittedCommand.size() == 2) {
+		Request.Start = FALSE;
+	}
+	else {
+		ShowMessages("incorrect use of '.sampling'\n\n");
+		CommandSamplingHelp();
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_CONTROL_SAMPLING,				// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(SAMPLING_CONTROL_REQUEST),	// Length of input buffer in bytes.
+		NULL,								// Output Buffer from driver.
+		0,									// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	ShowMessages(Request.Start ? "sampling is started\n" : "sampling is stopped\n");
+}
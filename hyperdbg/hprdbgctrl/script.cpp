@@ -0,0 +1,494 @@
+/**
+ * @file script.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Register the events of a script file with one request
+ * @details
+ * @version 0.1
+ * @date 2020-05-24
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+#include <fstream>
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief An action of an event of the script
+ *
+ */
+typedef struct _SCRIPT_ACTION {
+	DEBUGGER_EVENT_BATCH_ACTION Action;
+	vector<BYTE> CustomCode;
+
+} SCRIPT_ACTION, * PSCRIPT_ACTION;
+
+/**
+ * @brief An event of the script (a line)
+ *
+ */
+typedef struct _SCRIPT_EVENT {
+	UINT32 LineNumber;
+	DEBUGGER_EVENT_BATCH_ENTRY Entry;
+	vector<BYTE> Condition;
+	vector<SCRIPT_ACTION> Actions;
+
+} SCRIPT_EVENT, * PSCRIPT_EVENT;
+
+void CommandScriptHelp() {
+	ShowMessages(".script : registers all the events of a script file with one request, nothing is registered if any line is not valid.\n\n");
+	ShowMessages("syntax : \t.script [file path]\n");
+	ShowMessages("\t\te.g : .script c:\\scripts\\events.txt\n");
+	ShowMessages("\t\t\tdescription : registers the events of events.txt\n\n");
+	ShowMessages("each line of the script is an event (the lines that start with '#' are comments) :\n");
+	ShowMessages("\t[event] [options]... [actions]...\n\n");
+	ShowMessages("events :\n");
+	ShowMessages("\tmsrread [msr (hex value) | all], msrwrite [msr (hex value) | all]\n");
+	ShowMessages("\tin [port (hex value) | all], out [port (hex value) | all]\n");
+	ShowMessages("\tbp [address (hex value) | all], db [address (hex value) | all]\n");
+	ShowMessages("\tsyscall (the EFER syscall hook is enabled)\n");
+	ShowMessages("\thiddenhook [function address (hex value)]\n\n");
+	ShowMessages("options :\n");
+	ShowMessages("\tcore [core (hex value)], tag [tag (hex value)] (default is the line number), disabled\n");
+	ShowMessages("\tcondition [code (hex bytes)], pid [process id (hex value)], cr3 [cr3 (hex value)]\n");
+	ShowMessages("\tsample [one of each n hits (hex value)], ratelimit [hits per second (hex value)], burst [hits (hex value)]\n");
+	ShowMessages("\timmediate (the results of the actions are sent immediately)\n\n");
+	ShowMessages("actions :\n");
+	ShowMessages("\tbreak, log [register[,register]...], logmem [address (hex value)] [length (hex value)], code [code (hex bytes)]\n\n");
+	ShowMessages("\t\te.g of a script :\n");
+	ShowMessages("\t\t\tmsrread c0000082 core 1 log rax,rcx\n");
+	ShowMessages("\t\t\tout 80 sample 10 logmem fffff80126551180 20\n");
+	ShowMessages("\t\t\tbp all pid 1f4 ratelimit 64 burst 8 break\n");
+}
+
+/**
+ * @brief Convert a hex value of the script
+ *
+ * @param Token The token
+ * @param Value The value
+ * @return BOOLEAN Whether the token is a hex value or not
+ */
+BOOLEAN ScriptParseHexValue(const string& Token, UINT64& Value) {
+
+	if (Token.empty() || Token.size() > 16 ||
+		Token.find_first_not_of("0123456789abcdef") != string::npos) {
+		return FALSE;
+	}
+
+	Value = stoull(Token, nullptr, 16);
+	return TRUE;
+}
+
+/**
+ * @brief Convert the hex bytes of a code of the script
+ *
+ * @param Token The token (e.g, 90c3)
+ * @param Bytes The bytes
+ * @return BOOLEAN Whether the token is valid or not
+ */
+BOOLEAN ScriptParseHexBytes(const string& Token, vector<BYTE>& Bytes) {
+
+	if (Token.empty() || (Token.size() % 2) != 0 ||
+		Token.find_first_not_of("0123456789abcdef") != string::npos) {
+		return FALSE;
+	}
+
+	Bytes.clear();
+
+	for (size_t i = 0; i < Token.size(); i += 2) {
+		Bytes.push_back((BYTE)stoul(Token.substr(i, 2), nullptr, 16));
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Convert the registers of a log action (e.g, rax,rcx)
+ *
+ * @param Token The token
+ * @param Mask The GUEST_GP_REG_* bits of the registers
+ * @return BOOLEAN Whether all the registers are valid or not
+ */
+BOOLEAN ScriptParseRegisters(const string& Token, UINT64& Mask) {
+
+	const map<string, UINT64> Registers = {
+		{ "rax", GUEST_GP_REG_RAX }, { "rcx", GUEST_GP_REG_RCX }, { "rdx", GUEST_GP_REG_RDX },
+		{ "rbx", GUEST_GP_REG_RBX }, { "rsp", GUEST_GP_REG_RSP }, { "rbp", GUEST_GP_REG_RBP },
+		{ "rsi", GUEST_GP_REG_RSI }, { "rdi", GUEST_GP_REG_RDI }, { "r8", GUEST_GP_REG_R8 },
+		{ "r9", GUEST_GP_REG_R9 }, { "r10", GUEST_GP_REG_R10 }, { "r11", GUEST_GP_REG_R11 },
+		{ "r12", GUEST_GP_REG_R12 }, { "r13", GUEST_GP_REG_R13 }, { "r14", GUEST_GP_REG_R14 },
+		{ "r15", GUEST_GP_REG_R15 }, { "rflags", GUEST_GP_REG_RFLAGS }
+	};
+
+	Mask = 0;
+
+	for (auto& Register : Split(Token, ',')) {
+
+		auto Found = Registers.find(Register);
+
+		if (Found == Registers.end()) {
+			return FALSE;
+		}
+
+		Mask |= Found->second;
+	}
+
+	return Mask != 0;
+}
+
+/**
+ * @brief Parse a line of the script
+ *
+ * @param Tokens The tokens of the line
+ * @param Event The event of the line
+ * @param Error Description of the problem if the line is not valid
+ * @return BOOLEAN Whether the line is valid or not
+ */
+BOOLEAN ScriptParseLine(const vector<string>& Tokens, SCRIPT_EVENT& Event, string& Error) {
+
+	const map<string, DEBUGGER_EVENT_TYPE_ENUM> EventTypes = {
+		{ "msrread", RDMSR_INSTRUCTION_EXECUTION }, { "msrwrite", WRMSR_INSTRUCTION_EXECUTION },
+		{ "in", IN_INSTRUCTION_EXECUTION }, { "out", OUT_INSTRUCTION_EXECUTION },
+		{ "bp", BREAKPOINT_EXCEPTION }, { "db", DEBUG_EXCEPTION },
+		{ "syscall", SYSCALL_HOOK_EFER }, { "hiddenhook", HIDDEN_HOOK_EXEC_DETOUR }
+	};
+
+	PDEBUGGER_EVENT_BATCH_ENTRY Entry = &Event.Entry;
+	BOOLEAN IsImmediate = FALSE;
+	UINT64 Value;
+	size_t i = 1;
+
+	auto EventType = EventTypes.find(Tokens.at(0));
+
+	if (EventType == EventTypes.end()) {
+		Error = "unknown event '" + Tokens.at(0) + "'";
+		return FALSE;
+	}
+
+	Entry->EventType = EventType->second;
+	Entry->CoreId = DEBUGGER_EVENT_APPLY_TO_ALL_CORES;
+	Entry->Enabled = TRUE;
+	Entry->Tag = Event.LineNumber;
+
+	//
+	// The parameter of the event (OptionalParam1)
+	//
+	if (Entry->EventType != SYSCALL_HOOK_EFER) {
+
+		if (Tokens.size() < 2) {
+			Error = "the event needs a parameter";
+			return FALSE;
+		}
+
+		if (!Tokens.at(1).compare("all") && Entry->EventType != HIDDEN_HOOK_EXEC_DETOUR) {
+			Entry->OptionalParam1 = (Entry->EventType == BREAKPOINT_EXCEPTION || Entry->EventType == DEBUG_EXCEPTION) ?
+				DEBUGGER_EVENT_ALL_ADDRESSES : (Entry->EventType == IN_INSTRUCTION_EXECUTION || Entry->EventType == OUT_INSTRUCTION_EXECUTION) ?
+				DEBUGGER_EVENT_ALL_IO_PORTS : DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS;
+		}
+		else if (ScriptParseHexValue(Tokens.at(1), Value) && (Value != 0 || Entry->EventType != HIDDEN_HOOK_EXEC_DETOUR)) {
+			Entry->OptionalParam1 = Value;
+		}
+		else {
+			Error = "invalid parameter '" + Tokens.at(1) + "'";
+			return FALSE;
+		}
+
+		if ((Entry->EventType == IN_INSTRUCTION_EXECUTION || Entry->EventType == OUT_INSTRUCTION_EXECUTION) &&
+			Entry->OptionalParam1 != DEBUGGER_EVENT_ALL_IO_PORTS && Entry->OptionalParam1 > 0xffff) {
+			Error = "invalid port '" + Tokens.at(1) + "'";
+			return FALSE;
+		}
+
+		i++;
+	}
+
+	for (; i < Tokens.size(); i++) {
+
+		const string& Token = Tokens.at(i);
+		BOOLEAN HasValue = i + 1 < Tokens.size();
+		SCRIPT_ACTION Action = { 0 };
+
+		if (!Token.compare("disabled")) {
+			Entry->Enabled = FALSE;
+		}
+		else if (!Token.compare("immediate")) {
+			IsImmediate = TRUE;
+		}
+		else if (!Token.compare("core") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value) && Value < MAXUINT32) {
+			Entry->CoreId = (UINT32)Value;
+			i++;
+		}
+		else if (!Token.compare("tag") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value)) {
+			Entry->Tag = Value;
+			i++;
+		}
+		else if (!Token.compare("pid") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value) && Value <= MAXUINT32) {
+			Entry->Filter.Flags |= DEBUGGER_EVENT_FILTER_PROCESS_ID;
+			Entry->Filter.ProcessId = (UINT32)Value;
+			i++;
+		}
+		else if (!Token.compare("cr3") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value)) {
+			Entry->Filter.Flags |= DEBUGGER_EVENT_FILTER_CR3;
+			Entry->Filter.Cr3 = Value;
+			i++;
+		}
+		else if (!Token.compare("sample") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value) && Value <= MAXUINT32) {
+			Entry->SampleRate = (UINT32)Value;
+			i++;
+		}
+		else if (!Token.compare("ratelimit") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value) && Value <= MAXUINT32) {
+			Entry->HitsPerSecond = (UINT32)Value;
+			i++;
+		}
+		else if (!Token.compare("burst") && HasValue && ScriptParseHexValue(Tokens.at(i + 1), Value) && Value <= MAXUINT32) {
+			Entry->Burst = (UINT32)Value;
+			i++;
+		}
+		else if (!Token.compare("condition") && HasValue && ScriptParseHexBytes(Tokens.at(i + 1), Event.Condition)) {
+			i++;
+		}
+		else if (!Token.compare("break")) {
+			Action.Action.ActionType = BREAK_TO_DEBUGGER;
+			Event.Actions.push_back(Action);
+		}
+		else if (!Token.compare("log") && HasValue && ScriptParseRegisters(Tokens.at(i + 1), Action.Action.LogConfiguration.LogMask)) {
+			Action.Action.ActionType = LOG_THE_STATES;
+			Action.Action.LogConfiguration.LogType = GUEST_LOG_READ_GENERAL_PURPOSE_REGISTERS;
+			Event.Actions.push_back(Action);
+			i++;
+		}
+		else if (!Token.compare("logmem") && i + 2 < Tokens.size() &&
+			ScriptParseHexValue(Tokens.at(i + 1), Action.Action.LogConfiguration.LogValue) &&
+			ScriptParseHexValue(Tokens.at(i + 2), Value) && Value != 0 && Value <= DEBUGGER_LOG_STATES_MAXIMUM_MEMORY) {
+			Action.Action.ActionType = LOG_THE_STATES;
+			Action.Action.LogConfiguration.LogType = GUEST_LOG_READ_STATIC_MEMORY_ADDRESS;
+			Action.Action.LogConfiguration.LogLength = (UINT32)Value;
+			Event.Actions.push_back(Action);
+			i += 2;
+		}
+		else if (!Token.compare("code") && HasValue && ScriptParseHexBytes(Tokens.at(i + 1), Action.CustomCode)) {
+			Action.Action.ActionType = RUN_CUSTOM_CODE;
+			Action.Action.CustomCodeBufferSize = (UINT32)Action.CustomCode.size();
+			Event.Actions.push_back(Action);
+			i++;
+		}
+		else {
+			Error = "invalid use of '" + Token + "'";
+			return FALSE;
+		}
+	}
+
+	if (Entry->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES) {
+
+		SYSTEM_INFO SystemInfo;
+		GetSystemInfo(&SystemInfo);
+
+		if (Entry->CoreId >= SystemInfo.dwNumberOfProcessors) {
+			Error = "invalid core";
+			return FALSE;
+		}
+	}
+
+	if (Entry->Burst != 0 && Entry->HitsPerSecond == 0) {
+		Error = "'burst' needs 'ratelimit'";
+		return FALSE;
+	}
+
+	for (auto& Action : Event.Actions) {
+		Action.Action.ImmediatelySendTheResults = IsImmediate;
+		Action.Action.Size = (UINT32)DEBUGGER_EVENT_BATCH_ALIGN(sizeof(DEBUGGER_EVENT_BATCH_ACTION) + Action.CustomCode.size());
+	}
+
+	//
+	// The size of the entry with its condition code and its actions
+	//
+	Entry->ConditionsBufferSize = (UINT32)Event.Condition.size();
+	Entry->CountOfActions = (UINT32)Event.Actions.size();
+	Entry->Size = (UINT32)DEBUGGER_EVENT_BATCH_ALIGN(sizeof(DEBUGGER_EVENT_BATCH_ENTRY) + Event.Condition.size());
+
+	for (auto& Action : Event.Actions) {
+		Entry->Size += Action.Action.Size;
+	}
+
+	return TRUE;
+}
+
+void CommandScript(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	string FilePath;
+	string Line;
+	string Error;
+	vector<SCRIPT_EVENT> Events;
+	PDEBUGGER_EVENT_BATCH_REQUEST Request;
+	UINT64 BufferSize = sizeof(DEBUGGER_EVENT_BATCH_REQUEST);
+	UINT32 LineNumber = 0;
+	UINT32 CountOfErrors = 0;
+	UINT32 Offset;
+
+	if (SplittedCommand.size() < 2)
+	{
+		ShowMessages("incorrect use of '.script'\n\n");
+		CommandScriptHelp();
+		return;
+	}
+
+	//
+	// The path might have spaces
+	//
+	for (size_t i = 1; i < SplittedCommand.size(); i++) {
+		FilePath += (i == 1 ? "" : " ") + SplittedCommand.at(i);
+	}
+
+	ifstream File(FilePath);
+
+	if (!File.is_open()) {
+		ShowMessages("unable to open '%s'\n", FilePath.c_str());
+		return;
+	}
+
+	//
+	// Parse and check the whole script before sending anything
+	//
+	while (getline(File, Line)) {
+
+		SCRIPT_EVENT Event;
+
+		LineNumber++;
+
+		replace(Line.begin(), Line.end(), '\t', ' ');
+		replace(Line.begin(), Line.end(), '\r', ' ');
+		transform(Line.begin(), Line.end(), Line.begin(),
+			[](unsigned char c) { return std::tolower(c); });
+
+		vector<string> Tokens{ Split(Line, ' ') };
+
+		if (Tokens.empty() || Tokens.at(0).front() == '#') {
+			continue;
+		}
+
+		Event.LineNumber = LineNumber;
+		RtlZeroMemory(&Event.Entry, sizeof(DEBUGGER_EVENT_BATCH_ENTRY));
+
+		if (!ScriptParseLine(Tokens, Event, Error)) {
+			ShowMessages("line %d : %s\n", LineNumber, Error.c_str());
+			CountOfErrors++;
+			continue;
+		}
+
+		BufferSize += Event.Entry.Size;
+		Events.push_back(Event);
+	}
+
+	if (CountOfErrors != 0) {
+		ShowMessages("the script is not registered (%d lines are not valid)\n", CountOfErrors);
+		return;
+	}
+
+	if (Events.empty()) {
+		ShowMessages("there is no event in the script\n");
+		return;
+	}
+
+	if (Events.size() > DEBUGGER_EVENT_BATCH_MAXIMUM_EVENTS || BufferSize > DEBUGGER_EVENT_BATCH_MAXIMUM_SIZE) {
+		ShowMessages("the script has too many events (at most %d events)\n", DEBUGGER_EVENT_BATCH_MAXIMUM_EVENTS);
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	//
+	// Serialize all the events in one buffer
+	//
+	Request = (PDEBUGGER_EVENT_BATCH_REQUEST)malloc(BufferSize);
+
+	if (!Request)
+	{
+		ShowMessages("Unable to allocate memory for the events\n");
+		return;
+	}
+
+	RtlZeroMemory(Request, BufferSize);
+
+	Request->BufferSize = (UINT32)BufferSize;
+	Request->CountOfEvents = (UINT32)Events.size();
+
+	Offset = sizeof(DEBUGGER_EVENT_BATCH_REQUEST);
+
+	for (auto& Event : Events) {
+
+		PBYTE Entry = (PBYTE)Request + Offset;
+		UINT32 ActionOffset = (UINT32)DEBUGGER_EVENT_BATCH_ALIGN(sizeof(DEBUGGER_EVENT_BATCH_ENTRY) + Event.Condition.size());
+
+		memcpy(Entry, &Event.Entry, sizeof(DEBUGGER_EVENT_BATCH_ENTRY));
+
+		if (!Event.Condition.empty()) {
+			memcpy(Entry + sizeof(DEBUGGER_EVENT_BATCH_ENTRY), Event.Condition.data(), Event.Condition.size());
+		}
+
+		for (auto& Action : Event.Actions) {
+
+			memcpy(Entry + ActionOffset, &Action.Action, sizeof(DEBUGGER_EVENT_BATCH_ACTION));
+
+			if (!Action.CustomCode.empty()) {
+				memcpy(Entry + ActionOffset + sizeof(DEBUGGER_EVENT_BATCH_ACTION), Action.CustomCode.data(), Action.CustomCode.size());
+			}
+
+			ActionOffset += Action.Action.Size;
+		}
+
+		Offset += Event.Entry.Size;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_REGISTER_EVENT_BATCH,			// IO Control code
+		Request,							// Input Buffer to driver.
+		(DWORD)BufferSize,					// Length of input buffer in bytes.
+		Request,							// Output Buffer from driver.
+		(DWORD)BufferSize,					// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Request);
+		return;
+	}
+
+	if (Request->FailedEventIndex != DEBUGGER_EVENT_BATCH_NO_FAILED_EVENT && Request->FailedEventIndex < Events.size()) {
+		ShowMessages("line %d : the event is not accepted by the driver (status : 0x%x)\n",
+			Events.at(Request->FailedEventIndex).LineNumber, Request->Status);
+	}
+	else if (Request->Status != 0) {
+		ShowMessages("the events are not registered (status : 0x%x)\n", Request->Status);
+	}
+
+	//
+	// Show the events that are not registered (e.g, their hook is not applied)
+	//
+	Offset = sizeof(DEBUGGER_EVENT_BATCH_REQUEST);
+
+	for (auto& Event : Events) {
+
+		PDEBUGGER_EVENT_BATCH_ENTRY Entry = (PDEBUGGER_EVENT_BATCH_ENTRY)((PBYTE)Request + Offset);
+
+		if (Request->Status == 0 && Entry->Status != 0) {
+			ShowMessages("line %d : the event is not registered (status : 0x%x)\n", Event.LineNumber, Entry->Status);
+		}
+
+		Offset += Event.Entry.Size;
+	}
+
+	ShowMessages("%d of %d events are registered\n", Request->CountOfRegistered, Request->CountOfEvents);
+
+	free(Request);
+}
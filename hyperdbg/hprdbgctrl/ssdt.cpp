@@ -0,0 +1,155 @@
+/**
+ * @file ssdt.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the services of the syscall numbers
+ * @details
+ * @version 0.1
+ * @date 2020-05-20
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandSsdtHelp() {
+	ShowMessages(".ssdt : shows the kernel base and the address of the service of each syscall number.\n\n");
+	ShowMessages("syntax : \t.ssdt [nt] [win32k] [syscall number (hex value)]\n");
+	ShowMessages("\t\te.g : .ssdt\n");
+	ShowMessages("\t\t\tdescription : shows the services of the nt and the win32k tables\n");
+	ShowMessages("\t\te.g : .ssdt nt\n");
+	ShowMessages("\t\t\tdescription : shows the services of the nt table\n");
+	ShowMessages("\t\te.g : .ssdt 55\n");
+	ShowMessages("\t\t\tdescription : shows the service of the syscall 0x55\n");
+}
+
+/**
+ * @brief Show the name and the module of the service of a syscall number
+ *
+ * @param SyscallNumber The syscall number
+ * @param Address Address of the service
+ * @return VOID
+ */
+void SsdtShowService(UINT32 SyscallNumber, UINT64 Address) {
+
+	const char* Name = SyscallTraceGetName(SyscallNumber);
+	LM_MODULE Module;
+
+	ShowMessages("%-8x%-40s%016llx", SyscallNumber, Name ? Name : "", Address);
+
+	if (LmFindModule(Address, &Module))
+	{
+		ShowMessages("  %s", LmResolveAddress(Address).c_str());
+	}
+
+	ShowMessages("\n");
+}
+
+void CommandSsdt(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	PSYSCALL_SERVICE_TABLES_RESULT Result;
+	PUINT64 Services;
+	BOOLEAN ShowNt = TRUE;
+	BOOLEAN ShowWin32k = TRUE;
+	BOOLEAN IsSyscallNumber = FALSE;
+	UINT32 SyscallNumber = 0;
+	SIZE_T BufferSize = sizeof(SYSCALL_SERVICE_TABLES_RESULT) + 2 * SYSCALL_WIN32K_FIRST_NUMBER * sizeof(UINT64);
+
+	if (SplittedCommand.size() > 2)
+	{
+		ShowMessages("incorrect use of '.ssdt'\n\n");
+		CommandSsdtHelp();
+		return;
+	}
+
+	if (SplittedCommand.size() == 2) {
+		if (!SplittedCommand.at(1).compare("nt")) {
+			ShowWin32k = FALSE;
+		}
+		else if (!SplittedCommand.at(1).compare("win32k")) {
+			ShowNt = FALSE;
+		}
+		else if (SplittedCommand.at(1).find_first_not_of("0123456789abcdefABCDEF") == string::npos && SplittedCommand.at(1).size() <= 4) {
+			IsSyscallNumber = TRUE;
+			SyscallNumber = stoul(SplittedCommand.at(1), nullptr, 16);
+		}
+		else {
+			ShowMessages("incorrect use of '.ssdt'\n\n");
+			CommandSsdtHelp();
+			return;
+		}
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Result = (PSYSCALL_SERVICE_TABLES_RESULT)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the service tables\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,									// Handle to device
+		IOCTL_QUERY_SYSCALL_SERVICE_TABLES,	// IO Control code
+		NULL,									// Input Buffer to driver.
+		0,										// Length of input buffer in bytes.
+		Result,									// Output Buffer from driver.
+		(DWORD)BufferSize,						// Length of output buffer in bytes.
+		&ReturnedLength 						// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(SYSCALL_SERVICE_TABLES_RESULT)) {
+		ShowMessages("Ioctl failed with code 0x%x (probably the service tables are not found)\n", GetLastError());
+		free(Result);
+		return;
+	}
+
+	Services = (PUINT64)((UINT64)Result + sizeof(SYSCALL_SERVICE_TABLES_RESULT));
+	LmRefreshModules();
+
+	if (IsSyscallNumber) {
+		if (SyscallNumber < Result->CountOfNtServices) {
+			SsdtShowService(SyscallNumber, Services[SyscallNumber]);
+		}
+		else if (SyscallNumber >= SYSCALL_WIN32K_FIRST_NUMBER && SyscallNumber - SYSCALL_WIN32K_FIRST_NUMBER < Result->CountOfWin32kServices) {
+			SsdtShowService(SyscallNumber, Services[Result->CountOfNtServices + SyscallNumber - SYSCALL_WIN32K_FIRST_NUMBER]);
+		}
+		else {
+			ShowMessages("syscall %x is not found\n", SyscallNumber);
+		}
+	}
+	else {
+		ShowMessages("kernel base : %016llx (size : %x), nt table : %016llx, win32k table : %016llx\n\n",
+			Result->KernelBase,
+			Result->KernelSize,
+			Result->NtTable,
+			Result->Win32kTable);
+
+		for (UINT32 i = 0; ShowNt && i < Result->CountOfNtServices; i++)
+		{
+			SsdtShowService(i, Services[i]);
+		}
+
+		for (UINT32 i = 0; ShowWin32k && i < Result->CountOfWin32kServices; i++)
+		{
+			SsdtShowService(SYSCALL_WIN32K_FIRST_NUMBER + i, Services[Result->CountOfNtServices + i]);
+		}
+
+		if (ShowWin32k && Result->CountOfWin32kServices == 0) {
+			ShowMessages("the win32k table is not mapped in the session of this process\n");
+		}
+	}
+
+	free(Result);
+}
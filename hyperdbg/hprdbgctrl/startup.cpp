@@ -0,0 +1,125 @@
+/**
+ * @file startup.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Show the timing of the phases of the initialization of vmx
+ * @details
+ * @version 0.1
+ * @date 2020-05-21
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandStartupHelp() {
+	ShowMessages(".startup : shows the time of each phase of the initialization of vmx and the time of the bring-up of each core.\n\n");
+	ShowMessages("syntax : \t.startup\n");
+	ShowMessages("\t\te.g : .startup\n");
+	ShowMessages("\t\t\tdescription : shows the timing (the cores allocate their regions and execute vmlaunch in parallel)\n");
+}
+
+/**
+ * @brief Show a phase in cycles and microseconds
+ *
+ * @param Name Name of the phase
+ * @param Cycles Cycles of the phase
+ * @param Frequency Frequency of the time-stamp counter (might be zero)
+ * @return VOID
+ */
+void StartupShowPhase(const char* Name, UINT64 Cycles, UINT64 Frequency) {
+
+	if (Frequency != 0) {
+		ShowMessages("%-18s%-18llu%llu us\n", Name, Cycles, Cycles * 1000000 / Frequency);
+	}
+	else {
+		ShowMessages("%-18s%llu\n", Name, Cycles);
+	}
+}
+
+void CommandStartup(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	PVMX_STARTUP_TIMING Result;
+	PVMX_STARTUP_CORE_TIMING Cores;
+	SYSTEM_INFO SystemInfo;
+	SIZE_T BufferSize;
+	UINT32 SlowestCore = 0;
+
+	if (SplittedCommand.size() != 1)
+	{
+		ShowMessages("incorrect use of '.startup'\n\n");
+		CommandStartupHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	GetSystemInfo(&SystemInfo);
+	BufferSize = sizeof(VMX_STARTUP_TIMING) + SystemInfo.dwNumberOfProcessors * sizeof(VMX_STARTUP_CORE_TIMING);
+
+	Result = (PVMX_STARTUP_TIMING)malloc(BufferSize);
+
+	if (!Result)
+	{
+		ShowMessages("Unable to allocate memory for the timing\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_QUERY_STARTUP_TIMING,			// IO Control code
+		NULL,								// Input Buffer to driver.
+		0,									// Length of input buffer in bytes.
+		Result,								// Output Buffer from driver.
+		(DWORD)BufferSize,					// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status || ReturnedLength < sizeof(VMX_STARTUP_TIMING)) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Result);
+		return;
+	}
+
+	Cores = (PVMX_STARTUP_CORE_TIMING)((UINT64)Result + sizeof(VMX_STARTUP_TIMING));
+
+	ShowMessages("%-18s%-18s%s\n", "phase", "cycles", "time");
+
+	StartupShowPhase("mtrr map", Result->MtrrCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("pool manager", Result->PoolManagerCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("ept", Result->EptCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("regions", Result->RegionsCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("memory mappers", Result->MemoryMapperCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("vmlaunch", Result->LaunchCycles, Result->TimeStampCounterFrequency);
+	StartupShowPhase("total", Result->TotalCycles, Result->TimeStampCounterFrequency);
+
+	ShowMessages("\n%-6s%-18s%s\n", "core", "regions cycles", "vmlaunch cycles");
+
+	for (UINT32 i = 0; i < Result->CountOfCores; i++)
+	{
+		ShowMessages("%-6x%-18llu%llu\n", i, Cores[i].RegionsCycles, Cores[i].LaunchCycles);
+
+		if (Cores[i].RegionsCycles + Cores[i].LaunchCycles > Cores[SlowestCore].RegionsCycles + Cores[SlowestCore].LaunchCycles) {
+			SlowestCore = i;
+		}
+	}
+
+	if (Result->CountOfCores != 0) {
+		ShowMessages("\nthe slowest core is %x\n", SlowestCore);
+	}
+
+	if (Result->CountOfMissedCores != 0) {
+		ShowMessages("%d cores are not shown\n", Result->CountOfMissedCores);
+	}
+
+	free(Result);
+}
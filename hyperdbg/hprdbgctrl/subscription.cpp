@@ -0,0 +1,359 @@
+/**
+ * @file subscription.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Subscribe to the kernel messages by tag, operation code and core (IOCTL_LOG_SUBSCRIBE)
+ * @details Each subscriber has its own rings in the driver, a thread of this
+ * file reads them with IOCTL_READ_SUBSCRIBED_LOG_BUFFERS, the default
+ * consumer (the shared memory or IOCTL_READ_LOG_BUFFERS_BATCH) can be
+ * filtered too
+ * @version 0.1
+ * @date 2020-05-28
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+/**
+ * @brief The reader of a subscriber
+ *
+ */
+typedef struct _SUBSCRIPTION_READER {
+	HANDLE Thread;
+	HANDLE StopEvent;
+	UINT32 SubscriberId;
+
+} SUBSCRIPTION_READER, * PSUBSCRIPTION_READER;
+
+SUBSCRIPTION_READER SubscriptionReaders[LOG_MAXIMUM_SUBSCRIBERS + 1]; // Index is the ID (the default consumer has no reader)
+
+void CommandSubscribeHelp() {
+	ShowMessages(".subscribe : filters the kernel messages to a new consumer or the default one.\n\n");
+	ShowMessages("syntax : \t.subscribe [default | subscriber id (hex value)] [tag (hex value)]... [op (hex value)]... [core (hex value)]... [exclusive]\n");
+	ShowMessages("syntax : \t.subscribe remove [default | subscriber id (hex value)]\n");
+	ShowMessages("\t\te.g : .subscribe tag 1000000 exclusive\n");
+	ShowMessages("\t\t\tdescription : shows the messages of the event 0x1000000 in a new consumer (not in the default one)\n");
+	ShowMessages("\t\te.g : .subscribe core 0 core 1 op 1\n");
+	ShowMessages("\t\t\tdescription : shows the messages of the operation 0x1 of the cores 0 and 1 in a new consumer\n");
+	ShowMessages("\t\te.g : .subscribe default core 2\n");
+	ShowMessages("\t\t\tdescription : the default consumer only shows the messages of the core 2\n");
+	ShowMessages("\t\te.g : .subscribe remove 1\n");
+	ShowMessages("\t\t\tdescription : removes the subscriber 0x1\n\n");
+	ShowMessages("the operation codes greater than 0x%x are matched together by 'op %x'.\n", LOG_SUBSCRIPTION_OTHER_OPERATIONS, LOG_SUBSCRIPTION_OTHER_OPERATIONS);
+}
+
+/**
+ * @brief Show the messages of a subscriber until it's removed
+ *
+ * @param Data The reader
+ * @return DWORD
+ */
+DWORD WINAPI SubscriptionReaderThread(void* Data) {
+
+	PSUBSCRIPTION_READER Reader = (PSUBSCRIPTION_READER)Data;
+	LOG_SUBSCRIBER_READ_REQUEST ReadRequest = { 0 };
+	LOG_BATCH_PACKET_HEADER PacketHeader;
+	OVERLAPPED Overlapped = { 0 };
+	HANDLE Events[2];
+	DWORD ReturnedLength;
+	ULONG Offset;
+	BOOL Status;
+
+	char* Buffer = (char*)malloc(LogBatchBufferSize);
+
+	//
+	// each body is copied here to be null-terminated
+	//
+	char* MessageBuffer = (char*)malloc(PacketChunkSize + 1);
+
+	HANDLE Event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!Buffer || !MessageBuffer || !Event)
+	{
+		ShowMessages("unable to start the reader of the subscriber 0x%x\n", Reader->SubscriberId);
+		free(Buffer);
+		free(MessageBuffer);
+		if (Event) {
+			CloseHandle(Event);
+		}
+		return 0;
+	}
+
+	ReadRequest.SubscriberId = Reader->SubscriberId;
+
+	Events[0] = Event;
+	Events[1] = Reader->StopEvent;
+
+	while (TRUE) {
+
+		memset(&Overlapped, 0, sizeof(OVERLAPPED));
+
+		//
+		// The low bit of the event prevents the completion packet from
+		// being queued to the completion port of the default consumer
+		//
+		ResetEvent(Event);
+		Overlapped.hEvent = (HANDLE)((ULONG_PTR)Event | 1);
+
+		Status = DeviceIoControl(
+			Handle,								// Handle to device
+			IOCTL_READ_SUBSCRIBED_LOG_BUFFERS,	// IO Control code
+			&ReadRequest,						// Input Buffer to driver.
+			sizeof(LOG_SUBSCRIBER_READ_REQUEST),// Length of input buffer in bytes.
+			Buffer,								// Output Buffer from driver.
+			LogBatchBufferSize,					// Length of output buffer in bytes.
+			NULL,								// Bytes placed in buffer (in the overlapped).
+			&Overlapped							// asynchronous call
+		);
+
+		if (!Status && GetLastError() != ERROR_IO_PENDING) {
+			break;
+		}
+
+		if (WaitForMultipleObjects(2, Events, FALSE, INFINITE) != WAIT_OBJECT_0)
+		{
+			//
+			// We're asked to stop, the request is not needed anymore
+			//
+			CancelIoEx(Handle, &Overlapped);
+			GetOverlappedResult(Handle, &Overlapped, &ReturnedLength, TRUE);
+			break;
+		}
+
+		//
+		// It fails if the subscriber is removed
+		//
+		if (!GetOverlappedResult(Handle, &Overlapped, &ReturnedLength, TRUE)) {
+			break;
+		}
+
+		Offset = 0;
+
+		while (Offset + sizeof(LOG_BATCH_PACKET_HEADER) <= ReturnedLength) {
+
+			memcpy(&PacketHeader, Buffer + Offset, sizeof(LOG_BATCH_PACKET_HEADER));
+			Offset += sizeof(LOG_BATCH_PACKET_HEADER);
+
+			if (PacketHeader.Length > PacketChunkSize || Offset + PacketHeader.Length > ReturnedLength) {
+				ShowMessages("Invalid packet in the batch of kernel messages\n");
+				break;
+			}
+
+			memcpy(MessageBuffer, Buffer + Offset, PacketHeader.Length);
+			MessageBuffer[PacketHeader.Length] = '\0';
+			Offset += PacketHeader.Length;
+
+			ShowKernelMessage(&PacketHeader, MessageBuffer);
+		}
+	}
+
+	CloseHandle(Event);
+	free(Buffer);
+	free(MessageBuffer);
+
+	return 0;
+}
+
+/**
+ * @brief Stop the reader of a subscriber (if there is any)
+ *
+ * @param SubscriberId
+ * @return VOID
+ */
+void SubscriptionStopReader(UINT32 SubscriberId) {
+
+	PSUBSCRIPTION_READER Reader = &SubscriptionReaders[SubscriberId];
+
+	if (Reader->Thread == NULL)
+	{
+		return;
+	}
+
+	SetEvent(Reader->StopEvent);
+	WaitForSingleObject(Reader->Thread, INFINITE);
+	CloseHandle(Reader->Thread);
+	CloseHandle(Reader->StopEvent);
+	Reader->Thread = NULL;
+	Reader->StopEvent = NULL;
+}
+
+/**
+ * @brief Start the reader of a new subscriber
+ *
+ * @param SubscriberId
+ * @return BOOLEAN Whether the reader is started or not
+ */
+BOOLEAN SubscriptionStartReader(UINT32 SubscriberId) {
+
+	PSUBSCRIPTION_READER Reader = &SubscriptionReaders[SubscriberId];
+
+	//
+	// The reader of the previous subscriber of this id is exited (or it's
+	// exiting, as the subscriber is removed)
+	//
+	SubscriptionStopReader(SubscriberId);
+
+	Reader->SubscriberId = SubscriberId;
+	Reader->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (Reader->StopEvent == NULL)
+	{
+		return FALSE;
+	}
+
+	Reader->Thread = CreateThread(NULL, 0, SubscriptionReaderThread, Reader, 0, NULL);
+
+	if (Reader->Thread == NULL)
+	{
+		CloseHandle(Reader->StopEvent);
+		Reader->StopEvent = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Parse the id of a subscriber (default or a hex value)
+ *
+ * @param Text
+ * @param SubscriberId
+ * @return BOOLEAN Whether it's a valid id or not
+ */
+BOOLEAN SubscriptionParseId(const string& Text, UINT32& SubscriberId) {
+
+	UINT64 Value;
+
+	if (!Text.compare("default")) {
+		SubscriberId = LOG_SUBSCRIBER_DEFAULT;
+		return TRUE;
+	}
+
+	if (!ScriptParseHexValue(Text, Value) || Value > LOG_MAXIMUM_SUBSCRIBERS) {
+		return FALSE;
+	}
+
+	SubscriberId = (UINT32)Value;
+	return TRUE;
+}
+
+void CommandSubscribe(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	UINT64 Value;
+	size_t i = 1;
+	LOG_SUBSCRIPTION_REQUEST Request = { 0 };
+
+	Request.SubscriberId = LOG_SUBSCRIBER_NEW;
+
+	if (SplittedCommand.size() > 1 && !SplittedCommand.at(1).compare("remove")) {
+
+		if (SplittedCommand.size() != 3 || !SubscriptionParseId(SplittedCommand.at(2), Request.SubscriberId)) {
+			ShowMessages("incorrect use of '.subscribe'\n\n");
+			CommandSubscribeHelp();
+			return;
+		}
+
+		Request.Flags = LOG_SUBSCRIPTION_REMOVE;
+		i = SplittedCommand.size();
+	}
+	else if (SplittedCommand.size() > 1 && SubscriptionParseId(SplittedCommand.at(1), Request.SubscriberId)) {
+		i = 2;
+	}
+
+	for (; i < SplittedCommand.size(); i++)
+	{
+		if (!SplittedCommand.at(i).compare("exclusive")) {
+			Request.Flags |= LOG_SUBSCRIPTION_EXCLUSIVE;
+		}
+		else if (i + 1 < SplittedCommand.size() && ScriptParseHexValue(SplittedCommand.at(i + 1), Value)) {
+
+			if (!SplittedCommand.at(i).compare("tag") && Request.CountOfTags < LOG_SUBSCRIPTION_MAXIMUM_TAGS) {
+				Request.Tags[Request.CountOfTags++] = Value;
+			}
+			else if (!SplittedCommand.at(i).compare("op")) {
+				Request.OperationCodes |= 1ull << min(Value, (UINT64)LOG_SUBSCRIPTION_OTHER_OPERATIONS);
+			}
+			else if (!SplittedCommand.at(i).compare("core") && Value < 64) {
+				Request.CoreMask |= 1ull << Value;
+			}
+			else {
+				ShowMessages("incorrect use of '.subscribe'\n\n");
+				CommandSubscribeHelp();
+				return;
+			}
+			i++;
+		}
+		else {
+			ShowMessages("incorrect use of '.subscribe'\n\n");
+			CommandSubscribeHelp();
+			return;
+		}
+	}
+
+	if (Request.SubscriberId == LOG_SUBSCRIBER_DEFAULT && (Request.Flags & LOG_SUBSCRIPTION_EXCLUSIVE)) {
+		ShowMessages("the default consumer can't be exclusive\n");
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_LOG_SUBSCRIBE,				// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(LOG_SUBSCRIPTION_REQUEST),	// Length of input buffer in bytes.
+		&Request,							// Output Buffer from driver.
+		sizeof(LOG_SUBSCRIPTION_REQUEST),	// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	if (Request.Status != 0) {
+		ShowMessages("the subscription is not changed (status : 0x%x)\n", Request.Status);
+		return;
+	}
+
+	if (Request.Flags & LOG_SUBSCRIPTION_REMOVE) {
+
+		if (Request.SubscriberId != LOG_SUBSCRIBER_DEFAULT) {
+			SubscriptionStopReader(Request.SubscriberId);
+		}
+		ShowMessages("the subscriber 0x%x is removed\n", Request.SubscriberId);
+		return;
+	}
+
+	if (Request.SubscriberId == LOG_SUBSCRIBER_DEFAULT) {
+		ShowMessages("the filter of the default consumer is changed\n");
+		return;
+	}
+
+	//
+	// A new subscriber (or a filter is changed), each subscriber has a reader
+	//
+	if (SubscriptionReaders[Request.SubscriberId].Thread != NULL &&
+		WaitForSingleObject(SubscriptionReaders[Request.SubscriberId].Thread, 0) == WAIT_TIMEOUT) {
+		ShowMessages("the filter of the subscriber 0x%x is changed\n", Request.SubscriberId);
+		return;
+	}
+
+	if (!SubscriptionStartReader(Request.SubscriberId)) {
+		ShowMessages("unable to start the reader of the subscriber 0x%x (%x)\n", Request.SubscriberId, GetLastError());
+		return;
+	}
+
+	ShowMessages("the subscriber 0x%x is added\n", Request.SubscriberId);
+}
@@ -0,0 +1,97 @@
+/**
+ * @file suspend.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Suspend and resume the virtualization without unloading the hypervisor
+ * @details
+ * @version 0.1
+ * @date 2020-05-22
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandSuspendHelp() {
+	ShowMessages(".suspend : turns off vmx on all the cores, the regions, the EPT tables, the pools and the hooks are kept for resuming.\n\n");
+	ShowMessages("syntax : \t.suspend\n");
+	ShowMessages("\t\te.g : .suspend\n");
+	ShowMessages("\t\t\tdescription : suspends the virtualization (the sampling, the dirty page tracking and the aggregation are stopped)\n");
+}
+
+void CommandResumeHelp() {
+	ShowMessages(".resume : turns on vmx on all the cores after '.suspend' and applies the kept hooks again.\n\n");
+	ShowMessages("syntax : \t.resume\n");
+	ShowMessages("\t\te.g : .resume\n");
+	ShowMessages("\t\t\tdescription : resumes the virtualization\n");
+}
+
+/**
+ * @brief Send the request of suspending or resuming to the driver
+ *
+ * @param Suspend Whether to suspend or resume
+ * @return VOID
+ */
+void SuspendControlVmx(BOOLEAN Suspend) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	VMX_SUSPEND_REQUEST Request = { 0 };
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Request.Suspend = Suspend;
+
+	Status = DeviceIoControlSynchronous(
+		Handle,								// Handle to device
+		IOCTL_SUSPEND_VMX,					// IO Control code
+		&Request,							// Input Buffer to driver.
+		sizeof(VMX_SUSPEND_REQUEST),		// Length of input buffer in bytes.
+		&Request,							// Output Buffer from driver.
+		sizeof(VMX_SUSPEND_REQUEST),		// Length of output buffer in bytes.
+		&ReturnedLength 					// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x (probably the vmx is already %s)\n", GetLastError(), Suspend ? "suspended" : "running");
+		return;
+	}
+
+	if (Request.TimeStampCounterFrequency != 0) {
+		ShowMessages("vmx is %s in %llu us\n", Suspend ? "suspended" : "resumed", Request.Cycles * 1000000 / Request.TimeStampCounterFrequency);
+	}
+	else {
+		ShowMessages("vmx is %s in %llu cycles\n", Suspend ? "suspended" : "resumed", Request.Cycles);
+	}
+}
+
+void CommandSuspend(vector<string> SplittedCommand) {
+
+	if (SplittedCommand.size() != 1)
+	{
+		ShowMessages("incorrect use of '.suspend'\n\n");
+		CommandSuspendHelp();
+		return;
+	}
+
+	SuspendControlVmx(TRUE);
+}
+
+void CommandResume(vector<string> SplittedCommand) {
+
+	if (SplittedCommand.size() != 1)
+	{
+		ShowMessages("incorrect use of '.resume'\n\n");
+		CommandResumeHelp();
+		return;
+	}
+
+	SuspendControlVmx(FALSE);
+}
@@ -0,0 +1,135 @@
+/**
+ * @file syscallfilter.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Choose the syscalls that trigger the syscall hook events
+ * @details
+ * @version 0.1
+ * @date 2020-05-18
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+void CommandSyscallFilterHelp() {
+	ShowMessages(".syscallfilter : chooses the syscalls that trigger the syscall hook events, the other syscalls are only emulated.\n\n");
+	ShowMessages("syntax : \t.syscallfilter [syscall number (hex value)]... [pid (hex value)] [cr3 (hex value)] [clear]\n");
+	ShowMessages("\t\te.g : .syscallfilter 55 33 1004\n");
+	ShowMessages("\t\t\tdescription : only the syscalls 0x55, 0x33 and 0x1004 trigger the events\n");
+	ShowMessages("\t\te.g : .syscallfilter 55 pid 1f4\n");
+	ShowMessages("\t\t\tdescription : only the syscall 0x55 of the process 0x1f4 triggers the events\n");
+	ShowMessages("\t\te.g : .syscallfilter cr3 1aa000\n");
+	ShowMessages("\t\t\tdescription : all the syscalls of the address space 0x1aa000 trigger the events\n");
+	ShowMessages("\t\te.g : .syscallfilter clear\n");
+	ShowMessages("\t\t\tdescription : all the syscalls trigger the events\n");
+}
+
+void CommandSyscallFilter(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	PSYSCALL_HOOK_FILTER_REQUEST Request;
+	BOOLEAN IsClear = FALSE;
+	UINT32 CountOfSyscalls = 0;
+
+	if (SplittedCommand.size() < 2)
+	{
+		ShowMessages("incorrect use of '.syscallfilter'\n\n");
+		CommandSyscallFilterHelp();
+		return;
+	}
+
+	Request = (PSYSCALL_HOOK_FILTER_REQUEST)malloc(sizeof(SYSCALL_HOOK_FILTER_REQUEST));
+
+	if (!Request)
+	{
+		ShowMessages("Unable to allocate memory for the filter\n");
+		return;
+	}
+
+	RtlZeroMemory(Request, sizeof(SYSCALL_HOOK_FILTER_REQUEST));
+
+	for (size_t i = 1; i < SplittedCommand.size(); i++)
+	{
+		BOOLEAN IsHexValue = i + 1 < SplittedCommand.size() &&
+			!SplittedCommand.at(i + 1).empty() &&
+			SplittedCommand.at(i + 1).find_first_not_of("0123456789abcdefABCDEF") == string::npos;
+
+		if (!SplittedCommand.at(i).compare("clear") && SplittedCommand.size() == 2) {
+			IsClear = TRUE;
+		}
+		else if (!SplittedCommand.at(i).compare("pid") && IsHexValue) {
+			Request->ProcessId = stoul(SplittedCommand.at(++i), nullptr, 16);
+		}
+		else if (!SplittedCommand.at(i).compare("cr3") && IsHexValue) {
+			Request->Cr3 = stoull(SplittedCommand.at(++i), nullptr, 16);
+		}
+		else if (SplittedCommand.at(i).find_first_not_of("0123456789abcdefABCDEF") == string::npos &&
+			SplittedCommand.at(i).size() <= 4 &&
+			stoul(SplittedCommand.at(i), nullptr, 16) < SYSCALL_HOOK_FILTER_MAXIMUM_SYSCALLS) {
+
+			UINT32 SyscallNumber = stoul(SplittedCommand.at(i), nullptr, 16);
+
+			Request->Bitmap[SyscallNumber / 8] |= 1 << (SyscallNumber % 8);
+			Request->FilterSyscallNumbers = TRUE;
+			CountOfSyscalls++;
+		}
+		else {
+			ShowMessages("incorrect use of '.syscallfilter'\n\n");
+			CommandSyscallFilterHelp();
+			free(Request);
+			return;
+		}
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		free(Request);
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,									// Handle to device
+		IOCTL_SET_SYSCALL_HOOK_FILTER,			// IO Control code
+		Request,								// Input Buffer to driver.
+		sizeof(SYSCALL_HOOK_FILTER_REQUEST),	// Length of input buffer in bytes.
+		NULL,									// Output Buffer from driver.
+		0,										// Length of output buffer in bytes.
+		&ReturnedLength 						// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		free(Request);
+		return;
+	}
+
+	if (IsClear) {
+		ShowMessages("all the syscalls trigger the events\n");
+	}
+	else {
+		if (CountOfSyscalls != 0) {
+			ShowMessages("the filter is set (%d syscall numbers", CountOfSyscalls);
+		}
+		else {
+			ShowMessages("the filter is set (all the syscall numbers");
+		}
+
+		if (Request->ProcessId != 0) {
+			ShowMessages(", process id : %x", Request->ProcessId);
+		}
+
+		if (Request->Cr3 != 0) {
+			ShowMessages(", cr3 : %llx", Request->Cr3);
+		}
+
+		ShowMessages(")\n");
+	}
+
+	free(Request);
+}
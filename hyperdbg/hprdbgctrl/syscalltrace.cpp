@@ -0,0 +1,184 @@
+/**
+ * @file syscalltrace.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Control and show the binary trace of the syscalls
+ * @details The names of the syscalls are found from the stubs of ntdll.dll
+ * and win32u.dll (each stub loads its syscall number to eax)
+ * @version 0.1
+ * @date 2020-05-19
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern HANDLE Handle;
+
+map<UINT32, string> SyscallNames; // Names of the syscalls (key is the syscall number)
+BOOLEAN IsSyscallNamesLoaded = FALSE;
+
+void CommandSyscallTraceHelp() {
+	ShowMessages(".syscalltrace : traces the syscalls that match the filter of '.syscallfilter' as binary records (with their first 4 arguments).\n\n");
+	ShowMessages("syntax : \t.syscalltrace [start [return]] [stop]\n");
+	ShowMessages("\t\te.g : .syscalltrace start\n");
+	ShowMessages("\t\t\tdescription : starts tracing the syscalls\n");
+	ShowMessages("\t\te.g : .syscalltrace start return\n");
+	ShowMessages("\t\t\tdescription : starts tracing the syscalls and their return values\n");
+	ShowMessages("\t\te.g : .syscalltrace stop\n");
+	ShowMessages("\t\t\tdescription : stops tracing the syscalls\n");
+}
+
+/**
+ * @brief Add the syscall numbers of the Nt stubs of a module to the names
+ *
+ * @param Module Base address of the loaded module
+ * @return VOID
+ */
+void SyscallTraceLoadStubs(HMODULE Module) {
+
+	PIMAGE_DOS_HEADER DosHeader = (PIMAGE_DOS_HEADER)Module;
+	PIMAGE_NT_HEADERS NtHeaders;
+	PIMAGE_EXPORT_DIRECTORY Exports;
+	PDWORD Names;
+	PDWORD Functions;
+	PWORD Ordinals;
+
+	if (!Module || DosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+	{
+		return;
+	}
+
+	NtHeaders = (PIMAGE_NT_HEADERS)((UINT64)Module + DosHeader->e_lfanew);
+
+	if (NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].Size == 0)
+	{
+		return;
+	}
+
+	Exports = (PIMAGE_EXPORT_DIRECTORY)((UINT64)Module + NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
+	Names = (PDWORD)((UINT64)Module + Exports->AddressOfNames);
+	Functions = (PDWORD)((UINT64)Module + Exports->AddressOfFunctions);
+	Ordinals = (PWORD)((UINT64)Module + Exports->AddressOfNameOrdinals);
+
+	for (DWORD i = 0; i < Exports->NumberOfNames; i++)
+	{
+		const char* Name = (const char*)((UINT64)Module + Names[i]);
+		PUCHAR Code = (PUCHAR)((UINT64)Module + Functions[Ordinals[i]]);
+
+		//
+		// mov r10, rcx ; mov eax, syscall number
+		//
+		if (Name[0] == 'N' && Name[1] == 't' &&
+			Code[0] == 0x4c && Code[1] == 0x8b && Code[2] == 0xd1 && Code[3] == 0xb8)
+		{
+			SyscallNames[*(PUINT32)&Code[4]] = Name;
+		}
+	}
+}
+
+/**
+ * @brief Find the name of a syscall number
+ *
+ * @param SyscallNumber The syscall number
+ * @return const char* The name or NULL if it's not found
+ */
+const char* SyscallTraceGetName(UINT32 SyscallNumber) {
+
+	if (!IsSyscallNamesLoaded)
+	{
+		SyscallTraceLoadStubs(GetModuleHandleA("ntdll.dll"));
+		SyscallTraceLoadStubs(LoadLibraryExA("win32u.dll", NULL, DONT_RESOLVE_DLL_REFERENCES));
+		IsSyscallNamesLoaded = TRUE;
+	}
+
+	auto Found = SyscallNames.find(SyscallNumber);
+
+	return Found != SyscallNames.end() ? Found->second.c_str() : NULL;
+}
+
+/**
+ * @brief Show an OPERATION_LOG_SYSCALL_TRACE record
+ *
+ * @param Record The record
+ * @return VOID
+ */
+void ShowSyscallTraceRecord(PSYSCALL_TRACE_RECORD Record) {
+
+	char Number[16];
+	const char* Name = SyscallTraceGetName(Record->SyscallNumber);
+
+	if (!Name) {
+		sprintf_s(Number, sizeof(Number), "syscall %x", Record->SyscallNumber);
+		Name = Number;
+	}
+
+	if (Record->IsReturn) {
+		ShowMessages("(%s - core : %d) %x.%x %s => %llx\n",
+			TimeStampCounterToString(Record->TimeStampCounter).c_str(),
+			Record->CoreId,
+			Record->ProcessId,
+			Record->ThreadId,
+			Name,
+			Record->ReturnValue);
+	}
+	else {
+		ShowMessages("(%s - core : %d) %x.%x %s(%llx, %llx, %llx, %llx)\n",
+			TimeStampCounterToString(Record->TimeStampCounter).c_str(),
+			Record->CoreId,
+			Record->ProcessId,
+			Record->ThreadId,
+			Name,
+			Record->Arguments[0],
+			Record->Arguments[1],
+			Record->Arguments[2],
+			Record->Arguments[3]);
+	}
+}
+
+void CommandSyscallTrace(vector<string> SplittedCommand) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	SYSCALL_TRACE_CONTROL_REQUEST Request = { 0 };
+
+	if (SplittedCommand.size() == 2 && !SplittedCommand.at(1).compare("start")) {
+		Request.Start = TRUE;
+	}
+	else if (SplittedCommand.size() == 3 && !SplittedCommand.at(1).compare("start") && !SplittedCommand.at(2).compare("return")) {
+		Request.Start = TRUE;
+		Request.CaptureReturnValue = TRUE;
+	}
+	else if (SplittedCommand.size() == 2 && !SplittedCommand.at(1).compare("stop")) {
+		Request.Start = FALSE;
+	}
+	else {
+		ShowMessages("incorrect use of '.syscalltrace'\n\n");
+		CommandSyscallTraceHelp();
+		return;
+	}
+
+	if (!Handle)
+	{
+		ShowMessages("Handle not found, probably the driver is not initialized.\n");
+		return;
+	}
+
+	Status = DeviceIoControlSynchronous(
+		Handle,									// Handle to device
+		IOCTL_CONTROL_SYSCALL_TRACE,			// IO Control code
+		&Request,								// Input Buffer to driver.
+		sizeof(SYSCALL_TRACE_CONTROL_REQUEST),	// Length of input buffer in bytes.
+		NULL,									// Output Buffer from driver.
+		0,										// Length of output buffer in bytes.
+		&ReturnedLength 						// Bytes placed in buffer.
+	);
+
+	if (!Status) {
+		ShowMessages("Ioctl failed with code 0x%x\n", GetLastError());
+		return;
+	}
+
+	ShowMessages(Request.Start ? "syscall trace is started\n" : "syscall trace is stopped\n");
+}
@@ -0,0 +1,811 @@
+/**
+ * @file tracefile.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Save the kernel messages to a binary trace file
+ * @details The records are written in big chunks with unbuffered and
+ * overlapped writes, while a chunk is written the next one is filled
+ * @version 0.1
+ * @date 2020-05-03
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "pch.h"
+
+using namespace std;
+
+extern map<UINT32, string> BinaryMessageFormats;
+extern LOG_TIME_CALIBRATION TimeCalibration;
+
+//
+// Minimum length of the matches, and the limits of the end of the block
+// in the LZ4 block format
+//
+#define LZ4_MINIMUM_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_START_LIMIT 12
+#define LZ4_MAXIMUM_OFFSET 0xffff
+#define LZ4_HASH_BITS 12
+
+#define TRACE_FILE_ALIGN(Length) (((Length) + TRACE_FILE_SECTOR_SIZE - 1) & ~((UINT64)TRACE_FILE_SECTOR_SIZE - 1))
+#define TRACE_FILE_IO_BUFFER_SIZE TRACE_FILE_ALIGN(sizeof(TRACE_FILE_CHUNK_HEADER) + LZ4_COMPRESS_BOUND(TRACE_FILE_CHUNK_SIZE))
+
+SRWLOCK TraceFileLock = SRWLOCK_INIT;		// The command and the thread of messages use the file
+HANDLE TraceFileHandle = INVALID_HANDLE_VALUE;
+string TraceFilePath;
+BOOLEAN TraceFileCompress;
+BOOLEAN TraceFileQuiet;						// Don't show the messages that are saved to the file
+BOOLEAN TraceFileNeedsPreamble;				// The known binary formats should be saved before the first record
+UINT64 TraceFileOffset;						// Where the next chunk is written
+TRACE_FILE_HEADER TraceFileHeader;
+TRACE_FILE_CHUNK_HEADER TraceFileChunk;		// The chunk that is being filled
+char* TraceFileStagingBuffer;				// Records of the chunk that is being filled
+BYTE* TraceFileIoBuffers[2];				// Aligned buffers that are written to the file
+OVERLAPPED TraceFileOverlapped[2];
+HANDLE TraceFileEvents[3];					// Events of the writes (there are two pending writes at the same time)
+BOOLEAN TraceFileIoPending[2];
+UINT32 TraceFileCurrentIoBuffer;
+vector<TRACE_FILE_INDEX_ENTRY> TraceFileIndex;
+
+/**
+ * @brief Compress a block in LZ4 block format
+ * @details It's a greedy compressor, the speed is more important than the ratio because
+ * the messages are compressed in the thread that receives them, the hash table is per
+ * thread as the trace file and the remote agent compress at the same time
+ *
+ * @param Source
+ * @param SourceLength
+ * @param Destination
+ * @param DestinationLength
+ * @return UINT32 Length of the compressed block or zero if it doesn't fit
+ */
+UINT32 TraceFileCompressBlock(const BYTE* Source, UINT32 SourceLength, BYTE* Destination, UINT32 DestinationLength) {
+
+	static thread_local UINT32 HashTable[1 << LZ4_HASH_BITS];
+	const BYTE* Current = Source;
+	const BYTE* Anchor = Source;
+	const BYTE* End = Source + SourceLength;
+	BYTE* Output = Destination;
+	BYTE* OutputEnd = Destination + DestinationLength;
+	UINT32 Sequence;
+	UINT32 ReferenceSequence;
+	UINT32 Length;
+
+	memset(HashTable, 0, sizeof(HashTable));
+
+	while (SourceLength > LZ4_MATCH_START_LIMIT && Current < End - LZ4_MATCH_START_LIMIT)
+	{
+		memcpy(&Sequence, Current, sizeof(UINT32));
+
+		UINT32 Hash = (Sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		const BYTE* Reference = Source + HashTable[Hash];
+		HashTable[Hash] = (UINT32)(Current - Source);
+
+		memcpy(&ReferenceSequence, Reference, sizeof(UINT32));
+
+		if (Reference >= Current || Current - Reference > LZ4_MAXIMUM_OFFSET || ReferenceSequence != Sequence)
+		{
+			Current++;
+			continue;
+		}
+
+		//
+		// Extend the match, it should end before the last literals
+		//
+		const BYTE* MatchEnd = Current + LZ4_MINIMUM_MATCH;
+		Reference += LZ4_MINIMUM_MATCH;
+
+		while (MatchEnd < End - LZ4_LAST_LITERALS && *MatchEnd == *Reference)
+		{
+			MatchEnd++;
+			Reference++;
+		}
+
+		UINT32 LiteralLength = (UINT32)(Current - Anchor);
+		UINT32 MatchLength = (UINT32)(MatchEnd - Current) - LZ4_MINIMUM_MATCH;
+		UINT32 Offset = (UINT32)(MatchEnd - Reference);
+
+		if (Output + 1 + LiteralLength / 255 + 1 + LiteralLength + 2 + MatchLength / 255 + 1 > OutputEnd)
+		{
+			return 0;
+		}
+
+		//
+		// Token, then the literals, then the offset and the rest of the match length
+		//
+		BYTE* Token = Output++;
+
+		if (LiteralLength >= 15)
+		{
+			*Token = 15 << 4;
+			for (Length = LiteralLength - 15; Length >= 255; Length -= 255)
+			{
+				*Output++ = 255;
+			}
+			*Output++ = (BYTE)Length;
+		}
+		else
+		{
+			*Token = (BYTE)(LiteralLength << 4);
+		}
+
+		memcpy(Output, Anchor, LiteralLength);
+		Output += LiteralLength;
+
+		*Output++ = (BYTE)(Offset & 0xff);
+		*Output++ = (BYTE)(Offset >> 8);
+
+		if (MatchLength >= 15)
+		{
+			*Token |= 15;
+			for (Length = MatchLength - 15; Length >= 255; Length -= 255)
+			{
+				*Output++ = 255;
+			}
+			*Output++ = (BYTE)Length;
+		}
+		else
+		{
+			*Token |= (BYTE)MatchLength;
+		}
+
+		Current = MatchEnd;
+		Anchor = Current;
+	}
+
+	//
+	// The last sequence has only literals
+	//
+	UINT32 LiteralLength = (UINT32)(End - Anchor);
+
+	if (Output + 1 + LiteralLength / 255 + 1 + LiteralLength > OutputEnd)
+	{
+		return 0;
+	}
+
+	if (LiteralLength >= 15)
+	{
+		*Output++ = 15 << 4;
+		for (Length = LiteralLength - 15; Length >= 255; Length -= 255)
+		{
+			*Output++ = 255;
+		}
+		*Output++ = (BYTE)Length;
+	}
+	else
+	{
+		*Output++ = (BYTE)(LiteralLength << 4);
+	}
+
+	memcpy(Output, Anchor, LiteralLength);
+	Output += LiteralLength;
+
+	return (UINT32)(Output - Destination);
+}
+
+/**
+ * @brief Read a length of the LZ4 block format (the rest of a 15 in the token)
+ *
+ * @param Current The current byte of the block, it's moved after the length
+ * @param End End of the block
+ * @param Length The length that is extended
+ * @return BOOLEAN Whether the length is valid or not
+ */
+BOOLEAN TraceFileReadLength(const BYTE** Current, const BYTE* End, UINT32* Length) {
+
+	BYTE Byte;
+
+	do
+	{
+		if (*Current >= End || *Length > MAXUINT32 - 255)
+		{
+			return FALSE;
+		}
+
+		Byte = *(*Current)++;
+		*Length += Byte;
+
+	} while (Byte == 255);
+
+	return TRUE;
+}
+
+/**
+ * @brief Decompress a block in LZ4 block format
+ * @details The block might be received from the network, so all of the lengths
+ * and the offsets are checked
+ *
+ * @param Source
+ * @param SourceLength
+ * @param Destination
+ * @param DestinationLength
+ * @return UINT32 Length of the decompressed block or zero if it's not valid
+ */
+UINT32 TraceFileDecompressBlock(const BYTE* Source, UINT32 SourceLength, BYTE* Destination, UINT32 DestinationLength) {
+
+	const BYTE* Current = Source;
+	const BYTE* End = Source + SourceLength;
+	BYTE* Output = Destination;
+	BYTE* OutputEnd = Destination + DestinationLength;
+	UINT32 Length;
+	UINT32 Offset;
+
+	while (Current < End)
+	{
+		BYTE Token = *Current++;
+
+		//
+		// The literals
+		//
+		Length = Token >> 4;
+
+		if (Length == 15 && !TraceFileReadLength(&Current, End, &Length))
+		{
+			return 0;
+		}
+
+		if (Length > (UINT32)(End - Current) || Length > (UINT32)(OutputEnd - Output))
+		{
+			return 0;
+		}
+
+		memcpy(Output, Current, Length);
+		Output += Length;
+		Current += Length;
+
+		//
+		// The last sequence has only literals
+		//
+		if (Current == End)
+		{
+			break;
+		}
+
+		//
+		// The match, it might overlap the output so it's copied byte by byte
+		//
+		if (End - Current < 2)
+		{
+			return 0;
+		}
+
+		Offset = Current[0] | (Current[1] << 8);
+		Current += 2;
+
+		if (Offset == 0 || Offset > (UINT32)(Output - Destination))
+		{
+			return 0;
+		}
+
+		Length = Token & 15;
+
+		if (Length == 15 && !TraceFileReadLength(&Current, End, &Length))
+		{
+			return 0;
+		}
+
+		Length += LZ4_MINIMUM_MATCH;
+
+		if (Length > (UINT32)(OutputEnd - Output))
+		{
+			return 0;
+		}
+
+		const BYTE* Match = Output - Offset;
+
+		while (Length--)
+		{
+			*Output++ = *Match++;
+		}
+	}
+
+	return (UINT32)(Output - Destination);
+}
+
+/**
+ * @brief Wait for the previous write of an I/O buffer
+ *
+ * @param Index Index of the I/O buffer
+ * @return BOOLEAN Whether the write was successful or not
+ */
+BOOLEAN TraceFileWaitForWrite(UINT32 Index) {
+
+	DWORD WrittenLength;
+	BOOL Status;
+
+	if (!TraceFileIoPending[Index])
+	{
+		return TRUE;
+	}
+
+	TraceFileIoPending[Index] = FALSE;
+	Status = GetOverlappedResult(TraceFileHandle, &TraceFileOverlapped[Index], &WrittenLength, TRUE);
+
+	if (!Status) {
+		ShowMessages("writing to the trace file failed with code 0x%x\n", GetLastError());
+	}
+
+	return Status;
+}
+
+/**
+ * @brief Write an aligned buffer to the file
+ * @details The write continues in the background if the buffer is one of
+ * the I/O buffers, otherwise it waits for the write to finish
+ *
+ * @param Index Index of the I/O buffer or 0xffffffff for other buffers
+ * @param Buffer Aligned buffer
+ * @param Length Length of the buffer (a multiple of TRACE_FILE_SECTOR_SIZE)
+ * @param Offset Offset in the file
+ * @return BOOLEAN Whether the write was started successfully or not
+ */
+BOOLEAN TraceFileWrite(UINT32 Index, BYTE* Buffer, UINT32 Length, UINT64 Offset) {
+
+	OVERLAPPED Overlapped = { 0 };
+	DWORD WrittenLength;
+	LPOVERLAPPED CurrentOverlapped = Index < 2 ? &TraceFileOverlapped[Index] : &Overlapped;
+
+	memset(CurrentOverlapped, 0, sizeof(OVERLAPPED));
+	CurrentOverlapped->hEvent = TraceFileEvents[min(Index, 2)];
+	CurrentOverlapped->Offset = (DWORD)Offset;
+	CurrentOverlapped->OffsetHigh = (DWORD)(Offset >> 32);
+
+	if (!WriteFile(TraceFileHandle, Buffer, Length, NULL, CurrentOverlapped) && GetLastError() != ERROR_IO_PENDING) {
+		ShowMessages("writing to the trace file failed with code 0x%x\n", GetLastError());
+		return FALSE;
+	}
+
+	if (Index < 2)
+	{
+		TraceFileIoPending[Index] = TRUE;
+		return TRUE;
+	}
+
+	if (!GetOverlappedResult(TraceFileHandle, CurrentOverlapped, &WrittenLength, TRUE)) {
+		ShowMessages("writing to the trace file failed with code 0x%x\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief Compress the current chunk (if needed) and write it to the file
+ * @details The caller should hold TraceFileLock
+ *
+ * @return VOID
+ */
+void TraceFileFlushChunk() {
+
+	UINT32 StoredLength = 0;
+	UINT32 Index = TraceFileCurrentIoBuffer;
+	BYTE* IoBuffer = TraceFileIoBuffers[Index];
+	BYTE* Payload = IoBuffer + sizeof(TRACE_FILE_CHUNK_HEADER);
+	TRACE_FILE_INDEX_ENTRY Entry = { 0 };
+
+	if (TraceFileChunk.RecordCount == 0)
+	{
+		return;
+	}
+
+	//
+	// The buffer might still be written (from two chunks ago)
+	//
+	TraceFileWaitForWrite(Index);
+
+	if (TraceFileCompress)
+	{
+		StoredLength = TraceFileCompressBlock((BYTE*)TraceFileStagingBuffer, TraceFileChunk.UncompressedLength, Payload, LZ4_COMPRESS_BOUND(TRACE_FILE_CHUNK_SIZE));
+	}
+
+	if (StoredLength != 0 && StoredLength < TraceFileChunk.UncompressedLength)
+	{
+		TraceFileChunk.Flags = TRACE_FILE_FLAG_COMPRESSED;
+	}
+	else
+	{
+		//
+		// Not compressible, save the records as is
+		//
+		StoredLength = TraceFileChunk.UncompressedLength;
+		TraceFileChunk.Flags = 0;
+		memcpy(Payload, TraceFileStagingBuffer, StoredLength);
+	}
+
+	TraceFileChunk.Magic = TRACE_FILE_CHUNK_MAGIC;
+	TraceFileChunk.StoredLength = StoredLength;
+	memcpy(IoBuffer, &TraceFileChunk, sizeof(TRACE_FILE_CHUNK_HEADER));
+
+	UINT32 Length = (UINT32)TRACE_FILE_ALIGN(sizeof(TRACE_FILE_CHUNK_HEADER) + StoredLength);
+	memset(Payload + StoredLength, 0, Length - sizeof(TRACE_FILE_CHUNK_HEADER) - StoredLength);
+
+	if (TraceFileWrite(Index, IoBuffer, Length, TraceFileOffset))
+	{
+		Entry.FileOffset = TraceFileOffset;
+		Entry.RecordCount = TraceFileChunk.RecordCount;
+		Entry.StoredLength = StoredLength;
+		Entry.MinimumTimeStampCounter = TraceFileChunk.MinimumTimeStampCounter;
+		Entry.MaximumTimeStampCounter = TraceFileChunk.MaximumTimeStampCounter;
+		memcpy(Entry.BufferMask, TraceFileChunk.BufferMask, sizeof(Entry.BufferMask));
+		TraceFileIndex.push_back(Entry);
+
+		TraceFileOffset += Length;
+		TraceFileCurrentIoBuffer ^= 1;
+	}
+
+	memset(&TraceFileChunk, 0, sizeof(TRACE_FILE_CHUNK_HEADER));
+}
+
+/**
+ * @brief Add a record to the current chunk
+ * @details The caller should hold TraceFileLock
+ *
+ * @param PacketHeader Header of the record
+ * @param Body Body of the record
+ * @return VOID
+ */
+void TraceFileAppendRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body) {
+
+	UINT32 Length = sizeof(LOG_BATCH_PACKET_HEADER) + PacketHeader->Length;
+
+	if (TraceFileChunk.UncompressedLength + Length > TRACE_FILE_CHUNK_SIZE)
+	{
+		TraceFileFlushChunk();
+	}
+
+	memcpy(TraceFileStagingBuffer + TraceFileChunk.UncompressedLength, PacketHeader, sizeof(LOG_BATCH_PACKET_HEADER));
+	memcpy(TraceFileStagingBuffer + TraceFileChunk.UncompressedLength + sizeof(LOG_BATCH_PACKET_HEADER), Body, PacketHeader->Length);
+
+	//
+	// The records that are made by us (e.g. the preamble) don't have a time stamp counter
+	//
+	if (PacketHeader->TimeStampCounter != 0)
+	{
+		if (TraceFileChunk.MinimumTimeStampCounter == 0 || PacketHeader->TimeStampCounter < TraceFileChunk.MinimumTimeStampCounter)
+		{
+			TraceFileChunk.MinimumTimeStampCounter = PacketHeader->TimeStampCounter;
+		}
+
+		if (PacketHeader->TimeStampCounter > TraceFileChunk.MaximumTimeStampCounter)
+		{
+			TraceFileChunk.MaximumTimeStampCounter = PacketHeader->TimeStampCounter;
+		}
+	}
+
+	if (PacketHeader->BufferIndex < LOG_MAXIMUM_SHARED_BUFFERS)
+	{
+		TraceFileChunk.BufferMask[PacketHeader->BufferIndex / 64] |= 1ull << (PacketHeader->BufferIndex % 64);
+	}
+
+	TraceFileChunk.RecordCount++;
+	TraceFileChunk.UncompressedLength += Length;
+	TraceFileHeader.RecordCount++;
+}
+
+/**
+ * @brief Make the records of the state that is needed to decode the next records
+ * @details The binary formats and the time calibration might be received
+ * before opening the file (or connecting the remote debugger), it should be
+ * called in the thread of messages as the formats are only used by that thread
+ *
+ * @param AppendRecord Called for each record
+ * @return VOID
+ */
+void TraceFileBuildPreamble(void (*AppendRecord)(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body)) {
+
+	LOG_BATCH_PACKET_HEADER PacketHeader = { 0 };
+	char Body[PacketChunkSize];
+
+	if (TimeCalibration.TimeStampCounterFrequency != 0)
+	{
+		PacketHeader.OperationCode = OPERATION_LOG_TIME_CALIBRATION;
+		PacketHeader.Length = sizeof(LOG_TIME_CALIBRATION);
+		PacketHeader.TimeStampCounter = TimeCalibration.TimeStampCounter;
+		AppendRecord(&PacketHeader, (const char*)&TimeCalibration);
+	}
+
+	for (auto& Format : BinaryMessageFormats)
+	{
+		PLOG_BINARY_FORMAT_DEFINITION Definition = (PLOG_BINARY_FORMAT_DEFINITION)Body;
+		UINT32 FormatLength = min((UINT32)Format.second.size(), (UINT32)(PacketChunkSize - FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format) - 1));
+
+		Definition->FormatId = Format.first;
+		Definition->ArgumentCount = 0;
+		memcpy(Definition->Format, Format.second.c_str(), FormatLength);
+		Definition->Format[FormatLength] = '\0';
+
+		PacketHeader.OperationCode = OPERATION_LOG_BINARY_FORMAT_DEFINITION;
+		PacketHeader.Length = FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format) + FormatLength + 1;
+		PacketHeader.TimeStampCounter = 0;
+		AppendRecord(&PacketHeader, Body);
+	}
+}
+
+/**
+ * @brief Save the state that is needed to decode the records to the file
+ * @details The caller should hold TraceFileLock
+ *
+ * @return VOID
+ */
+void TraceFileSavePreamble() {
+
+	TraceFileNeedsPreamble = FALSE;
+
+	TraceFileBuildPreamble(TraceFileAppendRecord);
+
+	if (TimeCalibration.TimeStampCounterFrequency != 0)
+	{
+		memcpy(&TraceFileHeader.TimeCalibration, &TimeCalibration, sizeof(LOG_TIME_CALIBRATION));
+	}
+}
+
+/**
+ * @brief Save a kernel message to the trace file (if there is any)
+ *
+ * @param PacketHeader Header of the message
+ * @param Body Body of the message
+ * @return BOOLEAN Whether the message should be shown too or not
+ */
+BOOLEAN TraceFileSaveRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body) {
+
+	BOOLEAN Show = TRUE;
+
+	//
+	// Nothing to do if there is no file, the handle is checked without
+	// the lock as most of the time there is no file
+	//
+	if (TraceFileHandle == INVALID_HANDLE_VALUE)
+	{
+		return TRUE;
+	}
+
+	AcquireSRWLockExclusive(&TraceFileLock);
+
+	if (TraceFileHandle != INVALID_HANDLE_VALUE)
+	{
+		if (TraceFileNeedsPreamble)
+		{
+			TraceFileSavePreamble();
+		}
+
+		TraceFileAppendRecord(PacketHeader, Body);
+
+		if (TraceFileHeader.TimeCalibration.TimeStampCounterFrequency == 0 &&
+			PacketHeader->OperationCode == OPERATION_LOG_TIME_CALIBRATION && PacketHeader->Length >= sizeof(LOG_TIME_CALIBRATION))
+		{
+			memcpy(&TraceFileHeader.TimeCalibration, Body, sizeof(LOG_TIME_CALIBRATION));
+		}
+
+		//
+		// The formats and the calibration are still needed for the next messages
+		//
+		Show = !TraceFileQuiet ||
+			PacketHeader->OperationCode == OPERATION_LOG_BINARY_FORMAT_DEFINITION ||
+			PacketHeader->OperationCode == OPERATION_LOG_TIME_CALIBRATION;
+	}
+
+	ReleaseSRWLockExclusive(&TraceFileLock);
+
+	return Show;
+}
+
+/**
+ * @brief Open a new trace file
+ *
+ * @param Path Path of the file
+ * @param Compress Whether the chunks should be compressed
+ * @param Quiet Whether the saved messages should be shown too
+ * @return BOOLEAN Whether the file is opened or not
+ */
+BOOLEAN TraceFileOpen(const string& Path, BOOLEAN Compress, BOOLEAN Quiet) {
+
+	HANDLE Handle = CreateFileA(Path.c_str(),
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED,
+		NULL);
+
+	if (Handle == INVALID_HANDLE_VALUE)
+	{
+		ShowMessages("unable to create '%s' (error code : 0x%x)\n", Path.c_str(), GetLastError());
+		return FALSE;
+	}
+
+	//
+	// Unbuffered writes need aligned buffers, VirtualAlloc gives us page aligned memory
+	//
+	TraceFileStagingBuffer = (char*)malloc(TRACE_FILE_CHUNK_SIZE);
+	TraceFileIoBuffers[0] = (BYTE*)VirtualAlloc(NULL, TRACE_FILE_IO_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	TraceFileIoBuffers[1] = (BYTE*)VirtualAlloc(NULL, TRACE_FILE_IO_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	for (UINT32 i = 0; i < 3; i++)
+	{
+		TraceFileEvents[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+
+	if (TraceFileStagingBuffer == NULL || TraceFileIoBuffers[0] == NULL || TraceFileIoBuffers[1] == NULL ||
+		TraceFileEvents[0] == NULL || TraceFileEvents[1] == NULL || TraceFileEvents[2] == NULL)
+	{
+		ShowMessages("unable to allocate memory for the trace file\n");
+
+		for (UINT32 i = 0; i < 3; i++)
+		{
+			if (TraceFileEvents[i]) CloseHandle(TraceFileEvents[i]);
+			TraceFileEvents[i] = NULL;
+		}
+
+		free(TraceFileStagingBuffer);
+		if (TraceFileIoBuffers[0]) VirtualFree(TraceFileIoBuffers[0], 0, MEM_RELEASE);
+		if (TraceFileIoBuffers[1]) VirtualFree(TraceFileIoBuffers[1], 0, MEM_RELEASE);
+		TraceFileStagingBuffer = NULL;
+		TraceFileIoBuffers[0] = TraceFileIoBuffers[1] = NULL;
+
+		CloseHandle(Handle);
+		return FALSE;
+	}
+
+	memset(&TraceFileHeader, 0, sizeof(TRACE_FILE_HEADER));
+	memset(&TraceFileChunk, 0, sizeof(TRACE_FILE_CHUNK_HEADER));
+
+	TraceFileHeader.Magic = TRACE_FILE_MAGIC;
+	TraceFileHeader.Version = TRACE_FILE_VERSION;
+	TraceFileHeader.Flags = Compress ? TRACE_FILE_FLAG_COMPRESSED : 0;
+	TraceFileHeader.SectorSize = TRACE_FILE_SECTOR_SIZE;
+	TraceFileHeader.ChunkSize = TRACE_FILE_CHUNK_SIZE;
+
+	TraceFilePath = Path;
+	TraceFileCompress = Compress;
+	TraceFileQuiet = Quiet;
+	TraceFileNeedsPreamble = TRUE;
+	TraceFileOffset = TRACE_FILE_SECTOR_SIZE; // The first sector is the header
+	TraceFileCurrentIoBuffer = 0;
+	TraceFileIoPending[0] = TraceFileIoPending[1] = FALSE;
+	TraceFileIndex.clear();
+
+	AcquireSRWLockExclusive(&TraceFileLock);
+	TraceFileHandle = Handle;
+	ReleaseSRWLockExclusive(&TraceFileLock);
+
+	return TRUE;
+}
+
+/**
+ * @brief Write the remaining records, the index, and the header then close the file
+ *
+ * @return VOID
+ */
+void TraceFileClose() {
+
+	AcquireSRWLockExclusive(&TraceFileLock);
+
+	if (TraceFileHandle == INVALID_HANDLE_VALUE)
+	{
+		ReleaseSRWLockExclusive(&TraceFileLock);
+		return;
+	}
+
+	TraceFileFlushChunk();
+	TraceFileWaitForWrite(0);
+	TraceFileWaitForWrite(1);
+
+	//
+	// Write the index after the last chunk, the I/O buffers are free now
+	//
+	UINT64 IndexLength = TRACE_FILE_ALIGN(TraceFileIndex.size() * sizeof(TRACE_FILE_INDEX_ENTRY));
+	BYTE* IndexBuffer = IndexLength != 0 ? (BYTE*)VirtualAlloc(NULL, IndexLength, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE) : NULL;
+
+	if (IndexBuffer != NULL)
+	{
+		memcpy(IndexBuffer, TraceFileIndex.data(), TraceFileIndex.size() * sizeof(TRACE_FILE_INDEX_ENTRY));
+
+		if (TraceFileWrite(0xffffffff, IndexBuffer, (UINT32)IndexLength, TraceFileOffset))
+		{
+			TraceFileHeader.IndexOffset = TraceFileOffset;
+			TraceFileHeader.IndexCount = TraceFileIndex.size();
+		}
+
+		VirtualFree(IndexBuffer, 0, MEM_RELEASE);
+	}
+
+	for (auto& Entry : TraceFileIndex)
+	{
+		if (TraceFileHeader.MinimumTimeStampCounter == 0 || (Entry.MinimumTimeStampCounter != 0 && Entry.MinimumTimeStampCounter < TraceFileHeader.MinimumTimeStampCounter))
+		{
+			TraceFileHeader.MinimumTimeStampCounter = Entry.MinimumTimeStampCounter;
+		}
+		if (Entry.MaximumTimeStampCounter > TraceFileHeader.MaximumTimeStampCounter)
+		{
+			TraceFileHeader.MaximumTimeStampCounter = Entry.MaximumTimeStampCounter;
+		}
+	}
+
+	//
+	// Finally, the header (it's written last so a valid IndexOffset means that the file is complete)
+	//
+	memset(TraceFileIoBuffers[0], 0, TRACE_FILE_SECTOR_SIZE);
+	memcpy(TraceFileIoBuffers[0], &TraceFileHeader, sizeof(TRACE_FILE_HEADER));
+	TraceFileWrite(0xffffffff, TraceFileIoBuffers[0], TRACE_FILE_SECTOR_SIZE, 0);
+
+	ShowMessages("%llu messages are saved to '%s' (%llu bytes)\n", TraceFileHeader.RecordCount, TraceFilePath.c_str(), TraceFileOffset + IndexLength);
+
+	CloseHandle(TraceFileHandle);
+	TraceFileHandle = INVALID_HANDLE_VALUE;
+
+	for (UINT32 i = 0; i < 3; i++)
+	{
+		CloseHandle(TraceFileEvents[i]);
+		TraceFileEvents[i] = NULL;
+	}
+
+	free(TraceFileStagingBuffer);
+	VirtualFree(TraceFileIoBuffers[0], 0, MEM_RELEASE);
+	VirtualFree(TraceFileIoBuffers[1], 0, MEM_RELEASE);
+	TraceFileStagingBuffer = NULL;
+	TraceFileIoBuffers[0] = TraceFileIoBuffers[1] = NULL;
+	TraceFileIndex.clear();
+
+	ReleaseSRWLockExclusive(&TraceFileLock);
+}
+
+void CommandTraceFileHelp() {
+	ShowMessages(".tracefile : saves the kernel messages to a binary trace file.\n\n");
+	ShowMessages("syntax : \t.tracefile [path] [compress] [quiet]\n");
+	ShowMessages("syntax : \t.tracefile close\n");
+	ShowMessages("\t\te.g : .tracefile c:\\trace.hdt compress\n");
+	ShowMessages("\t\t\tdescription : saves the messages to c:\\trace.hdt with compressed chunks\n");
+	ShowMessages("\t\te.g : .tracefile c:\\trace.hdt quiet\n");
+	ShowMessages("\t\t\tdescription : saves the messages to c:\\trace.hdt without showing them\n");
+	ShowMessages("\t\te.g : .tracefile close\n");
+	ShowMessages("\t\t\tdescription : writes the index of the file and closes it\n");
+}
+
+void CommandTraceFile(vector<string> SplittedCommand) {
+
+	BOOLEAN Compress = FALSE;
+	BOOLEAN Quiet = FALSE;
+
+	if (SplittedCommand.size() == 1)
+	{
+		if (TraceFileHandle == INVALID_HANDLE_VALUE) {
+			ShowMessages("there is no trace file\n");
+		}
+		else {
+			ShowMessages("saving to '%s' (%llu messages, %llu chunks)\n", TraceFilePath.c_str(), TraceFileHeader.RecordCount, (UINT64)TraceFileIndex.size());
+		}
+		return;
+	}
+
+	if (SplittedCommand.size() == 2 && !SplittedCommand.at(1).compare("close"))
+	{
+		TraceFileClose();
+		return;
+	}
+
+	for (size_t i = 2; i < SplittedCommand.size(); i++)
+	{
+		if (!SplittedCommand.at(i).compare("compress")) {
+			Compress = TRUE;
+		}
+		else if (!SplittedCommand.at(i).compare("quiet")) {
+			Quiet = TRUE;
+		}
+		else {
+			ShowMessages("incorrect use of '.tracefile'\n\n");
+			CommandTraceFileHelp();
+			return;
+		}
+	}
+
+	if (TraceFileHandle != INVALID_HANDLE_VALUE)
+	{
+		ShowMessages("the messages are already saved to '%s', close it first\n", TraceFilePath.c_str());
+		return;
+	}
+
+	if (TraceFileOpen(SplittedCommand.at(1), Compress, Quiet))
+	{
+		ShowMessages("saving the messages to '%s'\n", SplittedCommand.at(1).c_str());
+	}
+}
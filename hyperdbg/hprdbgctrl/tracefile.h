@@ -0,0 +1,95 @@
+/**
+ * @file tracefile.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Format of the binary trace files of the kernel messages
+ * @details The file is a header sector, then the chunks, and finally the
+ * index of the chunks, all of them are aligned to TRACE_FILE_SECTOR_SIZE.
+ * The records of each chunk are the same as the result of
+ * IOCTL_READ_LOG_BUFFERS_BATCH (LOG_BATCH_PACKET_HEADER + body), the chunk
+ * might be compressed in LZ4 block format. An offline tool can use the index
+ * to find the chunks of a time range or a core without reading the chunks.
+ * @version 0.1
+ * @date 2020-05-03
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+
+//////////////////////////////////////////////////
+//				  Trace Files                   //
+//////////////////////////////////////////////////
+
+#define TRACE_FILE_MAGIC 0x0045434152544448 // "HDTRACE"
+#define TRACE_FILE_CHUNK_MAGIC 0x004b4e4843544448 // "HDTCHNK"
+#define TRACE_FILE_VERSION 1
+
+/* Alignment of the unbuffered writes (a multiple of the sector size of the disks) */
+#define TRACE_FILE_SECTOR_SIZE 0x1000
+
+/* Maximum size of the records of each chunk (before compression) */
+#define TRACE_FILE_CHUNK_SIZE 0x100000
+
+/* Flags of the file and the chunks */
+#define TRACE_FILE_FLAG_COMPRESSED 0x1
+
+/* Maximum size of a block of Length bytes after the LZ4 compression */
+#define LZ4_COMPRESS_BOUND(Length) ((Length) + (Length) / 255 + 16)
+
+/**
+ * @brief The first sector of the file
+ * @details IndexOffset is zero if the file is not closed, in this case
+ * the chunks should be scanned one after another
+ *
+ */
+typedef struct _TRACE_FILE_HEADER {
+	UINT64 Magic;
+	UINT32 Version;
+	UINT32 Flags;
+	UINT32 SectorSize;
+	UINT32 ChunkSize;
+	UINT64 IndexOffset;		// Offset of the array of TRACE_FILE_INDEX_ENTRY
+	UINT64 IndexCount;		// Count of the chunks
+	UINT64 RecordCount;
+	UINT64 MinimumTimeStampCounter;
+	UINT64 MaximumTimeStampCounter;
+	LOG_TIME_CALIBRATION TimeCalibration; // To convert the time stamp counters to time (zero frequency if unknown)
+
+} TRACE_FILE_HEADER, * PTRACE_FILE_HEADER;
+
+/**
+ * @brief Header of each chunk, StoredLength bytes of records follow it
+ * @details The next chunk is at the next sector after the stored records
+ *
+ */
+typedef struct _TRACE_FILE_CHUNK_HEADER {
+	UINT64 Magic;
+	UINT32 Flags;				// TRACE_FILE_FLAG_COMPRESSED if the records are compressed
+	UINT32 RecordCount;
+	UINT32 UncompressedLength;
+	UINT32 StoredLength;
+	UINT64 MinimumTimeStampCounter;
+	UINT64 MaximumTimeStampCounter;
+	UINT64 BufferMask[LOG_MAXIMUM_SHARED_BUFFERS / 64]; // Bit of each log buffer (core * 2 + vmx-root?) that has a record in the chunk
+
+} TRACE_FILE_CHUNK_HEADER, * PTRACE_FILE_CHUNK_HEADER;
+
+/**
+ * @brief Each entry of the index of the chunks
+ *
+ */
+typedef struct _TRACE_FILE_INDEX_ENTRY {
+	UINT64 FileOffset;			// Offset of the TRACE_FILE_CHUNK_HEADER
+	UINT32 RecordCount;
+	UINT32 StoredLength;
+	UINT64 MinimumTimeStampCounter;
+	UINT64 MaximumTimeStampCounter;
+	UINT64 BufferMask[LOG_MAXIMUM_SHARED_BUFFERS / 64];
+
+} TRACE_FILE_INDEX_ENTRY, * PTRACE_FILE_INDEX_ENTRY;
+
+BOOLEAN TraceFileSaveRecord(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body);
+void TraceFileClose();
+UINT32 TraceFileCompressBlock(const BYTE* Source, UINT32 SourceLength, BYTE* Destination, UINT32 DestinationLength);
+UINT32 TraceFileDecompressBlock(const BYTE* Source, UINT32 SourceLength, BYTE* Destination, UINT32 DestinationLength);
+void TraceFileBuildPreamble(void (*AppendRecord)(PLOG_BATCH_PACKET_HEADER PacketHeader, const char* Body));
@@ -0,0 +1,326 @@
+/**
+ * @file Aggregation.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Aggregation of the accesses to the hooked pages in vmx-root
+ * @details Instead of logging each access, vmx-root of each core counts the
+ * accesses by (address, guest RIP, access type) in a preallocated table, the
+ * tables are logged as summaries periodically (or when they're almost full)
+ * and they're copied to the user-mode on demand
+ * @version 0.1
+ * @date 2020-05-15
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "Vmx.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "ExtensionCommands.h"
+#include "Aggregation.h"
+
+/**
+ * @brief Initialize the aggregation (the tables are allocated when it's started)
+ *
+ * @return VOID
+ */
+VOID
+AggregationInitialize()
+{
+    AggregationTables          = NULL;
+    AggregationIsActive        = FALSE;
+    AggregationFlushPeriod     = 0;
+    AggregationFlushedAccesses = 0;
+
+    ExInitializeFastMutex(&AggregationMutex);
+}
+
+/**
+ * @brief Stop the aggregation and free the tables
+ * @details Should be called in vmx non-root before terminating vmx
+ *
+ * @return VOID
+ */
+VOID
+AggregationUnInitialize()
+{
+    AGGREGATION_QUERY_CONTEXT Context = {0};
+
+    AggregationStop();
+
+    ExAcquireFastMutex(&AggregationMutex);
+
+    if (AggregationTables)
+    {
+        //
+        // Nothing is copied, it only makes sure that no core is still
+        // counting an access in vmx-root
+        //
+        ExtensionCommandCopyAccessAggregationOnAllProcessors(&Context);
+
+        ExFreePoolWithTag(AggregationTables, POOLTAG);
+        AggregationTables = NULL;
+    }
+
+    ExReleaseFastMutex(&AggregationMutex);
+}
+
+/**
+ * @brief Start counting the accesses instead of logging them
+ * @details If the aggregation is already started only the period is changed,
+ * otherwise the previous counters are cleared
+ *
+ * @param FlushPeriod Milliseconds between logging the table of each core (zero means on demand)
+ * @return NTSTATUS
+ */
+NTSTATUS
+AggregationStart(UINT32 FlushPeriod)
+{
+    ULONG                     ProcessorCount = KeQueryActiveProcessorCount(0);
+    AGGREGATION_QUERY_CONTEXT Context        = {0};
+
+    ExAcquireFastMutex(&AggregationMutex);
+
+    AggregationFlushPeriod = (LogTimeStampCounterFrequency * FlushPeriod) / 1000;
+
+    if (AggregationIsActive)
+    {
+        ExReleaseFastMutex(&AggregationMutex);
+        return STATUS_SUCCESS;
+    }
+
+    if (!AggregationTables)
+    {
+        AggregationTables = ExAllocatePoolWithTag(NonPagedPool, sizeof(AGGREGATION_CORE_TABLE) * ProcessorCount, POOLTAG);
+
+        if (!AggregationTables)
+        {
+            ExReleaseFastMutex(&AggregationMutex);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(AggregationTables, sizeof(AGGREGATION_CORE_TABLE) * ProcessorCount);
+    }
+    else
+    {
+        //
+        // Clear the counters of the previous run
+        //
+        Context.Reset = TRUE;
+        ExtensionCommandCopyAccessAggregationOnAllProcessors(&Context);
+    }
+
+    AggregationFlushedAccesses = 0;
+
+    _ReadWriteBarrier();
+    AggregationIsActive = TRUE;
+
+    ExReleaseFastMutex(&AggregationMutex);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Stop counting the accesses
+ * @details The tables are kept, so they can still be queried
+ *
+ * @return VOID
+ */
+VOID
+AggregationStop()
+{
+    ExAcquireFastMutex(&AggregationMutex);
+
+    AggregationIsActive = FALSE;
+
+    ExReleaseFastMutex(&AggregationMutex);
+}
+
+/**
+ * @brief Log the used entries of the table of a core and clear them
+ * @details Should be called in vmx-root of the core
+ *
+ * @param CoreIndex Index of the core
+ * @param Table The table of the core
+ * @return VOID
+ */
+static VOID
+AggregationFlushTable(UINT32 CoreIndex, PAGGREGATION_CORE_TABLE Table)
+{
+    static const CHAR * AccessNames[] = {"reads", "writes on", "executes"};
+    UINT64              Accesses      = 0;
+
+    if (Table->CountOfEntries != 0)
+    {
+        LogInfo("Summary of the accesses of core %x : %d distinct accesses", CoreIndex, Table->CountOfEntries);
+
+        for (UINT32 i = 0; i < ACCESS_AGGREGATION_ENTRIES_PER_CORE; i++)
+        {
+            PACCESS_AGGREGATION_ENTRY Entry = &Table->Entries[i];
+
+            if (Entry->Count == 0)
+            {
+                continue;
+            }
+
+            LogInfo("Guest RIP : 0x%llx %s the page at : 0x%llx (%llu times)",
+                    Entry->GuestRip,
+                    AccessNames[Entry->AccessType],
+                    Entry->Address,
+                    Entry->Count);
+
+            Accesses += Entry->Count;
+        }
+
+        InterlockedAdd64(&AggregationFlushedAccesses, Accesses);
+
+        RtlZeroMemory(Table->Entries, sizeof(Table->Entries));
+        Table->CountOfEntries = 0;
+    }
+
+    Table->LastFlushTime = __rdtsc();
+}
+
+/**
+ * @brief Count an access to a hooked page
+ * @details Should be called in vmx-root of the core
+ *
+ * @param CoreIndex Index of the current core
+ * @param GuestRip RIP of the instruction that accessed the page
+ * @param Address The accessed virtual address
+ * @param AccessType ACCESS_AGGREGATION_TYPE
+ * @return BOOLEAN TRUE if the access is counted (so it shouldn't be logged)
+ */
+BOOLEAN
+AggregationRecordAccess(UINT32 CoreIndex, UINT64 GuestRip, UINT64 Address, UINT32 AccessType)
+{
+    PAGGREGATION_CORE_TABLE   Table;
+    PACCESS_AGGREGATION_ENTRY Entry;
+    UINT32                    Index;
+
+    if (!AggregationIsActive)
+    {
+        return FALSE;
+    }
+
+    Table = &AggregationTables[CoreIndex];
+
+    if (Table->CountOfEntries >= AGGREGATION_MAXIMUM_LOAD ||
+        (AggregationFlushPeriod != 0 && __rdtsc() - Table->LastFlushTime >= AggregationFlushPeriod))
+    {
+        AggregationFlushTable(CoreIndex, Table);
+    }
+
+    //
+    // Linear probing from the hash of the key, the table is never full so an
+    // empty entry is always found
+    //
+    Index = (UINT32)(((Address ^ (GuestRip * 0x9E3779B97F4A7C15ULL) ^ AccessType) * 0x9E3779B97F4A7C15ULL) >> 32);
+
+    while (TRUE)
+    {
+        Entry = &Table->Entries[Index & (ACCESS_AGGREGATION_ENTRIES_PER_CORE - 1)];
+
+        if (Entry->Count == 0)
+        {
+            Entry->Address    = Address;
+            Entry->GuestRip   = GuestRip;
+            Entry->AccessType = AccessType;
+            Entry->CoreIndex  = CoreIndex;
+            Table->CountOfEntries++;
+            break;
+        }
+
+        if (Entry->Address == Address && Entry->GuestRip == GuestRip && Entry->AccessType == AccessType)
+        {
+            break;
+        }
+
+        Index++;
+    }
+
+    Entry->Count++;
+
+    return TRUE;
+}
+
+/**
+ * @brief Copy the used entries of the table of the current core to the buffer
+ * of a query
+ * @details Should be called in vmx-root of the core
+ *
+ * @param CoreIndex Index of the current core
+ * @param Context The context of the query
+ * @return VOID
+ */
+VOID
+AggregationCopyTable(UINT32 CoreIndex, PAGGREGATION_QUERY_CONTEXT Context)
+{
+    PAGGREGATION_CORE_TABLE Table;
+    LONG                    Slot;
+
+    if (!AggregationTables)
+    {
+        return;
+    }
+
+    Table = &AggregationTables[CoreIndex];
+    Slot  = InterlockedExchangeAdd(&Context->CountOfEntries, Table->CountOfEntries);
+
+    for (UINT32 i = 0; i < ACCESS_AGGREGATION_ENTRIES_PER_CORE && (UINT32)Slot < Context->MaximumEntries; i++)
+    {
+        if (Table->Entries[i].Count != 0)
+        {
+            Context->Entries[Slot++] = Table->Entries[i];
+        }
+    }
+
+    if (Context->Reset)
+    {
+        RtlZeroMemory(Table->Entries, sizeof(Table->Entries));
+        Table->CountOfEntries = 0;
+        Table->LastFlushTime  = __rdtsc();
+    }
+}
+
+/**
+ * @brief Copy the counters of all the cores to the output buffer
+ *
+ * @param Result The header of the output buffer (the entries follow it)
+ * @param OutputBufferLength Size of the output buffer
+ * @param Reset Clear the counters after reading them
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+AggregationQuery(PACCESS_AGGREGATION_RESULT Result, UINT32 OutputBufferLength, BOOLEAN Reset, PUINT32 ReturnedLength)
+{
+    AGGREGATION_QUERY_CONTEXT Context = {0};
+
+    *ReturnedLength = sizeof(ACCESS_AGGREGATION_RESULT);
+
+    ExAcquireFastMutex(&AggregationMutex);
+
+    if (!AggregationTables)
+    {
+        ExReleaseFastMutex(&AggregationMutex);
+        RtlZeroMemory(Result, sizeof(ACCESS_AGGREGATION_RESULT));
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    Context.Entries        = (PACCESS_AGGREGATION_ENTRY)((UINT64)Result + sizeof(ACCESS_AGGREGATION_RESULT));
+    Context.MaximumEntries = (OutputBufferLength - sizeof(ACCESS_AGGREGATION_RESULT)) / sizeof(ACCESS_AGGREGATION_ENTRY);
+    Context.Reset          = Reset;
+
+    ExtensionCommandCopyAccessAggregationOnAllProcessors(&Context);
+
+    Result->CountOfEntries       = min((UINT32)Context.CountOfEntries, Context.MaximumEntries);
+    Result->CountOfMissedEntries = (UINT32)Context.CountOfEntries - Result->CountOfEntries;
+    Result->FlushedAccesses      = AggregationFlushedAccesses;
+
+    ExReleaseFastMutex(&AggregationMutex);
+
+    *ReturnedLength = sizeof(ACCESS_AGGREGATION_RESULT) + Result->CountOfEntries * sizeof(ACCESS_AGGREGATION_ENTRY);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file Aggregation.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the aggregation of the accesses to the hooked pages
+ * @details
+ * @version 0.1
+ * @date 2020-05-15
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* Count of the used entries of a table that causes it to be logged and cleared */
+#define AGGREGATION_MAXIMUM_LOAD ((ACCESS_AGGREGATION_ENTRIES_PER_CORE * 3) / 4)
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The counters of the accesses of each core
+ * @details An open-addressing hash table of (address, guest RIP, access type),
+ * only changed by vmx-root of the same core
+ *
+ */
+typedef struct _AGGREGATION_CORE_TABLE
+{
+    UINT64                   LastFlushTime;  // Time stamp counter of the last time that the table is logged
+    UINT32                   CountOfEntries; // Count of the used entries
+    ACCESS_AGGREGATION_ENTRY Entries[ACCESS_AGGREGATION_ENTRIES_PER_CORE];
+
+} AGGREGATION_CORE_TABLE, *PAGGREGATION_CORE_TABLE;
+
+/**
+ * @brief The context of copying the tables of all the cores to a buffer
+ * @details Each core reserves its part of the buffer with an atomic add
+ *
+ */
+typedef struct _AGGREGATION_QUERY_CONTEXT
+{
+    PACCESS_AGGREGATION_ENTRY Entries;        // The buffer of the entries
+    UINT32                    MaximumEntries; // Count of the entries that fit in the buffer
+    volatile LONG             CountOfEntries; // Count of the entries of all the cores (even if they don't fit)
+    BOOLEAN                   Reset;          // Clear the tables after copying them
+
+} AGGREGATION_QUERY_CONTEXT, *PAGGREGATION_QUERY_CONTEXT;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Tables of the cores (one for each core, null if it's never started) */
+AGGREGATION_CORE_TABLE * AggregationTables;
+
+/* Whether the accesses are counted instead of being logged */
+volatile BOOLEAN AggregationIsActive;
+
+/* Time stamp counter cycles between logging the table of each core (zero means on demand) */
+UINT64 AggregationFlushPeriod;
+
+/* Count of the accesses that are logged as summaries */
+volatile LONG64 AggregationFlushedAccesses;
+
+/* Serializes the start, stop and queries of the aggregation */
+FAST_MUTEX AggregationMutex;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+AggregationInitialize();
+VOID
+AggregationUnInitialize();
+NTSTATUS
+AggregationStart(UINT32 FlushPeriod);
+VOID
+AggregationStop();
+BOOLEAN
+AggregationRecordAccess(UINT32 CoreIndex, UINT64 GuestRip, UINT64 Address, UINT32 AccessType);
+VOID
+AggregationCopyTable(UINT32 CoreIndex, PAGGREGATION_QUERY_CONTEXT Context);
+NTSTATUS
+AggregationQuery(PACCESS_AGGREGATION_RESULT Result, UINT32 OutputBufferLength, BOOLEAN Reset, PUINT32 ReturnedLength);
@@ -1,4 +1,9 @@
 PUBLIC AsmInvept
+PUBLIC AsmVeHandler
+PUBLIC AsmVeDebugHandler
+
+EXTERN VeHandleVirtualizationException:PROC
+EXTERN VeHandleDebugException:PROC
 
 .code _text
 
@@ -45,6 +50,181 @@ AsmInvvpid PROC
         ret
 AsmInvvpid ENDP
 
+;------------------------------------------------------------------------
+; The #VE and #DB handlers are interrupt gates of IDT, nothing is pushed for the
+; error code of these exceptions, the stack is aligned to 16 by the processor
+; before pushing the 5 qwords of the interrupt frame
+;------------------------------------------------------------------------
+
+AsmVeHandler PROC
+
+    sub     rsp, 8                  ; not used, keeps the stack aligned the same as AsmVeDebugHandler
+
+    test    qword ptr [rsp+16], 3   ; CS of the interrupted code (after the slot and RIP)
+    jz      @KernelModeEntry
+    swapgs
+@KernelModeEntry:
+    cld
+
+    push r15
+    push r14
+    push r13
+    push r12
+    push r11
+    push r10
+    push r9
+    push r8        
+    push rdi
+    push rsi
+    push rbp
+    push rbp	; rsp
+    push rbx
+    push rdx
+    push rcx
+    push rax	
+
+    ; the interrupted code might use the volatile xmm registers
+    sub     rsp, 070h
+    movaps  xmmword ptr [rsp+000h], xmm0
+    movaps  xmmword ptr [rsp+010h], xmm1
+    movaps  xmmword ptr [rsp+020h], xmm2
+    movaps  xmmword ptr [rsp+030h], xmm3
+    movaps  xmmword ptr [rsp+040h], xmm4
+    movaps  xmmword ptr [rsp+050h], xmm5
+    stmxcsr dword ptr [rsp+060h]
+
+    lea     rcx, [rsp+070h]         ; Fast call argument to PGUEST_REGS
+    lea     rdx, [rsp+0f8h]         ; Fast call argument (second) - the interrupt frame
+
+    sub     rsp, 20h                ; Free some space for Shadow Section
+    call    VeHandleVirtualizationException
+    add     rsp, 20h
+
+    ldmxcsr dword ptr [rsp+060h]
+    movaps  xmm0, xmmword ptr [rsp+000h]
+    movaps  xmm1, xmmword ptr [rsp+010h]
+    movaps  xmm2, xmmword ptr [rsp+020h]
+    movaps  xmm3, xmmword ptr [rsp+030h]
+    movaps  xmm4, xmmword ptr [rsp+040h]
+    movaps  xmm5, xmmword ptr [rsp+050h]
+    add     rsp, 070h
+
+    pop rax
+    pop rcx
+    pop rdx
+    pop rbx
+    pop rbp		; rsp
+    pop rbp
+    pop rsi
+    pop rdi 
+    pop r8
+    pop r9
+    pop r10
+    pop r11
+    pop r12
+    pop r13
+    pop r14
+    pop r15
+
+    test    qword ptr [rsp+16], 3
+    jz      @KernelModeExit
+    swapgs
+@KernelModeExit:
+
+    add     rsp, 8
+    iretq
+
+AsmVeHandler ENDP
+
+;------------------------------------------------------------------------
+
+AsmVeDebugHandler PROC
+
+    sub     rsp, 8                  ; the address of the original handler (if the #DB is not ours)
+
+    test    qword ptr [rsp+16], 3   ; CS of the interrupted code (after the slot and RIP)
+    jz      @KernelModeEntry
+    swapgs
+@KernelModeEntry:
+    cld
+
+    push r15
+    push r14
+    push r13
+    push r12
+    push r11
+    push r10
+    push r9
+    push r8        
+    push rdi
+    push rsi
+    push rbp
+    push rbp	; rsp
+    push rbx
+    push rdx
+    push rcx
+    push rax	
+
+    ; the interrupted code might use the volatile xmm registers
+    sub     rsp, 070h
+    movaps  xmmword ptr [rsp+000h], xmm0
+    movaps  xmmword ptr [rsp+010h], xmm1
+    movaps  xmmword ptr [rsp+020h], xmm2
+    movaps  xmmword ptr [rsp+030h], xmm3
+    movaps  xmmword ptr [rsp+040h], xmm4
+    movaps  xmmword ptr [rsp+050h], xmm5
+    stmxcsr dword ptr [rsp+060h]
+
+    lea     rcx, [rsp+070h]         ; Fast call argument to PGUEST_REGS
+    lea     rdx, [rsp+0f8h]         ; Fast call argument (second) - the interrupt frame
+
+    sub     rsp, 20h                ; Free some space for Shadow Section
+    call    VeHandleDebugException
+    add     rsp, 20h
+
+    mov     [rsp+0f0h], rax         ; zero if it's handled
+
+    ldmxcsr dword ptr [rsp+060h]
+    movaps  xmm0, xmmword ptr [rsp+000h]
+    movaps  xmm1, xmmword ptr [rsp+010h]
+    movaps  xmm2, xmmword ptr [rsp+020h]
+    movaps  xmm3, xmmword ptr [rsp+030h]
+    movaps  xmm4, xmmword ptr [rsp+040h]
+    movaps  xmm5, xmmword ptr [rsp+050h]
+    add     rsp, 070h
+
+    pop rax
+    pop rcx
+    pop rdx
+    pop rbx
+    pop rbp		; rsp
+    pop rbp
+    pop rsi
+    pop rdi 
+    pop r8
+    pop r9
+    pop r10
+    pop r11
+    pop r12
+    pop r13
+    pop r14
+    pop r15
+
+    test    qword ptr [rsp+16], 3
+    jz      @KernelModeExit
+    swapgs
+@KernelModeExit:
+
+    cmp     qword ptr [rsp], 0
+    je      @Handled
+    ret                             ; continue in the original handler with the same interrupt frame
+
+@Handled:
+    add     rsp, 8
+    iretq
+
+AsmVeDebugHandler ENDP
+
 ;------------------------------------------------------------------------
 
 
@@ -20,8 +20,12 @@ AsmVmexitHandler PROC
 
     ; ------------ Save XMM Registers ------------
 
-        ;;;;;;;;;;;; 16 Byte * 16 Byte = 256 + 4  = 260 (0x106 == 0x110 but let's align it to have better performance) ;;;;;;;;;;;;
-        sub     rsp, 0110h
+        ; Only the volatile registers (xmm0 - xmm5) are saved, xmm6 - xmm15 are non-volatile
+        ; in the x64 calling convention so every function that uses them (in vmx-root) saves
+        ; and restores them itself, MxCsr is saved because its status flags are volatile
+
+        ;;;;;;;;;;;; 16 Byte * 6 = 96 + 4  = 100 (0x64 == 0x70 but let's align it to have better performance) ;;;;;;;;;;;;
+        sub     rsp, 070h
 
         movaps  xmmword ptr [rsp+000h], xmm0    ; each xmm register 128 bit (16 Byte)
         movaps  xmmword ptr [rsp+010h], xmm1
@@ -29,17 +33,7 @@ AsmVmexitHandler PROC
         movaps  xmmword ptr [rsp+030h], xmm3
         movaps  xmmword ptr [rsp+040h], xmm4
         movaps  xmmword ptr [rsp+050h], xmm5
-        movaps  xmmword ptr [rsp+060h], xmm6 
-        movaps  xmmword ptr [rsp+070h], xmm7
-        movaps  xmmword ptr [rsp+080h], xmm8
-        movaps  xmmword ptr [rsp+090h], xmm9
-        movaps  xmmword ptr [rsp+0a0h], xmm10
-        movaps  xmmword ptr [rsp+0b0h], xmm11
-        movaps  xmmword ptr [rsp+0c0h], xmm12
-        movaps  xmmword ptr [rsp+0d0h], xmm13
-        movaps  xmmword ptr [rsp+0e0h], xmm14
-        movaps  xmmword ptr [rsp+0f0h], xmm15 
-        stmxcsr dword ptr [rsp+0100h]           ; MxCsr is 4 Byte
+        stmxcsr dword ptr [rsp+060h]            ; MxCsr is 4 Byte
 
     ;---------------------------------------------
 
@@ -61,6 +55,11 @@ AsmVmexitHandler PROC
     push rax	
 
 	mov rcx, rsp		; Fast call argument to PGUEST_REGS
+
+	rdtsc				; Time stamp counter of the vm-exit (rax and rdx are saved)
+	shl rdx, 32
+	or rdx, rax			; Fast call argument to EntryTimeStampCounter
+
 	sub	rsp, 28h		; Free some space for Shadow Section
 	call	VmxVmexitHandler
 	add	rsp, 28h		; Restore the state
@@ -94,20 +93,10 @@ AsmVmexitHandler PROC
         movaps xmm3, xmmword ptr [rsp+030h]
         movaps xmm4, xmmword ptr [rsp+040h]
         movaps xmm5, xmmword ptr [rsp+050h]
-        movaps xmm6, xmmword ptr [rsp+060h]
-        movaps xmm7, xmmword ptr [rsp+070h]
-        movaps xmm8, xmmword ptr [rsp+080h]
-        movaps xmm9, xmmword ptr [rsp+090h]
-        movaps xmm10, xmmword ptr [rsp+0a0h]
-        movaps xmm11, xmmword ptr [rsp+0b0h]
-        movaps xmm12, xmmword ptr [rsp+0c0h]
-        movaps xmm13, xmmword ptr [rsp+0d0h]
-        movaps xmm14, xmmword ptr [rsp+0e0h]
-        movaps xmm15, xmmword ptr [rsp+0f0h]
-
-        ldmxcsr dword ptr [rsp+0100h]          
+
+        ldmxcsr dword ptr [rsp+060h]          
         
-        add     rsp, 0110h
+        add     rsp, 070h
     ; ----------------------------------------------
 
     popfq
@@ -124,7 +113,9 @@ AsmVmxoffHandler PROC
     call HvReturnStackPointerForVmxoff
     add rsp, 020h       ; remove for shadow space
 
-    mov [rsp+198h], rax  ; now, rax contains rsp
+    ; 0f8h = 16 GPRs (80h) + XMM registers (70h) + rflags (8h), it's where we pushed 0 at the start
+
+    mov [rsp+0f8h], rax  ; now, rax contains rsp
 
     sub rsp, 020h       ; shadow space
     call HvReturnInstructionPointerForVmxoff
@@ -132,7 +123,7 @@ AsmVmxoffHandler PROC
 
     mov rdx, rsp        ; save current rsp
 
-    mov rbx, [rsp+198h] ; read rsp again
+    mov rbx, [rsp+0f8h] ; read rsp again
 
     mov rsp, rbx
 
@@ -143,7 +134,7 @@ AsmVmxoffHandler PROC
                         
     sub rbx,08h         ; we push sth, so we have to add (sub) +8 from previous stack
                         ; also rbx already contains the rsp
-    mov [rsp+198h], rbx ; move the new pointer to the current stack
+    mov [rsp+0f8h], rbx ; move the new pointer to the current stack
 
 	RestoreState:
 
@@ -172,20 +163,10 @@ AsmVmxoffHandler PROC
         movaps xmm3, xmmword ptr [rsp+030h]
         movaps xmm4, xmmword ptr [rsp+040h]
         movaps xmm5, xmmword ptr [rsp+050h]
-        movaps xmm6, xmmword ptr [rsp+060h]
-        movaps xmm7, xmmword ptr [rsp+070h]
-        movaps xmm8, xmmword ptr [rsp+080h]
-        movaps xmm9, xmmword ptr [rsp+090h]
-        movaps xmm10, xmmword ptr [rsp+0a0h]
-        movaps xmm11, xmmword ptr [rsp+0b0h]
-        movaps xmm12, xmmword ptr [rsp+0c0h]
-        movaps xmm13, xmmword ptr [rsp+0d0h]
-        movaps xmm14, xmmword ptr [rsp+0e0h]
-        movaps xmm15, xmmword ptr [rsp+0f0h]
-
-        ldmxcsr dword ptr [rsp+0100h]          
+
+        ldmxcsr dword ptr [rsp+060h]          
         
-        add     rsp, 0110h
+        add     rsp, 070h
     ; ----------------------------------------------
 
     popfq
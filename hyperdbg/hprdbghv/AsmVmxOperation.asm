@@ -1,6 +1,7 @@
 PUBLIC AsmEnableVmxOperation
 PUBLIC AsmVmxVmcall
 PUBLIC AsmHypervVmcall
+PUBLIC AsmVmxVmfunc
 
 
 .code _text
@@ -51,5 +52,15 @@ AsmHypervVmcall ENDP
 
 ;------------------------------------------------------------------------
 
+AsmVmxVmfunc PROC
+    ; Switch to the EPT view in the EPTP list, should be called from vmx non-root
+    xor     eax, eax                ; VM function 0 (EPTP switching), the index of the view is on ecx
+    db      0fh, 01h, 0d4h          ; vmfunc
+    ret
+
+AsmVmxVmfunc ENDP
+
+;------------------------------------------------------------------------
+
 
 END
\ No newline at end of file
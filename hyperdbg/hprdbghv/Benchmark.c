@@ -0,0 +1,356 @@
+/**
+ * @file Benchmark.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Micro-benchmarks of the vm-exits and the hooks
+ * @details Each sample is the cycles of an operation between two time stamps
+ * on the pinned core, the hooks of a test are applied before its warmups and
+ * are removed after its samples
+ * @version 0.1
+ * @date 2020-05-24
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "Msr.h"
+#include "Vmx.h"
+#include "Vmcall.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "HypervisorRoutines.h"
+#include "ExtensionCommands.h"
+#include "Debugger.h"
+#include "InlineAsm.h"
+#include "Benchmark.h"
+
+/**
+ * @brief The code of the detoured function
+ * @details The prologue is the 18 bytes that are replaced by the jump to the
+ * hook (nops, so it's relocated to the trampoline as is), then it returns
+ * Value + 1
+ *
+ */
+static const UCHAR BenchmarkDetouredFunctionCode[] = {
+    0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, // nop (9 times)
+    0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, // nop (9 times)
+    0x48, 0x8D, 0x41, 0x01,                               // lea rax, [rcx + 1]
+    0xC3                                                  // ret
+};
+
+/**
+ * @brief Initialize the benchmarks
+ *
+ * @return VOID
+ */
+VOID
+BenchmarkInitialize()
+{
+    ExInitializeFastMutex(&BenchmarkMutex);
+
+    BenchmarkPages                    = NULL;
+    BenchmarkDetourOriginal           = NULL;
+    BenchmarkIsSyscallHookEferEnabled = FALSE;
+}
+
+/**
+ * @brief The hook of the detoured function
+ *
+ * @param Value
+ * @return UINT64 The result of the original function
+ */
+static UINT64
+BenchmarkDetourHook(UINT64 Value)
+{
+    return BenchmarkDetourOriginal(Value);
+}
+
+/**
+ * @brief Apply the hook of a test to the pages of the benchmark
+ * @details Should be called from vmx non-root, the hooks are applied to all
+ * the cores, the read and write hooks only watch the first byte of their page
+ * so the accesses of the test cause vm-exit but are not logged
+ *
+ * @param Test The test
+ * @param Address The hooked address of the test
+ * @return NTSTATUS
+ */
+static NTSTATUS
+BenchmarkApplyHook(BENCHMARK_TEST Test, PCHAR Address)
+{
+    EPT_HOOK_BATCH_ENTRY Entry = {0};
+
+    Entry.Address = (UINT64)Address;
+
+    if (Test == BENCHMARK_TEST_EPT_READ_HOOK_HIT)
+    {
+        Entry.Attributes  = EPT_HOOK_BATCH_ATTRIB_READ;
+        Entry.WatchLength = 1;
+    }
+    else if (Test == BENCHMARK_TEST_EPT_WRITE_HOOK_HIT)
+    {
+        Entry.Attributes  = EPT_HOOK_BATCH_ATTRIB_WRITE;
+        Entry.WatchLength = 1;
+    }
+    else
+    {
+        //
+        // The function is copied before hooking, as the fake page is a copy
+        // of the page at the time of hooking
+        //
+        RtlCopyMemory(Address, BenchmarkDetouredFunctionCode, sizeof(BenchmarkDetouredFunctionCode));
+
+        Entry.HookFunction = (UINT64)BenchmarkDetourHook;
+        Entry.OrigFunction = (UINT64)&BenchmarkDetourOriginal;
+        Entry.Attributes   = EPT_HOOK_BATCH_ATTRIB_EXEC;
+    }
+
+    EptPageHookBatch(&Entry, 1);
+
+    return Entry.Status;
+}
+
+/**
+ * @brief Measure an operation once
+ * @details Should be called at DISPATCH_LEVEL, the time stamps are fenced so
+ * the operation is not reordered out of them
+ *
+ * @param Test The operation
+ * @return UINT64 The cycles between the time stamps
+ */
+static UINT64
+BenchmarkMeasure(BENCHMARK_TEST Test)
+{
+    BENCHMARK_DETOURED_FUNCTION DetouredFunction = (BENCHMARK_DETOURED_FUNCTION)&BenchmarkPages[2 * PAGE_SIZE];
+    INT32                       CpuInfo[4];
+    UINT32                      Aux;
+    UINT64                      Start;
+    UINT64                      End;
+
+    _mm_lfence();
+    Start = __rdtsc();
+    _mm_lfence();
+
+    switch (Test)
+    {
+    case BENCHMARK_TEST_CPUID:
+        __cpuid(CpuInfo, 0);
+        break;
+    case BENCHMARK_TEST_RDMSR_BITMAP_HIT:
+    case BENCHMARK_TEST_RDMSR_BITMAP_MISS:
+        __readmsr(BENCHMARK_MSR);
+        break;
+    case BENCHMARK_TEST_VMCALL:
+        AsmVmxVmcall(VMCALL_BENCHMARK, BENCHMARK_VMCALL_ROUND_TRIP, 0, 0);
+        break;
+    case BENCHMARK_TEST_EPT_READ_HOOK_HIT:
+        *(volatile UCHAR *)&BenchmarkPages[BENCHMARK_UNWATCHED_OFFSET];
+        break;
+    case BENCHMARK_TEST_EPT_WRITE_HOOK_HIT:
+        *(volatile UCHAR *)&BenchmarkPages[PAGE_SIZE + BENCHMARK_UNWATCHED_OFFSET] = 0;
+        break;
+    case BENCHMARK_TEST_EPT_EXEC_HOOK_HIT:
+        //
+        // The read switches to the original page and the execution switches
+        // back to the fake page
+        //
+        *(volatile UCHAR *)&BenchmarkPages[2 * PAGE_SIZE + BENCHMARK_UNWATCHED_OFFSET];
+        DetouredFunction(0);
+        break;
+    case BENCHMARK_TEST_DETOUR_HOOK_CALL:
+        DetouredFunction(0);
+        break;
+    default:
+        break;
+    }
+
+    End = __rdtscp(&Aux);
+    _mm_lfence();
+
+    return End - Start;
+}
+
+/**
+ * @brief Perform a test on a core and copy its samples to the result
+ * @details Should be called from vmx non-root at PASSIVE_LEVEL, the samples
+ * follow the request in the buffer
+ *
+ * @param Request The request and the header of the result
+ * @param OutputBufferLength Size of the output buffer
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+BenchmarkPerform(PBENCHMARK_REQUEST Request, UINT32 OutputBufferLength, PUINT32 ReturnedLength)
+{
+    PUINT64        Samples        = (PUINT64)((UINT64)Request + sizeof(BENCHMARK_REQUEST));
+    BENCHMARK_TEST Test           = (BENCHMARK_TEST)Request->Test;
+    UINT32         CountOfSamples = min(Request->CountOfSamples, BENCHMARK_MAXIMUM_SAMPLES);
+    UINT32         CountOfWarmups = min(Request->CountOfWarmups, BENCHMARK_MAXIMUM_SAMPLES);
+    PCHAR          HookedAddress  = NULL;
+    NTSTATUS       Status         = STATUS_SUCCESS;
+    KIRQL          OldIrql;
+
+    Request->CountOfSamples            = 0;
+    Request->TimeStampCounterFrequency = LogTimeStampCounterFrequency;
+    *ReturnedLength                    = sizeof(BENCHMARK_REQUEST);
+
+    //
+    // The syscalls are measured by the caller, only the hook is configured
+    //
+    if (Test == BENCHMARK_TEST_ENABLE_SYSCALL_HOOK_EFER)
+    {
+        if (!InterlockedExchange(&BenchmarkIsSyscallHookEferEnabled, TRUE))
+        {
+            ExtensionCommandEnableEferOnAllProcessors();
+        }
+        return STATUS_SUCCESS;
+    }
+    else if (Test == BENCHMARK_TEST_DISABLE_SYSCALL_HOOK_EFER)
+    {
+        if (InterlockedExchange(&BenchmarkIsSyscallHookEferEnabled, FALSE))
+        {
+            ExtensionCommandDisableEferOnAllProcessors();
+        }
+        return STATUS_SUCCESS;
+    }
+
+    if (Test > BENCHMARK_TEST_DETOUR_HOOK_CALL || Request->CoreId >= KeQueryActiveProcessorCount(0) || Request->CoreId >= 64)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CountOfSamples = min(CountOfSamples, (OutputBufferLength - sizeof(BENCHMARK_REQUEST)) / sizeof(UINT64));
+
+    if (!g_GuestState[Request->CoreId].HasLaunched)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    ExAcquireFastMutex(&BenchmarkMutex);
+
+    //
+    // The pages are page aligned as they're a multiple of the page size
+    //
+    BenchmarkPages = ExAllocatePoolWithTag(NonPagedPool, BENCHMARK_COUNT_OF_PAGES * PAGE_SIZE, POOLTAG);
+
+    if (!BenchmarkPages)
+    {
+        ExReleaseFastMutex(&BenchmarkMutex);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(BenchmarkPages, BENCHMARK_COUNT_OF_PAGES * PAGE_SIZE);
+
+    //
+    // Each hook test has its own page
+    //
+    if (Test == BENCHMARK_TEST_EPT_READ_HOOK_HIT)
+    {
+        HookedAddress = &BenchmarkPages[0];
+    }
+    else if (Test == BENCHMARK_TEST_EPT_WRITE_HOOK_HIT)
+    {
+        HookedAddress = &BenchmarkPages[PAGE_SIZE];
+    }
+    else if (Test == BENCHMARK_TEST_EPT_EXEC_HOOK_HIT || Test == BENCHMARK_TEST_DETOUR_HOOK_CALL)
+    {
+        HookedAddress = &BenchmarkPages[2 * PAGE_SIZE];
+    }
+
+    if (HookedAddress)
+    {
+        Status = BenchmarkApplyHook(Test, HookedAddress);
+
+        if (!NT_SUCCESS(Status))
+        {
+            LogError("The hook of the benchmark is not applied, status : 0x%x", Status);
+
+            ExFreePoolWithTag(BenchmarkPages, POOLTAG);
+            BenchmarkPages = NULL;
+
+            ExReleaseFastMutex(&BenchmarkMutex);
+            return Status;
+        }
+    }
+
+    KeSetSystemAffinityThread((KAFFINITY)(1ULL << Request->CoreId));
+
+    //
+    // The MSR is only in the bitmap of the pinned core, the miss doesn't
+    // cause vm-exit unless it's watched by an msr event
+    //
+    if (Test == BENCHMARK_TEST_RDMSR_BITMAP_HIT)
+    {
+        AsmVmxVmcall(VMCALL_BENCHMARK, BENCHMARK_VMCALL_INTERCEPT_MSR_READ, BENCHMARK_MSR, 0);
+    }
+    else if (Test == BENCHMARK_TEST_RDMSR_BITMAP_MISS)
+    {
+        AsmVmxVmcall(VMCALL_BENCHMARK, BENCHMARK_VMCALL_RESTORE_MSR_BITMAP, 0, 0);
+    }
+
+    //
+    // The interrupts and the dpcs of the core run between the samples
+    //
+    for (UINT32 i = 0; i < CountOfWarmups + CountOfSamples; i++)
+    {
+        KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+        if (i < CountOfWarmups)
+        {
+            BenchmarkMeasure(Test);
+        }
+        else
+        {
+            Samples[i - CountOfWarmups] = BenchmarkMeasure(Test);
+        }
+
+        KeLowerIrql(OldIrql);
+    }
+
+    if (Test == BENCHMARK_TEST_RDMSR_BITMAP_HIT)
+    {
+        AsmVmxVmcall(VMCALL_BENCHMARK, BENCHMARK_VMCALL_RESTORE_MSR_BITMAP, 0, 0);
+    }
+
+    KeRevertToUserAffinityThread();
+
+    if (HookedAddress)
+    {
+        HvPerformPageUnHookSinglePage((UINT64)HookedAddress);
+    }
+
+    ExFreePoolWithTag(BenchmarkPages, POOLTAG);
+    BenchmarkPages = NULL;
+
+    ExReleaseFastMutex(&BenchmarkMutex);
+
+    Request->CountOfSamples = CountOfSamples;
+    *ReturnedLength         = sizeof(BENCHMARK_REQUEST) + CountOfSamples * sizeof(UINT64);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Handle VMCALL_BENCHMARK
+ * @details Should be called in vmx-root
+ *
+ * @param Action BENCHMARK_VMCALL_*
+ * @param Msr The MSR of BENCHMARK_VMCALL_INTERCEPT_MSR_READ
+ * @return NTSTATUS
+ */
+NTSTATUS
+BenchmarkHandleVmcall(UINT64 Action, UINT64 Msr)
+{
+    switch (Action)
+    {
+    case BENCHMARK_VMCALL_ROUND_TRIP:
+        return STATUS_SUCCESS;
+    case BENCHMARK_VMCALL_INTERCEPT_MSR_READ:
+        return HvSetMsrBitmap(Msr, KeGetCurrentProcessorNumber(), TRUE, FALSE) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    case BENCHMARK_VMCALL_RESTORE_MSR_BITMAP:
+        DebuggerUpdateMsrBitmap();
+        return STATUS_SUCCESS;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+}
@@ -0,0 +1,70 @@
+/**
+ * @file Benchmark.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the micro-benchmarks of the vm-exits and the hooks
+ * @details
+ * @version 0.1
+ * @date 2020-05-24
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* The actions of VMCALL_BENCHMARK (OptionalParam1) */
+#define BENCHMARK_VMCALL_ROUND_TRIP         0x0 // Return without doing anything
+#define BENCHMARK_VMCALL_INTERCEPT_MSR_READ 0x1 // Set the reads of an MSR (OptionalParam2) in the MSR bitmap of the core
+#define BENCHMARK_VMCALL_RESTORE_MSR_BITMAP 0x2 // Rebuild the MSR bitmap of the core from the msr events
+
+/* The MSR that is read by the RDMSR tests */
+#define BENCHMARK_MSR MSR_IA32_SYSENTER_CS
+
+/* Offset of the accesses of the EPT tests, it's in the first sub-page but out of the watched byte */
+#define BENCHMARK_UNWATCHED_OFFSET 0x40
+
+/* Count of the pages of a benchmark (the read hook, the write hook and the detoured function) */
+#define BENCHMARK_COUNT_OF_PAGES 3
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The function that is detoured by the execution hook tests
+ *
+ */
+typedef UINT64 (*BENCHMARK_DETOURED_FUNCTION)(UINT64 Value);
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Serializes the benchmarks (the hooked pages are shared) */
+FAST_MUTEX BenchmarkMutex;
+
+/* The pages of the current benchmark */
+PCHAR BenchmarkPages;
+
+/* Trampoline of the detoured function (filled while hooking it) */
+BENCHMARK_DETOURED_FUNCTION BenchmarkDetourOriginal;
+
+/* Shows whether the EFER syscall hook is enabled by the benchmarks */
+volatile LONG BenchmarkIsSyscallHookEferEnabled;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+BenchmarkInitialize();
+NTSTATUS
+BenchmarkPerform(PBENCHMARK_REQUEST Request, UINT32 OutputBufferLength, PUINT32 ReturnedLength);
+NTSTATUS
+BenchmarkHandleVmcall(UINT64 Action, UINT64 Msr);
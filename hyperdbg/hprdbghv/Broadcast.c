@@ -1,66 +1,249 @@
 /**
  * @file Broadcast.c
  * @author Sina Karvandi (sina@rayanfam.com)
- * @brief Broadcast debugger function to all logical cores
- * @details This file uses DPC to run its functions on all logical cores
+ * @brief Broadcast the vmcalls to the targeted logical cores
+ * @details Each core has a dpc that is targeted to it, a broadcast only
+ * queues the dpcs of the targeted cores so the cores perform the vmcalls in
+ * parallel and the other cores are not interrupted
  * @version 0.1
  * @date 2020-04-10
  * 
  * @copyright This project is released under the GNU Public License v3.
  * 
  */
-#pragma once 
-#include "Dpc.h"
+#include "Common.h"
+#include "Definition.h"
+#include "Broadcast.h"
 #include "Vmcall.h"
-#include "DebuggerCommands.h"
 #include "InlineAsm.h"
 
 /**
- * @brief Broadcast syscall hook to all cores
+ * @brief Allocate the dpcs of the cores
+ * 
+ * @return BOOLEAN Shows whether the allocation was successful or not
+ */
+BOOLEAN
+BroadcastInitialize()
+{
+    BroadcastCoreCount = KeQueryActiveProcessorCount(0);
+
+    if (BroadcastCoreCount > BROADCAST_MAXIMUM_CORES)
+    {
+        BroadcastCoreCount = BROADCAST_MAXIMUM_CORES;
+    }
+
+    BroadcastCoreStates = ExAllocatePoolWithTag(NonPagedPool, sizeof(BROADCAST_CORE_STATE) * BroadcastCoreCount, POOLTAG);
+
+    if (!BroadcastCoreStates)
+    {
+        return FALSE;
+    }
+
+    RtlZeroMemory(BroadcastCoreStates, sizeof(BROADCAST_CORE_STATE) * BroadcastCoreCount);
+
+    for (UINT32 i = 0; i < BroadcastCoreCount; i++)
+    {
+        //
+        // The dpcs are high importance, so the targeted cores run them as
+        // soon as they are queued
+        //
+        KeInitializeDpc(&BroadcastCoreStates[i].Dpc, BroadcastDpcPerformVmcalls, (PVOID)(UINT64)i);
+        KeSetTargetProcessorDpc(&BroadcastCoreStates[i].Dpc, (CCHAR)i);
+        KeSetImportanceDpc(&BroadcastCoreStates[i].Dpc, HighImportance);
+    }
+
+    ExInitializeFastMutex(&BroadcastMutex);
+    KeInitializeEvent(&BroadcastCompletedEvent, NotificationEvent, FALSE);
+
+    return TRUE;
+}
+
+/**
+ * @brief Free the dpcs of the cores
  * 
  * @return VOID 
  */
 VOID
-BroadcastDpcEnableEferSyscallEvents(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+BroadcastUnInitialize()
 {
-    //
-    // Enable Syscall hook from vmx-root
-    //
-    AsmVmxVmcall(VMCALL_ENABLE_SYSCALL_HOOK_EFER, 0, 0, 0);
-    
-    //
-    // Wait for all DPCs to synchronize at this point
-    //
-    KeSignalCallDpcSynchronize(SystemArgument2);
+    if (BroadcastCoreStates)
+    {
+        ExFreePoolWithTag(BroadcastCoreStates, POOLTAG);
+        BroadcastCoreStates = NULL;
+    }
+}
+
+/**
+ * @brief Add a core to a core mask
+ * 
+ * @param CoreMask The core mask
+ * @param CoreId The core or DEBUGGER_EVENT_APPLY_TO_ALL_CORES to add all the cores
+ * @return VOID 
+ */
+VOID
+BroadcastCoreMaskAdd(PBROADCAST_CORE_MASK CoreMask, UINT32 CoreId)
+{
+    if (CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+    {
+        for (UINT32 i = 0; i < BroadcastCoreCount; i++)
+        {
+            SetBit(CoreMask->Bits, i, TRUE);
+        }
+    }
+    else if (CoreId < BroadcastCoreCount)
+    {
+        SetBit(CoreMask->Bits, CoreId, TRUE);
+    }
+}
+
+/**
+ * @brief Perform the vmcalls of a broadcast on the targeted cores
+ * @details Should be called from vmx non-root at IRQL <= APC_LEVEL, the
+ * vmcalls are performed on each core in the order of the operations and the
+ * failure of a vmcall doesn't prevent the next ones
+ * 
+ * @param CoreMask The targeted cores
+ * @param Operations The vmcalls
+ * @param CountOfOperations Count of the vmcalls (up to BROADCAST_MAXIMUM_OPERATIONS)
+ * @param CoreStatus Receives the status of each targeted core (an entry for
+ * each core, might be null)
+ * @return NTSTATUS STATUS_SUCCESS if the vmcalls were successful on all the
+ * targeted cores, otherwise the first failure of the cores
+ */
+NTSTATUS
+BroadcastVmcalls(PBROADCAST_CORE_MASK CoreMask, PBROADCAST_OPERATION Operations, UINT32 CountOfOperations, NTSTATUS * CoreStatus)
+{
+    NTSTATUS Status       = STATUS_SUCCESS;
+    LONG     CountOfCores = 0;
+
+    if (CountOfOperations == 0 || CountOfOperations > BROADCAST_MAXIMUM_OPERATIONS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&BroadcastMutex);
+
+    RtlCopyMemory(BroadcastOperations, Operations, sizeof(BROADCAST_OPERATION) * CountOfOperations);
+    BroadcastCountOfOperations = CountOfOperations;
+
+    for (UINT32 i = 0; i < BroadcastCoreCount; i++)
+    {
+        if (GetBit(CoreMask->Bits, i))
+        {
+            CountOfCores++;
+        }
+    }
+
+    if (CountOfCores == 0)
+    {
+        ExReleaseFastMutex(&BroadcastMutex);
+        return STATUS_SUCCESS;
+    }
 
     //
-    // Mark the DPC as being complete
+    // The counter is set before queueing the first dpc, so the last core is
+    // the one that sets the event
     //
-    KeSignalCallDpcDone(SystemArgument1);
+    KeClearEvent(&BroadcastCompletedEvent);
+    InterlockedExchange(&BroadcastPendingCores, CountOfCores);
+
+    for (UINT32 i = 0; i < BroadcastCoreCount; i++)
+    {
+        if (GetBit(CoreMask->Bits, i))
+        {
+            KeInsertQueueDpc(&BroadcastCoreStates[i].Dpc, NULL, NULL);
+        }
+    }
+
+    KeWaitForSingleObject(&BroadcastCompletedEvent, Executive, KernelMode, FALSE, NULL);
+
+    for (UINT32 i = 0; i < BroadcastCoreCount; i++)
+    {
+        if (!GetBit(CoreMask->Bits, i))
+        {
+            continue;
+        }
+
+        if (CoreStatus)
+        {
+            CoreStatus[i] = BroadcastCoreStates[i].Status;
+        }
+
+        if (!NT_SUCCESS(BroadcastCoreStates[i].Status) && NT_SUCCESS(Status))
+        {
+            Status = BroadcastCoreStates[i].Status;
+        }
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        LogError("Vmcall %llx is not successful on all the targeted cores", BroadcastOperations[0].VmcallNumber);
+    }
+
+    ExReleaseFastMutex(&BroadcastMutex);
+
+    return Status;
 }
 
+/**
+ * @brief Perform a vmcall on all the cores
+ * 
+ * @param VmcallNumber The vmcall
+ * @param OptionalParam1 The first parameter of the vmcall
+ * @return NTSTATUS STATUS_SUCCESS if the vmcall was successful on all the cores
+ */
+NTSTATUS
+BroadcastVmcallToAllCores(UINT64 VmcallNumber, UINT64 OptionalParam1)
+{
+    BROADCAST_CORE_MASK CoreMask  = {0};
+    BROADCAST_OPERATION Operation = {0};
 
+    Operation.VmcallNumber   = VmcallNumber;
+    Operation.OptionalParam1 = OptionalParam1;
+
+    BroadcastCoreMaskAdd(&CoreMask, DEBUGGER_EVENT_APPLY_TO_ALL_CORES);
+
+    return BroadcastVmcalls(&CoreMask, &Operation, 1, NULL);
+}
 
 /**
- * @brief Broadcast syscall unhook to all cores
+ * @brief The dpc of each core that performs the vmcalls of the current broadcast
  * 
+ * @param Dpc 
+ * @param DeferredContext The index of the core
+ * @param SystemArgument1 
+ * @param SystemArgument2 
  * @return VOID 
  */
 VOID
-BroadcastDpcDisableEferSyscallEvents(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+BroadcastDpcPerformVmcalls(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
 {
-    //
-    // Disable Syscall hook from vmx-root
-    //
-    AsmVmxVmcall(VMCALL_DISABLE_SYSCALL_HOOK_EFER, 0, 0, 0);
+    PBROADCAST_CORE_STATE CoreState = &BroadcastCoreStates[(UINT64)DeferredContext];
+    NTSTATUS              Status;
 
-    //
-    // Wait for all DPCs to synchronize at this point
-    //
-    KeSignalCallDpcSynchronize(SystemArgument2);
+    CoreState->Status = STATUS_SUCCESS;
+
+    for (UINT32 i = 0; i < BroadcastCountOfOperations; i++)
+    {
+        Status = AsmVmxVmcall(BroadcastOperations[i].VmcallNumber,
+                              BroadcastOperations[i].OptionalParam1,
+                              BroadcastOperations[i].OptionalParam2,
+                              BroadcastOperations[i].OptionalParam3);
+
+        //
+        // Keep the first failure of this core
+        //
+        if (!NT_SUCCESS(Status) && NT_SUCCESS(CoreState->Status))
+        {
+            CoreState->Status = Status;
+        }
+    }
 
     //
-    // Mark the DPC as being complete
+    // The last core wakes up the broadcaster
     //
-    KeSignalCallDpcDone(SystemArgument1);
-}
\ No newline at end of file
+    if (InterlockedDecrement(&BroadcastPendingCores) == 0)
+    {
+        KeSetEvent(&BroadcastCompletedEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
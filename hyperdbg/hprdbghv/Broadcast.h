@@ -1,7 +1,7 @@
 /**
  * @file Broadcast.h
  * @author Sina Karvandi (sina@rayanfam.com)
- * @brief The broadcast (DPC) function to all the cores for debugger commands
+ * @brief The broadcast of the vmcalls to the targeted cores
  * @details 
  * @version 0.1
  * @date 2020-04-17
@@ -12,12 +12,99 @@
 #pragma once
 #include <ntddk.h>
 
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief Maximum count of the cores of a core mask
+ * 
+ */
+#define BROADCAST_MAXIMUM_CORES 256
+
+/**
+ * @brief Maximum count of the vmcalls of one broadcast
+ * 
+ */
+#define BROADCAST_MAXIMUM_OPERATIONS 8
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The cores that a broadcast is performed on (bit n is the core n)
+ * 
+ */
+typedef struct _BROADCAST_CORE_MASK
+{
+    UINT64 Bits[BROADCAST_MAXIMUM_CORES / 64];
+
+} BROADCAST_CORE_MASK, *PBROADCAST_CORE_MASK;
+
+/**
+ * @brief A vmcall that is performed on each of the targeted cores
+ * 
+ */
+typedef struct _BROADCAST_OPERATION
+{
+    UINT64 VmcallNumber;
+    UINT64 OptionalParam1;
+    UINT64 OptionalParam2;
+    UINT64 OptionalParam3;
+
+} BROADCAST_OPERATION, *PBROADCAST_OPERATION;
+
+/**
+ * @brief The dpc of each core (targeted to the core) and the status of the
+ * vmcalls of the last broadcast on it
+ * 
+ */
+typedef struct DECLSPEC_CACHEALIGN _BROADCAST_CORE_STATE
+{
+    KDPC     Dpc;
+    NTSTATUS Status;
+
+} BROADCAST_CORE_STATE, *PBROADCAST_CORE_STATE;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* The dpcs and the statuses of the cores */
+BROADCAST_CORE_STATE * BroadcastCoreStates;
+
+/* Count of the entries of BroadcastCoreStates */
+UINT32 BroadcastCoreCount;
+
+/* Serializes the broadcasts (the operations and the counter are shared) */
+FAST_MUTEX BroadcastMutex;
+
+/* The vmcalls of the current broadcast */
+BROADCAST_OPERATION BroadcastOperations[BROADCAST_MAXIMUM_OPERATIONS];
+
+/* Count of the vmcalls of the current broadcast */
+UINT32 BroadcastCountOfOperations;
+
+/* Count of the targeted cores that have not finished the current broadcast */
+volatile LONG BroadcastPendingCores;
+
+/* Set by the last core of the current broadcast */
+KEVENT BroadcastCompletedEvent;
 
 //////////////////////////////////////////////////
 //					Functions					//
 //////////////////////////////////////////////////
 
+BOOLEAN
+BroadcastInitialize();
+VOID
+BroadcastUnInitialize();
 VOID
-BroadcastDpcEnableEferSyscallEvents(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+BroadcastCoreMaskAdd(PBROADCAST_CORE_MASK CoreMask, UINT32 CoreId);
+NTSTATUS
+BroadcastVmcalls(PBROADCAST_CORE_MASK CoreMask, PBROADCAST_OPERATION Operations, UINT32 CountOfOperations, NTSTATUS * CoreStatus);
+NTSTATUS
+BroadcastVmcallToAllCores(UINT64 VmcallNumber, UINT64 OptionalParam1);
 VOID
-BroadcastDpcDisableEferSyscallEvents(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+BroadcastDpcPerformVmcalls(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
@@ -14,6 +14,7 @@
 #include "Msr.h"
 #include "Common.h"
 #include "Vmx.h"
+#include "GlobalVariables.h"
 
 /**
  * @brief Power function in order to computer address for MSR bitmaps
@@ -45,31 +46,6 @@ MathPower(int Base, int Exp)
     return result;
 }
 
-/**
- * @brief Broadcast a function to all logical cores
- * @details This function is deprecated as we want to supporrt more than 32 processors
- * 
- * @param ProcessorNumber The logical core number to execute routine on it
- * @param Routine The fucntion that should be executed on the target core
- * @return BOOLEAN Returns true if it was successfull
- */
-BOOLEAN
-BroadcastToProcessors(ULONG ProcessorNumber, RunOnLogicalCoreFunc Routine)
-{
-    KIRQL OldIrql;
-
-    KeSetSystemAffinityThread((KAFFINITY)(1 << ProcessorNumber));
-
-    OldIrql = KeRaiseIrqlToDpcLevel();
-
-    Routine(ProcessorNumber);
-
-    KeLowerIrql(OldIrql);
-
-    KeRevertToUserAffinityThread();
-
-    return TRUE;
-}
 /**
  * @brief Set Bits for a special address (used on MSR Bitmaps)
  * 
@@ -85,9 +61,12 @@ SetBit(PVOID Addr, UINT64 bit, BOOLEAN Set)
     UINT64 n;
     BYTE * Addr2;
 
+    //
+    // Bit n of the bitmap is the bit (n % 8) of the byte (n / 8)
+    //
     byte = bit / 8;
     temp = bit % 8;
-    n    = 7 - temp;
+    n    = temp;
 
     Addr2 = Addr;
 
@@ -117,7 +96,7 @@ GetBit(PVOID Addr, UINT64 bit)
     byte = 0;
     k    = 0;
     byte = bit / 8;
-    k    = 7 - bit % 8;
+    k    = bit % 8;
 
     Addr2 = Addr;
 
@@ -165,3 +144,230 @@ FindSystemDirectoryTableBase()
     NT_KPROCESS * SystemProcess = (NT_KPROCESS *)(PsInitialSystemProcess);
     return SystemProcess->DirectoryTableBase;
 }
+
+/**
+ * @brief Walk the page tables of a kernel address in the current address space
+ * @details The tables are accessed by MmGetVirtualForPhysical, it returns the
+ * addresses of the self-map for the tables, and the self-map shows the tables
+ * of the current process, so only the kernel addresses (their tables are the
+ * same in all the processes) are walked, it shouldn't be called in vmx-root
+ * (see GuestVirtualAddressToPhysicalAddress)
+ *
+ * @param Cr3 The cr3 of the address space (the PCID bits are ignored)
+ * @param VirtualAddress The target virtual address (kernel address)
+ * @param PageSize Size of the page that maps the address (if it's present)
+ * @return PUINT64 The entry that maps the address or NULL if a table is not present
+ */
+static PUINT64
+WalkKernelPageTables(UINT64 Cr3, UINT64 VirtualAddress, PUINT64 PageSize)
+{
+    PUINT64 Table = (PUINT64)PhysicalAddressToVirtualAddress(Cr3 & PAGE_TABLE_ENTRY_ADDRESS_MASK);
+    PUINT64 Entry;
+
+    for (INT Shift = 39; Shift >= 12; Shift -= 9)
+    {
+        if (Table == NULL)
+        {
+            return NULL;
+        }
+
+        Entry     = &Table[(VirtualAddress >> Shift) & 0x1ff];
+        *PageSize = 1ULL << Shift;
+
+        //
+        // The last level, or a 1GB or a 2MB page
+        //
+        if (Shift == 12 || ((*Entry & PAGE_TABLE_ENTRY_LARGE_PAGE) && Shift != 39))
+        {
+            return Entry;
+        }
+
+        if (!(*Entry & PAGE_TABLE_ENTRY_PRESENT))
+        {
+            return NULL;
+        }
+
+        Table = (PUINT64)PhysicalAddressToVirtualAddress(*Entry & PAGE_TABLE_ENTRY_ADDRESS_MASK);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Converts a virtual address of the guest to its physical address
+ * @details Should be called in vmx-root, unlike VirtualAddressToPhysicalAddress,
+ * the address is translated by the tables of the cr3 of the guest, each table
+ * is mapped by its physical address to the reserved address of the current
+ * core (see CopyGuestPhysicalMemory), so the cr3 of any process is walked
+ *
+ * @param GuestCr3 The cr3 of the guest
+ * @param VirtualAddress The target virtual address
+ * @param PageFlags [Out] The PWT, PCD and PAT bits of the page (as a 4KB entry)
+ * so the page is mapped by the same memory type, and the writable and user bits
+ * that are set in all of the levels (optional)
+ * @return UINT64 Returns the physical address or zero if it's not present
+ */
+UINT64
+GuestVirtualAddressToPhysicalAddress(UINT64 GuestCr3, UINT64 VirtualAddress, PUINT64 PageFlags)
+{
+    UINT64 Table  = GuestCr3 & PAGE_TABLE_ENTRY_ADDRESS_MASK;
+    UINT64 Rights = PAGE_TABLE_ENTRY_WRITABLE | PAGE_TABLE_ENTRY_USER;
+    UINT64 Entry;
+    UINT64 PageSize;
+
+    for (INT Shift = 39;; Shift -= 9)
+    {
+        if (!CopyGuestPhysicalMemory(Table + ((VirtualAddress >> Shift) & 0x1ff) * sizeof(UINT64), &Entry, sizeof(UINT64), FALSE, 0) ||
+            !(Entry & PAGE_TABLE_ENTRY_PRESENT))
+        {
+            return 0;
+        }
+
+        //
+        // The page is only writable or accessible by the user-mode if all
+        // of the levels allow it
+        //
+        Rights &= Entry;
+
+        //
+        // The last level, or a 1GB or a 2MB page
+        //
+        if (Shift == 12 || ((Entry & PAGE_TABLE_ENTRY_LARGE_PAGE) && Shift != 39))
+        {
+            PageSize = 1ULL << Shift;
+            break;
+        }
+
+        Table = Entry & PAGE_TABLE_ENTRY_ADDRESS_MASK;
+    }
+
+    if (PageFlags != NULL)
+    {
+        *PageFlags = Rights | (Entry & (PAGE_TABLE_ENTRY_WRITE_THROUGH | PAGE_TABLE_ENTRY_CACHE_DISABLE));
+
+        if (Entry & (PageSize == PAGE_SIZE ? PAGE_TABLE_ENTRY_PAT : PAGE_TABLE_ENTRY_LARGE_PAGE_PAT))
+        {
+            *PageFlags |= PAGE_TABLE_ENTRY_PAT;
+        }
+    }
+
+    return (Entry & PAGE_TABLE_ENTRY_ADDRESS_MASK & ~(PageSize - 1)) + (VirtualAddress & (PageSize - 1));
+}
+
+/**
+ * @brief Find the entry of the last level of the page tables of a kernel address
+ * @details Should be called in vmx non-root, the user-mode addresses are not
+ * walked (see WalkKernelPageTables)
+ *
+ * @param Cr3 The cr3 of the address space
+ * @param VirtualAddress The target kernel address (should be mapped by a 4KB page)
+ * @return PUINT64 Returns the entry or NULL if a table is not present
+ */
+PUINT64
+GetPageTableEntry(UINT64 Cr3, UINT64 VirtualAddress)
+{
+    UINT64  PageSize = 0;
+    PUINT64 Entry;
+
+    if ((VirtualAddress & 0xff00000000000000) == 0)
+    {
+        return NULL;
+    }
+
+    Entry = WalkKernelPageTables(Cr3, VirtualAddress, &PageSize);
+
+    return Entry != NULL && PageSize == PAGE_SIZE ? Entry : NULL;
+}
+
+/**
+ * @brief Copy the memory of the guest by its physical address
+ * @details Should be called in vmx-root, the page is mapped to the reserved
+ * address of the current core (the memory should be in a single page)
+ *
+ * @param PhysicalAddress The target physical address
+ * @param Buffer The buffer of the data
+ * @param Length Length of the data
+ * @param IsWrite Whether the buffer is copied to the guest or the guest is copied to the buffer
+ * @param MemoryTypeFlags The PWT, PCD and PAT bits of the mapping (zero for write-back), the
+ * pages of the virtual addresses are mapped by the type that the guest maps them
+ * @return BOOLEAN Returns true if the memory is copied
+ */
+BOOLEAN
+CopyGuestPhysicalMemory(UINT64 PhysicalAddress, PVOID Buffer, UINT32 Length, BOOLEAN IsWrite, UINT64 MemoryTypeFlags)
+{
+    VIRTUAL_MACHINE_STATE * CurrentGuestState = &g_GuestState[KeGetCurrentProcessorNumber()];
+    PVOID                   MappedAddress;
+
+    if (CurrentGuestState->MemoryMapperPte == NULL || (PhysicalAddress & (PAGE_SIZE - 1)) + Length > PAGE_SIZE)
+    {
+        return FALSE;
+    }
+
+    MappedAddress = (PVOID)(CurrentGuestState->MemoryMapperVirtualAddress + (PhysicalAddress & (PAGE_SIZE - 1)));
+
+    //
+    // Map the page, copy it, then unmap it
+    //
+    *CurrentGuestState->MemoryMapperPte = (PhysicalAddress & PAGE_TABLE_ENTRY_ADDRESS_MASK) | PAGE_TABLE_ENTRY_ACCESSED | PAGE_TABLE_ENTRY_PRESENT |
+                                          (MemoryTypeFlags & (PAGE_TABLE_ENTRY_WRITE_THROUGH | PAGE_TABLE_ENTRY_CACHE_DISABLE | PAGE_TABLE_ENTRY_PAT)) |
+                                          (IsWrite ? PAGE_TABLE_ENTRY_WRITABLE | PAGE_TABLE_ENTRY_DIRTY : 0);
+    __invlpg((PVOID)CurrentGuestState->MemoryMapperVirtualAddress);
+
+    if (IsWrite)
+    {
+        RtlCopyMemory(MappedAddress, Buffer, Length);
+    }
+    else
+    {
+        RtlCopyMemory(Buffer, MappedAddress, Length);
+    }
+
+    *CurrentGuestState->MemoryMapperPte = 0;
+    __invlpg((PVOID)CurrentGuestState->MemoryMapperVirtualAddress);
+
+    return TRUE;
+}
+
+/**
+ * @brief Read the memory of the guest by its virtual address
+ * @details Should be called in vmx-root, each page is translated by the cr3
+ * of the guest and it's mapped to the reserved address of the current core,
+ * so neither the cr3 is changed nor the page should be present in the
+ * current address space
+ *
+ * @param GuestCr3 The cr3 of the guest
+ * @param VirtualAddress The target virtual address
+ * @param Buffer The buffer to copy the memory
+ * @param Size Size of the memory
+ * @return BOOLEAN Returns true if all the pages are present
+ */
+BOOLEAN
+ReadGuestVirtualMemory(UINT64 GuestCr3, UINT64 VirtualAddress, PVOID Buffer, UINT32 Size)
+{
+    UINT64 PhysicalAddress;
+    UINT64 MemoryTypeFlags;
+    UINT32 Length;
+
+    while (Size != 0)
+    {
+        PhysicalAddress = GuestVirtualAddressToPhysicalAddress(GuestCr3, VirtualAddress, &MemoryTypeFlags);
+
+        if (PhysicalAddress == 0)
+        {
+            return FALSE;
+        }
+
+        Length = min(Size, PAGE_SIZE - (UINT32)(VirtualAddress & (PAGE_SIZE - 1)));
+
+        if (!CopyGuestPhysicalMemory(PhysicalAddress, Buffer, Length, FALSE, MemoryTypeFlags))
+        {
+            return FALSE;
+        }
+
+        Buffer = (PVOID)((UINT64)Buffer + Length);
+        VirtualAddress += Length;
+        Size -= Length;
+    }
+
+    return TRUE;
+}
@@ -45,6 +45,32 @@ SpinlockLock(volatile LONG * Lock);
 inline void
 SpinlockUnlock(volatile LONG * Lock);
 
+/**
+ * @brief A ticket spinlock (fair, the cores get it in the order of their tickets)
+ * @details The counters are only changed by the owner of the lock, so they
+ * don't need atomic operations
+ * 
+ */
+typedef struct _TICKET_SPINLOCK
+{
+    volatile LONG NextTicket;
+    volatile LONG NowServing;
+    BOOLEAN       CollectStatistics;     // Whether the counters are updated
+    UINT64        Acquisitions;          // Count of the acquisitions
+    UINT64        ContendedAcquisitions; // Acquisitions that waited for another core
+    UINT64        SpinCycles;            // Time stamp counter cycles of waiting
+
+} TICKET_SPINLOCK, *PTICKET_SPINLOCK;
+
+VOID
+TicketSpinlockInitialize(PTICKET_SPINLOCK Lock, BOOLEAN CollectStatistics);
+BOOLEAN
+TicketSpinlockTryLock(PTICKET_SPINLOCK Lock);
+VOID
+TicketSpinlockLock(PTICKET_SPINLOCK Lock);
+VOID
+TicketSpinlockUnlock(PTICKET_SPINLOCK Lock);
+
 //////////////////////////////////////////////////
 //					Constants					//
 //////////////////////////////////////////////////
@@ -75,6 +101,7 @@ SpinlockUnlock(volatile LONG * Lock);
 #define X86_CR4_OSFXSR     0x0200 /* enable fast FPU save and restore */
 #define X86_CR4_OSXMMEXCPT 0x0400 /* enable unmasked SSE exceptions */
 #define X86_CR4_VMXE       0x2000 /* enable VMX */
+#define X86_CR4_PCIDE      0x20000 /* enable process-context identifiers */
 
 /* EFLAGS/RFLAGS */
 #define X86_FLAGS_CF            (1 << 0)
@@ -136,6 +163,19 @@ SpinlockUnlock(volatile LONG * Lock);
 /* RPL Mask */
 #define RPL_MASK 3
 
+/* Bits of the entries of the page tables */
+#define PAGE_TABLE_ENTRY_PRESENT        0x1
+#define PAGE_TABLE_ENTRY_WRITABLE       0x2
+#define PAGE_TABLE_ENTRY_USER           0x4
+#define PAGE_TABLE_ENTRY_WRITE_THROUGH  0x8
+#define PAGE_TABLE_ENTRY_CACHE_DISABLE  0x10
+#define PAGE_TABLE_ENTRY_ACCESSED       0x20
+#define PAGE_TABLE_ENTRY_DIRTY          0x40
+#define PAGE_TABLE_ENTRY_LARGE_PAGE     0x80
+#define PAGE_TABLE_ENTRY_PAT            0x80   // In the entries of the 4KB pages
+#define PAGE_TABLE_ENTRY_LARGE_PAGE_PAT 0x1000 // In the entries of the 2MB and 1GB pages
+#define PAGE_TABLE_ENTRY_ADDRESS_MASK   0x000ffffffffff000ULL
+
 //////////////////////////////////////////////////
 //					 Structures					//
 //////////////////////////////////////////////////
@@ -273,12 +313,6 @@ typedef struct _NT_KPROCESS
     UCHAR             Data[1];
 } NT_KPROCESS, *PNT_KPROCESS;
 
-//////////////////////////////////////////////////
-//				 Function Types					//
-//////////////////////////////////////////////////
-
-typedef void (*RunOnLogicalCoreFunc)(ULONG ProcessorID);
-
 //////////////////////////////////////////////////
 //					Logging						//
 //////////////////////////////////////////////////
@@ -324,15 +358,6 @@ typedef enum _LOG_TYPE
 
 #else
 
-#    define LogInfo(format, ...)                                        \
-        LogSendMessageToQueue(OPERATION_LOG_INFO_MESSAGE,               \
-                              UseImmediateMessaging,                    \
-                              ShowSystemTimeOnDebugMessages,            \
-                              "[+] Information (%s:%d) | " format "\n", \
-                              __func__,                                 \
-                              __LINE__,                                 \
-                              __VA_ARGS__)
-
 #    define LogInfoImmediate(format, ...)                               \
         LogSendMessageToQueue(OPERATION_LOG_INFO_MESSAGE,               \
                               TRUE,                                     \
@@ -342,24 +367,74 @@ typedef enum _LOG_TYPE
                               __LINE__,                                 \
                               __VA_ARGS__)
 
-#    define LogWarning(format, ...)                                 \
-        LogSendMessageToQueue(OPERATION_LOG_WARNING_MESSAGE,        \
-                              UseImmediateMessaging,                \
-                              ShowSystemTimeOnDebugMessages,        \
-                              "[-] Warning (%s:%d) | " format "\n", \
-                              __func__,                             \
-                              __LINE__,                             \
-                              __VA_ARGS__)
-
-#    define LogError(format, ...)                                 \
-        LogSendMessageToQueue(OPERATION_LOG_ERROR_MESSAGE,        \
-                              UseImmediateMessaging,              \
-                              ShowSystemTimeOnDebugMessages,      \
-                              "[!] Error (%s:%d) | " format "\n", \
-                              __func__,                           \
-                              __LINE__,                           \
-                              __VA_ARGS__);                       \
-        DbgBreakPoint()
+#    if UseBinaryMessagesInVmxRoot
+
+/* Send binary message in vmx-root (if possible) otherwise send text message */
+#        define LogBinaryOrText(OperationCode, prefix, format, ...)         \
+            do                                                             \
+            {                                                              \
+                static LOG_BINARY_FORMAT_STATE LogFormatState = {0};       \
+                LogSendBinaryMessageToQueue(OperationCode,                 \
+                                            UseImmediateMessaging,         \
+                                            ShowSystemTimeOnDebugMessages, \
+                                            &LogFormatState,               \
+                                            prefix,                        \
+                                            __func__,                      \
+                                            __LINE__,                      \
+                                            format "\n",                   \
+                                            __VA_ARGS__);                  \
+            } while (0)
+
+#        define LogInfo(format, ...)                      \
+            LogBinaryOrText(OPERATION_LOG_INFO_MESSAGE,   \
+                            "[+] Information (%s:%d) | ", \
+                            format,                       \
+                            __VA_ARGS__)
+
+#        define LogWarning(format, ...)                    \
+            LogBinaryOrText(OPERATION_LOG_WARNING_MESSAGE, \
+                            "[-] Warning (%s:%d) | ",      \
+                            format,                        \
+                            __VA_ARGS__)
+
+#        define LogError(format, ...)                    \
+            LogBinaryOrText(OPERATION_LOG_ERROR_MESSAGE, \
+                            "[!] Error (%s:%d) | ",      \
+                            format,                      \
+                            __VA_ARGS__);                \
+            DbgBreakPoint()
+
+#    else
+
+#        define LogInfo(format, ...)                                        \
+            LogSendMessageToQueue(OPERATION_LOG_INFO_MESSAGE,               \
+                                  UseImmediateMessaging,                    \
+                                  ShowSystemTimeOnDebugMessages,            \
+                                  "[+] Information (%s:%d) | " format "\n", \
+                                  __func__,                                 \
+                                  __LINE__,                                 \
+                                  __VA_ARGS__)
+
+#        define LogWarning(format, ...)                                 \
+            LogSendMessageToQueue(OPERATION_LOG_WARNING_MESSAGE,        \
+                                  UseImmediateMessaging,                \
+                                  ShowSystemTimeOnDebugMessages,        \
+                                  "[-] Warning (%s:%d) | " format "\n", \
+                                  __func__,                             \
+                                  __LINE__,                             \
+                                  __VA_ARGS__)
+
+#        define LogError(format, ...)                                 \
+            LogSendMessageToQueue(OPERATION_LOG_ERROR_MESSAGE,        \
+                                  UseImmediateMessaging,              \
+                                  ShowSystemTimeOnDebugMessages,      \
+                                  "[!] Error (%s:%d) | " format "\n", \
+                                  __func__,                           \
+                                  __LINE__,                           \
+                                  __VA_ARGS__);                       \
+            DbgBreakPoint()
+
+#    endif // UseBinaryMessagesInVmxRoot
 
 /* Log without any prefix */
 #    define Log(format, ...)                                 \
@@ -377,11 +452,8 @@ typedef enum _LOG_TYPE
 
 void
 SetBit(PVOID Addr, UINT64 bit, BOOLEAN Set);
-void
-GetBit(PVOID Addr, UINT64 bit);
-
 BOOLEAN
-BroadcastToProcessors(ULONG ProcessorNumber, RunOnLogicalCoreFunc Routine);
+GetBit(PVOID Addr, UINT64 bit);
 
 UINT64
 VirtualAddressToPhysicalAddress(PVOID VirtualAddress);
@@ -395,6 +467,18 @@ MathPower(int Base, int Exp);
 UINT64
 FindSystemDirectoryTableBase();
 
+UINT64
+GuestVirtualAddressToPhysicalAddress(UINT64 GuestCr3, UINT64 VirtualAddress, PUINT64 PageFlags);
+
+PUINT64
+GetPageTableEntry(UINT64 Cr3, UINT64 VirtualAddress);
+
+BOOLEAN
+CopyGuestPhysicalMemory(UINT64 PhysicalAddress, PVOID Buffer, UINT32 Length, BOOLEAN IsWrite, UINT64 MemoryTypeFlags);
+
+BOOLEAN
+ReadGuestVirtualMemory(UINT64 GuestCr3, UINT64 VirtualAddress, PVOID Buffer, UINT32 Size);
+
 //////////////////////////////////////////////////
 //			 WDK Major Functions				//
 //////////////////////////////////////////////////
@@ -415,6 +499,8 @@ DrvWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS
 DrvClose(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS
+DrvCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+NTSTATUS
 DrvUnsupported(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS
 DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp);
@@ -423,17 +509,40 @@ DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 //			         Functions  				//
 //////////////////////////////////////////////////
 
-#define MAX_EXEC_TRAMPOLINE_SIZE 100
-
 /* A test function for Syscall hook */
 VOID
 SyscallHookTest();
+/* Initialize and free the resolved service tables */
+VOID
+SyscallHookInitialize();
+VOID
+SyscallHookUnInitialize();
+/* Find the kernel base and the service tables (resolved once) */
+PVOID
+SyscallHookGetKernelBase(PULONG pImageSize);
+BOOLEAN
+SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable);
+/* Find the service of a syscall number */
+PVOID
+SyscallHookGetFunctionAddress(INT32 ApiNumber, BOOLEAN GetFromWin32k);
+/* Copy the resolved service tables to a buffer */
+NTSTATUS
+SyscallHookQueryServiceTables(PSYSCALL_SERVICE_TABLES_RESULT Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength);
 /* Enable or Disable Syscall Hook for EFER MSR */
 VOID
 SyscallHookConfigureEFER(BOOLEAN EnableEFERSyscallHook);
 /* Manage #UD Exceptions for EFER Syscall */
 BOOLEAN
 SyscallHookHandleUD(PGUEST_REGS Regs, UINT32 CoreIndex);
+/* Set the syscalls that trigger the EFER Syscall events */
+VOID
+SyscallHookSetFilter(PSYSCALL_HOOK_FILTER_REQUEST Filter);
+/* Start or stop the binary trace of the syscalls */
+VOID
+SyscallHookControlTrace(PSYSCALL_TRACE_CONTROL_REQUEST Request);
+/* Send the trace record of a syscall */
+VOID
+SyscallHookTraceSyscall(PGUEST_REGS Regs, UINT32 CoreIndex);
 /* SYSRET instruction emulation routine */
 BOOLEAN
 SyscallHookEmulateSYSRET(PGUEST_REGS Regs);
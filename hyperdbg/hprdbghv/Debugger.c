@@ -13,9 +13,14 @@
 #include <ntddk.h>
 #include "Common.h"
 #include "Debugger.h"
+#include "Broadcast.h"
 #include "ExtensionCommands.h"
 #include "GlobalVariables.h"
 #include "Hooks.h"
+#include "HypervisorRoutines.h"
+#include "Events.h"
+#include "Vmcall.h"
+#include "InlineAsm.h"
 
 VOID
 TestMe()
@@ -113,20 +118,20 @@ DebuggerInitialize()
     ProcessorCount = KeQueryActiveProcessorCount(0);
 
     //
-    // Initialize lists relating to the debugger events store
+    // Initialize the arrays relating to the debugger events store
     //
     for (size_t i = 0; i < ProcessorCount; i++)
     {
-        //
-        // Initialize list of each event
-        //
-
-        InitializeListHead(&g_GuestState[i].Events.HiddenHookExecCcEventsHead);
-        InitializeListHead(&g_GuestState[i].Events.HiddenHookRwEventsHead);
-        InitializeListHead(&g_GuestState[i].Events.HiddenHooksExecDetourEventsHead);
-        InitializeListHead(&g_GuestState[i].Events.SyscallHooksEferEventsHead);
+        RtlZeroMemory(&g_GuestState[i].Events, sizeof(DEBUGGER_CORE_EVENTS));
     }
 
+    //
+    // The arrays are replaced (not changed) by the updates, and the replaced
+    // arrays are freed after all the cores leave them
+    //
+    ExInitializeFastMutex(&DebuggerEventsMutex);
+    InitializeListHead(&DebuggerRetiredEventArraysHead);
+
     //
     // Initialize the list of hidden hooks headers
     //
@@ -156,9 +161,12 @@ DebuggerCreateEvent(BOOLEAN Enabled, UINT32 CoreId, DEBUGGER_EVENT_TYPE_ENUM Eve
     }
 
     //
-    // Initialize the event structure
+    // Initialize the event structure, the counters of the cores are at the
+    // end of the buffer (after the condition) and aligned to a cache line
     //
-    PDEBUGGER_EVENT Event = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_EVENT) + ConditionsBufferSize, POOLTAG);
+    SIZE_T          StatisticsSize = KeQueryActiveProcessorCount(0) * sizeof(DEBUGGER_EVENT_STATISTICS);
+    SIZE_T          EventSize      = sizeof(DEBUGGER_EVENT) + ConditionsBufferSize + SYSTEM_CACHE_ALIGNMENT_SIZE + StatisticsSize;
+    PDEBUGGER_EVENT Event          = ExAllocatePoolWithTag(NonPagedPool, EventSize, POOLTAG);
     if (!Event)
     {
         //
@@ -166,7 +174,10 @@ DebuggerCreateEvent(BOOLEAN Enabled, UINT32 CoreId, DEBUGGER_EVENT_TYPE_ENUM Eve
         //
         return NULL;
     }
-    RtlZeroMemory(Event, sizeof(DEBUGGER_EVENT) + ConditionsBufferSize);
+    RtlZeroMemory(Event, EventSize);
+
+    Event->Statistics = (PDEBUGGER_EVENT_STATISTICS)(((UINT64)Event + sizeof(DEBUGGER_EVENT) + ConditionsBufferSize + SYSTEM_CACHE_ALIGNMENT_SIZE - 1) &
+                                                     ~((UINT64)SYSTEM_CACHE_ALIGNMENT_SIZE - 1));
 
     Event->CoreId         = CoreId;
     Event->Enabled        = Enabled;
@@ -327,7 +338,10 @@ DebuggerAddActionToEvent(PDEBUGGER_EVENT Event, DEBUGGER_EVENT_ACTION_TYPE_ENUM
     //
     if (ActionType == LOG_THE_STATES)
     {
-        Action->LogConfiguration.LogLength = InTheCaseOfLogTheStates->LogLength;
+        //
+        // The memory of each record is bounded, so it's built on the stack
+        //
+        Action->LogConfiguration.LogLength = min(InTheCaseOfLogTheStates->LogLength, DEBUGGER_LOG_STATES_MAXIMUM_MEMORY);
         Action->LogConfiguration.LogMask   = InTheCaseOfLogTheStates->LogMask;
         Action->LogConfiguration.LogType   = InTheCaseOfLogTheStates->LogType;
         Action->LogConfiguration.LogValue  = InTheCaseOfLogTheStates->LogValue;
@@ -354,408 +368,2266 @@ DebuggerAddActionToEvent(PDEBUGGER_EVENT Event, DEBUGGER_EVENT_ACTION_TYPE_ENUM
     return TRUE;
 }
 
-BOOLEAN
-DebuggerRegisterEvent(PDEBUGGER_EVENT Event)
+/**
+ * @brief Free an event that is not registered and its actions
+ * 
+ * @param Event The event
+ * @return VOID 
+ */
+static VOID
+DebuggerFreeUnregisteredEvent(PDEBUGGER_EVENT Event)
 {
-    UINT32 ProcessorCount;
+    while (!IsListEmpty(&Event->ActionsListHead))
+    {
+        PDEBUGGER_EVENT_ACTION Action = CONTAINING_RECORD(RemoveHeadList(&Event->ActionsListHead), DEBUGGER_EVENT_ACTION, ActionsList);
 
-    ProcessorCount = KeQueryActiveProcessorCount(0);
+        if (Action->RequestedBuffer.EnabledRequestBuffer)
+        {
+            ExFreePoolWithTag(Action->RequestedBuffer.RequstBufferAddress, POOLTAG);
+        }
+
+        ExFreePoolWithTag(Action, POOLTAG);
+    }
+
+    ExFreePoolWithTag(Event, POOLTAG);
+}
+
+/**
+ * @brief Wait for a DPC on all the cores (DebuggerQuiesceNonRootTriggers)
+ * @details The triggers of vmx non-root run at DISPATCH_LEVEL or above, so
+ * none of them is running on this core while we're in a DPC
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+static VOID
+DebuggerDpcQuiesceNonRootTriggers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
 
+/**
+ * @brief Wait for the triggers of vmx non-root (e.g. the detours of the hidden
+ * hooks) that might be walking the retired arrays
+ * @details Should be called in PASSIVE_LEVEL without DebuggerEventsMutex
+ * 
+ * @return UINT64 The arrays that are retired with a smaller NonRootGeneration
+ * are not used by vmx non-root anymore
+ */
+static UINT64
+DebuggerQuiesceNonRootTriggers()
+{
     //
-    // Register the event
+    // The arrays that are retired after the increment might be read after the
+    // DPC of a core, so they wait for the next one
     //
+    UINT64 Generation = InterlockedIncrement64(&DebuggerNonRootGeneration);
+
+    KeGenericCallDpc(DebuggerDpcQuiesceNonRootTriggers, NULL);
 
-    switch (Event->EventType)
+    return Generation;
+}
+
+/**
+ * @brief Free the retired event arrays that no core can still be walking
+ * @details A core might only walk a retired array in vmx-root if it was in
+ * vmx-root when the array was replaced (odd epoch) and it hasn't left that
+ * vm-exit yet (the same epoch), the triggers of vmx non-root are checked by
+ * DebuggerQuiesceNonRootTriggers, should be called with DebuggerEventsMutex held
+ * 
+ * @param QuiescedGeneration Result of DebuggerQuiesceNonRootTriggers (zero if
+ * it's not called, then nothing is freed)
+ * @return VOID 
+ */
+static VOID
+DebuggerReclaimEventArrays(UINT64 QuiescedGeneration)
+{
+    UINT32      ProcessorCount = KeQueryActiveProcessorCount(0);
+    PLIST_ENTRY TempList       = DebuggerRetiredEventArraysHead.Flink;
+
+    while (&DebuggerRetiredEventArraysHead != TempList)
     {
-    case HIDDEN_HOOK_RW:
-        if (Event->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+        PDEBUGGER_RETIRED_EVENT_ARRAY Retired = CONTAINING_RECORD(TempList, DEBUGGER_RETIRED_EVENT_ARRAY, RetiredList);
+        BOOLEAN                       IsInUse = Retired->NonRootGeneration >= QuiescedGeneration;
+
+        TempList = TempList->Flink;
+
+        for (UINT32 i = 0; !IsInUse && i < ProcessorCount; i++)
         {
-            //
-            // We have to apply this Event to all cores
-            //
-            for (size_t i = 0; i < ProcessorCount; i++)
+            if ((Retired->VmexitEpochs[i] & 1) && g_GuestState[i].VmexitEpoch == Retired->VmexitEpochs[i])
             {
-                //
-                // Add it to the list of the events with same type
-                //
-                InsertHeadList(&g_GuestState[i].Events.HiddenHookRwEventsHead, &(Event->EventsOfSameTypeList));
+                IsInUse = TRUE;
+                break;
+            }
+        }
+
+        if (!IsInUse)
+        {
+            RemoveEntryList(&Retired->RetiredList);
+
+            if (Retired->FreeTheEvents)
+            {
+                for (UINT32 i = 0; i < Retired->EventArray->Count; i++)
+                {
+                    DebuggerFreeUnregisteredEvent(Retired->EventArray->Events[i]);
+                }
             }
+
+            ExFreePoolWithTag(Retired->EventArray, POOLTAG);
+            ExFreePoolWithTag(Retired, POOLTAG);
         }
-        else if (Event->CoreId > ProcessorCount) // Check if the core Id is not invalid
+    }
+}
+
+/**
+ * @brief Add an array that is not visible to the cores anymore to the retired arrays
+ * @details Should be called with DebuggerEventsMutex held
+ * 
+ * @param Retired The record of the array (EventArray and FreeTheEvents are set)
+ * @return VOID 
+ */
+static VOID
+DebuggerRetireEventArray(PDEBUGGER_RETIRED_EVENT_ARRAY Retired)
+{
+    UINT32 ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    Retired->NonRootGeneration = DebuggerNonRootGeneration;
+
+    for (UINT32 i = 0; i < ProcessorCount; i++)
+    {
+        Retired->VmexitEpochs[i] = g_GuestState[i].VmexitEpoch;
+    }
+
+    InsertTailList(&DebuggerRetiredEventArraysHead, &Retired->RetiredList);
+}
+
+/**
+ * @brief Publish a new array of the events of a type on a core
+ * @details The vmx-root of the core reads the array pointer once for each
+ * trigger, so the previous array is retired (with the epochs of the cores)
+ * instead of being freed, should be called with DebuggerEventsMutex held
+ * 
+ * @param CoreIndex Index of the core
+ * @param EventType Type of the events
+ * @param EventArray The new array (immutable after this call)
+ * @param Retired The record of the previous array (allocated by the caller)
+ * @return VOID 
+ */
+static VOID
+DebuggerPublishEventArray(UINT32 CoreIndex, DEBUGGER_EVENT_TYPE_ENUM EventType, PDEBUGGER_EVENT_ARRAY EventArray, PDEBUGGER_RETIRED_EVENT_ARRAY Retired)
+{
+    PDEBUGGER_EVENT_ARRAY PreviousArray;
+
+    //
+    // The exchange is a full barrier, so the epochs are read after the new
+    // array is visible to all the cores
+    //
+    PreviousArray = InterlockedExchangePointer((PVOID volatile *)&g_GuestState[CoreIndex].Events.EventsOfType[EventType], EventArray);
+
+    if (!PreviousArray)
+    {
+        ExFreePoolWithTag(Retired, POOLTAG);
+        return;
+    }
+
+    Retired->EventArray    = PreviousArray;
+    Retired->FreeTheEvents = FALSE;
+
+    DebuggerRetireEventArray(Retired);
+}
+
+/**
+ * @brief Register a group of events with one update of the arrays of each
+ * type on each core and one broadcast
+ * @details Either all the events are registered or none of them, the bitmaps
+ * of all the events are rebuilt with one broadcast to the cores of the
+ * events, should be called from vmx non-root in PASSIVE_LEVEL
+ * 
+ * @param Events The events (created by DebuggerCreateEvent)
+ * @param CountOfEvents Count of the events
+ * @return BOOLEAN Whether the events are registered or not
+ */
+BOOLEAN
+DebuggerRegisterEvents(PDEBUGGER_EVENT * Events, UINT32 CountOfEvents)
+{
+    UINT32                          ProcessorCount;
+    UINT32                          CountOfArrays;
+    PDEBUGGER_EVENT_ARRAY *         NewArrays;
+    PDEBUGGER_RETIRED_EVENT_ARRAY * RetiredRecords;
+    PUINT32                         CountOfNewEvents;
+    BOOLEAN                         IsAllocated         = TRUE;
+    BOOLEAN                         MsrEventFound       = FALSE;
+    BOOLEAN                         IoEventFound        = FALSE;
+    BOOLEAN                         ExceptionEventFound = FALSE;
+    BOOLEAN                         SyscallEventFound   = FALSE;
+    BROADCAST_CORE_MASK             CoreMask            = {0};
+    BROADCAST_OPERATION             Operations[4]       = {0};
+    UINT32                          CountOfOperations   = 0;
+    UINT64                          QuiescedGeneration  = 0;
+
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+    CountOfArrays  = ProcessorCount * DEBUGGER_EVENT_TYPES_COUNT;
+
+    if (CountOfEvents == 0)
+    {
+        return FALSE;
+    }
+
+    //
+    // Check the event type and the core id
+    //
+    for (UINT32 i = 0; i < CountOfEvents; i++)
+    {
+        if ((UINT32)Events[i]->EventType >= DEBUGGER_EVENT_TYPES_COUNT)
         {
             //
-            // Add it to the list of the events with same type
+            // Wrong event type
             //
-            InsertHeadList(&g_GuestState[Event->CoreId].Events.HiddenHookRwEventsHead, &(Event->EventsOfSameTypeList));
+            return FALSE;
         }
-        else
+
+        if (Events[i]->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES && Events[i]->CoreId >= ProcessorCount)
         {
             //
             // Invalid core id
             //
             return FALSE;
         }
-        break;
-    case HIDDEN_HOOK_EXEC_DETOUR:
-        if (Event->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+    }
+
+    //
+    // The array of a type on a core is at (Core * DEBUGGER_EVENT_TYPES_COUNT + Type)
+    //
+    NewArrays        = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_EVENT_ARRAY) * CountOfArrays, POOLTAG);
+    RetiredRecords   = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_RETIRED_EVENT_ARRAY) * CountOfArrays, POOLTAG);
+    CountOfNewEvents = ExAllocatePoolWithTag(NonPagedPool, sizeof(UINT32) * CountOfArrays, POOLTAG);
+
+    if (!NewArrays || !RetiredRecords || !CountOfNewEvents)
+    {
+        if (NewArrays)
         {
-            //
-            // We have to apply this Event to all cores
-            //
-            for (size_t i = 0; i < ProcessorCount; i++)
-            {
-                //
-                // Add it to the list of the events with same type
-                //
-                InsertHeadList(&g_GuestState[i].Events.HiddenHooksExecDetourEventsHead, &(Event->EventsOfSameTypeList));
-            }
+            ExFreePoolWithTag(NewArrays, POOLTAG);
         }
-        else if (Event->CoreId > ProcessorCount) // Check if the core Id is not invalid
+
+        if (RetiredRecords)
         {
-            //
-            // Add it to the list of the events with same type
-            //
-            InsertHeadList(&g_GuestState[Event->CoreId].Events.HiddenHooksExecDetourEventsHead, &(Event->EventsOfSameTypeList));
+            ExFreePoolWithTag(RetiredRecords, POOLTAG);
         }
-        else
+
+        if (CountOfNewEvents)
         {
-            //
-            // Invalid core id
-            //
-            return FALSE;
+            ExFreePoolWithTag(CountOfNewEvents, POOLTAG);
         }
-        break;
-    case HIDDEN_HOOK_EXEC_CC:
-        if (Event->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+
+        return FALSE;
+    }
+
+    RtlZeroMemory(NewArrays, sizeof(PDEBUGGER_EVENT_ARRAY) * CountOfArrays);
+    RtlZeroMemory(RetiredRecords, sizeof(PDEBUGGER_RETIRED_EVENT_ARRAY) * CountOfArrays);
+    RtlZeroMemory(CountOfNewEvents, sizeof(UINT32) * CountOfArrays);
+
+    for (UINT32 i = 0; i < CountOfEvents; i++)
+    {
+        for (UINT32 j = 0; j < ProcessorCount; j++)
         {
-            //
-            // We have to apply this Event to all cores
-            //
-            for (size_t i = 0; i < ProcessorCount; i++)
+            if (Events[i]->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES || Events[i]->CoreId == j)
             {
-                //
-                // Add it to the list of the events with same type
-                //
-                InsertHeadList(&g_GuestState[i].Events.HiddenHookExecCcEventsHead, &(Event->EventsOfSameTypeList));
+                CountOfNewEvents[j * DEBUGGER_EVENT_TYPES_COUNT + Events[i]->EventType]++;
             }
         }
-        else if (Event->CoreId > ProcessorCount) // Check if the core Id is not invalid
+    }
+
+    //
+    // The list is read without the mutex, in the worst case the arrays are
+    // freed by the next update
+    //
+    if (!IsListEmpty(&DebuggerRetiredEventArraysHead))
+    {
+        QuiescedGeneration = DebuggerQuiesceNonRootTriggers();
+    }
+
+    ExAcquireFastMutex(&DebuggerEventsMutex);
+
+    //
+    // Free the arrays of the previous updates that are not used anymore
+    //
+    DebuggerReclaimEventArrays(QuiescedGeneration);
+
+    //
+    // Make the new arrays of all the target cores (copy of the current one
+    // plus the events), nothing is published unless all of them are allocated
+    //
+    for (UINT32 i = 0; i < CountOfArrays; i++)
+    {
+        UINT32                   Core = i / DEBUGGER_EVENT_TYPES_COUNT;
+        DEBUGGER_EVENT_TYPE_ENUM Type = i % DEBUGGER_EVENT_TYPES_COUNT;
+        PDEBUGGER_EVENT_ARRAY    CurrentArray;
+        UINT32                   CurrentCount;
+
+        if (CountOfNewEvents[i] == 0)
         {
-            //
-            // Add it to the list of the events with same type
-            //
-            InsertHeadList(&g_GuestState[Event->CoreId].Events.HiddenHookExecCcEventsHead, &(Event->EventsOfSameTypeList));
+            continue;
         }
-        else
+
+        CurrentArray = g_GuestState[Core].Events.EventsOfType[Type];
+        CurrentCount = CurrentArray ? CurrentArray->Count : 0;
+
+        NewArrays[i]      = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_EVENT_ARRAY) + sizeof(PDEBUGGER_EVENT) * (CurrentCount + CountOfNewEvents[i] - 1), POOLTAG);
+        RetiredRecords[i] = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_RETIRED_EVENT_ARRAY) + sizeof(UINT64) * ProcessorCount, POOLTAG);
+
+        if (!NewArrays[i] || !RetiredRecords[i])
         {
-            //
-            // Invalid core id
-            //
-            return FALSE;
+            IsAllocated = FALSE;
+            break;
         }
-        break;
-    case SYSCALL_HOOK_EFER:
-        if (Event->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+
+        if (CurrentArray)
         {
-            //
-            // We have to apply this Event to all cores
-            //
-            for (size_t i = 0; i < ProcessorCount; i++)
+            memcpy(NewArrays[i]->Events, CurrentArray->Events, sizeof(PDEBUGGER_EVENT) * CurrentCount);
+        }
+
+        NewArrays[i]->Count = CurrentCount;
+
+        for (UINT32 j = 0; j < CountOfEvents; j++)
+        {
+            if (Events[j]->EventType == Type && (Events[j]->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES || Events[j]->CoreId == Core))
             {
-                //
-                // Add it to the list of the events with same type
-                //
-                InsertHeadList(&g_GuestState[i].Events.SyscallHooksEferEventsHead, &(Event->EventsOfSameTypeList));
+                NewArrays[i]->Events[NewArrays[i]->Count++] = Events[j];
             }
         }
-        else if (Event->CoreId > ProcessorCount) // Check if the core Id is not invalid
+    }
+
+    for (UINT32 i = 0; i < CountOfArrays; i++)
+    {
+        if (IsAllocated && NewArrays[i])
         {
             //
-            // Add it to the list of the events with same type
+            // Each core has its own array that points to the events (the
+            // events are shared between the cores)
             //
-            InsertHeadList(&g_GuestState[Event->CoreId].Events.SyscallHooksEferEventsHead, &(Event->EventsOfSameTypeList));
+            DebuggerPublishEventArray(i / DEBUGGER_EVENT_TYPES_COUNT, i % DEBUGGER_EVENT_TYPES_COUNT, NewArrays[i], RetiredRecords[i]);
+            continue;
         }
-        else
+
+        if (NewArrays[i])
         {
-            //
-            // Invalid core id
-            //
-            return FALSE;
+            ExFreePoolWithTag(NewArrays[i], POOLTAG);
+        }
+
+        if (RetiredRecords[i])
+        {
+            ExFreePoolWithTag(RetiredRecords[i], POOLTAG);
         }
-        break;
-    default:
-        //
-        // Wrong event type
-        //
-        return FALSE;
-        break;
     }
-}
 
-BOOLEAN
-DebuggerTriggerEvents(DEBUGGER_EVENT_TYPE_ENUM EventType, PGUEST_REGS Regs, PVOID Context)
-{
-    
-    ULONG                       CurrentProcessorIndex;
-    PLIST_ENTRY                 TempList  = 0;
-    PLIST_ENTRY                 TempList2 = 0;
-    DebuggerCheckForCondition * ConditionFunc;
-    //
-    // Check if triggering debugging actions are allowed or not
-    //
-    if (!g_EnableDebuggerEvents)
+    ExReleaseFastMutex(&DebuggerEventsMutex);
+
+    ExFreePoolWithTag(NewArrays, POOLTAG);
+    ExFreePoolWithTag(RetiredRecords, POOLTAG);
+    ExFreePoolWithTag(CountOfNewEvents, POOLTAG);
+
+    if (!IsAllocated)
     {
-        //
-        // Debugger is not enabled
-        //
         return FALSE;
     }
 
-    //
-    // Search for this event in this core (get the core index)
-    //
-    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+    for (UINT32 i = 0; i < CountOfEvents; i++)
+    {
+        DEBUGGER_EVENT_TYPE_ENUM EventType = Events[i]->EventType;
 
-    //
-    // Find the debugger events list base on the type of the event
-    //
+        //
+        // The msr events are only triggered for the MSRs that are set in the
+        // MSR bitmap, so we have to add the new MSRs to the bitmap of the cores,
+        // same for the I/O events and the I/O bitmaps and the #BP and #DB
+        // events and the exception bitmap (and the addresses of the cores)
+        //
+        if (EventType == RDMSR_INSTRUCTION_EXECUTION || EventType == WRMSR_INSTRUCTION_EXECUTION)
+        {
+            MsrEventFound = TRUE;
+        }
+        else if (EventType == IN_INSTRUCTION_EXECUTION || EventType == OUT_INSTRUCTION_EXECUTION)
+        {
+            IoEventFound = TRUE;
+        }
+        else if (EventType == BREAKPOINT_EXCEPTION || EventType == DEBUG_EXCEPTION)
+        {
+            ExceptionEventFound = TRUE;
+        }
+        else if (EventType == SYSCALL_HOOK_EFER)
+        {
+            //
+            // The syscall events are only triggered if the EFER hook is
+            // enabled (enabling it again is harmless)
+            //
+            SyscallEventFound = TRUE;
+        }
+        else
+        {
+            continue;
+        }
 
-    if (EventType == HIDDEN_HOOK_RW)
-    {
-        TempList2 = &g_GuestState[CurrentProcessorIndex].Events.HiddenHookRwEventsHead;
-        TempList  = &g_GuestState[CurrentProcessorIndex].Events.HiddenHookRwEventsHead;
+        BroadcastCoreMaskAdd(&CoreMask, Events[i]->CoreId);
     }
-    else if (EventType == HIDDEN_HOOK_EXEC_DETOUR)
+
+    if (MsrEventFound)
     {
-        TempList2 = &g_GuestState[CurrentProcessorIndex].Events.HiddenHooksExecDetourEventsHead;
-        TempList  = &g_GuestState[CurrentProcessorIndex].Events.HiddenHooksExecDetourEventsHead;
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_MSR_BITMAP;
     }
-    else if (EventType == HIDDEN_HOOK_EXEC_CC)
+
+    if (IoEventFound)
     {
-        TempList2 = &g_GuestState[CurrentProcessorIndex].Events.HiddenHookExecCcEventsHead;
-        TempList  = &g_GuestState[CurrentProcessorIndex].Events.HiddenHookExecCcEventsHead;
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_IO_BITMAP;
     }
-    else if (EventType == SYSCALL_HOOK_EFER)
+
+    if (ExceptionEventFound)
     {
-        TempList2 = &g_GuestState[CurrentProcessorIndex].Events.SyscallHooksEferEventsHead;
-        TempList  = &g_GuestState[CurrentProcessorIndex].Events.SyscallHooksEferEventsHead;
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_EXCEPTION_BITMAP;
     }
-    else
+
+    if (SyscallEventFound)
     {
-        //
-        // Event type is not found
-        //
-        return FALSE;
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_ENABLE_SYSCALL_HOOK_EFER;
     }
 
-    while (TempList2 != TempList->Flink)
+    //
+    // The events are only in the arrays of their cores, so the bitmaps of the
+    // other cores are not changed and they are not interrupted
+    //
+    if (CountOfOperations != 0)
     {
-        TempList                     = TempList->Flink;
-        PDEBUGGER_EVENT CurrentEvent = CONTAINING_RECORD(TempList, DEBUGGER_EVENT, EventsOfSameTypeList);
-        //
-        // check if the event is enabled or not
-        //
-        if (!CurrentEvent->Enabled)
-        {
-            continue;
-        }
+        BroadcastVmcalls(&CoreMask, Operations, CountOfOperations, NULL);
+    }
 
+    return TRUE;
+}
+
+BOOLEAN
+DebuggerRegisterEvent(PDEBUGGER_EVENT Event)
+{
+    return DebuggerRegisterEvents(&Event, 1);
+}
+
+/**
+ * @brief Check the layout and the parameters of an entry of a batch of events
+ * 
+ * @param Entry The entry
+ * @param RemainingSize Size of the buffer from the entry
+ * @param ProcessorCount Count of the cores
+ * @return BOOLEAN Whether the entry is valid or not
+ */
+static BOOLEAN
+DebuggerCheckEventBatchEntry(PDEBUGGER_EVENT_BATCH_ENTRY Entry, UINT32 RemainingSize, UINT32 ProcessorCount)
+{
+    UINT32 Offset;
+
+    if (RemainingSize < sizeof(DEBUGGER_EVENT_BATCH_ENTRY) || Entry->Size < sizeof(DEBUGGER_EVENT_BATCH_ENTRY) ||
+        Entry->Size > RemainingSize || (Entry->Size % DEBUGGER_EVENT_BATCH_ALIGNMENT) != 0)
+    {
+        return FALSE;
+    }
+
+    //
+    // Nothing triggers the read/write and the int 3 hidden hook events yet
+    //
+    if (Entry->EventType >= DEBUGGER_EVENT_TYPES_COUNT || Entry->EventType == HIDDEN_HOOK_RW || Entry->EventType == HIDDEN_HOOK_EXEC_CC)
+    {
+        return FALSE;
+    }
+
+    if (Entry->EventType == HIDDEN_HOOK_EXEC_DETOUR && Entry->OptionalParam1 == NULL)
+    {
+        return FALSE;
+    }
+
+    if (Entry->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES && Entry->CoreId >= ProcessorCount)
+    {
+        return FALSE;
+    }
+
+    if (Entry->ConditionsBufferSize > Entry->Size - sizeof(DEBUGGER_EVENT_BATCH_ENTRY))
+    {
+        return FALSE;
+    }
+
+    Offset = (UINT32)DEBUGGER_EVENT_BATCH_ALIGN(sizeof(DEBUGGER_EVENT_BATCH_ENTRY) + Entry->ConditionsBufferSize);
+
+    for (UINT32 i = 0; i < Entry->CountOfActions; i++)
+    {
+        PDEBUGGER_EVENT_BATCH_ACTION Action = (PDEBUGGER_EVENT_BATCH_ACTION)((UINT64)Entry + Offset);
+
+        if (Offset > Entry->Size || Entry->Size - Offset < sizeof(DEBUGGER_EVENT_BATCH_ACTION) ||
+            Action->Size < sizeof(DEBUGGER_EVENT_BATCH_ACTION) || Action->Size > Entry->Size - Offset ||
+            (Action->Size % DEBUGGER_EVENT_BATCH_ALIGNMENT) != 0 ||
+            Action->CustomCodeBufferSize > Action->Size - sizeof(DEBUGGER_EVENT_BATCH_ACTION))
+        {
+            return FALSE;
+        }
+
+        if (Action->ActionType > RUN_CUSTOM_CODE ||
+            (Action->ActionType == RUN_CUSTOM_CODE && (Action->CustomCodeBufferSize == 0 || Action->OptionalRequestedBufferSize >= MaximumPacketsCapacity)))
+        {
+            return FALSE;
+        }
+
+        Offset += Action->Size;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Apply the detour hooks of the HIDDEN_HOOK_EXEC_DETOUR events of a
+ * batch with one EptPageHookBatch
+ * @details The functions that are already detoured (by the previous events)
+ * are not hooked again, the events of the functions that are not hooked are
+ * freed and removed from the array
+ * 
+ * @param Events The created events of the batch
+ * @param Entries The entry of each event
+ * @param CountOfEvents Count of the events (updated)
+ * @return VOID 
+ */
+static VOID
+DebuggerApplyEventBatchHooks(PDEBUGGER_EVENT * Events, PDEBUGGER_EVENT_BATCH_ENTRY * Entries, PUINT32 CountOfEvents)
+{
+    PEPT_HOOK_BATCH_ENTRY HookEntries;
+    PUINT64               Trampolines;
+    UINT32                CountOfHooks = 0;
+    UINT32                CountOfKept  = 0;
+
+    HookEntries = ExAllocatePoolWithTag(NonPagedPool, sizeof(EPT_HOOK_BATCH_ENTRY) * *CountOfEvents, POOLTAG);
+    Trampolines = ExAllocatePoolWithTag(NonPagedPool, sizeof(UINT64) * *CountOfEvents, POOLTAG);
+
+    if (HookEntries && Trampolines)
+    {
+        RtlZeroMemory(HookEntries, sizeof(EPT_HOOK_BATCH_ENTRY) * *CountOfEvents);
+
+        for (UINT32 i = 0; i < *CountOfEvents; i++)
+        {
+            BOOLEAN     IsHooked = FALSE;
+            PLIST_ENTRY TempList = &g_HiddenHooksDetourListHead;
+
+            if (Events[i]->EventType != HIDDEN_HOOK_EXEC_DETOUR)
+            {
+                continue;
+            }
+
+            while (&g_HiddenHooksDetourListHead != TempList->Flink)
+            {
+                TempList = TempList->Flink;
+
+                if (CONTAINING_RECORD(TempList, HIDDEN_HOOKS_DETOUR_DETAILS, OtherHooksList)->HookedFunctionAddress == Events[i]->OptionalParam1)
+                {
+                    IsHooked = TRUE;
+                    break;
+                }
+            }
+
+            for (UINT32 j = 0; j < CountOfHooks && !IsHooked; j++)
+            {
+                IsHooked = HookEntries[j].Address == Events[i]->OptionalParam1;
+            }
+
+            if (IsHooked)
+            {
+                continue;
+            }
+
+            HookEntries[CountOfHooks].Address      = Events[i]->OptionalParam1;
+            HookEntries[CountOfHooks].HookFunction = (UINT64)AsmGeneralDetourHook;
+            HookEntries[CountOfHooks].OrigFunction = (UINT64)&Trampolines[CountOfHooks];
+            HookEntries[CountOfHooks].Attributes   = EPT_HOOK_BATCH_ATTRIB_EXEC;
+            CountOfHooks++;
+        }
+
+        if (CountOfHooks != 0)
+        {
+            EptPageHookBatch(HookEntries, CountOfHooks);
+        }
+    }
+
+    for (UINT32 i = 0; i < *CountOfEvents; i++)
+    {
+        NTSTATUS Status = STATUS_SUCCESS;
+
+        if (Events[i]->EventType == HIDDEN_HOOK_EXEC_DETOUR)
+        {
+            if (!HookEntries || !Trampolines)
+            {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            for (UINT32 j = 0; j < CountOfHooks; j++)
+            {
+                if (HookEntries[j].Address == Events[i]->OptionalParam1)
+                {
+                    Status = HookEntries[j].Status;
+                    break;
+                }
+            }
+        }
+
+        if (Status != STATUS_SUCCESS)
+        {
+            Entries[i]->Status = Status;
+            DebuggerFreeUnregisteredEvent(Events[i]);
+            continue;
+        }
+
+        Events[CountOfKept]  = Events[i];
+        Entries[CountOfKept] = Entries[i];
+        CountOfKept++;
+    }
+
+    *CountOfEvents = CountOfKept;
+
+    if (HookEntries)
+    {
+        ExFreePoolWithTag(HookEntries, POOLTAG);
+    }
+
+    if (Trampolines)
+    {
+        ExFreePoolWithTag(Trampolines, POOLTAG);
+    }
+}
+
+/**
+ * @brief Create and register a batch of events (IOCTL_REGISTER_EVENT_BATCH)
+ * @details All the entries are checked before creating any event, the detour
+ * hooks of the batch are applied with EptPageHookBatch and all the events are
+ * registered with DebuggerRegisterEvents (one broadcast), an event is only
+ * dropped if its hook is not applied (its Status)
+ * 
+ * @param Request The request and the entries
+ * @param BufferLength Size of the input buffer
+ * @return NTSTATUS 
+ */
+NTSTATUS
+DebuggerRegisterEventBatch(PDEBUGGER_EVENT_BATCH_REQUEST Request, UINT32 BufferLength)
+{
+    UINT32                        ProcessorCount = KeQueryActiveProcessorCount(0);
+    PDEBUGGER_EVENT *             Events;
+    PDEBUGGER_EVENT_BATCH_ENTRY * Entries;
+    UINT32                        CountOfEvents = 0;
+    UINT32                        Offset;
+    NTSTATUS                      Status = STATUS_SUCCESS;
+
+    Request->CountOfRegistered = 0;
+    Request->FailedEventIndex  = DEBUGGER_EVENT_BATCH_NO_FAILED_EVENT;
+
+    if (Request->CountOfEvents == 0 || Request->CountOfEvents > DEBUGGER_EVENT_BATCH_MAXIMUM_EVENTS ||
+        Request->BufferSize < sizeof(DEBUGGER_EVENT_BATCH_REQUEST) || Request->BufferSize > BufferLength)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Events  = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_EVENT) * Request->CountOfEvents, POOLTAG);
+    Entries = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_EVENT_BATCH_ENTRY) * Request->CountOfEvents, POOLTAG);
+
+    if (!Events || !Entries)
+    {
+        if (Events)
+        {
+            ExFreePoolWithTag(Events, POOLTAG);
+        }
+
+        if (Entries)
+        {
+            ExFreePoolWithTag(Entries, POOLTAG);
+        }
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Check all the entries first, so an invalid entry doesn't leave the
+    // previous ones registered
+    //
+    Offset = sizeof(DEBUGGER_EVENT_BATCH_REQUEST);
+
+    for (UINT32 i = 0; i < Request->CountOfEvents; i++)
+    {
+        Entries[i] = (PDEBUGGER_EVENT_BATCH_ENTRY)((UINT64)Request + Offset);
+
+        if (!DebuggerCheckEventBatchEntry(Entries[i], Request->BufferSize - Offset, ProcessorCount))
+        {
+            Request->FailedEventIndex = i;
+            Status                    = STATUS_INVALID_PARAMETER;
+            goto Cleanup;
+        }
+
+        Entries[i]->Status = STATUS_PENDING;
+        Offset += Entries[i]->Size;
+    }
+
+    //
+    // Create the events and their actions, nothing is published yet
+    //
+    for (UINT32 i = 0; i < Request->CountOfEvents; i++)
+    {
+        PDEBUGGER_EVENT_BATCH_ENTRY Entry = Entries[i];
+        PDEBUGGER_EVENT             Event;
+        BOOLEAN                     IsCreated;
+
+        Offset = (UINT32)DEBUGGER_EVENT_BATCH_ALIGN(sizeof(DEBUGGER_EVENT_BATCH_ENTRY) + Entry->ConditionsBufferSize);
+
+        Event = DebuggerCreateEvent(Entry->Enabled,
+                                    Entry->CoreId,
+                                    Entry->EventType,
+                                    Entry->Tag,
+                                    Entry->ConditionsBufferSize,
+                                    Entry->ConditionsBufferSize != 0 ? (PVOID)((UINT64)Entry + sizeof(DEBUGGER_EVENT_BATCH_ENTRY)) : NULL);
+
+        if (!Event)
+        {
+            Request->FailedEventIndex = i;
+            Status                    = STATUS_INSUFFICIENT_RESOURCES;
+            goto Cleanup;
+        }
+
+        Events[CountOfEvents++] = Event;
+        Event->OptionalParam1   = Entry->OptionalParam1;
+
+        IsCreated = (Entry->Filter.Flags == 0 || DebuggerSetEventFilter(Event, &Entry->Filter)) &&
+                    DebuggerSetEventRateLimit(Event, Entry->SampleRate, Entry->HitsPerSecond, Entry->Burst);
+
+        for (UINT32 j = 0; j < Entry->CountOfActions && IsCreated; j++)
+        {
+            PDEBUGGER_EVENT_BATCH_ACTION       Action     = (PDEBUGGER_EVENT_BATCH_ACTION)((UINT64)Entry + Offset);
+            DEBUGGER_EVENT_REQUEST_CUSTOM_CODE CustomCode = {0};
+
+            CustomCode.CustomCodeBufferSize        = Action->CustomCodeBufferSize;
+            CustomCode.CustomCodeBufferAddress     = (PVOID)((UINT64)Action + sizeof(DEBUGGER_EVENT_BATCH_ACTION));
+            CustomCode.OptionalRequestedBufferSize = Action->OptionalRequestedBufferSize;
+
+            IsCreated = DebuggerAddActionToEvent(Event,
+                                                 Action->ActionType,
+                                                 Action->ImmediatelySendTheResults,
+                                                 Action->ActionType == RUN_CUSTOM_CODE ? &CustomCode : NULL,
+                                                 Action->ActionType == LOG_THE_STATES ? &Action->LogConfiguration : NULL);
+
+            Offset += Action->Size;
+        }
+
+        if (!IsCreated)
+        {
+            Request->FailedEventIndex = i;
+            Status                    = STATUS_INVALID_PARAMETER;
+            goto Cleanup;
+        }
+    }
+
+    DebuggerApplyEventBatchHooks(Events, Entries, &CountOfEvents);
+
+    if (CountOfEvents != 0 && !DebuggerRegisterEvents(Events, CountOfEvents))
+    {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    for (UINT32 i = 0; i < CountOfEvents; i++)
+    {
+        Entries[i]->Status = STATUS_SUCCESS;
+    }
+
+    Request->CountOfRegistered = CountOfEvents;
+    CountOfEvents              = 0;
+
+Cleanup:
+
+    for (UINT32 i = 0; i < CountOfEvents; i++)
+    {
+        DebuggerFreeUnregisteredEvent(Events[i]);
+    }
+
+    ExFreePoolWithTag(Events, POOLTAG);
+    ExFreePoolWithTag(Entries, POOLTAG);
+
+    return Status;
+}
+
+/**
+ * @brief Set the declarative filter of an event
+ * @details Should be called before registering the event
+ * 
+ * @param Event The event
+ * @param Filter The filter
+ * @return BOOLEAN Whether the filter is valid or not
+ */
+BOOLEAN
+DebuggerSetEventFilter(PDEBUGGER_EVENT Event, PDEBUGGER_EVENT_FILTER Filter)
+{
+    if ((Filter->Flags & DEBUGGER_EVENT_FILTER_RIP_RANGE) && Filter->RipStart >= Filter->RipEnd)
+    {
+        return FALSE;
+    }
+
+    if (Filter->Flags & DEBUGGER_EVENT_FILTER_REGISTERS)
+    {
+        if (Filter->CountOfRegisterFilters == 0 || Filter->CountOfRegisterFilters > DEBUGGER_EVENT_FILTER_MAXIMUM_REGISTERS)
+        {
+            return FALSE;
+        }
+
+        for (UINT32 i = 0; i < Filter->CountOfRegisterFilters; i++)
+        {
+            UINT32 Register = Filter->RegisterFilters[i].Register;
+
+            //
+            // Each comparison is for exactly one register
+            //
+            if (Register == 0 || (Register & (Register - 1)) != 0 || Register > GUEST_GP_REG_RFLAGS)
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    Event->Filter = *Filter;
+
+    return TRUE;
+}
+
+/**
+ * @brief Set the sampling and the rate limit of an event
+ * @details Should be called before registering the event
+ * 
+ * @param Event The event
+ * @param SampleRate Trigger one of each SampleRate hits (zero or one means all the hits)
+ * @param HitsPerSecond Hits per second of each core (zero means no rate limit)
+ * @param Burst Hits of each core that are allowed at once (zero means one)
+ * @return BOOLEAN Whether the rate limit is valid or not
+ */
+BOOLEAN
+DebuggerSetEventRateLimit(PDEBUGGER_EVENT Event, UINT32 SampleRate, UINT32 HitsPerSecond, UINT32 Burst)
+{
+    //
+    // A token is at least one cycle
+    //
+    if (HitsPerSecond > LogTimeStampCounterFrequency)
+    {
+        return FALSE;
+    }
+
+    Event->RateLimit.SampleRate     = SampleRate;
+    Event->RateLimit.HitsPerSecond  = HitsPerSecond;
+    Event->RateLimit.Burst          = Burst != 0 ? Burst : 1;
+    Event->RateLimit.CyclesPerToken = HitsPerSecond != 0 ? LogTimeStampCounterFrequency / HitsPerSecond : 0;
+
+    return TRUE;
+}
+
+/**
+ * @brief Check the sampling and the token bucket of an event on the current core
+ * @details Should be called in vmx-root, the state is in the counters of the
+ * current core so nothing is shared with the other cores
+ * 
+ * @param RateLimit The rate limit of the event
+ * @param Statistics The counters of the event on the current core
+ * @return BOOLEAN Whether the hit should be triggered or suppressed
+ */
+static BOOLEAN
+DebuggerCheckEventRateLimit(PDEBUGGER_EVENT_RATE_LIMIT RateLimit, PDEBUGGER_EVENT_STATISTICS Statistics)
+{
+    UINT64 Now;
+    UINT64 NewTokens;
+
+    if (RateLimit->SampleRate > 1)
+    {
+        if (++Statistics->SampleCounter < RateLimit->SampleRate)
+        {
+            return FALSE;
+        }
+
+        Statistics->SampleCounter = 0;
+    }
+
+    if (RateLimit->HitsPerSecond == 0)
+    {
+        return TRUE;
+    }
+
+    //
+    // Refill the bucket with the tokens of the elapsed time, the division is
+    // only needed if at least one token is elapsed
+    //
+    if (Statistics->Tokens < RateLimit->Burst)
+    {
+        Now = __rdtsc();
+
+        if (Now - Statistics->LastRefillTime >= RateLimit->CyclesPerToken)
+        {
+            NewTokens = (Now - Statistics->LastRefillTime) / RateLimit->CyclesPerToken;
+
+            if (NewTokens >= RateLimit->Burst - Statistics->Tokens)
+            {
+                Statistics->Tokens         = RateLimit->Burst;
+                Statistics->LastRefillTime = Now;
+            }
+            else
+            {
+                Statistics->Tokens += (UINT32)NewTokens;
+                Statistics->LastRefillTime += NewTokens * RateLimit->CyclesPerToken;
+            }
+        }
+    }
+
+    if (Statistics->Tokens == 0)
+    {
+        return FALSE;
+    }
+
+    Statistics->Tokens--;
+
+    return TRUE;
+}
+
+/**
+ * @brief Read a register of the guest for the filters
+ * 
+ * @param Regs Guest registers
+ * @param Register One of the GUEST_GP_REG_* bits
+ * @return UINT64 
+ */
+static UINT64
+DebuggerReadFilterRegister(PGUEST_REGS Regs, UINT32 Register)
+{
+    ULONG Index;
+
+    if (Register == GUEST_GP_REG_RSP)
+    {
+        return HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RSP);
+    }
+
+    if (Register == GUEST_GP_REG_RFLAGS)
+    {
+        return HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS);
+    }
+
+    //
+    // The bits of the other registers are in the order of GUEST_REGS
+    //
+    _BitScanForward(&Index, Register);
+
+    return ((PUINT64)Regs)[Index];
+}
+
+/**
+ * @brief Check the declarative filter of an event
+ * @details Should be called in vmx-root, the cheaper checks are first
+ * 
+ * @param Filter The filter of the event
+ * @param CoreIndex Index of the current core
+ * @param Regs Guest registers
+ * @return BOOLEAN Whether the event should be triggered or not
+ */
+static BOOLEAN
+DebuggerCheckEventFilter(PDEBUGGER_EVENT_FILTER Filter, ULONG CoreIndex, PGUEST_REGS Regs)
+{
+    UINT64 Cr3;
+    UINT64 GuestRip;
+
+    if ((Filter->Flags & DEBUGGER_EVENT_FILTER_CORE_MASK) &&
+        (CoreIndex >= 64 || !(Filter->CoreMask & (1ULL << CoreIndex))))
+    {
+        return FALSE;
+    }
+
+    if ((Filter->Flags & DEBUGGER_EVENT_FILTER_PROCESS_ID) &&
+        (UINT32)(UINT64)PsGetCurrentProcessId() != Filter->ProcessId)
+    {
+        return FALSE;
+    }
+
+    if (Filter->Flags & DEBUGGER_EVENT_FILTER_CR3)
+    {
+        __vmx_vmread(GUEST_CR3, &Cr3);
+
+        if (Cr3 != Filter->Cr3)
+        {
+            return FALSE;
+        }
+    }
+
+    if (Filter->Flags & DEBUGGER_EVENT_FILTER_RIP_RANGE)
+    {
+        GuestRip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+
+        if (GuestRip < Filter->RipStart || GuestRip >= Filter->RipEnd)
+        {
+            return FALSE;
+        }
+    }
+
+    if (Filter->Flags & DEBUGGER_EVENT_FILTER_REGISTERS)
+    {
+        for (UINT32 i = 0; i < Filter->CountOfRegisterFilters; i++)
+        {
+            PDEBUGGER_EVENT_REGISTER_FILTER RegisterFilter = &Filter->RegisterFilters[i];
+            UINT64                          Value          = DebuggerReadFilterRegister(Regs, RegisterFilter->Register) & RegisterFilter->Mask;
+
+            if (Value < RegisterFilter->Minimum || Value > RegisterFilter->Maximum)
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Trigger the events of a type on the current core
+ * @details The caller makes sure that the core is not changed and the arrays
+ * are not freed while they're walked (see DebuggerTriggerEvents)
+ * 
+ * @param EventType Type of the events
+ * @param Regs Guest registers
+ * @param Context Context of the events (depends on the type)
+ * @return BOOLEAN Returns false if the debugger events are not enabled
+ */
+static BOOLEAN
+DebuggerTriggerEventsOfCore(DEBUGGER_EVENT_TYPE_ENUM EventType, PGUEST_REGS Regs, PVOID Context)
+{
+    ULONG                       CurrentProcessorIndex;
+    PDEBUGGER_EVENT_ARRAY       EventArray;
+    PDEBUGGER_EVENT_STATISTICS  Statistics;
+    DebuggerCheckForCondition * ConditionFunc;
+    UINT64                      StartTime;
+    UINT64                      ConditionResult;
+
+    //
+    // Check if triggering debugging actions are allowed or not
+    //
+    if (!g_EnableDebuggerEvents)
+    {
+        //
+        // Debugger is not enabled
+        //
+        return FALSE;
+    }
+
+    if ((UINT32)EventType >= DEBUGGER_EVENT_TYPES_COUNT)
+    {
+        //
+        // Event type is not found
+        //
+        return FALSE;
+    }
+
+    //
+    // Search for this event in this core (get the core index), the array is
+    // read once as the updates publish new arrays instead of changing it
+    //
+    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+    EventArray            = g_GuestState[CurrentProcessorIndex].Events.EventsOfType[EventType];
+
+    if (!EventArray)
+    {
+        //
+        // There is no event of this type on this core
+        //
+        return TRUE;
+    }
+
+    for (UINT32 i = 0; i < EventArray->Count; i++)
+    {
+        PDEBUGGER_EVENT CurrentEvent = EventArray->Events[i];
+
+        //
+        // check if the event is enabled or not
+        //
+        if (!CurrentEvent->Enabled)
+        {
+            continue;
+        }
+
+        //
+        // For the msr events, the context is the MSR index and the event
+        // might be only for one MSR (the others are in the bitmap because
+        // of other events or the hypervisor itself)
+        //
+        if ((EventType == RDMSR_INSTRUCTION_EXECUTION || EventType == WRMSR_INSTRUCTION_EXECUTION) &&
+            CurrentEvent->OptionalParam1 != DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS &&
+            CurrentEvent->OptionalParam1 != (UINT64)Context)
+        {
+            continue;
+        }
+
+        //
+        // For the I/O events, the context is the port
+        //
+        if ((EventType == IN_INSTRUCTION_EXECUTION || EventType == OUT_INSTRUCTION_EXECUTION) &&
+            CurrentEvent->OptionalParam1 != DEBUGGER_EVENT_ALL_IO_PORTS &&
+            CurrentEvent->OptionalParam1 != (UINT64)Context)
+        {
+            continue;
+        }
+
+        //
+        // For the #BP and #DB events, the context is the guest RIP
+        //
+        if ((EventType == BREAKPOINT_EXCEPTION || EventType == DEBUG_EXCEPTION) &&
+            CurrentEvent->OptionalParam1 != DEBUGGER_EVENT_ALL_ADDRESSES &&
+            CurrentEvent->OptionalParam1 != (UINT64)Context)
+        {
+            continue;
+        }
+
+        //
+        // Check the declarative filter before calling the condition code,
+        // most of the events are rejected here
+        //
+        if (CurrentEvent->Filter.Flags != 0 && !DebuggerCheckEventFilter(&CurrentEvent->Filter, CurrentProcessorIndex, Regs))
+        {
+            continue;
+        }
+
+        Statistics = &CurrentEvent->Statistics[CurrentProcessorIndex];
+        Statistics->Hits++;
+
+        //
+        // Check the sampling and the rate limit of this core, the suppressed
+        // hits are reported in the next record of the event
+        //
+        if ((CurrentEvent->RateLimit.SampleRate > 1 || CurrentEvent->RateLimit.HitsPerSecond != 0) &&
+            !DebuggerCheckEventRateLimit(&CurrentEvent->RateLimit, Statistics))
+        {
+            Statistics->SuppressedHits++;
+            continue;
+        }
+
+        //
+        // Check if condtion is met or not , if the condition
+        // is not met then we have to avoid performing the actions
+        //
+        if (CurrentEvent->ConditionsBufferSize != 0)
+        {
+            //
+            // Means that there is some conditions
+            //
+            ConditionFunc = CurrentEvent->ConditionBufferAddress;
+
+            //
+            // Run and check for results
+            //
+            StartTime       = __rdtsc();
+            ConditionResult = ConditionFunc();
+            Statistics->ConditionCycles += __rdtsc() - StartTime;
+
+            if (ConditionResult == 0)
+            {
+                //
+                // The condition function returns null, mean that the
+                // condition didn't met, we can ignore this event
+                //
+                Statistics->ConditionRejections++;
+                continue;
+            }
+        }
+
+        //
+        // perform the actions
+        //
+        DebuggerPerformActions(CurrentEvent, Regs, Context);
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Trigger the events of a type on the current core
+ * @details In vmx non-root (e.g. the detours of the hidden hooks) the IRQL is
+ * raised to DISPATCH_LEVEL, so the thread stays on the core and the retired
+ * arrays are not freed until the trigger is finished (DebuggerQuiesceNonRootTriggers)
+ * 
+ * @param EventType Type of the events
+ * @param Regs Guest registers
+ * @param Context Context of the events (depends on the type)
+ * @return BOOLEAN Returns false if the debugger events are not enabled
+ */
+BOOLEAN
+DebuggerTriggerEvents(DEBUGGER_EVENT_TYPE_ENUM EventType, PGUEST_REGS Regs, PVOID Context)
+{
+    KIRQL   OldIrql;
+    BOOLEAN Result;
+    BOOLEAN IsIrqlRaised = FALSE;
+
+    if (!g_GuestState[KeGetCurrentProcessorNumber()].IsOnVmxRootMode && KeGetCurrentIrql() < DISPATCH_LEVEL)
+    {
+        KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+        IsIrqlRaised = TRUE;
+    }
+
+    Result = DebuggerTriggerEventsOfCore(EventType, Regs, Context);
+
+    if (IsIrqlRaised)
+    {
+        KeLowerIrql(OldIrql);
+    }
+
+    return Result;
+}
+
+VOID
+DebuggerPerformActions(PDEBUGGER_EVENT Event, PGUEST_REGS Regs, PVOID Context)
+{
+    PLIST_ENTRY                TempList   = 0;
+    PDEBUGGER_EVENT_STATISTICS Statistics = &Event->Statistics[KeGetCurrentProcessorNumber()];
+    UINT64                     StartTime;
+
+    //
+    // Find and run all the actions in this Event
+    //
+
+    TempList = &Event->ActionsListHead;
+    while (&Event->ActionsListHead != TempList->Flink)
+    {
+        TempList                             = TempList->Flink;
+        PDEBUGGER_EVENT_ACTION CurrentAction = CONTAINING_RECORD(TempList, DEBUGGER_EVENT_ACTION, ActionsList);
+
+        //
+        // Perform the action
+        //
+        StartTime = __rdtsc();
+
+        switch (CurrentAction->ActionType)
+        {
+        case BREAK_TO_DEBUGGER:
+            DebuggerPerformBreakToDebugger(Event->Tag, CurrentAction, Regs, Context);
+            break;
+        case LOG_THE_STATES:
+            DebuggerPerformLogTheStates(Event->Tag, CurrentAction, Regs, Context, &Statistics->SuppressedHits);
+            break;
+        case RUN_CUSTOM_CODE:
+            DebuggerPerformRunTheCustomCode(Event->Tag, CurrentAction, Regs, Context);
+            break;
+        default:
+            //
+            // Invalid action type
+            //
+            break;
+        }
+
+        Statistics->ActionsRun++;
+        Statistics->ActionCycles += __rdtsc() - StartTime;
+    }
+}
+
+/**
+ * @brief Find and copy the memory of a log the states action
+ * @details Should be called in vmx-root, the pointer and the memory are read
+ * by the page tables of the guest (GUEST_CR3) so an address that is not
+ * present only makes the memory of the record empty
+ * 
+ * @param LogConfiguration The configuration of the action
+ * @param Regs Guest registers
+ * @param Record The record (its Address and MemoryLength are filled)
+ * @param Memory The buffer of the memory (at least LogLength bytes)
+ * @return VOID
+ */
+static VOID
+DebuggerLogTheStatesReadMemory(PDEBUGGER_EVENT_ACTION_LOG_CONFIGURATION LogConfiguration, PGUEST_REGS Regs, PDEBUGGER_LOG_STATES_RECORD Record, PVOID Memory)
+{
+    UINT64  GuestCr3;
+    UINT64  Address   = 0;
+    UINT64  Pointer   = 0;
+    BOOLEAN IsPointer = TRUE;
+
+    __vmx_vmread(GUEST_CR3, &GuestCr3);
+
+    switch (LogConfiguration->LogType)
+    {
+    case GUEST_LOG_READ_STATIC_MEMORY_ADDRESS:
+        Address   = LogConfiguration->LogValue;
+        IsPointer = FALSE;
+        break;
+
+    case GUEST_LOG_READ_POI_REGISTER_PLUS_VALUE:
+        Pointer = DebuggerReadFilterRegister(Regs, (UINT32)LogConfiguration->LogMask) + LogConfiguration->LogValue;
+        break;
+
+    case GUEST_LOG_READ_POI_REGISTER_MINUS_VALUE:
+        Pointer = DebuggerReadFilterRegister(Regs, (UINT32)LogConfiguration->LogMask) - LogConfiguration->LogValue;
+        break;
+
+    default:
+        //
+        // poi(register), with or without the value
+        //
+        Pointer = DebuggerReadFilterRegister(Regs, (UINT32)LogConfiguration->LogMask);
+        break;
+    }
+
+    if (IsPointer)
+    {
+        if (!ReadGuestVirtualMemory(GuestCr3, Pointer, &Address, sizeof(UINT64)))
+        {
+            return;
+        }
+
+        if (LogConfiguration->LogType == GUEST_LOG_READ_POI_REGISTER_ADD_VALUE)
+        {
+            Address += LogConfiguration->LogValue;
+        }
+        else if (LogConfiguration->LogType == GUEST_LOG_READ_POI_REGISTER_SUBTRACT_VALUE)
+        {
+            Address -= LogConfiguration->LogValue;
+        }
+    }
+
+    Record->Address = Address;
+
+    if (ReadGuestVirtualMemory(GuestCr3, Address, Memory, LogConfiguration->LogLength))
+    {
+        Record->MemoryLength = LogConfiguration->LogLength;
+    }
+}
+
+/**
+ * @brief Perform the log the states action
+ * @details Should be called in vmx-root, a fixed-layout record is built on the
+ * stack and sent to the ring of the core, formatting is done in user-mode
+ * 
+ * @param Tag Tag of the event
+ * @param Action The action
+ * @param Regs Guest registers
+ * @param Context Optional parameter of the event
+ * @param SuppressedHits Suppressed hits of the event on the current core (cleared
+ * if the record is sent)
+ * @return VOID
+ */
+VOID
+DebuggerPerformLogTheStates(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context, PUINT64 SuppressedHits)
+{
+    UINT64                      Buffer[(sizeof(DEBUGGER_LOG_STATES_RECORD) + DEBUGGER_LOG_STATES_MAXIMUM_MEMORY) / sizeof(UINT64) + 17];
+    PDEBUGGER_LOG_STATES_RECORD Record = (PDEBUGGER_LOG_STATES_RECORD)Buffer;
+    PUINT64                     Values = (PUINT64)((UINT64)Buffer + sizeof(DEBUGGER_LOG_STATES_RECORD));
+    UINT32                      Mask;
+    ULONG                       Index;
+
+    RtlZeroMemory(Record, sizeof(DEBUGGER_LOG_STATES_RECORD));
+
+    Record->Tag              = Tag;
+    Record->TimeStampCounter = __rdtsc();
+    Record->GuestRip         = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+    Record->ActionOrderCode  = Action->ActionOrderCode;
+    Record->CoreId           = (UINT16)KeGetCurrentProcessorNumber();
+    Record->SuppressedHits   = *SuppressedHits;
+
+    if (Action->LogConfiguration.LogType == GUEST_LOG_READ_GENERAL_PURPOSE_REGISTERS)
+    {
+        //
+        // Only the selected registers are copied, in the order of their bits
+        //
+        Record->RegisterMask = (UINT32)Action->LogConfiguration.LogMask & (GUEST_GP_REG_RFLAGS | (GUEST_GP_REG_RFLAGS - 1));
+
+        for (Mask = Record->RegisterMask; _BitScanForward(&Index, Mask); Mask &= Mask - 1)
+        {
+            *Values++ = DebuggerReadFilterRegister(Regs, 1 << Index);
+        }
+    }
+    else if (Action->LogConfiguration.LogType <= GUEST_LOG_READ_POI_REGISTER_MINUS_VALUE)
+    {
+        Record->IsMemoryRequested = TRUE;
+
+        if (Action->LogConfiguration.LogLength != 0)
+        {
+            DebuggerLogTheStatesReadMemory(&Action->LogConfiguration, Regs, Record, Values);
+        }
+    }
+    else
+    {
+        //
+        // The pseudo-registers are not supported yet
+        //
+        return;
+    }
+
+    if (LogSendBuffer(OPERATION_LOG_STATES, Record, (UINT32)((UINT64)Values - (UINT64)Buffer) + Record->MemoryLength))
+    {
+        *SuppressedHits = 0;
+    }
+}
+
+VOID
+DebuggerPerformBreakToDebugger(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context)
+{
+    DbgBreakPoint();
+}
+VOID
+DebuggerPerformRunTheCustomCode(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context)
+{
+    PVOID                                             ReturnBufferToUsermodeAddress = 0;
+    DebuggerRunCustomCodeFunc *                       Func;
+    DebuggerRunCustomCodeWithPreAllocatedBufferFunc * FuncWithPreAllocBuffer;
+
+    if (Action->CustomCodeBufferSize == 0)
+    {
+        //
+        // Sth went wrong ! the buffer size for custom code shouldn't be zero
+        //
+        return;
+    }
+
+    //
+    // Run the custom code
+    //
+    if (Action->RequestedBuffer.RequestBufferSize == 0)
+    {
         //
-        // Check if condtion is met or not , if the condition
-        // is not met then we have to avoid performing the actions
-        //
-        if (CurrentEvent->ConditionsBufferSize != 0)
+        // Means that this custom code doesn't requested a pre-allocated buffer
+        //
+        Func = (DebuggerRunCustomCodeFunc *)Action->CustomCodeBufferAddress;
+
+        //
+        // Execute the code
+        //
+        ReturnBufferToUsermodeAddress = Func();
+    }
+    else
+    {
+        //
+        // Means that this custom code doesn't requested a pre-allocated buffer
+        //
+        FuncWithPreAllocBuffer = (DebuggerRunCustomCodeWithPreAllocatedBufferFunc *)Action->CustomCodeBufferAddress;
+
+        //
+        // Execute the code (with requested buffer parameter)
+        //
+        ReturnBufferToUsermodeAddress = FuncWithPreAllocBuffer(Action->RequestedBuffer.RequstBufferAddress);
+    }
+
+    //
+    // Check if we need to send the buffer to the usermode or not we only send
+    // buffer in usermode if the user requested a pre allocated buffer and
+    //return its address (in RAX), it's obvious the user might request a buffer
+    // and at last return another address (which is not the address of pre]
+    // allocated buffer), no matter, we send the user specific buffer with the
+    // size of the request for pre allocated buffer
+    //
+    if (ReturnBufferToUsermodeAddress != 0 && Action->RequestedBuffer.RequestBufferSize != 0)
+    {
+        //
+        // Send the buffer to the usermode
+        //
+
+        //
+        // check if buffer is valid or not, actually MS recommends not to use
+        // MmIsAddressValid, but we're not doing anything fancy here just wanna
+        // see if it's a valid address or not, because if this routine return
+        // null then it means that we didn't find a valid physical address for
+        // it, so if the programmer unintentionally forget to zero RAX, we can
+        // avoid doing sth bad here. (This function uses MmGetPhysicalAddress)
+        //
+        if (VirtualAddressToPhysicalAddress(ReturnBufferToUsermodeAddress) != 0)
+        {
+            //
+            // Address is valid, let send it with specific tag
+            //
+            LogSendBuffer(Tag, ReturnBufferToUsermodeAddress, Action->RequestedBuffer.RequestBufferSize);
+        }
+    }
+}
+
+/**
+ * @brief Remove the events of a tag from the arrays of all the cores
+ * @details The arrays without the events are published and the events (and
+ * their actions) are freed with the replaced arrays when no core is using
+ * them, the msr, I/O and exception bitmaps of the cores are updated with
+ * one broadcast, the hooks of the events are not removed, should be called
+ * from vmx non-root in PASSIVE_LEVEL
+ * 
+ * @param Tag Tag of the events
+ * @return BOOLEAN Whether any event is unregistered or not
+ */
+BOOLEAN
+DebuggerUnregisterEvent(UINT64 Tag)
+{
+    UINT32                          ProcessorCount;
+    UINT32                          CountOfArrays;
+    PDEBUGGER_EVENT_ARRAY *         NewArrays;
+    PDEBUGGER_RETIRED_EVENT_ARRAY * RetiredRecords;
+    PDEBUGGER_RETIRED_EVENT_ARRAY   RemovedEvents       = NULL;
+    PDEBUGGER_EVENT_ARRAY           RemovedEventsArray  = NULL;
+    UINT32                          CountOfMatches      = 0;
+    BOOLEAN                         IsAllocated         = TRUE;
+    BOOLEAN                         MsrEventFound       = FALSE;
+    BOOLEAN                         IoEventFound        = FALSE;
+    BOOLEAN                         ExceptionEventFound = FALSE;
+    BROADCAST_CORE_MASK             CoreMask            = {0};
+    BROADCAST_OPERATION             Operations[3]       = {0};
+    UINT32                          CountOfOperations   = 0;
+    UINT64                          QuiescedGeneration  = 0;
+
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+    CountOfArrays  = ProcessorCount * DEBUGGER_EVENT_TYPES_COUNT;
+
+    //
+    // The array of a type on a core is at (Core * DEBUGGER_EVENT_TYPES_COUNT + Type)
+    //
+    NewArrays      = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_EVENT_ARRAY) * CountOfArrays, POOLTAG);
+    RetiredRecords = ExAllocatePoolWithTag(NonPagedPool, sizeof(PDEBUGGER_RETIRED_EVENT_ARRAY) * CountOfArrays, POOLTAG);
+
+    if (!NewArrays || !RetiredRecords)
+    {
+        if (NewArrays)
+        {
+            ExFreePoolWithTag(NewArrays, POOLTAG);
+        }
+
+        if (RetiredRecords)
+        {
+            ExFreePoolWithTag(RetiredRecords, POOLTAG);
+        }
+
+        return FALSE;
+    }
+
+    RtlZeroMemory(NewArrays, sizeof(PDEBUGGER_EVENT_ARRAY) * CountOfArrays);
+    RtlZeroMemory(RetiredRecords, sizeof(PDEBUGGER_RETIRED_EVENT_ARRAY) * CountOfArrays);
+
+    if (!IsListEmpty(&DebuggerRetiredEventArraysHead))
+    {
+        QuiescedGeneration = DebuggerQuiesceNonRootTriggers();
+    }
+
+    ExAcquireFastMutex(&DebuggerEventsMutex);
+
+    DebuggerReclaimEventArrays(QuiescedGeneration);
+
+    //
+    // Count the events of the tag, an event of all the cores is in the arrays
+    // of all the cores so it's counted for each of them
+    //
+    for (UINT32 i = 0; i < CountOfArrays; i++)
+    {
+        PDEBUGGER_EVENT_ARRAY CurrentArray = g_GuestState[i / DEBUGGER_EVENT_TYPES_COUNT].Events.EventsOfType[i % DEBUGGER_EVENT_TYPES_COUNT];
+
+        for (UINT32 j = 0; CurrentArray && j < CurrentArray->Count; j++)
+        {
+            if (CurrentArray->Events[j]->Tag == Tag)
+            {
+                CountOfMatches++;
+            }
+        }
+    }
+
+    if (CountOfMatches == 0)
+    {
+        ExReleaseFastMutex(&DebuggerEventsMutex);
+        ExFreePoolWithTag(NewArrays, POOLTAG);
+        ExFreePoolWithTag(RetiredRecords, POOLTAG);
+        return FALSE;
+    }
+
+    //
+    // The removed events are retired as an array too, so they're freed after
+    // all the arrays that they were in
+    //
+    RemovedEvents      = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_RETIRED_EVENT_ARRAY) + sizeof(UINT64) * ProcessorCount, POOLTAG);
+    RemovedEventsArray = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_EVENT_ARRAY) + sizeof(PDEBUGGER_EVENT) * (CountOfMatches - 1), POOLTAG);
+
+    if (!RemovedEvents || !RemovedEventsArray)
+    {
+        IsAllocated = FALSE;
+    }
+    else
+    {
+        RemovedEventsArray->Count = 0;
+    }
+
+    //
+    // Make the new arrays (copy of the current one without the events), nothing
+    // is published unless all of them are allocated
+    //
+    for (UINT32 i = 0; IsAllocated && i < CountOfArrays; i++)
+    {
+        PDEBUGGER_EVENT_ARRAY CurrentArray = g_GuestState[i / DEBUGGER_EVENT_TYPES_COUNT].Events.EventsOfType[i % DEBUGGER_EVENT_TYPES_COUNT];
+        UINT32                CountOfRemaining;
+
+        if (!CurrentArray)
+        {
+            continue;
+        }
+
+        CountOfRemaining = 0;
+
+        for (UINT32 j = 0; j < CurrentArray->Count; j++)
+        {
+            if (CurrentArray->Events[j]->Tag != Tag)
+            {
+                CountOfRemaining++;
+            }
+        }
+
+        if (CountOfRemaining == CurrentArray->Count)
+        {
+            continue;
+        }
+
+        //
+        // An empty array is published as NULL
+        //
+        if (CountOfRemaining != 0)
+        {
+            NewArrays[i] = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_EVENT_ARRAY) + sizeof(PDEBUGGER_EVENT) * (CountOfRemaining - 1), POOLTAG);
+        }
+
+        RetiredRecords[i] = ExAllocatePoolWithTag(NonPagedPool, sizeof(DEBUGGER_RETIRED_EVENT_ARRAY) + sizeof(UINT64) * ProcessorCount, POOLTAG);
+
+        if ((CountOfRemaining != 0 && !NewArrays[i]) || !RetiredRecords[i])
+        {
+            IsAllocated = FALSE;
+            break;
+        }
+
+        if (NewArrays[i])
+        {
+            NewArrays[i]->Count = 0;
+        }
+
+        for (UINT32 j = 0; j < CurrentArray->Count; j++)
+        {
+            PDEBUGGER_EVENT CurrentEvent = CurrentArray->Events[j];
+            BOOLEAN         IsAdded      = FALSE;
+
+            if (CurrentEvent->Tag != Tag)
+            {
+                NewArrays[i]->Events[NewArrays[i]->Count++] = CurrentEvent;
+                continue;
+            }
+
+            for (UINT32 k = 0; k < RemovedEventsArray->Count; k++)
+            {
+                if (RemovedEventsArray->Events[k] == CurrentEvent)
+                {
+                    IsAdded = TRUE;
+                    break;
+                }
+            }
+
+            if (!IsAdded)
+            {
+                RemovedEventsArray->Events[RemovedEventsArray->Count++] = CurrentEvent;
+            }
+
+            BroadcastCoreMaskAdd(&CoreMask, i / DEBUGGER_EVENT_TYPES_COUNT);
+
+            if (CurrentEvent->EventType == RDMSR_INSTRUCTION_EXECUTION || CurrentEvent->EventType == WRMSR_INSTRUCTION_EXECUTION)
+            {
+                MsrEventFound = TRUE;
+            }
+            else if (CurrentEvent->EventType == IN_INSTRUCTION_EXECUTION || CurrentEvent->EventType == OUT_INSTRUCTION_EXECUTION)
+            {
+                IoEventFound = TRUE;
+            }
+            else if (CurrentEvent->EventType == BREAKPOINT_EXCEPTION || CurrentEvent->EventType == DEBUG_EXCEPTION)
+            {
+                ExceptionEventFound = TRUE;
+            }
+        }
+    }
+
+    for (UINT32 i = 0; i < CountOfArrays; i++)
+    {
+        if (IsAllocated && RetiredRecords[i])
+        {
+            DebuggerPublishEventArray(i / DEBUGGER_EVENT_TYPES_COUNT, i % DEBUGGER_EVENT_TYPES_COUNT, NewArrays[i], RetiredRecords[i]);
+            continue;
+        }
+
+        if (NewArrays[i])
+        {
+            ExFreePoolWithTag(NewArrays[i], POOLTAG);
+        }
+
+        if (RetiredRecords[i])
+        {
+            ExFreePoolWithTag(RetiredRecords[i], POOLTAG);
+        }
+    }
+
+    if (IsAllocated)
+    {
+        //
+        // Retired after all the arrays, so it's freed after them
+        //
+        RemovedEvents->EventArray    = RemovedEventsArray;
+        RemovedEvents->FreeTheEvents = TRUE;
+
+        DebuggerRetireEventArray(RemovedEvents);
+    }
+    else
+    {
+        if (RemovedEvents)
+        {
+            ExFreePoolWithTag(RemovedEvents, POOLTAG);
+        }
+
+        if (RemovedEventsArray)
+        {
+            ExFreePoolWithTag(RemovedEventsArray, POOLTAG);
+        }
+    }
+
+    ExReleaseFastMutex(&DebuggerEventsMutex);
+
+    ExFreePoolWithTag(NewArrays, POOLTAG);
+    ExFreePoolWithTag(RetiredRecords, POOLTAG);
+
+    if (!IsAllocated)
+    {
+        return FALSE;
+    }
+
+    //
+    // Remove the MSRs, the ports and the addresses of the events from the
+    // bitmaps of the cores that they were on
+    //
+    if (MsrEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_MSR_BITMAP;
+    }
+
+    if (IoEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_IO_BITMAP;
+    }
+
+    if (ExceptionEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_EXCEPTION_BITMAP;
+    }
+
+    if (CountOfOperations != 0)
+    {
+        BroadcastVmcalls(&CoreMask, Operations, CountOfOperations, NULL);
+    }
+
+    //
+    // Free the events now if no core is using them anymore
+    //
+    QuiescedGeneration = DebuggerQuiesceNonRootTriggers();
+
+    ExAcquireFastMutex(&DebuggerEventsMutex);
+    DebuggerReclaimEventArrays(QuiescedGeneration);
+    ExReleaseFastMutex(&DebuggerEventsMutex);
+
+    return TRUE;
+}
+
+/**
+ * @brief Remove the actions of an event
+ * @details The cores walk the actions of a registered event without a lock,
+ * so the actions are only removed with the event (DebuggerUnregisterEvent)
+ * 
+ * @param Event The event
+ * @return BOOLEAN Always false
+ */
+BOOLEAN
+DebuggerRemoveActionFromEvent(PDEBUGGER_EVENT Event)
+{
+    UNREFERENCED_PARAMETER(Event);
+
+    return FALSE;
+}
+BOOLEAN
+DebuggerDisableEvent(UINT64 Tag)
+{
+    UINT32                         ProcessorCount;
+    BOOLEAN                        Found               = FALSE;
+    BOOLEAN                        MsrEventFound       = FALSE;
+    BOOLEAN                        IoEventFound        = FALSE;
+    BOOLEAN                        ExceptionEventFound = FALSE;
+    BROADCAST_CORE_MASK            CoreMask            = {0};
+    BROADCAST_OPERATION            Operations[3]       = {0};
+    UINT32                         CountOfOperations   = 0;
+    const DEBUGGER_EVENT_TYPE_ENUM EventTypes[]        = {RDMSR_INSTRUCTION_EXECUTION,
+                                                   WRMSR_INSTRUCTION_EXECUTION,
+                                                   IN_INSTRUCTION_EXECUTION,
+                                                   OUT_INSTRUCTION_EXECUTION,
+                                                   BREAKPOINT_EXCEPTION,
+                                                   DEBUG_EXCEPTION};
+
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    //
+    // Seach all the cores for disable this event (currently only the msr,
+    // I/O, #BP and #DB events can be disabled), the mutex keeps the arrays
+    // from being reclaimed
+    //
+    ExAcquireFastMutex(&DebuggerEventsMutex);
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        for (size_t j = 0; j < RTL_NUMBER_OF(EventTypes); j++)
+        {
+            PDEBUGGER_EVENT_ARRAY EventArray = g_GuestState[i].Events.EventsOfType[EventTypes[j]];
+
+            for (UINT32 k = 0; EventArray && k < EventArray->Count; k++)
+            {
+                PDEBUGGER_EVENT CurrentEvent = EventArray->Events[k];
+
+                if (CurrentEvent->Tag == Tag)
+                {
+                    CurrentEvent->Enabled = FALSE;
+                    Found                 = TRUE;
+
+                    BroadcastCoreMaskAdd(&CoreMask, (UINT32)i);
+
+                    if (CurrentEvent->EventType == RDMSR_INSTRUCTION_EXECUTION || CurrentEvent->EventType == WRMSR_INSTRUCTION_EXECUTION)
+                    {
+                        MsrEventFound = TRUE;
+                    }
+                    else if (CurrentEvent->EventType == IN_INSTRUCTION_EXECUTION || CurrentEvent->EventType == OUT_INSTRUCTION_EXECUTION)
+                    {
+                        IoEventFound = TRUE;
+                    }
+                    else
+                    {
+                        ExceptionEventFound = TRUE;
+                    }
+                }
+            }
+        }
+    }
+
+    ExReleaseFastMutex(&DebuggerEventsMutex);
+
+    //
+    // Remove the MSRs and the ports of the disabled events from the bitmaps
+    // with one broadcast for all of them, only to the cores that the events
+    // are found on
+    //
+    if (MsrEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_MSR_BITMAP;
+    }
+
+    if (IoEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_IO_BITMAP;
+    }
+
+    if (ExceptionEventFound)
+    {
+        Operations[CountOfOperations++].VmcallNumber = VMCALL_UPDATE_EXCEPTION_BITMAP;
+    }
+
+    if (CountOfOperations != 0)
+    {
+        BroadcastVmcalls(&CoreMask, Operations, CountOfOperations, NULL);
+    }
+
+    return Found;
+}
+
+/**
+ * @brief Add the counters of the cores for each registered event
+ * @details An event of all the cores is in the arrays of all the cores, so
+ * it's only reported from the first core, the counters are read without
+ * stopping the cores as each of them is only written by its own core
+ * 
+ * @param Result The header of the output buffer (the entries follow it)
+ * @param OutputBufferLength Size of the output buffer
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+DebuggerQueryEventStatistics(PDEBUGGER_EVENT_STATISTICS_RESULT Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength)
+{
+    UINT32                           ProcessorCount = KeQueryActiveProcessorCount(0);
+    PDEBUGGER_EVENT_STATISTICS_ENTRY Entries        = (PDEBUGGER_EVENT_STATISTICS_ENTRY)((UINT64)Result + sizeof(DEBUGGER_EVENT_STATISTICS_RESULT));
+    UINT32                           MaximumEntries = (OutputBufferLength - sizeof(DEBUGGER_EVENT_STATISTICS_RESULT)) / sizeof(DEBUGGER_EVENT_STATISTICS_ENTRY);
+
+    RtlZeroMemory(Result, sizeof(DEBUGGER_EVENT_STATISTICS_RESULT));
+
+    ExAcquireFastMutex(&DebuggerEventsMutex);
+
+    for (UINT32 i = 0; i < ProcessorCount; i++)
+    {
+        for (UINT32 j = 0; j < DEBUGGER_EVENT_TYPES_COUNT; j++)
         {
-            //
-            // Means that there is some conditions
-            //
-            ConditionFunc = CurrentEvent->ConditionBufferAddress;
+            PDEBUGGER_EVENT_ARRAY EventArray = g_GuestState[i].Events.EventsOfType[j];
 
-            //
-            // Run and check for results
-            //
-            if (ConditionFunc() == 0)
+            for (UINT32 k = 0; EventArray && k < EventArray->Count; k++)
             {
-                //
-                // The condition function returns null, mean that the
-                // condition didn't met, we can ignore this event
-                //
-                continue;
+                PDEBUGGER_EVENT                  CurrentEvent = EventArray->Events[k];
+                PDEBUGGER_EVENT_STATISTICS_ENTRY Entry;
+
+                if (i != (CurrentEvent->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES ? 0 : CurrentEvent->CoreId))
+                {
+                    continue;
+                }
+
+                if (Result->CountOfEvents == MaximumEntries)
+                {
+                    Result->CountOfMissedEvents++;
+                    continue;
+                }
+
+                Entry = &Entries[Result->CountOfEvents++];
+
+                RtlZeroMemory(Entry, sizeof(DEBUGGER_EVENT_STATISTICS_ENTRY));
+
+                Entry->Tag            = CurrentEvent->Tag;
+                Entry->EventType      = CurrentEvent->EventType;
+                Entry->CoreId         = CurrentEvent->CoreId;
+                Entry->Enabled        = CurrentEvent->Enabled;
+                Entry->CountOfActions = CurrentEvent->CountOfActions;
+
+                for (UINT32 Core = 0; Core < ProcessorCount; Core++)
+                {
+                    PDEBUGGER_EVENT_STATISTICS Statistics = &CurrentEvent->Statistics[Core];
+
+                    Entry->Statistics.Hits += Statistics->Hits;
+                    Entry->Statistics.ConditionRejections += Statistics->ConditionRejections;
+                    Entry->Statistics.ActionsRun += Statistics->ActionsRun;
+                    Entry->Statistics.ConditionCycles += Statistics->ConditionCycles;
+                    Entry->Statistics.ActionCycles += Statistics->ActionCycles;
+                }
             }
         }
-
-        //
-        // perform the actions
-        //
-        DebuggerPerformActions(CurrentEvent, Regs, Context);
     }
 
-    return TRUE;
+    ExReleaseFastMutex(&DebuggerEventsMutex);
+
+    *ReturnedLength = sizeof(DEBUGGER_EVENT_STATISTICS_RESULT) + Result->CountOfEvents * sizeof(DEBUGGER_EVENT_STATISTICS_ENTRY);
+
+    return STATUS_SUCCESS;
 }
 
+/**
+ * @brief Rebuild the MSR bitmap of the current core from its msr events
+ * @details Should be called in vmx-root, the MSRs that are not watched by
+ * any enabled event are removed from the bitmap so they never cause vm-exit
+ * 
+ * @return VOID 
+ */
 VOID
-DebuggerPerformActions(PDEBUGGER_EVENT Event, PGUEST_REGS Regs, PVOID Context)
+DebuggerUpdateMsrBitmap()
 {
-    PLIST_ENTRY TempList = 0;
+    ULONG                 CurrentProcessorIndex;
+    UINT64                MsrBitmap;
+    UINT32                VmEntryControls = 0;
+    PDEBUGGER_EVENT_ARRAY EventArray;
+
+    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+    MsrBitmap             = g_GuestState[CurrentProcessorIndex].MsrBitmapVirtualAddress;
 
     //
-    // Find and run all the actions in this Event
+    // Nothing causes vm-exit unless it's watched
     //
+    RtlZeroMemory(MsrBitmap, PAGE_SIZE);
 
-    TempList = &Event->ActionsListHead;
-    while (&Event->ActionsListHead != TempList->Flink)
+    //
+    // The EFER syscall hook needs the reads of EFER (to hide the SCE bit)
+    //
+    __vmx_vmread(VM_ENTRY_CONTROLS, &VmEntryControls);
+
+    if (VmEntryControls & VM_ENTRY_LOAD_IA32_EFER)
     {
-        TempList                             = TempList->Flink;
-        PDEBUGGER_EVENT_ACTION CurrentAction = CONTAINING_RECORD(TempList, DEBUGGER_EVENT_ACTION, ActionsList);
+        HvSetMsrBitmap(MSR_EFER, CurrentProcessorIndex, TRUE, FALSE);
+    }
 
-        //
-        // Perform the action
-        //
-        switch (CurrentAction->ActionType)
+    //
+    // Add the MSRs of the RDMSR events (the first half of the bitmap is for reads)
+    //
+    EventArray = g_GuestState[CurrentProcessorIndex].Events.EventsOfType[RDMSR_INSTRUCTION_EXECUTION];
+
+    for (UINT32 i = 0; EventArray && i < EventArray->Count; i++)
+    {
+        PDEBUGGER_EVENT CurrentEvent = EventArray->Events[i];
+
+        if (!CurrentEvent->Enabled)
         {
-        case BREAK_TO_DEBUGGER:
-            DebuggerPerformBreakToDebugger(Event->Tag, CurrentAction, Regs, Context);
-            break;
-        case LOG_THE_STATES:
-            DebuggerPerformLogTheStates(Event->Tag, CurrentAction, Regs, Context);
-            break;
-        case RUN_CUSTOM_CODE:
-            DebuggerPerformRunTheCustomCode(Event->Tag, CurrentAction, Regs, Context);
-            break;
-        default:
-            //
-            // Invalid action type
-            //
-            break;
+            continue;
+        }
+
+        if (CurrentEvent->OptionalParam1 == DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS)
+        {
+            RtlFillMemory(MsrBitmap, PAGE_SIZE / 2, 0xff);
+        }
+        else
+        {
+            HvSetMsrBitmap(CurrentEvent->OptionalParam1, CurrentProcessorIndex, TRUE, FALSE);
         }
     }
-}
 
-VOID
-DebuggerPerformLogTheStates(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context)
-{
     //
-    // Context point to the registers
+    // Add the MSRs of the WRMSR events (the second half of the bitmap is for writes)
     //
-    DbgBreakPoint();
+    EventArray = g_GuestState[CurrentProcessorIndex].Events.EventsOfType[WRMSR_INSTRUCTION_EXECUTION];
 
-    //   Action->LogConfiguration.LogValue
-    //       Action->LogConfiguration.LogType
-    //          Action->LogConfiguration.LogMask
-    //              Action->LogConfiguration.LogLength
-    //                 Action->ImmediatelySendTheResults
-    //                    Action->ActionOrderCode
-}
+    for (UINT32 i = 0; EventArray && i < EventArray->Count; i++)
+    {
+        PDEBUGGER_EVENT CurrentEvent = EventArray->Events[i];
 
-VOID
-DebuggerPerformBreakToDebugger(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context)
-{
-    DbgBreakPoint();
+        if (!CurrentEvent->Enabled)
+        {
+            continue;
+        }
+
+        if (CurrentEvent->OptionalParam1 == DEBUGGER_EVENT_MSR_READ_OR_WRITE_ALL_MSRS)
+        {
+            RtlFillMemory(MsrBitmap + PAGE_SIZE / 2, PAGE_SIZE / 2, 0xff);
+        }
+        else
+        {
+            HvSetMsrBitmap(CurrentEvent->OptionalParam1, CurrentProcessorIndex, FALSE, TRUE);
+        }
+    }
 }
+
+/**
+ * @brief Rebuild the I/O bitmaps of the current core from its I/O events
+ * @details Should be called in vmx-root, IN and OUT share the same bitmaps
+ * 
+ * @return VOID 
+ */
 VOID
-DebuggerPerformRunTheCustomCode(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context)
+DebuggerUpdateIoBitmap()
 {
-    PVOID                                             ReturnBufferToUsermodeAddress = 0;
-    DebuggerRunCustomCodeFunc *                       Func;
-    DebuggerRunCustomCodeWithPreAllocatedBufferFunc * FuncWithPreAllocBuffer;
+    ULONG                 CurrentProcessorIndex;
+    PDEBUGGER_EVENT_ARRAY EventArrays[2];
 
-    if (Action->CustomCodeBufferSize == 0)
-    {
-        //
-        // Sth went wrong ! the buffer size for custom code shouldn't be zero
-        //
-        return;
-    }
+    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
 
     //
-    // Run the custom code
+    // Nothing causes vm-exit unless it's watched
     //
-    if (Action->RequestedBuffer.RequestBufferSize == 0)
-    {
-        //
-        // Means that this custom code doesn't requested a pre-allocated buffer
-        //
-        Func = (DebuggerRunCustomCodeFunc *)Action->CustomCodeBufferAddress;
+    RtlZeroMemory(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressA, PAGE_SIZE);
+    RtlZeroMemory(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressB, PAGE_SIZE);
 
-        //
-        // Execute the code
-        //
-        ReturnBufferToUsermodeAddress = Func();
-    }
-    else
+    EventArrays[0] = g_GuestState[CurrentProcessorIndex].Events.EventsOfType[IN_INSTRUCTION_EXECUTION];
+    EventArrays[1] = g_GuestState[CurrentProcessorIndex].Events.EventsOfType[OUT_INSTRUCTION_EXECUTION];
+
+    for (size_t i = 0; i < RTL_NUMBER_OF(EventArrays); i++)
     {
-        //
-        // Means that this custom code doesn't requested a pre-allocated buffer
-        //
-        FuncWithPreAllocBuffer = (DebuggerRunCustomCodeWithPreAllocatedBufferFunc *)Action->CustomCodeBufferAddress;
+        for (UINT32 j = 0; EventArrays[i] && j < EventArrays[i]->Count; j++)
+        {
+            PDEBUGGER_EVENT CurrentEvent = EventArrays[i]->Events[j];
 
-        //
-        // Execute the code (with requested buffer parameter)
-        //
-        ReturnBufferToUsermodeAddress = FuncWithPreAllocBuffer(Action->RequestedBuffer.RequstBufferAddress);
+            if (!CurrentEvent->Enabled)
+            {
+                continue;
+            }
+
+            if (CurrentEvent->OptionalParam1 == DEBUGGER_EVENT_ALL_IO_PORTS)
+            {
+                RtlFillMemory(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressA, PAGE_SIZE, 0xff);
+                RtlFillMemory(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressB, PAGE_SIZE, 0xff);
+            }
+            else if (CurrentEvent->OptionalParam1 < 0x8000)
+            {
+                SetBit(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressA, CurrentEvent->OptionalParam1, TRUE);
+            }
+            else if (CurrentEvent->OptionalParam1 <= 0xffff)
+            {
+                SetBit(g_GuestState[CurrentProcessorIndex].IoBitmapVirtualAddressB, CurrentEvent->OptionalParam1 - 0x8000, TRUE);
+            }
+        }
     }
+}
 
-    //
-    // Check if we need to send the buffer to the usermode or not we only send
-    // buffer in usermode if the user requested a pre allocated buffer and
-    //return its address (in RAX), it's obvious the user might request a buffer
-    // and at last return another address (which is not the address of pre]
-    // allocated buffer), no matter, we send the user specific buffer with the
-    // size of the request for pre allocated buffer
-    //
-    if (ReturnBufferToUsermodeAddress != 0 && Action->RequestedBuffer.RequestBufferSize != 0)
+/**
+ * @brief Rebuild an address set of the current core from an array of events
+ * 
+ * @param AddressSet The address set
+ * @param EventArray The #BP or #DB events of the core (null if there is no event)
+ * @return BOOLEAN Whether there is any enabled event or not
+ */
+BOOLEAN
+DebuggerBuildExceptionAddressSet(PDEBUGGER_EXCEPTION_ADDRESS_SET AddressSet, PDEBUGGER_EVENT_ARRAY EventArray)
+{
+    BOOLEAN HasEvent = FALSE;
+
+    RtlZeroMemory(AddressSet, sizeof(DEBUGGER_EXCEPTION_ADDRESS_SET));
+
+    for (UINT32 i = 0; EventArray && i < EventArray->Count; i++)
     {
+        UINT64          Slot;
+        PDEBUGGER_EVENT CurrentEvent = EventArray->Events[i];
+
+        if (!CurrentEvent->Enabled)
+        {
+            continue;
+        }
+
+        HasEvent = TRUE;
+
+        if (AddressSet->AllAddresses)
+        {
+            continue;
+        }
+
         //
-        // Send the buffer to the usermode
+        // Zero is the empty slot, and the set is kept at most 3/4 full so
+        // the probes are short, otherwise the events check the addresses
         //
+        if (CurrentEvent->OptionalParam1 == DEBUGGER_EVENT_ALL_ADDRESSES || CurrentEvent->OptionalParam1 == 0 ||
+            AddressSet->Count >= DEBUGGER_EXCEPTION_ADDRESS_SET_SIZE / 4 * 3)
+        {
+            AddressSet->AllAddresses = TRUE;
+            continue;
+        }
 
         //
-        // check if buffer is valid or not, actually MS recommends not to use
-        // MmIsAddressValid, but we're not doing anything fancy here just wanna
-        // see if it's a valid address or not, because if this routine return
-        // null then it means that we didn't find a valid physical address for
-        // it, so if the programmer unintentionally forget to zero RAX, we can
-        // avoid doing sth bad here. (This function uses MmGetPhysicalAddress)
+        // Fibonacci hashing, the top 8 bits are the slot of the 256 slots
         //
-        if (VirtualAddressToPhysicalAddress(ReturnBufferToUsermodeAddress) != 0)
+        Slot = (CurrentEvent->OptionalParam1 * 0x9E3779B97F4A7C15) >> 56;
+
+        while (AddressSet->Addresses[Slot] != 0 && AddressSet->Addresses[Slot] != CurrentEvent->OptionalParam1)
         {
-            //
-            // Address is valid, let send it with specific tag
-            //
-            LogSendBuffer(Tag, ReturnBufferToUsermodeAddress, Action->RequestedBuffer.RequestBufferSize);
+            Slot = (Slot + 1) & (DEBUGGER_EXCEPTION_ADDRESS_SET_SIZE - 1);
+        }
+
+        if (AddressSet->Addresses[Slot] == 0)
+        {
+            AddressSet->Addresses[Slot] = CurrentEvent->OptionalParam1;
+            AddressSet->Count++;
         }
     }
+
+    return HasEvent;
 }
 
-BOOLEAN
-DebuggerRemoveActionFromEvent(PDEBUGGER_EVENT Event)
+/**
+ * @brief Rebuild the address sets of the #BP and #DB events of the current
+ * core and intercept the exceptions that are watched
+ * @details Should be called in vmx-root, the other bits of the exception
+ * bitmap (e.g, #UD of the EFER syscall hook) are not changed
+ * 
+ * @return VOID 
+ */
+VOID
+DebuggerUpdateExceptionBitmap()
 {
-    //
-    // Remember to free the pool
-    //
+    ULONG  CurrentProcessorIndex;
+    UINT32 ExceptionBitmap = 0;
+
+    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+
+    __vmx_vmread(EXCEPTION_BITMAP, &ExceptionBitmap);
+
+    if (DebuggerBuildExceptionAddressSet(&g_GuestState[CurrentProcessorIndex].DebuggingState.BreakpointAddresses,
+                                         g_GuestState[CurrentProcessorIndex].Events.EventsOfType[BREAKPOINT_EXCEPTION]))
+    {
+        ExceptionBitmap |= (1 << EXCEPTION_VECTOR_BREAKPOINT);
+    }
+    else
+    {
+        ExceptionBitmap &= ~(1 << EXCEPTION_VECTOR_BREAKPOINT);
+    }
+
+    if (DebuggerBuildExceptionAddressSet(&g_GuestState[CurrentProcessorIndex].DebuggingState.DebugAddresses,
+                                         g_GuestState[CurrentProcessorIndex].Events.EventsOfType[DEBUG_EXCEPTION]))
+    {
+        ExceptionBitmap |= (1 << EXCEPTION_VECTOR_DEBUG_BREAKPOINT);
+    }
+    else
+    {
+        ExceptionBitmap &= ~(1 << EXCEPTION_VECTOR_DEBUG_BREAKPOINT);
+    }
+
+    __vmx_vmwrite(EXCEPTION_BITMAP, ExceptionBitmap);
 }
 
+/**
+ * @brief Check whether an address is in an address set
+ * @details Should be called in vmx-root, nothing is formatted or allocated
+ * as it's called for each #BP and #DB
+ * 
+ * @param AddressSet The address set of the current core
+ * @param Address The guest RIP
+ * @return BOOLEAN Whether the exception should trigger the events or not
+ */
 BOOLEAN
-DebuggerUnregisterEvent(UINT64 Tag)
+DebuggerCheckExceptionAddress(PDEBUGGER_EXCEPTION_ADDRESS_SET AddressSet, UINT64 Address)
 {
-    //
-    // Seach all the cores for remove this event
-    //
+    UINT64 Slot;
+
+    if (AddressSet->AllAddresses)
+    {
+        return TRUE;
+    }
+
+    if (AddressSet->Count == 0 || Address == 0)
+    {
+        return FALSE;
+    }
+
+    Slot = (Address * 0x9E3779B97F4A7C15) >> 56;
+
+    while (AddressSet->Addresses[Slot] != 0)
+    {
+        if (AddressSet->Addresses[Slot] == Address)
+        {
+            return TRUE;
+        }
+
+        Slot = (Slot + 1) & (DEBUGGER_EXCEPTION_ADDRESS_SET_SIZE - 1);
+    }
+
+    return FALSE;
 }
-BOOLEAN
-DebuggerDisableEvent(UINT64 Tag)
+
+/**
+ * @brief Send the record of a watched #BP or #DB and trigger its events
+ * @details Should be called in vmx-root, the record is binary (it's formatted
+ * in user-mode)
+ * 
+ * @param Vector EXCEPTION_VECTOR_BREAKPOINT or EXCEPTION_VECTOR_DEBUG_BREAKPOINT
+ * @param Regs Guest registers
+ * @param GuestRip Address of the exception
+ * @param ExitQualification The DR6 bits of the #DB (zero for #BP)
+ * @return VOID 
+ */
+VOID
+DebuggerHandleExceptionHit(UINT32 Vector, PGUEST_REGS Regs, UINT64 GuestRip, UINT64 ExitQualification)
 {
-    //
-    // Seach all the cores for disable this event
-    //
+    DEBUGGER_EXCEPTION_HIT_RECORD Record;
+
+    Record.GuestRip          = GuestRip;
+    Record.TimeStampCounter  = __rdtsc();
+    Record.ExitQualification = ExitQualification;
+    Record.ProcessId         = (UINT32)(UINT64)PsGetCurrentProcessId();
+    Record.CoreId            = (UINT16)KeGetCurrentProcessorNumber();
+    Record.Vector            = (UINT16)Vector;
+
+    __vmx_vmread(GUEST_CR3, &Record.GuestCr3);
+
+    LogSendBuffer(OPERATION_LOG_EXCEPTION_HIT, &Record, sizeof(DEBUGGER_EXCEPTION_HIT_RECORD));
+
+    DebuggerTriggerEvents(Vector == EXCEPTION_VECTOR_BREAKPOINT ? BREAKPOINT_EXCEPTION : DEBUG_EXCEPTION, Regs, (PVOID)GuestRip);
 }
 
+/**
+ * @brief Unregister an event and free it (see DebuggerUnregisterEvent)
+ * 
+ * @param Event The event (registered)
+ * @return BOOLEAN Whether the event is unregistered or not
+ */
 BOOLEAN
 DebuggerRemoveEvent(PDEBUGGER_EVENT Event)
 {
-    //
-    // Remember to free the pool
-    //
+    return DebuggerUnregisterEvent(Event->Tag);
 }
 
 //
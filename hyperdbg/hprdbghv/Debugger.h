@@ -19,6 +19,56 @@
 //					Structures					//
 //////////////////////////////////////////////////
 
+/* Slots of the address sets of the #BP and #DB events (power of 2) */
+#define DEBUGGER_EXCEPTION_ADDRESS_SET_SIZE 256
+
+/**
+ * @brief Addresses of the #BP or #DB events of a core (open addressing hash
+ * set, zero means empty slot)
+ * @details It's rebuilt from the events in vmx-root, if there are too many
+ * addresses then AllAddresses is set and the events check the addresses
+ * 
+ */
+typedef struct _DEBUGGER_EXCEPTION_ADDRESS_SET
+{
+    BOOLEAN AllAddresses;
+    UINT32  Count;
+    UINT64  Addresses[DEBUGGER_EXCEPTION_ADDRESS_SET_SIZE];
+
+} DEBUGGER_EXCEPTION_ADDRESS_SET, *PDEBUGGER_EXCEPTION_ADDRESS_SET;
+
+/* Slots of the cache of the #UD instructions of each core (power of 2) */
+#define DEBUGGER_UD_CACHE_SIZE 64
+
+/**
+ * @brief Type of an instruction that caused #UD (used by EFER Syscall)
+ *
+ */
+typedef enum _UD_INSTRUCTION_TYPE
+{
+    UD_INSTRUCTION_UNKNOWN = 0, // Empty slot of the cache
+    UD_INSTRUCTION_SYSCALL,
+    UD_INSTRUCTION_SYSRET,
+    UD_INSTRUCTION_OTHER
+
+} UD_INSTRUCTION_TYPE;
+
+/**
+ * @brief A classified #UD instruction of a core
+ * @details The user-mode addresses are cached with the cr3 of their process
+ * and the generation of the processes (a cr3 might be reused by another
+ * process), the kernel addresses with zero
+ *
+ */
+typedef struct _DEBUGGER_UD_CACHE_ENTRY
+{
+    UINT64              Rip;
+    UINT64              Cr3;
+    LONG                Generation;
+    UD_INSTRUCTION_TYPE Type;
+
+} DEBUGGER_UD_CACHE_ENTRY, *PDEBUGGER_UD_CACHE_ENTRY;
+
 /**
  * @brief Saves the debugger state
  * Each logical processor contains one of this structure which describes about the
@@ -30,8 +80,43 @@ typedef struct _PROCESSOR_DEBUGGING_STATE
     UINT64 UndefinedInstructionAddress; // #UD Location of instruction (used by EFER Syscall)
     UINT64 SysretAddress;               // Address of sysret
 
+    DEBUGGER_UD_CACHE_ENTRY UdCache[DEBUGGER_UD_CACHE_SIZE]; // Classified #UD instructions (direct-mapped)
+
+    DEBUGGER_EXCEPTION_ADDRESS_SET BreakpointAddresses; // Addresses of the BREAKPOINT_EXCEPTION events
+    DEBUGGER_EXCEPTION_ADDRESS_SET DebugAddresses;      // Addresses of the DEBUG_EXCEPTION events
+
 } PROCESSOR_DEBUGGING_STATE, PPROCESSOR_DEBUGGING_STATE;
 
+/**
+ * @brief An event array that is replaced by an update
+ * @details It's freed when no core is in the vm-exit that it was in when the
+ * array was replaced (see VmexitEpoch of the cores) and the triggers of vmx
+ * non-root that might have read it are finished (see DebuggerNonRootGeneration)
+ * 
+ */
+typedef struct _DEBUGGER_RETIRED_EVENT_ARRAY
+{
+    LIST_ENTRY            RetiredList;
+    PDEBUGGER_EVENT_ARRAY EventArray;
+    BOOLEAN               FreeTheEvents;     // The events of the array are unregistered, they're freed with it
+    UINT64                NonRootGeneration; // DebuggerNonRootGeneration after the array is replaced
+    UINT64                VmexitEpochs[1];   // VmexitEpoch of each core after the array is replaced
+
+} DEBUGGER_RETIRED_EVENT_ARRAY, *PDEBUGGER_RETIRED_EVENT_ARRAY;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Serializes the updates of the event arrays of the cores */
+FAST_MUTEX DebuggerEventsMutex;
+
+/* List of the retired event arrays (DEBUGGER_RETIRED_EVENT_ARRAY) */
+LIST_ENTRY DebuggerRetiredEventArraysHead;
+
+/* Incremented before each wait for the triggers of vmx non-root (DebuggerQuiesceNonRootTriggers) */
+volatile LONG64 DebuggerNonRootGeneration;
+
 //////////////////////////////////////////////////
 //					Data Type					//
 //////////////////////////////////////////////////
@@ -47,9 +132,9 @@ DebuggerRunCustomCodeWithPreAllocatedBufferFunc(PVOID PreAllocatedBufferAddress)
 //					Log wit Tag					//
 //////////////////////////////////////////////////
 
-/* Send buffer to the usermode with a tag that shows what was the action */
+/* Send buffer to the usermode with a tag that shows what was the action (the 16 hex digits of the tag are parsed by LogGetRecordTag) */
 #define LogWithTag(tag, IsImmediate, format, ...) \
-    LogSendMessageToQueue(OPERATION_LOG_WITH_TAG, IsImmediate, FALSE, "%016x" format, tag, __VA_ARGS__);
+    LogSendMessageToQueue(OPERATION_LOG_WITH_TAG, IsImmediate, FALSE, "%016llx" format, (UINT64)(tag), __VA_ARGS__);
 
 //////////////////////////////////////////////////
 //					Functions					//
@@ -64,9 +149,21 @@ DebuggerCreateEvent(BOOLEAN Enabled, UINT32 CoreId, DEBUGGER_EVENT_TYPE_ENUM Eve
 BOOLEAN
 DebuggerAddActionToEvent(PDEBUGGER_EVENT Event, DEBUGGER_EVENT_ACTION_TYPE_ENUM ActionType, BOOLEAN SendTheResultsImmediately, PDEBUGGER_EVENT_REQUEST_CUSTOM_CODE InTheCaseOfCustomCode, PDEBUGGER_EVENT_ACTION_LOG_CONFIGURATION InTheCaseOfLogTheStates);
 
+BOOLEAN
+DebuggerSetEventFilter(PDEBUGGER_EVENT Event, PDEBUGGER_EVENT_FILTER Filter);
+
+BOOLEAN
+DebuggerSetEventRateLimit(PDEBUGGER_EVENT Event, UINT32 SampleRate, UINT32 HitsPerSecond, UINT32 Burst);
+
 BOOLEAN
 DebuggerRegisterEvent(PDEBUGGER_EVENT Event);
 
+BOOLEAN
+DebuggerRegisterEvents(PDEBUGGER_EVENT * Events, UINT32 CountOfEvents);
+
+NTSTATUS
+DebuggerRegisterEventBatch(PDEBUGGER_EVENT_BATCH_REQUEST Request, UINT32 BufferLength);
+
 BOOLEAN
 DebuggerTriggerEvents(DEBUGGER_EVENT_TYPE_ENUM EventType, PGUEST_REGS Regs, PVOID Context);
 
@@ -77,7 +174,34 @@ VOID
 DebuggerPerformBreakToDebugger(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context);
 
 VOID
-DebuggerPerformLogTheStates(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context);
+DebuggerPerformLogTheStates(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context, PUINT64 SuppressedHits);
 
 VOID
 DebuggerPerformRunTheCustomCode(UINT64 Tag, PDEBUGGER_EVENT_ACTION Action, PGUEST_REGS Regs, PVOID Context);
+
+BOOLEAN
+DebuggerDisableEvent(UINT64 Tag);
+
+BOOLEAN
+DebuggerUnregisterEvent(UINT64 Tag);
+
+BOOLEAN
+DebuggerRemoveEvent(PDEBUGGER_EVENT Event);
+
+NTSTATUS
+DebuggerQueryEventStatistics(PDEBUGGER_EVENT_STATISTICS_RESULT Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength);
+
+VOID
+DebuggerUpdateMsrBitmap();
+
+VOID
+DebuggerUpdateIoBitmap();
+
+VOID
+DebuggerUpdateExceptionBitmap();
+
+BOOLEAN
+DebuggerCheckExceptionAddress(PDEBUGGER_EXCEPTION_ADDRESS_SET AddressSet, UINT64 Address);
+
+VOID
+DebuggerHandleExceptionHit(UINT32 Vector, PGUEST_REGS Regs, UINT64 GuestRip, UINT64 ExitQualification);
@@ -0,0 +1,134 @@
+/**
+ * @file Dispatch.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Dispatch tables of the vm-exits (one handler for each exit reason)
+ * @details Each core has its own table, so the features can replace the
+ * handler of an exit reason at runtime (in all the cores or in one core)
+ * without changing the vm-exit handler
+ * @version 0.1
+ * @date 2020-05-07
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#include "Common.h"
+#include "Vmx.h"
+#include "GlobalVariables.h"
+#include "Dispatch.h"
+
+/**
+ * @brief The default handlers of the exit reasons (the others are unknown)
+ * 
+ */
+static PVMEXIT_HANDLER const DispatchDefaultHandlers[VMEXIT_HANDLERS_COUNT] = {
+    [EXIT_REASON_EXCEPTION_NMI]                 = ExitHandleExceptionOrNmi,
+    [EXIT_REASON_TRIPLE_FAULT]                  = ExitHandleTripleFault,
+    [EXIT_REASON_CPUID]                         = ExitHandleCpuid,
+    [EXIT_REASON_HLT]                           = ExitHandleResume,
+    [EXIT_REASON_VMCALL]                        = ExitHandleVmcall,
+    [EXIT_REASON_VMCLEAR]                       = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMLAUNCH]                      = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMPTRLD]                       = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMPTRST]                       = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMREAD]                        = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMRESUME]                      = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMWRITE]                       = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMXOFF]                        = ExitHandleVmxInstruction,
+    [EXIT_REASON_VMXON]                         = ExitHandleVmxInstruction,
+    [EXIT_REASON_CR_ACCESS]                     = ExitHandleControlRegisterAccess,
+    [EXIT_REASON_IO_INSTRUCTION]                = ExitHandleIoInstruction,
+    [EXIT_REASON_MSR_READ]                      = ExitHandleMsrRead,
+    [EXIT_REASON_MSR_WRITE]                     = ExitHandleMsrWrite,
+    [EXIT_REASON_MONITOR_TRAP_FLAG]             = ExitHandleMonitorTrapFlag,
+    [EXIT_REASON_EPT_VIOLATION]                 = ExitHandleEptViolation,
+    [EXIT_REASON_EPT_MISCONFIG]                 = ExitHandleEptMisconfig,
+    [EXIT_REASON_SPP_EVENT]                     = ExitHandleSppEvent,
+    [EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED]  = ExitHandleResumeWithoutSkip,
+};
+
+/**
+ * @brief Get the default handler of an exit reason
+ * 
+ * @param ExitReason Basic exit reason
+ * @return PVMEXIT_HANDLER 
+ */
+PVMEXIT_HANDLER
+DispatchGetDefaultHandler(UINT32 ExitReason)
+{
+    if (ExitReason >= VMEXIT_HANDLERS_COUNT || DispatchDefaultHandlers[ExitReason] == NULL)
+    {
+        return ExitHandleUnknown;
+    }
+
+    return DispatchDefaultHandlers[ExitReason];
+}
+
+/**
+ * @brief Fill the dispatch tables of all the cores with the default handlers
+ * @details Should be called before virtualizing the cores
+ * 
+ * @return VOID 
+ */
+VOID
+DispatchInitialize()
+{
+    UINT32 ProcessorCount;
+
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        for (UINT32 ExitReason = 0; ExitReason < VMEXIT_HANDLERS_COUNT; ExitReason++)
+        {
+            g_GuestState[i].ExitHandlers[ExitReason] = DispatchGetDefaultHandler(ExitReason);
+        }
+    }
+}
+
+/**
+ * @brief Replace the handler of an exit reason
+ * @details The handler is replaced atomically so it can be called while the
+ * cores are virtualized, the vm-exits that are already dispatched still use
+ * the previous handler
+ * 
+ * @param CoreId Index of the core or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+ * @param ExitReason Basic exit reason
+ * @param Handler The new handler
+ * @return BOOLEAN Returns false if the core or the exit reason is invalid
+ */
+BOOLEAN
+DispatchRegisterHandler(UINT32 CoreId, UINT32 ExitReason, PVMEXIT_HANDLER Handler)
+{
+    UINT32 ProcessorCount;
+
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    if (ExitReason >= VMEXIT_HANDLERS_COUNT || Handler == NULL ||
+        (CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES && CoreId >= ProcessorCount))
+    {
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        if (CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES || CoreId == i)
+        {
+            InterlockedExchangePointer(&g_GuestState[i].ExitHandlers[ExitReason], Handler);
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Restore the default handler of an exit reason
+ * 
+ * @param CoreId Index of the core or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+ * @param ExitReason Basic exit reason
+ * @return BOOLEAN Returns false if the core or the exit reason is invalid
+ */
+BOOLEAN
+DispatchUnregisterHandler(UINT32 CoreId, UINT32 ExitReason)
+{
+    return DispatchRegisterHandler(CoreId, ExitReason, DispatchGetDefaultHandler(ExitReason));
+}
@@ -0,0 +1,48 @@
+/**
+ * @file Dispatch.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the dispatch tables of the vm-exits
+ * @details
+ * @version 0.1
+ * @date 2020-05-07
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#pragma once
+#include <ntddk.h>
+#include "Vmx.h"
+
+//////////////////////////////////////////////////
+//				  Exit Handlers					//
+//////////////////////////////////////////////////
+
+VMEXIT_HANDLER ExitHandleTripleFault;
+VMEXIT_HANDLER ExitHandleVmxInstruction;
+VMEXIT_HANDLER ExitHandleControlRegisterAccess;
+VMEXIT_HANDLER ExitHandleMsrRead;
+VMEXIT_HANDLER ExitHandleMsrWrite;
+VMEXIT_HANDLER ExitHandleCpuid;
+VMEXIT_HANDLER ExitHandleIoInstruction;
+VMEXIT_HANDLER ExitHandleEptViolation;
+VMEXIT_HANDLER ExitHandleEptMisconfig;
+VMEXIT_HANDLER ExitHandleSppEvent;
+VMEXIT_HANDLER ExitHandleVmcall;
+VMEXIT_HANDLER ExitHandleExceptionOrNmi;
+VMEXIT_HANDLER ExitHandleMonitorTrapFlag;
+VMEXIT_HANDLER ExitHandleResume;
+VMEXIT_HANDLER ExitHandleResumeWithoutSkip;
+VMEXIT_HANDLER ExitHandleUnknown;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+DispatchInitialize();
+PVMEXIT_HANDLER
+DispatchGetDefaultHandler(UINT32 ExitReason);
+BOOLEAN
+DispatchRegisterHandler(UINT32 CoreId, UINT32 ExitReason, PVMEXIT_HANDLER Handler);
+BOOLEAN
+DispatchUnregisterHandler(UINT32 CoreId, UINT32 ExitReason);
@@ -20,6 +20,15 @@
 #include "ExtensionCommands.h"
 #include "Hooks.h"
 #include "Debugger.h"
+#include "Statistics.h"
+#include "Broadcast.h"
+#include "Sampling.h"
+#include "Pml.h"
+#include "Aggregation.h"
+#include "FlightRecorder.h"
+#include "Dispatch.h"
+#include "Benchmark.h"
+#include "GuestMemory.h"
 #include "Trace.h"
 #include "Driver.tmh"
 
@@ -35,12 +44,13 @@ DriverEntry(
     PDRIVER_OBJECT  DriverObject,
     PUNICODE_STRING RegistryPath)
 {
-    NTSTATUS       Ntstatus       = STATUS_SUCCESS;
-    UINT64         Index          = 0;
-    UINT32         ProcessorCount = 0;
-    PDEVICE_OBJECT DeviceObject   = NULL;
-    UNICODE_STRING DriverName     = RTL_CONSTANT_STRING(L"\\Device\\HyperdbgHypervisorDevice");
-    UNICODE_STRING DosDeviceName  = RTL_CONSTANT_STRING(L"\\DosDevices\\HyperdbgHypervisorDevice");
+    NTSTATUS       Ntstatus         = STATUS_SUCCESS;
+    UINT64         Index            = 0;
+    UINT32         ProcessorCount   = 0;
+    PDEVICE_OBJECT DeviceObject     = NULL;
+    UNICODE_STRING DriverName       = RTL_CONSTANT_STRING(L"\\Device\\HyperdbgHypervisorDevice");
+    UNICODE_STRING DosDeviceName    = RTL_CONSTANT_STRING(L"\\DosDevices\\HyperdbgHypervisorDevice");
+    BOOLEAN        IsLogInitialized = FALSE;
 
     UNREFERENCED_PARAMETER(RegistryPath);
     UNREFERENCED_PARAMETER(DriverObject);
@@ -52,7 +62,9 @@ DriverEntry(
     WPP_INIT_TRACING(DriverObject, RegistryPath);
 
 #if !UseDbgPrintInsteadOfUsermodeMessageTracking
-    if (!LogInitialize())
+    IsLogInitialized = LogInitialize();
+
+    if (!IsLogInitialized)
     {
         DbgPrint("[*] Log buffer is not initialized !\n");
         DbgBreakPoint();
@@ -86,7 +98,8 @@ DriverEntry(
 
         DbgPrint("Insufficient memory\n");
         DbgBreakPoint();
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeLog;
     }
 
     //
@@ -94,6 +107,61 @@ DriverEntry(
     //
     RtlZeroMemory(g_GuestState, sizeof(VIRTUAL_MACHINE_STATE) * ProcessorCount);
 
+    //
+    // Allocate the statistics of the vm-exits
+    //
+    if (!StatisticsInitialize())
+    {
+        DbgPrint("Insufficient memory\n");
+        Ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeGuestState;
+    }
+
+    //
+    // Allocate the flight recorders of the vm-exits
+    //
+    if (!FlightRecorderInitialize())
+    {
+        DbgPrint("Insufficient memory\n");
+        Ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeStatistics;
+    }
+
+    //
+    // Allocate the dpcs of the broadcasts to the cores
+    //
+    if (!BroadcastInitialize())
+    {
+        DbgPrint("Insufficient memory\n");
+        Ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeFlightRecorders;
+    }
+
+    //
+    // Initialize the guest RIP sampling
+    //
+    SamplingInitialize();
+
+    //
+    // Initialize the dirty page tracking
+    //
+    PmlInitialize();
+
+    //
+    // Initialize the aggregation of the accesses to the hooked pages
+    //
+    AggregationInitialize();
+
+    //
+    // Initialize the micro-benchmarks
+    //
+    BenchmarkInitialize();
+
+    //
+    // Initialize the state of the service tables (resolved on the first use)
+    //
+    SyscallHookInitialize();
+
     LogInfo("Hyperdbg is Loaded :)");
 
     Ntstatus = IoCreateDevice(DriverObject,
@@ -111,6 +179,7 @@ DriverEntry(
 
         LogInfo("Setting device major functions");
         DriverObject->MajorFunction[IRP_MJ_CLOSE]          = DrvClose;
+        DriverObject->MajorFunction[IRP_MJ_CLEANUP]        = DrvCleanup;
         DriverObject->MajorFunction[IRP_MJ_CREATE]         = DrvCreate;
         DriverObject->MajorFunction[IRP_MJ_READ]           = DrvRead;
         DriverObject->MajorFunction[IRP_MJ_WRITE]          = DrvWrite;
@@ -127,6 +196,30 @@ DriverEntry(
 
     ASSERT(NT_SUCCESS(Ntstatus));
     return Ntstatus;
+
+    //
+    // The driver is not loaded so DrvUnload is not called, the allocations
+    // are freed in the reverse order
+    //
+FreeFlightRecorders:
+    FlightRecorderUnInitialize();
+
+FreeStatistics:
+    StatisticsUnInitialize();
+
+FreeGuestState:
+    ExFreePoolWithTag(g_GuestState, POOLTAG);
+    g_GuestState = NULL;
+
+FreeLog:
+    if (IsLogInitialized)
+    {
+        LogUnInitialize();
+    }
+
+    WPP_CLEANUP(DriverObject);
+
+    return Ntstatus;
 }
 
 /**
@@ -160,6 +253,26 @@ DrvUnload(PDRIVER_OBJECT DriverObject)
     //
     ExFreePoolWithTag(g_GuestState, POOLTAG);
 
+    //
+    // Free the statistics of the vm-exits
+    //
+    StatisticsUnInitialize();
+
+    //
+    // Free the flight recorders of the vm-exits
+    //
+    FlightRecorderUnInitialize();
+
+    //
+    // Free the dpcs of the broadcasts
+    //
+    BroadcastUnInitialize();
+
+    //
+    // Free the decoded service tables
+    //
+    SyscallHookUnInitialize();
+
     //
     // Stop the tracing
     //
@@ -220,6 +333,17 @@ DrvCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     //
     g_AllowIOCTLFromUsermode = TRUE;
 
+    //
+    // The new app needs the calibration of the time stamp counters of the messages
+    //
+    LogSendTimeCalibration();
+
+    //
+    // and the format definitions of the binary messages (the previous app
+    // received them)
+    //
+    LogInvalidateBinaryFormats();
+
     LogInfo("Hyperdbg's hypervisor Started...");
     //
     // We have to zero the g_GuestState again as we want to support multiple initialization by CreateFile
@@ -231,6 +355,24 @@ DrvCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     //
     RtlZeroMemory(g_GuestState, sizeof(VIRTUAL_MACHINE_STATE) * ProcessorCount);
 
+    //
+    // Set the default handlers of the vm-exits
+    //
+    DispatchInitialize();
+
+    //
+    // The statistics of the vm-exits are allocated in DriverEntry, the new
+    // app starts with zero counters
+    //
+    if (!StatisticsReset())
+    {
+        Irp->IoStatus.Status      = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     if (HvVmxInitialize())
     {
         LogInfo("Hyperdbg's hypervisor loaded successfully :)");
@@ -339,6 +481,43 @@ DrvClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     return STATUS_SUCCESS;
 }
 
+/**
+ * @brief IRP_MJ_CLEANUP Function handler
+ * @details It's called in the context of the process that closes the
+ * handle, so we can unmap the user-mode mappings here
+ * 
+ * @param DeviceObject 
+ * @param Irp 
+ * @return NTSTATUS 
+ */
+NTSTATUS
+DrvCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+#if !UseDbgPrintInsteadOfUsermodeMessageTracking
+
+    //
+    // Unmap the log buffers (if they're mapped to this process)
+    //
+    LogUnmapBuffersFromUsermode();
+
+    //
+    // No one reads the rings of the subscribers anymore
+    //
+    LogRemoveAllSubscriptions();
+
+    //
+    // No one waits for the pending IRPs anymore
+    //
+    LogCompleteAllPendingIrps();
+#endif
+
+    Irp->IoStatus.Status      = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
 /**
  * @brief Unsupported message for all other IRP_MJ_* handlers
  * 
@@ -358,6 +537,42 @@ DrvUnsupported(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     return STATUS_SUCCESS;
 }
 
+/**
+ * @brief Check whether an IOCTL is served while the vmx is suspended
+ * @details The other IOCTLs use VMCALL (directly or by broadcasting)
+ * 
+ * @param IoControlCode The IOCTL
+ * @return BOOLEAN 
+ */
+static BOOLEAN
+DrvIsIoctlAllowedWhileSuspended(ULONG IoControlCode)
+{
+    switch (IoControlCode)
+    {
+    case IOCTL_REGISTER_EVENT:
+    case IOCTL_RETURN_IRP_PENDING_PACKETS_AND_DISALLOW_IOCTL:
+    case IOCTL_TERMINATE_VMX:
+    case IOCTL_READ_LOG_BUFFERS_BATCH:
+    case IOCTL_QUERY_LOG_BUFFERS_STATISTICS:
+    case IOCTL_QUERY_VMEXIT_STATISTICS:
+    case IOCTL_SET_LOG_BUFFERS_POLICY:
+    case IOCTL_MAP_LOG_BUFFERS:
+    case IOCTL_READ_SAMPLES:
+    case IOCTL_DUMP_FLIGHT_RECORDER:
+    case IOCTL_QUERY_EVENT_STATISTICS:
+    case IOCTL_QUERY_POOL_STATISTICS:
+    case IOCTL_SET_SYSCALL_HOOK_FILTER:
+    case IOCTL_QUERY_SYSCALL_SERVICE_TABLES:
+    case IOCTL_QUERY_STARTUP_TIMING:
+    case IOCTL_SUSPEND_VMX:
+    case IOCTL_LOG_SUBSCRIBE:
+    case IOCTL_READ_SUBSCRIBED_LOG_BUFFERS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 /**
  * @brief Driver IOCTL Dispatcher
  * 
@@ -368,9 +583,23 @@ DrvUnsupported(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 NTSTATUS
 DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
-    PIO_STACK_LOCATION      IrpStack;
-    PREGISTER_NOTIFY_BUFFER RegisterEvent;
-    NTSTATUS                Status;
+    PIO_STACK_LOCATION                 IrpStack;
+    PREGISTER_NOTIFY_BUFFER            RegisterEvent;
+    NTSTATUS                           Status;
+    LOG_MAP_BUFFERS_REQUEST            MapRequest;
+    VMEXIT_STATISTICS_REQUEST          VmexitStatisticsRequest;
+    SAMPLING_CONTROL_REQUEST           SamplingRequest;
+    DIRTY_PAGE_QUERY_REQUEST           DirtyPageQueryRequest;
+    ACCESS_AGGREGATION_CONTROL_REQUEST AggregationRequest;
+    ACCESS_AGGREGATION_QUERY_REQUEST   AggregationQueryRequest;
+    PEPT_HOOK_BATCH_REQUEST            HookBatchRequest;
+    PEPT_HOOK_BATCH_ENTRY              HookBatchEntries;
+    PDEBUGGER_EVENT_BATCH_REQUEST      EventBatchRequest;
+    PDEBUGGER_GUEST_MEMORY_REQUEST     GuestMemoryRequest;
+    PLOG_SUBSCRIPTION_REQUEST          SubscriptionRequest;
+    UINT32                             DumpLength     = 0;
+    UINT32                             ResultLength   = 0;
+    ULONG_PTR                          ReturnedLength = 0;
 
     if (g_AllowIOCTLFromUsermode)
     {
@@ -382,6 +611,18 @@ DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
         IrpStack = IoGetCurrentIrpStackLocation(Irp);
 
+        if (g_VmxSuspended && !DrvIsIoctlAllowedWhileSuspended(IrpStack->Parameters.DeviceIoControl.IoControlCode))
+        {
+            //
+            // The vmx-root of the cores is not available until resuming
+            //
+            Irp->IoStatus.Status      = STATUS_DEVICE_NOT_READY;
+            Irp->IoStatus.Information = 0;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            return STATUS_DEVICE_NOT_READY;
+        }
+
         switch (IrpStack->Parameters.DeviceIoControl.IoControlCode)
         {
         case IOCTL_REGISTER_EVENT:
@@ -400,7 +641,7 @@ DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             switch (RegisterEvent->Type)
             {
             case IRP_BASED:
-                Status = LogRegisterIrpBasedNotification(DeviceObject, Irp);
+                Status = LogRegisterIrpBasedNotification(DeviceObject, Irp, IRP_BASED, LOG_SUBSCRIBER_DEFAULT);
                 break;
             case EVENT_BASED:
                 Status = LogRegisterEventBasedNotification(DeviceObject, Irp);
@@ -427,6 +668,512 @@ DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             HvTerminateVmx();
             Status = STATUS_SUCCESS;
             break;
+        case IOCTL_READ_LOG_BUFFERS_BATCH:
+            //
+            // The buffer should be able to hold at least one packet of the maximum size
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(LOG_BATCH_PACKET_HEADER) + PacketChunkSize ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = LogRegisterIrpBasedNotification(DeviceObject, Irp, IRP_BASED_BATCH, LOG_SUBSCRIBER_DEFAULT);
+            break;
+        case IOCTL_QUERY_LOG_BUFFERS_STATISTICS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(LOG_BUFFERS_STATISTICS) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            RtlZeroMemory(Irp->AssociatedIrp.SystemBuffer, sizeof(LOG_BUFFERS_STATISTICS));
+            LogQueryBuffersStatistics((PLOG_BUFFERS_STATISTICS)Irp->AssociatedIrp.SystemBuffer);
+
+            ReturnedLength = sizeof(LOG_BUFFERS_STATISTICS);
+            Status         = STATUS_SUCCESS;
+            break;
+        case IOCTL_QUERY_VMEXIT_STATISTICS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(VMEXIT_STATISTICS_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(VMEXIT_STATISTICS) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            //
+            // The input and the output are in the same buffer
+            //
+            VmexitStatisticsRequest = *(PVMEXIT_STATISTICS_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            RtlZeroMemory(Irp->AssociatedIrp.SystemBuffer, sizeof(VMEXIT_STATISTICS));
+            Status = StatisticsQueryVmexits(&VmexitStatisticsRequest, (PVMEXIT_STATISTICS)Irp->AssociatedIrp.SystemBuffer);
+
+            if (Status == STATUS_SUCCESS)
+            {
+                ReturnedLength = sizeof(VMEXIT_STATISTICS);
+            }
+            break;
+        case IOCTL_SET_LOG_BUFFERS_POLICY:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(LOG_BUFFERS_POLICY_REQUEST) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = LogSetOverflowPolicy(((PLOG_BUFFERS_POLICY_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Policy);
+            break;
+        case IOCTL_MAP_LOG_BUFFERS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(LOG_MAP_BUFFERS_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(LOG_MAPPED_BUFFERS_INFORMATION) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            //
+            // The input and output buffers are the same, so we copy the request first
+            //
+            MapRequest = *(PLOG_MAP_BUFFERS_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+            RtlZeroMemory(Irp->AssociatedIrp.SystemBuffer, sizeof(LOG_MAPPED_BUFFERS_INFORMATION));
+
+            Status = LogMapBuffersToUsermode(&MapRequest, (PLOG_MAPPED_BUFFERS_INFORMATION)Irp->AssociatedIrp.SystemBuffer, Irp->RequestorMode);
+
+            if (NT_SUCCESS(Status))
+            {
+                ReturnedLength = sizeof(LOG_MAPPED_BUFFERS_INFORMATION);
+            }
+            break;
+        case IOCTL_CONTROL_SAMPLING:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SAMPLING_CONTROL_REQUEST) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            SamplingRequest = *(PSAMPLING_CONTROL_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            if (SamplingRequest.Start)
+            {
+                Status = SamplingStart(SamplingRequest.Frequency == 0 ? SAMPLING_DEFAULT_FREQUENCY : SamplingRequest.Frequency);
+            }
+            else
+            {
+                SamplingStop();
+                Status = STATUS_SUCCESS;
+            }
+            break;
+        case IOCTL_READ_SAMPLES:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SAMPLING_READ_RESULT) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            ReturnedLength = sizeof(SAMPLING_READ_RESULT) +
+                             SamplingReadSamples((PSAMPLING_READ_RESULT)Irp->AssociatedIrp.SystemBuffer,
+                                                 (IrpStack->Parameters.DeviceIoControl.OutputBufferLength - sizeof(SAMPLING_READ_RESULT)) / sizeof(GUEST_RIP_SAMPLE)) *
+                                 sizeof(GUEST_RIP_SAMPLE);
+            Status = STATUS_SUCCESS;
+            break;
+        case IOCTL_DUMP_FLIGHT_RECORDER:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(VMEXIT_FLIGHT_RECORDER_DUMP) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = FlightRecorderDump((PVMEXIT_FLIGHT_RECORDER_DUMP)Irp->AssociatedIrp.SystemBuffer,
+                                        IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                        &DumpLength);
+
+            ReturnedLength = DumpLength;
+            break;
+        case IOCTL_EPT_HOOK_BATCH:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(EPT_HOOK_BATCH_REQUEST) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            HookBatchRequest = (PEPT_HOOK_BATCH_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+            HookBatchEntries = (PEPT_HOOK_BATCH_ENTRY)((UINT64)HookBatchRequest + sizeof(EPT_HOOK_BATCH_REQUEST));
+
+            if (HookBatchRequest->CountOfEntries == 0 || HookBatchRequest->CountOfEntries > EPT_HOOK_BATCH_MAXIMUM_ENTRIES ||
+                IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(EPT_HOOK_BATCH_REQUEST) + HookBatchRequest->CountOfEntries * sizeof(EPT_HOOK_BATCH_ENTRY) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(EPT_HOOK_BATCH_REQUEST) + HookBatchRequest->CountOfEntries * sizeof(EPT_HOOK_BATCH_ENTRY))
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            //
+            // The execution hooks need a kernel function, so the user-mode can
+            // only hook the read and write accesses
+            //
+            for (UINT32 i = 0; i < HookBatchRequest->CountOfEntries; i++)
+            {
+                HookBatchEntries[i].HookFunction = NULL;
+                HookBatchEntries[i].OrigFunction = NULL;
+            }
+
+            HookBatchRequest->CountOfSucceeded = EptPageHookBatch(HookBatchEntries, HookBatchRequest->CountOfEntries);
+
+            ReturnedLength = sizeof(EPT_HOOK_BATCH_REQUEST) + HookBatchRequest->CountOfEntries * sizeof(EPT_HOOK_BATCH_ENTRY);
+            Status         = STATUS_SUCCESS;
+            break;
+        case IOCTL_CONTROL_DIRTY_PAGE_TRACKING:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(DIRTY_PAGE_TRACKING_REQUEST) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            if (((PDIRTY_PAGE_TRACKING_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Start)
+            {
+                Status = PmlStart();
+            }
+            else
+            {
+                PmlStop();
+                Status = STATUS_SUCCESS;
+            }
+            break;
+        case IOCTL_QUERY_DIRTY_PAGES:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(DIRTY_PAGE_QUERY_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(DIRTY_PAGE_BITMAP) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            DirtyPageQueryRequest = *(PDIRTY_PAGE_QUERY_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            Status = PmlQueryDirtyPages((PDIRTY_PAGE_BITMAP)Irp->AssociatedIrp.SystemBuffer,
+                                        IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                        DirtyPageQueryRequest.Reset,
+                                        &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_CONTROL_ACCESS_AGGREGATION:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ACCESS_AGGREGATION_CONTROL_REQUEST) || Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            AggregationRequest = *(PACCESS_AGGREGATION_CONTROL_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            if (AggregationRequest.Start)
+            {
+                Status = AggregationStart(AggregationRequest.FlushPeriod);
+            }
+            else
+            {
+                AggregationStop();
+                Status = STATUS_SUCCESS;
+            }
+            break;
+        case IOCTL_QUERY_ACCESS_AGGREGATION:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ACCESS_AGGREGATION_QUERY_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ACCESS_AGGREGATION_RESULT) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            AggregationQueryRequest = *(PACCESS_AGGREGATION_QUERY_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            Status = AggregationQuery((PACCESS_AGGREGATION_RESULT)Irp->AssociatedIrp.SystemBuffer,
+                                      IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                      AggregationQueryRequest.Reset,
+                                      &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_QUERY_EVENT_STATISTICS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(DEBUGGER_EVENT_STATISTICS_RESULT) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = DebuggerQueryEventStatistics((PDEBUGGER_EVENT_STATISTICS_RESULT)Irp->AssociatedIrp.SystemBuffer,
+                                                  IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                                  &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_QUERY_POOL_STATISTICS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(POOL_MANAGER_STATISTICS) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            PoolManagerQueryStatistics((PPOOL_MANAGER_STATISTICS)Irp->AssociatedIrp.SystemBuffer);
+
+            Status         = STATUS_SUCCESS;
+            ReturnedLength = sizeof(POOL_MANAGER_STATISTICS);
+            break;
+        case IOCTL_SET_SYSCALL_HOOK_FILTER:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SYSCALL_HOOK_FILTER_REQUEST) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            SyscallHookSetFilter((PSYSCALL_HOOK_FILTER_REQUEST)Irp->AssociatedIrp.SystemBuffer);
+
+            Status = STATUS_SUCCESS;
+            break;
+        case IOCTL_CONTROL_SYSCALL_TRACE:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SYSCALL_TRACE_CONTROL_REQUEST) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            SyscallHookControlTrace((PSYSCALL_TRACE_CONTROL_REQUEST)Irp->AssociatedIrp.SystemBuffer);
+
+            Status = STATUS_SUCCESS;
+            break;
+        case IOCTL_QUERY_SYSCALL_SERVICE_TABLES:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SYSCALL_SERVICE_TABLES_RESULT) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = SyscallHookQueryServiceTables((PSYSCALL_SERVICE_TABLES_RESULT)Irp->AssociatedIrp.SystemBuffer,
+                                                   IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                                   &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_QUERY_STARTUP_TIMING:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(VMX_STARTUP_TIMING) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = HvQueryStartupTiming((PVMX_STARTUP_TIMING)Irp->AssociatedIrp.SystemBuffer,
+                                          IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                          &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_SUSPEND_VMX:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(VMX_SUSPEND_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(VMX_SUSPEND_REQUEST) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = HvControlVmxSuspension((PVMX_SUSPEND_REQUEST)Irp->AssociatedIrp.SystemBuffer);
+
+            ReturnedLength = sizeof(VMX_SUSPEND_REQUEST);
+            break;
+        case IOCTL_PERFORM_BENCHMARK:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(BENCHMARK_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(BENCHMARK_REQUEST) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            Status = BenchmarkPerform((PBENCHMARK_REQUEST)Irp->AssociatedIrp.SystemBuffer,
+                                      IrpStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                      &ResultLength);
+
+            ReturnedLength = ResultLength;
+            break;
+        case IOCTL_REGISTER_EVENT_BATCH:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(DEBUGGER_EVENT_BATCH_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.InputBufferLength > DEBUGGER_EVENT_BATCH_MAXIMUM_SIZE ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < IrpStack->Parameters.DeviceIoControl.InputBufferLength ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            EventBatchRequest = (PDEBUGGER_EVENT_BATCH_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            //
+            // The status of the batch and of each entry is in the buffer, so
+            // the buffer is returned even if the batch is not registered
+            //
+            EventBatchRequest->Status = DebuggerRegisterEventBatch(EventBatchRequest, IrpStack->Parameters.DeviceIoControl.InputBufferLength);
+
+            ReturnedLength = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
+            Status         = STATUS_SUCCESS;
+            break;
+        case IOCTL_GUEST_MEMORY_ACCESS:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(DEBUGGER_GUEST_MEMORY_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < IrpStack->Parameters.DeviceIoControl.InputBufferLength ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            GuestMemoryRequest = (PDEBUGGER_GUEST_MEMORY_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+
+            //
+            // The transferred length of each range is in the buffer, so the
+            // buffer is returned even if some of the ranges are not copied
+            //
+            GuestMemoryRequest->Status = GuestMemoryAccess(GuestMemoryRequest, IrpStack->Parameters.DeviceIoControl.InputBufferLength);
+
+            ReturnedLength = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
+            Status         = STATUS_SUCCESS;
+            break;
+        case IOCTL_LOG_SUBSCRIBE:
+            //
+            // First validate the parameters.
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(LOG_SUBSCRIPTION_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(LOG_SUBSCRIPTION_REQUEST) ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            SubscriptionRequest         = (PLOG_SUBSCRIPTION_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+            SubscriptionRequest->Status = LogSubscribe(SubscriptionRequest);
+
+            ReturnedLength = sizeof(LOG_SUBSCRIPTION_REQUEST);
+            Status         = STATUS_SUCCESS;
+            break;
+        case IOCTL_READ_SUBSCRIBED_LOG_BUFFERS:
+            //
+            // The buffer should be able to hold at least one packet of the maximum size
+            //
+            if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(LOG_SUBSCRIBER_READ_REQUEST) ||
+                IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(LOG_BATCH_PACKET_HEADER) + PacketChunkSize ||
+                Irp->AssociatedIrp.SystemBuffer == NULL)
+            {
+                Status = STATUS_INVALID_PARAMETER;
+                LogError("Invalid parameter to IOCTL Dispatcher.");
+                break;
+            }
+
+            //
+            // The input is overwritten by the packets, so the ID is read first
+            //
+            Status = LogRegisterIrpBasedNotification(DeviceObject,
+                                                     Irp,
+                                                     IRP_BASED_BATCH,
+                                                     ((PLOG_SUBSCRIBER_READ_REQUEST)Irp->AssociatedIrp.SystemBuffer)->SubscriberId);
+            break;
         default:
             LogError("Unknow IOCTL");
             Status = STATUS_NOT_IMPLEMENTED;
@@ -443,7 +1190,7 @@ DrvDispatchIoControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     if (Status != STATUS_PENDING)
     {
         Irp->IoStatus.Status      = Status;
-        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Information = ReturnedLength;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
     }
 
@@ -25,6 +25,8 @@
 #include "GlobalVariables.h"
 #include "Vmx.h"
 #include "Logging.h"
+#include "Debugger.h"
+#include "ExtensionCommands.h"
 
 /**
  * @brief As we have just on sysret in all the Windows,
@@ -124,6 +126,11 @@ SyscallHookConfigureEFER(BOOLEAN EnableEFERSyscallHook)
 
     MsrValue.Flags = __readmsr(MSR_EFER);
 
+    //
+    // Forget the classified #UDs of this core
+    //
+    RtlZeroMemory(g_GuestState[KeGetCurrentProcessorNumber()].DebuggingState.UdCache, sizeof(g_GuestState[0].DebuggingState.UdCache));
+
     if (EnableEFERSyscallHook)
     {
         MsrValue.SyscallEnable = FALSE;
@@ -205,7 +212,7 @@ BOOLEAN
 SyscallHookEmulateSYSCALL(PGUEST_REGS Regs)
 {
     SEGMENT_SELECTOR Cs, Ss;
-    UINT32           InstructionLength;
+    UINT64           InstructionLength;
     UINT64           MsrValue;
     ULONG64          GuestRip;
     ULONG64          GuestRflags;
@@ -213,17 +220,17 @@ SyscallHookEmulateSYSCALL(PGUEST_REGS Regs)
     //
     // Reading guest's RIP
     //
-    __vmx_vmread(GUEST_RIP, &GuestRip);
+    GuestRip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
 
     //
     // Reading instruction length
     //
-    __vmx_vmread(VM_EXIT_INSTRUCTION_LEN, &InstructionLength);
+    InstructionLength = HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH);
 
     //
     // Reading guest's Rflags
     //
-    __vmx_vmread(GUEST_RFLAGS, &GuestRflags);
+    GuestRflags = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS);
 
     //
     // Save the address of the instruction following SYSCALL into RCX and then
@@ -232,7 +239,7 @@ SyscallHookEmulateSYSCALL(PGUEST_REGS Regs)
     MsrValue  = __readmsr(MSR_LSTAR);
     Regs->rcx = GuestRip + InstructionLength;
     GuestRip  = MsrValue;
-    __vmx_vmwrite(GUEST_RIP, GuestRip);
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP, GuestRip);
 
     //
     // Save RFLAGS into R11 and then mask RFLAGS using MSR_FMASK
@@ -240,7 +247,7 @@ SyscallHookEmulateSYSCALL(PGUEST_REGS Regs)
     MsrValue  = __readmsr(MSR_FMASK);
     Regs->r11 = GuestRflags;
     GuestRflags &= ~(MsrValue | X86_FLAGS_RF);
-    __vmx_vmwrite(GUEST_RFLAGS, GuestRflags);
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS, GuestRflags);
 
     //
     // Load the CS and SS selectors with values derived from bits 47:32 of MSR_STAR
@@ -279,13 +286,13 @@ SyscallHookEmulateSYSRET(PGUEST_REGS Regs)
     // Load RIP from RCX
     //
     GuestRip = Regs->rcx;
-    __vmx_vmwrite(GUEST_RIP, GuestRip);
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP, GuestRip);
 
     //
     // Load RFLAGS from R11. Clear RF, VM, reserved bits
     //
     GuestRflags = (Regs->r11 & ~(X86_FLAGS_RF | X86_FLAGS_VM | X86_FLAGS_RESERVED_BITS)) | X86_FLAGS_FIXED;
-    __vmx_vmwrite(GUEST_RFLAGS, GuestRflags);
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS, GuestRflags);
 
     //
     // SYSRET loads the CS and SS selectors with values derived from bits 63:48 of MSR_STAR
@@ -307,80 +314,399 @@ SyscallHookEmulateSYSRET(PGUEST_REGS Regs)
 }
 
 /**
- * @brief Detect whether the #UD was because of Syscall or Sysret or not
- * 
- * @param Regs Guest register
- * @param CoreIndex Logical core index
- * @return BOOLEAN Shows whther the caller should inject #UD on the guest or not
+ * @brief Set the syscalls that trigger the SYSCALL_HOOK_EFER events
+ * @details The sequence is odd while the filter is copied, the cores read
+ * the filter again if it's changed while they're reading it (see
+ * SyscallHookIsFiltered), the IRQL is raised so the copy is not preempted
+ *
+ * @param Filter The syscall numbers and the process of the syscalls
+ * @return VOID
  */
-BOOLEAN
-SyscallHookHandleUD(PGUEST_REGS Regs, UINT32 CoreIndex)
+VOID
+SyscallHookSetFilter(PSYSCALL_HOOK_FILTER_REQUEST Filter)
 {
-    UINT64  GuestCr3;
-    UINT64  OriginalCr3;
-    UINT64  Rip;
-    BOOLEAN Result;
+    KIRQL OldIrql;
+    LONG  Sequence;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
 
     //
-    // Reading guest's RIP
-    __vmx_vmread(GUEST_RIP, &Rip);
+    // Make the sequence odd, it also serializes the concurrent requests
+    //
+    for (;;)
+    {
+        Sequence = SyscallHookFilterSequence;
+
+        if ((Sequence & 1) == 0 &&
+            InterlockedCompareExchange(&SyscallHookFilterSequence, Sequence + 1, Sequence) == Sequence)
+        {
+            break;
+        }
+
+        _mm_pause();
+    }
 
+    RtlCopyMemory(SyscallHookFilter.Bitmap, Filter->Bitmap, sizeof(SyscallHookFilter.Bitmap));
+    SyscallHookFilter.ProcessId            = Filter->ProcessId;
+    SyscallHookFilter.Cr3                  = Filter->Cr3 & ~0xfffULL;
+    SyscallHookFilter.FilterSyscallNumbers = Filter->FilterSyscallNumbers;
+
+    //
+    // The increment is a full barrier, so the filter is written before the
+    // sequence is even again
+    //
+    InterlockedIncrement(&SyscallHookFilterSequence);
+
+    KeLowerIrql(OldIrql);
+}
+
+/**
+ * @brief Start or stop the binary trace of the syscalls
+ * @details The EFER syscall hook is enabled on all the cores while the trace
+ * is active
+ *
+ * @param Request Whether to start or stop the trace
+ * @return VOID
+ */
+VOID
+SyscallHookControlTrace(PSYSCALL_TRACE_CONTROL_REQUEST Request)
+{
+    if (Request->Start)
+    {
+        SyscallTraceCaptureReturnValue = Request->CaptureReturnValue;
+
+        if (!InterlockedExchange(&SyscallTraceIsActive, TRUE))
+        {
+            RtlZeroMemory(SyscallTracePendingThreads, sizeof(SyscallTracePendingThreads));
+            ExtensionCommandEnableEferOnAllProcessors();
+        }
+    }
+    else if (InterlockedExchange(&SyscallTraceIsActive, FALSE))
+    {
+        ExtensionCommandDisableEferOnAllProcessors();
+    }
+}
+
+/**
+ * @brief Send the trace record of a syscall
+ * @details Should be called in vmx-root, the thread is added to the pending
+ * threads if the return value should be captured, the slot of the previous
+ * syscall of the thread is replaced (its sysret is missed, e.g. returned by
+ * iretq) and the slots of the threads that didn't return for a long time
+ * (e.g. terminated in the syscall) are reused
+ *
+ * @param Regs Guest registers at the syscall
+ * @param CoreIndex Logical core index
+ * @return VOID
+ */
+VOID
+SyscallHookTraceSyscall(PGUEST_REGS Regs, UINT32 CoreIndex)
+{
+    SYSCALL_TRACE_RECORD Record = {0};
+    UINT32               Index;
+    UINT32               Age;
+    volatile LONG64 *    FreeSlot = NULL;
+    LONG64               FreeSlotValue;
+    LONG64               Pending;
+
+    Record.TimeStampCounter = __rdtsc();
+    Record.Arguments[0]     = Regs->r10;
+    Record.Arguments[1]     = Regs->rdx;
+    Record.Arguments[2]     = Regs->r8;
+    Record.Arguments[3]     = Regs->r9;
+    Record.ProcessId        = (UINT32)(UINT64)PsGetCurrentProcessId();
+    Record.ThreadId         = (UINT32)(UINT64)PsGetCurrentThreadId();
+    Record.SyscallNumber    = (UINT32)Regs->rax;
+    Record.CoreId           = (UINT16)CoreIndex;
+
+    LogSendBuffer(OPERATION_LOG_SYSCALL_TRACE, &Record, sizeof(SYSCALL_TRACE_RECORD));
+
+    //
+    // The slots only keep 16 bits of the syscall number, the larger ones are
+    // not valid syscalls anyway
+    //
+    if (!SyscallTraceCaptureReturnValue || Record.SyscallNumber > 0xffff)
+    {
+        return;
+    }
 
+    Index = Record.ThreadId * 0x9E3779B9;
+    Age   = (UINT32)(Record.TimeStampCounter >> SYSCALL_TRACE_PENDING_AGE_SHIFT);
 
-    if (g_GuestState[CoreIndex].DebuggingState.SysretAddress == NULL && Rip & 0xff00000000000000)
+    for (UINT32 i = 0; i < SYSCALL_TRACE_PENDING_PROBES; i++)
     {
+        volatile LONG64 * Slot = &SyscallTracePendingThreads[(Index + i) & (SYSCALL_TRACE_PENDING_THREADS - 1)];
+
+        Pending = *Slot;
+
         //
-        // Find the address of sysret
+        // Only this thread changes its own slot (other than the reuse of the
+        // old slots), so it's replaced without checking the others
         //
-        // Due to KVA Shadowing, we need to switch to a different directory table base
-        // if the PCID indicates this is a user mode directory table base
+        if (Pending != 0 && (UINT32)((UINT64)Pending >> 32) == Record.ThreadId)
+        {
+            InterlockedCompareExchange64(Slot, SYSCALL_TRACE_PENDING_SLOT(Record.ThreadId, Age, Record.SyscallNumber), Pending);
+            return;
+        }
+
+        if (FreeSlot == NULL &&
+            (Pending == 0 || ((Age - (UINT32)((UINT64)Pending >> 16)) & 0xffff) > SYSCALL_TRACE_PENDING_MAXIMUM_AGE))
+        {
+            FreeSlot      = Slot;
+            FreeSlotValue = Pending;
+        }
+    }
+
+    //
+    // If no slot is free, the return of this syscall is not traced
+    //
+    if (FreeSlot != NULL)
+    {
+        InterlockedCompareExchange64(FreeSlot, SYSCALL_TRACE_PENDING_SLOT(Record.ThreadId, Age, Record.SyscallNumber), FreeSlotValue);
+    }
+}
+
+/**
+ * @brief Send the trace record of a sysret if its syscall is traced
+ * @details Should be called in vmx-root
+ *
+ * @param Regs Guest registers at the sysret
+ * @param CoreIndex Logical core index
+ * @return VOID
+ */
+static VOID
+SyscallHookTraceSysret(PGUEST_REGS Regs, UINT32 CoreIndex)
+{
+    SYSCALL_TRACE_RECORD Record   = {0};
+    UINT32               ThreadId = (UINT32)(UINT64)PsGetCurrentThreadId();
+    UINT32               Index    = ThreadId * 0x9E3779B9;
+    LONG64               Pending;
+
+    for (UINT32 i = 0; i < SYSCALL_TRACE_PENDING_PROBES; i++)
+    {
+        volatile LONG64 * Slot = &SyscallTracePendingThreads[(Index + i) & (SYSCALL_TRACE_PENDING_THREADS - 1)];
+
+        Pending = *Slot;
+
+        if (Pending == 0 || (UINT32)((UINT64)Pending >> 32) != ThreadId ||
+            InterlockedCompareExchange64(Slot, 0, Pending) != Pending)
+        {
+            continue;
+        }
+
+        Record.TimeStampCounter = __rdtsc();
+        Record.ReturnValue      = Regs->rax;
+        Record.ProcessId        = (UINT32)(UINT64)PsGetCurrentProcessId();
+        Record.ThreadId         = ThreadId;
+        Record.SyscallNumber    = (UINT32)Pending & 0xffff;
+        Record.CoreId           = (UINT16)CoreIndex;
+        Record.IsReturn         = TRUE;
+
+        LogSendBuffer(OPERATION_LOG_SYSCALL_TRACE, &Record, sizeof(SYSCALL_TRACE_RECORD));
+        return;
+    }
+}
+
+/**
+ * @brief Check whether a syscall should trigger the events
+ * @details Should be called in vmx-root, the parts of the filter that are
+ * used are read again if the filter is changed while they're read
+ *
+ * @param SyscallNumber The syscall number (RAX of the guest)
+ * @return BOOLEAN TRUE if the syscall matches the filter
+ */
+static BOOLEAN
+SyscallHookIsFiltered(UINT64 SyscallNumber)
+{
+    UINT64  GuestCr3;
+    LONG    Sequence;
+    BOOLEAN IsSyscallNumberMatched;
+    UINT32  ProcessId;
+    UINT64  Cr3;
+
+    for (;;)
+    {
+        Sequence = SyscallHookFilterSequence;
+
+        if (Sequence & 1)
+        {
+            _mm_pause();
+            continue;
+        }
+
+        _ReadWriteBarrier();
+
+        IsSyscallNumberMatched = !SyscallHookFilter.FilterSyscallNumbers ||
+                                 (SyscallNumber < SYSCALL_HOOK_FILTER_MAXIMUM_SYSCALLS &&
+                                  (SyscallHookFilter.Bitmap[SyscallNumber / 8] & (1 << (SyscallNumber % 8))));
+        ProcessId              = SyscallHookFilter.ProcessId;
+        Cr3                    = SyscallHookFilter.Cr3;
+
         //
-        __vmx_vmread(GUEST_CR3, &GuestCr3);
+        // Loads are not reordered with other loads on x64, so the compiler
+        // barrier is enough
+        //
+        _ReadWriteBarrier();
+
+        if (Sequence == SyscallHookFilterSequence)
+        {
+            break;
+        }
+    }
+
+    if (!IsSyscallNumberMatched)
+    {
+        return FALSE;
+    }
 
-        OriginalCr3                  = __readcr3();
-        NT_KPROCESS * CurrentProcess = (NT_KPROCESS *)(PsGetCurrentProcess());
-        __writecr3(CurrentProcess->DirectoryTableBase);
+    if (ProcessId != 0 && ProcessId != (UINT32)(UINT64)PsGetCurrentProcessId())
+    {
+        return FALSE;
+    }
 
-        if (IS_SYSRET_INSTRUCTION(Rip))
+    if (Cr3 != 0)
+    {
+        __vmx_vmread(GUEST_CR3, &GuestCr3);
+
+        //
+        // The PCID bits are ignored
+        //
+        if ((GuestCr3 & ~0xfffULL) != Cr3)
         {
-            __writecr3(OriginalCr3);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Find the type of the instruction that caused #UD
+ * @details The instructions are read by the page tables of the guest (without
+ * changing cr3) and their types are cached. The user-mode instructions are
+ * only cached if they're syscall, others usually terminate their process
+ * and their address might be reused by another code, they're cached with
+ * the generation of the processes as the cr3 might be reused by another process
+ *
+ * @param CoreIndex Logical core index
+ * @param Rip Address of the instruction
+ * @param GuestCr3 The cr3 of the guest
+ * @return UD_INSTRUCTION_TYPE
+ */
+static UD_INSTRUCTION_TYPE
+SyscallHookClassifyUD(UINT32 CoreIndex, UINT64 Rip, UINT64 GuestCr3)
+{
+    PDEBUGGER_UD_CACHE_ENTRY Entry;
+    UD_INSTRUCTION_TYPE      Type;
+    UINT8                    Code[3];
+    BOOLEAN                  IsKernel   = (Rip & 0xff00000000000000) != 0;
+    UINT64                   Cr3        = IsKernel ? 0 : GuestCr3 & PAGE_TABLE_ENTRY_ADDRESS_MASK;
+    LONG                     Generation = IsKernel ? 0 : SyscallHookProcessGeneration;
+
+    Entry = &g_GuestState[CoreIndex].DebuggingState.UdCache[(((Rip ^ Cr3) * 0x9E3779B97F4A7C15ULL) >> 32) & (DEBUGGER_UD_CACHE_SIZE - 1)];
+
+    if (Entry->Type != UD_INSTRUCTION_UNKNOWN && Entry->Rip == Rip && Entry->Cr3 == Cr3 && Entry->Generation == Generation)
+    {
+        return Entry->Type;
+    }
+
+    if (IsKernel)
+    {
+        Type = ReadGuestVirtualMemory(GuestCr3, Rip, Code, 3) && IS_SYSRET_INSTRUCTION(Code) ? UD_INSTRUCTION_SYSRET : UD_INSTRUCTION_OTHER;
 
+        if (Type == UD_INSTRUCTION_SYSRET)
+        {
             //
             // Save the address of Sysret, it won't change
             //
             g_GuestState[CoreIndex].DebuggingState.SysretAddress = Rip;
         }
-        __writecr3(OriginalCr3);
     }
-
-    if (Rip == g_GuestState[CoreIndex].DebuggingState.SysretAddress)
+    else if (ReadGuestVirtualMemory(GuestCr3, Rip, Code, 2))
     {
+        Type = IS_SYSCALL_INSTRUCTION(Code) ? UD_INSTRUCTION_SYSCALL : UD_INSTRUCTION_OTHER;
+
         //
-        // It's a sysret instruction, let's emulate it
+        // Without the generations, the cr3 of an exited process might be
+        // reused, so nothing is cached
         //
-        goto EmulateSYSRET;
+        if (Type == UD_INSTRUCTION_OTHER || !SyscallHookIsProcessNotifyRegistered)
+        {
+            return Type;
+        }
     }
-    else if (Rip & 0xff00000000000000)
+    else
     {
         //
-        // It's a #UD in kernel, not relate to us
-        // this way the caller injects a #UD
+        // The page is just executed, so it's not expected, anyway it's treated
+        // as a syscall without caching it
         //
-        return FALSE;
+        return UD_INSTRUCTION_SYSCALL;
     }
-    else
+
+    Entry->Rip        = Rip;
+    Entry->Cr3        = Cr3;
+    Entry->Generation = Generation;
+    Entry->Type       = Type;
+
+    return Type;
+}
+
+/**
+ * @brief Detect whether the #UD was because of Syscall or Sysret or not
+ * 
+ * @param Regs Guest register
+ * @param CoreIndex Logical core index
+ * @return BOOLEAN Shows whther the caller should inject #UD on the guest or not
+ */
+BOOLEAN
+SyscallHookHandleUD(PGUEST_REGS Regs, UINT32 CoreIndex)
+{
+    UINT64  GuestCr3;
+    UINT64  Rip;
+    BOOLEAN Result;
+
+    //
+    // Reading guest's RIP
+    //
+    Rip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+
+    //
+    // Most of the #UDs are the sysret, so it's checked before the cache
+    //
+    if (Rip == g_GuestState[CoreIndex].DebuggingState.SysretAddress)
+    {
+        goto EmulateSYSRET;
+    }
+
+    __vmx_vmread(GUEST_CR3, &GuestCr3);
+
+    switch (SyscallHookClassifyUD(CoreIndex, Rip, GuestCr3))
     {
+    case UD_INSTRUCTION_SYSRET:
         //
-        // It's sth in usermode, might be a syscall
+        // It's a sysret instruction, let's emulate it
         //
+        goto EmulateSYSRET;
+    case UD_INSTRUCTION_SYSCALL:
         goto EmulateSYSCALL;
+    default:
+        //
+        // It's a #UD not relate to us
+        // this way the caller injects a #UD
+        //
+        return FALSE;
     }
 
     //
     // Emulate SYSRET instruction
     //
 EmulateSYSRET:
-    LogInfo("SYSRET instruction => 0x%llX", Rip);
+    if (SyscallTraceIsActive && SyscallTraceCaptureReturnValue)
+    {
+        SyscallHookTraceSysret(Regs, CoreIndex);
+    }
+
     Result                               = SyscallHookEmulateSYSRET(Regs);
     g_GuestState[CoreIndex].IncrementRip = FALSE;
     return Result;
@@ -388,13 +714,24 @@ EmulateSYSRET:
     // Emulate SYSCALL instruction
     //
 EmulateSYSCALL:
+    //
+    // Only the syscalls that match the filter trigger the events, the
+    // others are emulated without anything else
+    //
+    if (SyscallHookIsFiltered(Regs->rax))
+    {
+        if (SyscallTraceIsActive)
+        {
+            SyscallHookTraceSyscall(Regs, CoreIndex);
+        }
+
+        DebuggerTriggerEvents(SYSCALL_HOOK_EFER, Regs, (PVOID)Regs->rax);
+    }
+
     //
     // We don't emulate the syscalls anymore because
     // The usermode code might be paged out
     Result = SyscallHookEmulateSYSCALL(Regs);
-    LogInfo("SYSCALL instruction => 0x%llX , process id : 0x%x",
-            Rip,
-            PsGetCurrentProcessId());
     //
     //SyscallHookEnableSCE();
     //HvSetMonitorTrapFlag(TRUE);
@@ -18,6 +18,10 @@
 #include "Invept.h"
 #include "HypervisorRoutines.h"
 #include "Vmcall.h"
+#include "Broadcast.h"
+#include "Trampoline.h"
+#include "Ve.h"
+#include "Aggregation.h"
 #include "PoolManager.h"
 #include "Hooks.h"
 #include "LengthDisassemblerEngine.h"
@@ -57,6 +61,71 @@ EptCheckFeatures()
         g_ExecuteOnlySupport = TRUE;
     }
 
+    if (!VpidRegister.Pdpte1GbPages)
+    {
+        g_Pdpte1GbPagesSupport = FALSE;
+        LogWarning("The processor doesn't support 1GB pages in EPT, all the memory is mapped using 2MB pages");
+    }
+    else
+    {
+        g_Pdpte1GbPagesSupport = TRUE;
+    }
+
+    //
+    // EPTP switching (VM function 0) lets the guest switch between the views
+    // of EPT without a vm-exit, the allowed 1-settings are in the high 32 bits
+    //
+    if (((__readmsr(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32) & CPU_BASED_CTL2_ENABLE_VMFUNC) &&
+        (__readmsr(MSR_IA32_VMX_VMFUNC) & 1))
+    {
+        g_EptpSwitchingSupport = TRUE;
+    }
+    else
+    {
+        g_EptpSwitchingSupport = FALSE;
+        LogWarning("The processor doesn't support EPTP switching, the views of EPT are only switched in vmx-root");
+    }
+
+    //
+    // Sub-page write permissions let the write watches of a byte range only
+    // cause vm-exit for the writes to the 128-byte sub-pages of the range
+    //
+    if (((__readmsr(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32) & CPU_BASED_CTL2_SUB_PAGE_WRITE_PERMISSIONS))
+    {
+        g_SppSupport = TRUE;
+    }
+    else
+    {
+        g_SppSupport = FALSE;
+        LogWarning("The processor doesn't support sub-page write permissions, the write watches of a byte range are filtered in vmx-root");
+    }
+
+    //
+    // The translations without the global ones are only invalidated if the
+    // type is supported, INVVPID needs VPID
+    //
+    if (VpidRegister.Invvpid && ((__readmsr(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32) & CPU_BASED_CTL2_ENABLE_VPID))
+    {
+        g_InvvpidSingleContextRetainingGlobalsSupport = VpidRegister.InvvpidSingleContextRetainGlobals;
+    }
+    else
+    {
+        g_InvvpidSingleContextRetainingGlobalsSupport = FALSE;
+    }
+
+    //
+    // Page-modification logging needs the dirty flags of EPT
+    //
+    if (VpidRegister.EptAccessedAndDirtyFlags && ((__readmsr(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32) & CPU_BASED_CTL2_ENABLE_PML))
+    {
+        g_PmlSupport = TRUE;
+    }
+    else
+    {
+        g_PmlSupport = FALSE;
+        LogWarning("The processor doesn't support page-modification logging, the dirty pages can't be tracked");
+    }
+
     if (!MTRRDefType.MtrrEnable)
     {
         LogError("Mtrr Dynamic Ranges not supported");
@@ -169,6 +238,14 @@ EptGetPml1Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress)
         return NULL;
     }
 
+    //
+    // Check to ensure the 1GB page is split
+    //
+    if (!EptPageTable->PML2[DirectoryPointer])
+    {
+        return NULL;
+    }
+
     PML2 = &EptPageTable->PML2[DirectoryPointer][Directory];
 
     //
@@ -208,7 +285,7 @@ EptGetPml1Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress)
  * 
  * @param EptPageTable The EPT Page Table
  * @param PhysicalAddress Physical Address that we want to get its PML2
- * @return PEPT_PML2_ENTRY 
+ * @return PEPT_PML2_ENTRY Return NULL if the address is invalid or the 1GB page wasn't already split
  */
 PEPT_PML2_ENTRY
 EptGetPml2Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress)
@@ -223,7 +300,7 @@ EptGetPml2Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress)
     //
     // Addresses above 512GB are invalid because it is > physical address bus width
     //
-    if (PML4Entry > 0)
+    if (PML4Entry > 0 || !EptPageTable->PML2[DirectoryPointer])
     {
         return NULL;
     }
@@ -244,11 +321,7 @@ EptGetPml2Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress)
 BOOLEAN
 EptSplitLargePage(PVMM_EPT_PAGE_TABLE EptPageTable, PVOID PreAllocatedBuffer, SIZE_T PhysicalAddress, ULONG CoreIndex)
 {
-    PVMM_EPT_DYNAMIC_SPLIT NewSplit;
-    EPT_PML1_ENTRY         EntryTemplate;
-    SIZE_T                 EntryIndex;
-    PEPT_PML2_ENTRY        TargetEntry;
-    EPT_PML2_POINTER       NewPointer;
+    PEPT_PML2_ENTRY TargetEntry;
 
     //
     // Find the PML2 entry that's currently used
@@ -260,6 +333,24 @@ EptSplitLargePage(PVMM_EPT_PAGE_TABLE EptPageTable, PVOID PreAllocatedBuffer, SI
         return FALSE;
     }
 
+    return EptSplitPml2Entry(TargetEntry, PreAllocatedBuffer);
+}
+
+/**
+ * @brief Split a 2MB (LargePage) entry into 4kb pages
+ * 
+ * @param TargetEntry The PML2 entry (of the global page table or a core view)
+ * @param PreAllocatedBuffer The address of pre-allocated buffer
+ * @return BOOLEAN Returns true if it was successfull or false if there was an error
+ */
+BOOLEAN
+EptSplitPml2Entry(PEPT_PML2_ENTRY TargetEntry, PVOID PreAllocatedBuffer)
+{
+    PVMM_EPT_DYNAMIC_SPLIT NewSplit;
+    EPT_PML1_ENTRY         EntryTemplate;
+    SIZE_T                 EntryIndex;
+    EPT_PML2_POINTER       NewPointer;
+
     //
     // If this large page is not marked a large page, that means it's a pointer already.
     // That page is therefore already split.
@@ -286,6 +377,11 @@ EptSplitLargePage(PVMM_EPT_PAGE_TABLE EptPageTable, PVOID PreAllocatedBuffer, SI
     //
     NewSplit->Entry = TargetEntry;
 
+    //
+    // Keep the large page entry, it's restored when there is no hook on this 2MB
+    //
+    NewSplit->OriginalEntry = *TargetEntry;
+
     //
     // Make a template for RWX
     //
@@ -327,6 +423,158 @@ EptSplitLargePage(PVMM_EPT_PAGE_TABLE EptPageTable, PVOID PreAllocatedBuffer, SI
     return TRUE;
 }
 
+/**
+ * @brief Split a 1GB (LargePage) of the global page table into 2MB pages
+ * @details Should be called from vmx-root (or before launching the VM), the
+ * views map the new table too as they don't have a private table for a 1GB page
+ * 
+ * @param PhysicalAddress Physical address of where we want to split
+ * @return BOOLEAN Returns true if it was successfull or false if there was an error
+ */
+static BOOLEAN
+EptSplit1GbPage(SIZE_T PhysicalAddress)
+{
+    SIZE_T              Pml3Index      = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
+    PVMM_EPT_PAGE_TABLE PageTable      = g_EptState->EptPageTable;
+    ULONG               ProcessorCount = KeQueryActiveProcessorCount(0);
+    PVMM_EPT_PML2_TABLE NewTable;
+    EPT_PML2_ENTRY      EntryTemplate;
+    EPT_PML3_POINTER    NewPointer;
+    SIZE_T              EntryIndex;
+
+    //
+    // Addresses above 512GB are invalid because it is > physical address bus width
+    //
+    if (ADDRMASK_EPT_PML4_INDEX(PhysicalAddress) > 0)
+    {
+        LogError("An invalid physical address passed");
+        return FALSE;
+    }
+
+    //
+    // If there is a table, then the 1GB is already mapped using 2MB pages
+    //
+    if (PageTable->PML2[Pml3Index])
+    {
+        return TRUE;
+    }
+
+    NewTable = PoolManagerRequestPool(SPLIT_1GB_PAGING_TO_2MB_PAGE, TRUE, sizeof(VMM_EPT_PML2_TABLE));
+
+    if (!NewTable)
+    {
+        LogError("There is no pre-allocated buffer available");
+        return FALSE;
+    }
+
+    //
+    // The 2MB pages have the same memory type as the 1GB page
+    //
+    EntryTemplate.Flags         = 0;
+    EntryTemplate.ReadAccess    = 1;
+    EntryTemplate.WriteAccess   = 1;
+    EntryTemplate.ExecuteAccess = 1;
+    EntryTemplate.LargePage     = 1;
+    EntryTemplate.MemoryType    = ((PEPT_PML3_ENTRY)&PageTable->PML3[Pml3Index])->MemoryType;
+
+    __stosq((SIZE_T *)&NewTable->PML2[0], EntryTemplate.Flags, VMM_EPT_PML2E_COUNT);
+
+    for (EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
+    {
+        NewTable->PML2[EntryIndex].PageFrameNumber = (Pml3Index * VMM_EPT_PML2E_COUNT) + EntryIndex;
+    }
+
+    NewPointer.Flags           = 0;
+    NewPointer.ReadAccess      = 1;
+    NewPointer.WriteAccess     = 1;
+    NewPointer.ExecuteAccess   = 1;
+    NewPointer.PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&NewTable->PML2[0]) / PAGE_SIZE;
+
+    //
+    // The table is filled before replacing the 1GB entry
+    //
+    PageTable->PML2[Pml3Index]       = &NewTable->PML2[0];
+    PageTable->PML3[Pml3Index].Flags = NewPointer.Flags;
+
+    if (g_EptState->CoreViews)
+    {
+        for (size_t i = 0; i < ProcessorCount; i++)
+        {
+            g_EptState->CoreViews[i].PML2[Pml3Index]       = &NewTable->PML2[0];
+            g_EptState->CoreViews[i].PML3[Pml3Index].Flags = NewPointer.Flags;
+        }
+    }
+
+    if (g_EptState->CleanView)
+    {
+        g_EptState->CleanView->PML2[Pml3Index]       = &NewTable->PML2[0];
+        g_EptState->CleanView->PML3[Pml3Index].Flags = NewPointer.Flags;
+    }
+
+    if (g_EptState->DisarmedView)
+    {
+        g_EptState->DisarmedView->PML2[Pml3Index]       = &NewTable->PML2[0];
+        g_EptState->DisarmedView->PML3[Pml3Index].Flags = NewPointer.Flags;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Get the memory type of a 1GB page if all of its 2MB pages have the same type
+ * @details The memory type of each 2MB page is computed by EptSetupPML2Entry, the
+ * 2MB pages have the same type if there is no MTRR range that covers a part of the 1GB
+ * 
+ * @param PageFrameNumber PFN of the 1GB page (Physical Address / 1GB)
+ * @param MemoryType The memory type of the 1GB page
+ * @return BOOLEAN Returns false if the 1GB should be mapped using 2MB pages
+ */
+static BOOLEAN
+EptGetMemoryTypeOf1GbPage(SIZE_T PageFrameNumber, PUCHAR MemoryType)
+{
+    SIZE_T AddressOfPage    = PageFrameNumber * SIZE_1_GB;
+    SIZE_T TargetMemoryType = MEMORY_TYPE_WRITE_BACK;
+    SIZE_T CurrentMtrrRange;
+
+    //
+    // The first 2MB page is UC, so the first 1GB is always split
+    //
+    if (!g_Pdpte1GbPagesSupport || PageFrameNumber == 0)
+    {
+        return FALSE;
+    }
+
+    for (CurrentMtrrRange = 0; CurrentMtrrRange < g_EptState->NumberOfEnabledMemoryRanges; CurrentMtrrRange++)
+    {
+        if (AddressOfPage <= g_EptState->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress &&
+            (AddressOfPage + SIZE_1_GB - 1) >= g_EptState->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress)
+        {
+            //
+            // The range covers only some of the 2MB pages
+            //
+            if (AddressOfPage < g_EptState->MemoryRanges[CurrentMtrrRange].PhysicalBaseAddress ||
+                (AddressOfPage + SIZE_1_GB - 1) > g_EptState->MemoryRanges[CurrentMtrrRange].PhysicalEndAddress)
+            {
+                return FALSE;
+            }
+
+            TargetMemoryType = g_EptState->MemoryRanges[CurrentMtrrRange].MemoryType;
+
+            //
+            // 11.11.4.1 MTRR Precedences
+            //
+            if (TargetMemoryType == MEMORY_TYPE_UNCACHEABLE)
+            {
+                break;
+            }
+        }
+    }
+
+    *MemoryType = (UCHAR)TargetMemoryType;
+
+    return TRUE;
+}
+
 /**
  * @brief Set up PML2 Entries
  * 
@@ -419,6 +667,9 @@ EptSetupPML2Entry(PEPT_PML2_ENTRY NewEntry, SIZE_T PageFrameNumber)
 
 /**
  * @brief Allocates page maps and create identity page table
+ * @details The 1GB regions that all of their 2MB pages have the same memory type
+ * are mapped as 1GB pages, the tables of 2MB pages of the other regions are
+ * allocated by the pool manager
  * 
  * @return PVMM_EPT_PAGE_TABLE 
  */
@@ -426,10 +677,15 @@ PVMM_EPT_PAGE_TABLE
 EptAllocateAndCreateIdentityPageTable()
 {
     PVMM_EPT_PAGE_TABLE PageTable;
+    PVMM_EPT_PML2_TABLE PML2Table;
     EPT_PML3_POINTER    RWXTemplate;
+    EPT_PML3_ENTRY      PML3EntryTemplate;
+    EPT_PML3_ENTRY      PML3Entry;
     EPT_PML2_ENTRY      PML2EntryTemplate;
     SIZE_T              EntryGroupIndex;
     SIZE_T              EntryIndex;
+    UCHAR               MemoryType;
+    UINT32              CountOfSplitPages = 0;
 
     //
     // Allocate all paging structures as 4KB aligned pages
@@ -465,38 +721,28 @@ EptAllocateAndCreateIdentityPageTable()
     PageTable->PML4[0].ExecuteAccess   = 1;
 
     //
-    // Now mark each 1GB PML3 entry as RWX and map each to their PML2 entry
+    // Now mark each 1GB PML3 entry as RWX and either map it to its PML2 entries
+    // or map it as a 1GB page
     //
 
     //
     // Ensure stack memory is cleared
     //
-    RWXTemplate.Flags = 0;
+    RWXTemplate.Flags       = 0;
+    PML3EntryTemplate.Flags = 0;
 
     //
-    // Set up one 'template' RWX PML3 entry and copy it into each of the 512 PML3 entries
-    // Using the same method as SimpleVisor for copying each entry using intrinsics.
+    // Set up one 'template' RWX PML3 entry for the pointers to PML2 tables and
+    // one for the 1GB pages
     //
     RWXTemplate.ReadAccess    = 1;
     RWXTemplate.WriteAccess   = 1;
     RWXTemplate.ExecuteAccess = 1;
 
-    //
-    // Copy the template into each of the 512 PML3 entry slots
-    //
-    __stosq((SIZE_T *)&PageTable->PML3[0], RWXTemplate.Flags, VMM_EPT_PML3E_COUNT);
-
-    //
-    // For each of the 512 PML3 entries
-    //
-    for (EntryIndex = 0; EntryIndex < VMM_EPT_PML3E_COUNT; EntryIndex++)
-    {
-        //
-        // Map the 1GB PML3 entry to 512 PML2 (2MB) entries to describe each large page.
-        // NOTE: We do *not* manage any PML1 (4096 byte) entries and do not allocate them.
-        //
-        PageTable->PML3[EntryIndex].PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&PageTable->PML2[EntryIndex][0]) / PAGE_SIZE;
-    }
+    PML3EntryTemplate.ReadAccess    = 1;
+    PML3EntryTemplate.WriteAccess   = 1;
+    PML3EntryTemplate.ExecuteAccess = 1;
+    PML3EntryTemplate.LargePage     = 1;
 
     PML2EntryTemplate.Flags = 0;
 
@@ -512,32 +758,182 @@ EptAllocateAndCreateIdentityPageTable()
     //
     PML2EntryTemplate.LargePage = 1;
 
-    /* For each collection of 512 PML2 entries (512 collections * 512 entries per collection), mark it RWX using the same template above.
-	   This marks the entries as "Present" regardless of if the actual system has memory at this region or not. We will cause a fault in our
-	   EPT handler if the guest access a page outside a usable range, despite the EPT frame being present here.
-	 */
-    __stosq((SIZE_T *)&PageTable->PML2[0], PML2EntryTemplate.Flags, VMM_EPT_PML3E_COUNT * VMM_EPT_PML2E_COUNT);
-
     //
-    // For each of the 512 collections of 512 2MB PML2 entries
+    // Allocate the tables of the 1GB regions that can't be mapped as 1GB pages
     //
     for (EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
     {
+        if (!EptGetMemoryTypeOf1GbPage(EntryGroupIndex, &MemoryType))
+        {
+            CountOfSplitPages++;
+        }
+    }
+
+    if (CountOfSplitPages != 0)
+    {
+        PoolManagerRequestAllocation(sizeof(VMM_EPT_PML2_TABLE), CountOfSplitPages, SPLIT_1GB_PAGING_TO_2MB_PAGE);
+        PoolManagerCheckAndPerformAllocation();
+    }
+
+    /* Every entry is marked as "Present" regardless of if the actual system has memory at this region or not. We will cause a fault in our
+	   EPT handler if the guest access a page outside a usable range, despite the EPT frame being present here.
+	 */
+    for (EntryGroupIndex = 0; EntryGroupIndex < VMM_EPT_PML3E_COUNT; EntryGroupIndex++)
+    {
+        if (EptGetMemoryTypeOf1GbPage(EntryGroupIndex, &MemoryType))
+        {
+            //
+            // Map the 1GB as a large page, it's split when it's hooked
+            //
+            PML3Entry                 = PML3EntryTemplate;
+            PML3Entry.MemoryType      = MemoryType;
+            PML3Entry.PageFrameNumber = EntryGroupIndex;
+
+            PageTable->PML3[EntryGroupIndex].Flags = PML3Entry.Flags;
+            continue;
+        }
+
+        PML2Table = PoolManagerRequestPool(SPLIT_1GB_PAGING_TO_2MB_PAGE, FALSE, 0);
+
+        if (PML2Table == NULL)
+        {
+            LogError("Failed to allocate memory for PageTable");
+            MmFreeContiguousMemory(PageTable);
+            return NULL;
+        }
+
         //
-        // For each 2MB PML2 entry in the collection
+        // Map the 1GB PML3 entry to 512 PML2 (2MB) entries to describe each large page.
+        // NOTE: We do *not* manage any PML1 (4096 byte) entries and do not allocate them.
         //
+        __stosq((SIZE_T *)&PML2Table->PML2[0], PML2EntryTemplate.Flags, VMM_EPT_PML2E_COUNT);
+
         for (EntryIndex = 0; EntryIndex < VMM_EPT_PML2E_COUNT; EntryIndex++)
         {
             //
             // Setup the memory type and frame number of the PML2 entry
             //
-            EptSetupPML2Entry(&PageTable->PML2[EntryGroupIndex][EntryIndex], (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex);
+            EptSetupPML2Entry(&PML2Table->PML2[EntryIndex], (EntryGroupIndex * VMM_EPT_PML2E_COUNT) + EntryIndex);
         }
+
+        PageTable->PML2[EntryGroupIndex]                 = &PML2Table->PML2[0];
+        PageTable->PML3[EntryGroupIndex].Flags           = RWXTemplate.Flags;
+        PageTable->PML3[EntryGroupIndex].PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&PML2Table->PML2[0]) / PAGE_SIZE;
     }
 
     return PageTable;
 }
 
+/**
+ * @brief Allocate the root of the sub-page permission table (SPPT)
+ * @details The other tables of SPPT are requested from the pool manager when
+ * a page is watched, if it fails then the write watches are filtered in vmx-root
+ * 
+ * @return VOID 
+ */
+static VOID
+EptSppInitialize()
+{
+    g_EptState->SppTable = NULL;
+
+    if (!g_SppSupport)
+    {
+        return;
+    }
+
+    g_EptState->SppTable = ExAllocatePoolWithTag(NonPagedPool, sizeof(VMM_EPT_SPP_TABLE), POOLTAG);
+
+    if (!g_EptState->SppTable)
+    {
+        LogWarning("Unable to allocate memory for the sub-page permission table, the write watches of a byte range are filtered in vmx-root");
+        return;
+    }
+
+    RtlZeroMemory(g_EptState->SppTable, sizeof(VMM_EPT_SPP_TABLE));
+
+    //
+    // Each page needs at most three tables of SPPT (the next pages of the same
+    // 2MB region use the same tables)
+    //
+    PoolManagerRequestAllocation(sizeof(VMM_EPT_SPP_TABLE), 10, SPP_TABLE);
+    PoolManagerCheckAndPerformAllocation();
+}
+
+/**
+ * @brief Get the write permissions of the sub-pages of a page for a write watch
+ * @details Bit 2 * i allows the writes to the sub-page i, so the sub-pages that
+ * have a byte of the watched range are not writable
+ * 
+ * @param WatchStart The offset of the first watched byte in the page
+ * @param WatchEnd The offset after the last watched byte in the page
+ * @return UINT64 The leaf entry of SPPT
+ */
+static UINT64
+EptSppGetWritePermissions(UINT32 WatchStart, UINT32 WatchEnd)
+{
+    UINT64 WritePermissions = 0;
+
+    for (UINT32 i = 0; i < EPT_SPP_SUBPAGES_PER_PAGE; i++)
+    {
+        UINT32 SubPageStart = i * EPT_SPP_SUBPAGE_SIZE;
+
+        if (SubPageStart + EPT_SPP_SUBPAGE_SIZE <= WatchStart || SubPageStart >= WatchEnd)
+        {
+            WritePermissions |= 1ULL << (i * 2);
+        }
+    }
+
+    return WritePermissions;
+}
+
+/**
+ * @brief Set the write permissions of the sub-pages of a page in SPPT
+ * @details Should be called from vmx-root (or before launching the VM), the
+ * missing tables are received from the pool manager
+ * 
+ * @param PhysicalAddress The physical address of the page
+ * @param WritePermissions The leaf entry of the page
+ * @return BOOLEAN Returns false if there is no pre-allocated table
+ */
+static BOOLEAN
+EptSppSetWritePermissions(SIZE_T PhysicalAddress, UINT64 WritePermissions)
+{
+    PVMM_EPT_SPP_TABLE Table = g_EptState->SppTable;
+    PVMM_EPT_SPP_TABLE NextTable;
+    UINT64 *           Entry;
+
+    //
+    // SPPT is walked the same as EPT, the leaf tables have an entry for each
+    // page of a 2MB region
+    //
+    for (UINT32 Shift = 39; Shift >= 21; Shift -= 9)
+    {
+        Entry = &Table->Entries[(PhysicalAddress >> Shift) & 0x1ff];
+
+        if (*Entry & EPT_SPPT_ENTRY_VALID)
+        {
+            Table = (PVMM_EPT_SPP_TABLE)PhysicalAddressToVirtualAddress(*Entry & EPT_SPPT_ENTRY_ADDRESS_MASK);
+            continue;
+        }
+
+        NextTable = PoolManagerRequestPool(SPP_TABLE, TRUE, sizeof(VMM_EPT_SPP_TABLE));
+
+        if (!NextTable)
+        {
+            return FALSE;
+        }
+
+        RtlZeroMemory(NextTable, sizeof(VMM_EPT_SPP_TABLE));
+
+        *Entry = ((UINT64)VirtualAddressToPhysicalAddress(NextTable) & EPT_SPPT_ENTRY_ADDRESS_MASK) | EPT_SPPT_ENTRY_VALID;
+        Table  = NextTable;
+    }
+
+    Table->Entries[(PhysicalAddress >> 12) & 0x1ff] = WritePermissions;
+
+    return TRUE;
+}
+
 /**
  * @brief Initialize EPT for an individual logical processor
  * @details Creates an identity mapped page table and sets up an EPTP to be applied to the VMCS later
@@ -573,9 +969,10 @@ EptLogicalProcessorInitialize()
     EPTP.MemoryType = MEMORY_TYPE_WRITE_BACK;
 
     //
-    // We are not utilizing the 'access' and 'dirty' flag features
+    // The 'access' and 'dirty' flags are only used by the page-modification logging,
+    // they're enabled from the start as the views have copies of the EPTP
     //
-    EPTP.EnableAccessAndDirtyFlags = FALSE;
+    EPTP.EnableAccessAndDirtyFlags = g_PmlSupport;
 
     //
     // Bits 5:3 (1 less than the EPT page-walk length) must be 3, indicating an EPT page-walk length of 4;
@@ -593,7 +990,890 @@ EptLogicalProcessorInitialize()
     //
     g_EptState->EptPointer = EPTP;
 
-    return TRUE;
+    //
+    // The views of the cores share this page table until a core has its own hooks
+    //
+    if (!EptInitializeCoreViews())
+    {
+        LogError("Unable to allocate memory for the EPT views of the cores");
+        return FALSE;
+    }
+
+    //
+    // The write watches of a byte range use the sub-page write permissions
+    //
+    EptSppInitialize();
+
+    return TRUE;
+}
+
+/**
+ * @brief Make a view that maps the PML2 tables of the global page table
+ * 
+ * @param View The view (zeroed)
+ * @return VOID 
+ */
+static VOID
+EptInitializeView(PVMM_EPT_CORE_VIEW View)
+{
+    View->PML4[0]                 = g_EptState->EptPageTable->PML4[0];
+    View->PML4[0].PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&View->PML3[0]) / PAGE_SIZE;
+
+    RtlCopyMemory(&View->PML3[0], &g_EptState->EptPageTable->PML3[0], sizeof(View->PML3));
+
+    for (size_t j = 0; j < VMM_EPT_PML3E_COUNT; j++)
+    {
+        View->PML2[j] = g_EptState->EptPageTable->PML2[j];
+    }
+
+    View->EptPointer                 = g_EptState->EptPointer;
+    View->EptPointer.PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&View->PML4[0]) / PAGE_SIZE;
+}
+
+/**
+ * @brief Allocate the EPT views of the cores, the clean view and the disarmed view
+ * @details Should be called in vmx non-root after creating the global page table,
+ * all the views map the PML2 tables of the global page table
+ * 
+ * @return BOOLEAN 
+ */
+BOOLEAN
+EptInitializeCoreViews()
+{
+    ULONG ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    g_EptState->CoreViews = ExAllocatePoolWithTag(NonPagedPool, sizeof(VMM_EPT_CORE_VIEW) * ProcessorCount, POOLTAG);
+
+    if (!g_EptState->CoreViews)
+    {
+        return FALSE;
+    }
+
+    RtlZeroMemory(g_EptState->CoreViews, sizeof(VMM_EPT_CORE_VIEW) * ProcessorCount);
+
+    //
+    // The hooked pages of all the cores are accessed in the clean view, without
+    // the clean view these accesses are handled by restoring the entry and MTF
+    //
+    g_EptState->CleanView = ExAllocatePoolWithTag(NonPagedPool, sizeof(VMM_EPT_CORE_VIEW), POOLTAG);
+
+    if (g_EptState->CleanView)
+    {
+        RtlZeroMemory(g_EptState->CleanView, sizeof(VMM_EPT_CORE_VIEW));
+        EptInitializeView(g_EptState->CleanView);
+    }
+    else
+    {
+        LogWarning("Unable to allocate memory for the clean view of EPT, hooked pages are accessed using MTF");
+    }
+
+    //
+    // The cores switch to the disarmed view on the cr3 loads of the processes
+    // that the scoped hooks are not armed in
+    //
+    g_EptState->DisarmedView = ExAllocatePoolWithTag(NonPagedPool, sizeof(VMM_EPT_CORE_VIEW), POOLTAG);
+
+    if (g_EptState->DisarmedView)
+    {
+        RtlZeroMemory(g_EptState->DisarmedView, sizeof(VMM_EPT_CORE_VIEW));
+        EptInitializeView(g_EptState->DisarmedView);
+    }
+    else
+    {
+        LogWarning("Unable to allocate memory for the disarmed view of EPT, the hooks can't be scoped to a process");
+    }
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        PVMM_EPT_CORE_VIEW View = &g_EptState->CoreViews[i];
+
+        EptInitializeView(View);
+
+        //
+        // The EPTP list of VMFUNC, the hooked view is the global page table
+        // until the core has its own hooks
+        //
+        View->EptpList[EPT_VIEW_INDEX_HOOKED] = g_EptState->EptPointer.Flags;
+
+        if (g_EptState->CleanView)
+        {
+            View->EptpList[EPT_VIEW_INDEX_CLEAN] = g_EptState->CleanView->EptPointer.Flags;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Free the EPT views of the cores, the clean view and the disarmed view
+ * @details The private tables of the views are freed by the pool manager
+ * 
+ * @return VOID 
+ */
+VOID
+EptUninitializeCoreViews()
+{
+    if (g_EptState->CoreViews)
+    {
+        ExFreePoolWithTag(g_EptState->CoreViews, POOLTAG);
+        g_EptState->CoreViews = NULL;
+    }
+
+    if (g_EptState->CleanView)
+    {
+        ExFreePoolWithTag(g_EptState->CleanView, POOLTAG);
+        g_EptState->CleanView = NULL;
+    }
+
+    if (g_EptState->DisarmedView)
+    {
+        ExFreePoolWithTag(g_EptState->DisarmedView, POOLTAG);
+        g_EptState->DisarmedView = NULL;
+    }
+}
+
+/**
+ * @brief Get the EPTP that a core uses
+ * 
+ * @param CoreIndex Index of the core
+ * @return UINT64 The EPTP of the core's view if it's active, the EPTP of the
+ * disarmed view if the core is disarmed, otherwise the global EPTP
+ */
+UINT64
+EptGetEptPointerOfCore(ULONG CoreIndex)
+{
+    if (g_EptState->CoreViews && g_EptState->CoreViews[CoreIndex].IsActive)
+    {
+        return g_EptState->CoreViews[CoreIndex].EptPointer.Flags;
+    }
+
+    if (g_EptState->CoreViews && g_EptState->CoreViews[CoreIndex].IsDisarmed && g_EptState->DisarmedView)
+    {
+        return g_EptState->DisarmedView->EptPointer.Flags;
+    }
+
+    return g_EptState->EptPointer.Flags;
+}
+
+/**
+ * @brief Get the PML2 entry of a physical address in a core view
+ * 
+ * @param View The core view
+ * @param PhysicalAddress Physical Address that we want to get its PML2
+ * @return PEPT_PML2_ENTRY Return NULL if the address is invalid or it's in a 1GB page
+ */
+static PEPT_PML2_ENTRY
+EptCoreViewGetPml2Entry(PVMM_EPT_CORE_VIEW View, SIZE_T PhysicalAddress)
+{
+    //
+    // Addresses above 512GB are invalid because it is > physical address bus width
+    //
+    if (ADDRMASK_EPT_PML4_INDEX(PhysicalAddress) > 0 || !View->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)])
+    {
+        return NULL;
+    }
+
+    return &View->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)][ADDRMASK_EPT_PML2_INDEX(PhysicalAddress)];
+}
+
+/**
+ * @brief Get the PML1 entry of a physical address in a core view
+ * 
+ * @param View The core view
+ * @param PhysicalAddress Physical Address that we want to get its PML1
+ * @return PEPT_PML1_ENTRY Return NULL if the address is invalid or the page wasn't already split
+ */
+static PEPT_PML1_ENTRY
+EptCoreViewGetPml1Entry(PVMM_EPT_CORE_VIEW View, SIZE_T PhysicalAddress)
+{
+    PEPT_PML2_ENTRY PML2 = EptCoreViewGetPml2Entry(View, PhysicalAddress);
+    PEPT_PML1_ENTRY PML1;
+
+    if (!PML2 || PML2->LargePage)
+    {
+        return NULL;
+    }
+
+    PML1 = (PEPT_PML1_ENTRY)PhysicalAddressToVirtualAddress((PVOID)(((PEPT_PML2_POINTER)PML2)->PageFrameNumber * PAGE_SIZE));
+
+    if (!PML1)
+    {
+        return NULL;
+    }
+
+    return &PML1[ADDRMASK_EPT_PML1_INDEX(PhysicalAddress)];
+}
+
+/**
+ * @brief Give a core view its own PML2 table and PML1 table for a physical address
+ * @details Should be called from vmx-root, the new tables are copies of the
+ * current tables of the view (copy-on-write of the global page table)
+ * 
+ * @param View The core view
+ * @param PhysicalAddress The physical address
+ * @return BOOLEAN Returns false if there was no pre-allocated buffer
+ */
+static BOOLEAN
+EptCoreViewPrivatizePage(PVMM_EPT_CORE_VIEW View, SIZE_T PhysicalAddress)
+{
+    SIZE_T                 Pml3Index = ADDRMASK_EPT_PML3_INDEX(PhysicalAddress);
+    SIZE_T                 Pml2Index = ADDRMASK_EPT_PML2_INDEX(PhysicalAddress);
+    PEPT_PML2_ENTRY        SharedPml2;
+    PEPT_PML2_ENTRY        ViewEntry;
+    PVMM_EPT_PML2_TABLE    PrivatePml2;
+    PVMM_EPT_DYNAMIC_SPLIT NewSplit;
+    EPT_PML2_POINTER       NewPointer;
+
+    //
+    // The views don't have private tables for 1GB pages, so the 1GB page is
+    // split in the global page table first
+    //
+    if (!EptSplit1GbPage(PhysicalAddress))
+    {
+        return FALSE;
+    }
+
+    SharedPml2 = g_EptState->EptPageTable->PML2[Pml3Index];
+
+    //
+    // Copy the PML2 table of this 1GB, if it's still the global one
+    //
+    if (View->PML2[Pml3Index] == SharedPml2)
+    {
+        PrivatePml2 = PoolManagerRequestPool(EPT_CORE_VIEW_PML2_TABLE, TRUE, sizeof(VMM_EPT_PML2_TABLE));
+
+        if (!PrivatePml2)
+        {
+            LogError("There is no pre-allocated buffer available");
+            return FALSE;
+        }
+
+        RtlCopyMemory(&PrivatePml2->PML2[0], SharedPml2, sizeof(PrivatePml2->PML2));
+
+        View->PML2[Pml3Index]                 = &PrivatePml2->PML2[0];
+        View->PML3[Pml3Index].PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&PrivatePml2->PML2[0]) / PAGE_SIZE;
+    }
+
+    ViewEntry = &View->PML2[Pml3Index][Pml2Index];
+
+    //
+    // If it points to another PML1 than the global one, then it's already private
+    //
+    if (!ViewEntry->LargePage &&
+        (SharedPml2[Pml2Index].LargePage || ((PEPT_PML2_POINTER)ViewEntry)->PageFrameNumber != ((PEPT_PML2_POINTER)&SharedPml2[Pml2Index])->PageFrameNumber))
+    {
+        return TRUE;
+    }
+
+    NewSplit = PoolManagerRequestPool(SPLIT_2MB_PAGING_TO_4KB_PAGE, TRUE, sizeof(VMM_EPT_DYNAMIC_SPLIT));
+
+    if (!NewSplit)
+    {
+        LogError("There is no pre-allocated buffer available");
+        return FALSE;
+    }
+
+    if (ViewEntry->LargePage)
+    {
+        return EptSplitPml2Entry(ViewEntry, NewSplit);
+    }
+
+    //
+    // Copy the global PML1 table, with the hooks of all the cores
+    //
+    RtlZeroMemory(NewSplit, sizeof(VMM_EPT_DYNAMIC_SPLIT));
+    RtlCopyMemory(&NewSplit->PML1[0],
+                  PhysicalAddressToVirtualAddress((PVOID)(((PEPT_PML2_POINTER)ViewEntry)->PageFrameNumber * PAGE_SIZE)),
+                  sizeof(NewSplit->PML1));
+
+    NewSplit->Entry = ViewEntry;
+
+    NewPointer.Flags           = ViewEntry->Flags;
+    NewPointer.PageFrameNumber = (SIZE_T)VirtualAddressToPhysicalAddress(&NewSplit->PML1[0]) / PAGE_SIZE;
+
+    RtlCopyMemory(ViewEntry, &NewPointer, sizeof(NewPointer));
+
+    return TRUE;
+}
+
+/**
+ * @brief Update the private PML2 tables of the core views after a 2MB page
+ * of the global page table is split
+ * @details The views that still map this 2MB as a large page use the global
+ * PML1 table, so they see the hooks of all the cores
+ * 
+ * @param PhysicalAddress The physical address in the split page
+ * @return VOID 
+ */
+static VOID
+EptCoreViewsSyncSplit(SIZE_T PhysicalAddress)
+{
+    ULONG           ProcessorCount = KeQueryActiveProcessorCount(0);
+    PEPT_PML2_ENTRY SharedEntry    = EptGetPml2Entry(g_EptState->EptPageTable, PhysicalAddress);
+
+    if (!g_EptState->CoreViews || !SharedEntry)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        PEPT_PML2_ENTRY ViewEntry = EptCoreViewGetPml2Entry(&g_EptState->CoreViews[i], PhysicalAddress);
+
+        if (ViewEntry && ViewEntry != SharedEntry && ViewEntry->LargePage)
+        {
+            ViewEntry->Flags = SharedEntry->Flags;
+        }
+    }
+
+    //
+    // The disarmed view has the hooks of all the processes except the scoped hooks
+    //
+    if (g_EptState->DisarmedView)
+    {
+        PEPT_PML2_ENTRY ViewEntry = EptCoreViewGetPml2Entry(g_EptState->DisarmedView, PhysicalAddress);
+
+        if (ViewEntry && ViewEntry != SharedEntry && ViewEntry->LargePage)
+        {
+            ViewEntry->Flags = SharedEntry->Flags;
+        }
+    }
+}
+
+/**
+ * @brief Apply an entry of a hook on all the cores to the private PML1 tables
+ * of the core views
+ * @details Should be called from vmx-root, the other cores should invalidate
+ * their EPT after that
+ * 
+ * @param PhysicalAddress The physical address of the hooked page
+ * @param SharedEntry The entry in the global page table
+ * @param EntryValue The new value of the entry
+ * @return VOID 
+ */
+static VOID
+EptCoreViewsApplyEntry(SIZE_T PhysicalAddress, PEPT_PML1_ENTRY SharedEntry, EPT_PML1_ENTRY EntryValue)
+{
+    ULONG ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    if (!g_EptState->CoreViews)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < ProcessorCount; i++)
+    {
+        PEPT_PML1_ENTRY ViewEntry = EptCoreViewGetPml1Entry(&g_EptState->CoreViews[i], PhysicalAddress);
+
+        if (ViewEntry && ViewEntry != SharedEntry)
+        {
+            SpinlockLock(&Pml1ModificationAndInvalidationLock);
+            ViewEntry->Flags = EntryValue.Flags;
+            SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+        }
+    }
+}
+
+/**
+ * @brief Get the PML1 entry of a hooked page in the EPT that a core uses
+ * @details The hooks of all the cores have a private copy in the views that
+ * split the same 2MB page
+ * 
+ * @param HookedEntry The details of the hooked page
+ * @param CoreIndex Index of the core
+ * @return PEPT_PML1_ENTRY 
+ */
+PEPT_PML1_ENTRY
+EptGetHookedPageEntryOfCore(PEPT_HOOKED_PAGE_DETAIL HookedEntry, ULONG CoreIndex)
+{
+    PEPT_PML1_ENTRY ViewEntry;
+
+    if (!g_EptState->CoreViews)
+    {
+        return HookedEntry->EntryAddress;
+    }
+
+    if (g_EptState->CoreViews[CoreIndex].IsActive)
+    {
+        ViewEntry = EptCoreViewGetPml1Entry(&g_EptState->CoreViews[CoreIndex], HookedEntry->PhysicalBaseAddress);
+    }
+    else if (g_EptState->CoreViews[CoreIndex].IsDisarmed && g_EptState->DisarmedView)
+    {
+        ViewEntry = EptCoreViewGetPml1Entry(g_EptState->DisarmedView, HookedEntry->PhysicalBaseAddress);
+    }
+    else
+    {
+        return HookedEntry->EntryAddress;
+    }
+
+    return ViewEntry ? ViewEntry : HookedEntry->EntryAddress;
+}
+
+/**
+ * @brief Check whether a core accesses a hooked page by switching to the clean view
+ * @details The cores that use their own view restore the entry in their view
+ * 
+ * @param HookedEntry The details of the hooked page
+ * @param CoreIndex Index of the core
+ * @return BOOLEAN 
+ */
+static BOOLEAN
+EptCleanViewIsUsable(PEPT_HOOKED_PAGE_DETAIL HookedEntry, ULONG CoreIndex)
+{
+    return g_EptState->CleanView != NULL &&
+           HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES &&
+           !g_EptState->CoreViews[CoreIndex].IsActive;
+}
+
+/**
+ * @brief Set the entry of a hooked page in the clean view
+ * @details Should be called from vmx-root after the page is privatized in the
+ * clean view, the pages of the read/write hooks are not hooked in the clean view
+ * and the pages of the execution hooks are the original page without execute
+ * access, so the execution switches back to the hooked view
+ * 
+ * @param HookedEntry The details of the hooked page
+ * @param IsHooked False if the hook is removed
+ * @return VOID 
+ */
+static VOID
+EptCleanViewApplyHook(PEPT_HOOKED_PAGE_DETAIL HookedEntry, BOOLEAN IsHooked)
+{
+    PEPT_PML1_ENTRY CleanEntry;
+    EPT_PML1_ENTRY  EntryValue;
+
+    if (!g_EptState->CleanView)
+    {
+        return;
+    }
+
+    CleanEntry = EptCoreViewGetPml1Entry(g_EptState->CleanView, HookedEntry->PhysicalBaseAddress);
+
+    if (!CleanEntry)
+    {
+        return;
+    }
+
+    EntryValue = HookedEntry->OriginalEntry;
+
+    if (IsHooked && HookedEntry->IsExecutionHook)
+    {
+        EntryValue.ReadAccess    = 1;
+        EntryValue.WriteAccess   = 1;
+        EntryValue.ExecuteAccess = 0;
+        EntryValue.SuppressVe    = 1;
+    }
+
+    SpinlockLock(&Pml1ModificationAndInvalidationLock);
+    CleanEntry->Flags = EntryValue.Flags;
+    SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+}
+
+/**
+ * @brief Switch the current core from the clean view to its hooked view
+ * @details Should be called from vmx-root, the cores leave the clean view when
+ * the hooks are changed so they don't miss the new hooks
+ * 
+ * @return VOID 
+ */
+VOID
+EptCleanViewLeave()
+{
+    UINT64 CurrentEptPointer = 0;
+
+    if (!g_EptState->CleanView)
+    {
+        return;
+    }
+
+    __vmx_vmread(EPT_POINTER, &CurrentEptPointer);
+
+    if (CurrentEptPointer == g_EptState->CleanView->EptPointer.Flags)
+    {
+        __vmx_vmwrite(EPT_POINTER, EptGetEptPointerOfCore(KeGetCurrentProcessorNumber()));
+    }
+}
+
+/**
+ * @brief Set the entry of a hooked page in the disarmed view
+ * @details Should be called from vmx-root, the pages of the scoped hooks are
+ * privatized in the disarmed view and keep the original entry, the other
+ * hooks are only changed if their 2MB page is also privatized there
+ * 
+ * @param HookedEntry The details of the hooked page
+ * @param IsHooked False if the hook is removed
+ * @return VOID 
+ */
+static VOID
+EptDisarmedViewApplyHook(PEPT_HOOKED_PAGE_DETAIL HookedEntry, BOOLEAN IsHooked)
+{
+    PEPT_PML1_ENTRY DisarmedEntry;
+
+    if (!g_EptState->DisarmedView)
+    {
+        return;
+    }
+
+    DisarmedEntry = EptCoreViewGetPml1Entry(g_EptState->DisarmedView, HookedEntry->PhysicalBaseAddress);
+
+    //
+    // The entry is shared with the global page table
+    //
+    if (!DisarmedEntry || DisarmedEntry == HookedEntry->EntryAddress)
+    {
+        return;
+    }
+
+    SpinlockLock(&Pml1ModificationAndInvalidationLock);
+    DisarmedEntry->Flags = (IsHooked && HookedEntry->ProcessId == 0) ? HookedEntry->ChangedEntry.Flags : HookedEntry->OriginalEntry.Flags;
+    SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+}
+
+/**
+ * @brief Switch the current core to the armed or the disarmed view of the
+ * scoped hooks by its current process
+ * @details Should be called from vmx-root on the cr3 loads, the process is
+ * checked instead of cr3 as the user and the kernel cr3 of a process are
+ * different with KPTI, the cores that use their own view stay armed
+ * 
+ * @param CoreIndex Index of the current core
+ * @return VOID 
+ */
+VOID
+EptDisarmedViewUpdate(ULONG CoreIndex)
+{
+    PVMM_EPT_CORE_VIEW View;
+    BOOLEAN            IsDisarmed;
+
+    if (!g_EptState->DisarmedView || !g_EptState->CoreViews)
+    {
+        return;
+    }
+
+    View = &g_EptState->CoreViews[CoreIndex];
+
+    IsDisarmed = !View->IsActive &&
+                 g_EptState->CountOfScopedHooks != 0 &&
+                 (UINT32)(UINT64)PsGetCurrentProcessId() != g_EptState->ScopedHooksProcessId;
+
+    if (IsDisarmed == View->IsDisarmed)
+    {
+        return;
+    }
+
+    //
+    // Switching the EPTP doesn't need to invalidate EPT, the cached
+    // translations are tagged by the EPTP
+    //
+    View->IsDisarmed                      = IsDisarmed;
+    View->EptpList[EPT_VIEW_INDEX_HOOKED] = EptGetEptPointerOfCore(CoreIndex);
+
+    __vmx_vmwrite(EPT_POINTER, EptGetEptPointerOfCore(CoreIndex));
+}
+
+/**
+ * @brief Get the split that a PML1 entry belongs to
+ * @details The PML1 entries are at the start of the (page aligned) split
+ * 
+ * @param Pml1Entry The PML1 entry
+ * @return PVMM_EPT_DYNAMIC_SPLIT 
+ */
+static PVMM_EPT_DYNAMIC_SPLIT
+EptGetSplitOfPml1Entry(PEPT_PML1_ENTRY Pml1Entry)
+{
+    return (PVMM_EPT_DYNAMIC_SPLIT)PAGE_ALIGN(Pml1Entry);
+}
+
+/**
+ * @brief Add a hooked page to the count of the hooked pages of its split
+ * @details The hooks of all the cores are counted in the split of the global
+ * page table and the hooks of a core are counted in the split of its view
+ * 
+ * @param HookedEntry The details of the hooked page
+ * @return VOID 
+ */
+static VOID
+EptAcquireSplitOfHookedPage(PEPT_HOOKED_PAGE_DETAIL HookedEntry)
+{
+    InterlockedIncrement(&EptGetSplitOfPml1Entry(HookedEntry->EntryAddress)->CountOfHookedPages);
+}
+
+/**
+ * @brief Map a 2MB page of a view as a large page after the split of the global
+ * page table is merged
+ * @details The private PML1 tables of the clean view and the disarmed view are
+ * freed, the private PML1 tables of the other views are kept as they still have
+ * the hooks of the core
+ * 
+ * @param View The view
+ * @param Split The split of the global page table
+ * @param PhysicalAddress The physical address in the 2MB page
+ * @param ReleasedTable [Out] The private PML1 table to free with the split
+ * (NULL if it's not the clean view or the disarmed view)
+ * @return VOID 
+ */
+static VOID
+EptViewMergeSplit(PVMM_EPT_CORE_VIEW View, PVMM_EPT_DYNAMIC_SPLIT Split, SIZE_T PhysicalAddress, UINT64 * ReleasedTable)
+{
+    PEPT_PML2_ENTRY ViewEntry = EptCoreViewGetPml2Entry(View, PhysicalAddress);
+
+    //
+    // The views that still map the global PML2 table are merged with it
+    //
+    if (!ViewEntry || ViewEntry == Split->Entry || ViewEntry->LargePage)
+    {
+        return;
+    }
+
+    if (((PEPT_PML2_POINTER)ViewEntry)->PageFrameNumber != ((PEPT_PML2_POINTER)Split->Entry)->PageFrameNumber)
+    {
+        if (ReleasedTable == NULL)
+        {
+            return;
+        }
+
+        //
+        // The other cores might still walk it with their cached translations
+        //
+        *ReleasedTable = (UINT64)PhysicalAddressToVirtualAddress(((PEPT_PML2_POINTER)ViewEntry)->PageFrameNumber * PAGE_SIZE);
+    }
+
+    ViewEntry->Flags = Split->OriginalEntry.Flags;
+}
+
+/**
+ * @brief Merge the split of a removed hook into a 2MB page if it was the last
+ * hook of the split
+ * @details Should be called from vmx non-root after the hook is removed from
+ * the EPT of all the cores, if the split is merged the caller should invalidate
+ * the EPT of all the cores and then call EptFreeReleasedSplits
+ * 
+ * @param HookedEntry The details of the removed hook
+ * @return BOOLEAN Returns true if the split is merged
+ */
+BOOLEAN
+EptReleaseSplitOfHookedPage(PEPT_HOOKED_PAGE_DETAIL HookedEntry)
+{
+    ULONG                  ProcessorCount = KeQueryActiveProcessorCount(0);
+    PVMM_EPT_DYNAMIC_SPLIT Split          = EptGetSplitOfPml1Entry(HookedEntry->EntryAddress);
+
+    if (InterlockedDecrement(&Split->CountOfHookedPages) != 0)
+    {
+        return FALSE;
+    }
+
+    SpinlockLock(&Pml1ModificationAndInvalidationLock);
+
+    Split->ReleasedViewTables[0] = NULL;
+    Split->ReleasedViewTables[1] = NULL;
+
+    if (HookedEntry->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+    {
+        //
+        // The view of the core maps the 2MB page the same as the global page table
+        // (the hooks of all the cores are also in the global page table)
+        //
+        Split->Entry->Flags = EptGetPml2Entry(g_EptState->EptPageTable, HookedEntry->PhysicalBaseAddress)->Flags;
+    }
+    else
+    {
+        if (g_EptState->CoreViews)
+        {
+            for (size_t i = 0; i < ProcessorCount; i++)
+            {
+                EptViewMergeSplit(&g_EptState->CoreViews[i], Split, HookedEntry->PhysicalBaseAddress, NULL);
+            }
+        }
+
+        if (g_EptState->CleanView)
+        {
+            EptViewMergeSplit(g_EptState->CleanView, Split, HookedEntry->PhysicalBaseAddress, &Split->ReleasedViewTables[0]);
+        }
+
+        if (g_EptState->DisarmedView)
+        {
+            EptViewMergeSplit(g_EptState->DisarmedView, Split, HookedEntry->PhysicalBaseAddress, &Split->ReleasedViewTables[1]);
+        }
+
+        Split->Entry->Flags = Split->OriginalEntry.Flags;
+    }
+
+    //
+    // The split is freed when it's safe (after the EPT of the cores is invalidated),
+    // the pool manager might deallocate it as soon as it's freed
+    //
+    InsertTailList(&g_EptState->ReleasedSplitsList, &Split->DynamicSplitList);
+
+    SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+
+    return TRUE;
+}
+
+/**
+ * @brief Return the merged splits (and the private PML1 tables of their views)
+ * to the pool manager
+ * @details Should be called from vmx non-root after the EPT of all the cores is
+ * invalidated (HvNotifyAllToInvalidateEpt), so no core walks them anymore
+ * 
+ * @return VOID 
+ */
+VOID
+EptFreeReleasedSplits()
+{
+    PVMM_EPT_DYNAMIC_SPLIT Split;
+
+    SpinlockLock(&Pml1ModificationAndInvalidationLock);
+
+    while (!IsListEmpty(&g_EptState->ReleasedSplitsList))
+    {
+        Split = CONTAINING_RECORD(RemoveHeadList(&g_EptState->ReleasedSplitsList), VMM_EPT_DYNAMIC_SPLIT, DynamicSplitList);
+
+        for (UINT32 i = 0; i < RTL_NUMBER_OF(Split->ReleasedViewTables); i++)
+        {
+            if (Split->ReleasedViewTables[i] != NULL)
+            {
+                PoolManagerFreePool(Split->ReleasedViewTables[i]);
+            }
+        }
+
+        PoolManagerFreePool((UINT64)Split);
+    }
+
+    SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+}
+
+/**
+ * @brief Get the first slot of a physical page in the index of the hooked pages
+ * 
+ * @param PhysicalAddress The physical address (or the base address of the page)
+ * @return UINT32 Index of the slot
+ */
+static UINT32
+EptHookedPagesTableHash(SIZE_T PhysicalAddress)
+{
+    //
+    // Fibonacci hashing of the page frame number
+    //
+    return (UINT32)(((UINT64)(PhysicalAddress / PAGE_SIZE) * 0x9E3779B97F4A7C15ULL) >> (64 - EPT_HOOKED_PAGES_TABLE_BITS));
+}
+
+/**
+ * @brief Add a hooked page to the index of the hooked pages
+ * @details The index is a part of g_EptState so it's safe to be used in vmx-root,
+ * the slot is written after the details are filled so the other cores never see
+ * a partial entry
+ * 
+ * @param HookedPage The details of the hooked page (should be in HookedPagesList)
+ * @return BOOLEAN Returns false if the index is full
+ */
+BOOLEAN
+EptHookedPagesTableInsert(PEPT_HOOKED_PAGE_DETAIL HookedPage)
+{
+    UINT32 Slot = EptHookedPagesTableHash(HookedPage->PhysicalBaseAddress);
+
+    //
+    // Keep the probe sequences short
+    //
+    if (g_EptState->HookedPagesTableCount >= EPT_HOOKED_PAGES_TABLE_MAXIMUM_ENTRIES)
+    {
+        return FALSE;
+    }
+
+    for (UINT32 i = 0; i < EPT_HOOKED_PAGES_TABLE_SIZE; i++, Slot = (Slot + 1) & (EPT_HOOKED_PAGES_TABLE_SIZE - 1))
+    {
+        PEPT_HOOKED_PAGE_DETAIL Entry = g_EptState->HookedPagesTable[Slot];
+
+        //
+        // An empty slot or the slot of a removed hook
+        //
+        if (Entry == NULL || Entry == EPT_HOOKED_PAGES_TABLE_DELETED_ENTRY)
+        {
+            g_EptState->HookedPagesTableCount++;
+            InterlockedExchangePointer(&g_EptState->HookedPagesTable[Slot], HookedPage);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * @brief Find the hooked page of a physical address in the index
+ * 
+ * @param PhysicalAddress The physical address (it's not needed to be page aligned)
+ * @return PEPT_HOOKED_PAGE_DETAIL The details of the hooked page or NULL if the page is not hooked
+ */
+PEPT_HOOKED_PAGE_DETAIL
+EptHookedPagesTableFind(SIZE_T PhysicalAddress)
+{
+    SIZE_T PhysicalBaseAddress = PAGE_ALIGN(PhysicalAddress);
+    UINT32 Slot                = EptHookedPagesTableHash(PhysicalBaseAddress);
+
+    for (UINT32 i = 0; i < EPT_HOOKED_PAGES_TABLE_SIZE; i++, Slot = (Slot + 1) & (EPT_HOOKED_PAGES_TABLE_SIZE - 1))
+    {
+        PEPT_HOOKED_PAGE_DETAIL Entry = g_EptState->HookedPagesTable[Slot];
+
+        if (Entry == NULL)
+        {
+            break;
+        }
+
+        if (Entry != EPT_HOOKED_PAGES_TABLE_DELETED_ENTRY && Entry->PhysicalBaseAddress == PhysicalBaseAddress)
+        {
+            return Entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Remove a hooked page from the index of the hooked pages
+ * @details The slot is marked as removed, so the probe sequences of the other
+ * pages are not broken, if it's the last slot of its cluster then no probe
+ * sequence passes it and it's emptied with the removed slots before it
+ * 
+ * @param HookedPage The details of the hooked page
+ * @return VOID 
+ */
+VOID
+EptHookedPagesTableRemove(PEPT_HOOKED_PAGE_DETAIL HookedPage)
+{
+    UINT32 Slot = EptHookedPagesTableHash(HookedPage->PhysicalBaseAddress);
+
+    for (UINT32 i = 0; i < EPT_HOOKED_PAGES_TABLE_SIZE; i++, Slot = (Slot + 1) & (EPT_HOOKED_PAGES_TABLE_SIZE - 1))
+    {
+        PEPT_HOOKED_PAGE_DETAIL Entry = g_EptState->HookedPagesTable[Slot];
+
+        if (Entry == NULL)
+        {
+            return;
+        }
+
+        if (Entry == HookedPage)
+        {
+            g_EptState->HookedPagesTableCount--;
+
+            if (g_EptState->HookedPagesTable[(Slot + 1) & (EPT_HOOKED_PAGES_TABLE_SIZE - 1)] != NULL)
+            {
+                InterlockedExchangePointer(&g_EptState->HookedPagesTable[Slot], EPT_HOOKED_PAGES_TABLE_DELETED_ENTRY);
+                return;
+            }
+
+            //
+            // The readers (vmx-root) stop at this slot instead of the next one,
+            // the result is the same as there is no hook in these slots
+            //
+            do
+            {
+                InterlockedExchangePointer(&g_EptState->HookedPagesTable[Slot], NULL);
+                Slot = (Slot - 1) & (EPT_HOOKED_PAGES_TABLE_SIZE - 1);
+
+            } while (g_EptState->HookedPagesTable[Slot] == EPT_HOOKED_PAGES_TABLE_DELETED_ENTRY);
+
+            return;
+        }
+    }
 }
 
 /**
@@ -611,48 +1891,43 @@ EptLogicalProcessorInitialize()
 BOOLEAN
 EptHandlePageHookExit(VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification, UINT64 GuestPhysicalAddr)
 {
-    BOOLEAN     IsHandled = FALSE;
-    PLIST_ENTRY TempList  = 0;
+    BOOLEAN                 IsHandled = FALSE;
+    PEPT_HOOKED_PAGE_DETAIL HookedEntry;
 
-    TempList = &g_EptState->HookedPagesList;
-    while (&g_EptState->HookedPagesList != TempList->Flink)
+    HookedEntry = EptHookedPagesTableFind(GuestPhysicalAddr);
+
+    //
+    // The hooks of the other cores are not in the EPT of this core
+    //
+    if (HookedEntry && (HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES || HookedEntry->CoreId == KeGetCurrentProcessorNumber()))
     {
-        TempList                            = TempList->Flink;
-        PEPT_HOOKED_PAGE_DETAIL HookedEntry = CONTAINING_RECORD(TempList, EPT_HOOKED_PAGE_DETAIL, PageHookList);
-        if (HookedEntry->PhysicalBaseAddress == PAGE_ALIGN(GuestPhysicalAddr))
+        //
+        // We found an address that match the details
+        //
+        // Returning true means that the caller should return to the ept state to
+        // the previous state when this instruction is executed
+        // by setting the Monitor Trap Flag. Return false means that nothing special
+        // for the caller to do
+        //
+        if (EptHandleHookedPage(HookedEntry, ViolationQualification, GuestPhysicalAddr))
         {
             //
-            // We found an address that match the details
-            //
-            // Returning true means that the caller should return to the ept state to
-            // the previous state when this instruction is executed
-            // by setting the Monitor Trap Flag. Return false means that nothing special
-            // for the caller to do
-            //
-            if (EptHandleHookedPage(HookedEntry, ViolationQualification, GuestPhysicalAddr))
-            {
-                //
-                // Next we have to save the current hooked entry to restore on the next instruction's vm-exit
-                //
-                g_GuestState[KeGetCurrentProcessorNumber()].MtfEptHookRestorePoint = HookedEntry;
-
-                //
-                // We have to set Monitor trap flag and give it the HookedEntry to work with
-                //
-                HvSetMonitorTrapFlag(TRUE);
-            }
-
-            //
-            // Indicate that we handled the ept violation
+            // Next we have to save the current hooked entry to restore on the next instruction's vm-exit
             //
-            IsHandled = TRUE;
+            g_GuestState[KeGetCurrentProcessorNumber()].MtfEptHookRestorePoint = HookedEntry;
 
             //
-            // Get out of the loop
+            // We have to set Monitor trap flag and give it the HookedEntry to work with
             //
-            break;
+            HvSetMonitorTrapFlag(TRUE);
         }
+
+        //
+        // Indicate that we handled the ept violation
+        //
+        IsHandled = TRUE;
     }
+
     //
     // Redo the instruction
     //
@@ -703,9 +1978,20 @@ VOID
 EptHandleMonitorTrapFlag(PEPT_HOOKED_PAGE_DETAIL HookedEntry)
 {
     //
-    // restore the hooked state
+    // The entry is not changed if the instruction is executed in the clean view
+    //
+    if (EptCleanViewIsUsable(HookedEntry, KeGetCurrentProcessorNumber()))
+    {
+        EptCleanViewLeave();
+        return;
+    }
+
+    //
+    // restore the hooked state, the instruction might have cached the
+    // restored entry by any linear address (e.g. the instruction crosses a
+    // page or the page has aliases), so the whole EPT of the core is invalidated
     //
-    EptSetPML1AndInvalidateTLB(HookedEntry->EntryAddress, HookedEntry->ChangedEntry, INVEPT_SINGLE_CONTEXT);
+    EptSetPML1AndInvalidateTLB(EptGetHookedPageEntryOfCore(HookedEntry, KeGetCurrentProcessorNumber()), HookedEntry->ChangedEntry, INVEPT_SINGLE_CONTEXT);
 }
 
 /**
@@ -726,6 +2012,40 @@ EptHandleMisconfiguration(UINT64 GuestAddress)
     //
 }
 
+/**
+ * @brief Handle vm-exits for SPPT misconfigurations and misses
+ * @details The sub-page write permissions of the page are disabled, so the
+ * writes to the page cause EPT violation and they're filtered in vmx-root, it's
+ * logged once for each page as the page falls back to the EPT violations
+ * 
+ * @param GuestPhysicalAddr The physical address of the write
+ * @return VOID 
+ */
+VOID
+EptHandleSppEvent(UINT64 GuestPhysicalAddr)
+{
+    PEPT_HOOKED_PAGE_DETAIL HookedEntry;
+    EPT_PML1_ENTRY          EntryValue;
+
+    HookedEntry = EptHookedPagesTableFind(GuestPhysicalAddr);
+
+    if (!HookedEntry || !HookedEntry->IsSubPageWatch)
+    {
+        return;
+    }
+
+    LogWarning("The sub-page permission table is invalid for the guest address : 0x%llx, the page is watched by EPT violations", GuestPhysicalAddr);
+
+    HookedEntry->IsSubPageWatch                       = FALSE;
+    HookedEntry->ChangedEntry.SubPageWritePermissions = 0;
+
+    EntryValue = HookedEntry->ChangedEntry;
+
+    EptCoreViewsApplyEntry(HookedEntry->PhysicalBaseAddress, HookedEntry->EntryAddress, EntryValue);
+    EptDisarmedViewApplyHook(HookedEntry, TRUE);
+    EptSetPML1AndInvalidateTLB(HookedEntry->EntryAddress, EntryValue, INVEPT_ALL_CONTEXTS);
+}
+
 /**
  * @brief Write an absolute x64 jump to an arbitrary address to a buffer
  * 
@@ -839,14 +2159,24 @@ EptHookInstructionMemory(PEPT_HOOKED_PAGE_DETAIL Hook, PVOID TargetFunction, PVO
     }
     LogInfo("Number of bytes of instruction mem: %d", SizeOfHookedInstructions);
 
+    //
+    // The copied instructions and the jump back should fit in a slot of the arena
+    //
+    if (SizeOfHookedInstructions + 13 > TRAMPOLINE_SLOT_SIZE)
+    {
+        LogError("The instructions of the trampoline don't fit in a slot of the arena");
+        return FALSE;
+    }
+
     //
     // Build a trampoline
     //
 
     //
-    // Allocate some executable memory for the trampoline
+    // Allocate some executable memory for the trampoline, the trampolines are
+    // packed in the executable pages of the arena
     //
-    Hook->Trampoline = PoolManagerRequestPool(EXEC_TRAMPOLINE, TRUE, MAX_EXEC_TRAMPOLINE_SIZE);
+    Hook->Trampoline = TrampolineArenaAllocate();
 
     if (!Hook->Trampoline)
     {
@@ -900,8 +2230,9 @@ EptHookInstructionMemory(PEPT_HOOKED_PAGE_DETAIL Hook, PVOID TargetFunction, PVO
  * @param HookedEntryDetails The entry that describes the hooked page
  * @param ViolationQualification The exit qualification of vm-exit
  * @param PhysicalAddress The physical address that cause this vm-exit
- * @return BOOLEAN Returns TRUE if the function was hook was handled or returns false 
- * if there was an unexpected ept violation
+ * @return BOOLEAN Returns TRUE if the previous state should be restored after the
+ * current instruction (MTF) or returns false if there is nothing to restore or there
+ * was an unexpected ept violation
  */
 BOOLEAN
 EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification, SIZE_T PhysicalAddress)
@@ -910,6 +2241,10 @@ EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIF
     ULONG64 ExactAccessedAddress;
     ULONG64 AlignedVirtualAddress;
     ULONG64 AlignedPhysicalAddress;
+    UINT32  AccessedOffset;
+    BOOLEAN IsReported;
+    UINT64  CurrentEptPointer = 0;
+    ULONG   CoreIndex         = KeGetCurrentProcessorNumber();
 
     //
     // Get alignment
@@ -925,19 +2260,48 @@ EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIF
     //
     // Reading guest's RIP
     //
-    __vmx_vmread(GUEST_RIP, &GuestRip);
+    GuestRip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+
+    //
+    // The accesses to the bytes out of the watched range are not reported, they're
+    // only executed with the original entry
+    //
+    AccessedOffset = (UINT32)(PhysicalAddress - AlignedPhysicalAddress);
+    IsReported     = HookedEntryDetails->IsExecutionHook ||
+                 (AccessedOffset >= HookedEntryDetails->WatchStart && AccessedOffset < HookedEntryDetails->WatchEnd);
+
+    //
+    // The scoped hooks are still armed in the other processes on the cores
+    // that use their own view
+    //
+    if (HookedEntryDetails->ProcessId != 0 && (UINT32)(UINT64)PsGetCurrentProcessId() != HookedEntryDetails->ProcessId)
+    {
+        IsReported = FALSE;
+    }
 
+    //
+    // The accesses are only counted if the aggregation is started
+    //
     if (!ViolationQualification.EptExecutable && ViolationQualification.ExecuteAccess)
     {
-        LogInfo("Guest RIP : 0x%llx tries to execute the page at : 0x%llx", GuestRip, ExactAccessedAddress);
+        if (IsReported && !AggregationRecordAccess(CoreIndex, GuestRip, ExactAccessedAddress, ACCESS_AGGREGATION_TYPE_EXECUTE))
+        {
+            LogInfo("Guest RIP : 0x%llx tries to execute the page at : 0x%llx", GuestRip, ExactAccessedAddress);
+        }
     }
     else if (!ViolationQualification.EptWriteable && ViolationQualification.WriteAccess)
     {
-        LogInfo("Guest RIP : 0x%llx tries to write on the page at :0x%llx", GuestRip, ExactAccessedAddress);
+        if (IsReported && !AggregationRecordAccess(CoreIndex, GuestRip, ExactAccessedAddress, ACCESS_AGGREGATION_TYPE_WRITE))
+        {
+            LogInfo("Guest RIP : 0x%llx tries to write on the page at :0x%llx", GuestRip, ExactAccessedAddress);
+        }
     }
     else if (!ViolationQualification.EptReadable && ViolationQualification.ReadAccess)
     {
-        LogInfo("Guest RIP : 0x%llx tries to read the page at :0x%llx", GuestRip, ExactAccessedAddress);
+        if (IsReported && !AggregationRecordAccess(CoreIndex, GuestRip, ExactAccessedAddress, ACCESS_AGGREGATION_TYPE_READ))
+        {
+            LogInfo("Guest RIP : 0x%llx tries to read the page at :0x%llx", GuestRip, ExactAccessedAddress);
+        }
     }
     else
     {
@@ -947,7 +2311,39 @@ EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIF
         return FALSE;
     }
 
-    EptSetPML1AndInvalidateTLB(HookedEntryDetails->EntryAddress, HookedEntryDetails->OriginalEntry, INVEPT_SINGLE_CONTEXT);
+    if (EptCleanViewIsUsable(HookedEntryDetails, CoreIndex))
+    {
+        //
+        // Switching the EPTP doesn't need to invalidate EPT, the cached
+        // translations are tagged by the EPTP
+        //
+        __vmx_vmread(EPT_POINTER, &CurrentEptPointer);
+
+        if (CurrentEptPointer == g_EptState->CleanView->EptPointer.Flags)
+        {
+            //
+            // Only the execution on the page of an execution hook is caught in
+            // the clean view, so go back to the hooked view
+            //
+            __vmx_vmwrite(EPT_POINTER, EptGetEptPointerOfCore(CoreIndex));
+            return FALSE;
+        }
+
+        __vmx_vmwrite(EPT_POINTER, g_EptState->CleanView->EptPointer.Flags);
+
+        //
+        // The reads and writes of an execution hook stay in the clean view until
+        // the next execution on a hooked page, unless there are read/write hooks
+        // as they would be missed in the clean view
+        //
+        return !HookedEntryDetails->IsExecutionHook || g_EptState->CountOfMonitorHooks != 0;
+    }
+
+    //
+    // The EPT violation invalidated the translations of the accessed page on
+    // this core, so the original entry is used without invalidating EPT
+    //
+    EptSetPML1(EptGetHookedPageEntryOfCore(HookedEntryDetails, CoreIndex), HookedEntryDetails->OriginalEntry);
 
     //
     // Means that restore the Entry to the previous state after current instruction executed in the guest
@@ -966,10 +2362,15 @@ EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIF
  * @param UnsetRead Hook READ Access
  * @param UnsetWrite Hook WRITE Access
  * @param UnsetExecute Hook EXECUTE Access
+ * @param DeliverVe Deliver the accesses as #VE to the guest (read/write hooks of all the cores)
+ * @param WatchLength Count of the watched bytes from TargetAddress in its page (zero for the whole page)
+ * @param InvalidateTlb Invalidate the EPT of the current core (false if the caller invalidates it after a batch)
+ * @param CoreId DEBUGGER_EVENT_APPLY_TO_ALL_CORES or the current core to hook only in its EPT view
+ * @param ProcessId The process that the hook is armed in or zero for all the processes (only the hooks of all the cores)
  * @return BOOLEAN Returns true if the hook was successfull or false if there was an error
  */
 BOOLEAN
-EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN UnsetRead, BOOLEAN UnsetWrite, BOOLEAN UnsetExecute)
+EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN UnsetRead, BOOLEAN UnsetWrite, BOOLEAN UnsetExecute, BOOLEAN DeliverVe, UINT32 WatchLength, BOOLEAN InvalidateTlb, UINT32 CoreId, UINT32 ProcessId)
 {
     EPT_PML1_ENTRY          ChangedEntry;
     INVEPT_DESCRIPTOR       Descriptor;
@@ -977,7 +2378,10 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
     PVOID                   VirtualTarget;
     PVOID                   TargetBuffer;
     PEPT_PML1_ENTRY         TargetPage;
+    PEPT_PML2_ENTRY         TargetLargePage;
     PEPT_HOOKED_PAGE_DETAIL HookedPage;
+    PEPT_HOOKED_PAGE_DETAIL ExistingHook;
+    PVMM_EPT_CORE_VIEW      View = NULL;
     ULONG                   LogicalCoreIndex;
 
     //
@@ -990,6 +2394,39 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
         return FALSE;
     }
 
+    //
+    // The view of a core can only be changed from vmx-root of that core
+    //
+    if (CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+    {
+        if (CoreId != LogicalCoreIndex || !g_GuestState[LogicalCoreIndex].HasLaunched || !g_EptState->CoreViews)
+        {
+            LogError("The hooks of a core should be applied from vmx-root of that core");
+            return FALSE;
+        }
+
+        View = &g_EptState->CoreViews[CoreId];
+    }
+
+    //
+    // The scoped hooks are not hooked in the disarmed view, and there is only
+    // one disarmed view so the scoped hooks are of the same process
+    //
+    if (ProcessId != 0)
+    {
+        if (View || !g_EptState->DisarmedView)
+        {
+            LogError("The hooks of a process should be applied to all the cores and need the disarmed view");
+            return FALSE;
+        }
+
+        if (g_EptState->CountOfScopedHooks != 0 && g_EptState->ScopedHooksProcessId != ProcessId)
+        {
+            LogError("There are hooks of another process, the hooks of a process are armed in a single process");
+            return FALSE;
+        }
+    }
+
     //
     // Translate the page from a physical address to virtual so we can read its memory.
     // This function will return NULL if the physical address was not already mapped in
@@ -1006,27 +2443,97 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
     }
 
     //
-    // Set target buffer, request buffer from pool manager,
-    // we also need to allocate new page to replace the current page ASAP
+    // A page is either hooked in all the cores or in the view of a core, as
+    // the entries in the views are copies of the global ones
     //
-    TargetBuffer = PoolManagerRequestPool(SPLIT_2MB_PAGING_TO_4KB_PAGE, TRUE, sizeof(VMM_EPT_DYNAMIC_SPLIT));
+    ExistingHook = EptHookedPagesTableFind(PhysicalAddress);
 
-    if (!TargetBuffer)
+    if (ExistingHook && (CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES || ExistingHook->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES))
     {
-        LogError("There is no pre-allocated buffer available");
+        LogError("The page is already hooked for another core");
+        return FALSE;
+    }
+
+    if (ExistingHook && ExistingHook->ProcessId != ProcessId)
+    {
+        LogError("The page is already hooked for another process");
         return FALSE;
     }
 
-    if (!EptSplitLargePage(g_EptState->EptPageTable, TargetBuffer, PhysicalAddress, LogicalCoreIndex))
-    {
-        LogError("Could not split page for the address : 0x%llx", PhysicalAddress);
-        return FALSE;
-    }
+    if (View)
+    {
+        //
+        // Copy the tables of this page to the view of the core
+        //
+        if (!EptCoreViewPrivatizePage(View, PhysicalAddress))
+        {
+            LogError("Could not split page for the address : 0x%llx", PhysicalAddress);
+            return FALSE;
+        }
+
+        TargetPage = EptCoreViewGetPml1Entry(View, PhysicalAddress);
+    }
+    else
+    {
+        //
+        // Set target buffer, request buffer from pool manager,
+        // we also need to allocate new page to replace the current page ASAP
+        // (if the page is already split, then there is no need to a new buffer)
+        //
+        if (!EptSplit1GbPage(PhysicalAddress))
+        {
+            LogError("Could not split page for the address : 0x%llx", PhysicalAddress);
+            return FALSE;
+        }
+
+        TargetLargePage = EptGetPml2Entry(g_EptState->EptPageTable, PhysicalAddress);
+        TargetBuffer    = NULL;
+
+        if (TargetLargePage && TargetLargePage->LargePage)
+        {
+            TargetBuffer = PoolManagerRequestPool(SPLIT_2MB_PAGING_TO_4KB_PAGE, TRUE, sizeof(VMM_EPT_DYNAMIC_SPLIT));
+
+            if (!TargetBuffer)
+            {
+                LogError("There is no pre-allocated buffer available");
+                return FALSE;
+            }
+        }
+
+        if (!EptSplitLargePage(g_EptState->EptPageTable, TargetBuffer, PhysicalAddress, LogicalCoreIndex))
+        {
+            LogError("Could not split page for the address : 0x%llx", PhysicalAddress);
+            return FALSE;
+        }
+
+        if (TargetBuffer)
+        {
+            EptCoreViewsSyncSplit(PhysicalAddress);
+        }
+
+        //
+        // The clean view needs its own entry for this page
+        //
+        if (g_EptState->CleanView && !EptCoreViewPrivatizePage(g_EptState->CleanView, PhysicalAddress))
+        {
+            LogError("Could not split page in the clean view for the address : 0x%llx", PhysicalAddress);
+            return FALSE;
+        }
+
+        //
+        // The disarmed view keeps the original entry of the scoped hooks
+        //
+        if (ProcessId != 0 && !EptCoreViewPrivatizePage(g_EptState->DisarmedView, PhysicalAddress))
+        {
+            LogError("Could not split page in the disarmed view for the address : 0x%llx", PhysicalAddress);
+            return FALSE;
+        }
 
-    //
-    // Pointer to the page entry in the page table
-    //
-    TargetPage = EptGetPml1Entry(g_EptState->EptPageTable, PhysicalAddress);
+        //
+        // Pointer to the page entry in the page table
+        //
+        TargetPage = EptGetPml1Entry(g_EptState->EptPageTable, PhysicalAddress);
+    }
 
     //
     // Ensure the target is valid
@@ -1055,6 +2562,17 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
     else
         ChangedEntry.WriteAccess = 1;
 
+    //
+    // Only the violations of the entries with "suppress #VE" = 0 are delivered
+    // as #VE, the other hooks are always handled in vmx-root
+    //
+    ChangedEntry.SuppressVe = (DeliverVe && !UnsetExecute && !View && !ProcessId && VeCoreStates) ? 0 : 1;
+
+    //
+    // The other hooks of the page are not sub-page watches
+    //
+    ChangedEntry.SubPageWritePermissions = 0;
+
     //
     // Save the detail of hooked page to keep track of it
     //
@@ -1086,6 +2604,46 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
     //
     HookedPage->EntryAddress = TargetPage;
 
+    //
+    // Save the scope of the hook
+    //
+    HookedPage->CoreId    = CoreId;
+    HookedPage->ProcessId = ProcessId;
+
+    //
+    // Save the watched bytes, the accesses to the other bytes of the page are
+    // not reported
+    //
+    if (WatchLength != 0 && !UnsetExecute)
+    {
+        HookedPage->WatchStart = (UINT32)ADDRMASK_EPT_PML1_OFFSET((SIZE_T)TargetAddress);
+        HookedPage->WatchEnd   = (UINT32)min((SIZE_T)HookedPage->WatchStart + WatchLength, PAGE_SIZE);
+    }
+    else
+    {
+        HookedPage->WatchStart = 0;
+        HookedPage->WatchEnd   = PAGE_SIZE;
+    }
+
+    //
+    // Only the writes to the watched sub-pages of a write watch cause vm-exit
+    // if SPP is supported, otherwise the other writes are filtered in vmx-root
+    //
+    HookedPage->IsSubPageWatch = FALSE;
+
+    if (WatchLength != 0 && UnsetWrite && !UnsetRead && !UnsetExecute && !ExistingHook && g_EptState->SppTable)
+    {
+        if (EptSppSetWritePermissions(PhysicalAddress, EptSppGetWritePermissions(HookedPage->WatchStart, HookedPage->WatchEnd)))
+        {
+            HookedPage->IsSubPageWatch           = TRUE;
+            ChangedEntry.SubPageWritePermissions = 1;
+        }
+        else
+        {
+            LogWarning("There is no pre-allocated table for sub-page write permissions, the writes to the page are filtered in vmx-root");
+        }
+    }
+
     //
     // Save the orginal entry
     //
@@ -1135,10 +2693,61 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
     HookedPage->ChangedEntry = ChangedEntry;
 
     //
-    // Add it to the list
+    // Add it to the index of the hooked pages, then to the list
     //
+    if (!EptHookedPagesTableInsert(HookedPage))
+    {
+        LogError("There are too many hooked pages");
+        return FALSE;
+    }
+
     InsertHeadList(&g_EptState->HookedPagesList, &(HookedPage->PageHookList));
 
+    //
+    // The split is merged into a large page when the last hook on it is removed
+    //
+    EptAcquireSplitOfHookedPage(HookedPage);
+
+    //
+    // The core starts to use its view with the first hook in the view, the
+    // view is the same as the global tables at this point
+    //
+    if (View && !View->IsActive)
+    {
+        View->IsActive                        = TRUE;
+        View->EptpList[EPT_VIEW_INDEX_HOOKED] = View->EptPointer.Flags;
+        __vmx_vmwrite(EPT_POINTER, View->EptPointer.Flags);
+    }
+
+    //
+    // The hooks of all the cores are also applied to the private tables of the views
+    //
+    if (!View)
+    {
+        EptCoreViewsApplyEntry(PhysicalAddress, TargetPage, ChangedEntry);
+        EptCleanViewApplyHook(HookedPage, TRUE);
+
+        //
+        // The original entry of another scoped hook of the page is the hooked
+        // entry, the disarmed view already has the original one
+        //
+        if (!ExistingHook || ProcessId == 0)
+        {
+            EptDisarmedViewApplyHook(HookedPage, TRUE);
+        }
+
+        if (!UnsetExecute)
+        {
+            InterlockedIncrement(&g_EptState->CountOfMonitorHooks);
+        }
+
+        if (ProcessId != 0)
+        {
+            g_EptState->ScopedHooksProcessId = ProcessId;
+            InterlockedIncrement(&g_EptState->CountOfScopedHooks);
+        }
+    }
+
     //
     // if not launched, there is no need to modify it on a safe environment
     //
@@ -1149,17 +2758,93 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
         //
         TargetPage->Flags = ChangedEntry.Flags;
     }
+    else if (InvalidateTlb)
+    {
+        //
+        // Apply the hook to EPT (the clean view and the disarmed view are also changed)
+        //
+        EptSetPML1AndInvalidateTLB(TargetPage, ChangedEntry, (!View && (g_EptState->CleanView || g_EptState->DisarmedView)) ? INVEPT_ALL_CONTEXTS : INVEPT_SINGLE_CONTEXT);
+    }
     else
     {
         //
-        // Apply the hook to EPT
+        // Apply the hook to EPT, the caller invalidates the TLB
         //
-        EptSetPML1AndInvalidateTLB(TargetPage, ChangedEntry, INVEPT_SINGLE_CONTEXT);
+        SpinlockLock(&Pml1ModificationAndInvalidationLock);
+        TargetPage->Flags = ChangedEntry.Flags;
+        SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+    }
+
+    if (!View && g_GuestState[LogicalCoreIndex].HasLaunched)
+    {
+        EptCleanViewLeave();
     }
 
     return TRUE;
 }
 
+/**
+ * @brief Hook a batch of pages with a single invalidation of the EPT
+ * @details This function have to be called through a VMCALL in VMX Root Mode (or
+ * before launching the VM), only the entries with STATUS_PENDING are hooked
+ * 
+ * @param Entries The pages to hook (Status of each entry is set)
+ * @param CountOfEntries Count of the entries
+ * @return UINT32 Count of the hooked pages
+ */
+UINT32
+EptPerformPageHookBatch(PEPT_HOOK_BATCH_ENTRY Entries, UINT32 CountOfEntries)
+{
+    UINT32 CountOfSucceeded = 0;
+    ULONG  LogicalCoreIndex = KeGetCurrentProcessorIndex();
+
+    for (UINT32 i = 0; i < CountOfEntries; i++)
+    {
+        if (Entries[i].Status != STATUS_PENDING)
+        {
+            continue;
+        }
+
+        if (EptPerformPageHook(Entries[i].Address,
+                               Entries[i].HookFunction,
+                               Entries[i].OrigFunction,
+                               (Entries[i].Attributes & PAGE_ATTRIB_READ) ? TRUE : FALSE,
+                               (Entries[i].Attributes & PAGE_ATTRIB_WRITE) ? TRUE : FALSE,
+                               (Entries[i].Attributes & PAGE_ATTRIB_EXEC) ? TRUE : FALSE,
+                               (Entries[i].Attributes & PAGE_ATTRIB_VE) ? TRUE : FALSE,
+                               Entries[i].WatchLength,
+                               FALSE,
+                               DEBUGGER_EVENT_APPLY_TO_ALL_CORES,
+                               Entries[i].ProcessId))
+        {
+            Entries[i].Status = STATUS_SUCCESS;
+            CountOfSucceeded++;
+        }
+        else
+        {
+            Entries[i].Status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    //
+    // Invalidate the EPT of this core once for all the entries, the other
+    // cores are notified by the caller
+    //
+    if (CountOfSucceeded != 0 && g_GuestState[LogicalCoreIndex].HasLaunched)
+    {
+        if (g_EptState->CleanView || g_EptState->DisarmedView)
+        {
+            InveptAllContexts();
+        }
+        else
+        {
+            InveptSingleContext(EptGetEptPointerOfCore(LogicalCoreIndex));
+        }
+    }
+
+    return CountOfSucceeded;
+}
+
 /**
  * @brief This function allocates a buffer in VMX Non Root Mode and then invokes a VMCALL to set the hook
  * 
@@ -1173,12 +2858,33 @@ EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction
  */
 BOOLEAN
 EptPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN SetHookForRead, BOOLEAN SetHookForWrite, BOOLEAN SetHookForExec)
+{
+    return EptPageHookOnCore(DEBUGGER_EVENT_APPLY_TO_ALL_CORES, TargetAddress, HookFunction, OrigFunction, SetHookForRead, SetHookForWrite, SetHookForExec);
+}
+
+/**
+ * @brief Set a hook in all the cores or only in the EPT view of a single core
+ * @details The hooks of a single core only change the view of that core, so
+ * only that core invalidates its EPT
+ * 
+ * @param CoreId Index of the core or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+ * @param TargetAddress The address of function or memory address to be hooked
+ * @param HookFunction The function that will be called when hook triggered
+ * @param OrigFunction A pointer to write the restore point on it (HookFunction should finally jump to this address)
+ * @param SetHookForRead Hook READ Access
+ * @param SetHookForWrite Hook WRITE Access
+ * @param SetHookForExec Hook EXECUTE Access
+ * @return BOOLEAN Returns true if the hook was successfull or false if there was an error
+ */
+BOOLEAN
+EptPageHookOnCore(UINT32 CoreId, PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN SetHookForRead, BOOLEAN SetHookForWrite, BOOLEAN SetHookForExec)
 {
     ULONG                   LogicalProcCounts;
     PVOID                   PreAllocBuff;
     PVOID                   PagedAlignTarget;
     PEPT_HOOKED_PAGE_DETAIL HookedPageDetail;
     UINT32                  PageHookMask = 0;
+    BOOLEAN                 HookResult;
     ULONG                   LogicalCoreIndex;
 
     //
@@ -1227,7 +2933,35 @@ EptPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLE
         return FALSE;
     }
 
-    if (g_GuestState[LogicalCoreIndex].HasLaunched)
+    if (CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES)
+    {
+        if (CoreId >= KeQueryActiveProcessorCount(0) || !g_GuestState[LogicalCoreIndex].HasLaunched || g_GuestState[LogicalCoreIndex].IsOnVmxRootMode)
+        {
+            LogError("The hooks of a single core should be applied from vmx non-root after launching the VM");
+            return FALSE;
+        }
+
+        PageHookMask |= PAGE_ATTRIB_CURRENT_CORE;
+
+        //
+        // The VMCALL should be executed in the target core
+        //
+        KeSetSystemAffinityThread((KAFFINITY)(1ULL << CoreId));
+
+        HookResult = AsmVmxVmcall(((UINT64)PageHookMask) << 32 | VMCALL_CHANGE_PAGE_ATTRIB, TargetAddress, HookFunction, OrigFunction) == STATUS_SUCCESS;
+
+        KeRevertToUserAffinityThread();
+
+        if (HookResult)
+        {
+            //
+            // No need to notify the other cores, their EPT is not changed
+            //
+            LogInfo("Hook applied to the core %x", CoreId);
+            return TRUE;
+        }
+    }
+    else if (g_GuestState[LogicalCoreIndex].HasLaunched)
     {
         //
         // Move Attribute Mask to the upper 32 bits of the VMCALL Number
@@ -1254,7 +2988,7 @@ EptPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLE
     }
     else
     {
-        if (EptPerformPageHook(TargetAddress, HookFunction, OrigFunction, SetHookForRead, SetHookForWrite, SetHookForExec) == TRUE)
+        if (EptPerformPageHook(TargetAddress, HookFunction, OrigFunction, SetHookForRead, SetHookForWrite, SetHookForExec, FALSE, 0, TRUE, DEBUGGER_EVENT_APPLY_TO_ALL_CORES, 0) == TRUE)
         {
             LogInfo("[*] Hook applied (VM has not launched)");
             return TRUE;
@@ -1265,6 +2999,190 @@ EptPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLE
     return FALSE;
 }
 
+/**
+ * @brief Hook a batch of pages with a single VMCALL and a single EPT invalidation
+ * @details Should be called from vmx non-root in PASSIVE_LEVEL, as the buffers
+ * of the whole batch are allocated here
+ * 
+ * @param Entries The pages to hook (Status of each entry is set)
+ * @param CountOfEntries Count of the entries
+ * @return UINT32 Count of the hooked pages
+ */
+UINT32
+EptPageHookBatch(PEPT_HOOK_BATCH_ENTRY Entries, UINT32 CountOfEntries)
+{
+    UINT32 CountOfValidEntries  = 0;
+    UINT32 CountOfExecEntries   = 0;
+    UINT32 CountOf1GbPages      = 0;
+    UINT32 CountOfRangeWatches  = 0;
+    UINT32 CountOfScopedEntries = 0;
+    UINT32 CountOfScopedSplits  = 0;
+    UINT32 CountOfSucceeded     = 0;
+    SIZE_T PhysicalAddress;
+    ULONG  LogicalCoreIndex;
+
+    LogicalCoreIndex = KeGetCurrentProcessorIndex();
+
+    if (g_GuestState[LogicalCoreIndex].IsOnVmxRootMode)
+    {
+        return 0;
+    }
+
+    //
+    // Check the entries the same as EptPageHook
+    //
+    for (UINT32 i = 0; i < CountOfEntries; i++)
+    {
+        UINT32 Attributes = Entries[i].Attributes & (PAGE_ATTRIB_READ | PAGE_ATTRIB_WRITE | PAGE_ATTRIB_EXEC | PAGE_ATTRIB_VE);
+
+        if ((Attributes & ~PAGE_ATTRIB_VE) == 0 || Entries[i].Address == NULL ||
+            ((Attributes & PAGE_ATTRIB_WRITE) && !(Attributes & PAGE_ATTRIB_READ) && Entries[i].WatchLength == 0) ||
+            ((Attributes & PAGE_ATTRIB_EXEC) && Entries[i].HookFunction == NULL))
+        {
+            Entries[i].Status = STATUS_INVALID_PARAMETER;
+            continue;
+        }
+
+        if (((Attributes & PAGE_ATTRIB_EXEC) && !g_ExecuteOnlySupport) || (Entries[i].ProcessId != 0 && !g_EptState->DisarmedView))
+        {
+            Entries[i].Status = STATUS_NOT_SUPPORTED;
+            continue;
+        }
+
+        Entries[i].Attributes = Attributes;
+        Entries[i].Status     = STATUS_PENDING;
+        CountOfValidEntries++;
+
+        if (Attributes & PAGE_ATTRIB_EXEC)
+        {
+            CountOfExecEntries++;
+        }
+        else if (Entries[i].WatchLength != 0)
+        {
+            CountOfRangeWatches++;
+        }
+
+        //
+        // The hooks in 1GB pages need a table of 2MB pages
+        //
+        PhysicalAddress = (SIZE_T)VirtualAddressToPhysicalAddress(Entries[i].Address);
+
+        if (PhysicalAddress && ADDRMASK_EPT_PML4_INDEX(PhysicalAddress) == 0 &&
+            !g_EptState->EptPageTable->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)])
+        {
+            CountOf1GbPages++;
+        }
+
+        //
+        // The scoped hooks are also split in the disarmed view, which needs its
+        // own table of 2MB pages for each 1GB
+        //
+        if (Entries[i].ProcessId != 0)
+        {
+            CountOfScopedEntries++;
+
+            if (PhysicalAddress && ADDRMASK_EPT_PML4_INDEX(PhysicalAddress) == 0 &&
+                g_EptState->DisarmedView->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)] == g_EptState->EptPageTable->PML2[ADDRMASK_EPT_PML3_INDEX(PhysicalAddress)])
+            {
+                CountOfScopedSplits++;
+            }
+        }
+    }
+
+    if (CountOfValidEntries == 0)
+    {
+        return 0;
+    }
+
+    //
+    // There are only a few pre-allocated buffers and vmx-root can't allocate
+    // new buffers, so allocate the buffers of the whole batch now
+    //
+    PoolManagerRequestAllocation(sizeof(VMM_EPT_DYNAMIC_SPLIT), (g_EptState->CleanView ? CountOfValidEntries * 2 : CountOfValidEntries) + CountOfScopedEntries, SPLIT_2MB_PAGING_TO_4KB_PAGE);
+    PoolManagerRequestAllocation(sizeof(EPT_HOOKED_PAGE_DETAIL), CountOfValidEntries, TRACKING_HOOKED_PAGES);
+
+    if (CountOfScopedSplits != 0)
+    {
+        PoolManagerRequestAllocation(sizeof(VMM_EPT_PML2_TABLE), CountOfScopedSplits, EPT_CORE_VIEW_PML2_TABLE);
+    }
+
+    if (CountOf1GbPages != 0)
+    {
+        PoolManagerRequestAllocation(sizeof(VMM_EPT_PML2_TABLE), CountOf1GbPages, SPLIT_1GB_PAGING_TO_2MB_PAGE);
+    }
+
+    //
+    // The sub-page watches need at most three tables of SPPT for each page
+    //
+    if (CountOfRangeWatches != 0 && g_EptState->SppTable)
+    {
+        PoolManagerRequestAllocation(sizeof(VMM_EPT_SPP_TABLE), CountOfRangeWatches * 3, SPP_TABLE);
+    }
+
+    if (CountOfExecEntries != 0)
+    {
+        TrampolineArenaRequestPages(CountOfExecEntries);
+        PoolManagerRequestAllocation(sizeof(HIDDEN_HOOKS_DETOUR_DETAILS), CountOfExecEntries, DETOUR_HOOK_DETAILS);
+    }
+
+    PoolManagerCheckAndPerformAllocation();
+
+    if (g_GuestState[LogicalCoreIndex].HasLaunched)
+    {
+        AsmVmxVmcall(VMCALL_CHANGE_PAGE_ATTRIB_BATCH, Entries, CountOfEntries, NULL);
+
+        for (UINT32 i = 0; i < CountOfEntries; i++)
+        {
+            if (Entries[i].Status == STATUS_SUCCESS)
+            {
+                CountOfSucceeded++;
+            }
+        }
+
+        if (CountOfSucceeded != 0)
+        {
+            //
+            // Now we have to notify all the core to invalidate their EPT (only once)
+            //
+            HvNotifyAllToInvalidateEpt();
+        }
+
+        //
+        // The cores switch to the disarmed view on the cr3 loads of the other
+        // processes, the current process of each core is checked now
+        //
+        if (CountOfSucceeded != 0 && CountOfScopedEntries != 0)
+        {
+            BroadcastVmcallToAllCores(VMCALL_CONFIGURE_SCOPED_HOOKS, g_EptState->CountOfScopedHooks != 0);
+        }
+    }
+    else
+    {
+        CountOfSucceeded = EptPerformPageHookBatch(Entries, CountOfEntries);
+    }
+
+    LogInfo("%d of %d hooks applied", CountOfSucceeded, CountOfEntries);
+
+    return CountOfSucceeded;
+}
+
+/**
+ * @brief Set a PML1 entry without invalidating EPT
+ * @details Should be called from vmx-root, only if the cached translations of
+ * the entry are already invalidated (e.g. by the EPT violation of the page)
+ * 
+ * @param EntryAddress The PML1 entry
+ * @param EntryValue The value of the entry
+ * @return VOID 
+ */
+VOID
+EptSetPML1(PEPT_PML1_ENTRY EntryAddress, EPT_PML1_ENTRY EntryValue)
+{
+    SpinlockLock(&Pml1ModificationAndInvalidationLock);
+    EntryAddress->Flags = EntryValue.Flags;
+    SpinlockUnlock(&Pml1ModificationAndInvalidationLock);
+}
+
 /**
  * @brief This function set the specific PML1 entry in a spinlock protected area then invalidate the TLB
  * @details This function should be called from vmx root-mode
@@ -1290,7 +3208,7 @@ EptSetPML1AndInvalidateTLB(PEPT_PML1_ENTRY EntryAddress, EPT_PML1_ENTRY EntryVal
     //
     if (InvalidationType == INVEPT_SINGLE_CONTEXT)
     {
-        InveptSingleContext(g_EptState->EptPointer.Flags);
+        InveptSingleContext(EptGetEptPointerOfCore(KeGetCurrentProcessorNumber()));
     }
     else
     {
@@ -1314,7 +3232,7 @@ EptSetPML1AndInvalidateTLB(PEPT_PML1_ENTRY EntryAddress, EPT_PML1_ENTRY EntryVal
 BOOLEAN
 EptPageUnHookSinglePage(SIZE_T PhysicalAddress)
 {
-    PLIST_ENTRY TempList = 0;
+    PEPT_HOOKED_PAGE_DETAIL HookedEntry;
 
     //
     // Should be called from vmx-root, for calling from vmx non-root use the corresponding VMCALL
@@ -1324,19 +3242,32 @@ EptPageUnHookSinglePage(SIZE_T PhysicalAddress)
         return FALSE;
     }
 
-    TempList = &g_EptState->HookedPagesList;
-    while (&g_EptState->HookedPagesList != TempList->Flink)
+    HookedEntry = EptHookedPagesTableFind(PhysicalAddress);
+
+    if (HookedEntry)
     {
-        TempList                            = TempList->Flink;
-        PEPT_HOOKED_PAGE_DETAIL HookedEntry = CONTAINING_RECORD(TempList, EPT_HOOKED_PAGE_DETAIL, PageHookList);
-        if (HookedEntry->PhysicalBaseAddress == PAGE_ALIGN(PhysicalAddress))
+        //
+        // Undo the hook on the EPT table of this core (the hooks of the other
+        // cores are not in its view)
+        //
+        if (HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES && (g_EptState->CleanView || g_EptState->DisarmedView))
         {
+            EptCleanViewApplyHook(HookedEntry, FALSE);
+            EptDisarmedViewApplyHook(HookedEntry, FALSE);
+
             //
-            // Undo the hook on the EPT table
+            // The global entry is also restored as all the cores might be disarmed
             //
-            EptSetPML1AndInvalidateTLB(HookedEntry->EntryAddress, HookedEntry->OriginalEntry, INVEPT_SINGLE_CONTEXT);
-            return TRUE;
+            EptSetPML1(HookedEntry->EntryAddress, HookedEntry->OriginalEntry);
+            EptSetPML1AndInvalidateTLB(EptGetHookedPageEntryOfCore(HookedEntry, KeGetCurrentProcessorNumber()), HookedEntry->OriginalEntry, INVEPT_ALL_CONTEXTS);
+            EptCleanViewLeave();
         }
+        else if (HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES || HookedEntry->CoreId == KeGetCurrentProcessorNumber())
+        {
+            EptSetPML1AndInvalidateTLB(EptGetHookedPageEntryOfCore(HookedEntry, KeGetCurrentProcessorNumber()), HookedEntry->OriginalEntry, INVEPT_SINGLE_CONTEXT);
+        }
+
+        return TRUE;
     }
     //
     // Nothing found, probably the list is not found
@@ -1369,9 +3300,26 @@ EptPageUnHookAllPages()
         TempList                            = TempList->Flink;
         PEPT_HOOKED_PAGE_DETAIL HookedEntry = CONTAINING_RECORD(TempList, EPT_HOOKED_PAGE_DETAIL, PageHookList);
 
+        if (HookedEntry->CoreId != DEBUGGER_EVENT_APPLY_TO_ALL_CORES && HookedEntry->CoreId != KeGetCurrentProcessorNumber())
+        {
+            continue;
+        }
+
         //
-        // Undo the hook on the EPT table
+        // Undo the hook on the EPT table (and the clean view and the disarmed view)
         //
-        EptSetPML1AndInvalidateTLB(HookedEntry->EntryAddress, HookedEntry->OriginalEntry, INVEPT_SINGLE_CONTEXT);
+        if (HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES && (g_EptState->CleanView || g_EptState->DisarmedView))
+        {
+            EptCleanViewApplyHook(HookedEntry, FALSE);
+            EptDisarmedViewApplyHook(HookedEntry, FALSE);
+            EptSetPML1(HookedEntry->EntryAddress, HookedEntry->OriginalEntry);
+            EptSetPML1AndInvalidateTLB(EptGetHookedPageEntryOfCore(HookedEntry, KeGetCurrentProcessorNumber()), HookedEntry->OriginalEntry, INVEPT_ALL_CONTEXTS);
+        }
+        else
+        {
+            EptSetPML1AndInvalidateTLB(EptGetHookedPageEntryOfCore(HookedEntry, KeGetCurrentProcessorNumber()), HookedEntry->OriginalEntry, INVEPT_SINGLE_CONTEXT);
+        }
     }
+
+    EptCleanViewLeave();
 }
@@ -11,6 +11,7 @@
  */
 #pragma once
 #include <ntddk.h>
+#include "Definition.h"
 
 //////////////////////////////////////////////////
 //					Constants					//
@@ -53,12 +54,28 @@
 #define PAGE_ATTRIB_WRITE 0x4
 #define PAGE_ATTRIB_EXEC  0x8
 
+// Hook only in the EPT view of the current core */
+#define PAGE_ATTRIB_CURRENT_CORE 0x10
+
+// Deliver the accesses of a read/write hook as #VE (if it's supported) */
+#define PAGE_ATTRIB_VE 0x20
+
 // VMX EPT & VPID Capabilities MSR */
 #define MSR_IA32_VMX_EPT_VPID_CAP 0x0000048C
 
 // MTRR Def MSR */
 #define MSR_IA32_MTRR_DEF_TYPE 0x000002FF
 
+/* Slots of the index of the hooked pages (power of 2) */
+#define EPT_HOOKED_PAGES_TABLE_BITS 11
+#define EPT_HOOKED_PAGES_TABLE_SIZE (1 << EPT_HOOKED_PAGES_TABLE_BITS)
+
+/* Maximum count of the hooked pages in the index (3/4 of the slots) */
+#define EPT_HOOKED_PAGES_TABLE_MAXIMUM_ENTRIES (EPT_HOOKED_PAGES_TABLE_SIZE / 4 * 3)
+
+/* Marks the slots of the removed hooks in the index */
+#define EPT_HOOKED_PAGES_TABLE_DELETED_ENTRY ((struct _EPT_HOOKED_PAGE_DETAIL *)1)
+
 // MTRR Capabilities MSR */
 #define MSR_IA32_MTRR_CAPABILITIES 0x000000FE
 
@@ -77,6 +94,21 @@
 /* Integer 2MB */
 #define SIZE_2_MB ((SIZE_T)(512 * PAGE_SIZE))
 
+/* Integer 1GB */
+#define SIZE_1_GB ((SIZE_T)(512 * SIZE_2_MB))
+
+/* Size of the sub-pages of sub-page write permissions (SPP) */
+#define EPT_SPP_SUBPAGE_SIZE 128
+
+/* Count of the sub-pages of each page */
+#define EPT_SPP_SUBPAGES_PER_PAGE (PAGE_SIZE / EPT_SPP_SUBPAGE_SIZE)
+
+/* Valid bit of the non-leaf entries of SPPT */
+#define EPT_SPPT_ENTRY_VALID 0x1ULL
+
+/* Physical address of the next table in the non-leaf entries of SPPT */
+#define EPT_SPPT_ENTRY_ADDRESS_MASK 0x000FFFFFFFFFF000ULL
+
 /* Offset into the 1st paging structure (4096 byte) */
 #define ADDRMASK_EPT_PML1_OFFSET(_VAR_) (_VAR_ & 0xFFFULL)
 
@@ -668,7 +700,16 @@ typedef union _EPTE
 		 * @brief [Bits 47:12] Physical address of the 4-KByte page referenced by this entry.
 		 */
         UINT64 PageFrameNumber : 36;
-        UINT64 Reserved3 : 15;
+        UINT64 Reserved3 : 13;
+
+        /**
+		 * @brief [Bit 61] Sub-page write permissions. If the "sub-page write permissions for EPT" VM-execution control is 1 and
+		 * write access is 0, the writes to this page are allowed based on the write permissions of the 128-byte sub-pages in SPPT.
+		 *
+		 * @see Vol3C[28.2.4(Sub-Page Write Permissions)]
+		 */
+        UINT64 SubPageWritePermissions : 1;
+        UINT64 Reserved4 : 1;
 
         /**
 		 * @brief [Bit 63] Suppress \#VE. If the "EPT-violation \#VE" VM-execution control is 1, EPT violations caused by accesses to this
@@ -687,11 +728,12 @@ typedef union _EPTE
 //				      typedefs         			 //
 //////////////////////////////////////////////////
 
-typedef EPT_PML4 EPT_PML4_POINTER, *PEPT_PML4_POINTER;
-typedef EPDPTE   EPT_PML3_POINTER, *PEPT_PML3_POINTER;
-typedef EPDE_2MB EPT_PML2_ENTRY, *PEPT_PML2_ENTRY;
-typedef EPDE     EPT_PML2_POINTER, *PEPT_PML2_POINTER;
-typedef EPTE     EPT_PML1_ENTRY, *PEPT_PML1_ENTRY;
+typedef EPT_PML4   EPT_PML4_POINTER, *PEPT_PML4_POINTER;
+typedef EPDPTE     EPT_PML3_POINTER, *PEPT_PML3_POINTER;
+typedef EPDPTE_1GB EPT_PML3_ENTRY, *PEPT_PML3_ENTRY;
+typedef EPDE_2MB   EPT_PML2_ENTRY, *PEPT_PML2_ENTRY;
+typedef EPDE       EPT_PML2_POINTER, *PEPT_PML2_POINTER;
+typedef EPTE       EPT_PML1_ENTRY, *PEPT_PML1_ENTRY;
 
 //////////////////////////////////////////////////
 //			     Structs Cont.                	//
@@ -716,12 +758,13 @@ typedef struct _VMM_EPT_PAGE_TABLE
     EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
 
     /**
-	 * @brief For each 1GB PML3 entry, create 512 2MB entries to map identity.
+	 * @brief For each 1GB PML3 entry, a table of 512 2MB entries to map identity or NULL if the 1GB is mapped as a
+	 * large page (the tables are allocated by the pool manager when the 1GB page is split).
 	 * NOTE: We are using 2MB pages as the smallest paging size in our map, so we do not manage individiual 4096 byte pages.
 	 * Therefore, we do not allocate any PML1 (4096 byte) paging structures.
 	 */
     DECLSPEC_ALIGN(PAGE_SIZE)
-    EPT_PML2_ENTRY PML2[VMM_EPT_PML3E_COUNT][VMM_EPT_PML2E_COUNT];
+    PEPT_PML2_ENTRY PML2[VMM_EPT_PML3E_COUNT];
 
 } VMM_EPT_PAGE_TABLE, *PVMM_EPT_PAGE_TABLE;
 
@@ -923,17 +966,104 @@ typedef struct _MTRR_RANGE_DESCRIPTOR
     UCHAR  MemoryType;
 } MTRR_RANGE_DESCRIPTOR, *PMTRR_RANGE_DESCRIPTOR;
 
+/**
+ * @brief A 4096 byte table of PML2 entries (the private 1GB tables of the core views)
+ * 
+ */
+typedef struct _VMM_EPT_PML2_TABLE
+{
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    EPT_PML2_ENTRY PML2[VMM_EPT_PML2E_COUNT];
+
+} VMM_EPT_PML2_TABLE, *PVMM_EPT_PML2_TABLE;
+
+/**
+ * @brief A 4096 byte table of the sub-page permission table (SPPT), the leaf
+ * entries are the write permissions of the sub-pages of each page (bit 2 * i for
+ * the sub-page i)
+ * 
+ */
+typedef struct _VMM_EPT_SPP_TABLE
+{
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    UINT64 Entries[512];
+
+} VMM_EPT_SPP_TABLE, *PVMM_EPT_SPP_TABLE;
+
+/* Count of the entries in the EPTP list of VMFUNC */
+#define EPT_EPTP_LIST_ENTRIES 512
+
+/* Index of the hooked view (the EPT of the core) in the EPTP list */
+#define EPT_VIEW_INDEX_HOOKED 0
+
+/* Index of the clean view in the EPTP list */
+#define EPT_VIEW_INDEX_CLEAN 1
+
+/**
+ * @brief The EPT view of a core
+ * @details The view has its own PML4 and PML3, each PML3 entry points to the
+ * PML2 table of the global page table until a hook of this core changes that
+ * 1GB (copy-on-write), the 2MB entries of this core's hooks are split to a
+ * private PML1 as well, so these hooks don't change the other cores
+ * 
+ */
+typedef struct _VMM_EPT_CORE_VIEW
+{
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    EPT_PML4_POINTER PML4[VMM_EPT_PML4E_COUNT];
+
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    EPT_PML3_POINTER PML3[VMM_EPT_PML3E_COUNT];
+
+    /**
+	 * @brief The EPTP list of the core for EPTP switching (VM function 0)
+	 */
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    UINT64 EptpList[EPT_EPTP_LIST_ENTRIES];
+
+    /**
+	 * @brief The PML2 table of each 1GB (the global one or a private copy), NULL if it's a 1GB page
+	 */
+    PEPT_PML2_ENTRY PML2[VMM_EPT_PML3E_COUNT];
+
+    /**
+	 * @brief Extended-Page-Table Pointer of this view
+	 */
+    EPTP EptPointer;
+
+    /**
+	 * @brief Whether the core uses this view (after the first hook of this core)
+	 */
+    BOOLEAN IsActive;
+
+    /**
+	 * @brief Whether the core uses the disarmed view (the current process is not the process of the scoped hooks)
+	 */
+    BOOLEAN IsDisarmed;
+
+} VMM_EPT_CORE_VIEW, *PVMM_EPT_CORE_VIEW;
+
 /**
  * @brief Main structure for saving the state of EPT among the project
  * 
  */
 typedef struct _EPT_STATE
 {
-    LIST_ENTRY            HookedPagesList;             // A list of the details about hooked pages
-    MTRR_RANGE_DESCRIPTOR MemoryRanges[9];             // Physical memory ranges described by the BIOS in the MTRRs. Used to build the EPT identity mapping.
-    ULONG                 NumberOfEnabledMemoryRanges; // Number of memory ranges specified in MemoryRanges
-    EPTP                  EptPointer;                  // Extended-Page-Table Pointer
-    PVMM_EPT_PAGE_TABLE   EptPageTable;                // Page table entries for EPT operation
+    LIST_ENTRY                       HookedPagesList;                               // A list of the details about hooked pages
+    LIST_ENTRY                       ReleasedSplitsList;                            // The merged splits that are freed after the EPT of the cores is invalidated
+    UINT32                           HookedPagesTableCount;                         // Count of the hooked pages in HookedPagesTable (without the removed slots)
+    struct _EPT_HOOKED_PAGE_DETAIL * HookedPagesTable[EPT_HOOKED_PAGES_TABLE_SIZE]; // Index of HookedPagesList by the physical page (open addressing)
+    MTRR_RANGE_DESCRIPTOR            MemoryRanges[9];                               // Physical memory ranges described by the BIOS in the MTRRs. Used to build the EPT identity mapping.
+    ULONG                            NumberOfEnabledMemoryRanges;                   // Number of memory ranges specified in MemoryRanges
+    EPTP                             EptPointer;                                    // Extended-Page-Table Pointer
+    PVMM_EPT_PAGE_TABLE              EptPageTable;                                  // Page table entries for EPT operation
+    PVMM_EPT_CORE_VIEW               CoreViews;                                     // The EPT view of each core (for the hooks of a single core)
+    PVMM_EPT_CORE_VIEW               CleanView;                                     // The view that the hooked pages of all the cores are accessible in (NULL if not available)
+    PVMM_EPT_CORE_VIEW               DisarmedView;                                  // The view that the scoped hooks are not hooked in, for the other processes (NULL if not available)
+    UINT32                           ScopedHooksProcessId;                          // The process that the scoped hooks are armed in
+    volatile LONG                    CountOfScopedHooks;                            // Count of the hooks that are only armed in ScopedHooksProcessId
+    volatile LONG                    CountOfMonitorHooks;                           // Count of the read/write hooks of all the cores (they're not hooked in the clean view)
+    PVMM_EPT_SPP_TABLE               SppTable;                                      // The root of the sub-page permission table (NULL if SPP is not supported)
 
 } EPT_STATE, *PEPT_STATE;
 
@@ -957,7 +1087,26 @@ typedef struct _VMM_EPT_DYNAMIC_SPLIT
     };
 
     /**
-	 * @brief Linked list entries for each dynamic split
+    * @brief The 2MB entry that is replaced by this split, it's restored when the split is merged
+    * 
+    */
+    EPT_PML2_ENTRY OriginalEntry;
+
+    /**
+    * @brief Count of the hooked pages that use the PML1 entries of this split
+    * 
+    */
+    volatile LONG CountOfHookedPages;
+
+    /**
+    * @brief The private PML1 tables of the clean view and the disarmed view that
+    * are freed with this split (after the EPT of the cores is invalidated)
+    * 
+    */
+    UINT64 ReleasedViewTables[2];
+
+    /**
+	 * @brief Linked list entries for each dynamic split (ReleasedSplitsList when it's merged)
 	 * 
 	 */
     LIST_ENTRY DynamicSplitList;
@@ -1126,6 +1275,28 @@ typedef struct _EPT_HOOKED_PAGE_DETAIL
 	 */
     BOOLEAN IsExecutionHook;
 
+    /**
+	 * @brief The core that this page is hooked in its view, or DEBUGGER_EVENT_APPLY_TO_ALL_CORES
+	 */
+    UINT32 CoreId;
+
+    /**
+	 * @brief The offsets of the watched bytes in the page (WatchStart to WatchEnd - 1), the accesses
+	 * to the other bytes are not reported
+	 */
+    UINT32 WatchStart;
+    UINT32 WatchEnd;
+
+    /**
+	 * @brief Whether only the writes to the sub-pages of the watched bytes cause vm-exit (SPP)
+	 */
+    BOOLEAN IsSubPageWatch;
+
+    /**
+	 * @brief The process that the hook is armed in, zero if it's armed in all the processes
+	 */
+    UINT32 ProcessId;
+
 } EPT_HOOKED_PAGE_DETAIL, *PEPT_HOOKED_PAGE_DETAIL;
 
 //////////////////////////////////////////////////
@@ -1154,28 +1325,49 @@ BOOLEAN
 EptBuildMtrrMap();
 /* Hook in VMX Root Mode (A pre-allocated buffer should be available) */
 BOOLEAN
-EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN UnsetRead, BOOLEAN UnsetWrite, BOOLEAN UnsetExecute);
+EptPerformPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN UnsetRead, BOOLEAN UnsetWrite, BOOLEAN UnsetExecute, BOOLEAN DeliverVe, UINT32 WatchLength, BOOLEAN InvalidateTlb, UINT32 CoreId, UINT32 ProcessId);
+/* Hook a batch of pages in VMX Root Mode with a single invalidation */
+UINT32
+EptPerformPageHookBatch(PEPT_HOOK_BATCH_ENTRY Entries, UINT32 CountOfEntries);
 /* Hook in VMX Non Root Mode */
 BOOLEAN
 EptPageHook(PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN SetHookForRead, BOOLEAN SetHookForWrite, BOOLEAN SetHookForExec);
+/* Hook in the EPT view of a single core in VMX Non Root Mode */
+BOOLEAN
+EptPageHookOnCore(UINT32 CoreId, PVOID TargetAddress, PVOID HookFunction, PVOID * OrigFunction, BOOLEAN SetHookForRead, BOOLEAN SetHookForWrite, BOOLEAN SetHookForExec);
+/* Hook a batch of pages in VMX Non Root Mode */
+UINT32
+EptPageHookBatch(PEPT_HOOK_BATCH_ENTRY Entries, UINT32 CountOfEntries);
 /* Initialize EPT Table based on Processor Index */
 BOOLEAN
 EptLogicalProcessorInitialize();
 /* Handle EPT Violation */
 BOOLEAN
 EptHandleEptViolation(ULONG ExitQualification, UINT64 GuestPhysicalAddr);
+/* Split a 2MB entry into 4KB pages */
+BOOLEAN
+EptSplitPml2Entry(PEPT_PML2_ENTRY TargetEntry, PVOID PreAllocatedBuffer);
 /* Get the PML1 Entry of a special address */
 PEPT_PML1_ENTRY
 EptGetPml1Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress);
+/* Get the PML2 Entry of a special address */
+PEPT_PML2_ENTRY
+EptGetPml2Entry(PVMM_EPT_PAGE_TABLE EptPageTable, SIZE_T PhysicalAddress);
 /* Handle vm-exits for Monitor Trap Flag to restore previous state */
 VOID
 EptHandleMonitorTrapFlag(PEPT_HOOKED_PAGE_DETAIL HookedEntry);
 /* Handle Ept Misconfigurations */
 VOID
 EptHandleMisconfiguration(UINT64 GuestAddress);
+/* Handle the SPP misconfigurations and misses */
+VOID
+EptHandleSppEvent(UINT64 GuestPhysicalAddr);
 /* This function set the specific PML1 entry in a spinlock protected area then	invalidate the TLB , this function should be called from vmx root-mode */
 VOID
 EptSetPML1AndInvalidateTLB(PEPT_PML1_ENTRY EntryAddress, EPT_PML1_ENTRY EntryValue, INVEPT_TYPE InvalidationType);
+/* Set a PML1 entry whose translations are already invalidated */
+VOID
+EptSetPML1(PEPT_PML1_ENTRY EntryAddress, EPT_PML1_ENTRY EntryValue);
 /* Handle hooked pages in Vmx-root mode */
 BOOLEAN
 EptHandleHookedPage(EPT_HOOKED_PAGE_DETAIL * HookedEntryDetails, VMX_EXIT_QUALIFICATION_EPT_VIOLATION ViolationQualification, SIZE_T PhysicalAddress);
@@ -1185,3 +1377,36 @@ EptPageUnHookSinglePage(SIZE_T PhysicalAddress);
 /* Remove all hooks from the hooked pages lists */
 VOID
 EptPageUnHookAllPages();
+/* Add a hooked page to the index of the hooked pages */
+BOOLEAN
+EptHookedPagesTableInsert(PEPT_HOOKED_PAGE_DETAIL HookedPage);
+/* Find the hooked page of a physical address in the index */
+PEPT_HOOKED_PAGE_DETAIL
+EptHookedPagesTableFind(SIZE_T PhysicalAddress);
+/* Remove a hooked page from the index of the hooked pages */
+VOID
+EptHookedPagesTableRemove(PEPT_HOOKED_PAGE_DETAIL HookedPage);
+/* Allocate the EPT views of the cores */
+BOOLEAN
+EptInitializeCoreViews();
+/* Free the EPT views of the cores */
+VOID
+EptUninitializeCoreViews();
+/* Get the EPTP that a core uses */
+UINT64
+EptGetEptPointerOfCore(ULONG CoreIndex);
+/* Get the PML1 entry of a hooked page in the EPT that a core uses */
+PEPT_PML1_ENTRY
+EptGetHookedPageEntryOfCore(PEPT_HOOKED_PAGE_DETAIL HookedEntry, ULONG CoreIndex);
+/* Switch the current core from the clean view to its hooked view */
+VOID
+EptCleanViewLeave();
+/* Switch the current core to the armed or the disarmed view of the scoped hooks */
+VOID
+EptDisarmedViewUpdate(ULONG CoreIndex);
+/* Merge the split of a removed hook into a 2MB page if it's the last hook of the split (vmx non-root) */
+BOOLEAN
+EptReleaseSplitOfHookedPage(PEPT_HOOKED_PAGE_DETAIL HookedEntry);
+/* Free the merged splits after the EPT of all the cores is invalidated (vmx non-root) */
+VOID
+EptFreeReleasedSplits();
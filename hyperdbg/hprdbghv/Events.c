@@ -11,6 +11,7 @@
  */
 #include "Events.h"
 #include "Vmx.h"
+#include "HypervisorRoutines.h"
 
 /**
  * @brief Injects interruption to a guest
@@ -46,8 +47,8 @@ VOID
 EventInjectBreakpoint()
 {
     EventInjectInterruption(INTERRUPT_TYPE_SOFTWARE_EXCEPTION, EXCEPTION_VECTOR_BREAKPOINT, FALSE, 0);
-    UINT32 ExitInstrLength;
-    __vmx_vmread(VM_EXIT_INSTRUCTION_LEN, &ExitInstrLength);
+    UINT64 ExitInstrLength;
+    ExitInstrLength = HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH);
     __vmx_vmwrite(VM_ENTRY_INSTRUCTION_LEN, ExitInstrLength);
 }
 
@@ -60,8 +61,8 @@ VOID
 EventInjectGeneralProtection()
 {
     EventInjectInterruption(INTERRUPT_TYPE_HARDWARE_EXCEPTION, EXCEPTION_VECTOR_GENERAL_PROTECTION_FAULT, TRUE, 0);
-    UINT32 ExitInstrLength;
-    __vmx_vmread(VM_EXIT_INSTRUCTION_LEN, &ExitInstrLength);
+    UINT64 ExitInstrLength;
+    ExitInstrLength = HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH);
     __vmx_vmwrite(VM_ENTRY_INSTRUCTION_LEN, ExitInstrLength);
 }
 
@@ -90,3 +91,33 @@ EventInjectPageFault(ULONG32 ErrorCode)
     //
     EventInjectInterruption(INTERRUPT_TYPE_HARDWARE_EXCEPTION, EXCEPTION_VECTOR_PAGE_FAULT, TRUE, ErrorCode);
 }
+
+/**
+ * @brief Inject #DB to the guest (after the vm-exit of a #DB)
+ * @details The vm-exit of #DB is before updating DR6, the bits of DR6 are in
+ * the exit qualification (B0-B3, BD and BS)
+ * 
+ * @param InterruptionType Type of the #DB (hardware exception, or privileged
+ * software exception for ICEBP)
+ * @param ExitQualification The exit qualification of the vm-exit
+ * @return VOID 
+ */
+VOID
+EventInjectDebugException(INTERRUPT_TYPE InterruptionType, UINT64 ExitQualification)
+{
+    UINT64 Dr6;
+
+    Dr6 = __readdr(6);
+    Dr6 = (Dr6 & ~0x600f) | (ExitQualification & 0x600f);
+    __writedr(6, Dr6);
+
+    EventInjectInterruption(InterruptionType, EXCEPTION_VECTOR_DEBUG_BREAKPOINT, FALSE, 0);
+
+    if (InterruptionType == INTERRUPT_TYPE_PRIVILEGED_SOFTWARE_INTERRUPT)
+    {
+        //
+        // ICEBP is a trap, so the length of the instruction is needed
+        //
+        __vmx_vmwrite(VM_ENTRY_INSTRUCTION_LEN, HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH));
+    }
+}
@@ -133,3 +133,5 @@ VOID
 EventInjectUndefinedOpcode();
 VOID
 EventInjectPageFault(ULONG32 ErrorCode);
+VOID
+EventInjectDebugException(INTERRUPT_TYPE InterruptionType, UINT64 ExitQualification);
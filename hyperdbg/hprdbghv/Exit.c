@@ -20,290 +20,541 @@
 #include "Invept.h"
 #include "HypervisorRoutines.h"
 #include "Events.h"
+#include "Statistics.h"
+#include "Debugger.h"
+#include "Sampling.h"
+#include "FlightRecorder.h"
+#include "Dispatch.h"
+#include "Ve.h"
 
 /**
- * @brief VM-Exit handler for different exit reasons
+ * @brief Handle the triple faults of the guest
  * 
- * @param GuestRegs Registers that are automatically saved by AsmVmexitHandler (HOST_RIP)
- * @return BOOLEAN Return True if VMXOFF executed (not in vmx anymore),
- *  or return false if we are still in vmx (so we should use vm resume)
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
  */
-BOOLEAN
-VmxVmexitHandler(PGUEST_REGS GuestRegs)
+VOID
+ExitHandleTripleFault(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
 {
-    VMEXIT_INTERRUPT_INFO InterruptExit         = {0};
-    UINT64                GuestPhysicalAddr     = 0;
-    ULONG                 ExitReason            = 0;
-    ULONG                 ExitQualification     = 0;
-    ULONG                 Rflags                = 0;
-    ULONG                 EcxReg                = 0;
-    ULONG                 ExitInstructionLength = 0;
-    ULONG                 CurrentProcessorIndex = 0;
+    LogError("Triple fault error occured.");
+
+#if CollectVmexitFlightRecorder
 
     //
-    // *********** SEND MESSAGE AFTER WE SET THE STATE ***********
+    // Show how the guest reached here
     //
+    FlightRecorderLogCore(CoreIndex);
+#endif
+}
 
-    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+/**
+ * @brief Handle the VMX instructions of the guest (they fail)
+ * @details Instructions that cause vm-exit unconditionally (25.1.2), nested
+ * virtualization is not supported so VMCLEAR, VMPTRLD, VMPTRST, VMREAD, VMRESUME,
+ * VMWRITE, VMXOFF, VMXON and VMLAUNCH fail
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleVmxInstruction(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    ULONG Rflags = 0;
+
+    Rflags = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS);
 
     //
-    // Indicates we are in Vmx root mode in this logical core
+    // cf=1 indicate vm instructions fail
     //
-    g_GuestState[CurrentProcessorIndex].IsOnVmxRootMode = TRUE;
-    g_GuestState[CurrentProcessorIndex].IncrementRip    = TRUE;
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS, Rflags | 0x1);
+}
 
-    __vmx_vmread(VM_EXIT_REASON, &ExitReason);
-    ExitReason &= 0xffff;
+/**
+ * @brief Handle the accesses to the control registers
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleControlRegisterAccess(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    HvHandleControlRegisterAccess(GuestRegs);
+}
 
-    __vmx_vmread(EXIT_QUALIFICATION, &ExitQualification);
+/**
+ * @brief Handle RDMSR (and trigger the RDMSR events)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleMsrRead(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    ULONG EcxReg = 0;
+
+    EcxReg = GuestRegs->rcx & 0xffffffff;
 
     //
-    // Debugging purpose
+    // Only the watched MSRs cause vm-exit (or the MSRs out of the range of
+    // the bitmap)
     //
-    //LogInfo("VM_EXIT_REASON : 0x%x", ExitReason);
-    //LogInfo("EXIT_QUALIFICATION : 0x%llx", ExitQualification);
+    DebuggerTriggerEvents(RDMSR_INSTRUCTION_EXECUTION, GuestRegs, (PVOID)(UINT64)EcxReg);
+
+    HvHandleMsrRead(GuestRegs);
+}
+
+/**
+ * @brief Handle WRMSR (and trigger the WRMSR events)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleMsrWrite(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    ULONG EcxReg = 0;
+
+    EcxReg = GuestRegs->rcx & 0xffffffff;
+
+    //
+    // Only the watched MSRs cause vm-exit (or the MSRs out of the range of
+    // the bitmap)
     //
+    DebuggerTriggerEvents(WRMSR_INSTRUCTION_EXECUTION, GuestRegs, (PVOID)(UINT64)EcxReg);
 
-    switch (ExitReason)
-    {
-    case EXIT_REASON_TRIPLE_FAULT:
-    {
-        LogError("Triple fault error occured.");
+    HvHandleMsrWrite(GuestRegs);
+}
 
-        break;
-    }
-        //
-        // 25.1.2  Instructions That Cause VM Exits Unconditionally
-        // The following instructions cause VM exits when they are executed in VMX non-root operation: CPUID, GETSEC,
-        // INVD, and XSETBV. This is also true of instructions introduced with VMX, which include: INVEPT, INVVPID,
-        // VMCALL, VMCLEAR, VMLAUNCH, VMPTRLD, VMPTRST, VMRESUME, VMXOFF, and VMXON.
-        //
+/**
+ * @brief Handle CPUID
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleCpuid(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    HvHandleCpuid(GuestRegs);
+}
 
-    case EXIT_REASON_VMCLEAR:
-    case EXIT_REASON_VMPTRLD:
-    case EXIT_REASON_VMPTRST:
-    case EXIT_REASON_VMREAD:
-    case EXIT_REASON_VMRESUME:
-    case EXIT_REASON_VMWRITE:
-    case EXIT_REASON_VMXOFF:
-    case EXIT_REASON_VMXON:
-    case EXIT_REASON_VMLAUNCH:
-    {
-        __vmx_vmread(GUEST_RFLAGS, &Rflags);
+/**
+ * @brief Handle IN, OUT, INS and OUTS (and trigger the I/O events)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleIoInstruction(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    VMX_EXIT_QUALIFICATION_IO_INSTRUCTION IoQualification;
 
-        //
-        // cf=1 indicate vm instructions fail
-        //
-        __vmx_vmwrite(GUEST_RFLAGS, Rflags | 0x1);
+    //
+    // Only the watched ports cause vm-exit
+    //
+    IoQualification.Flags = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
 
-        break;
-    }
+    DebuggerTriggerEvents(IoQualification.AccessType ? IN_INSTRUCTION_EXECUTION : OUT_INSTRUCTION_EXECUTION,
+                          GuestRegs,
+                          (PVOID)(UINT64)IoQualification.PortNumber);
 
-    case EXIT_REASON_CR_ACCESS:
-    {
-        HvHandleControlRegisterAccess(GuestRegs);
-        break;
-    }
-    case EXIT_REASON_MSR_READ:
-    {
-        EcxReg = GuestRegs->rcx & 0xffffffff;
-        HvHandleMsrRead(GuestRegs);
+    HvHandleIoInstruction(GuestRegs);
+}
 
-        break;
-    }
-    case EXIT_REASON_MSR_WRITE:
-    {
-        EcxReg = GuestRegs->rcx & 0xffffffff;
-        HvHandleMsrWrite(GuestRegs);
+/**
+ * @brief Handle the EPT violations
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleEptViolation(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    UINT64 GuestPhysicalAddr = 0;
+    ULONG  ExitQualification = 0;
 
-        break;
-    }
-    case EXIT_REASON_CPUID:
+    //
+    // Reading guest physical address
+    //
+    GuestPhysicalAddr = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_PHYSICAL_ADDRESS);
+    ExitQualification = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
+
+    if (!EptHandleEptViolation(ExitQualification, GuestPhysicalAddr))
+        LogError("There were errors in handling Ept Violation");
+}
+
+/**
+ * @brief Handle the EPT misconfigurations
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleEptMisconfig(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    UINT64 GuestPhysicalAddr = 0;
+
+    GuestPhysicalAddr = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_PHYSICAL_ADDRESS);
+
+    EptHandleMisconfiguration(GuestPhysicalAddr);
+}
+
+/**
+ * @brief Handle the SPP-related events (SPPT misconfigurations and misses)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleSppEvent(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    UINT64 GuestPhysicalAddr = 0;
+
+    GuestPhysicalAddr = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_PHYSICAL_ADDRESS);
+
+    EptHandleSppEvent(GuestPhysicalAddr);
+
+    //
+    // Redo the instruction
+    //
+    g_GuestState[CoreIndex].IncrementRip = FALSE;
+}
+
+/**
+ * @brief Handle VMCALL (of HyperDbg or Hyper-V)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleVmcall(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    //
+    // Check if it's our routines that request the VMCALL our it relates to Hyper-V
+    //
+    if (GuestRegs->r10 == 0x48564653 && GuestRegs->r11 == 0x564d43414c4c && GuestRegs->r12 == 0x4e4f485950455256)
     {
-        HvHandleCpuid(GuestRegs);
-        break;
+        //
+        // Then we have to manage it as it relates to us
+        //
+        GuestRegs->rax = VmxVmcallHandler(GuestRegs->rcx, GuestRegs->rdx, GuestRegs->r8, GuestRegs->r9);
     }
-
-    case EXIT_REASON_IO_INSTRUCTION:
+    else
     {
-        LogError("Exit reason for I/O instructions are not supported yet.");
-        break;
+        //
+        // Otherwise let the top-level hypervisor to manage it
+        //
+        GuestRegs->rax = AsmHypervVmcall(GuestRegs->rcx, GuestRegs->rdx, GuestRegs->r8);
     }
-    case EXIT_REASON_EPT_VIOLATION:
+}
+
+/**
+ * @brief Handle the exceptions of the exception bitmap and the NMIs
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleExceptionOrNmi(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    VMEXIT_INTERRUPT_INFO InterruptExit = {0};
+
+    //
+    // Exception or non-maskable interrupt (NMI). Either:
+    //	1: Guest software caused an exception and the bit in the exception bitmap associated with exception�s vector was set to 1
+    //	2: An NMI was delivered to the logical processor and the �NMI exiting� VM-execution control was 1.
+    //
+    // VM_EXIT_INTR_INFO shows the exit infromation about event that occured and causes this exit
+    // Don't forget to read VM_EXIT_INTR_ERROR_CODE in the case of re-injectiong event
+    //
+
+    //
+    // read the exit reason
+    //
+    __vmx_vmread(VM_EXIT_INTR_INFO, &InterruptExit);
+
+    if (InterruptExit.InterruptionType == INTERRUPT_TYPE_SOFTWARE_EXCEPTION && InterruptExit.Vector == EXCEPTION_VECTOR_BREAKPOINT)
     {
+        ULONG64 GuestRip;
         //
-        // Reading guest physical address
+        // Reading guest's RIP
         //
-        __vmx_vmread(GUEST_PHYSICAL_ADDRESS, &GuestPhysicalAddr);
+        GuestRip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
 
-        if (!EptHandleEptViolation(ExitQualification, GuestPhysicalAddr))
-            LogError("There were errors in handling Ept Violation");
+        //
+        // Only the watched addresses are sent to the user, the others are
+        // re-injected without any message
+        //
+        if (DebuggerCheckExceptionAddress(&g_GuestState[CoreIndex].DebuggingState.BreakpointAddresses, GuestRip))
+        {
+            DebuggerHandleExceptionHit(EXCEPTION_VECTOR_BREAKPOINT, GuestRegs, GuestRip, 0);
+        }
 
-        break;
+        g_GuestState[CoreIndex].IncrementRip = FALSE;
+
+        //
+        // re-inject #BP back to the guest
+        //
+        EventInjectBreakpoint();
     }
-    case EXIT_REASON_EPT_MISCONFIG:
+    else if (InterruptExit.Vector == EXCEPTION_VECTOR_DEBUG_BREAKPOINT &&
+             (InterruptExit.InterruptionType == INTERRUPT_TYPE_HARDWARE_EXCEPTION || InterruptExit.InterruptionType == INTERRUPT_TYPE_PRIVILEGED_SOFTWARE_INTERRUPT))
     {
-        __vmx_vmread(GUEST_PHYSICAL_ADDRESS, &GuestPhysicalAddr);
+        ULONG64 GuestRip;
+        ULONG64 DebugExitQualification;
 
-        EptHandleMisconfiguration(GuestPhysicalAddr);
+        GuestRip               = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+        DebugExitQualification = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
 
-        break;
+        if (DebuggerCheckExceptionAddress(&g_GuestState[CoreIndex].DebuggingState.DebugAddresses, GuestRip))
+        {
+            DebuggerHandleExceptionHit(EXCEPTION_VECTOR_DEBUG_BREAKPOINT, GuestRegs, GuestRip, DebugExitQualification);
+        }
+
+        g_GuestState[CoreIndex].IncrementRip = FALSE;
+
+        //
+        // re-inject #DB back to the guest (DR6 is not updated by the
+        // vm-exit so it's updated from the exit qualification)
+        //
+        EventInjectDebugException(InterruptExit.InterruptionType, DebugExitQualification);
     }
-    case EXIT_REASON_VMCALL:
+    else if (InterruptExit.InterruptionType == INTERRUPT_TYPE_HARDWARE_EXCEPTION && InterruptExit.Vector == EXCEPTION_VECTOR_UNDEFINED_OPCODE)
     {
         //
-        // Check if it's our routines that request the VMCALL our it relates to Hyper-V
+        // Handle the #UD, checking if this exception was intentional.
         //
-        if (GuestRegs->r10 == 0x48564653 && GuestRegs->r11 == 0x564d43414c4c && GuestRegs->r12 == 0x4e4f485950455256)
-        {
-            //
-            // Then we have to manage it as it relates to us
-            //
-            GuestRegs->rax = VmxVmcallHandler(GuestRegs->rcx, GuestRegs->rdx, GuestRegs->r8, GuestRegs->r9);
-        }
-        else
+
+        if (!SyscallHookHandleUD(GuestRegs, CoreIndex))
         {
             //
-            // Otherwise let the top-level hypervisor to manage it
+            // If this #UD was found to be unintentional, inject a #UD interruption into the guest.
             //
-            GuestRegs->rax = AsmHypervVmcall(GuestRegs->rcx, GuestRegs->rdx, GuestRegs->r8);
+            EventInjectUndefinedOpcode();
         }
-        break;
     }
-    case EXIT_REASON_EXCEPTION_NMI:
+    else
+    {
+        LogError("Not expected event occured");
+    }
+}
+
+/**
+ * @brief Handle the monitor trap flag
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleMonitorTrapFlag(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    //
+    // Monitor Trap Flag
+    //
+    if (g_GuestState[CoreIndex].MtfEptHookRestorePoint)
     {
         //
-        // Exception or non-maskable interrupt (NMI). Either:
-        //	1: Guest software caused an exception and the bit in the exception bitmap associated with exception�s vector was set to 1
-        //	2: An NMI was delivered to the logical processor and the �NMI exiting� VM-execution control was 1.
+        // Restore the previous state
         //
-        // VM_EXIT_INTR_INFO shows the exit infromation about event that occured and causes this exit
-        // Don't forget to read VM_EXIT_INTR_ERROR_CODE in the case of re-injectiong event
+        EptHandleMonitorTrapFlag(g_GuestState[CoreIndex].MtfEptHookRestorePoint);
+
         //
+        // Set it to NULL
+        //
+        g_GuestState[CoreIndex].MtfEptHookRestorePoint = NULL;
+    }
+    else if (g_GuestState[CoreIndex].DebuggingState.UndefinedInstructionAddress != NULL)
+    {
+        ULONG64 GuestRip;
 
         //
-        // read the exit reason
+        // Reading guest's RIP
         //
-        __vmx_vmread(VM_EXIT_INTR_INFO, &InterruptExit);
+        GuestRip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
 
-        if (InterruptExit.InterruptionType == INTERRUPT_TYPE_SOFTWARE_EXCEPTION && InterruptExit.Vector == EXCEPTION_VECTOR_BREAKPOINT)
+        if (g_GuestState[CoreIndex].DebuggingState.UndefinedInstructionAddress == GuestRip)
         {
-            ULONG64 GuestRip;
             //
-            // Reading guest's RIP
+            // #UD was not because of syscall because it's no incremented, we should inject the #UD again
             //
-            __vmx_vmread(GUEST_RIP, &GuestRip);
-
-            //
-            // Send the user
-            //
-            LogInfo("Breakpoint Hit (Process Id : 0x%x) at : %llx ", PsGetCurrentProcessId(), GuestRip);
-
-            g_GuestState[CurrentProcessorIndex].IncrementRip = FALSE;
-
-            //
-            // re-inject #BP back to the guest
-            //
-            EventInjectBreakpoint();
+            EventInjectUndefinedOpcode();
         }
-        else if (InterruptExit.InterruptionType == INTERRUPT_TYPE_HARDWARE_EXCEPTION && InterruptExit.Vector == EXCEPTION_VECTOR_UNDEFINED_OPCODE)
+        else
         {
             //
-            // Handle the #UD, checking if this exception was intentional.
+            // It was because of Syscall, let's trace it
             //
-
-            if (!SyscallHookHandleUD(GuestRegs, CurrentProcessorIndex))
+            if (SyscallTraceIsActive)
             {
-                //
-                // If this #UD was found to be unintentional, inject a #UD interruption into the guest.
-                //
-                EventInjectUndefinedOpcode();
+                SyscallHookTraceSyscall(GuestRegs, CoreIndex);
             }
         }
-        else
-        {
-            LogError("Not expected event occured");
-        }
-        break;
-    }
-    case EXIT_REASON_MONITOR_TRAP_FLAG:
-    {
+
         //
-        // Monitor Trap Flag
+        // Enable syscall hook again
         //
-        if (g_GuestState[CurrentProcessorIndex].MtfEptHookRestorePoint)
-        {
-            //
-            // Restore the previous state
-            //
-            EptHandleMonitorTrapFlag(g_GuestState[CurrentProcessorIndex].MtfEptHookRestorePoint);
+        SyscallHookDisableSCE();
+        g_GuestState[CoreIndex].DebuggingState.UndefinedInstructionAddress = NULL;
+    }
+    else
+    {
+        LogError("Why MTF occured ?!");
+    }
+    //
+    // Redo the instruction
+    //
+    g_GuestState[CoreIndex].IncrementRip = FALSE;
 
-            //
-            // Set it to NULL
-            //
-            g_GuestState[CurrentProcessorIndex].MtfEptHookRestorePoint = NULL;
-        }
-        else if (g_GuestState[CurrentProcessorIndex].DebuggingState.UndefinedInstructionAddress != NULL)
-        {
-            ULONG64 GuestRip;
+    //
+    // We don't need MTF anymore
+    //
+    HvSetMonitorTrapFlag(FALSE);
+}
 
-            //
-            // Reading guest's RIP
-            //
-            __vmx_vmread(GUEST_RIP, &GuestRip);
+/**
+ * @brief Resume the guest from the next instruction without doing anything
+ * @details Used for the exit reasons of instructions that need nothing (e.g, HLT)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleResume(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    //
+    // Nothing to do, the instruction is skipped
+    //
+}
 
-            if (g_GuestState[CurrentProcessorIndex].DebuggingState.UndefinedInstructionAddress == GuestRip)
-            {
-                //
-                // #UD was not because of syscall because it's no incremented, we should inject the #UD again
-                //
-                EventInjectUndefinedOpcode();
-            }
-            else
-            {
-                //
-                // It was because of Syscall, let's log it
-                //
-                LogInfo("SYSCALL instruction => 0x%llX , process id : 0x%x , rax = 0x%llx",
-                        g_GuestState[CurrentProcessorIndex].DebuggingState.UndefinedInstructionAddress,
-                        PsGetCurrentProcessId(),
-                        GuestRegs->rax);
-            }
+/**
+ * @brief Resume the guest from the same instruction without doing anything
+ * @details Used for the exit reasons that are not caused by an instruction
+ * (e.g, VMX-preemption timer when it's not used)
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleResumeWithoutSkip(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    g_GuestState[CoreIndex].IncrementRip = FALSE;
+}
 
-            //
-            // Enable syscall hook again
-            //
-            SyscallHookDisableSCE();
-            g_GuestState[CurrentProcessorIndex].DebuggingState.UndefinedInstructionAddress = NULL;
-        }
-        else
-        {
-            LogError("Why MTF occured ?!");
-        }
-        //
-        // Redo the instruction
-        //
-        g_GuestState[CurrentProcessorIndex].IncrementRip = FALSE;
+/**
+ * @brief Handle the exit reasons that are not expected
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+ExitHandleUnknown(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    LogError("Unkown Vmexit, reason : 0x%llx", ExitReason);
+}
 
-        //
-        // We don't need MTF anymore
-        //
-        HvSetMonitorTrapFlag(FALSE);
+/**
+ * @brief VM-Exit handler for different exit reasons
+ * @details Each exit reason is handled by the handler of the dispatch table
+ * of the current core
+ * 
+ * @param GuestRegs Registers that are automatically saved by AsmVmexitHandler (HOST_RIP)
+ * @param EntryTimeStampCounter Time stamp counter at the start of AsmVmexitHandler
+ * @return BOOLEAN Return True if VMXOFF executed (not in vmx anymore),
+ *  or return false if we are still in vmx (so we should use vm resume)
+ */
+BOOLEAN
+VmxVmexitHandler(PGUEST_REGS GuestRegs, UINT64 EntryTimeStampCounter)
+{
+    ULONG ExitReason            = 0;
+    ULONG CurrentProcessorIndex = 0;
 
-        break;
-    }
-    case EXIT_REASON_HLT:
+    //
+    // *********** SEND MESSAGE AFTER WE SET THE STATE ***********
+    //
+
+    CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+
+    //
+    // Indicates we are in Vmx root mode in this logical core
+    //
+    g_GuestState[CurrentProcessorIndex].IsOnVmxRootMode = TRUE;
+    g_GuestState[CurrentProcessorIndex].IncrementRip    = TRUE;
+
+    //
+    // The epoch is odd until the end of this vm-exit, the interlocked
+    // increment is a full barrier so the event arrays are read after it
+    //
+    InterlockedIncrement64((volatile LONG64 *)&g_GuestState[CurrentProcessorIndex].VmexitEpoch);
+
+    //
+    // The cached VMCS fields are from the previous vm-exit
+    //
+    HvResetExitContext(CurrentProcessorIndex);
+
+    __vmx_vmread(VM_EXIT_REASON, &ExitReason);
+    ExitReason &= 0xffff;
+
+    //
+    // Log the accesses that the #VE handler of this core recorded in the guest
+    //
+    if (VeCoreStates)
     {
-        //
-        //__halt();
-        //
-        break;
+        VeDrainRecords(CurrentProcessorIndex);
     }
-    default:
+
+#if CollectVmexitFlightRecorder
+
+    //
+    // Save the vm-exit before handling it (if it hangs, it's the last record)
+    //
+    FlightRecorderRecordVmexit(CurrentProcessorIndex, ExitReason, EntryTimeStampCounter);
+#endif
+
+    //
+    // Debugging purpose
+    //
+    //LogInfo("VM_EXIT_REASON : 0x%x", ExitReason);
+    //LogInfo("EXIT_QUALIFICATION : 0x%llx", HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION));
+    //
+
+    if (ExitReason < VMEXIT_HANDLERS_COUNT)
     {
-        LogError("Unkown Vmexit, reason : 0x%llx", ExitReason);
-        break;
+        g_GuestState[CurrentProcessorIndex].ExitHandlers[ExitReason](GuestRegs, CurrentProcessorIndex, ExitReason);
     }
+    else
+    {
+        ExitHandleUnknown(GuestRegs, CurrentProcessorIndex, ExitReason);
     }
 
     if (!g_GuestState[CurrentProcessorIndex].VmxoffState.IsVmxoffExecuted && g_GuestState[CurrentProcessorIndex].IncrementRip)
@@ -311,11 +562,35 @@ VmxVmexitHandler(PGUEST_REGS GuestRegs)
         HvResumeToNextInstruction();
     }
 
+    //
+    // Write the modified VMCS fields (the VMCS is not available after VMXOFF)
+    //
+    if (!g_GuestState[CurrentProcessorIndex].VmxoffState.IsVmxoffExecuted)
+    {
+        HvWriteBackExitContext(CurrentProcessorIndex);
+    }
+
+#if CollectVmexitStatistics
+
+    //
+    // Count the vm-exit and its cycles (the rest is restoring the registers and VMRESUME)
+    //
+    StatisticsRecordVmexit(CurrentProcessorIndex, ExitReason, EntryTimeStampCounter);
+#endif
+
+#if CollectVmexitFlightRecorder
+
+    FlightRecorderCompleteVmexit(CurrentProcessorIndex, EntryTimeStampCounter);
+#endif
+
     //
     // Set indicator of Vmx non root mode to false
     //
     g_GuestState[CurrentProcessorIndex].IsOnVmxRootMode = FALSE;
 
+    _ReadWriteBarrier();
+    g_GuestState[CurrentProcessorIndex].VmexitEpoch++;
+
     if (g_GuestState[CurrentProcessorIndex].VmxoffState.IsVmxoffExecuted)
         return TRUE;
 
@@ -11,7 +11,7 @@
  * 
  */
 #include "Broadcast.h"
-#include "Dpc.h"
+#include "Vmcall.h"
 #include "Debugger.h"
 #include "Logging.h"
 #include "Common.h"
@@ -26,7 +26,7 @@
 VOID
 ExtensionCommandEnableEferOnAllProcessors()
 {
-    KeGenericCallDpc(BroadcastDpcEnableEferSyscallEvents, 0x0);
+    BroadcastVmcallToAllCores(VMCALL_ENABLE_SYSCALL_HOOK_EFER, 0);
 }
 
 /**
@@ -37,7 +37,89 @@ ExtensionCommandEnableEferOnAllProcessors()
 VOID
 ExtensionCommandDisableEferOnAllProcessors()
 {
-    KeGenericCallDpc(BroadcastDpcDisableEferSyscallEvents, 0x0);
+    BroadcastVmcallToAllCores(VMCALL_DISABLE_SYSCALL_HOOK_EFER, 0);
+}
+
+/**
+ * @brief routines for the msr events (apply the watched MSRs)
+ * @details All the changes to the msr events are applied with one broadcast
+ * 
+ * @return VOID 
+ */
+VOID
+ExtensionCommandUpdateMsrBitmapOnAllProcessors()
+{
+    BroadcastVmcallToAllCores(VMCALL_UPDATE_MSR_BITMAP, 0);
+}
+
+/**
+ * @brief routines for the I/O events (apply the watched ports)
+ * @details All the changes to the I/O events are applied with one broadcast
+ * 
+ * @return VOID 
+ */
+VOID
+ExtensionCommandUpdateIoBitmapOnAllProcessors()
+{
+    BroadcastVmcallToAllCores(VMCALL_UPDATE_IO_BITMAP, 0);
+}
+
+/**
+ * @brief routines for the sampling (set the VMX-preemption timer)
+ * 
+ * @param TimerValue Value of the timer, or zero to disable it
+ * @return VOID 
+ */
+VOID
+ExtensionCommandConfigureSamplingTimerOnAllProcessors(UINT64 TimerValue)
+{
+    BroadcastVmcallToAllCores(VMCALL_CONFIGURE_SAMPLING_TIMER, TimerValue);
+}
+
+/**
+ * @brief routines for the #BP and #DB events (apply the watched addresses)
+ * 
+ * @return VOID 
+ */
+VOID
+ExtensionCommandUpdateExceptionBitmapOnAllProcessors()
+{
+    BroadcastVmcallToAllCores(VMCALL_UPDATE_EXCEPTION_BITMAP, 0);
+}
+
+/**
+ * @brief routines for the dirty page tracking (set the page-modification logging)
+ * 
+ * @param Enable Whether to enable or disable the logging
+ * @return VOID 
+ */
+VOID
+ExtensionCommandConfigureDirtyPageLogOnAllProcessors(BOOLEAN Enable)
+{
+    BroadcastVmcallToAllCores(VMCALL_CONFIGURE_DIRTY_PAGE_LOG, Enable);
+}
+
+/**
+ * @brief routines for the dirty page tracking (move the logs to the bitmap)
+ * 
+ * @return VOID 
+ */
+VOID
+ExtensionCommandFlushDirtyPageLogOnAllProcessors()
+{
+    BroadcastVmcallToAllCores(VMCALL_FLUSH_DIRTY_PAGE_LOG, 0);
+}
+
+/**
+ * @brief routines for the access aggregation (copy the counters to a query)
+ * 
+ * @param Context The context of the query (PAGGREGATION_QUERY_CONTEXT)
+ * @return VOID 
+ */
+VOID
+ExtensionCommandCopyAccessAggregationOnAllProcessors(PVOID Context)
+{
+    BroadcastVmcallToAllCores(VMCALL_COPY_ACCESS_AGGREGATION, (UINT64)Context);
 }
 
 /**
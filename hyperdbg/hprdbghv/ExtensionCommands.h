@@ -20,4 +20,25 @@ VOID
 ExtensionCommandEnableEferOnAllProcessors();
 
 VOID
-ExtensionCommandDisableEferOnAllProcessors();
\ No newline at end of file
+ExtensionCommandDisableEferOnAllProcessors();
+
+VOID
+ExtensionCommandUpdateMsrBitmapOnAllProcessors();
+
+VOID
+ExtensionCommandUpdateIoBitmapOnAllProcessors();
+
+VOID
+ExtensionCommandConfigureSamplingTimerOnAllProcessors(UINT64 TimerValue);
+
+VOID
+ExtensionCommandUpdateExceptionBitmapOnAllProcessors();
+
+VOID
+ExtensionCommandConfigureDirtyPageLogOnAllProcessors(BOOLEAN Enable);
+
+VOID
+ExtensionCommandFlushDirtyPageLogOnAllProcessors();
+
+VOID
+ExtensionCommandCopyAccessAggregationOnAllProcessors(PVOID Context);
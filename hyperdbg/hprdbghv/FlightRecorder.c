@@ -0,0 +1,241 @@
+/**
+ * @file FlightRecorder.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Flight recorder of the vm-exits (the last vm-exits of each core)
+ * @details The recorders are written with plain stores in the vm-exit handler
+ * so it's cheap enough to keep it enabled, they are read from user-mode, logged
+ * in the case of triple fault, and saved in the crash dump (secondary dump
+ * data) in the case of bugcheck
+ * @version 0.1
+ * @date 2020-05-06
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#include "Common.h"
+#include "Vmx.h"
+#include "HypervisorRoutines.h"
+#include "FlightRecorder.h"
+
+/**
+ * @brief Guid of the flight recorders in the secondary dump data
+ * {5D7C5E4A-2F8B-4C1E-9B0D-6A3E8F1C2B47}
+ */
+static const GUID FlightRecorderDumpGuid = {0x5d7c5e4a, 0x2f8b, 0x4c1e, {0x9b, 0x0d, 0x6a, 0x3e, 0x8f, 0x1c, 0x2b, 0x47}};
+
+/**
+ * @brief Save the flight recorders of all the cores in the crash dump
+ * 
+ * @return VOID 
+ */
+VOID
+FlightRecorderBugCheckCallback(KBUGCHECK_CALLBACK_REASON Reason,
+                               PKBUGCHECK_REASON_CALLBACK_RECORD Record,
+                               PVOID ReasonSpecificData,
+                               ULONG ReasonSpecificDataLength)
+{
+    PKBUGCHECK_SECONDARY_DUMP_DATA SecondaryDumpData = (PKBUGCHECK_SECONDARY_DUMP_DATA)ReasonSpecificData;
+    ULONG                          Size;
+
+    if (Reason != KbCallbackSecondaryDumpData || !FlightRecorders ||
+        ReasonSpecificDataLength < sizeof(KBUGCHECK_SECONDARY_DUMP_DATA))
+    {
+        return;
+    }
+
+    Size = sizeof(FLIGHT_RECORDER_CORE_BLOCK) * FlightRecordersCoreCount;
+
+    //
+    // The recorders are in one non-paged allocation, so they're given as is
+    //
+    SecondaryDumpData->OutBuffer       = FlightRecorders;
+    SecondaryDumpData->OutBufferLength = min(Size, SecondaryDumpData->MaximumAllowed);
+    SecondaryDumpData->Guid            = FlightRecorderDumpGuid;
+}
+
+/**
+ * @brief Allocate the flight recorders of the cores and register the bugcheck
+ * callback
+ * 
+ * @return BOOLEAN Shows whether the allocation was successful or not
+ */
+BOOLEAN
+FlightRecorderInitialize()
+{
+    FlightRecordersCoreCount = KeQueryActiveProcessorCount(0);
+
+    FlightRecorders = ExAllocatePoolWithTag(NonPagedPool, sizeof(FLIGHT_RECORDER_CORE_BLOCK) * FlightRecordersCoreCount, POOLTAG);
+
+    if (!FlightRecorders)
+    {
+        return FALSE;
+    }
+
+    RtlZeroMemory(FlightRecorders, sizeof(FLIGHT_RECORDER_CORE_BLOCK) * FlightRecordersCoreCount);
+
+    KeInitializeCallbackRecord(&FlightRecorderBugCheckCallbackRecord);
+
+    if (!KeRegisterBugCheckReasonCallback(&FlightRecorderBugCheckCallbackRecord,
+                                          FlightRecorderBugCheckCallback,
+                                          KbCallbackSecondaryDumpData,
+                                          (PUCHAR) "HyperdbgFlightRecorder"))
+    {
+        //
+        // Not fatal, the recorders are still available from user-mode
+        //
+        LogWarning("Unable to register the bugcheck callback of the flight recorder");
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Deregister the bugcheck callback and free the flight recorders
+ * 
+ * @return VOID 
+ */
+VOID
+FlightRecorderUnInitialize()
+{
+    if (FlightRecorders)
+    {
+        KeDeregisterBugCheckReasonCallback(&FlightRecorderBugCheckCallbackRecord);
+
+        ExFreePoolWithTag(FlightRecorders, POOLTAG);
+        FlightRecorders = NULL;
+    }
+}
+
+/**
+ * @brief Save a vm-exit in the flight recorder of the current core
+ * @details Should be called in vmx-root at the start of the vm-exit handler,
+ * the record is saved before handling the vm-exit so the vm-exit that hangs
+ * the system is in the recorder (with zero cycles)
+ * 
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @param EntryTimeStampCounter Time stamp counter at the start of AsmVmexitHandler
+ * @return VOID 
+ */
+VOID
+FlightRecorderRecordVmexit(UINT32 CoreIndex, UINT32 ExitReason, UINT64 EntryTimeStampCounter)
+{
+    PVMEXIT_FLIGHT_RECORDER_CORE Recorder;
+    PVMEXIT_FLIGHT_RECORD        Record;
+
+    if (CoreIndex >= FlightRecordersCoreCount || !FlightRecorders)
+    {
+        return;
+    }
+
+    Recorder = &FlightRecorders[CoreIndex].Recorder;
+    Record   = &Recorder->Records[Recorder->CountOfVmexits & (FLIGHT_RECORDER_ENTRIES_PER_CORE - 1)];
+
+    Record->ExitReason        = ExitReason;
+    Record->ExitQualification = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
+    Record->GuestRip          = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+    Record->TimeStampCounter  = EntryTimeStampCounter;
+    Record->HandlerCycles     = 0;
+
+    Recorder->CountOfVmexits++;
+}
+
+/**
+ * @brief Save the cycles of the current vm-exit in the flight recorder
+ * @details Should be called in vmx-root at the end of the vm-exit handler
+ * 
+ * @param CoreIndex Index of the current core
+ * @param EntryTimeStampCounter Time stamp counter at the start of AsmVmexitHandler
+ * @return VOID 
+ */
+VOID
+FlightRecorderCompleteVmexit(UINT32 CoreIndex, UINT64 EntryTimeStampCounter)
+{
+    PVMEXIT_FLIGHT_RECORDER_CORE Recorder;
+
+    if (CoreIndex >= FlightRecordersCoreCount || !FlightRecorders)
+    {
+        return;
+    }
+
+    Recorder = &FlightRecorders[CoreIndex].Recorder;
+
+    Recorder->Records[(Recorder->CountOfVmexits - 1) & (FLIGHT_RECORDER_ENTRIES_PER_CORE - 1)].HandlerCycles = __rdtsc() - EntryTimeStampCounter;
+}
+
+/**
+ * @brief Log the flight recorder of a core (from the oldest vm-exit)
+ * @details Used in the case of triple fault
+ * 
+ * @param CoreIndex Index of the core
+ * @return VOID 
+ */
+VOID
+FlightRecorderLogCore(UINT32 CoreIndex)
+{
+    PVMEXIT_FLIGHT_RECORDER_CORE Recorder;
+    UINT64                       Start;
+
+    if (CoreIndex >= FlightRecordersCoreCount || !FlightRecorders)
+    {
+        return;
+    }
+
+    Recorder = &FlightRecorders[CoreIndex].Recorder;
+    Start    = Recorder->CountOfVmexits > FLIGHT_RECORDER_ENTRIES_PER_CORE ? Recorder->CountOfVmexits - FLIGHT_RECORDER_ENTRIES_PER_CORE : 0;
+
+    LogError("Last %lld vm-exits of core %d (reason, qualification, rip, tsc, cycles) :",
+             Recorder->CountOfVmexits - Start,
+             CoreIndex);
+
+    for (UINT64 i = Start; i < Recorder->CountOfVmexits; i++)
+    {
+        PVMEXIT_FLIGHT_RECORD Record = &Recorder->Records[i & (FLIGHT_RECORDER_ENTRIES_PER_CORE - 1)];
+
+        LogError("0x%x, 0x%llx, 0x%llx, 0x%llx, %lld",
+                 Record->ExitReason,
+                 Record->ExitQualification,
+                 Record->GuestRip,
+                 Record->TimeStampCounter,
+                 Record->HandlerCycles);
+    }
+}
+
+/**
+ * @brief Copy the flight recorders of all the cores to the result of
+ * IOCTL_DUMP_FLIGHT_RECORDER
+ * @details The recorders are changed by the cores at the same time, so the
+ * last records of the other cores might be from newer vm-exits
+ * 
+ * @param Dump The header of the output buffer (the recorders follow it)
+ * @param BufferSize Size of the output buffer
+ * @param ReturnedLength [Out] Size of the result
+ * @return NTSTATUS 
+ */
+NTSTATUS
+FlightRecorderDump(PVMEXIT_FLIGHT_RECORDER_DUMP Dump, UINT32 BufferSize, PUINT32 ReturnedLength)
+{
+    PVMEXIT_FLIGHT_RECORDER_CORE Destination = (PVMEXIT_FLIGHT_RECORDER_CORE)((UINT64)Dump + sizeof(VMEXIT_FLIGHT_RECORDER_DUMP));
+
+    if (!FlightRecorders)
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (BufferSize < sizeof(VMEXIT_FLIGHT_RECORDER_DUMP) + sizeof(VMEXIT_FLIGHT_RECORDER_CORE) * FlightRecordersCoreCount)
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Dump->CoreCount      = FlightRecordersCoreCount;
+    Dump->EntriesPerCore = FLIGHT_RECORDER_ENTRIES_PER_CORE;
+
+    for (UINT32 i = 0; i < FlightRecordersCoreCount; i++)
+    {
+        Destination[i] = FlightRecorders[i].Recorder;
+    }
+
+    *ReturnedLength = sizeof(VMEXIT_FLIGHT_RECORDER_DUMP) + sizeof(VMEXIT_FLIGHT_RECORDER_CORE) * FlightRecordersCoreCount;
+
+    return STATUS_SUCCESS;
+}
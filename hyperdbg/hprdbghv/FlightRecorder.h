@@ -0,0 +1,60 @@
+/**
+ * @file FlightRecorder.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the flight recorder of the vm-exits
+ * @details
+ * @version 0.1
+ * @date 2020-05-06
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#pragma once
+#include <ntddk.h>
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The flight recorder of each core
+ * @details Each core only writes to its own block and the blocks are cache
+ * aligned
+ * 
+ */
+typedef struct DECLSPEC_CACHEALIGN _FLIGHT_RECORDER_CORE_BLOCK
+{
+    VMEXIT_FLIGHT_RECORDER_CORE Recorder;
+
+} FLIGHT_RECORDER_CORE_BLOCK, *PFLIGHT_RECORDER_CORE_BLOCK;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Flight recorders of the vm-exits (one block for each core) */
+FLIGHT_RECORDER_CORE_BLOCK * FlightRecorders;
+
+/* Count of the blocks of FlightRecorders */
+UINT32 FlightRecordersCoreCount;
+
+/* Callback that saves the flight recorders in the crash dump */
+KBUGCHECK_REASON_CALLBACK_RECORD FlightRecorderBugCheckCallbackRecord;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+BOOLEAN
+FlightRecorderInitialize();
+VOID
+FlightRecorderUnInitialize();
+VOID
+FlightRecorderRecordVmexit(UINT32 CoreIndex, UINT32 ExitReason, UINT64 EntryTimeStampCounter);
+VOID
+FlightRecorderCompleteVmexit(UINT32 CoreIndex, UINT64 EntryTimeStampCounter);
+VOID
+FlightRecorderLogCore(UINT32 CoreIndex);
+NTSTATUS
+FlightRecorderDump(PVMEXIT_FLIGHT_RECORDER_DUMP Dump, UINT32 BufferSize, PUINT32 ReturnedLength);
@@ -35,17 +35,41 @@ VIRTUAL_MACHINE_STATE * g_GuestState;
 EPT_STATE * g_EptState;
 
 /**
- * @brief Save the state of the thread that waits for messages to deliver to user-mode
+ * @brief Support for execute-only pages (indicating that data accesses are
+ *  not allowed while instruction fetches are allowed)
  * 
  */
-NOTIFY_RECORD * g_GlobalNotifyRecord;
+BOOLEAN g_ExecuteOnlySupport;
 
 /**
- * @brief Support for execute-only pages (indicating that data accesses are
- *  not allowed while instruction fetches are allowed)
+ * @brief Support for EPTP switching (VM function 0) in vmx non-root
  * 
  */
-BOOLEAN g_ExecuteOnlySupport;
+BOOLEAN g_EptpSwitchingSupport;
+
+/**
+ * @brief Support for mapping 1GB pages by EPT PDPTEs
+ * 
+ */
+BOOLEAN g_Pdpte1GbPagesSupport;
+
+/**
+ * @brief Support for sub-page write permissions (SPP) of EPT
+ * 
+ */
+BOOLEAN g_SppSupport;
+
+/**
+ * @brief Support for page-modification logging (PML) and the dirty flags of EPT
+ * 
+ */
+BOOLEAN g_PmlSupport;
+
+/**
+ * @brief Support for the single-context-retaining-globals INVVPID type (and VPID)
+ * 
+ */
+BOOLEAN g_InvvpidSingleContextRetainingGlobalsSupport;
 
 /**
  * @brief Determines whether the clients are allowed to send IOCTL to the drive or not
@@ -71,3 +95,16 @@ BOOLEAN g_HandleInUse;
  * 
  */
 LIST_ENTRY g_HiddenHooksDetourListHead;
+
+/**
+ * @brief The cycles of the phases of the initialization of vmx
+ * 
+ */
+VMX_STARTUP_TIMING g_StartupTiming;
+
+/**
+ * @brief Shows whether the cores are out of vmx operation while their
+ * regions and the hooks are kept
+ * 
+ */
+BOOLEAN g_VmxSuspended;
@@ -0,0 +1,272 @@
+/**
+ * @file GuestMemory.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Bulk reads and writes of the guest memory
+ * @details The user buffer is locked and mapped once by its MDL, then the
+ * ranges are copied in vmx-root, each page is translated by the cr3 of the
+ * target and it's mapped to the reserved address of the core, so the pages
+ * of other processes (or the pages that are not mapped anywhere) are copied
+ * without attaching to the process or mapping them by the memory manager
+ * @version 0.1
+ * @date 2020-05-27
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "Vmx.h"
+#include "Vmcall.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "InlineAsm.h"
+#include "GuestMemory.h"
+
+/**
+ * @brief Check whether a range is in the physical memory (RAM)
+ * @details The devices (MMIO) are never accessed, neither by the physical
+ * ranges nor by the pages of the virtual ranges, can be called in vmx-root
+ *
+ * @param Ranges The result of MmGetPhysicalMemoryRanges
+ * @param Address The physical address
+ * @param Length Length of the range
+ * @return BOOLEAN Whether the range is in the physical memory
+ */
+static BOOLEAN
+GuestMemoryIsPhysicalMemory(PPHYSICAL_MEMORY_RANGE Ranges, UINT64 Address, UINT64 Length)
+{
+    for (PPHYSICAL_MEMORY_RANGE Range = Ranges; Range->BaseAddress.QuadPart != 0 || Range->NumberOfBytes.QuadPart != 0; Range++)
+    {
+        if (Address >= (UINT64)Range->BaseAddress.QuadPart &&
+            Address + Length <= (UINT64)Range->BaseAddress.QuadPart + Range->NumberOfBytes.QuadPart)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * @brief Copy a part of the ranges of a request (VMCALL_GUEST_MEMORY_ACCESS)
+ * @details Should be called in vmx-root, at most GUEST_MEMORY_VMCALL_BUDGET
+ * bytes are copied, the rest of a range is skipped if a page of it is not
+ * present or it's not in the physical memory, the pages of the virtual
+ * ranges are mapped by the memory type of the guest
+ *
+ * @param Context The state of the request
+ * @return NTSTATUS
+ */
+NTSTATUS
+GuestMemoryHandleVmcall(PGUEST_MEMORY_CONTEXT Context)
+{
+    PDEBUGGER_GUEST_MEMORY_REQUEST Request    = Context->Request;
+    BOOLEAN                        IsWrite    = (Request->Flags & DEBUGGER_GUEST_MEMORY_WRITE) != 0;
+    BOOLEAN                        IsPhysical = (Request->Flags & DEBUGGER_GUEST_MEMORY_PHYSICAL) != 0;
+    UINT32                         Budget     = GUEST_MEMORY_VMCALL_BUDGET;
+    PDEBUGGER_GUEST_MEMORY_ENTRY   Entry;
+    UINT64                         Address;
+    UINT64                         PhysicalAddress;
+    UINT64                         MemoryTypeFlags = 0;
+    UINT32                         Length;
+
+    while (Context->CurrentEntry < Request->CountOfEntries && Budget != 0)
+    {
+        Entry   = &Context->Entries[Context->CurrentEntry];
+        Address = Entry->Address + Context->CurrentOffset;
+        Length  = min(Entry->Length - Context->CurrentOffset, PAGE_SIZE - (UINT32)(Address & (PAGE_SIZE - 1)));
+        Length  = min(Length, Budget);
+
+        if (Length != 0)
+        {
+            PhysicalAddress = IsPhysical ? Address : GuestVirtualAddressToPhysicalAddress(Context->Cr3, Address, &MemoryTypeFlags);
+
+            if ((IsPhysical || (PhysicalAddress != 0 && GuestMemoryIsPhysicalMemory(Context->Ranges, PhysicalAddress, Length))) &&
+                CopyGuestPhysicalMemory(PhysicalAddress, Context->Buffer + Entry->BufferOffset + Context->CurrentOffset, Length, IsWrite, MemoryTypeFlags))
+            {
+                Context->CurrentOffset += Length;
+                Entry->TransferredLength += Length;
+                Request->TransferredLength += Length;
+                Budget -= Length;
+
+                if (Context->CurrentOffset != Entry->Length)
+                {
+                    continue;
+                }
+            }
+        }
+
+        //
+        // The range is copied (or the rest of it is not present)
+        //
+        Context->CurrentEntry++;
+        Context->CurrentOffset = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Read or write the ranges of the guest memory (IOCTL_GUEST_MEMORY_ACCESS)
+ *
+ * @param Request The request and its ranges
+ * @param BufferLength Length of the buffer of the request
+ * @return NTSTATUS STATUS_PARTIAL_COPY if a range is not copied completely
+ */
+NTSTATUS
+GuestMemoryAccess(PDEBUGGER_GUEST_MEMORY_REQUEST Request, UINT32 BufferLength)
+{
+    PDEBUGGER_GUEST_MEMORY_ENTRY Entries = (PDEBUGGER_GUEST_MEMORY_ENTRY)((UINT64)Request + sizeof(DEBUGGER_GUEST_MEMORY_REQUEST));
+    BOOLEAN                      IsWrite = (Request->Flags & DEBUGGER_GUEST_MEMORY_WRITE) != 0;
+    GUEST_MEMORY_CONTEXT         Context = {0};
+    PEPROCESS                    Process = NULL;
+    UINT64                       RequestedLength = 0;
+    NTSTATUS                     Status;
+    PMDL                         Mdl;
+
+    Request->TransferredLength = 0;
+
+    if (Request->CountOfEntries == 0 || Request->CountOfEntries > DEBUGGER_GUEST_MEMORY_MAXIMUM_ENTRIES ||
+        BufferLength < sizeof(DEBUGGER_GUEST_MEMORY_REQUEST) + Request->CountOfEntries * sizeof(DEBUGGER_GUEST_MEMORY_ENTRY) ||
+        Request->UserBufferLength == 0 || Request->UserBufferLength > DEBUGGER_GUEST_MEMORY_MAXIMUM_BUFFER_SIZE ||
+        (Request->Flags & ~(DEBUGGER_GUEST_MEMORY_WRITE | DEBUGGER_GUEST_MEMORY_PHYSICAL)) != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (UINT32 i = 0; i < Request->CountOfEntries; i++)
+    {
+        if ((UINT64)Entries[i].BufferOffset + Entries[i].Length > Request->UserBufferLength ||
+            Entries[i].Address + Entries[i].Length < Entries[i].Address)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        Entries[i].TransferredLength = 0;
+        RequestedLength += Entries[i].Length;
+    }
+
+    //
+    // The ranges are read here, vmx-root checks the translated pages by them
+    //
+    Context.Ranges = MmGetPhysicalMemoryRanges();
+
+    if (Context.Ranges == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Request->Flags & DEBUGGER_GUEST_MEMORY_PHYSICAL)
+    {
+        for (UINT32 i = 0; i < Request->CountOfEntries; i++)
+        {
+            if (!GuestMemoryIsPhysicalMemory(Context.Ranges, Entries[i].Address, Entries[i].Length))
+            {
+                Status = STATUS_INVALID_ADDRESS;
+                goto Cleanup;
+            }
+        }
+    }
+    else if (Request->ProcessId != 0)
+    {
+        //
+        // The process is referenced until the end, so its page tables are not freed
+        //
+        Status = PsLookupProcessByProcessId((HANDLE)Request->ProcessId, &Process);
+
+        if (!NT_SUCCESS(Status))
+        {
+            goto Cleanup;
+        }
+
+        Context.Cr3 = ((NT_KPROCESS *)Process)->DirectoryTableBase;
+    }
+    else if (Request->Cr3 != 0)
+    {
+        //
+        // The PCID (or the PWT and PCD) bits and the no-flush bit are removed, the
+        // others should be zero and the PML4 should be in the physical memory, as
+        // vmx-root walks the tables of this cr3
+        //
+        Context.Cr3 = Request->Cr3 & PAGE_TABLE_ENTRY_ADDRESS_MASK;
+
+        if ((Request->Cr3 & ~(PAGE_TABLE_ENTRY_ADDRESS_MASK | (PAGE_SIZE - 1) | (1ULL << 63))) != 0 ||
+            !GuestMemoryIsPhysicalMemory(Context.Ranges, Context.Cr3, PAGE_SIZE))
+        {
+            Status = STATUS_INVALID_PARAMETER;
+            goto Cleanup;
+        }
+    }
+    else
+    {
+        Context.Cr3 = FindSystemDirectoryTableBase();
+    }
+
+    //
+    // Lock the user buffer and map it to the system space once, vmx-root
+    // uses the cr3 of the system, so the buffer is accessible there
+    //
+    Mdl = IoAllocateMdl((PVOID)Request->UserBuffer, Request->UserBufferLength, FALSE, FALSE, NULL);
+
+    if (Mdl == NULL)
+    {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(Mdl, UserMode, IsWrite ? IoReadAccess : IoWriteAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(Mdl);
+        Status = GetExceptionCode();
+        goto Cleanup;
+    }
+
+    Context.Buffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority | MdlMappingNoExecute);
+
+    if (Context.Buffer == NULL)
+    {
+        MmUnlockPages(Mdl);
+        IoFreeMdl(Mdl);
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    Context.Request = Request;
+    Context.Entries = Entries;
+    Status          = STATUS_SUCCESS;
+
+    //
+    // Each VMCALL copies a part of the ranges, so the interrupts are not
+    // disabled for a long time
+    //
+    while (Context.CurrentEntry < Request->CountOfEntries)
+    {
+        Status = AsmVmxVmcall(VMCALL_GUEST_MEMORY_ACCESS, (UINT64)&Context, 0, 0);
+
+        if (!NT_SUCCESS(Status))
+        {
+            break;
+        }
+    }
+
+    MmUnlockPages(Mdl);
+    IoFreeMdl(Mdl);
+
+    if (NT_SUCCESS(Status) && Request->TransferredLength != RequestedLength)
+    {
+        Status = STATUS_PARTIAL_COPY;
+    }
+
+Cleanup:
+    if (Process != NULL)
+    {
+        ObDereferenceObject(Process);
+    }
+
+    ExFreePool(Context.Ranges);
+
+    return Status;
+}
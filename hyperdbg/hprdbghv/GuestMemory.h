@@ -0,0 +1,51 @@
+/**
+ * @file GuestMemory.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the bulk reads and writes of the guest memory
+ * @details
+ * @version 0.1
+ * @date 2020-05-27
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* Maximum bytes that are copied by each VMCALL_GUEST_MEMORY_ACCESS (the interrupts of the core are disabled meanwhile) */
+#define GUEST_MEMORY_VMCALL_BUDGET 0x100000
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The state of a guest memory request between its VMCALLs
+ *
+ */
+typedef struct _GUEST_MEMORY_CONTEXT
+{
+    PDEBUGGER_GUEST_MEMORY_REQUEST Request;
+    PDEBUGGER_GUEST_MEMORY_ENTRY   Entries;
+    PUCHAR                         Buffer;        // System address of the user buffer (mapped by its MDL)
+    UINT64                         Cr3;           // The address space of the virtual addresses
+    PPHYSICAL_MEMORY_RANGE         Ranges;        // The physical memory (RAM), the other pages are not copied
+    UINT32                         CurrentEntry;  // The range that is being copied
+    UINT32                         CurrentOffset; // The copied bytes of that range
+
+} GUEST_MEMORY_CONTEXT, *PGUEST_MEMORY_CONTEXT;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+NTSTATUS
+GuestMemoryAccess(PDEBUGGER_GUEST_MEMORY_REQUEST Request, UINT32 BufferLength);
+NTSTATUS
+GuestMemoryHandleVmcall(PGUEST_MEMORY_CONTEXT Context);
@@ -11,6 +11,7 @@
  */
 
 #pragma once
+#include "Definition.h"
 
 //////////////////////////////////////////////////
 //				   Syscall Hook					//
@@ -22,6 +23,22 @@
 #define IMAGE_VXD_SIGNATURE    0x454C     // LE
 #define IMAGE_NT_SIGNATURE     0x00004550 // PE00
 
+/* Slots of the table of the threads that their sysret should be traced (power of 2) */
+#define SYSCALL_TRACE_PENDING_THREADS 1024
+
+/* Slots that are probed to find a thread in the table */
+#define SYSCALL_TRACE_PENDING_PROBES 16
+
+/* The age of each slot is counted in units of 2^30 cycles of the tsc (about a third of a second) */
+#define SYSCALL_TRACE_PENDING_AGE_SHIFT 30
+
+/* Slots that are older than this (in units of age) are reused by other threads */
+#define SYSCALL_TRACE_PENDING_MAXIMUM_AGE 64
+
+/* A slot contains the thread id (bits 63:32), the age (bits 31:16) and the syscall number (bits 15:0) */
+#define SYSCALL_TRACE_PENDING_SLOT(ThreadId, Age, SyscallNumber) \
+    ((LONG64)(((UINT64)(ThreadId) << 32) | ((UINT64)((Age)&0xffff) << 16) | ((SyscallNumber)&0xffff)))
+
 //////////////////////////////////////////////////
 //				   Structure					//
 //////////////////////////////////////////////////
@@ -42,6 +59,27 @@ typedef struct _SSDTStruct
     PCHAR pArgumentTable;
 } SSDTStruct, *PSSDTStruct;
 
+/**
+ * @brief The kernel base and the service tables (resolved once)
+ * @details The addresses of the services are decoded from the tables, so
+ * the service of each syscall number is found by an index
+ *
+ */
+typedef struct _SYSCALL_HOOK_SERVICE_TABLES
+{
+    volatile BOOLEAN IsResolved;       // The kernel base and the nt table are resolved
+    volatile BOOLEAN IsWin32kResolved; // The win32k table is decoded (it's only mapped in the sessions)
+    PVOID            KernelBase;
+    ULONG            KernelSize;
+    PSSDTStruct      NtTable;
+    PSSDTStruct      Win32kTable;
+    PUINT64          NtServices;     // Address of the service of each nt syscall number
+    PUINT64          Win32kServices; // Address of the service of each win32k syscall number
+    UINT32           CountOfNtServices;
+    UINT32           CountOfWin32kServices;
+
+} SYSCALL_HOOK_SERVICE_TABLES, *PSYSCALL_HOOK_SERVICE_TABLES;
+
 typedef struct _HIDDEN_HOOKS_DETOUR_DETAILS
 {
     LIST_ENTRY OtherHooksList;
@@ -102,6 +140,33 @@ SSyscallHookEnableSCE();
 VOID
 SyscallHookDisableSCE();
 
+/* The kernel base and the decoded service tables */
+SYSCALL_HOOK_SERVICE_TABLES SyscallHookServiceTables;
+
+/* Serializes the resolution of the service tables */
+FAST_MUTEX SyscallHookServiceTablesMutex;
+
+/* The syscalls that trigger the SYSCALL_HOOK_EFER events (the others are only emulated) */
+SYSCALL_HOOK_FILTER_REQUEST SyscallHookFilter;
+
+/* Sequence of the changes of the filter (odd while the filter is changed) */
+volatile LONG SyscallHookFilterSequence;
+
+/* Whether the syscalls that match the filter are traced */
+volatile LONG SyscallTraceIsActive;
+
+/* Whether the sysrets of the traced syscalls are traced */
+BOOLEAN SyscallTraceCaptureReturnValue;
+
+/* Threads that are in a traced syscall (see SYSCALL_TRACE_PENDING_SLOT, zero means empty slot) */
+volatile LONG64 SyscallTracePendingThreads[SYSCALL_TRACE_PENDING_THREADS];
+
+/* Changed when a process is created or exited (the cached user-mode #UDs of the previous generations are ignored) */
+volatile LONG SyscallHookProcessGeneration;
+
+/* Whether the process notify routine is registered (otherwise the user-mode #UDs are not cached) */
+BOOLEAN SyscallHookIsProcessNotifyRegistered;
+
 //////////////////////////////////////////////////
 //				   Hidden Hooks					//
 //////////////////////////////////////////////////
@@ -19,6 +19,14 @@
 #include "Vpid.h"
 #include "Vmcall.h"
 #include "Dpc.h"
+#include "Broadcast.h"
+#include "Events.h"
+#include "Sampling.h"
+#include "Pml.h"
+#include "Aggregation.h"
+#include "Ve.h"
+#include "Hooks.h"
+#include "Trampoline.h"
 
 /**
  * @brief Initialize Vmx operation
@@ -30,58 +38,74 @@ HvVmxInitialize()
 {
     int                LogicalProcessorsCount;
     IA32_VMX_BASIC_MSR VmxBasicMsr = {0};
+    UINT64             InitializationStartTime;
+    UINT64             StartTime;
 
     //
     // ****** Start Virtualizing Current System ******
     //
+    RtlZeroMemory(&g_StartupTiming, sizeof(VMX_STARTUP_TIMING));
 
-    //
-    // Initiating EPTP and VMX
-    //
-    if (!VmxInitializer())
-    {
-        //
-        // there was error somewhere in initializing
-        //
-        return FALSE;
-    }
+    InitializationStartTime = __rdtsc();
 
     LogicalProcessorsCount = KeQueryActiveProcessorCount(0);
+    StartTime              = __rdtsc();
 
     for (size_t ProcessorID = 0; ProcessorID < LogicalProcessorsCount; ProcessorID++)
     {
         //
-        // *** Launching VM for Test (in the all logical processor) ***
-        //
-
-        //
-        //Allocating VMM Stack
+        // Reserving the address to read the memory of the guest (it's not done in the
+        // broadcast as reserving the system ptes needs IRQL <= APC_LEVEL), it's done
+        // before vmxon so a failure only frees the reserved addresses
         //
-        if (!VmxAllocateVmmStack(ProcessorID))
+        if (!VmxAllocateMemoryMapper(ProcessorID))
         {
-            //
-            // Some error in allocating Vmm Stack
-            //
+            for (size_t i = 0; i < ProcessorID; i++)
+            {
+                VmxFreeMemoryMapper((INT)i);
+            }
+
             return FALSE;
         }
+    }
+
+    g_StartupTiming.MemoryMapperCycles = __rdtsc() - StartTime;
 
+    //
+    // Initiating EPTP and VMX (the Vmm stack and the bitmaps of each core are
+    // allocated by the core itself)
+    //
+    if (!VmxInitializer())
+    {
         //
-        // Allocating MSR Bit
+        // there was error somewhere in initializing
         //
-        if (!VmxAllocateMsrBitmap(ProcessorID))
+        for (size_t ProcessorID = 0; ProcessorID < LogicalProcessorsCount; ProcessorID++)
         {
-            //
-            // Some error in allocating Msr Bitmaps
-            //
-            return FALSE;
+            VmxFreeMemoryMapper((INT)ProcessorID);
         }
+
+        return FALSE;
     }
 
+    StartTime = __rdtsc();
+
     //
     // As we want to support more than 32 processor (64 logical-core) we let windows execute our routine for us
     //
     KeGenericCallDpc(HvDpcBroadcastInitializeGuest, 0x0);
 
+    g_StartupTiming.LaunchCycles = __rdtsc() - StartTime;
+    g_StartupTiming.TotalCycles  = __rdtsc() - InitializationStartTime;
+    g_StartupTiming.CountOfCores = LogicalProcessorsCount;
+
+    LogInfo("Vmx is initialized on %d logical cores in %llu cycles (ept : %llu, regions : %llu, vmlaunch : %llu)",
+            LogicalProcessorsCount,
+            g_StartupTiming.TotalCycles,
+            g_StartupTiming.EptCycles,
+            g_StartupTiming.RegionsCycles,
+            g_StartupTiming.LaunchCycles);
+
     //
     // Check if everything is ok then return true otherwise false
     //
@@ -95,6 +119,35 @@ HvVmxInitialize()
     }
 }
 
+/**
+ * @brief Copy the cycles of the phases of the initialization of vmx to a buffer
+ * 
+ * @param Result The header of the output buffer (the timing of the cores follows it)
+ * @param OutputBufferLength Size of the output buffer
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+HvQueryStartupTiming(PVMX_STARTUP_TIMING Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength)
+{
+    PVMX_STARTUP_CORE_TIMING Cores        = (PVMX_STARTUP_CORE_TIMING)((UINT64)Result + sizeof(VMX_STARTUP_TIMING));
+    UINT32                   MaximumCores = (OutputBufferLength - sizeof(VMX_STARTUP_TIMING)) / sizeof(VMX_STARTUP_CORE_TIMING);
+
+    *Result                           = g_StartupTiming;
+    Result->TimeStampCounterFrequency = LogTimeStampCounterFrequency;
+    Result->CountOfCores              = min(g_StartupTiming.CountOfCores, MaximumCores);
+    Result->CountOfMissedCores        = g_StartupTiming.CountOfCores - Result->CountOfCores;
+
+    for (size_t i = 0; i < Result->CountOfCores; i++)
+    {
+        Cores[i] = g_GuestState[i].StartupTiming;
+    }
+
+    *ReturnedLength = sizeof(VMX_STARTUP_TIMING) + Result->CountOfCores * sizeof(VMX_STARTUP_CORE_TIMING);
+
+    return STATUS_SUCCESS;
+}
+
 /**
  * @brief Check whether VMX Feature is supported or not
  * 
@@ -233,8 +286,51 @@ HvGetSegmentDescriptor(PSEGMENT_SELECTOR SegmentSelector, USHORT Selector, PUCHA
     return TRUE;
 }
 
+/**
+ * @brief The CPUID leaves that are not cached as their results change
+ * (thermal and power management, the x2APIC topology and the XSAVE sizes
+ * that depend on XCR0)
+ * 
+ */
+static const UINT32 CpuidCacheBypassLeaves[] = {
+    0x6,
+    0xb,
+    0xd,
+    0x1f,
+};
+
+/**
+ * @brief The CPUID leaves that ignore the subleaf (ECX), they're cached with
+ * a zero subleaf so the garbage of ECX doesn't make different entries
+ * 
+ */
+static const UINT32 CpuidCacheNoSubleafLeaves[] = {
+    0x0,
+    CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS,
+    0x2,
+    0x3,
+    0x5,
+    0xa,
+    0x16,
+    0x19,
+    CPUID_HV_VENDOR_AND_MAX_FUNCTIONS,
+    CPUID_HV_INTERFACE,
+    0x80000000,
+    0x80000001,
+    0x80000002,
+    0x80000003,
+    0x80000004,
+    0x80000005,
+    0x80000006,
+    0x80000007,
+    0x80000008,
+};
+
 /**
  * @brief Handle Cpuid Vmexits
+ * @details The results are cached for each core so the next CPUIDs of the same
+ * (leaf, subleaf) don't execute CPUID in vmx-root, the bits that reflect the
+ * guest's CR4 are updated on each hit
  * 
  * @param RegistersState Guest's gp registers
  * @return VOID 
@@ -242,8 +338,49 @@ HvGetSegmentDescriptor(PSEGMENT_SELECTOR SegmentSelector, USHORT Selector, PUCHA
 VOID
 HvHandleCpuid(PGUEST_REGS RegistersState)
 {
-    INT32 cpu_info[4];
-    ULONG Mode = 0;
+    INT32              cpu_info[4];
+    ULONG              Mode    = 0;
+    UINT32             Leaf    = (UINT32)RegistersState->rax;
+    UINT32             Subleaf = (UINT32)RegistersState->rcx;
+    UINT64             GuestCr4;
+    BOOLEAN            Bypass = FALSE;
+    PCPUID_CACHE_ENTRY CacheEntry;
+
+    for (size_t i = 0; i < RTL_NUMBER_OF(CpuidCacheNoSubleafLeaves); i++)
+    {
+        if (CpuidCacheNoSubleafLeaves[i] == Leaf)
+        {
+            Subleaf = 0;
+            break;
+        }
+    }
+
+    CacheEntry = &g_GuestState[KeGetCurrentProcessorNumber()].CpuidCache[(Leaf + (Leaf >> 28) * 5 + Subleaf * 3) & (CPUID_CACHE_ENTRIES - 1)];
+
+    if (CacheEntry->Valid && CacheEntry->Leaf == Leaf && CacheEntry->Subleaf == Subleaf)
+    {
+        RtlCopyMemory(cpu_info, CacheEntry->Registers, sizeof(cpu_info));
+
+        //
+        // OSXSAVE (CPUID.1:ECX[27]) and OSPKE (CPUID.7.0:ECX[4]) are the copies
+        // of CR4.OSXSAVE and CR4.PKE of the guest
+        //
+        if (Leaf == CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS || (Leaf == 7 && Subleaf == 0))
+        {
+            __vmx_vmread(GUEST_CR4, &GuestCr4);
+
+            if (Leaf == CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS)
+            {
+                cpu_info[2] = (cpu_info[2] & ~(1 << 27)) | ((GuestCr4 & (1 << 18)) ? (1 << 27) : 0);
+            }
+            else
+            {
+                cpu_info[2] = (cpu_info[2] & ~(1 << 4)) | ((GuestCr4 & (1 << 22)) ? (1 << 4) : 0);
+            }
+        }
+
+        goto CopyResults;
+    }
 
     //
     // Otherwise, issue the CPUID to the logical processor based on the indexes
@@ -285,6 +422,28 @@ HvHandleCpuid(PGUEST_REGS RegistersState)
         cpu_info[1] = cpu_info[2] = cpu_info[3] = 0;
     }
 
+    //
+    // Save the result (with the above modifications) for the next CPUIDs
+    //
+    for (size_t i = 0; i < RTL_NUMBER_OF(CpuidCacheBypassLeaves); i++)
+    {
+        if (CpuidCacheBypassLeaves[i] == Leaf)
+        {
+            Bypass = TRUE;
+            break;
+        }
+    }
+
+    if (!Bypass)
+    {
+        CacheEntry->Leaf    = Leaf;
+        CacheEntry->Subleaf = Subleaf;
+        RtlCopyMemory(CacheEntry->Registers, cpu_info, sizeof(cpu_info));
+        CacheEntry->Valid = TRUE;
+    }
+
+CopyResults:
+
     //
     // Copy the values from the logical processor registers into the VP GPRs
     //
@@ -308,8 +467,9 @@ HvHandleControlRegisterAccess(PGUEST_REGS GuestState)
     PULONG64              RegPtr;
     INT64                 GuestRsp = 0;
     UINT64                NewCr3;
+    UINT64                GuestCr4 = 0;
 
-    __vmx_vmread(EXIT_QUALIFICATION, &ExitQualification);
+    ExitQualification = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
 
     CrExitQualification = (PMOV_CR_QUALIFICATION)&ExitQualification;
 
@@ -321,8 +481,8 @@ HvHandleControlRegisterAccess(PGUEST_REGS GuestState)
     //
     if (CrExitQualification->Fields.Register == 4)
     {
-        __vmx_vmread(GUEST_RSP, &GuestRsp);
-        *RegPtr = GuestRsp;
+        GuestRsp = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RSP);
+        *RegPtr  = GuestRsp;
     }
 
     switch (CrExitQualification->Fields.AccessType)
@@ -337,9 +497,33 @@ HvHandleControlRegisterAccess(PGUEST_REGS GuestState)
             break;
         case 3:
             NewCr3 = (*RegPtr & ~(1ULL << 63));
-            LogInfo("New process cr3 : 0x%llx , Proc id = : 0x%x", NewCr3, PsGetCurrentProcessId());
-            __vmx_vmwrite(GUEST_CR3, (*RegPtr & ~(1ULL << 63)));
-            InvvpidSingleContext(VPID_TAG);
+            __vmx_vmwrite(GUEST_CR3, NewCr3);
+
+            //
+            // The scoped hooks are armed on the cr3 loads of their process and
+            // disarmed on the cr3 loads of the other processes
+            //
+            EptDisarmedViewUpdate(KeGetCurrentProcessorNumber());
+
+            //
+            // MOV to CR3 doesn't invalidate the global translations, and if
+            // CR4.PCIDE and bit 63 are set it doesn't invalidate anything
+            //
+            __vmx_vmread(GUEST_CR4, &GuestCr4);
+
+            if ((GuestCr4 & X86_CR4_PCIDE) && (*RegPtr & (1ULL << 63)))
+            {
+                break;
+            }
+
+            if (g_InvvpidSingleContextRetainingGlobalsSupport)
+            {
+                InvvpidSingleContextRetainingGlobals(VPID_TAG);
+            }
+            else
+            {
+                InvvpidSingleContext(VPID_TAG);
+            }
             break;
         case 4:
             __vmx_vmwrite(GUEST_CR4, *RegPtr);
@@ -454,8 +638,6 @@ HvHandleMsrRead(PGUEST_REGS GuestRegs)
     //
     if (GuestRegs->rcx == MSR_EFER)
     {
-        DbgBreakPoint();
-
         EFER_MSR MsrEFER;
         MsrEFER.Flags         = msr.Content;
         MsrEFER.SyscallEnable = TRUE;
@@ -501,6 +683,276 @@ HvHandleMsrWrite(PGUEST_REGS GuestRegs)
     }
 }
 
+/**
+ * @brief Handles in the cases when IN, OUT, INS or OUTS causes a vm-exit
+ * @details The string instructions are emulated by the page tables of the
+ * guest, with the address size of the instruction and the base of its segment
+ * (ES for INS, DS or the override for OUTS), at most IO_STRING_MAXIMUM_ELEMENTS
+ * elements of a REP are emulated in one vm-exit and the RIP isn't changed if
+ * any element is remained, so the guest re-executes it for the rest. If an
+ * element is on a page that is not present or is not accessible, the instruction
+ * is stopped at this element and #PF is injected, so the guest re-executes it
+ * after handling the page-fault
+ * 
+ * @param GuestRegs Guest's gp registers
+ * @return VOID 
+ */
+VOID
+HvHandleIoInstruction(PGUEST_REGS GuestRegs)
+{
+    VMX_EXIT_QUALIFICATION_IO_INSTRUCTION IoQualification;
+    UINT32                                Size;
+    UINT16                                Port;
+    UINT64                                Count;
+    UINT64                                Index;
+    UINT64                                Elements;
+    INT64                                 Step;
+    UINT64                                InstructionInfo;
+    UINT64                                AddressSize;
+    UINT64                                AddressMask;
+    UINT64                                LinearMask;
+    UINT64                                Segment;
+    UINT64                                SegmentBase;
+    UINT64                                Linear;
+    UINT64                                GuestCr0;
+    UINT64                                GuestCr3;
+    UINT64                                CsAccessRights;
+    UINT64                                SsAccessRights;
+    UINT64                                RequiredRights;
+    UINT64                                PhysicalAddress[2];
+    UINT64                                PageFlags[2];
+    UINT32                                FirstLength;
+    UINT32                                Pages;
+    UINT32                                Page;
+    UINT32                                ErrorCode;
+    BOOLEAN                               IsIns;
+    BOOLEAN                               IsUserMode;
+    BOOLEAN                               Faulted;
+    UINT32                                Value;
+
+    IoQualification.Flags = HvGetExitContextField(VMX_EXIT_CONTEXT_EXIT_QUALIFICATION);
+
+    //
+    // 0 = 1-byte, 1 = 2-byte, 3 = 4-byte
+    //
+    Size = (UINT32)IoQualification.SizeOfAccess + 1;
+    Port = (UINT16)IoQualification.PortNumber;
+
+    if (!IoQualification.StringInstruction)
+    {
+        if (IoQualification.AccessType)
+        {
+            //
+            // IN (a 32-bit result zero-extends RAX)
+            //
+            if (Size == 1)
+            {
+                GuestRegs->rax = (GuestRegs->rax & ~0xffULL) | __inbyte(Port);
+            }
+            else if (Size == 2)
+            {
+                GuestRegs->rax = (GuestRegs->rax & ~0xffffULL) | __inword(Port);
+            }
+            else
+            {
+                GuestRegs->rax = __indword(Port);
+            }
+        }
+        else
+        {
+            //
+            // OUT
+            //
+            if (Size == 1)
+            {
+                __outbyte(Port, (UCHAR)GuestRegs->rax);
+            }
+            else if (Size == 2)
+            {
+                __outword(Port, (USHORT)GuestRegs->rax);
+            }
+            else
+            {
+                __outdword(Port, (ULONG)GuestRegs->rax);
+            }
+        }
+
+        return;
+    }
+
+    //
+    // INS or OUTS, the guest is always in IA-32e mode (4-level paging) but the
+    // code segment is either 64-bit or compatibility mode
+    //
+    __vmx_vmread(VMX_INSTRUCTION_INFO, &InstructionInfo);
+    __vmx_vmread(GUEST_CS_AR_BYTES, &CsAccessRights);
+    __vmx_vmread(GUEST_SS_AR_BYTES, &SsAccessRights);
+    __vmx_vmread(GUEST_CR0, &GuestCr0);
+    __vmx_vmread(GUEST_CR3, &GuestCr3);
+
+    IsIns      = (BOOLEAN)IoQualification.AccessType;
+    IsUserMode = ((SsAccessRights >> 5) & 0x3) == 3;
+
+    //
+    // Address size (bits 9:7 of the instruction information) : 0 = 16-bit,
+    // 1 = 32-bit, 2 = 64-bit
+    //
+    AddressSize = (InstructionInfo >> 7) & 0x7;
+    AddressMask = AddressSize == 0 ? 0xffff : (AddressSize == 1 ? 0xffffffff : MAXIMUM_ADDRESS);
+
+    //
+    // INS always writes to ES, OUTS reads from DS or its segment override
+    // (bits 17:15 of the instruction information), in 64-bit mode (CS.L)
+    // only FS and GS have a base and the linear address is not truncated
+    //
+    Segment = IsIns ? 0 : (InstructionInfo >> 15) & 0x7;
+
+    if ((CsAccessRights & (1 << 13)) && Segment != 4 && Segment != 5)
+    {
+        SegmentBase = 0;
+    }
+    else
+    {
+        __vmx_vmread(GUEST_SEG_BASE(Segment), &SegmentBase);
+    }
+
+    LinearMask = (CsAccessRights & (1 << 13)) ? MAXIMUM_ADDRESS : 0xffffffff;
+
+    //
+    // INS needs a writable page (for the supervisor only if CR0.WP is set), and
+    // the user-mode needs the user pages
+    //
+    RequiredRights = ((IsIns && (IsUserMode || (GuestCr0 & X86_CR0_WP))) ? PAGE_TABLE_ENTRY_WRITABLE : 0) |
+                     (IsUserMode ? PAGE_TABLE_ENTRY_USER : 0);
+
+    Count    = IoQualification.RepPrefixed ? GuestRegs->rcx & AddressMask : 1;
+    Index    = (IsIns ? GuestRegs->rdi : GuestRegs->rsi) & AddressMask;
+    Step     = (HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RFLAGS) & X86_FLAGS_DF) ? -(INT64)Size : (INT64)Size;
+    Elements  = 0;
+    Linear    = 0;
+    ErrorCode = 0;
+    Faulted   = FALSE;
+
+    while (Count != 0 && Elements < IO_STRING_MAXIMUM_ELEMENTS)
+    {
+        Linear = (SegmentBase + Index) & LinearMask;
+
+        //
+        // The element might cross a page, so both of its pages are translated
+        // before accessing the port (INS doesn't lose the data on a fault)
+        //
+        FirstLength        = min(Size, PAGE_SIZE - (UINT32)(Linear & (PAGE_SIZE - 1)));
+        Pages              = FirstLength == Size ? 1 : 2;
+        PhysicalAddress[0] = GuestVirtualAddressToPhysicalAddress(GuestCr3, Linear, &PageFlags[0]);
+        PhysicalAddress[1] = Pages == 1 ? 0 : GuestVirtualAddressToPhysicalAddress(GuestCr3, (Linear + FirstLength) & LinearMask, &PageFlags[1]);
+
+        for (Page = 0; Page < Pages; Page++)
+        {
+            if (PhysicalAddress[Page] == 0 || (PageFlags[Page] & RequiredRights) != RequiredRights)
+            {
+                break;
+            }
+        }
+
+        if (Page != Pages)
+        {
+            //
+            // Error code : present (bit 0) for the protection faults, write
+            // (bit 1) for INS and user-mode (bit 2) if the CPL (DPL of SS) is 3
+            //
+            Linear    = Page == 0 ? Linear : (Linear + FirstLength) & LinearMask;
+            ErrorCode = (PhysicalAddress[Page] != 0 ? 0x1 : 0) | (IsIns ? 0x2 : 0) | (IsUserMode ? 0x4 : 0);
+            Faulted   = TRUE;
+
+            break;
+        }
+
+        if (IsIns)
+        {
+            if (Size == 1)
+            {
+                Value = __inbyte(Port);
+            }
+            else if (Size == 2)
+            {
+                Value = __inword(Port);
+            }
+            else
+            {
+                Value = __indword(Port);
+            }
+
+            CopyGuestPhysicalMemory(PhysicalAddress[0], &Value, FirstLength, TRUE, PageFlags[0]);
+
+            if (Pages == 2)
+            {
+                CopyGuestPhysicalMemory(PhysicalAddress[1], (PUCHAR)&Value + FirstLength, Size - FirstLength, TRUE, PageFlags[1]);
+            }
+        }
+        else
+        {
+            Value = 0;
+
+            CopyGuestPhysicalMemory(PhysicalAddress[0], &Value, FirstLength, FALSE, PageFlags[0]);
+
+            if (Pages == 2)
+            {
+                CopyGuestPhysicalMemory(PhysicalAddress[1], (PUCHAR)&Value + FirstLength, Size - FirstLength, FALSE, PageFlags[1]);
+            }
+
+            if (Size == 1)
+            {
+                __outbyte(Port, (UCHAR)Value);
+            }
+            else if (Size == 2)
+            {
+                __outword(Port, (USHORT)Value);
+            }
+            else
+            {
+                __outdword(Port, Value);
+            }
+        }
+
+        Index = (Index + Step) & AddressMask;
+        Count--;
+        Elements++;
+    }
+
+    //
+    // The registers show the elements that are done (also on a fault), by the
+    // address size, a 16-bit register keeps its upper bits and a 32-bit one is
+    // zero-extended
+    //
+    if (IoQualification.RepPrefixed)
+    {
+        GuestRegs->rcx = AddressSize == 0 ? (GuestRegs->rcx & ~0xffffULL) | Count : Count;
+    }
+
+    if (IsIns)
+    {
+        GuestRegs->rdi = AddressSize == 0 ? (GuestRegs->rdi & ~0xffffULL) | Index : Index;
+    }
+    else
+    {
+        GuestRegs->rsi = AddressSize == 0 ? (GuestRegs->rsi & ~0xffffULL) | Index : Index;
+    }
+
+    if (Faulted)
+    {
+        __writecr2(Linear);
+        EventInjectPageFault(ErrorCode);
+        g_GuestState[KeGetCurrentProcessorNumber()].IncrementRip = FALSE;
+    }
+    else if (Count != 0)
+    {
+        //
+        // The rest of the elements are done when the guest re-executes it
+        //
+        g_GuestState[KeGetCurrentProcessorNumber()].IncrementRip = FALSE;
+    }
+}
+
 /**
  * @brief Set bits in Msr Bitmap
  * 
@@ -560,14 +1012,107 @@ HvResumeToNextInstruction()
 {
     ULONG64 ResumeRIP             = NULL;
     ULONG64 CurrentRIP            = NULL;
-    ULONG   ExitInstructionLength = 0;
+    ULONG64 ExitInstructionLength = 0;
 
-    __vmx_vmread(GUEST_RIP, &CurrentRIP);
-    __vmx_vmread(VM_EXIT_INSTRUCTION_LEN, &ExitInstructionLength);
+    CurrentRIP            = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+    ExitInstructionLength = HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH);
 
     ResumeRIP = CurrentRIP + ExitInstructionLength;
 
-    __vmx_vmwrite(GUEST_RIP, ResumeRIP);
+    HvSetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP, ResumeRIP);
+}
+
+/**
+ * @brief VMCS encoding of each VMX_EXIT_CONTEXT_FIELD
+ * 
+ */
+static const ULONG ExitContextFieldEncodings[VMX_EXIT_CONTEXT_MAXIMUM_FIELDS] = {
+    GUEST_RIP,
+    GUEST_RSP,
+    GUEST_RFLAGS,
+    EXIT_QUALIFICATION,
+    VM_EXIT_INSTRUCTION_LEN,
+    GUEST_PHYSICAL_ADDRESS,
+};
+
+/**
+ * @brief Forget the cached VMCS fields of the previous vm-exit
+ * @details Should be called at the start of each vm-exit
+ * 
+ * @param CoreIndex Index of the current core
+ * @return VOID 
+ */
+VOID
+HvResetExitContext(UINT32 CoreIndex)
+{
+    g_GuestState[CoreIndex].ExitContext.ValidFields = 0;
+    g_GuestState[CoreIndex].ExitContext.DirtyFields = 0;
+}
+
+/**
+ * @brief Read a VMCS field of the current vm-exit
+ * @details The field is read from the VMCS only the first time, it should be
+ * called in vmx-root
+ * 
+ * @param Field The field
+ * @return UINT64 Value of the field
+ */
+UINT64
+HvGetExitContextField(VMX_EXIT_CONTEXT_FIELD Field)
+{
+    PVMX_EXIT_CONTEXT ExitContext = &g_GuestState[KeGetCurrentProcessorNumber()].ExitContext;
+    UINT64            Value       = 0;
+
+    if (!(ExitContext->ValidFields & (1 << Field)))
+    {
+        __vmx_vmread(ExitContextFieldEncodings[Field], &Value);
+
+        ExitContext->Values[Field] = Value;
+        ExitContext->ValidFields |= (1 << Field);
+    }
+
+    return ExitContext->Values[Field];
+}
+
+/**
+ * @brief Modify a VMCS field of the current vm-exit
+ * @details The field is written to the VMCS in HvWriteBackExitContext (before
+ * VMRESUME), the read-only fields (exit information) shouldn't be modified
+ * 
+ * @param Field The field
+ * @param Value The new value
+ * @return VOID 
+ */
+VOID
+HvSetExitContextField(VMX_EXIT_CONTEXT_FIELD Field, UINT64 Value)
+{
+    PVMX_EXIT_CONTEXT ExitContext = &g_GuestState[KeGetCurrentProcessorNumber()].ExitContext;
+
+    ExitContext->Values[Field] = Value;
+    ExitContext->ValidFields |= (1 << Field);
+    ExitContext->DirtyFields |= (1 << Field);
+}
+
+/**
+ * @brief Write the modified VMCS fields of the current vm-exit
+ * @details Should be called before VMRESUME (not after VMXOFF)
+ * 
+ * @param CoreIndex Index of the current core
+ * @return VOID 
+ */
+VOID
+HvWriteBackExitContext(UINT32 CoreIndex)
+{
+    PVMX_EXIT_CONTEXT ExitContext = &g_GuestState[CoreIndex].ExitContext;
+    ULONG             Field;
+
+    while (ExitContext->DirtyFields != 0)
+    {
+        _BitScanForward(&Field, ExitContext->DirtyFields);
+        ExitContext->DirtyFields &= ~(1 << Field);
+
+        __vmx_vmwrite(ExitContextFieldEncodings[Field], ExitContext->Values[Field]);
+    }
 }
 
 /**
@@ -579,9 +1124,10 @@ VOID
 HvNotifyAllToInvalidateEpt()
 {
     //
-    // Let's notify them all
+    // Let's notify them all, the clean view and the disarmed view are changed
+    // with the hooks of all the cores so all the contexts are invalidated
     //
-    KeIpiGenericCall(HvInvalidateEptByVmcall, g_EptState->EptPointer.Flags);
+    KeIpiGenericCall(HvInvalidateEptByVmcall, (g_EptState->CleanView || g_EptState->DisarmedView) ? NULL : g_EptState->EptPointer.Flags);
 }
 
 /**
@@ -603,9 +1149,10 @@ HvInvalidateEptByVmcall(UINT64 Context)
     else
     {
         //
-        // We have to invalidate all contexts
+        // We have to invalidate the context of this core (it might use its own
+        // EPT view)
         //
-        AsmVmxVmcall(VMCALL_INVEPT_SINGLE_CONTEXT, Context, NULL, NULL);
+        AsmVmxVmcall(VMCALL_INVEPT_SINGLE_CONTEXT, EptGetEptPointerOfCore(KeGetCurrentProcessorNumber()), NULL, NULL);
     }
 }
 
@@ -637,10 +1184,18 @@ HvReturnInstructionPointerForVmxoff()
 VOID
 HvDpcBroadcastInitializeGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
 {
+    UINT64 StartTime = __rdtsc();
+
     //
     // Save the vmx state and prepare vmcs setup and finally execute vmlaunch instruction
     //
     AsmVmxSaveState();
+
+    //
+    // We're in the guest now (or the vmlaunch is failed)
+    //
+    g_GuestState[KeGetCurrentProcessorNumber()].StartupTiming.LaunchCycles = __rdtsc() - StartTime;
+
     //
     // Wait for all DPCs to synchronize at this point
     //
@@ -662,15 +1217,54 @@ HvTerminateVmx()
 {
     LogInfo("Terminating VMX...\n");
 
+    //
+    // The regions are freed after VMXOFF of each core, so a suspended vmx
+    // is resumed first
+    //
+    if (g_VmxSuspended && !NT_SUCCESS(HvResumeVmx()))
+    {
+        LogError("VMX is suspended and it's not possible to terminate it");
+        return;
+    }
+
     //
     // ******* Terminating Vmx *******
     //
 
+    //
+    // Stop the sampling before turning off the preemption timers
+    //
+    SamplingUnInitialize();
+
+    //
+    // Stop the dirty page tracking before turning off the logging
+    //
+    PmlUnInitialize();
+
+    //
+    // Stop counting the accesses before removing the hooks
+    //
+    AggregationUnInitialize();
+
     //
     // Remve All the hooks if any
     //
     HvPerformPageUnHookAllPages();
 
+    //
+    // Restore the original #VE and #DB handlers (no entry delivers #VE now)
+    //
+    if (VeCoreStates)
+    {
+        KeGenericCallDpc(VeDpcBroadcastRemoveHandlers, 0x0);
+    }
+
+    //
+    // Send the non-immediate messages of all the cores before turning off the
+    // hypervisor (the vmx-root buffers are flushed using VMCALL)
+    //
+    KeGenericCallDpc(LogDpcBroadcastFlushNonImmediateBuffers, 0x0);
+
     //
     // Broadcast to terminate Vmx
     //
@@ -685,6 +1279,33 @@ HvTerminateVmx()
     //
     MmFreeContiguousMemory(g_EptState->EptPageTable);
 
+    //
+    // Free the EPT views of the cores
+    //
+    EptUninitializeCoreViews();
+
+    //
+    // Free the reserved addresses of the memory mappers
+    //
+    for (size_t ProcessorID = 0; ProcessorID < KeQueryActiveProcessorCount(0); ProcessorID++)
+    {
+        VmxFreeMemoryMapper((INT)ProcessorID);
+    }
+
+    //
+    // Free the root of the sub-page permission table
+    //
+    if (g_EptState->SppTable)
+    {
+        ExFreePoolWithTag(g_EptState->SppTable, POOLTAG);
+        g_EptState->SppTable = NULL;
+    }
+
+    //
+    // Free the state of virtualization exceptions
+    //
+    VeUninitialize();
+
     //
     // Free EptState
     //
@@ -729,6 +1350,206 @@ HvDpcBroadcastTerminateGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgu
     KeSignalCallDpcDone(SystemArgument1);
 }
 
+/**
+ * @brief The broadcast function which suspends the guest
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+HvDpcBroadcastSuspendGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    //
+    // A core that is failed to resume is not in vmx operation
+    //
+    if (g_GuestState[KeGetCurrentProcessorNumber()].HasLaunched && !VmxSuspend())
+    {
+        LogError("There were an error suspending Vmx");
+    }
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief The broadcast function which resumes the guest
+ * @details Only VMXON and VMLAUNCH are executed, the regions and the
+ * bitmaps of the core are kept from the suspension
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+HvDpcBroadcastResumeGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    ULONG CurrentProcessorIndex = KeGetCurrentProcessorNumber();
+
+    AsmEnableVmxOperation();
+
+    if (VmxReuseVmxonRegion(&g_GuestState[CurrentProcessorIndex]))
+    {
+        g_GuestState[CurrentProcessorIndex].VmxoffState.IsVmxoffExecuted = FALSE;
+
+        //
+        // The page tables of the guest are changed while the core was not in vmx
+        // operation, the cached translations of the previous launch are not valid
+        //
+        InveptAllContexts();
+        InvvpidAllContexts();
+
+        //
+        // Save the vmx state and prepare vmcs setup and finally execute vmlaunch instruction
+        //
+        AsmVmxSaveState();
+
+        if (g_GuestState[CurrentProcessorIndex].HasLaunched)
+        {
+            //
+            // The new VMCS only has the default exception bitmap and EFER
+            //
+            AsmVmxVmcall(VMCALL_UPDATE_EXCEPTION_BITMAP, 0, 0, 0);
+
+            if (g_GuestState[CurrentProcessorIndex].VmxoffState.IsEferSyscallHookEnabled)
+            {
+                AsmVmxVmcall(VMCALL_ENABLE_SYSCALL_HOOK_EFER, 0, 0, 0);
+            }
+        }
+    }
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief Turn off vmx on all logical cores and keep the regions, the EPT
+ * tables, the pools and the hooks
+ * @details The sampling, the dirty page tracking and the aggregation are
+ * stopped as they need vmx-root
+ * 
+ * @return NTSTATUS 
+ */
+NTSTATUS
+HvSuspendVmx()
+{
+    if (g_VmxSuspended)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    //
+    // The IOCTLs that use VMCALL are rejected from now
+    //
+    g_VmxSuspended = TRUE;
+
+    SamplingStop();
+    PmlStop();
+    AggregationStop();
+
+    //
+    // Send the non-immediate messages of all the cores (the vmx-root buffers are
+    // flushed using VMCALL)
+    //
+    KeGenericCallDpc(LogDpcBroadcastFlushNonImmediateBuffers, 0x0);
+
+    KeGenericCallDpc(HvDpcBroadcastSuspendGuest, 0x0);
+
+    //
+    // No entry delivers #VE after VMXOFF, so the original handlers are restored
+    // (they're installed again by the VMCS setup of resuming)
+    //
+    if (VeCoreStates)
+    {
+        KeGenericCallDpc(VeDpcBroadcastRemoveHandlers, 0x0);
+    }
+
+    LogInfo("VMX is suspended");
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Resume vmx on all logical cores after HvSuspendVmx
+ * 
+ * @return NTSTATUS 
+ */
+NTSTATUS
+HvResumeVmx()
+{
+    ULONG ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    if (!g_VmxSuspended)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    KeGenericCallDpc(HvDpcBroadcastResumeGuest, 0x0);
+
+    for (ULONG i = 0; i < ProcessorCount; i++)
+    {
+        if (!g_GuestState[i].HasLaunched)
+        {
+            //
+            // The cores should be all in vmx operation or all out of it
+            //
+            LogError("Vmx is not resumed on logical core %d", i);
+            KeGenericCallDpc(HvDpcBroadcastSuspendGuest, 0x0);
+
+            if (VeCoreStates)
+            {
+                KeGenericCallDpc(VeDpcBroadcastRemoveHandlers, 0x0);
+            }
+
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    g_VmxSuspended = FALSE;
+
+    LogInfo("VMX is resumed");
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Suspend or resume vmx on all logical cores
+ * 
+ * @param Request Whether to suspend or resume (the cycles are returned in it)
+ * @return NTSTATUS 
+ */
+NTSTATUS
+HvControlVmxSuspension(PVMX_SUSPEND_REQUEST Request)
+{
+    NTSTATUS Status;
+    UINT64   StartTime = __rdtsc();
+
+    Status = Request->Suspend ? HvSuspendVmx() : HvResumeVmx();
+
+    Request->Cycles                    = __rdtsc() - StartTime;
+    Request->TimeStampCounterFrequency = LogTimeStampCounterFrequency;
+
+    return Status;
+}
+
 /**
  * @brief Set the monitor trap flag
  * 
@@ -835,59 +1656,33 @@ HvRestoreRegisters()
 }
 
 /**
- * @brief The broadcast function which removes all the hooks and invalidate TLB
+ * @brief Free the trampoline of a removed detour hook and its detour details
+ * @details Should be called from vmx non-root after the hook is removed from
+ * the EPT of all the cores
  * 
- * @param Dpc 
- * @param DeferredContext 
- * @param SystemArgument1 
- * @param SystemArgument2 
+ * @param HookedEntry The details of the removed hook
  * @return VOID 
  */
-VOID
-HvDpcBroadcastRemoveHookAndInvalidateAllEntries(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+static VOID
+HvReleaseTrampolineOfHook(PEPT_HOOKED_PAGE_DETAIL HookedEntry)
 {
-    //
-    // Execute the VMCALL to remove the hook and invalidate
-    //
-    AsmVmxVmcall(VMCALL_UNHOOK_ALL_PAGES, NULL, NULL, NULL);
-
-    //
-    // Wait for all DPCs to synchronize at this point
-    //
-    KeSignalCallDpcSynchronize(SystemArgument2);
+    PLIST_ENTRY TempList = &g_HiddenHooksDetourListHead;
 
-    //
-    // Mark the DPC as being complete
-    //
-    KeSignalCallDpcDone(SystemArgument1);
-}
-
-/**
- * @brief The broadcast function which removes the single hook and invalidate TLB
- * 
- * @param Dpc 
- * @param DeferredContext 
- * @param SystemArgument1 
- * @param SystemArgument2 
- * @return VOID 
- */
-VOID
-HvDpcBroadcastRemoveHookAndInvalidateSingleEntry(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
-{
-    //
-    // Execute the VMCALL to remove the hook and invalidate
-    //
-    AsmVmxVmcall(VMCALL_UNHOOK_SINGLE_PAGE, DeferredContext, NULL, NULL);
+    while (&g_HiddenHooksDetourListHead != TempList->Flink)
+    {
+        TempList                                          = TempList->Flink;
+        PHIDDEN_HOOKS_DETOUR_DETAILS CurrentHookedDetails = CONTAINING_RECORD(TempList, HIDDEN_HOOKS_DETOUR_DETAILS, OtherHooksList);
 
-    //
-    // Wait for all DPCs to synchronize at this point
-    //
-    KeSignalCallDpcSynchronize(SystemArgument2);
+        if (CurrentHookedDetails->ReturnAddress == HookedEntry->Trampoline)
+        {
+            RemoveEntryList(&CurrentHookedDetails->OtherHooksList);
+            PoolManagerFreePool((UINT64)CurrentHookedDetails);
+            break;
+        }
+    }
 
-    //
-    // Mark the DPC as being complete
-    //
-    KeSignalCallDpcDone(SystemArgument1);
+    TrampolineArenaFree(HookedEntry->Trampoline);
+    HookedEntry->Trampoline = NULL;
 }
 
 /**
@@ -900,8 +1695,8 @@ HvDpcBroadcastRemoveHookAndInvalidateSingleEntry(KDPC * Dpc, PVOID DeferredConte
 BOOLEAN
 HvPerformPageUnHookSinglePage(UINT64 VirtualAddress)
 {
-    PLIST_ENTRY TempList = 0;
-    SIZE_T      PhysicalAddress;
+    PEPT_HOOKED_PAGE_DETAIL HookedEntry;
+    SIZE_T                  PhysicalAddress;
 
     PhysicalAddress = PAGE_ALIGN(VirtualAddressToPhysicalAddress(VirtualAddress));
 
@@ -913,26 +1708,52 @@ HvPerformPageUnHookSinglePage(UINT64 VirtualAddress)
         return FALSE;
     }
 
-    TempList = &g_EptState->HookedPagesList;
-    while (&g_EptState->HookedPagesList != TempList->Flink)
+    HookedEntry = EptHookedPagesTableFind(PhysicalAddress);
+
+    if (HookedEntry)
     {
-        TempList                            = TempList->Flink;
-        PEPT_HOOKED_PAGE_DETAIL HookedEntry = CONTAINING_RECORD(TempList, EPT_HOOKED_PAGE_DETAIL, PageHookList);
+        //
+        // Remove it in all the cores
+        //
+        BroadcastVmcallToAllCores(VMCALL_UNHOOK_SINGLE_PAGE, HookedEntry->PhysicalBaseAddress);
+
+        //
+        // remove the entry from the index and the list
+        //
+        EptHookedPagesTableRemove(HookedEntry);
+        RemoveEntryList(&HookedEntry->PageHookList);
 
-        if (HookedEntry->PhysicalBaseAddress == PhysicalAddress)
+        if (HookedEntry->CoreId == DEBUGGER_EVENT_APPLY_TO_ALL_CORES && !HookedEntry->IsExecutionHook)
         {
-            //
-            // Remove it in all the cores
-            //
-            KeGenericCallDpc(HvDpcBroadcastRemoveHookAndInvalidateSingleEntry, HookedEntry->PhysicalBaseAddress);
+            InterlockedDecrement(&g_EptState->CountOfMonitorHooks);
+        }
 
-            //
-            // remove the entry from the list
-            //
-            RemoveEntryList(HookedEntry->PageHookList.Flink);
+        //
+        // Map the 2MB page as a large page if it was the last hook on it
+        //
+        if (EptReleaseSplitOfHookedPage(HookedEntry))
+        {
+            HvNotifyAllToInvalidateEpt();
+            EptFreeReleasedSplits();
+        }
+
+        //
+        // The slot of the trampoline is reused by the next detour hooks
+        //
+        if (HookedEntry->IsExecutionHook && HookedEntry->Trampoline)
+        {
+            HvReleaseTrampolineOfHook(HookedEntry);
+        }
 
-            return TRUE;
+        //
+        // The cr3 loads don't exit after the last scoped hook
+        //
+        if (HookedEntry->ProcessId != 0 && InterlockedDecrement(&g_EptState->CountOfScopedHooks) == 0)
+        {
+            BroadcastVmcallToAllCores(VMCALL_CONFIGURE_SCOPED_HOOKS, FALSE);
         }
+
+        return TRUE;
     }
     //
     // Nothing found , probably the list is not found
@@ -949,6 +1770,10 @@ HvPerformPageUnHookSinglePage(UINT64 VirtualAddress)
 VOID
 HvPerformPageUnHookAllPages()
 {
+    PLIST_ENTRY TempList    = 0;
+    BOOLEAN     IsAnyMerged = FALSE;
+    BOOLEAN     IsAnyScoped = g_EptState->CountOfScopedHooks != 0;
+
     //
     // Should be called from vmx non-root
     //
@@ -960,9 +1785,43 @@ HvPerformPageUnHookAllPages()
     //
     // Remove it in all the cores
     //
-    KeGenericCallDpc(HvDpcBroadcastRemoveHookAndInvalidateAllEntries, 0x0);
+    BroadcastVmcallToAllCores(VMCALL_UNHOOK_ALL_PAGES, 0);
 
     //
-    // No need to remove the list as it will automatically remove by the pool uninitializer
+    // Map the split pages as large pages again, the details of the hooks are
+    // freed by the pool uninitializer
     //
+    TempList = &g_EptState->HookedPagesList;
+    while (&g_EptState->HookedPagesList != TempList->Flink)
+    {
+        TempList                            = TempList->Flink;
+        PEPT_HOOKED_PAGE_DETAIL HookedEntry = CONTAINING_RECORD(TempList, EPT_HOOKED_PAGE_DETAIL, PageHookList);
+
+        IsAnyMerged |= EptReleaseSplitOfHookedPage(HookedEntry);
+
+        if (HookedEntry->IsExecutionHook && HookedEntry->Trampoline)
+        {
+            HvReleaseTrampolineOfHook(HookedEntry);
+        }
+    }
+
+    //
+    // The hooks are not in the EPT anymore, so they're removed from the list and the index
+    //
+    InitializeListHead(&g_EptState->HookedPagesList);
+    RtlZeroMemory(g_EptState->HookedPagesTable, sizeof(g_EptState->HookedPagesTable));
+    g_EptState->HookedPagesTableCount = 0;
+    g_EptState->CountOfMonitorHooks   = 0;
+    g_EptState->CountOfScopedHooks    = 0;
+
+    if (IsAnyMerged)
+    {
+        HvNotifyAllToInvalidateEpt();
+        EptFreeReleasedSplits();
+    }
+
+    if (IsAnyScoped)
+    {
+        BroadcastVmcallToAllCores(VMCALL_CONFIGURE_SCOPED_HOOKS, FALSE);
+    }
 }
@@ -25,6 +25,9 @@ HvIsVmxSupported();
 /* Initialize Vmx */
 BOOLEAN
 HvVmxInitialize();
+/* Copy the cycles of the phases of the initialization of vmx */
+NTSTATUS
+HvQueryStartupTiming(PVMX_STARTUP_TIMING Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength);
 /* Allocates Vmx regions for all logical cores (Vmxon region and Vmcs region) */
 BOOLEAN
 VmxDpcBroadcastAllocateVmxonRegions(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
@@ -60,9 +63,24 @@ HvHandleMsrRead(PGUEST_REGS GuestRegs);
 /* Handle Guest's Msr write */
 VOID
 HvHandleMsrWrite(PGUEST_REGS GuestRegs);
+/* Handle Guest's I/O instructions */
+VOID
+HvHandleIoInstruction(PGUEST_REGS GuestRegs);
 /* Resume GUEST_RIP to next instruction */
 VOID
 HvResumeToNextInstruction();
+/* Forget the cached VMCS fields of the previous vm-exit */
+VOID
+HvResetExitContext(UINT32 CoreIndex);
+/* Read a VMCS field of the current vm-exit (from the cache if it's already read) */
+UINT64
+HvGetExitContextField(VMX_EXIT_CONTEXT_FIELD Field);
+/* Modify a VMCS field of the current vm-exit (it's written to the VMCS before VMRESUME) */
+VOID
+HvSetExitContextField(VMX_EXIT_CONTEXT_FIELD Field, UINT64 Value);
+/* Write the modified VMCS fields of the current vm-exit */
+VOID
+HvWriteBackExitContext(UINT32 CoreIndex);
 /* Invalidate EPT using Vmcall (should be called from Vmx non root mode) */
 VOID
 HvInvalidateEptByVmcall(UINT64 Context);
@@ -75,6 +93,21 @@ HvDpcBroadcastTerminateGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgu
 /* Terminate Vmx on all logical cores */
 VOID
 HvTerminateVmx();
+/* The broadcast function which suspends the guest */
+VOID
+HvDpcBroadcastSuspendGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+/* The broadcast function which resumes the guest */
+VOID
+HvDpcBroadcastResumeGuest(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+/* Turn off vmx on all logical cores and keep the regions and the hooks */
+NTSTATUS
+HvSuspendVmx();
+/* Resume vmx on all logical cores */
+NTSTATUS
+HvResumeVmx();
+/* Suspend or resume vmx on all logical cores */
+NTSTATUS
+HvControlVmxSuspension(PVMX_SUSPEND_REQUEST Request);
 /* Set or unset the monitor trap flags */
 VOID
 HvSetMonitorTrapFlag(BOOLEAN Set);
@@ -20,6 +20,7 @@ extern void inline AsmEnableVmxOperation();
 extern void inline AsmRestoreToVmxOffState();
 extern NTSTATUS inline AsmVmxVmcall(unsigned long long VmcallNumber, unsigned long long OptionalParam1, unsigned long long OptionalParam2, long long OptionalParam3);
 extern UINT64 inline AsmHypervVmcall(unsigned long long HypercallInputValue, unsigned long long InputParamGPA, unsigned long long OutputParamGPA);
+extern void inline AsmVmxVmfunc(unsigned long ViewIndex);
 
 //
 // ====================  Vmx Context State Operations ====================
@@ -44,6 +45,8 @@ extern void inline AsmSaveVmxOffState();
 //
 extern unsigned char inline AsmInvept(unsigned long Type, void * Descriptors);
 extern unsigned char inline AsmInvvpid(unsigned long Type, void * Descriptors);
+extern void AsmVeHandler();
+extern void AsmVeDebugHandler();
 
 //
 // ====================  Get segment registers ====================
@@ -15,6 +15,9 @@
 #include "Logging.h"
 #include "Trace.h"
 #include "GlobalVariables.h"
+#include "Dpc.h"
+#include "Vmcall.h"
+#include "InlineAsm.h"
 #include "Logging.tmh"
 
 /**
@@ -25,11 +28,17 @@
 BOOLEAN
 LogInitialize()
 {
+    UINT32        ProcessorCount;
+    LARGE_INTEGER DueTime;
+
     //
     // Initialize buffers for trace message and data messages
-    //(we have two buffers one for vmx root and one for vmx non-root)
+    // (we have two buffers for each core, one for vmx root and one for vmx non-root)
     //
-    MessageBufferInformation = ExAllocatePoolWithTag(NonPagedPool, sizeof(LOG_BUFFER_INFORMATION) * 2, POOLTAG);
+    ProcessorCount     = KeQueryActiveProcessorCount(0);
+    MessageBufferCount = ProcessorCount * 2;
+
+    MessageBufferInformation = ExAllocatePoolWithTag(NonPagedPool, sizeof(LOG_BUFFER_INFORMATION) * MessageBufferCount, POOLTAG);
 
     if (!MessageBufferInformation)
     {
@@ -39,34 +48,37 @@ LogInitialize()
     //
     // Zeroing the memory
     //
-    RtlZeroMemory(MessageBufferInformation, sizeof(LOG_BUFFER_INFORMATION) * 2);
+    RtlZeroMemory(MessageBufferInformation, sizeof(LOG_BUFFER_INFORMATION) * MessageBufferCount);
+
+    //
+    // Initialize the lock of the consumers, the producers don't need any lock
+    //
+    KeInitializeSpinLock(&MessageBufferReaderLock);
+
+    //
+    // The subscribers are added by IOCTL_LOG_SUBSCRIBE
+    //
+    KeInitializeGuardedMutex(&LogSubscriptionsMutex);
 
     //
-    // Initialize the lock for Vmx-root mode (HIGH_IRQL Spinlock)
+    // Initialize the queue of the IRPs that wait for new messages
     //
-    VmxRootLoggingLock = 0;
+    InitializeListHead(&MessageBufferPendingIrps);
+    KeInitializeSpinLock(&MessageBufferPendingIrpsLock);
+    KeInitializeDpc(&MessageBufferNotifyDpc, LogNotifyPendingIrpsCallback, NULL);
 
     //
     // Allocate buffer for messages and initialize the core buffer information
     //
-    for (int i = 0; i < 2; i++)
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
     {
-        //
-        // initialize the lock
-        // Actually, only the 0th buffer use this spinlock but let initialize it
-        // for both but the second buffer spinlock is useless
-        // as we use our custom spinlock
-        //
-        KeInitializeSpinLock(&MessageBufferInformation[i].BufferLock);
-        KeInitializeSpinLock(&MessageBufferInformation[i].BufferLockForNonImmMessage);
-
         //
         // allocate the buffer
         //
         MessageBufferInformation[i].BufferStartAddress                   = ExAllocatePoolWithTag(NonPagedPool, LogBufferSize, POOLTAG);
         MessageBufferInformation[i].BufferForMultipleNonImmediateMessage = ExAllocatePoolWithTag(NonPagedPool, PacketChunkSize, POOLTAG);
 
-        if (!MessageBufferInformation[i].BufferStartAddress)
+        if (!MessageBufferInformation[i].BufferStartAddress || !MessageBufferInformation[i].BufferForMultipleNonImmediateMessage)
         {
             return FALSE; // STATUS_INSUFFICIENT_RESOURCES
         }
@@ -75,12 +87,120 @@ LogInitialize()
         // Zeroing the buffer
         //
         RtlZeroMemory(MessageBufferInformation[i].BufferStartAddress, LogBufferSize);
+        RtlZeroMemory(MessageBufferInformation[i].BufferForMultipleNonImmediateMessage, PacketChunkSize);
 
         //
         // Set the end address
         //
         MessageBufferInformation[i].BufferEndAddress = (UINT64)MessageBufferInformation[i].BufferStartAddress + LogBufferSize;
+
+        //
+        // The ring uses its own counters until it's mapped to user-mode
+        //
+        MessageBufferInformation[i].SharedControl = &MessageBufferInformation[i].Control;
+    }
+
+    //
+    // What to do when the rings are full
+    //
+    MessageBufferOverflowPolicy = LogBuffersDefaultOverflowPolicy;
+
+    //
+    // Compute the frequency of the time stamp counter (for converting it to time in user-mode)
+    //
+    LogCalibrateTimeStampCounter();
+
+    //
+    // Initialize the DPCs to flush the non-immediate messages of each core on the same core
+    //
+    MessageBufferFlushDpcs = ExAllocatePoolWithTag(NonPagedPool, sizeof(KDPC) * ProcessorCount, POOLTAG);
+
+    if (!MessageBufferFlushDpcs)
+    {
+        return FALSE; // STATUS_INSUFFICIENT_RESOURCES
+    }
+
+    for (UINT32 i = 0; i < ProcessorCount; i++)
+    {
+        KeInitializeDpc(&MessageBufferFlushDpcs[i], LogFlushCoreDpc, NULL);
+        KeSetTargetProcessorDpc(&MessageBufferFlushDpcs[i], (CCHAR)i);
+    }
+
+    //
+    // Compute the deadline of the non-immediate messages and start the timer that checks it
+    //
+    MessageBufferFlushDeadline = (LogTimeStampCounterFrequency * NonImmediateMessagesFlushInterval) / 1000000;
+
+    KeInitializeDpc(&MessageBufferFlushTimerDpc, LogFlushTimerCallback, NULL);
+    KeInitializeTimer(&MessageBufferFlushTimer);
+
+    DueTime.QuadPart = -((LONGLONG)NonImmediateMessagesFlushInterval * 10);
+    KeSetTimerEx(&MessageBufferFlushTimer, DueTime, max(1, NonImmediateMessagesFlushInterval / 1000), &MessageBufferFlushTimerDpc);
+
+    return TRUE;
+}
+
+/**
+ * @brief Compute the frequency of the time stamp counter
+ * @details It's measured against the performance counter for 10 ms
+ * 
+ * @return VOID 
+ */
+VOID
+LogCalibrateTimeStampCounter()
+{
+    LARGE_INTEGER PerformanceFrequency;
+    LARGE_INTEGER StartCounter;
+    LARGE_INTEGER EndCounter;
+    UINT64        StartTsc;
+    UINT64        EndTsc;
+
+    StartCounter = KeQueryPerformanceCounter(&PerformanceFrequency);
+    StartTsc     = __rdtsc();
+
+    KeStallExecutionProcessor(10000);
+
+    EndCounter = KeQueryPerformanceCounter(NULL);
+    EndTsc     = __rdtsc();
+
+    if (EndCounter.QuadPart <= StartCounter.QuadPart)
+    {
+        LogTimeStampCounterFrequency = 0;
+        return;
+    }
+
+    LogTimeStampCounterFrequency = ((EndTsc - StartTsc) * PerformanceFrequency.QuadPart) / (EndCounter.QuadPart - StartCounter.QuadPart);
+}
+
+/**
+ * @brief Send a record to user-mode for converting the time stamp counters to time
+ * @details It should be called in vmx non-root
+ * 
+ * @return BOOLEAN Returns true if the record is sent
+ */
+BOOLEAN
+LogSendTimeCalibration()
+{
+    LOG_TIME_CALIBRATION Calibration;
+    LARGE_INTEGER        SystemTime;
+    LARGE_INTEGER        LocalTime;
+
+    if (LogTimeStampCounterFrequency == 0)
+    {
+        return FALSE;
     }
+
+    //
+    // Take the anchor, the time stamp counter and the system time
+    //
+    KeQuerySystemTime(&SystemTime);
+    Calibration.TimeStampCounter = __rdtsc();
+    ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
+
+    Calibration.TimeStampCounterFrequency = LogTimeStampCounterFrequency;
+    Calibration.LocalTime                 = LocalTime.QuadPart;
+
+    return LogSendBuffer(OPERATION_LOG_TIME_CALIBRATION, &Calibration, sizeof(LOG_TIME_CALIBRATION));
 }
 
 /**
@@ -92,15 +212,37 @@ VOID
 LogUnInitialize()
 {
     //
-    // de-allocate buffer for messages and initialize the core buffer information (for vmx-root core)
+    // Free the rings of the subscribers (before waiting for the DPCs)
+    //
+    LogRemoveAllSubscriptions();
+
+    //
+    // Stop the timer of flushing the non-immediate messages and wait for its DPCs
+    //
+    KeCancelTimer(&MessageBufferFlushTimer);
+    KeFlushQueuedDpcs();
+
+    if (MessageBufferFlushDpcs)
+    {
+        ExFreePoolWithTag(MessageBufferFlushDpcs, POOLTAG);
+    }
+
     //
-    for (int i = 0; i < 2; i++)
+    // de-allocate buffer for messages of all the cores
+    //
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
     {
         //
         // Free each buffers
         //
-        ExFreePoolWithTag(MessageBufferInformation[i].BufferStartAddress, POOLTAG);
-        ExFreePoolWithTag(MessageBufferInformation[i].BufferForMultipleNonImmediateMessage, POOLTAG);
+        if (MessageBufferInformation[i].BufferStartAddress)
+        {
+            ExFreePoolWithTag(MessageBufferInformation[i].BufferStartAddress, POOLTAG);
+        }
+        if (MessageBufferInformation[i].BufferForMultipleNonImmediateMessage)
+        {
+            ExFreePoolWithTag(MessageBufferInformation[i].BufferForMultipleNonImmediateMessage, POOLTAG);
+        }
     }
 
     //
@@ -110,81 +252,124 @@ LogUnInitialize()
 }
 
 /**
- * @brief Save buffer to the pool
+ * @brief Write a record to a ring
+ * @details The caller should make sure that it's the only producer of the ring,
+ * if the ring is full, the oldest records are overwritten based on the
+ * policy of the rings
  * 
+ * @param Ring The target ring
  * @param OperationCode The operation code that will be send to user mode
  * @param Buffer Buffer to be send to user mode
  * @param BufferLength Length of the buffer
- * @return BOOLEAN Returns true if the buffer succssfully set to be 
- * send to user mode and false if there was an error
+ * @return BOOLEAN Returns true if the record is written and false if the ring is full
  */
 BOOLEAN
-LogSendBuffer(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
+LogWriteRecordToRing(PLOG_BUFFER_INFORMATION Ring, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
 {
-    KIRQL   OldIRQL;
-    UINT32  Index;
-    BOOLEAN IsVmxRoot;
-
-    if (BufferLength > PacketChunkSize - 1 || BufferLength == 0)
-    {
-        //
-        // We can't save this huge buffer
-        //
-        return FALSE;
-    }
+    BUFFER_HEADER * Header;
+    UINT64          WrittenCount;
+    UINT64          ReadCount;
+    UINT64          Offset;
+    UINT64          TailLength;
+    UINT64          OldestLength;
+    BOOLEAN         IsOldestRecord;
+    UINT64          PaddingLength = 0;
+    UINT64          RecordLength  = LOG_RECORD_SIZE(BufferLength);
 
     //
-    // Check that if we're in vmx root-mode
+    // The consumer might change the ReadCount at the same time, as it only
+    // increases, in the worst case we see less free space
     //
-    IsVmxRoot = g_GuestState[KeGetCurrentProcessorNumber()].IsOnVmxRootMode;
+    WrittenCount = Ring->SharedControl->WrittenCount;
+    ReadCount    = Ring->SharedControl->ReadCount;
 
     //
-    // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-    // if not we use the windows spinlock
+    // Compute the offset of the new record, a record never wraps around
+    // the end of the buffer so we might need to skip the tail
     //
-    if (IsVmxRoot)
+    Offset     = WrittenCount & (LogBufferSize - 1);
+    TailLength = LogBufferSize - Offset;
+
+    if (TailLength < RecordLength)
     {
-        //
-        // Set the index
-        //
-        Index = 1;
-        SpinlockLock(&VmxRootLoggingLock);
+        PaddingLength = TailLength;
     }
-    else
+
+    while (WrittenCount - ReadCount + PaddingLength + RecordLength > LogBufferSize)
     {
+        if (MessageBufferOverflowPolicy != LOG_OVERFLOW_OVERWRITE_OLDEST || ReadCount > WrittenCount || WrittenCount - ReadCount > LogBufferSize)
+        {
+            //
+            // The ring is full (or the counters are invalid), we can't overwrite
+            // the unread records
+            //
+            return FALSE;
+        }
+
         //
-        // Set the index
+        // Compute the size of the oldest record, the consumer never changes
+        // the contents of the ring so it's safe to read its header
         //
-        Index = 0;
+        Header         = (BUFFER_HEADER *)((UINT64)Ring->BufferStartAddress + (ReadCount & (LogBufferSize - 1)));
+        OldestLength   = LogBufferSize - (ReadCount & (LogBufferSize - 1));
+        IsOldestRecord = FALSE;
+
+        if (OldestLength >= sizeof(BUFFER_HEADER) && Header->OpeationNumber != OPERATION_LOG_PADDING)
+        {
+            OldestLength   = LOG_RECORD_SIZE(Header->BufferLength);
+            IsOldestRecord = TRUE;
+        }
+
+        if (ReadCount + OldestLength > WrittenCount)
+        {
+            OldestLength = WrittenCount - ReadCount;
+        }
 
         //
-        // Acquire the lock
+        // The consumer might be consuming the same record at the same time,
+        // only one of us can move the ReadCount
         //
-        KeAcquireSpinLock(&MessageBufferInformation[Index].BufferLock, &OldIRQL);
+        if (InterlockedCompareExchange64((volatile LONG64 *)&Ring->SharedControl->ReadCount, ReadCount + OldestLength, ReadCount) == ReadCount &&
+            IsOldestRecord)
+        {
+            Ring->OverwrittenRecords++;
+
+            if (Header->OpeationNumber == OPERATION_LOG_BINARY_FORMAT_DEFINITION)
+            {
+                //
+                // The consumer never sees this definition, its call site should send it again
+                //
+                LogInvalidateBinaryFormats();
+            }
+        }
+
+        ReadCount = Ring->SharedControl->ReadCount;
     }
 
-    //
-    // check if the buffer is filled to it's maximum index or not
-    //
-    if (MessageBufferInformation[Index].CurrentIndexToWrite > MaximumPacketsCapacity - 1)
+    if (PaddingLength != 0)
     {
         //
-        // start from the begining
+        // Let the consumer know that the tail is skipped, if the tail is smaller
+        // than a header then the consumer skips it without any header
         //
-        MessageBufferInformation[Index].CurrentIndexToWrite = 0;
-    }
+        if (TailLength >= sizeof(BUFFER_HEADER))
+        {
+            Header                   = (BUFFER_HEADER *)((UINT64)Ring->BufferStartAddress + Offset);
+            Header->OpeationNumber   = OPERATION_LOG_PADDING;
+            Header->BufferLength     = TailLength - sizeof(BUFFER_HEADER);
+            Header->TimeStampCounter = 0;
+        }
 
-    //
-    // Compute the start of the buffer header
-    //
-    BUFFER_HEADER * Header = (BUFFER_HEADER *)((UINT64)MessageBufferInformation[Index].BufferStartAddress + (MessageBufferInformation[Index].CurrentIndexToWrite * (PacketChunkSize + sizeof(BUFFER_HEADER))));
+        Offset = 0;
+    }
 
     //
     // Set the header
     //
-    Header->OpeationNumber = OperationCode;
-    Header->BufferLength   = BufferLength;
-    Header->Valid          = TRUE;
+    Header                   = (BUFFER_HEADER *)((UINT64)Ring->BufferStartAddress + Offset);
+    Header->OpeationNumber   = OperationCode;
+    Header->BufferLength     = BufferLength;
+    Header->TimeStampCounter = __rdtsc();
 
     //
     // ******** Now it's time to fill the buffer ********
@@ -193,7 +378,7 @@ LogSendBuffer(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
     //
     // compute the saving index
     //
-    PVOID SavingBuffer = ((UINT64)MessageBufferInformation[Index].BufferStartAddress + (MessageBufferInformation[Index].CurrentIndexToWrite * (PacketChunkSize + sizeof(BUFFER_HEADER))) + sizeof(BUFFER_HEADER));
+    PVOID SavingBuffer = ((UINT64)Header + sizeof(BUFFER_HEADER));
 
     //
     // Copy the buffer
@@ -201,503 +386,2150 @@ LogSendBuffer(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
     RtlCopyBytes(SavingBuffer, Buffer, BufferLength);
 
     //
-    // Increment the next index to write
+    // Make sure that all of the contents are visible before publishing
+    // the record to the consumer
     //
-    MessageBufferInformation[Index].CurrentIndexToWrite = MessageBufferInformation[Index].CurrentIndexToWrite + 1;
+    KeMemoryBarrier();
+    Ring->SharedControl->WrittenCount = WrittenCount + PaddingLength + RecordLength;
 
-    //
-    // check if there is any thread in IRP Pending state, so we can complete their request
-    //
-    if (g_GlobalNotifyRecord != NULL)
+    if (Ring->IsMappedToUsermode)
     {
         //
-        // there is some threads that needs to be completed
-        //
-
-        //
-        // set the target pool
-        //
-        g_GlobalNotifyRecord->CheckVmxRootMessagePool = IsVmxRoot;
-
-        //
-        // Insert dpc to queue
+        // Signal the user-mode app if the ring is crossing the threshold
+        // (the event is signaled in a DPC as we might be in vmx-root)
         //
-        KeInsertQueueDpc(&g_GlobalNotifyRecord->Dpc, g_GlobalNotifyRecord, NULL);
-
-        //
-        // set notify routine to null
-        //
-        g_GlobalNotifyRecord = NULL;
+        if (WrittenCount - ReadCount < MessageBufferSharedFillThreshold &&
+            WrittenCount - ReadCount + PaddingLength + RecordLength >= MessageBufferSharedFillThreshold)
+        {
+            KeInsertQueueDpc(&MessageBufferSharedEventDpc, NULL, NULL);
+        }
     }
 
-    //
-    // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-    // if not we use the windows spinlock
-    //
-    if (IsVmxRoot)
-    {
-        SpinlockUnlock(&VmxRootLoggingLock);
-    }
-    else
-    {
-        //
-        // Release the lock
-        //
-        KeReleaseSpinLock(&MessageBufferInformation[Index].BufferLock, OldIRQL);
-    }
+    return TRUE;
 }
 
 /**
- * @brief Attempt to read the buffer 
+ * @brief Save buffer to a ring
+ * @details The caller should make sure that it's the only producer of the ring,
+ * it means that it runs on the owner core of the ring and can't be preempted
+ * by another producer of the same ring
  * 
- * @param IsVmxRoot Determine whether you want to read vmx root buffer or vmx non root buffer
- * @param BufferToSaveMessage Target buffer to save the message
- * @param ReturnedLength The actual length of the buffer that this function used it
- * @return BOOLEAN return of this function shows whether the read was successfull 
- * or not (e.g FALSE shows there's no new buffer available.)
+ * @param Ring The target ring
+ * @param OperationCode The operation code that will be send to user mode
+ * @param Buffer Buffer to be send to user mode
+ * @param BufferLength Length of the buffer
+ * @return BOOLEAN Returns true if the buffer succssfully set to be 
+ * send to user mode and false if there was an error or the ring is full
  */
 BOOLEAN
-LogReadBuffer(BOOLEAN IsVmxRoot, PVOID BufferToSaveMessage, UINT32 * ReturnedLength)
+LogSendBufferToRing(PLOG_BUFFER_INFORMATION Ring, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
 {
-    KIRQL  OldIRQL;
-    UINT32 Index;
+    LOG_RECORDS_LOST RecordsLost;
 
-    //
-    // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-    // if not we use the windows spinlock
-    //
-    if (IsVmxRoot)
+    if (Ring->LostRecords != 0 && MessageBufferOverflowPolicy == LOG_OVERFLOW_SUMMARIZE)
     {
         //
-        // Set the index
+        // Report the dropped records before the new record
         //
-        Index = 1;
+        RecordsLost.LostRecords = Ring->LostRecords;
 
-        //
-        // Acquire the lock
-        //
-        SpinlockLock(&VmxRootLoggingLock);
+        if (!LogWriteRecordToRing(Ring, OPERATION_LOG_RECORDS_LOST, &RecordsLost, sizeof(LOG_RECORDS_LOST)))
+        {
+            Ring->DroppedRecords++;
+            Ring->LostRecords++;
+            return FALSE;
+        }
+
+        Ring->LostRecords = 0;
     }
-    else
+
+    if (!LogWriteRecordToRing(Ring, OperationCode, Buffer, BufferLength))
     {
-        //
-        // Set the index
-        //
-        Index = 0;
+        Ring->DroppedRecords++;
 
-        //
-        // Acquire the lock
-        //
-        KeAcquireSpinLock(&MessageBufferInformation[Index].BufferLock, &OldIRQL);
+        if (OperationCode == OPERATION_LOG_BINARY_FORMAT_DEFINITION)
+        {
+            //
+            // It might be dropped only for this consumer (e.g. a subscriber)
+            //
+            LogInvalidateBinaryFormats();
+        }
+
+        if (MessageBufferOverflowPolicy == LOG_OVERFLOW_SUMMARIZE)
+        {
+            Ring->LostRecords++;
+        }
+        return FALSE;
     }
 
+    Ring->WrittenRecords++;
+
     //
-    // Compute the current buffer to read
+    // check if there is any thread in IRP Pending state, so we can complete their request,
+    // if the DPC is already queued (e.g. by other cores), it's not queued again
     //
-    BUFFER_HEADER * Header = (BUFFER_HEADER *)((UINT64)MessageBufferInformation[Index].BufferStartAddress + (MessageBufferInformation[Index].CurrentIndexToSend * (PacketChunkSize + sizeof(BUFFER_HEADER))));
+    if (MessageBufferPendingIrpsCount != 0)
+    {
+        KeInsertQueueDpc(&MessageBufferNotifyDpc, NULL, NULL);
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Save buffer to the pool
+ * 
+ * @param OperationCode The operation code that will be send to user mode
+ * @param Buffer Buffer to be send to user mode
+ * @param BufferLength Length of the buffer
+ * @return BOOLEAN Returns true if the buffer succssfully set to be 
+ * send to user mode and false if there was an error
+ */
+BOOLEAN
+LogSendBuffer(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
+{
+    KIRQL   OldIRQL;
+    BOOLEAN Result;
+    ULONG   CurrentCore;
 
-    if (!Header->Valid)
+    if (BufferLength > PacketChunkSize - 1 || BufferLength == 0)
     {
         //
-        // there is nothing to send
+        // We can't save this huge buffer
         //
         return FALSE;
     }
 
     //
-    // If we reached here, means that there is sth to send
-    //
-
-    //
-    // First copy the header
+    // Check that if we're in vmx root-mode, in vmx-root we're the only producer
+    // of this core's vmx-root ring as vm-exits are not nested, so no lock is needed
     //
-    RtlCopyBytes(BufferToSaveMessage, &Header->OpeationNumber, sizeof(UINT32));
+    CurrentCore = KeGetCurrentProcessorNumber();
 
-    //
-    // Second, save the buffer contents
-    //
-    PVOID SendingBuffer = ((UINT64)MessageBufferInformation[Index].BufferStartAddress + (MessageBufferInformation[Index].CurrentIndexToSend * (PacketChunkSize + sizeof(BUFFER_HEADER))) + sizeof(BUFFER_HEADER));
-    PVOID SavingAddress = ((UINT64)BufferToSaveMessage + sizeof(UINT32)); /* Because we want to pass the header of usermode header */
-    RtlCopyBytes(SavingAddress, SendingBuffer, Header->BufferLength);
-
-#if ShowMessagesOnDebugger
-
-    //
-    // Means that show just messages
-    //
-    if (Header->OpeationNumber <= OPERATION_LOG_NON_IMMEDIATE_MESSAGE)
+    if (g_GuestState[CurrentCore].IsOnVmxRootMode)
     {
-        //
-        // We're in Dpc level here so it's safe to use DbgPrint
-        // DbgPrint limitation is 512 Byte
-        //
-        if (Header->BufferLength > DbgPrintLimitation)
-        {
-            for (size_t i = 0; i <= Header->BufferLength / DbgPrintLimitation; i++)
-            {
-                if (i != 0)
-                {
-                    DbgPrint("%s", (char *)((UINT64)SendingBuffer + (DbgPrintLimitation * i) - 2));
-                }
-                else
-                {
-                    DbgPrint("%s", (char *)((UINT64)SendingBuffer + (DbgPrintLimitation * i)));
-                }
-            }
-        }
-        else
+        if (LogActiveSubscriptions != 0 && !LogRouteToSubscribers(CurrentCore, TRUE, OperationCode, Buffer, BufferLength))
         {
-            DbgPrint("%s", (char *)SendingBuffer);
+            //
+            // Only the subscribers are interested in this record
+            //
+            return TRUE;
         }
-    }
-#endif
 
-    //
-    // Finally, set the current index to invalid as we sent it
-    //
-    Header->Valid = FALSE;
+        return LogSendBufferToRing(&MessageBufferInformation[LOG_BUFFER_INDEX(CurrentCore, TRUE)], OperationCode, Buffer, BufferLength);
+    }
 
     //
-    // Set the length to show as the ReturnedByted in usermode ioctl funtion + size of header
+    // In vmx non-root, we raise the IRQL so no other thread or interrupt
+    // on this core can write to the same ring (and we won't migrate to another core)
     //
-    *ReturnedLength = Header->BufferLength + sizeof(UINT32);
+    KeRaiseIrql(HIGH_LEVEL, &OldIRQL);
 
-    //
-    // Last step is to clear the current buffer (we can't do it once when CurrentIndexToSend is zero because
-    // there might be multiple messages on the start of the queue that didn't read yet)
-    // we don't free the header
-    //
-    RtlZeroMemory(SendingBuffer, Header->BufferLength);
+    CurrentCore = KeGetCurrentProcessorNumber();
 
-    //
-    // Check to see whether we passed the index or not
-    //
-    if (MessageBufferInformation[Index].CurrentIndexToSend > MaximumPacketsCapacity - 2)
+    if (LogActiveSubscriptions != 0 && !LogRouteToSubscribers(CurrentCore, FALSE, OperationCode, Buffer, BufferLength))
     {
-        MessageBufferInformation[Index].CurrentIndexToSend = 0;
+        Result = TRUE;
     }
     else
     {
-        //
-        // Increment the next index to read
-        //
-        MessageBufferInformation[Index].CurrentIndexToSend = MessageBufferInformation[Index].CurrentIndexToSend + 1;
+        Result = LogSendBufferToRing(&MessageBufferInformation[LOG_BUFFER_INDEX(CurrentCore, FALSE)], OperationCode, Buffer, BufferLength);
     }
 
-    //
-    // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-    // if not we use the windows spinlock
-    //
-    if (IsVmxRoot)
-    {
-        SpinlockUnlock(&VmxRootLoggingLock);
-    }
-    else
-    {
-        //
-        // Release the lock
-        //
-        KeReleaseSpinLock(&MessageBufferInformation[Index].BufferLock, OldIRQL);
-    }
+    KeLowerIrql(OldIRQL);
+
+    return Result;
 }
 
 /**
- * @brief Check if new message is available or not
+ * @brief Get the header of the next unread record of a ring
+ * @details It should only be called by the consumer of the ring, the
+ * skipped tail of the ring is consumed by this function
  * 
- * @param IsVmxRoot Check vmx root pool for message or check vmx non root pool
- * @return BOOLEAN return of this function shows whether the read was successfull or not
- * (e.g FALSE shows there's no new buffer available.)
+ * @param Ring The target ring
+ * @param ReadCount [Out] The ReadCount of the record, the record should be
+ * consumed with LogConsumeRingRecord using this value
+ * @return PBUFFER_HEADER Returns the header or NULL if there is nothing to read
  */
-BOOLEAN
-LogCheckForNewMessage(BOOLEAN IsVmxRoot)
+PBUFFER_HEADER
+LogGetRingHeader(PLOG_BUFFER_INFORMATION Ring, UINT64 * ReadCount)
 {
-    KIRQL  OldIRQL;
-    UINT32 Index;
+    BUFFER_HEADER * Header;
+    UINT64          WrittenCount;
+    UINT64          Offset;
+    UINT64          TailLength;
 
-    if (IsVmxRoot)
-    {
-        Index = 1;
-    }
-    else
+    while (TRUE)
     {
-        Index = 0;
+        *ReadCount   = Ring->SharedControl->ReadCount;
+        WrittenCount = Ring->SharedControl->WrittenCount;
+
+        if (*ReadCount >= WrittenCount)
+        {
+            return NULL;
+        }
+
+        //
+        // Make sure that we see the contents that the producer wrote before increasing the counter
+        //
+        KeMemoryBarrier();
+
+        Offset     = *ReadCount & (LogBufferSize - 1);
+        TailLength = LogBufferSize - Offset;
+        Header     = (BUFFER_HEADER *)((UINT64)Ring->BufferStartAddress + Offset);
+
+        if (TailLength < sizeof(BUFFER_HEADER) || Header->OpeationNumber == OPERATION_LOG_PADDING)
+        {
+            //
+            // The producer skipped the tail, the next record is at the start of the buffer
+            //
+            LogConsumeRingRecord(Ring, *ReadCount, TailLength);
+            continue;
+        }
+
+        if (Header->BufferLength > PacketChunkSize || *ReadCount + LOG_RECORD_SIZE(Header->BufferLength) > WrittenCount)
+        {
+            //
+            // Either the producer is overwriting this record (LOG_OVERFLOW_OVERWRITE_OLDEST)
+            // or the counters are not valid (e.g. the user-mode app changed them), in the
+            // second case the records are dropped
+            //
+            LogConsumeRingRecord(Ring, *ReadCount, WrittenCount - *ReadCount);
+            continue;
+        }
+
+        return Header;
     }
+}
 
+/**
+ * @brief Consume a record of a ring
+ * @details The producer might overwrite the oldest records at the same time
+ * (LOG_OVERFLOW_OVERWRITE_OLDEST), so the ReadCount is only changed if it's
+ * not changed by the producer
+ * 
+ * @param Ring The target ring
+ * @param ReadCount The ReadCount of the record
+ * @param Length Length of the record
+ * @return BOOLEAN Returns FALSE if the record is overwritten by the producer
+ */
+BOOLEAN
+LogConsumeRingRecord(PLOG_BUFFER_INFORMATION Ring, UINT64 ReadCount, UINT64 Length)
+{
     //
-    // Compute the current buffer to read
+    // Make sure that we read the contents before the producer is allowed to reuse them
     //
-    BUFFER_HEADER * Header = (BUFFER_HEADER *)((UINT64)MessageBufferInformation[Index].BufferStartAddress + (MessageBufferInformation[Index].CurrentIndexToSend * (PacketChunkSize + sizeof(BUFFER_HEADER))));
+    KeMemoryBarrier();
 
-    if (!Header->Valid)
+    return InterlockedCompareExchange64((volatile LONG64 *)&Ring->SharedControl->ReadCount, ReadCount + Length, ReadCount) == ReadCount;
+}
+
+/**
+ * @brief Find the ring which has the oldest unread buffer
+ * 
+ * @param Rings The rings of the consumer (MessageBufferCount rings)
+ * @return PLOG_BUFFER_INFORMATION Returns the ring or NULL if there is
+ * nothing to read
+ */
+PLOG_BUFFER_INFORMATION
+LogFindOldestRing(PLOG_BUFFER_INFORMATION Rings)
+{
+    PLOG_BUFFER_INFORMATION OldestRing = NULL;
+    UINT64                  OldestTsc  = MAXULONG64;
+    BUFFER_HEADER *         Header;
+    UINT64                  ReadCount;
+
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
     {
+        if (Rings[i].IsMappedToUsermode)
+        {
+            //
+            // The user-mode app reads this ring itself
+            //
+            continue;
+        }
+
         //
-        // there is nothing to send
+        // Get the current buffer to read
         //
-        return FALSE;
+        Header = LogGetRingHeader(&Rings[i], &ReadCount);
+
+        if (Header != NULL && Header->TimeStampCounter <= OldestTsc)
+        {
+            OldestTsc  = Header->TimeStampCounter;
+            OldestRing = &Rings[i];
+        }
     }
 
-    //
-    // If we reached here, means that there is sth to send
-    //
-    return TRUE;
+    return OldestRing;
 }
 
-//
-// Send string messages and tracing for logging and monitoring
-//
+/**
+ * @brief Attempt to read the oldest buffer of all the rings
+ * @details The caller should hold MessageBufferReaderLock
+ * 
+ * @param Rings The rings of the consumer (MessageBufferCount rings)
+ * @param BufferToSaveMessage Target buffer to save the message
+ * @param MaximumLength Size of the target buffer
+ * @param ReturnedLength The actual length of the buffer that this function used it
+ * @param TimeStampCounter [Out] The time stamp counter of the message (optional)
+ * @param BufferIndex [Out] Index of the ring of the message (optional)
+ * @return BOOLEAN return of this function shows whether the read was successfull 
+ * or not (e.g FALSE shows there's no new buffer available or it doesn't fit.)
+ */
 BOOLEAN
-LogSendMessageToQueue(UINT32 OperationCode, BOOLEAN IsImmediateMessage, BOOLEAN ShowCurrentSystemTime, const char * Fmt, ...)
+LogReadBufferWithoutLock(PLOG_BUFFER_INFORMATION Rings, PVOID BufferToSaveMessage, UINT32 MaximumLength, UINT32 * ReturnedLength, UINT64 * TimeStampCounter, UINT32 * BufferIndex)
 {
-    BOOLEAN Result;
-    va_list ArgList;
-    size_t  WrittenSize;
-    UINT32  Index;
-    KIRQL   OldIRQL;
-    BOOLEAN IsVmxRootMode;
-    int     SprintfResult;
-    char    LogMessage[PacketChunkSize];
-    char    TempMessage[PacketChunkSize];
-    char    TimeBuffer[20] = {0};
+    PLOG_BUFFER_INFORMATION Ring;
+    BUFFER_HEADER *         Header;
+    UINT64                  ReadCount;
+    UINT32                  OperationCode;
+    UINT32                  BufferLength;
 
-    //
-    // Set Vmx State
-    //
-    IsVmxRootMode = g_GuestState[KeGetCurrentProcessorNumber()].IsOnVmxRootMode;
-
-    if (ShowCurrentSystemTime)
+    while (TRUE)
     {
-        //
-        // It's actually not necessary to use -1 but because user-mode code might assume a null-terminated buffer so
-        // it's better to use - 1
-        //
-        va_start(ArgList, Fmt);
-        //
-        // We won't use this because we can't use in any IRQL
-        // Status = RtlStringCchVPrintfA(TempMessage, PacketChunkSize - 1, Fmt, ArgList);
-        //
-        SprintfResult = vsprintf_s(TempMessage, PacketChunkSize - 1, Fmt, ArgList);
-        va_end(ArgList);
+        Ring = LogFindOldestRing(Rings);
+
+        if (Ring == NULL)
+        {
+            //
+            // there is nothing to send
+            //
+            return FALSE;
+        }
 
         //
-        // Check if the buffer passed the limit
+        // Get the current buffer to read
         //
-        if (SprintfResult == -1)
+        Header = LogGetRingHeader(Ring, &ReadCount);
+
+        if (Header == NULL)
         {
             //
-            // Probably the buffer is large that we can't store it
+            // The producer overwrote the records of this ring, find the oldest ring again
+            //
+            continue;
+        }
+
+        OperationCode = Header->OpeationNumber;
+        BufferLength  = Header->BufferLength;
+
+        if (TimeStampCounter != NULL)
+        {
+            *TimeStampCounter = Header->TimeStampCounter;
+        }
+
+        if (BufferIndex != NULL)
+        {
+            *BufferIndex = (UINT32)(Ring - Rings);
+        }
+
+        if (BufferLength + sizeof(UINT32) > MaximumLength)
+        {
+            //
+            // The target buffer doesn't have enough space for this message
             //
             return FALSE;
         }
 
         //
-        // Fill the above with timer
+        // If we reached here, means that there is sth to send
+        //
+
+        //
+        // First copy the header
         //
-        TIME_FIELDS   TimeFields;
-        LARGE_INTEGER SystemTime, LocalTime;
-        KeQuerySystemTime(&SystemTime);
-        ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
-        RtlTimeToTimeFields(&LocalTime, &TimeFields);
+        RtlCopyBytes(BufferToSaveMessage, &OperationCode, sizeof(UINT32));
+
         //
-        // We won't use this because we can't use in any IRQL
-        // Status = RtlStringCchPrintfA(TimeBuffer, RTL_NUMBER_OF(TimeBuffer),
-        //	"%02hd:%02hd:%02hd.%03hd", TimeFields.Hour,
-        //	TimeFields.Minute, TimeFields.Second,
-        //	TimeFields.Milliseconds);
+        // Second, save the buffer contents
         //
+        RtlCopyBytes((UINT64)BufferToSaveMessage + sizeof(UINT32), (UINT64)Header + sizeof(BUFFER_HEADER), BufferLength);
+
+        //
+        // Finally, consume the record, after this point the producer is allowed to
+        // reuse its memory, if the producer overwrote the record while we're copying
+        // it then we read the next record instead
         //
-        // Append time with previous message
+        if (LogConsumeRingRecord(Ring, ReadCount, LOG_RECORD_SIZE(BufferLength)))
+        {
+            break;
+        }
+    }
+
+#if ShowMessagesOnDebugger
+
+    //
+    // Means that show just messages
+    //
+    if (OperationCode <= OPERATION_LOG_NON_IMMEDIATE_MESSAGE)
+    {
         //
-        // Status = RtlStringCchPrintfA(LogMessage, PacketChunkSize - 1, "(%s)\t %s", TimeBuffer, TempMessage);
+        // We're in Dpc level here so it's safe to use DbgPrint
+        // DbgPrint limitation is 512 Byte, the records are not null-terminated
+        // so the length is given to DbgPrint
         //
+        for (UINT32 i = 0; i < BufferLength; i += DbgPrintLimitation - 1)
+        {
+            DbgPrint("%.*s", min(DbgPrintLimitation - 1, BufferLength - i), (char *)((UINT64)BufferToSaveMessage + sizeof(UINT32) + i));
+        }
+    }
+#endif
+
+    //
+    // Set the length to show as the ReturnedByted in usermode ioctl funtion + size of header
+    //
+    *ReturnedLength = BufferLength + sizeof(UINT32);
+
+    return TRUE;
+}
+
+/**
+ * @brief Attempt to read the buffer 
+ * @details It merges the rings of all the cores and reads the oldest message
+ * 
+ * @param BufferToSaveMessage Target buffer to save the message
+ * @param ReturnedLength The actual length of the buffer that this function used it
+ * @return BOOLEAN return of this function shows whether the read was successfull 
+ * or not (e.g FALSE shows there's no new buffer available.)
+ */
+BOOLEAN
+LogReadBuffer(PVOID BufferToSaveMessage, UINT32 * ReturnedLength)
+{
+    KIRQL   OldIRQL;
+    BOOLEAN Result;
+
+    //
+    // The consumers are never in vmx-root so we can use the windows spinlock
+    //
+    KeAcquireSpinLock(&MessageBufferReaderLock, &OldIRQL);
+
+    Result = LogReadBufferWithoutLock(MessageBufferInformation, BufferToSaveMessage, UsermodeBufferSize, ReturnedLength, NULL, NULL);
+
+    KeReleaseSpinLock(&MessageBufferReaderLock, OldIRQL);
+
+    return Result;
+}
+
+/**
+ * @brief Attempt to read as many buffers as fit in the target buffer
+ * @details The result is a list of LOG_BATCH_PACKET_HEADER and the body
+ * of each packet
+ * 
+ * @param SubscriberId The consumer (LOG_SUBSCRIBER_DEFAULT or a subscriber)
+ * @param BufferToSaveMessages Target buffer to save the messages
+ * @param BufferLength Size of the target buffer
+ * @param ReturnedLength The actual length of the buffer that this function used it
+ * @return BOOLEAN return of this function shows whether at least one message is read
+ */
+BOOLEAN
+LogReadBufferBatch(UINT32 SubscriberId, PVOID BufferToSaveMessages, UINT32 BufferLength, UINT32 * ReturnedLength)
+{
+    KIRQL                    OldIRQL;
+    UINT32                   Offset = 0;
+    UINT32                   Length;
+    PLOG_BATCH_PACKET_HEADER PacketHeader;
+    PLOG_BUFFER_INFORMATION  Rings;
+
+    KeAcquireSpinLock(&MessageBufferReaderLock, &OldIRQL);
+
+    //
+    // The rings of a subscriber are not freed while we hold the lock
+    //
+    Rings = LogGetSubscriberRings(SubscriberId);
+
+    while (Rings != NULL && Offset + sizeof(LOG_BATCH_PACKET_HEADER) < BufferLength)
+    {
+        PacketHeader = (PLOG_BATCH_PACKET_HEADER)((UINT64)BufferToSaveMessages + Offset);
 
         //
-        // this function probably run without error, so there is no need to check the return value
+        // The operation code is the last field of the header, so we read the
+        // operation code and the body right there
         //
-        sprintf_s(TimeBuffer, RTL_NUMBER_OF(TimeBuffer), "%02hd:%02hd:%02hd.%03hd", TimeFields.Hour, TimeFields.Minute, TimeFields.Second, TimeFields.Milliseconds);
+        if (!LogReadBufferWithoutLock(Rings,
+                                      &PacketHeader->OperationCode,
+                                      BufferLength - Offset - FIELD_OFFSET(LOG_BATCH_PACKET_HEADER, OperationCode),
+                                      &Length,
+                                      &PacketHeader->TimeStampCounter,
+                                      &PacketHeader->BufferIndex))
+        {
+            break;
+        }
+
+        PacketHeader->Length   = Length - sizeof(UINT32);
+        PacketHeader->Reserved = 0;
+        Offset += FIELD_OFFSET(LOG_BATCH_PACKET_HEADER, OperationCode) + Length;
+    }
+
+    KeReleaseSpinLock(&MessageBufferReaderLock, OldIRQL);
+
+    *ReturnedLength = Offset;
+
+    return Offset != 0;
+}
+
+/**
+ * @brief Check if new message is available or not
+ * 
+ * @param SubscriberId The consumer (LOG_SUBSCRIBER_DEFAULT or a subscriber)
+ * @return BOOLEAN return of this function shows whether the read was successfull or not
+ * (e.g FALSE shows there's no new buffer available.)
+ */
+BOOLEAN
+LogCheckForNewMessage(UINT32 SubscriberId)
+{
+    KIRQL                   OldIRQL;
+    PLOG_BUFFER_INFORMATION Rings;
+    BOOLEAN                 Result = FALSE;
+
+    KeAcquireSpinLock(&MessageBufferReaderLock, &OldIRQL);
+
+    Rings = LogGetSubscriberRings(SubscriberId);
+
+    //
+    // If we find a ring with unread message, means that there is sth to send
+    //
+    if (Rings != NULL)
+    {
+        Result = LogFindOldestRing(Rings) != NULL;
+    }
+
+    KeReleaseSpinLock(&MessageBufferReaderLock, OldIRQL);
+
+    return Result;
+}
+
+/**
+ * @brief Get the statistics of the rings
+ * @details The counters are changed by the producers at the same time, so
+ * they're not exactly from the same moment
+ * 
+ * @param Statistics [Out] The statistics of the rings
+ * @return VOID 
+ */
+VOID
+LogQueryBuffersStatistics(PLOG_BUFFERS_STATISTICS Statistics)
+{
+    PLOG_BUFFER_INFORMATION Ring;
+
+    Statistics->BufferCount = min(MessageBufferCount, LOG_MAXIMUM_SHARED_BUFFERS);
+    Statistics->Policy      = MessageBufferOverflowPolicy;
 
+    for (UINT32 i = 0; i < Statistics->BufferCount; i++)
+    {
+        Ring = &MessageBufferInformation[i];
+
+        Statistics->Rings[i].WrittenRecords     = Ring->WrittenRecords;
+        Statistics->Rings[i].DroppedRecords     = Ring->DroppedRecords;
+        Statistics->Rings[i].OverwrittenRecords = Ring->OverwrittenRecords;
+        Statistics->Rings[i].UnreadBytes        = Ring->SharedControl->WrittenCount - Ring->SharedControl->ReadCount;
+    }
+}
+
+/**
+ * @brief Change the policy of the rings when they are full
+ * 
+ * @param Policy The new policy
+ * @return NTSTATUS 
+ */
+NTSTATUS
+LogSetOverflowPolicy(LOG_BUFFER_OVERFLOW_POLICY Policy)
+{
+    if (Policy != LOG_OVERFLOW_DROP_NEWEST && Policy != LOG_OVERFLOW_OVERWRITE_OLDEST && Policy != LOG_OVERFLOW_SUMMARIZE)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // The producers read the policy for each record, so there is no need to synchronize
+    //
+    MessageBufferOverflowPolicy = Policy;
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Get the tag of the event of a record
+ * 
+ * @param OperationCode The operation code of the record
+ * @param Buffer Body of the record
+ * @param BufferLength Length of the body
+ * @return UINT64 Returns the tag or zero if the record has no tag
+ */
+UINT64
+LogGetRecordTag(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
+{
+    UINT64 Tag = 0;
+    char   Digit;
+
+    switch (OperationCode)
+    {
+    case OPERATION_LOG_WITH_TAG:
         //
-        // Append time with previous message
+        // The text starts with the hex of the tag (see LogWithTag)
         //
-        SprintfResult = sprintf_s(LogMessage, PacketChunkSize - 1, "(%s - core : %d - vmx-root? %s)\t %s", TimeBuffer, KeGetCurrentProcessorNumberEx(0), IsVmxRootMode ? "yes" : "no", TempMessage);
+        for (UINT32 i = 0; i < 16 && i < BufferLength; i++)
+        {
+            Digit = ((char *)Buffer)[i];
+
+            if (Digit >= '0' && Digit <= '9')
+            {
+                Tag = (Tag << 4) | (Digit - '0');
+            }
+            else if (Digit >= 'a' && Digit <= 'f')
+            {
+                Tag = (Tag << 4) | (Digit - 'a' + 10);
+            }
+            else
+            {
+                break;
+            }
+        }
+        return Tag;
+    case OPERATION_LOG_STATES:
+        return BufferLength >= sizeof(DEBUGGER_LOG_STATES_RECORD) ? ((PDEBUGGER_LOG_STATES_RECORD)Buffer)->Tag : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Check whether a record matches the filter of a subscription
+ * 
+ * @param Filter The filter
+ * @param CoreIndex The core that the record is written on
+ * @param OperationCode The operation code of the record (the log level of
+ * the binary messages)
+ * @param Tag The tag of the record (see LogGetRecordTag)
+ * @return BOOLEAN 
+ */
+BOOLEAN
+LogMatchSubscriptionFilter(PLOG_SUBSCRIPTION_FILTER Filter, ULONG CoreIndex, UINT32 OperationCode, UINT64 Tag)
+{
+    if (Filter->OperationCodes != 0 && !(Filter->OperationCodes & (1ULL << min(OperationCode, LOG_SUBSCRIPTION_OTHER_OPERATIONS))))
+    {
+        return FALSE;
+    }
+
+    if (Filter->CoreMask != 0 && (CoreIndex >= 64 || !(Filter->CoreMask & (1ULL << CoreIndex))))
+    {
+        return FALSE;
+    }
+
+    if (Filter->CountOfTags == 0)
+    {
+        return TRUE;
+    }
+
+    for (UINT32 i = 0; i < Filter->CountOfTags; i++)
+    {
+        if (Filter->Tags[i] == Tag)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * @brief Write a record to the rings of the interested subscribers
+ * @details The caller should be the producer of the rings of the core in
+ * this mode (the same as LogSendBufferToRing), the subscribers get the
+ * records in their own rings of the same core and mode
+ * 
+ * @param CoreIndex The current core
+ * @param IsVmxRoot Whether we're in vmx-root
+ * @param OperationCode The operation code of the record
+ * @param Buffer Body of the record
+ * @param BufferLength Length of the body
+ * @return BOOLEAN Returns whether the record should be written to the
+ * default rings too
+ */
+BOOLEAN
+LogRouteToSubscribers(ULONG CoreIndex, BOOLEAN IsVmxRoot, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength)
+{
+    PLOG_SUBSCRIBER Subscriber;
+    UINT64          Tag;
+    UINT32          RingIndex           = LOG_BUFFER_INDEX(CoreIndex, IsVmxRoot);
+    UINT32          FilterOperationCode = OperationCode;
+    BOOLEAN         IsForDefaultRings   = TRUE;
+    BOOLEAN         IsForAll            = FALSE;
+
+    if (OperationCode == OPERATION_LOG_TIME_CALIBRATION || OperationCode == OPERATION_LOG_BINARY_FORMAT_DEFINITION)
+    {
+        //
+        // Every consumer needs these records to decode the other records
+        //
+        IsForAll = TRUE;
+    }
+    else if (OperationCode == OPERATION_LOG_BINARY_MESSAGE && BufferLength >= FIELD_OFFSET(LOG_BINARY_MESSAGE, Arguments))
+    {
+        //
+        // The binary messages are filtered as the messages of their log level
+        //
+        FilterOperationCode = ((PLOG_BINARY_MESSAGE)Buffer)->OperationCode;
+    }
+
+    Tag = IsForAll ? 0 : LogGetRecordTag(OperationCode, Buffer, BufferLength);
+
+    for (UINT32 i = 0; i < LOG_MAXIMUM_SUBSCRIBERS; i++)
+    {
+        Subscriber = &LogSubscribers[i];
+
+        if (!Subscriber->IsActive || (!IsForAll && !LogMatchSubscriptionFilter(&Subscriber->Filter, CoreIndex, FilterOperationCode, Tag)))
+        {
+            continue;
+        }
+
+        LogSendBufferToRing(&Subscriber->Rings[RingIndex], OperationCode, Buffer, BufferLength);
+
+        if (Subscriber->Filter.Flags & LOG_SUBSCRIPTION_EXCLUSIVE)
+        {
+            IsForDefaultRings = FALSE;
+        }
+    }
+
+    if (IsForAll)
+    {
+        return TRUE;
+    }
+
+    if (LogDefaultRingsFiltered && !LogMatchSubscriptionFilter(&LogDefaultRingsFilter, CoreIndex, FilterOperationCode, Tag))
+    {
+        IsForDefaultRings = FALSE;
+    }
+
+    return IsForDefaultRings;
+}
+
+/**
+ * @brief Get the rings of a consumer
+ * @details The caller should hold MessageBufferReaderLock
+ * 
+ * @param SubscriberId LOG_SUBSCRIBER_DEFAULT or a subscriber
+ * @return PLOG_BUFFER_INFORMATION Returns the rings or NULL if there is
+ * no such subscriber
+ */
+PLOG_BUFFER_INFORMATION
+LogGetSubscriberRings(UINT32 SubscriberId)
+{
+    if (SubscriberId == LOG_SUBSCRIBER_DEFAULT)
+    {
+        return MessageBufferInformation;
+    }
+
+    if (SubscriberId > LOG_MAXIMUM_SUBSCRIBERS)
+    {
+        return NULL;
+    }
+
+    return LogSubscribers[SubscriberId - 1].Rings;
+}
+
+/**
+ * @brief Free the rings of a subscriber
+ * 
+ * @param Rings The rings (MessageBufferCount rings)
+ * @return VOID 
+ */
+static VOID
+LogFreeSubscriberRings(PLOG_BUFFER_INFORMATION Rings)
+{
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
+    {
+        if (Rings[i].BufferStartAddress)
+        {
+            ExFreePoolWithTag(Rings[i].BufferStartAddress, POOLTAG);
+        }
+    }
+
+    ExFreePoolWithTag(Rings, POOLTAG);
+}
+
+/**
+ * @brief Allocate the rings of a new subscriber
+ * @details The non-immediate messages are not accumulated in these rings,
+ * so they don't have the buffer of the non-immediate messages
+ * 
+ * @return PLOG_BUFFER_INFORMATION Returns the rings or NULL if there is
+ * not enough memory
+ */
+static PLOG_BUFFER_INFORMATION
+LogAllocateSubscriberRings()
+{
+    PLOG_BUFFER_INFORMATION Rings;
+
+    Rings = ExAllocatePoolWithTag(NonPagedPool, sizeof(LOG_BUFFER_INFORMATION) * MessageBufferCount, POOLTAG);
+
+    if (!Rings)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(Rings, sizeof(LOG_BUFFER_INFORMATION) * MessageBufferCount);
+
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
+    {
+        Rings[i].BufferStartAddress = ExAllocatePoolWithTag(NonPagedPool, LogBufferSize, POOLTAG);
+
+        if (!Rings[i].BufferStartAddress)
+        {
+            LogFreeSubscriberRings(Rings);
+            return NULL;
+        }
+
+        RtlZeroMemory(Rings[i].BufferStartAddress, LogBufferSize);
+
+        Rings[i].BufferEndAddress = (UINT64)Rings[i].BufferStartAddress + LogBufferSize;
+        Rings[i].SharedControl    = &Rings[i].Control;
+    }
+
+    return Rings;
+}
+
+/**
+ * @brief Wait for the producers of all the cores
+ * @details The producers run in vmx-root or at HIGH_LEVEL, so none of
+ * them is running on this core while we're in a DPC, after the broadcast
+ * no producer sees the previous state of the subscriptions
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogDpcBroadcastQuiesceProducers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief Add, change or remove a subscription (IOCTL_LOG_SUBSCRIBE)
+ * @details The routing of a subscriber is stopped before its filter is
+ * changed, the unread records of its rings are kept, should be called
+ * in PASSIVE_LEVEL
+ * 
+ * @param Request The request, SubscriberId is the ID of the new subscriber
+ * in the result
+ * @return NTSTATUS 
+ */
+NTSTATUS
+LogSubscribe(PLOG_SUBSCRIPTION_REQUEST Request)
+{
+    PLOG_SUBSCRIBER          Subscriber   = NULL;
+    PLOG_SUBSCRIPTION_FILTER Filter       = &LogDefaultRingsFilter;
+    PLOG_BUFFER_INFORMATION  Rings        = NULL;
+    PLOG_BUFFER_INFORMATION  RemovedRings = NULL;
+    UINT32                   SubscriberId = Request->SubscriberId;
+    BOOLEAN                  IsRemove     = (Request->Flags & LOG_SUBSCRIPTION_REMOVE) != 0;
+    BOOLEAN                  WasRouted    = FALSE;
+    KIRQL                    OldIRQL;
+
+    if (Request->CountOfTags > LOG_SUBSCRIPTION_MAXIMUM_TAGS ||
+        (Request->Flags & ~(LOG_SUBSCRIPTION_EXCLUSIVE | LOG_SUBSCRIPTION_REMOVE)) ||
+        (SubscriberId == LOG_SUBSCRIBER_NEW && IsRemove) ||
+        (SubscriberId == LOG_SUBSCRIBER_DEFAULT && (Request->Flags & LOG_SUBSCRIPTION_EXCLUSIVE)) ||
+        (SubscriberId != LOG_SUBSCRIBER_NEW && SubscriberId > LOG_MAXIMUM_SUBSCRIBERS))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireGuardedMutex(&LogSubscriptionsMutex);
+
+    if (SubscriberId == LOG_SUBSCRIBER_NEW)
+    {
+        for (UINT32 i = 0; i < LOG_MAXIMUM_SUBSCRIBERS; i++)
+        {
+            if (LogSubscribers[i].Rings == NULL)
+            {
+                Subscriber   = &LogSubscribers[i];
+                SubscriberId = i + 1;
+                break;
+            }
+        }
+
+        if (Subscriber == NULL)
+        {
+            KeReleaseGuardedMutex(&LogSubscriptionsMutex);
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        Rings = LogAllocateSubscriberRings();
+
+        if (Rings == NULL)
+        {
+            KeReleaseGuardedMutex(&LogSubscriptionsMutex);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    else if (SubscriberId != LOG_SUBSCRIBER_DEFAULT)
+    {
+        Subscriber = &LogSubscribers[SubscriberId - 1];
+
+        if (Subscriber->Rings == NULL)
+        {
+            KeReleaseGuardedMutex(&LogSubscriptionsMutex);
+            return STATUS_NOT_FOUND;
+        }
+
+        WasRouted            = Subscriber->IsActive;
+        Subscriber->IsActive = FALSE;
+    }
+    else
+    {
+        WasRouted               = LogDefaultRingsFiltered;
+        LogDefaultRingsFiltered = FALSE;
+    }
+
+    if (WasRouted)
+    {
+        //
+        // Make sure that no producer is using the previous filter (or the rings)
+        //
+        InterlockedDecrement(&LogActiveSubscriptions);
+        KeGenericCallDpc(LogDpcBroadcastQuiesceProducers, NULL);
+    }
+
+    if (Subscriber != NULL)
+    {
+        Filter = &Subscriber->Filter;
+    }
+
+    if (IsRemove)
+    {
+        if (Subscriber != NULL)
+        {
+            //
+            // The readers might be reading the rings
+            //
+            KeAcquireSpinLock(&MessageBufferReaderLock, &OldIRQL);
+
+            RemovedRings      = Subscriber->Rings;
+            Subscriber->Rings = NULL;
+
+            KeReleaseSpinLock(&MessageBufferReaderLock, OldIRQL);
+        }
+
+        RtlZeroMemory(Filter, sizeof(LOG_SUBSCRIPTION_FILTER));
+    }
+    else
+    {
+        Filter->Flags          = Request->Flags & LOG_SUBSCRIPTION_EXCLUSIVE;
+        Filter->OperationCodes = Request->OperationCodes;
+        Filter->CoreMask       = Request->CoreMask;
+        Filter->CountOfTags    = Request->CountOfTags;
+
+        RtlCopyMemory(Filter->Tags, Request->Tags, Request->CountOfTags * sizeof(UINT64));
+
+        if (Rings != NULL)
+        {
+            KeAcquireSpinLock(&MessageBufferReaderLock, &OldIRQL);
+            Subscriber->Rings = Rings;
+            KeReleaseSpinLock(&MessageBufferReaderLock, OldIRQL);
+        }
+
+        //
+        // The filter should be visible to the producers before they start routing
+        //
+        KeMemoryBarrier();
+
+        if (Subscriber != NULL)
+        {
+            Subscriber->IsActive = TRUE;
+        }
+        else
+        {
+            LogDefaultRingsFiltered = TRUE;
+        }
+
+        InterlockedIncrement(&LogActiveSubscriptions);
+
+        //
+        // A new subscriber has not received the previous format definitions
+        //
+        if (Subscriber != NULL)
+        {
+            LogInvalidateBinaryFormats();
+        }
+    }
+
+    KeReleaseGuardedMutex(&LogSubscriptionsMutex);
+
+    if (RemovedRings != NULL)
+    {
+        LogFreeSubscriberRings(RemovedRings);
+
+        //
+        // The pending IRPs of the removed subscriber are completed
+        //
+        KeInsertQueueDpc(&MessageBufferNotifyDpc, NULL, NULL);
+    }
+
+    Request->SubscriberId = SubscriberId;
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Remove all the subscribers and the filter of the default rings
+ * @details It's called when the handle is closed (IRP_MJ_CLEANUP)
+ * 
+ * @return VOID 
+ */
+VOID
+LogRemoveAllSubscriptions()
+{
+    LOG_SUBSCRIPTION_REQUEST Request;
+
+    for (UINT32 i = 0; i <= LOG_MAXIMUM_SUBSCRIBERS; i++)
+    {
+        if (i != LOG_SUBSCRIBER_DEFAULT && LogSubscribers[i - 1].Rings == NULL)
+        {
+            continue;
+        }
+
+        RtlZeroMemory(&Request, sizeof(LOG_SUBSCRIPTION_REQUEST));
+
+        Request.SubscriberId = i;
+        Request.Flags        = LOG_SUBSCRIPTION_REMOVE;
+
+        LogSubscribe(&Request);
+    }
+}
+
+/**
+ * @brief Change the consumer of a ring between the notify DPC and the user-mode app
+ * @details The caller should make sure that no producer or consumer is using the ring
+ * 
+ * @param Ring The target ring
+ * @param SharedControl The shared counters of the ring
+ * @param IsMapped Whether the user-mode app should consume the ring
+ * @return VOID 
+ */
+VOID
+LogChangeRingUsermodeMapping(PLOG_BUFFER_INFORMATION Ring, PLOG_SHARED_RING_CONTROL SharedControl, BOOLEAN IsMapped)
+{
+    UINT64 ReadCount;
+    UINT64 WrittenCount;
+
+    if (IsMapped)
+    {
+        //
+        // Keep the unread messages for the user-mode app
+        //
+        SharedControl->ReadCount    = Ring->Control.ReadCount;
+        SharedControl->WrittenCount = Ring->Control.WrittenCount;
+
+        Ring->SharedControl      = SharedControl;
+        Ring->IsMappedToUsermode = TRUE;
+    }
+    else if (Ring->IsMappedToUsermode)
+    {
+        ReadCount    = Ring->SharedControl->ReadCount;
+        WrittenCount = Ring->SharedControl->WrittenCount;
+
+        if (ReadCount > WrittenCount || WrittenCount - ReadCount > LogBufferSize)
+        {
+            //
+            // The user-mode app changed the counter to an invalid value, we can't
+            // find the start of the records so the unread messages are dropped
+            //
+            ReadCount = WrittenCount;
+        }
+
+        Ring->Control.ReadCount    = ReadCount;
+        Ring->Control.WrittenCount = WrittenCount;
+
+        Ring->IsMappedToUsermode = FALSE;
+        Ring->SharedControl      = &Ring->Control;
+    }
+}
+
+/**
+ * @brief Change the consumer of the rings of the current core 
+ * @details As we're in a DPC on the owner core, none of the producers of
+ * these rings is running
+ * 
+ * @param Dpc 
+ * @param DeferredContext TRUE if the rings should be mapped to user-mode
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogDpcBroadcastChangeUsermodeMapping(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    ULONG   CurrentCore = KeGetCurrentProcessorNumber();
+    BOOLEAN IsMapped    = (BOOLEAN)DeferredContext;
+    UINT32  Index;
+
+    //
+    // The notify DPC might be reading the rings on other cores
+    //
+    KeAcquireSpinLockAtDpcLevel(&MessageBufferReaderLock);
+
+    for (UINT32 i = 0; i < 2; i++)
+    {
+        Index = LOG_BUFFER_INDEX(CurrentCore, i);
+        LogChangeRingUsermodeMapping(&MessageBufferInformation[Index], &MessageBufferSharedControl[Index], IsMapped);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&MessageBufferReaderLock);
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief Signal the user-mode event of the mapped rings
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogSharedEventCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (MessageBufferSharedEvent != NULL)
+    {
+        KeSetEvent(MessageBufferSharedEvent, 0, FALSE);
+    }
+}
+
+/**
+ * @brief Map the log rings to the current process (read-only)
+ * @details After this function the user-mode app reads the messages in place
+ * and the notify DPC no longer reads the rings
+ * 
+ * @param Request The user-mode request
+ * @param MappedBuffers [Out] The user-mode addresses of the rings
+ * @param RequestorMode Mode of the requestor (for referencing the event)
+ * @return NTSTATUS 
+ */
+NTSTATUS
+LogMapBuffersToUsermode(PLOG_MAP_BUFFERS_REQUEST Request, PLOG_MAPPED_BUFFERS_INFORMATION MappedBuffers, KPROCESSOR_MODE RequestorMode)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    SIZE_T   SharedControlSize;
+
+    if (MessageBufferSharedControl != NULL)
+    {
+        LogError("Log buffers are already mapped to user-mode");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (MessageBufferCount > LOG_MAXIMUM_SHARED_BUFFERS)
+    {
+        LogError("Too many log buffers to be mapped to user-mode");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // Allocate the shared counters (it's mapped to user-mode so it should be page aligned)
+    //
+    SharedControlSize          = ROUND_TO_PAGES(sizeof(LOG_SHARED_RING_CONTROL) * MessageBufferCount);
+    MessageBufferSharedControl = ExAllocatePoolWithTag(NonPagedPool, SharedControlSize, POOLTAG);
+
+    if (!MessageBufferSharedControl)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(MessageBufferSharedControl, SharedControlSize);
+
+    //
+    // Get the object pointer from the handle
+    // Note we must be in the context of the process that created the handle
+    //
+    Status = ObReferenceObjectByHandle((HANDLE)Request->hEvent,
+                                       SYNCHRONIZE | EVENT_MODIFY_STATE,
+                                       *ExEventObjectType,
+                                       RequestorMode,
+                                       &MessageBufferSharedEvent,
+                                       NULL);
+
+    if (!NT_SUCCESS(Status))
+    {
+        LogError("Unable to reference User-Mode Event object, Error = 0x%x", Status);
+        MessageBufferSharedEvent = NULL;
+        LogUnmapBuffersFromUsermode();
+        return Status;
+    }
+
+    KeInitializeDpc(&MessageBufferSharedEventDpc, LogSharedEventCallback, NULL);
+
+    MessageBufferSharedFillThreshold = Request->FillThreshold;
+
+    if (MessageBufferSharedFillThreshold == 0 || MessageBufferSharedFillThreshold > LogBufferSize)
+    {
+        MessageBufferSharedFillThreshold = 1;
+    }
+
+    //
+    // Map the counters (writable) and the rings (read-only) to the current process
+    //
+    __try
+    {
+        MessageBufferSharedControlMdl = IoAllocateMdl(MessageBufferSharedControl, SharedControlSize, FALSE, FALSE, NULL);
+
+        if (!MessageBufferSharedControlMdl)
+        {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            __leave;
+        }
+
+        MmBuildMdlForNonPagedPool(MessageBufferSharedControlMdl);
+        MessageBufferSharedControlUsermodeAddress = MmMapLockedPagesSpecifyCache(MessageBufferSharedControlMdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+
+        for (UINT32 i = 0; i < MessageBufferCount; i++)
+        {
+            MessageBufferInformation[i].UsermodeMdl = IoAllocateMdl(MessageBufferInformation[i].BufferStartAddress, LogBufferSize, FALSE, FALSE, NULL);
+
+            if (!MessageBufferInformation[i].UsermodeMdl)
+            {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                __leave;
+            }
+
+            MmBuildMdlForNonPagedPool(MessageBufferInformation[i].UsermodeMdl);
+            MessageBufferInformation[i].UsermodeAddress = MmMapLockedPagesSpecifyCache(MessageBufferInformation[i].UsermodeMdl,
+                                                                                       UserMode,
+                                                                                       MmCached,
+                                                                                       NULL,
+                                                                                       FALSE,
+                                                                                       NormalPagePriority | MdlMappingNoWrite);
+
+            MappedBuffers->BufferAddresses[i] = (UINT64)MessageBufferInformation[i].UsermodeAddress;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        LogError("Unable to map log buffers to user-mode, Error = 0x%x", Status);
+        LogUnmapBuffersFromUsermode();
+        return Status;
+    }
+
+    MappedBuffers->BufferCount          = MessageBufferCount;
+    MappedBuffers->BufferSize           = LogBufferSize;
+    MappedBuffers->SharedControlAddress = (UINT64)MessageBufferSharedControlUsermodeAddress;
+
+    //
+    // Change the consumer of the rings on all the cores
+    //
+    KeGenericCallDpc(LogDpcBroadcastChangeUsermodeMapping, (PVOID)TRUE);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Unmap the log rings from user-mode
+ * @details It should be called in the context of the process that the rings
+ * are mapped to it, the unread messages are read by the notify DPC after that
+ * 
+ * @return VOID 
+ */
+VOID
+LogUnmapBuffersFromUsermode()
+{
+    if (MessageBufferSharedControl == NULL)
+    {
+        //
+        // Not mapped
+        //
+        return;
+    }
+
+    //
+    // Change the consumer of the rings back to the notify DPC
+    //
+    KeGenericCallDpc(LogDpcBroadcastChangeUsermodeMapping, (PVOID)FALSE);
+
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
+    {
+        if (MessageBufferInformation[i].UsermodeAddress)
+        {
+            MmUnmapLockedPages(MessageBufferInformation[i].UsermodeAddress, MessageBufferInformation[i].UsermodeMdl);
+            MessageBufferInformation[i].UsermodeAddress = NULL;
+        }
+        if (MessageBufferInformation[i].UsermodeMdl)
+        {
+            IoFreeMdl(MessageBufferInformation[i].UsermodeMdl);
+            MessageBufferInformation[i].UsermodeMdl = NULL;
+        }
+    }
+
+    if (MessageBufferSharedControlUsermodeAddress)
+    {
+        MmUnmapLockedPages(MessageBufferSharedControlUsermodeAddress, MessageBufferSharedControlMdl);
+        MessageBufferSharedControlUsermodeAddress = NULL;
+    }
+    if (MessageBufferSharedControlMdl)
+    {
+        IoFreeMdl(MessageBufferSharedControlMdl);
+        MessageBufferSharedControlMdl = NULL;
+    }
+
+    //
+    // No one queues the event DPC anymore, wait for the queued ones
+    //
+    KeFlushQueuedDpcs();
+
+    if (MessageBufferSharedEvent)
+    {
+        ObDereferenceObject(MessageBufferSharedEvent);
+        MessageBufferSharedEvent = NULL;
+    }
+
+    ExFreePoolWithTag(MessageBufferSharedControl, POOLTAG);
+    MessageBufferSharedControl = NULL;
+}
+
+//
+// Send string messages and tracing for logging and monitoring
+//
+BOOLEAN
+LogSendMessageToQueue(UINT32 OperationCode, BOOLEAN IsImmediateMessage, BOOLEAN ShowCurrentSystemTime, const char * Fmt, ...)
+{
+    BOOLEAN                 Result;
+    va_list                 ArgList;
+    size_t                  WrittenSize;
+    PLOG_BUFFER_INFORMATION Ring;
+    KIRQL                   OldIRQL;
+    BOOLEAN                 IsVmxRootMode;
+    int                     SprintfResult;
+    char                    LogMessage[PacketChunkSize];
+    char                    TempMessage[PacketChunkSize];
+
+    //
+    // Set Vmx State
+    //
+    IsVmxRootMode = g_GuestState[KeGetCurrentProcessorNumber()].IsOnVmxRootMode;
+
+    if (ShowCurrentSystemTime)
+    {
+        //
+        // It's actually not necessary to use -1 but because user-mode code might assume a null-terminated buffer so
+        // it's better to use - 1
+        //
+        va_start(ArgList, Fmt);
+        //
+        // We won't use this because we can't use in any IRQL
+        // Status = RtlStringCchVPrintfA(TempMessage, PacketChunkSize - 1, Fmt, ArgList);
+        //
+        SprintfResult = vsprintf_s(TempMessage, PacketChunkSize - 1, Fmt, ArgList);
+        va_end(ArgList);
+
+        //
+        // Check if the buffer passed the limit
+        //
+        if (SprintfResult == -1)
+        {
+            //
+            // Probably the buffer is large that we can't store it
+            //
+            return FALSE;
+        }
+
+        //
+        // Append the time stamp counter with previous message, formatting the time is
+        // deferred to user-mode (based on OPERATION_LOG_TIME_CALIBRATION) as querying
+        // and formatting the system time is too expensive here
+        //
+        SprintfResult = sprintf_s(LogMessage, PacketChunkSize - 1, "(tsc : %llx - core : %d - vmx-root? %s)\t %s", __rdtsc(), KeGetCurrentProcessorNumberEx(0), IsVmxRootMode ? "yes" : "no", TempMessage);
+
+        //
+        // Check if the buffer passed the limit
+        //
+        if (SprintfResult == -1)
+        {
+            //
+            // Probably the buffer is large that we can't store it
+            //
+            return FALSE;
+        }
+    }
+    else
+    {
+        //
+        // It's actually not necessary to use -1 but because user-mode code might assume a null-terminated buffer so
+        // it's better to use - 1
+        //
+        va_start(ArgList, Fmt);
+
+        //
+        // We won't use this because we can't use in any IRQL
+        // Status = RtlStringCchVPrintfA(LogMessage, PacketChunkSize - 1, Fmt, ArgList);
+        //
+        SprintfResult = vsprintf_s(LogMessage, PacketChunkSize - 1, Fmt, ArgList);
+        va_end(ArgList);
+
+        //
+        // Check if the buffer passed the limit
+        //
+        if (SprintfResult == -1)
+        {
+            //
+            // Probably the buffer is large that we can't store it
+            //
+            return FALSE;
+        }
+    }
+    //
+    // Use std function because they can be run in any IRQL
+    // RtlStringCchLengthA(LogMessage, PacketChunkSize - 1, &WrittenSize);
+    //
+    WrittenSize = strnlen_s(LogMessage, PacketChunkSize - 1);
+
+    if (LogMessage[0] == '\0')
+    {
+        //
+        // nothing to write
+        //
+        return FALSE;
+    }
+#if UseWPPTracing
+
+    if (OperationCode == OPERATION_LOG_INFO_MESSAGE)
+    {
+        HypervisorTraceLevelMessage(
+            TRACE_LEVEL_INFORMATION, // ETW Level defined in evntrace.h
+            HVFS_LOG_INFO,
+            "%s", // Flag defined in WPP_CONTROL_GUIDS
+            LogMessage);
+    }
+    else if (OperationCode == OPERATION_LOG_WARNING_MESSAGE)
+    {
+        HypervisorTraceLevelMessage(
+            TRACE_LEVEL_WARNING, // ETW Level defined in evntrace.h
+            HVFS_LOG_WARNING,
+            "%s", // Flag defined in WPP_CONTROL_GUIDS
+            LogMessage);
+    }
+    else if (OperationCode == OPERATION_LOG_ERROR_MESSAGE)
+    {
+        HypervisorTraceLevelMessage(
+            TRACE_LEVEL_ERROR, // ETW Level defined in evntrace.h
+            HVFS_LOG_ERROR,
+            "%s", // Flag defined in WPP_CONTROL_GUIDS
+            LogMessage);
+    }
+    else
+    {
+        HypervisorTraceLevelMessage(
+            TRACE_LEVEL_NONE, // ETW Level defined in evntrace.h
+            HVFS_LOG,
+            "%s", // Flag defined in WPP_CONTROL_GUIDS
+            LogMessage);
+    }
+
+#else
+    if (IsImmediateMessage)
+    {
+        return LogSendBuffer(OperationCode, LogMessage, WrittenSize);
+    }
+    else
+    {
+        //
+        // Each core has its own buffer for accumulating non-immediate messages,
+        // in vmx-root we're the only writer of it, and in vmx non-root we raise
+        // the IRQL so no one else on this core can access it
+        //
+        if (!IsVmxRootMode)
+        {
+            KeRaiseIrql(HIGH_LEVEL, &OldIRQL);
+        }
+
+        Ring = &MessageBufferInformation[LOG_BUFFER_INDEX(KeGetCurrentProcessorNumber(), IsVmxRootMode)];
+
+        //
+        // The subscribers get the message immediately (with its own operation code
+        // and tag), only the default rings accumulate it
+        //
+        if (LogActiveSubscriptions != 0 && !LogRouteToSubscribers(KeGetCurrentProcessorNumber(), IsVmxRootMode, OperationCode, LogMessage, (UINT32)WrittenSize))
+        {
+            if (!IsVmxRootMode)
+            {
+                KeLowerIrql(OldIRQL);
+            }
+
+            return TRUE;
+        }
+
+        //
+        //Set the result to True
+        //
+        Result = TRUE;
+
+        //
+        // If log message WrittenSize is above the buffer then we have to send the previous buffer
+        //
+        if ((Ring->CurrentLengthOfNonImmBuffer + WrittenSize) > PacketChunkSize - 1 && Ring->CurrentLengthOfNonImmBuffer != 0)
+        {
+            //
+            // Send the previous buffer (non-immediate message)
+            //
+            Result = LogFlushNonImmediateBuffer(Ring);
+        }
+
+        if (Ring->CurrentLengthOfNonImmBuffer == 0)
+        {
+            //
+            // The deadline of flushing the buffer starts from the first message
+            //
+            Ring->NonImmediateBufferTimeStamp = __rdtsc();
+        }
+
+        //
+        // We have to save the message
+        //
+        RtlCopyBytes(Ring->BufferForMultipleNonImmediateMessage +
+                         Ring->CurrentLengthOfNonImmBuffer,
+                     LogMessage,
+                     WrittenSize);
+
+        //
+        // add the length
+        //
+        Ring->CurrentLengthOfNonImmBuffer += WrittenSize;
+
+        if (!IsVmxRootMode)
+        {
+            KeLowerIrql(OldIRQL);
+        }
+
+        return Result;
+    }
+#endif
+}
+
+/**
+ * @brief Send the accumulated non-immediate messages of a ring
+ * @details The caller should be the producer of the ring (the owner core
+ * in the owner mode)
+ * 
+ * @param Ring The target ring
+ * @return BOOLEAN Returns true if the buffer is sent (or it's empty)
+ */
+BOOLEAN
+LogFlushNonImmediateBuffer(PLOG_BUFFER_INFORMATION Ring)
+{
+    BOOLEAN Result;
+
+    if (Ring->CurrentLengthOfNonImmBuffer == 0)
+    {
+        return TRUE;
+    }
+
+    Result = LogSendBufferToRing(Ring,
+                                 OPERATION_LOG_NON_IMMEDIATE_MESSAGE,
+                                 Ring->BufferForMultipleNonImmediateMessage,
+                                 Ring->CurrentLengthOfNonImmBuffer);
+
+    //
+    // Free the immediate buffer
+    //
+    Ring->CurrentLengthOfNonImmBuffer = 0;
+    RtlZeroMemory(Ring->BufferForMultipleNonImmediateMessage, PacketChunkSize);
+
+    return Result;
+}
+
+/**
+ * @brief Flush the non-immediate messages of the current core
+ * @details In vmx non-root (this function), the IRQL is raised as the
+ * producers do, and the vmx-root buffer is flushed using VMCALL
+ * 
+ * @return VOID 
+ */
+VOID
+LogFlushCurrentCoreNonImmediateBuffers()
+{
+    KIRQL OldIRQL;
+    ULONG CurrentCore;
+
+    KeRaiseIrql(HIGH_LEVEL, &OldIRQL);
+
+    CurrentCore = KeGetCurrentProcessorNumber();
+    LogFlushNonImmediateBuffer(&MessageBufferInformation[LOG_BUFFER_INDEX(CurrentCore, FALSE)]);
+
+    KeLowerIrql(OldIRQL);
+
+    if (g_GuestState[CurrentCore].HasLaunched && MessageBufferInformation[LOG_BUFFER_INDEX(CurrentCore, TRUE)].CurrentLengthOfNonImmBuffer != 0)
+    {
+        AsmVmxVmcall(VMCALL_FLUSH_LOG_BUFFERS, 0, 0, 0);
+    }
+}
+
+/**
+ * @brief Flush the non-immediate messages of the core that this DPC targets
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogFlushCoreDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    LogFlushCurrentCoreNonImmediateBuffers();
+}
+
+/**
+ * @brief Check the deadline of the non-immediate messages of all the cores
+ * @details The buffers are flushed on their own core, so this function only
+ * queues the DPC of the cores that have an expired buffer
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogFlushTimerCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    PLOG_BUFFER_INFORMATION Ring;
+    UINT64                  CurrentTimeStamp;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    CurrentTimeStamp = __rdtsc();
+
+    for (UINT32 i = 0; i < MessageBufferCount; i++)
+    {
+        Ring = &MessageBufferInformation[i];
+
+        //
+        // The producer might change the buffer at the same time, in the worst
+        // case we queue the DPC for nothing or we flush it in the next tick
+        //
+        if (Ring->CurrentLengthOfNonImmBuffer != 0 && CurrentTimeStamp - Ring->NonImmediateBufferTimeStamp >= MessageBufferFlushDeadline)
+        {
+            KeInsertQueueDpc(&MessageBufferFlushDpcs[i / 2], NULL, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Broadcast flushing the non-immediate messages to all the cores
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogDpcBroadcastFlushNonImmediateBuffers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    LogFlushCurrentCoreNonImmediateBuffers();
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief Count the arguments of a format string for binary messages
+ * @details Formats with string arguments (%s, %S, %Z, ...) are not eligible
+ * because the user-mode can't access the pointers, these formats are sent
+ * as text messages
+ * 
+ * @param Fmt The format string
+ * @param ArgumentCount [Out] Count of arguments
+ * @return BOOLEAN Returns true if the format is eligible for binary messages
+ */
+BOOLEAN
+LogCountBinaryFormatArguments(const char * Fmt, UINT32 * ArgumentCount)
+{
+    UINT32 Count = 0;
+
+    for (const char * Current = Fmt; *Current != '\0'; Current++)
+    {
+        if (*Current != '%')
+        {
+            continue;
+        }
+
+        Current++;
+
+        if (*Current == '%')
+        {
+            //
+            // It's just a '%' character
+            //
+            continue;
+        }
+
+        //
+        // Skip flags, width, precision and size prefixes
+        //
+        while (*Current != '\0' && strchr("-+ #0123456789.*hlLjztIw", *Current) != NULL)
+        {
+            if (*Current == '*')
+            {
+                //
+                // Width or precision is passed as an argument
+                //
+                Count++;
+            }
+            Current++;
+        }
+
+        if (*Current == '\0' || strchr("sSZn", *Current) != NULL)
+        {
+            //
+            // It needs a pointer that we can't send to user-mode
+            //
+            return FALSE;
+        }
+
+        Count++;
+    }
+
+    if (Count > LOG_BINARY_MAXIMUM_ARGUMENTS)
+    {
+        return FALSE;
+    }
+
+    *ArgumentCount = Count;
+
+    return TRUE;
+}
+
+/**
+ * @brief Make all the call sites send their format definitions again
+ * @details It's called if a definition is lost or there is a new consumer
+ * that has not received the previous definitions, the IDs don't change
+ * 
+ * @return VOID 
+ */
+VOID
+LogInvalidateBinaryFormats()
+{
+    InterlockedIncrement(&LogBinaryFormatGeneration);
+}
+
+/**
+ * @brief Register the format string of a call site for binary messages
+ * @details The format definition is sent to user-mode as a packet so the next
+ * binary messages can be formatted in user-mode, a registered format is sent
+ * again with the same ID if the generation of the formats is changed
+ * 
+ * @param FormatState The state of the call site
+ * @param CurrentFormatId LOG_BINARY_FORMAT_NOT_REGISTERED or the ID of the
+ * format if it should be sent again
+ * @param Prefix The prefix format (gets function name and line)
+ * @param FunctionName Name of the function of the call site
+ * @param Line Line of the call site
+ * @param Fmt The format string
+ * @return LONG Returns the ID of the format or one of LOG_BINARY_FORMAT_* if
+ * it's not registered
+ */
+LONG
+LogRegisterBinaryFormat(PLOG_BINARY_FORMAT_STATE FormatState, LONG CurrentFormatId, const char * Prefix, const char * FunctionName, UINT32 Line, const char * Fmt)
+{
+    LONG                          FormatId;
+    LONG                          Generation;
+    UINT32                        ArgumentCount;
+    int                           PrefixLength;
+    UINT32                        MaximumFormatLength;
+    char                          DefinitionBuffer[PacketChunkSize];
+    PLOG_BINARY_FORMAT_DEFINITION Definition = (PLOG_BINARY_FORMAT_DEFINITION)DefinitionBuffer;
+
+    //
+    // Take the ownership of registration, if another core is registering it then
+    // we use the text message for now
+    //
+    if (InterlockedCompareExchange(&FormatState->FormatId, LOG_BINARY_FORMAT_REGISTERING, CurrentFormatId) != CurrentFormatId)
+    {
+        return LOG_BINARY_FORMAT_REGISTERING;
+    }
+
+    //
+    // If the generation is changed while we're sending the definition, it's
+    // sent again next time
+    //
+    Generation = LogBinaryFormatGeneration;
+
+    if (!LogCountBinaryFormatArguments(Fmt, &ArgumentCount))
+    {
+        InterlockedExchange(&FormatState->FormatId, LOG_BINARY_FORMAT_NOT_ELIGIBLE);
+        return LOG_BINARY_FORMAT_NOT_ELIGIBLE;
+    }
+
+    //
+    // The prefix is the same for all the messages of this call site so
+    // we render it once and put it in the format
+    //
+    MaximumFormatLength = PacketChunkSize - 1 - FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format);
+    PrefixLength        = sprintf_s(Definition->Format, MaximumFormatLength, Prefix, FunctionName, Line);
+
+    if (PrefixLength == -1 || strcpy_s(Definition->Format + PrefixLength, MaximumFormatLength - PrefixLength, Fmt) != 0)
+    {
+        InterlockedExchange(&FormatState->FormatId, LOG_BINARY_FORMAT_NOT_ELIGIBLE);
+        return LOG_BINARY_FORMAT_NOT_ELIGIBLE;
+    }
+
+    FormatId                  = CurrentFormatId > 0 ? CurrentFormatId : InterlockedIncrement(&LogBinaryFormatCounter);
+    Definition->FormatId      = FormatId;
+    Definition->ArgumentCount = ArgumentCount;
+
+    if (!LogSendBuffer(OPERATION_LOG_BINARY_FORMAT_DEFINITION,
+                       Definition,
+                       FIELD_OFFSET(LOG_BINARY_FORMAT_DEFINITION, Format) + strlen(Definition->Format) + 1))
+    {
+        //
+        // Let's try again next time (the generation is not changed so a
+        // registered format is sent again too)
+        //
+        InterlockedExchange(&FormatState->FormatId, CurrentFormatId);
+        return LOG_BINARY_FORMAT_NOT_REGISTERED;
+    }
+
+    //
+    // The argument count and the generation should be visible before the ID
+    //
+    FormatState->ArgumentCount = ArgumentCount;
+    FormatState->Generation    = Generation;
+    KeMemoryBarrier();
+    InterlockedExchange(&FormatState->FormatId, FormatId);
+
+    return FormatId;
+}
+
+/**
+ * @brief Send binary message (deferred formatting) in vmx-root
+ * @details In vmx non-root or if the format is not eligible, it sends the
+ * message as a text message
+ * 
+ * @param OperationCode The operation code that will be send to user mode
+ * @param IsImmediateMessage Should be sent immediately (text messages only)
+ * @param ShowCurrentSystemTime Show the time of the message
+ * @param FormatState The state of the call site
+ * @param Prefix The prefix format (gets function name and line)
+ * @param FunctionName Name of the function of the call site
+ * @param Line Line of the call site
+ * @param Fmt The format string
+ * @param ... Arguments of the format string
+ * @return BOOLEAN Returns true if the message is sent
+ */
+BOOLEAN
+LogSendBinaryMessageToQueue(UINT32                   OperationCode,
+                            BOOLEAN                  IsImmediateMessage,
+                            BOOLEAN                  ShowCurrentSystemTime,
+                            PLOG_BINARY_FORMAT_STATE FormatState,
+                            const char *             Prefix,
+                            const char *             FunctionName,
+                            UINT32                   Line,
+                            const char *             Fmt,
+                            ...)
+{
+    va_list            ArgList;
+    LONG               FormatId;
+    ULONG              CurrentCore;
+    int                SprintfResult;
+    LOG_BINARY_MESSAGE Message;
+    char               PrefixMessage[PacketChunkSize];
+    char               BodyMessage[PacketChunkSize];
+
+    CurrentCore = KeGetCurrentProcessorNumber();
+
+    if (g_GuestState[CurrentCore].IsOnVmxRootMode)
+    {
+        FormatId = FormatState->FormatId;
 
-        //
-        // Check if the buffer passed the limit
-        //
-        if (SprintfResult == -1)
+        if (FormatId == LOG_BINARY_FORMAT_NOT_REGISTERED ||
+            (FormatId > 0 && FormatState->Generation != LogBinaryFormatGeneration))
         {
-            //
-            // Probably the buffer is large that we can't store it
-            //
-            return FALSE;
+            FormatId = LogRegisterBinaryFormat(FormatState, FormatId, Prefix, FunctionName, Line, Fmt);
         }
-    }
-    else
-    {
-        //
-        // It's actually not necessary to use -1 but because user-mode code might assume a null-terminated buffer so
-        // it's better to use - 1
-        //
-        va_start(ArgList, Fmt);
 
-        //
-        // We won't use this because we can't use in any IRQL
-        // Status = RtlStringCchVPrintfA(LogMessage, PacketChunkSize - 1, Fmt, ArgList);
-        //
-        SprintfResult = vsprintf_s(LogMessage, PacketChunkSize - 1, Fmt, ArgList);
-        va_end(ArgList);
-
-        //
-        // Check if the buffer passed the limit
-        //
-        if (SprintfResult == -1)
+        if (FormatId > 0)
         {
+            Message.FormatId             = FormatId;
+            Message.OperationCode        = OperationCode;
+            Message.CoreId               = CurrentCore;
+            Message.ArgumentCount        = FormatState->ArgumentCount;
+            Message.ShowTimeStampCounter = ShowCurrentSystemTime;
+            Message.TimeStampCounter     = __rdtsc();
+
             //
-            // Probably the buffer is large that we can't store it
+            // All the variadic arguments are 64-bit slots in x64
             //
-            return FALSE;
+            va_start(ArgList, Fmt);
+            for (UINT32 i = 0; i < Message.ArgumentCount; i++)
+            {
+                Message.Arguments[i] = va_arg(ArgList, UINT64);
+            }
+            va_end(ArgList);
+
+            return LogSendBuffer(OPERATION_LOG_BINARY_MESSAGE,
+                                 &Message,
+                                 FIELD_OFFSET(LOG_BINARY_MESSAGE, Arguments) + (Message.ArgumentCount * sizeof(UINT64)));
         }
     }
+
     //
-    // Use std function because they can be run in any IRQL
-    // RtlStringCchLengthA(LogMessage, PacketChunkSize - 1, &WrittenSize);
+    // Send it as a text message
     //
-    WrittenSize = strnlen_s(LogMessage, PacketChunkSize - 1);
+    if (sprintf_s(PrefixMessage, PacketChunkSize - 1, Prefix, FunctionName, Line) == -1)
+    {
+        PrefixMessage[0] = '\0';
+    }
 
-    if (LogMessage[0] == '\0')
+    va_start(ArgList, Fmt);
+    SprintfResult = vsprintf_s(BodyMessage, PacketChunkSize - 1, Fmt, ArgList);
+    va_end(ArgList);
+
+    if (SprintfResult == -1)
     {
         //
-        // nothing to write
+        // Probably the buffer is large that we can't store it
         //
         return FALSE;
     }
-#if UseWPPTracing
 
-    if (OperationCode == OPERATION_LOG_INFO_MESSAGE)
-    {
-        HypervisorTraceLevelMessage(
-            TRACE_LEVEL_INFORMATION, // ETW Level defined in evntrace.h
-            HVFS_LOG_INFO,
-            "%s", // Flag defined in WPP_CONTROL_GUIDS
-            LogMessage);
-    }
-    else if (OperationCode == OPERATION_LOG_WARNING_MESSAGE)
-    {
-        HypervisorTraceLevelMessage(
-            TRACE_LEVEL_WARNING, // ETW Level defined in evntrace.h
-            HVFS_LOG_WARNING,
-            "%s", // Flag defined in WPP_CONTROL_GUIDS
-            LogMessage);
-    }
-    else if (OperationCode == OPERATION_LOG_ERROR_MESSAGE)
-    {
-        HypervisorTraceLevelMessage(
-            TRACE_LEVEL_ERROR, // ETW Level defined in evntrace.h
-            HVFS_LOG_ERROR,
-            "%s", // Flag defined in WPP_CONTROL_GUIDS
-            LogMessage);
-    }
-    else
-    {
-        HypervisorTraceLevelMessage(
-            TRACE_LEVEL_NONE, // ETW Level defined in evntrace.h
-            HVFS_LOG,
-            "%s", // Flag defined in WPP_CONTROL_GUIDS
-            LogMessage);
-    }
+    return LogSendMessageToQueue(OperationCode, IsImmediateMessage, ShowCurrentSystemTime, "%s%s", PrefixMessage, BodyMessage);
+}
 
-#else
-    if (IsImmediateMessage)
-    {
-        return LogSendBuffer(OperationCode, LogMessage, WrittenSize);
-    }
-    else
+/**
+ * @brief Complete the pending IRPs with the new messages
+ * @details The IRPs of each consumer are completed in the order that they
+ * are received, an IRP whose consumer has nothing to read doesn't block
+ * the IRPs of the other consumers
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+LogNotifyPendingIrpsCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    PLIST_ENTRY        Entry;
+    PLIST_ENTRY        NextEntry;
+    PIRP               Irp;
+    PIO_STACK_LOCATION IrpSp;
+    NOTIFY_TYPE        Type;
+    UINT32             SubscriberId;
+    BOOLEAN            Result;
+    UINT32             Length;
+    UINT32             EmptyConsumers = 0; // Bit of each consumer that has nothing to read
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    KeAcquireSpinLockAtDpcLevel(&MessageBufferPendingIrpsLock);
+
+    for (Entry = MessageBufferPendingIrps.Flink; Entry != &MessageBufferPendingIrps; Entry = NextEntry)
     {
-        //
-        // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-        // if not we use the windows spinlock
-        //
-        if (IsVmxRootMode)
+        NextEntry    = Entry->Flink;
+        Irp          = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+        IrpSp        = IoGetCurrentIrpStackLocation(Irp);
+        Type         = (NOTIFY_TYPE)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[0];
+        SubscriberId = (UINT32)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[1];
+
+        if (EmptyConsumers & (1 << SubscriberId))
         {
             //
-            // Set the index
+            // The previous IRP of this consumer is still waiting
             //
-            Index = 1;
-            SpinlockLock(&VmxRootLoggingLockForNonImmBuffers);
+            continue;
         }
-        else
-        {
-            //
-            // Set the index
-            //
-            Index = 0;
 
-            //
-            // Acquire the lock
-            //
-            KeAcquireSpinLock(&MessageBufferInformation[Index].BufferLockForNonImmMessage, &OldIRQL);
-        }
         //
-        //Set the result to True
+        // Read Buffer might be empty (nothing to send), the IRP waits for the next message
         //
-        Result = TRUE;
+        Length = 0;
 
         //
-        // If log message WrittenSize is above the buffer then we have to send the previous buffer
+        // The IRP might be cancelled while we're reading, so it's not cancellable anymore
         //
-        if ((MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer + WrittenSize) > PacketChunkSize - 1 && MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer != 0)
+        if (IoSetCancelRoutine(Irp, NULL) == NULL)
         {
             //
-            // Send the previous buffer (non-immediate message)
+            // The cancel routine is running, it waits for the lock to remove the IRP
             //
-            Result = LogSendBuffer(OPERATION_LOG_NON_IMMEDIATE_MESSAGE,
-                                   MessageBufferInformation[Index].BufferForMultipleNonImmediateMessage,
-                                   MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer);
+            RemoveEntryList(Entry);
+            InitializeListHead(Entry);
+            continue;
+        }
+
+        if (Type == IRP_BASED_BATCH)
+        {
+            Result = LogReadBufferBatch(SubscriberId, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &Length);
+        }
+        else
+        {
+            Result = LogReadBuffer(Irp->AssociatedIrp.SystemBuffer, &Length);
+        }
 
+        if (!Result && SubscriberId != LOG_SUBSCRIBER_DEFAULT && LogSubscribers[SubscriberId - 1].Rings == NULL)
+        {
             //
-            // Free the immediate buffer
+            // The subscriber is removed
             //
-            MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer = 0;
-            RtlZeroMemory(MessageBufferInformation[Index].BufferForMultipleNonImmediateMessage, PacketChunkSize);
+            Irp->IoStatus.Status = STATUS_CANCELLED;
         }
+        else if (!Result)
+        {
+            //
+            // The IRP waits for the next message, unless it's cancelled meanwhile
+            //
+            IoSetCancelRoutine(Irp, LogCancelPendingIrp);
 
-        //
-        // We have to save the message
-        //
-        RtlCopyBytes(MessageBufferInformation[Index].BufferForMultipleNonImmediateMessage +
-                         MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer,
-                     LogMessage,
-                     WrittenSize);
-
-        //
-        // add the length
-        //
-        MessageBufferInformation[Index].CurrentLengthOfNonImmBuffer += WrittenSize;
+            if (!Irp->Cancel || IoSetCancelRoutine(Irp, NULL) == NULL)
+            {
+                EmptyConsumers |= 1 << SubscriberId;
+                continue;
+            }
 
-        // Check if we're in Vmx-root, if it is then we use our customized HIGH_IRQL Spinlock,
-        // if not we use the windows spinlock
-        //
-        if (IsVmxRootMode)
-        {
-            SpinlockUnlock(&VmxRootLoggingLockForNonImmBuffers);
+            Irp->IoStatus.Status = STATUS_CANCELLED;
         }
         else
+        {
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+        }
+
+        RemoveEntryList(Entry);
+        InterlockedDecrement(&MessageBufferPendingIrpsCount);
+
+        Irp->IoStatus.Information = Length;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&MessageBufferPendingIrpsLock);
+}
+
+/**
+ * @brief Cancel routine of the pending IRPs
+ * @details The entry of the IRP is empty if it's already removed from the list
+ * 
+ * @param DeviceObject 
+ * @param Irp 
+ * @return VOID 
+ */
+VOID
+LogCancelPendingIrp(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    KIRQL OldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    KeAcquireSpinLock(&MessageBufferPendingIrpsLock, &OldIrql);
+
+    if (!IsListEmpty(&Irp->Tail.Overlay.ListEntry))
+    {
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    }
+
+    InterlockedDecrement(&MessageBufferPendingIrpsCount);
+
+    KeReleaseSpinLock(&MessageBufferPendingIrpsLock, OldIrql);
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status      = STATUS_CANCELLED;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+/**
+ * @brief Complete all the pending IRPs without any message
+ * @details It's called when the handle is closed (IRP_MJ_CLEANUP)
+ * 
+ * @return VOID 
+ */
+VOID
+LogCompleteAllPendingIrps()
+{
+    KIRQL       OldIrql;
+    PLIST_ENTRY Entry;
+    PIRP        Irp;
+
+    KeAcquireSpinLock(&MessageBufferPendingIrpsLock, &OldIrql);
+
+    while (!IsListEmpty(&MessageBufferPendingIrps))
+    {
+        Entry = RemoveHeadList(&MessageBufferPendingIrps);
+        Irp   = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+        if (IoSetCancelRoutine(Irp, NULL) == NULL)
         {
             //
-            // Release the lock
+            // The cancel routine is running, it completes the IRP
             //
-            KeReleaseSpinLock(&MessageBufferInformation[Index].BufferLockForNonImmMessage, OldIRQL);
+            InitializeListHead(Entry);
+            continue;
         }
 
-        return Result;
+        InterlockedDecrement(&MessageBufferPendingIrpsCount);
+
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status      = STATUS_CANCELLED;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
     }
-#endif
+
+    KeReleaseSpinLock(&MessageBufferPendingIrpsLock, OldIrql);
 }
 
 /**
- * @brief Complete the IRP in IRP Pending state and fill the usermode buffers with pool data
+ * @brief Complete the requests of user-mode (event-based)
  * 
  * @param Dpc 
- * @param DeferredContext 
+ * @param DeferredContext The NOTIFY_RECORD of the request
  * @param SystemArgument1 
  * @param SystemArgument2 
  * @return VOID 
@@ -706,8 +2538,6 @@ VOID
 LogNotifyUsermodeCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
 {
     PNOTIFY_RECORD NotifyRecord;
-    PIRP           Irp;
-    UINT32         Length;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(SystemArgument1);
@@ -720,68 +2550,6 @@ LogNotifyUsermodeCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument
 
     switch (NotifyRecord->Type)
     {
-    case IRP_BASED:
-        Irp = NotifyRecord->Message.PendingIrp;
-
-        if (Irp != NULL)
-        {
-            PCHAR              OutBuff;       // pointer to output buffer
-            ULONG              InBuffLength;  // Input buffer length
-            ULONG              OutBuffLength; // Output buffer length
-            PIO_STACK_LOCATION IrpSp;
-
-            //
-            // Make suree that concurrent calls to notify function never occurs
-            //
-            if (!(Irp->CurrentLocation <= Irp->StackCount + 1))
-            {
-                LogError("Probably two or more functions called DPC for an object.");
-                return;
-            }
-
-            IrpSp         = IoGetCurrentIrpStackLocation(Irp);
-            InBuffLength  = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
-            OutBuffLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
-
-            if (!InBuffLength || !OutBuffLength)
-            {
-                Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
-                IoCompleteRequest(Irp, IO_NO_INCREMENT);
-                break;
-            }
-
-            //
-            // Check again that SystemBuffer is not null
-            //
-            if (!Irp->AssociatedIrp.SystemBuffer)
-            {
-                //
-                // Buffer is invalid
-                //
-                return;
-            }
-
-            OutBuff = Irp->AssociatedIrp.SystemBuffer;
-            Length  = 0;
-
-            //
-            // Read Buffer might be empty (nothing to send)
-            //
-            if (!LogReadBuffer(NotifyRecord->CheckVmxRootMessagePool, OutBuff, &Length))
-            {
-                //
-                // we have to return here as there is nothing to send here
-                //
-                return;
-            }
-
-            Irp->IoStatus.Information = Length;
-
-            Irp->IoStatus.Status = STATUS_SUCCESS;
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        }
-        break;
-
     case EVENT_BASED:
         //
         // Signal the Event created in user-mode.
@@ -808,93 +2576,84 @@ LogNotifyUsermodeCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument
 
 /**
  * @brief Register a new IRP Pending thread which listens for new buffers
+ * @details Multiple IRPs can wait at the same time (e.g. overlapped requests
+ * of user-mode), they're completed in the order that they are received
  * 
  * @param DeviceObject 
  * @param Irp 
+ * @param Type IRP_BASED (one buffer for each IRP) or IRP_BASED_BATCH (fill the IRP
+ * with as many buffers as fit)
+ * @param SubscriberId The consumer (LOG_SUBSCRIBER_DEFAULT or a subscriber, only
+ * with IRP_BASED_BATCH)
  * @return NTSTATUS 
  */
 NTSTATUS
-LogRegisterIrpBasedNotification(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+LogRegisterIrpBasedNotification(PDEVICE_OBJECT DeviceObject, PIRP Irp, NOTIFY_TYPE Type, UINT32 SubscriberId)
 {
-    PNOTIFY_RECORD          NotifyRecord;
-    PIO_STACK_LOCATION      IrpStack;
-    KIRQL                   OOldIrql;
-    PREGISTER_NOTIFY_BUFFER RegisterEvent;
+    KIRQL              OldIrql;
+    PIO_STACK_LOCATION IrpSp;
 
-    //
-    // check if current core has another thread with pending IRP,
-    // if no then put the current thread to pending
-    // otherwise return and complete thread with STATUS_SUCCESS as
-    // there is another thread waiting for message
-    //
+    IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
-    if (g_GlobalNotifyRecord == NULL)
+    if (!Irp->AssociatedIrp.SystemBuffer || !IrpSp->Parameters.DeviceIoControl.OutputBufferLength ||
+        (Type == IRP_BASED && IrpSp->Parameters.DeviceIoControl.OutputBufferLength < UsermodeBufferSize) ||
+        (Type == IRP_BASED && SubscriberId != LOG_SUBSCRIBER_DEFAULT) || SubscriberId > LOG_MAXIMUM_SUBSCRIBERS)
     {
-        IrpStack      = IoGetCurrentIrpStackLocation(Irp);
-        RegisterEvent = (PREGISTER_NOTIFY_BUFFER)Irp->AssociatedIrp.SystemBuffer;
+        return STATUS_INVALID_PARAMETER;
+    }
 
+    if (MessageBufferPendingIrpsCount >= MaximumPendingIrps)
+    {
         //
-        // Allocate a record and save all the event context
+        // There are enough threads waiting for messages
         //
-        NotifyRecord = ExAllocatePoolWithQuotaTag(NonPagedPool, sizeof(NOTIFY_RECORD), POOLTAG);
+        return STATUS_SUCCESS;
+    }
 
-        if (NULL == NotifyRecord)
-        {
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+    Irp->Tail.Overlay.DriverContext[0] = (PVOID)(ULONG_PTR)Type;
+    Irp->Tail.Overlay.DriverContext[1] = (PVOID)(ULONG_PTR)SubscriberId;
 
-        NotifyRecord->Type               = IRP_BASED;
-        NotifyRecord->Message.PendingIrp = Irp;
+    IoMarkIrpPending(Irp);
 
-        KeInitializeDpc(&NotifyRecord->Dpc,        // Dpc
-                        LogNotifyUsermodeCallback, // DeferredRoutine
-                        NotifyRecord               // DeferredContext
-        );
+    KeAcquireSpinLock(&MessageBufferPendingIrpsLock, &OldIrql);
 
-        IoMarkIrpPending(Irp);
+    InsertTailList(&MessageBufferPendingIrps, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&MessageBufferPendingIrpsCount);
 
-        //
-        // check for new message (for both Vmx-root mode or Vmx non root-mode)
-        //
-        if (LogCheckForNewMessage(FALSE))
-        {
-            //
-            // check vmx root
-            //
-            NotifyRecord->CheckVmxRootMessagePool = FALSE;
+    IoSetCancelRoutine(Irp, LogCancelPendingIrp);
 
-            //
-            // Insert dpc to queue
-            //
-            KeInsertQueueDpc(&NotifyRecord->Dpc, NotifyRecord, NULL);
-        }
-        else if (LogCheckForNewMessage(TRUE))
-        {
-            //
-            // check vmx non-root
-            //
-            NotifyRecord->CheckVmxRootMessagePool = TRUE;
-            //
-            // Insert dpc to queue
-            //
-            KeInsertQueueDpc(&NotifyRecord->Dpc, NotifyRecord, NULL);
-        }
-        else
-        {
-            //
-            // Set the notify routine to the global structure
-            //
-            g_GlobalNotifyRecord = NotifyRecord;
-        }
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL) != NULL)
+    {
         //
-        // We will return pending as we have marked the IRP pending
+        // The IRP is cancelled before setting the cancel routine
         //
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        InterlockedDecrement(&MessageBufferPendingIrpsCount);
+
+        KeReleaseSpinLock(&MessageBufferPendingIrpsLock, OldIrql);
+
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status      = STATUS_CANCELLED;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
         return STATUS_PENDING;
     }
-    else
+
+    KeReleaseSpinLock(&MessageBufferPendingIrpsLock, OldIrql);
+
+    //
+    // check for new message (in the rings of all the cores), or complete the
+    // IRP if the subscriber is removed meanwhile
+    //
+    if (LogCheckForNewMessage(SubscriberId) || (SubscriberId != LOG_SUBSCRIBER_DEFAULT && LogSubscribers[SubscriberId - 1].Rings == NULL))
     {
-        return STATUS_SUCCESS;
+        KeInsertQueueDpc(&MessageBufferNotifyDpc, NULL, NULL);
     }
+
+    //
+    // We will return pending as we have marked the IRP pending
+    //
+    return STATUS_PENDING;
 }
 
 /**
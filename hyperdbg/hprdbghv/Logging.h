@@ -29,23 +29,14 @@ typedef struct _NOTIFY_RECORD
         PKEVENT Event;
         PIRP    PendingIrp;
     } Message;
-    KDPC    Dpc;
-    BOOLEAN CheckVmxRootMessagePool; // Set so that notify callback can understand where to check (Vmx root or Vmx non-root)
+    KDPC Dpc;
 } NOTIFY_RECORD, *PNOTIFY_RECORD;
 
-/**
- * @brief Message buffer structure
- * 
- */
-typedef struct _BUFFER_HEADER
-{
-    UINT32  OpeationNumber; // Operation ID to user-mode
-    UINT32  BufferLength;   // The actual length
-    BOOLEAN Valid;          // Determine whether the buffer was valid to send or not
-} BUFFER_HEADER, *PBUFFER_HEADER;
-
 /**
  * @brief Core-specific buffers
+ * @details Each logical core has two of these rings, one for vmx-root and one
+ * for vmx non-root, each ring has exactly one producer (the owner core in its
+ * mode) and one consumer (the notify DPC), so no lock is needed for writing
  * 
  */
 typedef struct _LOG_BUFFER_INFORMATION
@@ -55,82 +46,214 @@ typedef struct _LOG_BUFFER_INFORMATION
 
     UINT64 BufferForMultipleNonImmediateMessage; // Start address of the buffer for accumulating non-immadiate messages
     UINT32 CurrentLengthOfNonImmBuffer;          // the current size of the buffer for accumulating non-immadiate messages
+    UINT64 NonImmediateBufferTimeStamp;          // TSC of the first message in the buffer for accumulating non-immadiate messages
 
-    KSPIN_LOCK BufferLock;                 // SpinLock to protect access to the queue
-    KSPIN_LOCK BufferLockForNonImmMessage; // SpinLock to protect access to the queue of non-imm messages
+    LOG_SHARED_RING_CONTROL  Control;            // Counters of the ring (if not IsMappedToUsermode)
+    BOOLEAN                  IsMappedToUsermode; // Whether the consumer is the user-mode app that the buffer is mapped to it
+    PLOG_SHARED_RING_CONTROL SharedControl;      // Current counters of the ring (Control or the counters that are shared with user-mode)
+    PMDL                     UsermodeMdl;        // Mdl of the buffer (if mapped to user-mode)
+    PVOID                    UsermodeAddress;    // Address of the buffer in user-mode (if mapped to user-mode)
 
-    UINT32 CurrentIndexToSend;  // Current buffer index to send to user-mode
-    UINT32 CurrentIndexToWrite; // Current buffer index to write new messages
+    UINT64 WrittenRecords;     // Count of records that are written to the ring (only changed by the producer)
+    UINT64 DroppedRecords;     // Count of records that are dropped as the ring was full (only changed by the producer)
+    UINT64 OverwrittenRecords; // Count of unread records that are overwritten (only changed by the producer)
+    UINT64 LostRecords;        // Count of dropped records that are not reported yet (LOG_OVERFLOW_SUMMARIZE)
 
 } LOG_BUFFER_INFORMATION, *PLOG_BUFFER_INFORMATION;
 
+/* States of a call site's format for binary messages */
+#define LOG_BINARY_FORMAT_NOT_REGISTERED 0
+#define LOG_BINARY_FORMAT_REGISTERING    -1
+#define LOG_BINARY_FORMAT_NOT_ELIGIBLE   -2
+
+/**
+ * @brief Each call site of the log macros has one of this structure (static)
+ * to hold the ID of its format string for binary messages
+ * 
+ */
+typedef struct _LOG_BINARY_FORMAT_STATE
+{
+    volatile LONG FormatId;      // One of LOG_BINARY_FORMAT_* or the registered ID (> 0)
+    UINT32        ArgumentCount; // Count of arguments of the format string (valid if FormatId > 0)
+    volatile LONG Generation;    // LogBinaryFormatGeneration when the definition is sent (valid if FormatId > 0)
+
+} LOG_BINARY_FORMAT_STATE, *PLOG_BINARY_FORMAT_STATE;
+
+/**
+ * @brief The events of a type on a core
+ * @details An array is never changed after it's published, the updates
+ * publish a new array and retire this one (see DEBUGGER_RETIRED_EVENT_ARRAY)
+ * 
+ */
+typedef struct _DEBUGGER_EVENT_ARRAY
+{
+    UINT32          Count;
+    PDEBUGGER_EVENT Events[1]; // Count events
+
+} DEBUGGER_EVENT_ARRAY, *PDEBUGGER_EVENT_ARRAY;
+
 // Each core has one of the structure in g_GuestState
 typedef struct _DEBUGGER_CORE_EVENTS
 {
-    LIST_ENTRY HiddenHookRwEventsHead;          // HIDDEN_HOOK_RW  [WARNING : MAKE SURE TO INITIALIZE LIST HEAD]
-    LIST_ENTRY HiddenHooksExecDetourEventsHead; // HIDDEN_HOOK_EXEC_DETOUR [WARNING : MAKE SURE TO INITIALIZE LIST HEAD]
-    LIST_ENTRY HiddenHookExecCcEventsHead;      // HIDDEN_HOOK_EXEC_CC [WARNING : MAKE SURE TO INITIALIZE LIST HEAD]
-    LIST_ENTRY SyscallHooksEferEventsHead;      // SYSCALL_HOOK_EFER [WARNING : MAKE SURE TO INITIALIZE LIST HEAD]
+    PDEBUGGER_EVENT_ARRAY volatile EventsOfType[DEBUGGER_EVENT_TYPES_COUNT]; // Indexed by DEBUGGER_EVENT_TYPE_ENUM (null if there is no event)
 
 } DEBUGGER_CORE_EVENTS, *PDEBUGGER_CORE_EVENTS;
 
+/**
+ * @brief The filter of a subscription (see LOG_SUBSCRIPTION_REQUEST)
+ * 
+ */
+typedef struct _LOG_SUBSCRIPTION_FILTER
+{
+    UINT32 Flags;          // LOG_SUBSCRIPTION_EXCLUSIVE
+    UINT32 CountOfTags;    // Zero means all the records
+    UINT64 OperationCodes; // Bit of each operation code, zero means all
+    UINT64 CoreMask;       // Bit of each core, zero means all
+    UINT64 Tags[LOG_SUBSCRIPTION_MAXIMUM_TAGS];
+
+} LOG_SUBSCRIPTION_FILTER, *PLOG_SUBSCRIPTION_FILTER;
+
+/**
+ * @brief A consumer that only receives the records of its filter
+ * @details The rings are the same as MessageBufferInformation (two for
+ * each core, with the same producers), the producers read the subscriber
+ * without any lock, so a subscriber is only changed when it's not active
+ * and no producer is running (see LogDpcBroadcastQuiesceProducers)
+ * 
+ */
+typedef struct _LOG_SUBSCRIBER
+{
+    volatile BOOLEAN        IsActive; // Whether the producers write to the rings
+    LOG_SUBSCRIPTION_FILTER Filter;
+    PLOG_BUFFER_INFORMATION Rings; // MessageBufferCount rings, null if the subscriber is free (changed with MessageBufferReaderLock held)
+
+} LOG_SUBSCRIBER, *PLOG_SUBSCRIBER;
+
 //////////////////////////////////////////////////
 //				Global Variables				//
 //////////////////////////////////////////////////
 
-/* Global Variable for buffer on all cores */
+/* Global Variable for buffer on all cores (two rings for each core) */
 LOG_BUFFER_INFORMATION * MessageBufferInformation;
 
-/* Vmx-root lock for logging */
-volatile LONG VmxRootLoggingLock;
+/* Count of rings in MessageBufferInformation */
+UINT32 MessageBufferCount;
+
+/* Last ID that is given to a format string of binary messages */
+volatile LONG LogBinaryFormatCounter;
+
+/* The call sites send their format definitions again if it's changed (e.g. a definition is lost) */
+volatile LONG LogBinaryFormatGeneration;
+
+/* Shared counters of the rings (when the rings are mapped to user-mode) */
+LOG_SHARED_RING_CONTROL * MessageBufferSharedControl;
+
+/* Mdl and user-mode address of MessageBufferSharedControl */
+PMDL  MessageBufferSharedControlMdl;
+PVOID MessageBufferSharedControlUsermodeAddress;
+
+/* The user-mode event that is signaled when a mapped ring is filled */
+PKEVENT MessageBufferSharedEvent;
+
+/* Dpc to signal MessageBufferSharedEvent (we can't signal it in vmx-root) */
+KDPC MessageBufferSharedEventDpc;
+
+/* Count of unread packets of a mapped ring to signal the event */
+UINT32 MessageBufferSharedFillThreshold;
+
+/* Lock to serialize the consumers of the rings (never acquired in vmx-root) */
+KSPIN_LOCK MessageBufferReaderLock;
+
+/* What to do when a ring is full */
+LOG_BUFFER_OVERFLOW_POLICY MessageBufferOverflowPolicy;
 
-/* Vmx-root lock for logging */
-volatile LONG VmxRootLoggingLockForNonImmBuffers;
+/* IRPs of user-mode (IRP_BASED and IRP_BASED_BATCH) that wait for new messages */
+LIST_ENTRY MessageBufferPendingIrps;
+
+/* Lock of MessageBufferPendingIrps (never acquired in vmx-root) */
+KSPIN_LOCK MessageBufferPendingIrpsLock;
+
+/* Count of the IRPs in MessageBufferPendingIrps (checked by the producers without the lock) */
+volatile LONG MessageBufferPendingIrpsCount;
+
+/* Dpc to complete the pending IRPs when there are new messages */
+KDPC MessageBufferNotifyDpc;
+
+/* Frequency of the time stamp counter (ticks per second) */
+UINT64 LogTimeStampCounterFrequency;
+
+/* Dpcs to flush the non-immediate messages of each core (targeted to the core) */
+KDPC * MessageBufferFlushDpcs;
+
+/* Timer (and its Dpc) to check the deadline of the non-immediate messages */
+KTIMER MessageBufferFlushTimer;
+KDPC   MessageBufferFlushTimerDpc;
+
+/* Maximum TSC ticks that a non-immediate message waits in the accumulation buffer */
+UINT64 MessageBufferFlushDeadline;
+
+/* The subscribers (the ID of each one is its index + 1) */
+LOG_SUBSCRIBER LogSubscribers[LOG_MAXIMUM_SUBSCRIBERS];
+
+/* The filter of the default rings (if LogDefaultRingsFiltered) */
+LOG_SUBSCRIPTION_FILTER LogDefaultRingsFilter;
+volatile BOOLEAN        LogDefaultRingsFiltered;
+
+/* Count of the active subscribers and the filter of the default rings (the producers skip routing if it's zero) */
+volatile LONG LogActiveSubscriptions;
+
+/* Serializes the changes of the subscriptions (a guarded mutex keeps us in PASSIVE_LEVEL for broadcasting) */
+KGUARDED_MUTEX LogSubscriptionsMutex;
+
+//////////////////////////////////////////////////
+//					Constants					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief Get the index of the ring of a core in MessageBufferInformation
+ * 
+ */
+#define LOG_BUFFER_INDEX(CoreIndex, IsVmxRoot) (((CoreIndex)*2) + ((IsVmxRoot) ? 1 : 0))
 
 //////////////////////////////////////////////////
 //					Illustration				//
 //////////////////////////////////////////////////
 
 /*
-A core buffer is like this , it's divided into MaximumPacketsCapacity chucks,
-each chunk has PacketChunkSize + sizeof(BUFFER_HEADER) size
+Each core has two buffers (vmx-root and vmx non-root), the reader merges them
+based on the TimeStampCounter of the headers.
+
+A core buffer is like this, it has LogBufferSize bytes and it's filled with
+variable-length records, each record has LOG_RECORD_SIZE(BufferLength) size
+(aligned to LogRecordAlignment), the offset of the next record to read or to
+write is (SharedControl->ReadCount % LogBufferSize) or
+(SharedControl->WrittenCount % LogBufferSize)
 
 			 _________________________
 			|      BUFFER_HEADER      |
 			|_________________________|
-			|						  |
 			|           BODY		  |
-			|         (Buffer)		  |
-			| size = PacketChunkSize  |
-			|						  |
+			| size = BufferLength	  |
+			|_________________________|
+			|    (align to 8 bytes)   |
 			|_________________________|
 			|      BUFFER_HEADER      |
 			|_________________________|
 			|						  |
 			|           BODY		  |
-			|         (Buffer)		  |
-			| size = PacketChunkSize  |
+			| size = BufferLength	  |
 			|						  |
 			|_________________________|
 			|						  |
-			|						  |
-			|						  |
-			|						  |
 			|			.			  |
 			|			.			  |
 			|			.			  |
-			|						  |
-			|						  |
-			|						  |
-			|						  |
 			|_________________________|
 			|      BUFFER_HEADER      |
+			|  (OPERATION_LOG_PADDING)|
 			|_________________________|
-			|						  |
-			|           BODY		  |
-			|         (Buffer)		  |
-			| size = PacketChunkSize  |
-			|						  |
+			|  skipped tail (a record |
+			|  never wraps around)	  |
 			|_________________________|
 
 */
@@ -142,18 +265,96 @@ each chunk has PacketChunkSize + sizeof(BUFFER_HEADER) size
 BOOLEAN
 LogInitialize();
 VOID
+LogCalibrateTimeStampCounter();
+BOOLEAN
+LogSendTimeCalibration();
+VOID
 LogUnInitialize();
 BOOLEAN
 LogSendBuffer(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength);
 BOOLEAN
-LogReadBuffer(BOOLEAN IsVmxRoot, PVOID BufferToSaveMessage, UINT32 * ReturnedLength);
+LogWriteRecordToRing(PLOG_BUFFER_INFORMATION Ring, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength);
+BOOLEAN
+LogSendBufferToRing(PLOG_BUFFER_INFORMATION Ring, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength);
+UINT64
+LogGetRecordTag(UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength);
+BOOLEAN
+LogMatchSubscriptionFilter(PLOG_SUBSCRIPTION_FILTER Filter, ULONG CoreIndex, UINT32 OperationCode, UINT64 Tag);
+BOOLEAN
+LogRouteToSubscribers(ULONG CoreIndex, BOOLEAN IsVmxRoot, UINT32 OperationCode, PVOID Buffer, UINT32 BufferLength);
+PBUFFER_HEADER
+LogGetRingHeader(PLOG_BUFFER_INFORMATION Ring, UINT64 * ReadCount);
 BOOLEAN
-LogCheckForNewMessage(BOOLEAN IsVmxRoot);
+LogConsumeRingRecord(PLOG_BUFFER_INFORMATION Ring, UINT64 ReadCount, UINT64 Length);
+PLOG_BUFFER_INFORMATION
+LogFindOldestRing(PLOG_BUFFER_INFORMATION Rings);
+BOOLEAN
+LogReadBufferWithoutLock(PLOG_BUFFER_INFORMATION Rings, PVOID BufferToSaveMessage, UINT32 MaximumLength, UINT32 * ReturnedLength, UINT64 * TimeStampCounter, UINT32 * BufferIndex);
+BOOLEAN
+LogReadBuffer(PVOID BufferToSaveMessage, UINT32 * ReturnedLength);
+BOOLEAN
+LogReadBufferBatch(UINT32 SubscriberId, PVOID BufferToSaveMessages, UINT32 BufferLength, UINT32 * ReturnedLength);
+BOOLEAN
+LogCheckForNewMessage(UINT32 SubscriberId);
+PLOG_BUFFER_INFORMATION
+LogGetSubscriberRings(UINT32 SubscriberId);
+NTSTATUS
+LogSubscribe(PLOG_SUBSCRIPTION_REQUEST Request);
+VOID
+LogRemoveAllSubscriptions();
+VOID
+LogDpcBroadcastQuiesceProducers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
 BOOLEAN
 LogSendMessageToQueue(UINT32 OperationCode, BOOLEAN IsImmediateMessage, BOOLEAN ShowCurrentSystemTime, const char * Fmt, ...);
+BOOLEAN
+LogFlushNonImmediateBuffer(PLOG_BUFFER_INFORMATION Ring);
+VOID
+LogFlushCurrentCoreNonImmediateBuffers();
+VOID
+LogFlushCoreDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+LogFlushTimerCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+LogDpcBroadcastFlushNonImmediateBuffers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+BOOLEAN
+LogCountBinaryFormatArguments(const char * Fmt, UINT32 * ArgumentCount);
+VOID
+LogInvalidateBinaryFormats();
+LONG
+LogRegisterBinaryFormat(PLOG_BINARY_FORMAT_STATE FormatState, LONG CurrentFormatId, const char * Prefix, const char * FunctionName, UINT32 Line, const char * Fmt);
+BOOLEAN
+LogSendBinaryMessageToQueue(UINT32                   OperationCode,
+                            BOOLEAN                  IsImmediateMessage,
+                            BOOLEAN                  ShowCurrentSystemTime,
+                            PLOG_BINARY_FORMAT_STATE FormatState,
+                            const char *             Prefix,
+                            const char *             FunctionName,
+                            UINT32                   Line,
+                            const char *             Fmt,
+                            ...);
+VOID
+LogQueryBuffersStatistics(PLOG_BUFFERS_STATISTICS Statistics);
+NTSTATUS
+LogSetOverflowPolicy(LOG_BUFFER_OVERFLOW_POLICY Policy);
+VOID
+LogChangeRingUsermodeMapping(PLOG_BUFFER_INFORMATION Ring, PLOG_SHARED_RING_CONTROL SharedControl, BOOLEAN IsMapped);
+NTSTATUS
+LogMapBuffersToUsermode(PLOG_MAP_BUFFERS_REQUEST Request, PLOG_MAPPED_BUFFERS_INFORMATION MappedBuffers, KPROCESSOR_MODE RequestorMode);
+VOID
+LogUnmapBuffersFromUsermode();
+VOID
+LogDpcBroadcastChangeUsermodeMapping(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+LogSharedEventCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+LogNotifyPendingIrpsCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+LogCompleteAllPendingIrps();
+VOID
+LogCancelPendingIrp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 VOID
 LogNotifyUsermodeCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
 NTSTATUS
 LogRegisterEventBasedNotification(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS
-LogRegisterIrpBasedNotification(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+LogRegisterIrpBasedNotification(PDEVICE_OBJECT DeviceObject, PIRP Irp, NOTIFY_TYPE Type, UINT32 SubscriberId);
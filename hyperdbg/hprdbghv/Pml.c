@@ -0,0 +1,482 @@
+/**
+ * @file Pml.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Dirty page tracking based on the page-modification logging (PML)
+ * @details The dirty flags of EPT are cleared when the tracking is started (and
+ * after each reset), the first write to each page sets the dirty flag and the
+ * processor writes the guest physical address to the log of the core without
+ * vm-exit, the logs are moved to the bitmap of the dirty pages when they're
+ * full or when the bitmap is queried
+ * @version 0.1
+ * @date 2020-05-14
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "Msr.h"
+#include "Vmx.h"
+#include "Ept.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "HypervisorRoutines.h"
+#include "ExtensionCommands.h"
+#include "Dispatch.h"
+#include "Pml.h"
+
+/**
+ * @brief Initialize the dirty page tracking (the logs are allocated when it's started)
+ *
+ * @return VOID
+ */
+VOID
+PmlInitialize()
+{
+    PmlCoreLogs     = NULL;
+    PmlDirtyBitmap  = NULL;
+    PmlCountOfPages = 0;
+
+    ExInitializeFastMutex(&PmlMutex);
+}
+
+/**
+ * @brief Stop the dirty page tracking (if it's started) and free the logs
+ * @details Should be called in vmx non-root before terminating vmx
+ *
+ * @return VOID
+ */
+VOID
+PmlUnInitialize()
+{
+    PmlStop();
+}
+
+/**
+ * @brief Count of the physical pages that the bitmap should cover
+ * @details The pages after the last range of the physical memory are not
+ * mapped by EPT, so they're never dirty
+ *
+ * @return UINT64
+ */
+static UINT64
+PmlGetCountOfPhysicalPages()
+{
+    PPHYSICAL_MEMORY_RANGE Ranges;
+    UINT64                 HighestAddress = 0;
+
+    Ranges = MmGetPhysicalMemoryRanges();
+
+    if (!Ranges)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; Ranges[i].BaseAddress.QuadPart != 0 || Ranges[i].NumberOfBytes.QuadPart != 0; i++)
+    {
+        HighestAddress = max(HighestAddress, (UINT64)(Ranges[i].BaseAddress.QuadPart + Ranges[i].NumberOfBytes.QuadPart));
+    }
+
+    ExFreePool(Ranges);
+
+    //
+    // The identity page table only maps the first PML4 entry
+    //
+    HighestAddress = min(HighestAddress, (UINT64)VMM_EPT_PML3E_COUNT * SIZE_1_GB);
+
+    return HighestAddress / PAGE_SIZE;
+}
+
+/**
+ * @brief Clear the dirty flag of an entry that maps a page
+ * @details The processor sets the flag atomically, so the flag is cleared
+ * with an atomic operation
+ *
+ * @param Entry The entry (PML1, large PML2 or 1GB PML3)
+ * @return VOID
+ */
+static VOID
+PmlClearDirtyFlag(volatile UINT64 * Entry)
+{
+    if (*Entry & PML_EPT_ENTRY_DIRTY_FLAG)
+    {
+        InterlockedAnd64((volatile LONG64 *)Entry, ~PML_EPT_ENTRY_DIRTY_FLAG);
+    }
+}
+
+/**
+ * @brief Clear the dirty flags of the entries of a view that map a page
+ *
+ * @param PML3 The PML3 table of the view
+ * @param PML2 The PML2 table of each PML3 entry (NULL for 1GB pages)
+ * @return VOID
+ */
+static VOID
+PmlClearDirtyFlagsOfView(PEPT_PML3_POINTER PML3, PEPT_PML2_ENTRY * PML2)
+{
+    for (size_t i = 0; i < VMM_EPT_PML3E_COUNT; i++)
+    {
+        if (!PML2[i])
+        {
+            PmlClearDirtyFlag(&PML3[i].Flags);
+            continue;
+        }
+
+        for (size_t j = 0; j < VMM_EPT_PML2E_COUNT; j++)
+        {
+            PEPT_PML2_ENTRY Entry = &PML2[i][j];
+            PEPT_PML1_ENTRY PML1;
+
+            if (Entry->LargePage)
+            {
+                PmlClearDirtyFlag(&Entry->Flags);
+                continue;
+            }
+
+            PML1 = (PEPT_PML1_ENTRY)PhysicalAddressToVirtualAddress(((PEPT_PML2_POINTER)Entry)->PageFrameNumber * PAGE_SIZE);
+
+            for (size_t k = 0; k < VMM_EPT_PML1E_COUNT; k++)
+            {
+                PmlClearDirtyFlag(&PML1[k].Flags);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Clear the dirty flags of all the views, so the next write to each page is logged
+ * @details Should be called in vmx non-root, the cores should invalidate their
+ * EPT after that (the private tables of the views are also cleared)
+ *
+ * @return VOID
+ */
+static VOID
+PmlClearDirtyFlags()
+{
+    ULONG ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    PmlClearDirtyFlagsOfView(&g_EptState->EptPageTable->PML3[0], &g_EptState->EptPageTable->PML2[0]);
+
+    if (g_EptState->CoreViews)
+    {
+        for (size_t i = 0; i < ProcessorCount; i++)
+        {
+            PmlClearDirtyFlagsOfView(&g_EptState->CoreViews[i].PML3[0], &g_EptState->CoreViews[i].PML2[0]);
+        }
+    }
+
+    if (g_EptState->CleanView)
+    {
+        PmlClearDirtyFlagsOfView(&g_EptState->CleanView->PML3[0], &g_EptState->CleanView->PML2[0]);
+    }
+
+    if (g_EptState->DisarmedView)
+    {
+        PmlClearDirtyFlagsOfView(&g_EptState->DisarmedView->PML3[0], &g_EptState->DisarmedView->PML2[0]);
+    }
+}
+
+/**
+ * @brief Start tracking the dirty pages of all the cores
+ * @details If the tracking is already started, the bitmap is not changed
+ *
+ * @return NTSTATUS
+ */
+NTSTATUS
+PmlStart()
+{
+    ULONG  ProcessorCount = KeQueryActiveProcessorCount(0);
+    UINT64 CountOfPages;
+
+    if (!g_PmlSupport)
+    {
+        LogError("The page-modification logging is not supported");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // The physical memory ranges are queried in PASSIVE_LEVEL
+    //
+    CountOfPages = PmlGetCountOfPhysicalPages();
+
+    if (CountOfPages == 0)
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    ExAcquireFastMutex(&PmlMutex);
+
+    if (PmlCoreLogs)
+    {
+        ExReleaseFastMutex(&PmlMutex);
+        return STATUS_SUCCESS;
+    }
+
+    PmlDirtyBitmap = ExAllocatePoolWithTag(NonPagedPool, ((CountOfPages + 63) / 64) * sizeof(UINT64), POOLTAG);
+    PmlCoreLogs    = ExAllocatePoolWithTag(NonPagedPool, sizeof(PML_CORE_LOG) * ProcessorCount, POOLTAG);
+
+    if (!PmlDirtyBitmap || !PmlCoreLogs)
+    {
+        if (PmlDirtyBitmap)
+        {
+            ExFreePoolWithTag(PmlDirtyBitmap, POOLTAG);
+            PmlDirtyBitmap = NULL;
+        }
+
+        if (PmlCoreLogs)
+        {
+            ExFreePoolWithTag(PmlCoreLogs, POOLTAG);
+            PmlCoreLogs = NULL;
+        }
+
+        ExReleaseFastMutex(&PmlMutex);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(PmlDirtyBitmap, ((CountOfPages + 63) / 64) * sizeof(UINT64));
+    RtlZeroMemory(PmlCoreLogs, sizeof(PML_CORE_LOG) * ProcessorCount);
+
+    PmlCountOfPages = CountOfPages;
+
+    //
+    // The handler should be set before the first log is full
+    //
+    DispatchRegisterHandler(DEBUGGER_EVENT_APPLY_TO_ALL_CORES, EXIT_REASON_PML_FULL, PmlHandleVmexit);
+
+    //
+    // Enable the logging on all the cores, then clear the dirty flags so the
+    // pages that are dirtied before the logging are logged again
+    //
+    ExtensionCommandConfigureDirtyPageLogOnAllProcessors(TRUE);
+
+    PmlClearDirtyFlags();
+    HvNotifyAllToInvalidateEpt();
+
+    ExReleaseFastMutex(&PmlMutex);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Stop tracking the dirty pages and free the bitmap
+ *
+ * @return VOID
+ */
+VOID
+PmlStop()
+{
+    ExAcquireFastMutex(&PmlMutex);
+
+    if (PmlCoreLogs)
+    {
+        //
+        // Disable the logging on all the cores, after that no core writes to
+        // the logs or the bitmap
+        //
+        ExtensionCommandConfigureDirtyPageLogOnAllProcessors(FALSE);
+        DispatchUnregisterHandler(DEBUGGER_EVENT_APPLY_TO_ALL_CORES, EXIT_REASON_PML_FULL);
+
+        ExFreePoolWithTag(PmlCoreLogs, POOLTAG);
+        ExFreePoolWithTag(PmlDirtyBitmap, POOLTAG);
+
+        PmlCoreLogs     = NULL;
+        PmlDirtyBitmap  = NULL;
+        PmlCountOfPages = 0;
+    }
+
+    ExReleaseFastMutex(&PmlMutex);
+}
+
+/**
+ * @brief Enable or disable the page-modification logging of the current core
+ * @details Should be called in vmx-root
+ *
+ * @param CoreIndex Index of the current core
+ * @param Enable Whether to enable or disable the logging
+ * @return VOID
+ */
+VOID
+PmlConfigureLogging(UINT32 CoreIndex, BOOLEAN Enable)
+{
+    UINT32 SecondaryControls = 0;
+
+    __vmx_vmread(SECONDARY_VM_EXEC_CONTROL, &SecondaryControls);
+
+    if (Enable && PmlCoreLogs)
+    {
+        __vmx_vmwrite(PML_ADDRESS, VirtualAddressToPhysicalAddress(&PmlCoreLogs[CoreIndex].Entries[0]));
+        __vmx_vmwrite(GUEST_PML_INDEX, PML_ENTRIES_PER_CORE - 1);
+        __vmx_vmwrite(SECONDARY_VM_EXEC_CONTROL, HvAdjustControls(SecondaryControls | CPU_BASED_CTL2_ENABLE_PML, MSR_IA32_VMX_PROCBASED_CTLS2));
+    }
+    else
+    {
+        __vmx_vmwrite(SECONDARY_VM_EXEC_CONTROL, HvAdjustControls(SecondaryControls & ~CPU_BASED_CTL2_ENABLE_PML, MSR_IA32_VMX_PROCBASED_CTLS2));
+    }
+}
+
+/**
+ * @brief Set the bits of a range of pages in the bitmap
+ *
+ * @param FirstPage The first page
+ * @param CountOfPages Count of the pages
+ * @return VOID
+ */
+static VOID
+PmlMarkDirtyPages(UINT64 FirstPage, UINT64 CountOfPages)
+{
+    UINT64 LastPage = min(FirstPage + CountOfPages, PmlCountOfPages);
+
+    for (UINT64 Page = FirstPage; Page < LastPage;)
+    {
+        if ((Page % 64) == 0 && LastPage - Page >= 64)
+        {
+            InterlockedExchange64(&PmlDirtyBitmap[Page / 64], -1);
+            Page += 64;
+        }
+        else
+        {
+            InterlockedOr64(&PmlDirtyBitmap[Page / 64], 1LL << (Page % 64));
+            Page++;
+        }
+    }
+}
+
+/**
+ * @brief Move the page-modification log of the current core to the bitmap
+ * @details Should be called in vmx-root, the dirty flag of a large page is
+ * only set once, so all the pages of a large page are marked as dirty
+ *
+ * @param CoreIndex Index of the current core
+ * @return VOID
+ */
+VOID
+PmlFlushLog(UINT32 CoreIndex)
+{
+    UINT64          PmlIndex = 0;
+    PPML_CORE_LOG   Log;
+    PEPT_PML2_ENTRY LargePage;
+
+    if (!PmlCoreLogs || !PmlDirtyBitmap)
+    {
+        return;
+    }
+
+    Log = &PmlCoreLogs[CoreIndex];
+
+    __vmx_vmread(GUEST_PML_INDEX, &PmlIndex);
+
+    //
+    // The index is the next entry to write, it's 0xffff when the log is full
+    //
+    PmlIndex = (PmlIndex & 0xffff) >= PML_ENTRIES_PER_CORE ? 0 : (PmlIndex & 0xffff) + 1;
+
+    for (UINT64 i = PmlIndex; i < PML_ENTRIES_PER_CORE; i++)
+    {
+        SIZE_T PhysicalAddress = Log->Entries[i];
+
+        LargePage = EptGetPml2Entry(g_EptState->EptPageTable, PhysicalAddress);
+
+        if (!LargePage)
+        {
+            PmlMarkDirtyPages((PhysicalAddress & ~(SIZE_1_GB - 1)) / PAGE_SIZE, SIZE_1_GB / PAGE_SIZE);
+        }
+        else if (LargePage->LargePage)
+        {
+            PmlMarkDirtyPages((PhysicalAddress & ~(SIZE_2_MB - 1)) / PAGE_SIZE, SIZE_2_MB / PAGE_SIZE);
+        }
+        else
+        {
+            PmlMarkDirtyPages(PhysicalAddress / PAGE_SIZE, 1);
+        }
+    }
+
+    __vmx_vmwrite(GUEST_PML_INDEX, PML_ENTRIES_PER_CORE - 1);
+}
+
+/**
+ * @brief Handler of the vm-exits of the full page-modification logs
+ *
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID
+ */
+VOID
+PmlHandleVmexit(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    PmlFlushLog(CoreIndex);
+
+    //
+    // The write that caused the vm-exit is not performed yet
+    //
+    g_GuestState[CoreIndex].IncrementRip = FALSE;
+}
+
+/**
+ * @brief Copy the bitmap of the dirty pages to the result of IOCTL_QUERY_DIRTY_PAGES
+ * @details The logs of all the cores are moved to the bitmap first, if it's
+ * reset then the dirty flags are cleared before that, so a page that is written
+ * later is either in this result or in the next one
+ *
+ * @param Result The header of the output buffer (the bitmap follows it)
+ * @param OutputBufferLength Size of the output buffer
+ * @param Reset Clear the bitmap after reading it
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+PmlQueryDirtyPages(PDIRTY_PAGE_BITMAP Result, UINT32 OutputBufferLength, BOOLEAN Reset, PUINT32 ReturnedLength)
+{
+    UINT64 * Bitmap = (UINT64 *)((UINT64)Result + sizeof(DIRTY_PAGE_BITMAP));
+    UINT64   CountOfWords;
+
+    RtlZeroMemory(Result, sizeof(DIRTY_PAGE_BITMAP));
+    *ReturnedLength = sizeof(DIRTY_PAGE_BITMAP);
+
+    ExAcquireFastMutex(&PmlMutex);
+
+    if (!PmlCoreLogs)
+    {
+        ExReleaseFastMutex(&PmlMutex);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    CountOfWords         = (PmlCountOfPages + 63) / 64;
+    Result->CountOfPages = PmlCountOfPages;
+
+    if (OutputBufferLength < sizeof(DIRTY_PAGE_BITMAP) + CountOfWords * sizeof(UINT64))
+    {
+        //
+        // Only the size of the bitmap is reported
+        //
+        ExReleaseFastMutex(&PmlMutex);
+        return STATUS_SUCCESS;
+    }
+
+    if (Reset)
+    {
+        PmlClearDirtyFlags();
+        HvNotifyAllToInvalidateEpt();
+    }
+
+    ExtensionCommandFlushDirtyPageLogOnAllProcessors();
+
+    for (UINT64 i = 0; i < CountOfWords; i++)
+    {
+        UINT64 Word = Reset ? InterlockedExchange64(&PmlDirtyBitmap[i], 0) : PmlDirtyBitmap[i];
+
+        Bitmap[i] = Word;
+
+        while (Word)
+        {
+            Word &= Word - 1;
+            Result->CountOfDirtyPages++;
+        }
+    }
+
+    ExReleaseFastMutex(&PmlMutex);
+
+    Result->IsBitmapIncluded = TRUE;
+    *ReturnedLength          = (UINT32)(sizeof(DIRTY_PAGE_BITMAP) + CountOfWords * sizeof(UINT64));
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file Pml.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the dirty page tracking (page-modification logging)
+ * @details
+ * @version 0.1
+ * @date 2020-05-14
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* Count of the entries of the page-modification log of each core */
+#define PML_ENTRIES_PER_CORE 512
+
+/* Dirty flag of the EPT entries that map a page (bit 9) */
+#define PML_EPT_ENTRY_DIRTY_FLAG (1ULL << 9)
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The page-modification log of each core
+ * @details The processor writes the guest physical addresses from the last
+ * entry to the first one, GUEST_PML_INDEX is the next entry to write
+ *
+ */
+typedef struct _PML_CORE_LOG
+{
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    UINT64 Entries[PML_ENTRIES_PER_CORE];
+
+} PML_CORE_LOG, *PPML_CORE_LOG;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Logs of the cores (one for each core, null if the tracking is not started) */
+PML_CORE_LOG * PmlCoreLogs;
+
+/* Bitmap of the dirty pages (bit i of word j is the page j * 64 + i) */
+volatile LONG64 * PmlDirtyBitmap;
+
+/* Count of the physical pages of PmlDirtyBitmap */
+UINT64 PmlCountOfPages;
+
+/* Serializes the start, stop and queries of the tracking */
+FAST_MUTEX PmlMutex;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+PmlInitialize();
+VOID
+PmlUnInitialize();
+NTSTATUS
+PmlStart();
+VOID
+PmlStop();
+VOID
+PmlConfigureLogging(UINT32 CoreIndex, BOOLEAN Enable);
+VOID
+PmlFlushLog(UINT32 CoreIndex);
+
+VOID
+PmlHandleVmexit(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason);
+NTSTATUS
+PmlQueryDirtyPages(PDIRTY_PAGE_BITMAP Result, UINT32 OutputBufferLength, BOOLEAN Reset, PUINT32 ReturnedLength);
@@ -30,14 +30,30 @@ PoolManagerInitialize()
     //
     // Allocate global requesting variable
     //
-    RequestNewAllocation = ExAllocatePoolWithTag(NonPagedPool, sizeof(REQUEST_NEW_ALLOCATION), POOLTAG);
+    RequestNewAllocation = ExAllocatePoolWithTag(NonPagedPool, sizeof(POOL_ALLOCATION_REQUEST_QUEUE), POOLTAG);
 
     if (!RequestNewAllocation)
     {
         LogError("Insufficient memory");
         return FALSE;
     }
-    RtlZeroMemory(RequestNewAllocation, sizeof(REQUEST_NEW_ALLOCATION));
+    RtlZeroMemory(RequestNewAllocation, sizeof(POOL_ALLOCATION_REQUEST_QUEUE));
+
+    //
+    // All the slots are free
+    //
+    for (LONG i = 0; i < POOL_MANAGER_REQUEST_QUEUE_SIZE; i++)
+    {
+        RequestNewAllocation->Requests[i].Sequence = i;
+    }
+
+    ExInitializeFastMutex(&LockForPerformingAllocation);
+
+    //
+    // Every hook and split of any core might take the lock of the pools, so
+    // it's fair and its contention is counted
+    //
+    TicketSpinlockInitialize(&LockForReadingPool, TRUE);
 
     ListOfAllocatedPoolsHead = ExAllocatePoolWithTag(NonPagedPool, sizeof(LIST_ENTRY), POOLTAG);
 
@@ -53,6 +69,37 @@ PoolManagerInitialize()
     //
     InitializeListHead(ListOfAllocatedPoolsHead);
 
+    RtlZeroMemory(FreePoolsOfIntentions, sizeof(FreePoolsOfIntentions));
+
+    for (UINT32 i = 0; i < POOL_INTENTIONS_COUNT; i++)
+    {
+        InitializeListHead(&FreePoolsOfIntentions[i].FreePoolsHead);
+        FreePoolsOfIntentions[i].LowWatermark  = POOL_MANAGER_DEFAULT_LOW_WATERMARK;
+        FreePoolsOfIntentions[i].HighWatermark = POOL_MANAGER_DEFAULT_HIGH_WATERMARK;
+    }
+
+    //
+    // The replenishment is queued from vmx-root with a DPC, then the DPC
+    // queues a work item to allocate in PASSIVE_LEVEL
+    //
+    KeInitializeDpc(&PoolReplenishmentDpc, PoolManagerReplenishmentDpcCallback, NULL);
+    ExInitializeWorkItem(&PoolReplenishmentWorkItem, PoolManagerReplenishmentWorkItemCallback, NULL);
+
+    IsPoolReplenishmentQueued = 0;
+    CountOfPoolReplenishments = 0;
+
+    //
+    // Allocate the magazines of the cores
+    //
+    PoolMagazines = ExAllocatePoolWithTag(NonPagedPool, sizeof(POOL_MAGAZINE) * POOL_INTENTIONS_COUNT * KeQueryActiveProcessorCount(0), POOLTAG);
+
+    if (!PoolMagazines)
+    {
+        LogError("Insufficient memory");
+        return FALSE;
+    }
+    RtlZeroMemory(PoolMagazines, sizeof(POOL_MAGAZINE) * POOL_INTENTIONS_COUNT * KeQueryActiveProcessorCount(0));
+
     //
     // Request pages to be allocated for converting 2MB to 4KB pages
     //
@@ -64,15 +111,26 @@ PoolManagerInitialize()
     PoolManagerRequestAllocation(sizeof(EPT_HOOKED_PAGE_DETAIL), 10, TRACKING_HOOKED_PAGES);
 
     //
-    // Request pages to be allocated for Trampoline of Executable hooked pages
+    // Request pages to be allocated for the arena of the trampolines of
+    // executable hooked pages (each page has TRAMPOLINE_SLOTS_PER_PAGE trampolines)
     //
-    PoolManagerRequestAllocation(MAX_EXEC_TRAMPOLINE_SIZE, 10, EXEC_TRAMPOLINE);
+    PoolManagerRequestAllocation(PAGE_SIZE, 2, EXEC_TRAMPOLINE);
 
     //
     // Request pages to be allocated for detour hooked pages details
     //
     PoolManagerRequestAllocation(sizeof(HIDDEN_HOOKS_DETOUR_DETAILS), 10, DETOUR_HOOK_DETAILS);
 
+    //
+    // Request pages to be allocated for the private PML2 tables of the core views
+    //
+    PoolManagerRequestAllocation(sizeof(VMM_EPT_PML2_TABLE), 10, EPT_CORE_VIEW_PML2_TABLE);
+
+    //
+    // Request pages to be allocated for converting 1GB to 2MB pages
+    //
+    PoolManagerRequestAllocation(sizeof(VMM_EPT_PML2_TABLE), 10, SPLIT_1GB_PAGING_TO_2MB_PAGE);
+
     //
     // Let's start the allocations
     //
@@ -87,9 +145,23 @@ PoolManagerInitialize()
 VOID
 PoolManagerUninitialize()
 {
-    PLIST_ENTRY ListTemp = 0;
-    UINT64      Address  = 0;
-    ListTemp             = ListOfAllocatedPoolsHead;
+    PLIST_ENTRY   ListTemp = 0;
+    UINT64        Address  = 0;
+    LARGE_INTEGER Interval;
+    ListTemp               = ListOfAllocatedPoolsHead;
+
+    //
+    // Wait for the queued replenishment, then keep the flag so no other
+    // replenishment is queued
+    //
+    KeFlushQueuedDpcs();
+
+    Interval.QuadPart = -10 * 1000 * 10; // 10 milliseconds
+
+    while (InterlockedCompareExchange(&IsPoolReplenishmentQueued, 1, 0) != 0)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+    }
 
     while (ListOfAllocatedPoolsHead != ListTemp->Flink)
     {
@@ -113,12 +185,93 @@ PoolManagerUninitialize()
 
     ExFreePoolWithTag(ListOfAllocatedPoolsHead, POOLTAG);
     ExFreePoolWithTag(RequestNewAllocation, POOLTAG);
+    ExFreePoolWithTag(PoolMagazines, POOLTAG);
+}
+
+/**
+ * @brief Queue a replenishment of the pools
+ * @details Can be called from vmx-root, only one replenishment is queued at a time
+ * 
+ * @return VOID
+ */
+static VOID
+PoolManagerQueueReplenishment()
+{
+    IsNewRequestForAllocationRecieved = TRUE;
+
+    if (InterlockedCompareExchange(&IsPoolReplenishmentQueued, 1, 0) == 0)
+    {
+        KeInsertQueueDpc(&PoolReplenishmentDpc, NULL, NULL);
+    }
+}
+
+/**
+ * @brief Queue the replenishment work item
+ * 
+ * @param Dpc 
+ * @param DeferredContext 
+ * @param SystemArgument1 
+ * @param SystemArgument2 
+ * @return VOID 
+ */
+VOID
+PoolManagerReplenishmentDpcCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    ExQueueWorkItem(&PoolReplenishmentWorkItem, DelayedWorkQueue);
+}
+
+/**
+ * @brief Perform the queued replenishment in PASSIVE_LEVEL
+ * 
+ * @param Parameter 
+ * @return VOID 
+ */
+VOID
+PoolManagerReplenishmentWorkItemCallback(PVOID Parameter)
+{
+    PoolManagerCheckAndPerformAllocation();
+
+    InterlockedIncrement(&CountOfPoolReplenishments);
+    InterlockedExchange(&IsPoolReplenishmentQueued, 0);
+}
+
+/**
+ * @brief Move some of the free pools of an intention to the magazine of the current core
+ * @details Should be called in vmx-root, at most half of the free pools are
+ * moved so the other cores can also find free pools
+ * 
+ * @param Magazine The magazine of the current core
+ * @param Intention The intention of the magazine
+ * @return VOID
+ */
+static VOID
+PoolManagerRefillMagazine(PPOOL_MAGAZINE Magazine, POOL_ALLOCATION_INTENTION Intention)
+{
+    PPOOL_FREE_LIST FreeList = &FreePoolsOfIntentions[Intention];
+    UINT32          Count;
+
+    TicketSpinlockLock(&LockForReadingPool);
+
+    Count = min((FreeList->CountOfFreePools + 1) / 2, POOL_MANAGER_MAGAZINE_SIZE - Magazine->CountOfPools);
+
+    for (UINT32 i = 0; i < Count; i++)
+    {
+        PLIST_ENTRY Entry = RemoveHeadList(&FreeList->FreePoolsHead);
+
+        Magazine->Pools[Magazine->CountOfPools++] = CONTAINING_RECORD(Entry, POOL_TABLE, FreeList);
+    }
+
+    FreeList->CountOfFreePools -= Count;
+
+    TicketSpinlockUnlock(&LockForReadingPool);
 }
 
 /**
  * @brief This function should be called from vmx-root in order to get a pool from the list
  * @details If RequestNewPool is TRUE then Size is used, otherwise Size is useless
- * Note : Most of the times this function called from vmx root but not all the time
+ * Note : Most of the times this function called from vmx root but not all the time,
+ * in vmx-root the pool is popped from the magazine of the current core without
+ * any lock, otherwise it's popped from the free list of the intention
  * 
  * @param Intention The intention why we need this pool for (buffer tag)
  * @param RequestNewPool Create a request to allocate a new pool with the same size, next time
@@ -129,30 +282,68 @@ PoolManagerUninitialize()
 UINT64
 PoolManagerRequestPool(POOL_ALLOCATION_INTENTION Intention, BOOLEAN RequestNewPool, UINT32 Size)
 {
-    PLIST_ENTRY ListTemp = 0;
-    UINT64      Address  = 0;
-    ListTemp             = ListOfAllocatedPoolsHead;
+    PPOOL_TABLE PoolTable = NULL;
+    UINT64      Address   = 0;
+    ULONG       CurrentCore;
 
-    SpinlockLock(&LockForReadingPool);
+    if ((UINT32)Intention >= POOL_INTENTIONS_COUNT)
+    {
+        return 0;
+    }
 
-    while (ListOfAllocatedPoolsHead != ListTemp->Flink)
+    CurrentCore = KeGetCurrentProcessorNumber();
+
+    if (g_GuestState[CurrentCore].IsOnVmxRootMode)
     {
-        ListTemp = ListTemp->Flink;
+        PPOOL_MAGAZINE Magazine = &PoolMagazines[CurrentCore * POOL_INTENTIONS_COUNT + Intention];
 
+        if (Magazine->CountOfPools == 0)
+        {
+            PoolManagerRefillMagazine(Magazine, Intention);
+        }
+
+        if (Magazine->CountOfPools != 0)
+        {
+            PoolTable = Magazine->Pools[--Magazine->CountOfPools];
+        }
+    }
+    else
+    {
         //
-        // Get the head of the record
+        // The magazines are only used in vmx-root, as a thread in vmx non-root
+        // might be interrupted by the vmx-root of the same core
         //
-        PPOOL_TABLE PoolTable = (PPOOL_TABLE)CONTAINING_RECORD(ListTemp, POOL_TABLE, PoolsList);
+        TicketSpinlockLock(&LockForReadingPool);
 
-        if (PoolTable->Intention == Intention && PoolTable->IsBusy == FALSE)
+        if (!IsListEmpty(&FreePoolsOfIntentions[Intention].FreePoolsHead))
         {
-            PoolTable->IsBusy = TRUE;
-            Address           = PoolTable->Address;
-            break;
+            PoolTable = CONTAINING_RECORD(RemoveHeadList(&FreePoolsOfIntentions[Intention].FreePoolsHead), POOL_TABLE, FreeList);
+            FreePoolsOfIntentions[Intention].CountOfFreePools--;
         }
+
+        TicketSpinlockUnlock(&LockForReadingPool);
     }
 
-    SpinlockUnlock(&LockForReadingPool);
+    if (PoolTable)
+    {
+        PoolTable->IsBusy = TRUE;
+        Address           = PoolTable->Address;
+
+        InterlockedIncrement(&FreePoolsOfIntentions[Intention].CountOfBusyPools);
+        InterlockedIncrement(&FreePoolsOfIntentions[Intention].CountOfConsumedPools);
+    }
+    else
+    {
+        InterlockedIncrement(&FreePoolsOfIntentions[Intention].CountOfFailedRequests);
+    }
+
+    //
+    // The free list is read without the lock, it's only a hint
+    //
+    if (FreePoolsOfIntentions[Intention].CountOfFreePools < FreePoolsOfIntentions[Intention].LowWatermark)
+    {
+        PoolManagerQueueReplenishment();
+    }
 
     //
     // Check if we need additional pools e.g another pool or the pool
@@ -169,9 +360,92 @@ PoolManagerRequestPool(POOL_ALLOCATION_INTENTION Intention, BOOLEAN RequestNewPo
     return Address;
 }
 
+/**
+ * @brief This function should be called from vmx-root in order to return a pool to the pool manager
+ * @details The pool is not reused, it's de-allocated next time that it's safe to
+ * deallocate (PoolManagerCheckAndPerformAllocation)
+ * 
+ * @param AddressToFree The address that is returned by PoolManagerRequestPool
+ * @return BOOLEAN Returns false if the address is not in the pool table
+ */
+BOOLEAN
+PoolManagerFreePool(UINT64 AddressToFree)
+{
+    PLIST_ENTRY ListTemp = 0;
+    BOOLEAN     Result   = FALSE;
+    ListTemp             = ListOfAllocatedPoolsHead;
+
+    TicketSpinlockLock(&LockForReadingPool);
+
+    while (ListOfAllocatedPoolsHead != ListTemp->Flink)
+    {
+        ListTemp = ListTemp->Flink;
+
+        //
+        // Get the head of the record
+        //
+        PPOOL_TABLE PoolTable = (PPOOL_TABLE)CONTAINING_RECORD(ListTemp, POOL_TABLE, PoolsList);
+
+        if (PoolTable->Address == AddressToFree)
+        {
+            PoolTable->ShouldBeFreed = TRUE;
+            Result                   = TRUE;
+
+            InterlockedDecrement(&FreePoolsOfIntentions[PoolTable->Intention].CountOfBusyPools);
+            break;
+        }
+    }
+
+    TicketSpinlockUnlock(&LockForReadingPool);
+
+    if (Result)
+    {
+        //
+        // Let the allocator (PASSIVE_LEVEL) to free the pool
+        //
+        IsNewRequestForAllocationRecieved = TRUE;
+    }
+
+    return Result;
+}
+
+/**
+ * @brief De-allocate the pools that are marked to be freed
+ * @details This function should be called from PASSIVE_LEVEL
+ * 
+ * @return VOID 
+ */
+VOID
+PoolManagerFreeReturnedPools()
+{
+    PLIST_ENTRY ListTemp = ListOfAllocatedPoolsHead->Flink;
+
+    while (ListOfAllocatedPoolsHead != ListTemp)
+    {
+        //
+        // Get the head of the record
+        //
+        PPOOL_TABLE PoolTable = (PPOOL_TABLE)CONTAINING_RECORD(ListTemp, POOL_TABLE, PoolsList);
+
+        ListTemp = ListTemp->Flink;
+
+        if (PoolTable->ShouldBeFreed)
+        {
+            TicketSpinlockLock(&LockForReadingPool);
+            RemoveEntryList(&PoolTable->PoolsList);
+            FreePoolsOfIntentions[PoolTable->Intention].CountOfPools--;
+            TicketSpinlockUnlock(&LockForReadingPool);
+
+            ExFreePoolWithTag(PoolTable->Address, POOLTAG);
+            ExFreePoolWithTag(PoolTable, POOLTAG);
+        }
+    }
+}
+
 /**
  * @brief Allocate the new pools and add them to pool table
- * @details This function doesn't need lock as it just calls once from PASSIVE_LEVEL
+ * @details This function should be called from PASSIVE_LEVEL, the lists are
+ * locked as vmx-root might be reading them
  * 
  * @param Size Size of each chunk
  * @param Count Count of chunks
@@ -182,6 +456,11 @@ PoolManagerRequestPool(POOL_ALLOCATION_INTENTION Intention, BOOLEAN RequestNewPo
 BOOLEAN
 PoolManagerAllocateAndAddToPoolTable(SIZE_T Size, UINT32 Count, POOL_ALLOCATION_INTENTION Intention)
 {
+    if ((UINT32)Intention >= POOL_INTENTIONS_COUNT)
+    {
+        return FALSE;
+    }
+
     for (size_t i = 0; i < Count; i++)
     {
         POOL_TABLE * SinglePool = ExAllocatePoolWithTag(NonPagedPool, sizeof(POOL_TABLE), POOLTAG);
@@ -213,14 +492,74 @@ PoolManagerAllocateAndAddToPoolTable(SIZE_T Size, UINT32 Count, POOL_ALLOCATION_
         SinglePool->Size          = Size;
 
         //
-        // Add it to the list
+        // Add it to the list and the free list of its intention
         //
+        TicketSpinlockLock(&LockForReadingPool);
+
         InsertHeadList(ListOfAllocatedPoolsHead, &(SinglePool->PoolsList));
+        InsertTailList(&FreePoolsOfIntentions[Intention].FreePoolsHead, &(SinglePool->FreeList));
+        FreePoolsOfIntentions[Intention].CountOfFreePools++;
+        FreePoolsOfIntentions[Intention].CountOfPools++;
+        FreePoolsOfIntentions[Intention].Size = Size;
+
+        TicketSpinlockUnlock(&LockForReadingPool);
     }
+
+    return TRUE;
+}
+
+/**
+ * @brief Adapt the watermarks of the intentions to their consumption and
+ * allocate the pools of the intentions that are below their low watermark
+ * @details Should be called in PASSIVE_LEVEL by the allocator
+ * 
+ * @return BOOLEAN FALSE if any of the allocations failed
+ */
+static BOOLEAN
+PoolManagerReplenishPools()
+{
+    BOOLEAN Result = TRUE;
+
+    for (UINT32 i = 0; i < POOL_INTENTIONS_COUNT; i++)
+    {
+        PPOOL_FREE_LIST FreeList = &FreePoolsOfIntentions[i];
+        UINT32          Consumed;
+
+        if (FreeList->Size == 0 || FreeList->CountOfFreePools >= FreeList->LowWatermark)
+        {
+            continue;
+        }
+
+        //
+        // The high watermark moves toward twice of the consumption since the
+        // previous replenishment, so the next burst of the same size is served
+        //
+        Consumed                = InterlockedExchange(&FreeList->CountOfConsumedPools, 0);
+        FreeList->HighWatermark = (FreeList->HighWatermark + Consumed * 2) / 2;
+        FreeList->HighWatermark = max(FreeList->HighWatermark, POOL_MANAGER_DEFAULT_HIGH_WATERMARK);
+        FreeList->HighWatermark = min(FreeList->HighWatermark, POOL_MANAGER_MAXIMUM_HIGH_WATERMARK);
+        FreeList->LowWatermark  = FreeList->HighWatermark / 2;
+
+        if (FreeList->CountOfFreePools < FreeList->HighWatermark)
+        {
+            Consumed = FreeList->HighWatermark - FreeList->CountOfFreePools;
+
+            if (!PoolManagerAllocateAndAddToPoolTable(FreeList->Size, Consumed, i))
+            {
+                Result = FALSE;
+            }
+
+            FreeList->CountOfReplenishedPools += Consumed;
+        }
+    }
+
+    return Result;
 }
 
 /**
  * @brief This function performs allocations from VMX non-root based on RequestNewAllocation
+ * @details The queue is drained in one batch and the requests of the same
+ * intention and size are merged before allocating them
  * 
  * @return BOOLEAN If the the pool manager allocates buffer or there was no buffer to allocate
  * then it returns true, if there was any error then it returns false
@@ -228,7 +567,10 @@ PoolManagerAllocateAndAddToPoolTable(SIZE_T Size, UINT32 Count, POOL_ALLOCATION_
 BOOLEAN
 PoolManagerCheckAndPerformAllocation()
 {
-    BOOLEAN Result = TRUE;
+    POOL_ALLOCATION_REQUEST  Merged[POOL_MANAGER_REQUEST_QUEUE_SIZE];
+    UINT32                   CountOfMerged = 0;
+    PPOOL_ALLOCATION_REQUEST Request;
+    BOOLEAN                  Result = TRUE;
 
     //
     // let's make sure we're on vmx non-root and also we have new allocation
@@ -243,124 +585,80 @@ PoolManagerCheckAndPerformAllocation()
 
     PAGED_CODE();
 
-    if (RequestNewAllocation->Size0 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size0, RequestNewAllocation->Count0, RequestNewAllocation->Intention0);
+    ExAcquireFastMutex(&LockForPerformingAllocation);
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count0     = 0;
-        RequestNewAllocation->Intention0 = 0;
-        RequestNewAllocation->Size0      = 0;
-    }
-    if (RequestNewAllocation->Size1 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size1, RequestNewAllocation->Count1, RequestNewAllocation->Intention1);
+    //
+    // Cleared before draining, so a request that is pushed during the drain
+    // is either drained now or signals the next call
+    //
+    IsNewRequestForAllocationRecieved = FALSE;
+    _ReadWriteBarrier();
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count1     = 0;
-        RequestNewAllocation->Intention1 = 0;
-        RequestNewAllocation->Size1      = 0;
-    }
-    if (RequestNewAllocation->Size2 != 0)
+    while (TRUE)
     {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size2, RequestNewAllocation->Count2, RequestNewAllocation->Intention2);
+        Request = &RequestNewAllocation->Requests[RequestNewAllocation->DequeuePosition & (POOL_MANAGER_REQUEST_QUEUE_SIZE - 1)];
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count2     = 0;
-        RequestNewAllocation->Intention2 = 0;
-        RequestNewAllocation->Size2      = 0;
-    }
+        if (Request->Sequence != RequestNewAllocation->DequeuePosition + 1)
+        {
+            //
+            // The queue is empty (or the next request is not filled yet)
+            //
+            break;
+        }
 
-    if (RequestNewAllocation->Size3 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size3, RequestNewAllocation->Count3, RequestNewAllocation->Intention3);
+        for (UINT32 i = 0; i <= CountOfMerged; i++)
+        {
+            if (i == CountOfMerged)
+            {
+                Merged[CountOfMerged++] = *Request;
+                break;
+            }
+
+            if (Merged[i].Intention == Request->Intention && Merged[i].Size == Request->Size)
+            {
+                Merged[i].Count += Request->Count;
+                break;
+            }
+        }
 
         //
-        // Free the data for future use
+        // Free the slot for the next round of the queue
         //
-
-        RequestNewAllocation->Count3     = 0;
-        RequestNewAllocation->Intention3 = 0;
-        RequestNewAllocation->Size3      = 0;
+        InterlockedExchange(&Request->Sequence, RequestNewAllocation->DequeuePosition + POOL_MANAGER_REQUEST_QUEUE_SIZE);
+        RequestNewAllocation->DequeuePosition++;
     }
-    if (RequestNewAllocation->Size4 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size4, RequestNewAllocation->Count4, RequestNewAllocation->Intention4);
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count4     = 0;
-        RequestNewAllocation->Intention4 = 0;
-        RequestNewAllocation->Size4      = 0;
-    }
-    if (RequestNewAllocation->Size5 != 0)
+    for (UINT32 i = 0; i < CountOfMerged; i++)
     {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size5, RequestNewAllocation->Count5, RequestNewAllocation->Intention5);
-
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count5     = 0;
-        RequestNewAllocation->Intention5 = 0;
-        RequestNewAllocation->Size5      = 0;
+        if (!PoolManagerAllocateAndAddToPoolTable(Merged[i].Size, Merged[i].Count, Merged[i].Intention))
+        {
+            Result = FALSE;
+        }
     }
-    if (RequestNewAllocation->Size6 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size6, RequestNewAllocation->Count6, RequestNewAllocation->Intention6);
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count6     = 0;
-        RequestNewAllocation->Intention6 = 0;
-        RequestNewAllocation->Size6      = 0;
-    }
-    if (RequestNewAllocation->Size7 != 0)
+    //
+    // Fill the intentions that are still below their low watermark
+    //
+    if (!PoolManagerReplenishPools())
     {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size7, RequestNewAllocation->Count7, RequestNewAllocation->Intention7);
-
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count7     = 0;
-        RequestNewAllocation->Intention7 = 0;
-        RequestNewAllocation->Size7      = 0;
+        Result = FALSE;
     }
-    if (RequestNewAllocation->Size8 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size8, RequestNewAllocation->Count8, RequestNewAllocation->Intention8);
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count8     = 0;
-        RequestNewAllocation->Intention8 = 0;
-        RequestNewAllocation->Size8      = 0;
-    }
-    if (RequestNewAllocation->Size9 != 0)
-    {
-        Result = PoolManagerAllocateAndAddToPoolTable(RequestNewAllocation->Size9, RequestNewAllocation->Count9, RequestNewAllocation->Intention9);
+    //
+    // Free the pools that are returned from vmx-root
+    //
+    PoolManagerFreeReturnedPools();
+
+    ExReleaseFastMutex(&LockForPerformingAllocation);
 
-        //
-        // Free the data for future use
-        //
-        RequestNewAllocation->Count9     = 0;
-        RequestNewAllocation->Intention9 = 0;
-        RequestNewAllocation->Size9      = 0;
-    }
-    IsNewRequestForAllocationRecieved = FALSE;
     return Result;
 }
 
 /**
  * @brief Request to allocate new buffers
+ * @details Lock-free, so it can be called from vmx-root of any core at the
+ * same time, a slot is reserved by moving the enqueue position and the
+ * request is published by its sequence
  * 
  * @param Size Request new buffer to allocate 
  * @param Count Count of chunks
@@ -370,84 +668,98 @@ PoolManagerCheckAndPerformAllocation()
 BOOLEAN
 PoolManagerRequestAllocation(SIZE_T Size, UINT32 Count, POOL_ALLOCATION_INTENTION Intention)
 {
-    //
-    // ******** We check to find a free place to store ********
-    //
-
-    SpinlockLock(&LockForRequestAllocation);
+    PPOOL_ALLOCATION_REQUEST Request;
+    LONG                     Position;
 
-    if (RequestNewAllocation->Size0 == 0)
-    {
-        RequestNewAllocation->Count0     = Count;
-        RequestNewAllocation->Intention0 = Intention;
-        RequestNewAllocation->Size0      = Size;
-    }
-    else if (RequestNewAllocation->Size1 == 0)
-    {
-        RequestNewAllocation->Count1     = Count;
-        RequestNewAllocation->Intention1 = Intention;
-        RequestNewAllocation->Size1      = Size;
-    }
-    else if (RequestNewAllocation->Size2 == 0)
-    {
-        RequestNewAllocation->Count2     = Count;
-        RequestNewAllocation->Intention2 = Intention;
-        RequestNewAllocation->Size2      = Size;
-    }
-    else if (RequestNewAllocation->Size3 == 0)
-    {
-        RequestNewAllocation->Count3     = Count;
-        RequestNewAllocation->Intention3 = Intention;
-        RequestNewAllocation->Size3      = Size;
-    }
-    else if (RequestNewAllocation->Size4 == 0)
-    {
-        RequestNewAllocation->Count4     = Count;
-        RequestNewAllocation->Intention4 = Intention;
-        RequestNewAllocation->Size4      = Size;
-    }
-    else if (RequestNewAllocation->Size5 == 0)
-    {
-        RequestNewAllocation->Count5     = Count;
-        RequestNewAllocation->Intention5 = Intention;
-        RequestNewAllocation->Size5      = Size;
-    }
-    else if (RequestNewAllocation->Size6 == 0)
-    {
-        RequestNewAllocation->Count6     = Count;
-        RequestNewAllocation->Intention6 = Intention;
-        RequestNewAllocation->Size6      = Size;
-    }
-    else if (RequestNewAllocation->Size7 == 0)
-    {
-        RequestNewAllocation->Count7     = Count;
-        RequestNewAllocation->Intention7 = Intention;
-        RequestNewAllocation->Size7      = Size;
-    }
-    else if (RequestNewAllocation->Size8 == 0)
+    if (Size == 0 || Count == 0)
     {
-        RequestNewAllocation->Count8     = Count;
-        RequestNewAllocation->Intention8 = Intention;
-        RequestNewAllocation->Size8      = Size;
-    }
-    else if (RequestNewAllocation->Size9 == 0)
-    {
-        RequestNewAllocation->Count9     = Count;
-        RequestNewAllocation->Intention9 = Intention;
-        RequestNewAllocation->Size9      = Size;
+        return FALSE;
     }
 
-    else
+    Position = RequestNewAllocation->EnqueuePosition;
+
+    while (TRUE)
     {
-        SpinlockUnlock(&LockForRequestAllocation);
-        return FALSE;
+        Request = &RequestNewAllocation->Requests[Position & (POOL_MANAGER_REQUEST_QUEUE_SIZE - 1)];
+
+        if (Request->Sequence == Position)
+        {
+            //
+            // The slot is free, try to reserve it
+            //
+            LONG Previous = InterlockedCompareExchange(&RequestNewAllocation->EnqueuePosition, Position + 1, Position);
+
+            if (Previous == Position)
+            {
+                break;
+            }
+
+            Position = Previous;
+        }
+        else if (Request->Sequence - Position < 0)
+        {
+            //
+            // The slot is not drained since the previous round, the queue is full
+            //
+            return FALSE;
+        }
+        else
+        {
+            //
+            // Another core reserved this slot
+            //
+            Position = RequestNewAllocation->EnqueuePosition;
+        }
     }
 
+    Request->Count     = Count;
+    Request->Intention = Intention;
+    Request->Size      = Size;
+
     //
-    // Signals to show that we have new allocations
+    // Publish the request, then signals to show that we have new allocations
     //
+    InterlockedExchange(&Request->Sequence, Position + 1);
+
     IsNewRequestForAllocationRecieved = TRUE;
 
-    SpinlockUnlock(&LockForRequestAllocation);
     return TRUE;
 }
+
+/**
+ * @brief Copy the counters and the watermarks of the intentions
+ * 
+ * @param Statistics The result of IOCTL_QUERY_POOL_STATISTICS
+ * @return VOID
+ */
+VOID
+PoolManagerQueryStatistics(PPOOL_MANAGER_STATISTICS Statistics)
+{
+    RtlZeroMemory(Statistics, sizeof(POOL_MANAGER_STATISTICS));
+
+    Statistics->CountOfIntentions     = min(POOL_INTENTIONS_COUNT, POOL_STATISTICS_MAXIMUM_INTENTIONS);
+    Statistics->CountOfReplenishments = CountOfPoolReplenishments;
+
+    TicketSpinlockLock(&LockForReadingPool);
+
+    for (UINT32 i = 0; i < Statistics->CountOfIntentions; i++)
+    {
+        PPOOL_FREE_LIST            FreeList  = &FreePoolsOfIntentions[i];
+        PPOOL_INTENTION_STATISTICS Intention = &Statistics->Intentions[i];
+
+        Intention->Size             = FreeList->Size;
+        Intention->ReplenishedPools = FreeList->CountOfReplenishedPools;
+        Intention->Pools            = FreeList->CountOfPools;
+        Intention->FreePools        = FreeList->CountOfFreePools;
+        Intention->BusyPools        = FreeList->CountOfBusyPools;
+        Intention->FailedRequests   = FreeList->CountOfFailedRequests;
+        Intention->LowWatermark     = FreeList->LowWatermark;
+        Intention->HighWatermark    = FreeList->HighWatermark;
+    }
+
+    Statistics->LockAcquisitions          = LockForReadingPool.Acquisitions;
+    Statistics->LockContendedAcquisitions = LockForReadingPool.ContendedAcquisitions;
+    Statistics->LockSpinCycles            = LockForReadingPool.SpinCycles;
+
+    TicketSpinlockUnlock(&LockForReadingPool);
+}
@@ -11,12 +11,29 @@
  */
 #pragma once
 #include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
 
 //////////////////////////////////////////////////
 //                   Definition	    			//
 //////////////////////////////////////////////////
 #define NumberOfPreAllocatedBuffers 10
 
+/* Count of the slots of the queue of the allocation requests (power of 2) */
+#define POOL_MANAGER_REQUEST_QUEUE_SIZE 64
+
+/* Count of the free pools that each core keeps for each intention */
+#define POOL_MANAGER_MAGAZINE_SIZE 8
+
+/* Free pools of an intention that causes a replenishment (before any consumption is observed) */
+#define POOL_MANAGER_DEFAULT_LOW_WATERMARK (NumberOfPreAllocatedBuffers / 2)
+
+/* Free pools of an intention after a replenishment (before any consumption is observed) */
+#define POOL_MANAGER_DEFAULT_HIGH_WATERMARK NumberOfPreAllocatedBuffers
+
+/* Maximum high watermark of an intention */
+#define POOL_MANAGER_MAXIMUM_HIGH_WATERMARK 512
+
 //////////////////////////////////////////////////
 //                    Enums		    			//
 //////////////////////////////////////////////////
@@ -30,10 +47,16 @@ typedef enum
     TRACKING_HOOKED_PAGES,
     EXEC_TRAMPOLINE,
     SPLIT_2MB_PAGING_TO_4KB_PAGE,
-    DETOUR_HOOK_DETAILS
+    DETOUR_HOOK_DETAILS,
+    EPT_CORE_VIEW_PML2_TABLE,
+    SPLIT_1GB_PAGING_TO_2MB_PAGE,
+    SPP_TABLE
 
 } POOL_ALLOCATION_INTENTION;
 
+/* Count of the intentions (the free lists are indexed by the intention) */
+#define POOL_INTENTIONS_COUNT (SPP_TABLE + 1)
+
 //////////////////////////////////////////////////
 //                   Structures		   			//
 //////////////////////////////////////////////////
@@ -48,83 +71,139 @@ typedef struct _POOL_TABLE
     SIZE_T                    Size;
     POOL_ALLOCATION_INTENTION Intention;
     LIST_ENTRY                PoolsList;
+    LIST_ENTRY                FreeList; // Links the pool in the free list of its intention (if it's free)
     BOOLEAN                   IsBusy;
     BOOLEAN                   ShouldBeFreed;
 
 } POOL_TABLE, *PPOOL_TABLE;
 
 /**
- * @brief Manage the requests for new allocations
+ * @brief The free pools of an intention and its replenishment state
+ * @details The watermarks adapt to the consumption between the replenishments
  * 
  */
-typedef struct _REQUEST_NEW_ALLOCATION
+typedef struct _POOL_FREE_LIST
 {
-    SIZE_T                    Size0;
-    UINT32                    Count0;
-    POOL_ALLOCATION_INTENTION Intention0;
-
-    SIZE_T                    Size1;
-    UINT32                    Count1;
-    POOL_ALLOCATION_INTENTION Intention1;
+    LIST_ENTRY    FreePoolsHead; // POOL_TABLE entries that are not given to anyone
+    UINT32        CountOfFreePools;
+    UINT32        CountOfPools;  // Count of all the pools of this intention
+    SIZE_T        Size;          // Size of the pools of this intention (zero if nothing is allocated)
+    UINT32        LowWatermark;  // A replenishment is queued if the free pools are less than it
+    UINT32        HighWatermark; // Count of the free pools after a replenishment
+    volatile LONG CountOfBusyPools;
+    volatile LONG CountOfFailedRequests;
+    volatile LONG CountOfConsumedPools; // Pools that are given since the last replenishment
+    UINT64        CountOfReplenishedPools;
+
+} POOL_FREE_LIST, *PPOOL_FREE_LIST;
 
-    SIZE_T                    Size2;
-    UINT32                    Count2;
-    POOL_ALLOCATION_INTENTION Intention2;
-
-    SIZE_T                    Size3;
-    UINT32                    Count3;
-    POOL_ALLOCATION_INTENTION Intention3;
-
-    SIZE_T                    Size4;
-    UINT32                    Count4;
-    POOL_ALLOCATION_INTENTION Intention4;
-
-    SIZE_T                    Size5;
-    UINT32                    Count5;
-    POOL_ALLOCATION_INTENTION Intention5;
+/**
+ * @brief The free pools of an intention that are kept by a core
+ * @details Only used by vmx-root of the same core, so it's used without any
+ * lock, it's refilled from the free list of the intention in batches
+ * 
+ */
+typedef struct _POOL_MAGAZINE
+{
+    UINT32      CountOfPools;
+    PPOOL_TABLE Pools[POOL_MANAGER_MAGAZINE_SIZE];
 
-    SIZE_T                    Size6;
-    UINT32                    Count6;
-    POOL_ALLOCATION_INTENTION Intention6;
+} POOL_MAGAZINE, *PPOOL_MAGAZINE;
 
-    SIZE_T                    Size7;
-    UINT32                    Count7;
-    POOL_ALLOCATION_INTENTION Intention7;
+/**
+ * @brief A request for new allocations in the queue of the requests
+ * @details Sequence shows the state of the slot, it's the position of the
+ * slot if it's free and the position plus one if it's filled
+ * 
+ */
+typedef struct _POOL_ALLOCATION_REQUEST
+{
+    volatile LONG             Sequence;
+    UINT32                    Count;
+    SIZE_T                    Size;
+    POOL_ALLOCATION_INTENTION Intention;
 
-    SIZE_T                    Size8;
-    UINT32                    Count8;
-    POOL_ALLOCATION_INTENTION Intention8;
+} POOL_ALLOCATION_REQUEST, *PPOOL_ALLOCATION_REQUEST;
 
-    SIZE_T                    Size9;
-    UINT32                    Count9;
-    POOL_ALLOCATION_INTENTION Intention9;
+/**
+ * @brief Bounded lock-free queue of the requests for new allocations
+ * @details Any core (even in vmx-root) pushes to it, and only the allocator
+ * in PASSIVE_LEVEL pops from it
+ * 
+ */
+typedef struct _POOL_ALLOCATION_REQUEST_QUEUE
+{
+    volatile LONG           EnqueuePosition;
+    LONG                    DequeuePosition;
+    POOL_ALLOCATION_REQUEST Requests[POOL_MANAGER_REQUEST_QUEUE_SIZE];
 
-} REQUEST_NEW_ALLOCATION, *PREQUEST_NEW_ALLOCATION;
+} POOL_ALLOCATION_REQUEST_QUEUE, *PPOOL_ALLOCATION_REQUEST_QUEUE;
 
 //////////////////////////////////////////////////
 //                   Variables	    			//
 //////////////////////////////////////////////////
 
 /**
- * @brief If sb wants allocation from vmx root, adds it's request to this structure
+ * @brief If sb wants allocation from vmx root, adds it's request to this queue
  * 
  */
-REQUEST_NEW_ALLOCATION * RequestNewAllocation;
+POOL_ALLOCATION_REQUEST_QUEUE * RequestNewAllocation;
+
+TICKET_SPINLOCK LockForReadingPool;
 
-volatile LONG LockForRequestAllocation;
-volatile LONG LockForReadingPool;
+/**
+ * @brief Serializes the allocator (the only consumer of the queue)
+ * 
+ */
+FAST_MUTEX LockForPerformingAllocation;
 
 /**
- * @brief We set it when there is a new allocation
+ * @brief We set it when there is a new allocation or a returned pool
  * 
  */
-BOOLEAN IsNewRequestForAllocationRecieved;
+volatile BOOLEAN IsNewRequestForAllocationRecieved;
 /**
  * @brief Create a list from all pools
  * 
  */
 PLIST_ENTRY ListOfAllocatedPoolsHead;
 
+/**
+ * @brief The free pools of each intention (protected by LockForReadingPool)
+ * 
+ */
+POOL_FREE_LIST FreePoolsOfIntentions[POOL_INTENTIONS_COUNT];
+
+/**
+ * @brief The magazines of the cores (POOL_INTENTIONS_COUNT magazines for each core)
+ * 
+ */
+POOL_MAGAZINE * PoolMagazines;
+
+/**
+ * @brief Queues the replenishment work item (it can be queued from vmx-root)
+ * 
+ */
+KDPC PoolReplenishmentDpc;
+
+/**
+ * @brief Performs the allocations in PASSIVE_LEVEL
+ * 
+ */
+WORK_QUEUE_ITEM PoolReplenishmentWorkItem;
+
+/**
+ * @brief Whether the replenishment is queued (only one of them is queued at a time)
+ * 
+ */
+volatile LONG IsPoolReplenishmentQueued;
+
+/**
+ * @brief Count of the replenishments that are performed by the work item
+ * 
+ */
+volatile LONG CountOfPoolReplenishments;
+
 //////////////////////////////////////////////////
 //                   Functions		  			//
 //////////////////////////////////////////////////
@@ -143,6 +222,19 @@ PoolManagerRequestAllocation(SIZE_T Size, UINT32 Count, POOL_ALLOCATION_INTENTIO
 /* next time it's safe the pool will be allocated */
 UINT64
 PoolManagerRequestPool(POOL_ALLOCATION_INTENTION Intention, BOOLEAN RequestNewPool, UINT32 Size);
+/* Return a pool that is received from PoolManagerRequestPool (can be called from vmx-root), the pool is */
+/* de-allocated next time that it's safe (IRQL PASSIVE_LEVEL) */
+BOOLEAN
+PoolManagerFreePool(UINT64 AddressToFree);
 /* De-allocate all the allocated pools */
 VOID
 PoolManagerUninitialize();
+/* Queues the replenishment work item (the DPC is queued from vmx-root when an intention is below its low watermark) */
+VOID
+PoolManagerReplenishmentDpcCallback(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+/* Performs the allocations of the replenishment in PASSIVE_LEVEL */
+VOID
+PoolManagerReplenishmentWorkItemCallback(PVOID Parameter);
+/* Copy the counters and the watermarks of the intentions to the result of IOCTL_QUERY_POOL_STATISTICS */
+VOID
+PoolManagerQueryStatistics(PPOOL_MANAGER_STATISTICS Statistics);
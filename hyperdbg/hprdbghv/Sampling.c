@@ -0,0 +1,295 @@
+/**
+ * @file Sampling.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Guest RIP sampling based on the VMX-preemption timer
+ * @details Each time the timer of a core expires, the guest RIP, CR3, CPL and
+ * the time stamp counter are saved in the ring of the core and the guest is
+ * resumed immediately, the user-mode reads the samples and makes the profile
+ * @version 0.1
+ * @date 2020-05-05
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#include "Common.h"
+#include "Msr.h"
+#include "Vmx.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "HypervisorRoutines.h"
+#include "ExtensionCommands.h"
+#include "Sampling.h"
+#include "Dispatch.h"
+
+/**
+ * @brief Initialize the sampling (the rings are allocated when it's started)
+ * 
+ * @return VOID 
+ */
+VOID
+SamplingInitialize()
+{
+    SamplingRings     = NULL;
+    SamplingCoreCount = KeQueryActiveProcessorCount(0);
+
+    ExInitializeFastMutex(&SamplingMutex);
+}
+
+/**
+ * @brief Stop the sampling (if it's started) and free the rings
+ * @details Should be called in vmx non-root before terminating vmx
+ * 
+ * @return VOID 
+ */
+VOID
+SamplingUnInitialize()
+{
+    SamplingStop();
+}
+
+/**
+ * @brief Start sampling the guest RIP of all the cores
+ * @details The preemption timer counts down at the rate of the time stamp
+ * counter divided by 2^IA32_VMX_MISC[4:0], if the sampling is already started
+ * only the frequency is changed
+ * 
+ * @param Frequency Samples of each core per second
+ * @return NTSTATUS 
+ */
+NTSTATUS
+SamplingStart(UINT32 Frequency)
+{
+    MSR    PinBasedControls;
+    UINT64 TimerValue;
+
+    if (Frequency == 0 || LogTimeStampCounterFrequency == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Check whether the processor supports the preemption timer (allowed 1-settings)
+    //
+    PinBasedControls.Content = __readmsr((__readmsr(MSR_IA32_VMX_BASIC) & (1ULL << 55)) ? MSR_IA32_VMX_TRUE_PINBASED_CTLS : MSR_IA32_VMX_PINBASED_CTLS);
+
+    if (!(PinBasedControls.High & PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER))
+    {
+        LogError("The VMX-preemption timer is not supported");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    TimerValue = (LogTimeStampCounterFrequency / Frequency) >> (__readmsr(MSR_IA32_VMX_MISC) & 0x1f);
+
+    //
+    // The field is 32-bit and 0 causes vm-exit before executing any instruction
+    //
+    if (TimerValue == 0 || TimerValue > MAXULONG)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&SamplingMutex);
+
+    if (!SamplingRings)
+    {
+        SamplingRings = ExAllocatePoolWithTag(NonPagedPool, sizeof(SAMPLING_CORE_RING) * SamplingCoreCount, POOLTAG);
+
+        if (!SamplingRings)
+        {
+            ExReleaseFastMutex(&SamplingMutex);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(SamplingRings, sizeof(SAMPLING_CORE_RING) * SamplingCoreCount);
+    }
+
+    //
+    // The handler should be set before the first timer expires
+    //
+    DispatchRegisterHandler(DEBUGGER_EVENT_APPLY_TO_ALL_CORES, EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, SamplingHandleVmexit);
+
+    //
+    // Enable the timer on all the cores
+    //
+    ExtensionCommandConfigureSamplingTimerOnAllProcessors(TimerValue);
+
+    ExReleaseFastMutex(&SamplingMutex);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Stop sampling and free the rings (the unread samples are lost)
+ * 
+ * @return VOID 
+ */
+VOID
+SamplingStop()
+{
+    ExAcquireFastMutex(&SamplingMutex);
+
+    if (SamplingRings)
+    {
+        //
+        // Disable the timer on all the cores, after that no core writes to
+        // the rings
+        //
+        ExtensionCommandConfigureSamplingTimerOnAllProcessors(0);
+        DispatchUnregisterHandler(DEBUGGER_EVENT_APPLY_TO_ALL_CORES, EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED);
+
+        ExFreePoolWithTag(SamplingRings, POOLTAG);
+        SamplingRings = NULL;
+    }
+
+    ExReleaseFastMutex(&SamplingMutex);
+}
+
+/**
+ * @brief Enable or disable the preemption timer of the current core
+ * @details Should be called in vmx-root
+ * 
+ * @param TimerValue Value of the timer, or zero to disable it
+ * @return VOID 
+ */
+VOID
+SamplingConfigureTimer(UINT64 TimerValue)
+{
+    UINT32 PinBasedControls = 0;
+    ULONG  PinBasedMsr;
+
+    PinBasedMsr = (__readmsr(MSR_IA32_VMX_BASIC) & (1ULL << 55)) ? MSR_IA32_VMX_TRUE_PINBASED_CTLS : MSR_IA32_VMX_PINBASED_CTLS;
+
+    __vmx_vmread(PIN_BASED_VM_EXEC_CONTROL, &PinBasedControls);
+
+    if (TimerValue != 0)
+    {
+        //
+        // As the "save VMX-preemption timer value" vm-exit control is not set,
+        // each vm-entry starts the timer from this value
+        //
+        __vmx_vmwrite(GUEST_PREEMPTION_TIMER, TimerValue);
+        __vmx_vmwrite(PIN_BASED_VM_EXEC_CONTROL, HvAdjustControls(PinBasedControls | PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER, PinBasedMsr));
+    }
+    else
+    {
+        __vmx_vmwrite(PIN_BASED_VM_EXEC_CONTROL, HvAdjustControls(PinBasedControls & ~PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER, PinBasedMsr));
+    }
+}
+
+/**
+ * @brief Save a sample of the guest in the ring of the current core
+ * @details Should be called in vmx-root in the vm-exits of the preemption
+ * timer, it's only plain stores to the ring of the current core
+ * 
+ * @param CoreIndex Index of the current core
+ * @return VOID 
+ */
+VOID
+SamplingRecordSample(UINT32 CoreIndex)
+{
+    PSAMPLING_CORE_RING Ring;
+    PGUEST_RIP_SAMPLE   Sample;
+    UINT64              SsAccessRights = 0;
+
+    //
+    // There is no instruction to skip, the guest is interrupted
+    //
+    g_GuestState[CoreIndex].IncrementRip = FALSE;
+
+    if (!SamplingRings || CoreIndex >= SamplingCoreCount)
+    {
+        return;
+    }
+
+    Ring = &SamplingRings[CoreIndex];
+
+    if (Ring->WrittenCount - Ring->ReadCount >= SAMPLING_MAXIMUM_SAMPLES_PER_CORE)
+    {
+        //
+        // The reader resets this counter, so it's the only atomic operation
+        //
+        InterlockedIncrement64((volatile LONG64 *)&Ring->LostCount);
+        return;
+    }
+
+    Sample = &Ring->Samples[Ring->WrittenCount % SAMPLING_MAXIMUM_SAMPLES_PER_CORE];
+
+    Sample->Rip = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+    __vmx_vmread(GUEST_CR3, &Sample->Cr3);
+    __vmx_vmread(GUEST_SS_AR_BYTES, &SsAccessRights);
+    Sample->Cpl              = (SsAccessRights >> 5) & 0x3;
+    Sample->CoreIndex        = CoreIndex;
+    Sample->TimeStampCounter = __rdtsc();
+
+    //
+    // The sample should be visible before the counter
+    //
+    _WriteBarrier();
+    Ring->WrittenCount++;
+}
+
+/**
+ * @brief Handler of the vm-exits of the preemption timer while sampling
+ * 
+ * @param GuestRegs Guest registers
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @return VOID 
+ */
+VOID
+SamplingHandleVmexit(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason)
+{
+    SamplingRecordSample(CoreIndex);
+}
+
+/**
+ * @brief Move the samples of all the cores to the result of IOCTL_READ_SAMPLES
+ * 
+ * @param Result The header of the output buffer (the samples follow it)
+ * @param MaximumSamples Count of the samples that fit in the output buffer
+ * @return UINT32 Count of the samples that are read
+ */
+UINT32
+SamplingReadSamples(PSAMPLING_READ_RESULT Result, UINT32 MaximumSamples)
+{
+    PGUEST_RIP_SAMPLE Samples = (PGUEST_RIP_SAMPLE)((UINT64)Result + sizeof(SAMPLING_READ_RESULT));
+    UINT32            Count   = 0;
+    UINT64            LostCount;
+
+    Result->CountOfSamples = 0;
+    Result->LostSamples    = 0;
+
+    ExAcquireFastMutex(&SamplingMutex);
+
+    if (!SamplingRings)
+    {
+        ExReleaseFastMutex(&SamplingMutex);
+        return 0;
+    }
+
+    for (size_t i = 0; i < SamplingCoreCount; i++)
+    {
+        PSAMPLING_CORE_RING Ring         = &SamplingRings[i];
+        UINT64              WrittenCount = Ring->WrittenCount;
+
+        _ReadBarrier();
+
+        while (Ring->ReadCount != WrittenCount && Count < MaximumSamples)
+        {
+            Samples[Count++] = Ring->Samples[Ring->ReadCount % SAMPLING_MAXIMUM_SAMPLES_PER_CORE];
+            Ring->ReadCount++;
+        }
+
+        //
+        // Report the lost samples from the previous read
+        //
+        LostCount = InterlockedExchange64((volatile LONG64 *)&Ring->LostCount, 0);
+        Result->LostSamples += LostCount;
+    }
+
+    ExReleaseFastMutex(&SamplingMutex);
+
+    Result->CountOfSamples = Count;
+
+    return Count;
+}
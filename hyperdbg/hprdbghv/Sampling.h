@@ -0,0 +1,70 @@
+/**
+ * @file Sampling.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the guest RIP sampling (VMX-preemption timer)
+ * @details
+ * @version 0.1
+ * @date 2020-05-05
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The ring of the samples of each core
+ * @details The core is the only producer (in vmx-root) and IOCTL_READ_SAMPLES
+ * is the only consumer, the counters are not wrapped and the index of a
+ * sample is (Count % SAMPLING_MAXIMUM_SAMPLES_PER_CORE)
+ * 
+ */
+typedef struct DECLSPEC_CACHEALIGN _SAMPLING_CORE_RING
+{
+    volatile UINT64  WrittenCount;
+    volatile UINT64  ReadCount;
+    volatile UINT64  LostCount;
+    GUEST_RIP_SAMPLE Samples[SAMPLING_MAXIMUM_SAMPLES_PER_CORE];
+
+} SAMPLING_CORE_RING, *PSAMPLING_CORE_RING;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Rings of the samples (one for each core, null if the sampling is not started) */
+SAMPLING_CORE_RING * SamplingRings;
+
+/* Count of the rings of SamplingRings */
+UINT32 SamplingCoreCount;
+
+/* Serializes the start, stop and reads of the samples */
+FAST_MUTEX SamplingMutex;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+SamplingInitialize();
+VOID
+SamplingUnInitialize();
+NTSTATUS
+SamplingStart(UINT32 Frequency);
+VOID
+SamplingStop();
+VOID
+SamplingConfigureTimer(UINT64 TimerValue);
+VOID
+SamplingRecordSample(UINT32 CoreIndex);
+
+VOID
+SamplingHandleVmexit(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason);
+UINT32
+SamplingReadSamples(PSAMPLING_READ_RESULT Result, UINT32 MaximumSamples);
@@ -25,6 +25,7 @@
  */
 
 #include <ntddk.h>
+#include "Common.h"
 
 /**
  * @brief The maximum wait before PAUSE
@@ -88,3 +89,99 @@ SpinlockUnlock(volatile LONG * Lock)
 {
     *Lock = 0;
 }
+
+/**
+ * @brief Initialize a ticket spinlock
+ * 
+ * @param Lock The lock
+ * @param CollectStatistics Whether the counters of the lock are updated
+ * @return VOID
+ */
+VOID
+TicketSpinlockInitialize(PTICKET_SPINLOCK Lock, BOOLEAN CollectStatistics)
+{
+    RtlZeroMemory(Lock, sizeof(TICKET_SPINLOCK));
+
+    Lock->CollectStatistics = CollectStatistics;
+}
+
+/**
+ * @brief Tries to get the ticket lock otherwise returns
+ * @details A ticket is only taken if it's served immediately
+ * 
+ * @param Lock The lock
+ * @return BOOLEAN If it was successfull on getting the lock
+ */
+BOOLEAN
+TicketSpinlockTryLock(PTICKET_SPINLOCK Lock)
+{
+    LONG Ticket = Lock->NowServing;
+
+    if (Lock->NextTicket != Ticket || InterlockedCompareExchange(&Lock->NextTicket, Ticket + 1, Ticket) != Ticket)
+    {
+        return FALSE;
+    }
+
+    if (Lock->CollectStatistics)
+    {
+        Lock->Acquisitions++;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Get the ticket lock, the cores get it in the order of their tickets
+ * @details Can be used in any IRQL and in vmx-root, each waiter pauses in
+ * proportion to the count of the tickets before it
+ * 
+ * @param Lock The lock
+ * @return VOID
+ */
+VOID
+TicketSpinlockLock(PTICKET_SPINLOCK Lock)
+{
+    LONG   Ticket = InterlockedExchangeAdd(&Lock->NextTicket, 1);
+    LONG   Ahead;
+    UINT64 StartTime = 0;
+
+    if (Lock->NowServing != Ticket)
+    {
+        if (Lock->CollectStatistics)
+        {
+            StartTime = __rdtsc();
+        }
+
+        while ((Ahead = Ticket - Lock->NowServing) != 0)
+        {
+            for (LONG i = 0; i < Ahead; ++i)
+            {
+                _mm_pause();
+            }
+        }
+    }
+
+    if (Lock->CollectStatistics)
+    {
+        Lock->Acquisitions++;
+
+        if (StartTime != 0)
+        {
+            Lock->ContendedAcquisitions++;
+            Lock->SpinCycles += __rdtsc() - StartTime;
+        }
+    }
+}
+
+/**
+ * @brief Release the ticket lock (serve the next ticket)
+ * 
+ * @param Lock The lock
+ * @return VOID
+ */
+VOID
+TicketSpinlockUnlock(PTICKET_SPINLOCK Lock)
+{
+    _ReadWriteBarrier();
+    Lock->NowServing++;
+}
@@ -16,13 +16,85 @@
 #include "Logging.h"
 
 /**
- * @brief Get the kernel base and Image size
+ * @brief Change the generation of the processes when a process is created
+ * or exited, so the cached #UDs of its cr3 are not used by another process
+ *
+ * @param ParentId 
+ * @param ProcessId 
+ * @param Create 
+ * @return VOID
+ */
+static VOID
+SyscallHookProcessNotifyRoutine(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
+{
+    UNREFERENCED_PARAMETER(ParentId);
+    UNREFERENCED_PARAMETER(ProcessId);
+    UNREFERENCED_PARAMETER(Create);
+
+    InterlockedIncrement(&SyscallHookProcessGeneration);
+}
+
+/**
+ * @brief Initialize the state of the service tables (they're resolved
+ * on the first use) and the generation of the processes
+ *
+ * @return VOID
+ */
+VOID
+SyscallHookInitialize()
+{
+    RtlZeroMemory(&SyscallHookServiceTables, sizeof(SYSCALL_HOOK_SERVICE_TABLES));
+
+    ExInitializeFastMutex(&SyscallHookServiceTablesMutex);
+
+    SyscallHookProcessGeneration         = 0;
+    SyscallHookIsProcessNotifyRegistered = NT_SUCCESS(PsSetCreateProcessNotifyRoutine(SyscallHookProcessNotifyRoutine, FALSE));
+
+    if (!SyscallHookIsProcessNotifyRegistered)
+    {
+        LogWarning("The process notify routine is not registered, the user-mode #UDs are not cached");
+    }
+}
+
+/**
+ * @brief Free the decoded service tables and remove the process notify routine
+ *
+ * @return VOID
+ */
+VOID
+SyscallHookUnInitialize()
+{
+    if (SyscallHookIsProcessNotifyRegistered)
+    {
+        PsSetCreateProcessNotifyRoutine(SyscallHookProcessNotifyRoutine, TRUE);
+        SyscallHookIsProcessNotifyRegistered = FALSE;
+    }
+
+    ExAcquireFastMutex(&SyscallHookServiceTablesMutex);
+
+    if (SyscallHookServiceTables.NtServices)
+    {
+        ExFreePoolWithTag(SyscallHookServiceTables.NtServices, POOLTAG);
+    }
+
+    if (SyscallHookServiceTables.Win32kServices)
+    {
+        ExFreePoolWithTag(SyscallHookServiceTables.Win32kServices, POOLTAG);
+    }
+
+    RtlZeroMemory(&SyscallHookServiceTables, sizeof(SYSCALL_HOOK_SERVICE_TABLES));
+
+    ExReleaseFastMutex(&SyscallHookServiceTablesMutex);
+}
+
+/**
+ * @brief Query the kernel base and Image size
  * 
  * @param pImageSize [Out] Image size
  * @return PVOID 
  */
-PVOID
-SyscallHookGetKernelBase(PULONG pImageSize)
+static PVOID
+SyscallHookQueryKernelBase(PULONG pImageSize)
 {
     NTSTATUS                   status;
     ZWQUERYSYSTEMINFORMATION   ZwQSI = 0;
@@ -71,6 +143,7 @@ SyscallHookGetKernelBase(PULONG pImageSize)
     else
     {
         LogError("ZwQuerySystemInformation (2) failed");
+        ExFreePool(pSystemInfoBuffer);
         return NULL;
     }
 
@@ -79,18 +152,18 @@ SyscallHookGetKernelBase(PULONG pImageSize)
 }
 
 /**
- * @brief Find SSDT address of Nt fucntions and W32Table
+ * @brief Scan the kernel for SSDT address of Nt fucntions and W32Table
  * 
+ * @param kernelBase The kernel base
+ * @param kernelSize Image size of the kernel
  * @param NtTable [Out] Address of Nt Syscall Table
  * @param Win32kTable [Out] Address of Win32k Syscall Table
  * @return BOOLEAN Returns true if it can find the nt tables and win32k successfully otherwise
  * returns false
  */
-BOOLEAN
-SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable)
+static BOOLEAN
+SyscallHookScanSsdt(ULONG_PTR kernelBase, ULONG kernelSize, PSSDTStruct * NtTable, PSSDTStruct * Win32kTable)
 {
-    ULONG               kernelSize = 0;
-    ULONG_PTR           kernelBase;
     const unsigned char KiSystemServiceStartPattern[] = {0x8B, 0xF8, 0xC1, 0xEF, 0x07, 0x83, 0xE7, 0x20, 0x25, 0xFF, 0x0F, 0x00, 0x00};
     const ULONG         signatureSize                 = sizeof(KiSystemServiceStartPattern);
     BOOLEAN             found                         = FALSE;
@@ -101,11 +174,6 @@ SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable)
     PVOID               ntTable;
     PVOID               win32kTable;
 
-    //
-    // x64 code
-    //
-    kernelBase = (ULONG_PTR)SyscallHookGetKernelBase(&kernelSize);
-
     if (kernelBase == 0 || kernelSize == 0)
         return FALSE;
 
@@ -152,6 +220,145 @@ SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable)
     return TRUE;
 }
 
+/**
+ * @brief Decode the address of the service of each syscall number of a table
+ *
+ * @param Table The service table
+ * @param Count [Out] Count of the services
+ * @return PUINT64 The addresses of the services or NULL if the table is not mapped
+ */
+static PUINT64
+SyscallHookDecodeServiceTable(PSSDTStruct Table, PUINT32 Count)
+{
+    PUINT64 Services;
+
+    if (!MmIsAddressValid(Table) || Table->NumberOfServices == 0 || Table->NumberOfServices > SYSCALL_WIN32K_FIRST_NUMBER)
+    {
+        return NULL;
+    }
+
+    //
+    // The win32k table is only mapped in the sessions
+    //
+    if (!MmIsAddressValid(Table->pServiceTable) || !MmIsAddressValid(&Table->pServiceTable[Table->NumberOfServices - 1]))
+    {
+        return NULL;
+    }
+
+    Services = ExAllocatePoolWithTag(NonPagedPool, sizeof(UINT64) * Table->NumberOfServices, POOLTAG);
+
+    if (!Services)
+    {
+        return NULL;
+    }
+
+    for (UINT32 i = 0; i < Table->NumberOfServices; i++)
+    {
+        Services[i] = (UINT64)Table->pServiceTable + (Table->pServiceTable[i] >> 4);
+    }
+
+    *Count = (UINT32)Table->NumberOfServices;
+
+    return Services;
+}
+
+/**
+ * @brief Resolve the kernel base and decode the service tables
+ * @details Everything is resolved once, except the win32k table that is
+ * retried until it's decoded in a session
+ *
+ * @param Win32k Also decode the win32k table
+ * @return BOOLEAN Returns true if the requested tables are resolved
+ */
+static BOOLEAN
+SyscallHookResolveServiceTables(BOOLEAN Win32k)
+{
+    if (SyscallHookServiceTables.IsResolved && (!Win32k || SyscallHookServiceTables.IsWin32kResolved))
+    {
+        return TRUE;
+    }
+
+    ExAcquireFastMutex(&SyscallHookServiceTablesMutex);
+
+    if (!SyscallHookServiceTables.IsResolved)
+    {
+        SyscallHookServiceTables.KernelBase = SyscallHookQueryKernelBase(&SyscallHookServiceTables.KernelSize);
+
+        if (SyscallHookScanSsdt((ULONG_PTR)SyscallHookServiceTables.KernelBase,
+                                SyscallHookServiceTables.KernelSize,
+                                &SyscallHookServiceTables.NtTable,
+                                &SyscallHookServiceTables.Win32kTable))
+        {
+            SyscallHookServiceTables.NtServices = SyscallHookDecodeServiceTable(SyscallHookServiceTables.NtTable,
+                                                                                &SyscallHookServiceTables.CountOfNtServices);
+
+            if (SyscallHookServiceTables.NtServices)
+            {
+                _ReadWriteBarrier();
+                SyscallHookServiceTables.IsResolved = TRUE;
+            }
+        }
+    }
+
+    if (Win32k && SyscallHookServiceTables.IsResolved && !SyscallHookServiceTables.IsWin32kResolved)
+    {
+        SyscallHookServiceTables.Win32kServices = SyscallHookDecodeServiceTable(SyscallHookServiceTables.Win32kTable,
+                                                                                &SyscallHookServiceTables.CountOfWin32kServices);
+
+        if (SyscallHookServiceTables.Win32kServices)
+        {
+            _ReadWriteBarrier();
+            SyscallHookServiceTables.IsWin32kResolved = TRUE;
+        }
+    }
+
+    ExReleaseFastMutex(&SyscallHookServiceTablesMutex);
+
+    return SyscallHookServiceTables.IsResolved && (!Win32k || SyscallHookServiceTables.IsWin32kResolved);
+}
+
+/**
+ * @brief Get the kernel base and Image size
+ * 
+ * @param pImageSize [Out] Image size
+ * @return PVOID 
+ */
+PVOID
+SyscallHookGetKernelBase(PULONG pImageSize)
+{
+    if (!SyscallHookResolveServiceTables(FALSE))
+    {
+        return NULL;
+    }
+
+    if (pImageSize)
+        *pImageSize = SyscallHookServiceTables.KernelSize;
+
+    return SyscallHookServiceTables.KernelBase;
+}
+
+/**
+ * @brief Find SSDT address of Nt fucntions and W32Table
+ * 
+ * @param NtTable [Out] Address of Nt Syscall Table
+ * @param Win32kTable [Out] Address of Win32k Syscall Table
+ * @return BOOLEAN Returns true if it can find the nt tables and win32k successfully otherwise
+ * returns false
+ */
+BOOLEAN
+SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable)
+{
+    if (!SyscallHookResolveServiceTables(FALSE))
+    {
+        return FALSE;
+    }
+
+    *NtTable     = (UINT64)SyscallHookServiceTables.NtTable;
+    *Win32kTable = (UINT64)SyscallHookServiceTables.Win32kTable;
+
+    return TRUE;
+}
+
 /**
  * @brief Find entry from SSDT table of Nt fucntions and W32Table syscalls
  * 
@@ -162,18 +369,10 @@ SyscallHookFindSsdt(PUINT64 NtTable, PUINT64 Win32kTable)
 PVOID
 SyscallHookGetFunctionAddress(INT32 ApiNumber, BOOLEAN GetFromWin32k)
 {
-    SSDTStruct * SSDT;
-    BOOLEAN      Result;
-    ULONG_PTR    SSDTbase;
-    ULONG        ReadOffset;
-    UINT64       NtTable, Win32kTable;
-
     //
     // Read the address og SSDT
     //
-    Result = SyscallHookFindSsdt(&NtTable, &Win32kTable);
-
-    if (!Result)
+    if (!SyscallHookResolveServiceTables(GetFromWin32k))
     {
         LogError("SSDT not found");
         return 0;
@@ -181,25 +380,73 @@ SyscallHookGetFunctionAddress(INT32 ApiNumber, BOOLEAN GetFromWin32k)
 
     if (!GetFromWin32k)
     {
-        SSDT = NtTable;
+        if (ApiNumber < 0 || (UINT32)ApiNumber >= SyscallHookServiceTables.CountOfNtServices)
+        {
+            return 0;
+        }
+
+        return (PVOID)SyscallHookServiceTables.NtServices[ApiNumber];
     }
-    else
+
+    //
+    // Win32k APIs start from 0x1000
+    //
+    ApiNumber = ApiNumber - SYSCALL_WIN32K_FIRST_NUMBER;
+
+    if (ApiNumber < 0 || (UINT32)ApiNumber >= SyscallHookServiceTables.CountOfWin32kServices)
     {
-        //
-        // Win32k APIs start from 0x1000
-        //
-        ApiNumber = ApiNumber - 0x1000;
-        SSDT      = Win32kTable;
+        return 0;
     }
 
-    SSDTbase = (ULONG_PTR)SSDT->pServiceTable;
+    return (PVOID)SyscallHookServiceTables.Win32kServices[ApiNumber];
+}
+
+/**
+ * @brief Copy the kernel base and the addresses of the services to a buffer
+ *
+ * @param Result The header of the output buffer (the addresses follow it)
+ * @param OutputBufferLength Size of the output buffer
+ * @param ReturnedLength Size of the result
+ * @return NTSTATUS
+ */
+NTSTATUS
+SyscallHookQueryServiceTables(PSYSCALL_SERVICE_TABLES_RESULT Result, UINT32 OutputBufferLength, PUINT32 ReturnedLength)
+{
+    PUINT64 Services       = (PUINT64)((UINT64)Result + sizeof(SYSCALL_SERVICE_TABLES_RESULT));
+    UINT32  MaximumEntries = (OutputBufferLength - sizeof(SYSCALL_SERVICE_TABLES_RESULT)) / sizeof(UINT64);
+
+    RtlZeroMemory(Result, sizeof(SYSCALL_SERVICE_TABLES_RESULT));
+    *ReturnedLength = sizeof(SYSCALL_SERVICE_TABLES_RESULT);
 
-    if (!SSDTbase)
+    //
+    // The win32k table is optional (the caller might not be in a session)
+    //
+    SyscallHookResolveServiceTables(TRUE);
+
+    if (!SyscallHookServiceTables.IsResolved)
     {
-        LogError("ServiceTable not found");
-        return 0;
+        return STATUS_NOT_FOUND;
     }
-    return (PVOID)((SSDT->pServiceTable[ApiNumber] >> 4) + SSDTbase);
+
+    Result->KernelBase            = (UINT64)SyscallHookServiceTables.KernelBase;
+    Result->KernelSize            = SyscallHookServiceTables.KernelSize;
+    Result->NtTable               = (UINT64)SyscallHookServiceTables.NtTable;
+    Result->Win32kTable           = (UINT64)SyscallHookServiceTables.Win32kTable;
+    Result->CountOfNtServices     = min(SyscallHookServiceTables.CountOfNtServices, MaximumEntries);
+    Result->CountOfWin32kServices = SyscallHookServiceTables.IsWin32kResolved ? min(SyscallHookServiceTables.CountOfWin32kServices, MaximumEntries - Result->CountOfNtServices) : 0;
+    Result->CountOfMissedServices = SyscallHookServiceTables.CountOfNtServices - Result->CountOfNtServices;
+
+    if (SyscallHookServiceTables.IsWin32kResolved)
+    {
+        Result->CountOfMissedServices += SyscallHookServiceTables.CountOfWin32kServices - Result->CountOfWin32kServices;
+    }
+
+    RtlCopyMemory(Services, SyscallHookServiceTables.NtServices, Result->CountOfNtServices * sizeof(UINT64));
+    RtlCopyMemory(&Services[Result->CountOfNtServices], SyscallHookServiceTables.Win32kServices, Result->CountOfWin32kServices * sizeof(UINT64));
+
+    *ReturnedLength = sizeof(SYSCALL_SERVICE_TABLES_RESULT) + (Result->CountOfNtServices + Result->CountOfWin32kServices) * sizeof(UINT64);
+
+    return STATUS_SUCCESS;
 }
 
 /**
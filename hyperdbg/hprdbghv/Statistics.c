@@ -0,0 +1,185 @@
+/**
+ * @file Statistics.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Statistics of the hypervisor (vm-exit counters and latency histograms)
+ * @details
+ * @version 0.1
+ * @date 2020-05-04
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#include "Common.h"
+#include "Statistics.h"
+
+/**
+ * @brief Allocate the statistics of the cores
+ * 
+ * @return BOOLEAN Shows whether the allocation was successful or not
+ */
+BOOLEAN
+StatisticsInitialize()
+{
+    VmexitStatisticsCoreCount = KeQueryActiveProcessorCount(0);
+
+    //
+    // The allocations bigger than a page are page aligned so all the blocks
+    // are cache aligned
+    //
+    VmexitStatistics = ExAllocatePoolWithTag(NonPagedPool, sizeof(VMEXIT_CORE_STATISTICS) * VmexitStatisticsCoreCount, POOLTAG);
+
+    if (!VmexitStatistics)
+    {
+        return FALSE;
+    }
+
+    RtlZeroMemory(VmexitStatistics, sizeof(VMEXIT_CORE_STATISTICS) * VmexitStatisticsCoreCount);
+
+    return TRUE;
+}
+
+/**
+ * @brief Zero the statistics of the cores (e.g. for a new app)
+ * @details The blocks are allocated once by StatisticsInitialize
+ * 
+ * @return BOOLEAN Shows whether the statistics are allocated or not
+ */
+BOOLEAN
+StatisticsReset()
+{
+    if (!VmexitStatistics)
+    {
+        return FALSE;
+    }
+
+    RtlZeroMemory(VmexitStatistics, sizeof(VMEXIT_CORE_STATISTICS) * VmexitStatisticsCoreCount);
+
+    return TRUE;
+}
+
+/**
+ * @brief Free the statistics of the cores
+ * 
+ * @return VOID 
+ */
+VOID
+StatisticsUnInitialize()
+{
+    if (VmexitStatistics)
+    {
+        ExFreePoolWithTag(VmexitStatistics, POOLTAG);
+        VmexitStatistics = NULL;
+    }
+}
+
+/**
+ * @brief Count a vm-exit and add its cycles to the histogram
+ * @details Should be called in vmx-root at the end of the vm-exit handler,
+ * only the current core writes to its block so there is no lock
+ * 
+ * @param CoreIndex Index of the current core
+ * @param ExitReason Basic exit reason
+ * @param EntryTimeStampCounter Time stamp counter at the start of AsmVmexitHandler
+ * @return VOID 
+ */
+VOID
+StatisticsRecordVmexit(UINT32 CoreIndex, UINT32 ExitReason, UINT64 EntryTimeStampCounter)
+{
+    PVMEXIT_REASON_STATISTICS ReasonStatistics;
+    UINT64                    Cycles;
+    ULONG                     Bucket = 0;
+
+    if (ExitReason >= VMEXIT_STATISTICS_MAXIMUM_REASONS || CoreIndex >= VmexitStatisticsCoreCount || !VmexitStatistics)
+    {
+        return;
+    }
+
+    Cycles           = __rdtsc() - EntryTimeStampCounter;
+    ReasonStatistics = &VmexitStatistics[CoreIndex].Reasons[ExitReason];
+
+    //
+    // log2 of the cycles, the last bucket also has the larger ones
+    //
+    if (Cycles != 0)
+    {
+        _BitScanReverse64(&Bucket, Cycles);
+    }
+
+    if (Bucket >= VMEXIT_STATISTICS_HISTOGRAM_BUCKETS)
+    {
+        Bucket = VMEXIT_STATISTICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    ReasonStatistics->Count++;
+    ReasonStatistics->TotalCycles += Cycles;
+    ReasonStatistics->Histogram[Bucket]++;
+
+    if (Cycles > ReasonStatistics->MaximumCycles)
+    {
+        ReasonStatistics->MaximumCycles = Cycles;
+    }
+}
+
+/**
+ * @brief Read the vm-exit statistics of a core or the sum of all the cores
+ * @details The statistics are changed by the cores at the same time, so a
+ * few vm-exits might be lost when they're reset
+ * 
+ * @param Request Core index and whether to reset the statistics
+ * @param Statistics [Out] The statistics (should be zeroed by the caller)
+ * @return NTSTATUS 
+ */
+NTSTATUS
+StatisticsQueryVmexits(PVMEXIT_STATISTICS_REQUEST Request, PVMEXIT_STATISTICS Statistics)
+{
+    UINT32 CoreIndex;
+    UINT32 CoreIndexEnd;
+
+    if (!VmexitStatistics)
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (Request->CoreIndex == VMEXIT_STATISTICS_ALL_CORES)
+    {
+        CoreIndex    = 0;
+        CoreIndexEnd = VmexitStatisticsCoreCount;
+    }
+    else if (Request->CoreIndex < VmexitStatisticsCoreCount)
+    {
+        CoreIndex    = Request->CoreIndex;
+        CoreIndexEnd = Request->CoreIndex + 1;
+    }
+    else
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Statistics->CoreCount = VmexitStatisticsCoreCount;
+    Statistics->CoreIndex = Request->CoreIndex;
+
+    for (; CoreIndex < CoreIndexEnd; CoreIndex++)
+    {
+        for (UINT32 i = 0; i < VMEXIT_STATISTICS_MAXIMUM_REASONS; i++)
+        {
+            PVMEXIT_REASON_STATISTICS Source      = &VmexitStatistics[CoreIndex].Reasons[i];
+            PVMEXIT_REASON_STATISTICS Destination = &Statistics->Reasons[i];
+
+            Destination->Count += Source->Count;
+            Destination->TotalCycles += Source->TotalCycles;
+            Destination->MaximumCycles = max(Destination->MaximumCycles, Source->MaximumCycles);
+
+            for (UINT32 j = 0; j < VMEXIT_STATISTICS_HISTOGRAM_BUCKETS; j++)
+            {
+                Destination->Histogram[j] += Source->Histogram[j];
+            }
+        }
+
+        if (Request->Reset)
+        {
+            RtlZeroMemory(&VmexitStatistics[CoreIndex], sizeof(VMEXIT_CORE_STATISTICS));
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file Statistics.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the statistics of the hypervisor (vm-exit counters)
+ * @details
+ * @version 0.1
+ * @date 2020-05-04
+ * 
+ * @copyright This project is released under the GNU Public License v3.
+ * 
+ */
+#pragma once
+#include <ntddk.h>
+#include "Definition.h"
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The vm-exit statistics of each core
+ * @details Each core only writes to its own block, and the blocks are cache
+ * aligned so the cores never write to the same cache line
+ * 
+ */
+typedef struct DECLSPEC_CACHEALIGN _VMEXIT_CORE_STATISTICS
+{
+    VMEXIT_REASON_STATISTICS Reasons[VMEXIT_STATISTICS_MAXIMUM_REASONS];
+
+} VMEXIT_CORE_STATISTICS, *PVMEXIT_CORE_STATISTICS;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* Statistics of the vm-exits (one block for each core) */
+VMEXIT_CORE_STATISTICS * VmexitStatistics;
+
+/* Count of the blocks of VmexitStatistics */
+UINT32 VmexitStatisticsCoreCount;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+BOOLEAN
+StatisticsInitialize();
+BOOLEAN
+StatisticsReset();
+VOID
+StatisticsUnInitialize();
+VOID
+StatisticsRecordVmexit(UINT32 CoreIndex, UINT32 ExitReason, UINT64 EntryTimeStampCounter);
+NTSTATUS
+StatisticsQueryVmexits(PVMEXIT_STATISTICS_REQUEST Request, PVMEXIT_STATISTICS Statistics);
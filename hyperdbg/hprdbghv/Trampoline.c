@@ -0,0 +1,155 @@
+/**
+ * @file Trampoline.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief The arena of the trampolines of the detour hooks
+ * @details The trampolines are packed in a few executable pages instead of a
+ * pool for each of them, the slots of the removed hooks are reused
+ * @version 0.1
+ * @date 2020-05-23
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "PoolManager.h"
+#include "Logging.h"
+#include "Trampoline.h"
+
+/**
+ * @brief Make the arena empty
+ * @details Should be called after initializing the pool manager, the pages
+ * of the arena are freed by the pool manager
+ *
+ * @return VOID
+ */
+VOID
+TrampolineArenaInitialize()
+{
+    RtlZeroMemory(TrampolineArenaPages, sizeof(TrampolineArenaPages));
+
+    TrampolineArenaCountOfPages     = 0;
+    TrampolineArenaCountOfFreeSlots = 0;
+    TrampolineArenaLock             = 0;
+}
+
+/**
+ * @brief Request the pages of the trampolines that don't fit in the free slots
+ * @details Should be called from vmx non-root before hooking, as vmx-root
+ * can't allocate new pages
+ *
+ * @param CountOfTrampolines Count of the trampolines that are going to be allocated
+ * @return VOID
+ */
+VOID
+TrampolineArenaRequestPages(UINT32 CountOfTrampolines)
+{
+    //
+    // The count of the free slots is read without the lock, it's only a hint
+    //
+    if (CountOfTrampolines <= TrampolineArenaCountOfFreeSlots)
+    {
+        return;
+    }
+
+    CountOfTrampolines -= TrampolineArenaCountOfFreeSlots;
+
+    PoolManagerRequestAllocation(PAGE_SIZE, (CountOfTrampolines + TRAMPOLINE_SLOTS_PER_PAGE - 1) / TRAMPOLINE_SLOTS_PER_PAGE, EXEC_TRAMPOLINE);
+}
+
+/**
+ * @brief Allocate a trampoline
+ * @details Can be called from vmx-root, a new page is taken from the pool
+ * manager if there is no free slot
+ *
+ * @return PCHAR The trampoline (TRAMPOLINE_SLOT_SIZE bytes) or NULL if there
+ * is no pre-allocated page
+ */
+PCHAR
+TrampolineArenaAllocate()
+{
+    PTRAMPOLINE_ARENA_PAGE Page       = NULL;
+    PCHAR                  Trampoline = NULL;
+    ULONG                  SlotIndex;
+
+    SpinlockLock(&TrampolineArenaLock);
+
+    for (UINT32 i = 0; i < TrampolineArenaCountOfPages; i++)
+    {
+        if (TrampolineArenaPages[i].UsedSlots != MAXUINT64)
+        {
+            Page = &TrampolineArenaPages[i];
+            break;
+        }
+    }
+
+    if (!Page && TrampolineArenaCountOfPages < TRAMPOLINE_ARENA_MAXIMUM_PAGES)
+    {
+        Page       = &TrampolineArenaPages[TrampolineArenaCountOfPages];
+        Page->Base = PoolManagerRequestPool(EXEC_TRAMPOLINE, TRUE, PAGE_SIZE);
+
+        if (Page->Base)
+        {
+            //
+            // The unused slots trap if they're executed
+            //
+            RtlFillMemory(Page->Base, PAGE_SIZE, TRAMPOLINE_FREE_SLOT_FILL);
+
+            Page->UsedSlots = 0;
+            TrampolineArenaCountOfPages++;
+            TrampolineArenaCountOfFreeSlots += TRAMPOLINE_SLOTS_PER_PAGE;
+        }
+        else
+        {
+            Page = NULL;
+        }
+    }
+
+    if (Page)
+    {
+        _BitScanForward64(&SlotIndex, ~Page->UsedSlots);
+
+        Page->UsedSlots |= 1ULL << SlotIndex;
+        TrampolineArenaCountOfFreeSlots--;
+
+        Trampoline = Page->Base + SlotIndex * TRAMPOLINE_SLOT_SIZE;
+    }
+
+    SpinlockUnlock(&TrampolineArenaLock);
+
+    if (!Trampoline)
+    {
+        LogError("There is no pre-allocated page for the trampolines");
+    }
+
+    return Trampoline;
+}
+
+/**
+ * @brief Free a trampoline so its slot is reused
+ * @details Should be called after the hook is removed from all the cores
+ *
+ * @param Trampoline The trampoline that was returned by TrampolineArenaAllocate
+ * @return VOID
+ */
+VOID
+TrampolineArenaFree(PCHAR Trampoline)
+{
+    PCHAR  Base      = PAGE_ALIGN(Trampoline);
+    UINT32 SlotIndex = (UINT32)((Trampoline - Base) / TRAMPOLINE_SLOT_SIZE);
+
+    SpinlockLock(&TrampolineArenaLock);
+
+    for (UINT32 i = 0; i < TrampolineArenaCountOfPages; i++)
+    {
+        if (TrampolineArenaPages[i].Base == Base && (TrampolineArenaPages[i].UsedSlots & (1ULL << SlotIndex)))
+        {
+            RtlFillMemory(Trampoline, TRAMPOLINE_SLOT_SIZE, TRAMPOLINE_FREE_SLOT_FILL);
+
+            TrampolineArenaPages[i].UsedSlots &= ~(1ULL << SlotIndex);
+            TrampolineArenaCountOfFreeSlots++;
+            break;
+        }
+    }
+
+    SpinlockUnlock(&TrampolineArenaLock);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file Trampoline.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the arena of the trampolines of the detour hooks
+ * @details
+ * @version 0.1
+ * @date 2020-05-23
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* Size of each trampoline in the arena (the copied instructions and the jump back) */
+#define TRAMPOLINE_SLOT_SIZE 64
+
+/* Count of the trampolines of each page of the arena (a bit for each of them) */
+#define TRAMPOLINE_SLOTS_PER_PAGE (PAGE_SIZE / TRAMPOLINE_SLOT_SIZE)
+
+/* Maximum count of the pages of the arena */
+#define TRAMPOLINE_ARENA_MAXIMUM_PAGES 64
+
+/* The byte that the free slots are filled with (int 3) */
+#define TRAMPOLINE_FREE_SLOT_FILL 0xCC
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief An executable page of the arena
+ * @details The page is a nonpaged pool of the pool manager (EXEC_TRAMPOLINE), it's
+ * kept in the arena after its trampolines are freed
+ *
+ */
+typedef struct _TRAMPOLINE_ARENA_PAGE
+{
+    PCHAR  Base;      // The page aligned buffer
+    UINT64 UsedSlots; // Bit i is set if the slot i is used
+
+} TRAMPOLINE_ARENA_PAGE, *PTRAMPOLINE_ARENA_PAGE;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* The pages of the arena */
+TRAMPOLINE_ARENA_PAGE TrampolineArenaPages[TRAMPOLINE_ARENA_MAXIMUM_PAGES];
+
+/* Count of the used entries of TrampolineArenaPages */
+UINT32 TrampolineArenaCountOfPages;
+
+/* Count of the free slots of all the pages */
+UINT32 TrampolineArenaCountOfFreeSlots;
+
+/* Protects the pages of the arena (used in vmx-root and vmx non-root) */
+volatile LONG TrampolineArenaLock;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+VOID
+TrampolineArenaInitialize();
+VOID
+TrampolineArenaRequestPages(UINT32 CountOfTrampolines);
+PCHAR
+TrampolineArenaAllocate();
+VOID
+TrampolineArenaFree(PCHAR Trampoline);
@@ -0,0 +1,440 @@
+/**
+ * @file Ve.c
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Deliver the EPT violations of the read/write hooks as virtualization exceptions (#VE)
+ * @details The hooked entries with "suppress #VE" = 0 cause a #VE in the guest
+ * instead of a vm-exit, our #VE handler records the access in the ring of the
+ * core, switches to the clean view with VMFUNC and single-steps the instruction,
+ * then our #DB handler switches back to the hooked view, so there is no vm-exit.
+ * If the processor doesn't support #VE (or EPTP switching) the violations are
+ * handled in vmx-root as before
+ * @version 0.1
+ * @date 2020-05-11
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include "Common.h"
+#include "Msr.h"
+#include "Vmx.h"
+#include "Ept.h"
+#include "GlobalVariables.h"
+#include "Logging.h"
+#include "InlineAsm.h"
+#include "Vmcall.h"
+#include "Ve.h"
+#include "Aggregation.h"
+
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwQuerySystemInformation(ULONG SystemInformationClass, PVOID SystemInformation, ULONG SystemInformationLength, PULONG ReturnLength);
+
+/**
+ * @brief Check whether the kernel page table isolation (KVA shadow) is enabled
+ * @details Our handlers are not mapped in the user-mode address space when
+ * the KVA shadow is enabled, so #VE can't be used
+ *
+ * @return BOOLEAN
+ */
+static BOOLEAN
+VeIsKvaShadowEnabled()
+{
+    ULONG KvaShadowFlags = 0;
+
+    if (!NT_SUCCESS(ZwQuerySystemInformation(VE_SYSTEM_KERNEL_VA_SHADOW_INFORMATION, &KvaShadowFlags, sizeof(KvaShadowFlags), NULL)))
+    {
+        //
+        // The older versions of Windows don't have the KVA shadow
+        //
+        return FALSE;
+    }
+
+    //
+    // Bit 0 is KvaShadowEnabled
+    //
+    return (KvaShadowFlags & 1) ? TRUE : FALSE;
+}
+
+/**
+ * @brief Allocate the state of the virtualization exceptions (if they're supported)
+ * @details Should be called in vmx non-root in PASSIVE_LEVEL after initializing
+ * EPT and before setting up the VMCS of the cores
+ *
+ * @return BOOLEAN Whether #VE is used or not
+ */
+BOOLEAN
+VeInitialize()
+{
+    ULONG ProcessorCount = KeQueryActiveProcessorCount(0);
+    MSR   SecondaryControls;
+
+    VeCoreStates = NULL;
+
+    //
+    // The instruction is executed in the clean view, so EPTP switching is needed
+    //
+    if (!g_EptpSwitchingSupport || !g_EptState->CleanView)
+    {
+        return FALSE;
+    }
+
+    SecondaryControls.Content = __readmsr(MSR_IA32_VMX_PROCBASED_CTLS2);
+
+    if (!(SecondaryControls.High & CPU_BASED_CTL2_EPT_VE))
+    {
+        LogWarning("The processor doesn't support virtualization exceptions, the read/write hooks are handled in vmx-root");
+        return FALSE;
+    }
+
+    if (VeIsKvaShadowEnabled())
+    {
+        LogWarning("Virtualization exceptions are not used as KVA shadow is enabled");
+        return FALSE;
+    }
+
+    VeCoreStates = ExAllocatePoolWithTag(NonPagedPool, sizeof(VE_CORE_STATE) * ProcessorCount, POOLTAG);
+
+    if (!VeCoreStates)
+    {
+        LogWarning("Unable to allocate memory for virtualization exceptions");
+        return FALSE;
+    }
+
+    RtlZeroMemory(VeCoreStates, sizeof(VE_CORE_STATE) * ProcessorCount);
+
+    return TRUE;
+}
+
+/**
+ * @brief Free the state of the virtualization exceptions
+ * @details Should be called after removing the handlers and terminating vmx
+ *
+ * @return VOID
+ */
+VOID
+VeUninitialize()
+{
+    if (VeCoreStates)
+    {
+        ExFreePoolWithTag(VeCoreStates, POOLTAG);
+        VeCoreStates = NULL;
+    }
+}
+
+/**
+ * @brief Set up the VMCS fields of the virtualization exceptions
+ * @details Should be called while setting up the VMCS of the core, the
+ * "EPT-violation #VE" control is set by the caller
+ *
+ * @param CoreIndex Index of the core
+ * @return VOID
+ */
+VOID
+VeSetupVmcs(ULONG CoreIndex)
+{
+    __vmx_vmwrite(VIRT_EXCEPTION_INFO, VirtualAddressToPhysicalAddress(&VeCoreStates[CoreIndex].Information));
+    __vmx_vmwrite(EPTP_INDEX, EPT_VIEW_INDEX_HOOKED);
+}
+
+/**
+ * @brief Get the handler of a gate of IDT
+ *
+ * @param Gate The gate descriptor
+ * @return UINT64
+ */
+static UINT64
+VeGetGateHandler(PVE_IDT_GATE_DESCRIPTOR Gate)
+{
+    return ((UINT64)Gate->OffsetHigh << 32) | ((UINT64)Gate->OffsetMiddle << 16) | Gate->OffsetLow;
+}
+
+/**
+ * @brief Change the handler of a gate of IDT (the other fields are not changed)
+ * @details The IDT might be mapped as read-only, so it's changed through a
+ * new mapping of its page
+ *
+ * @param Gate The gate descriptor
+ * @param Handler The new handler
+ * @return BOOLEAN
+ */
+static BOOLEAN
+VeSetGateHandler(PVE_IDT_GATE_DESCRIPTOR Gate, UINT64 Handler)
+{
+    PMDL                    Mdl;
+    PVE_IDT_GATE_DESCRIPTOR MappedGate;
+
+    Mdl = IoAllocateMdl(Gate, sizeof(VE_IDT_GATE_DESCRIPTOR), FALSE, FALSE, NULL);
+
+    if (!Mdl)
+    {
+        return FALSE;
+    }
+
+    MmBuildMdlForNonPagedPool(Mdl);
+
+    MappedGate = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, MmCached, NULL, FALSE, NormalPagePriority);
+
+    if (!MappedGate)
+    {
+        IoFreeMdl(Mdl);
+        return FALSE;
+    }
+
+    //
+    // The IDT is only used by this core, so disabling the interrupts is enough
+    //
+    _disable();
+
+    MappedGate->OffsetLow    = (UINT16)Handler;
+    MappedGate->OffsetMiddle = (UINT16)(Handler >> 16);
+    MappedGate->OffsetHigh   = (UINT32)(Handler >> 32);
+
+    _enable();
+
+    MmUnmapLockedPages(MappedGate, Mdl);
+    IoFreeMdl(Mdl);
+
+    return TRUE;
+}
+
+/**
+ * @brief Install our #VE and #DB handlers in the IDT of the current core
+ * @details Should be called in vmx non-root of the core before launching the VM
+ *
+ * @param CoreIndex Index of the core
+ * @return BOOLEAN Returns false if the #VEs shouldn't be enabled in this core
+ */
+BOOLEAN
+VeInstallHandlers(ULONG CoreIndex)
+{
+    PVE_IDT_GATE_DESCRIPTOR Idt   = (PVE_IDT_GATE_DESCRIPTOR)AsmGetIdtBase();
+    PVE_CORE_STATE          State = &VeCoreStates[CoreIndex];
+
+    State->OriginalVeHandler    = VeGetGateHandler(&Idt[VE_VECTOR]);
+    State->OriginalDebugHandler = VeGetGateHandler(&Idt[VE_DEBUG_VECTOR]);
+
+    if (!VeSetGateHandler(&Idt[VE_DEBUG_VECTOR], (UINT64)AsmVeDebugHandler))
+    {
+        LogWarning("Unable to install the #DB handler, virtualization exceptions are not used in the core %x", CoreIndex);
+        State->OriginalVeHandler = State->OriginalDebugHandler = NULL;
+        return FALSE;
+    }
+
+    if (!VeSetGateHandler(&Idt[VE_VECTOR], (UINT64)AsmVeHandler))
+    {
+        LogWarning("Unable to install the #VE handler, virtualization exceptions are not used in the core %x", CoreIndex);
+        VeSetGateHandler(&Idt[VE_DEBUG_VECTOR], State->OriginalDebugHandler);
+        State->OriginalVeHandler = State->OriginalDebugHandler = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Broadcast to restore the original #VE and #DB handlers of the cores
+ * @details Should be called after removing the hooks, as patchguard checks IDT
+ *
+ * @param Dpc
+ * @param DeferredContext
+ * @param SystemArgument1
+ * @param SystemArgument2
+ * @return VOID
+ */
+VOID
+VeDpcBroadcastRemoveHandlers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    PVE_IDT_GATE_DESCRIPTOR Idt   = (PVE_IDT_GATE_DESCRIPTOR)AsmGetIdtBase();
+    PVE_CORE_STATE          State = &VeCoreStates[KeGetCurrentProcessorNumber()];
+
+    if (State->OriginalVeHandler)
+    {
+        VeSetGateHandler(&Idt[VE_VECTOR], State->OriginalVeHandler);
+        VeSetGateHandler(&Idt[VE_DEBUG_VECTOR], State->OriginalDebugHandler);
+
+        State->OriginalVeHandler = State->OriginalDebugHandler = NULL;
+    }
+
+    //
+    // Wait for all DPCs to synchronize at this point
+    //
+    KeSignalCallDpcSynchronize(SystemArgument2);
+
+    //
+    // Mark the DPC as being complete
+    //
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+/**
+ * @brief Handle a virtualization exception (called from AsmVeHandler in vmx non-root)
+ * @details The information area is busy until the instruction is executed, so
+ * the violations of this core are vm-exits until then
+ *
+ * @param Regs The registers of the interrupted code
+ * @param Frame The interrupt frame
+ * @return VOID
+ */
+VOID
+VeHandleVirtualizationException(PGUEST_REGS Regs, PVE_INTERRUPT_FRAME Frame)
+{
+    PVE_CORE_STATE    State = &VeCoreStates[KeGetCurrentProcessorNumber()];
+    PVE_ACCESS_RECORD Record;
+
+    //
+    // Record the access, the consumer is vmx-root of this core
+    //
+    if (State->WrittenCount - State->ReadCount < VE_RECORDS_PER_CORE)
+    {
+        Record = &State->Records[State->WrittenCount % VE_RECORDS_PER_CORE];
+
+        Record->GuestRip             = Frame->Rip;
+        Record->GuestLinearAddress   = State->Information.GuestLinearAddress;
+        Record->GuestPhysicalAddress = State->Information.GuestPhysicalAddress;
+        Record->ExitQualification    = State->Information.ExitQualification;
+
+        _WriteBarrier();
+        State->WrittenCount++;
+    }
+    else
+    {
+        State->LostCount++;
+    }
+
+    //
+    // Execute the instruction in the clean view and come back in the #DB
+    //
+    State->GuestTrapFlag    = (Frame->Rflags & X86_FLAGS_TF) ? TRUE : FALSE;
+    State->IsSingleStepping = TRUE;
+    Frame->Rflags |= X86_FLAGS_TF;
+
+    AsmVmxVmfunc(EPT_VIEW_INDEX_CLEAN);
+
+    //
+    // Let vmx-root log the records before the ring is full
+    //
+    if (State->WrittenCount - State->ReadCount >= VE_RECORDS_PER_CORE / 2)
+    {
+        AsmVmxVmcall(VMCALL_FLUSH_VE_RECORDS, NULL, NULL, NULL);
+    }
+}
+
+/**
+ * @brief Handle a debug exception (called from AsmVeDebugHandler)
+ * @details Our single-steps are handled here, the other debug exceptions are
+ * passed to the original handler
+ *
+ * @param Regs The registers of the interrupted code
+ * @param Frame The interrupt frame
+ * @return UINT64 The original handler to continue with, or zero if it's handled
+ */
+UINT64
+VeHandleDebugException(PGUEST_REGS Regs, PVE_INTERRUPT_FRAME Frame)
+{
+    PVE_CORE_STATE State = &VeCoreStates[KeGetCurrentProcessorNumber()];
+    UINT64         Dr6;
+
+    if (!State->IsSingleStepping)
+    {
+        return State->OriginalDebugHandler;
+    }
+
+    State->IsSingleStepping = FALSE;
+
+    //
+    // The instruction is executed, go back to the hooked view and let the
+    // next #VE be delivered
+    //
+    AsmVmxVmfunc(EPT_VIEW_INDEX_HOOKED);
+
+    State->Information.Busy = 0;
+
+    //
+    // The guest was single-stepping itself, so it receives this #DB
+    //
+    if (State->GuestTrapFlag)
+    {
+        return State->OriginalDebugHandler;
+    }
+
+    Frame->Rflags &= ~X86_FLAGS_TF;
+
+    Dr6 = __readdr(6);
+
+    //
+    // A hardware breakpoint is also hit by the instruction
+    //
+    if (Dr6 & VE_DR6_BREAKPOINTS)
+    {
+        __writedr(6, Dr6 & ~VE_DR6_BS);
+        return State->OriginalDebugHandler;
+    }
+
+    __writedr(6, Dr6 & ~VE_DR6_BS);
+
+    return NULL;
+}
+
+/**
+ * @brief Log the accesses that are recorded by the #VE handler of a core
+ * @details Should be called from vmx-root of the core (it's called at the
+ * start of each vm-exit)
+ *
+ * @param CoreIndex Index of the core
+ * @return VOID
+ */
+VOID
+VeDrainRecords(ULONG CoreIndex)
+{
+    PVE_CORE_STATE                       State;
+    PVE_ACCESS_RECORD                    Record;
+    VMX_EXIT_QUALIFICATION_EPT_VIOLATION Qualification;
+
+    if (!VeCoreStates)
+    {
+        return;
+    }
+
+    State = &VeCoreStates[CoreIndex];
+
+    while (State->ReadCount != State->WrittenCount)
+    {
+        Record              = &State->Records[State->ReadCount % VE_RECORDS_PER_CORE];
+        Qualification.Flags = Record->ExitQualification;
+
+        //
+        // The access is only counted if the aggregation is started
+        //
+        if (AggregationRecordAccess(CoreIndex,
+                                    Record->GuestRip,
+                                    Record->GuestLinearAddress,
+                                    Qualification.WriteAccess ? ACCESS_AGGREGATION_TYPE_WRITE : ACCESS_AGGREGATION_TYPE_READ))
+        {
+            _ReadWriteBarrier();
+            State->ReadCount++;
+            continue;
+        }
+
+        if (Qualification.WriteAccess)
+        {
+            LogInfo("Guest RIP : 0x%llx tries to write on the page at :0x%llx (#VE)", Record->GuestRip, Record->GuestLinearAddress);
+        }
+        else
+        {
+            LogInfo("Guest RIP : 0x%llx tries to read the page at :0x%llx (#VE)", Record->GuestRip, Record->GuestLinearAddress);
+        }
+
+        _ReadWriteBarrier();
+        State->ReadCount++;
+    }
+
+    if (State->LostCount != State->ReportedLost)
+    {
+        LogWarning("%llu accesses of the #VE handler of the core %x are lost",
+                   State->LostCount - State->ReportedLost,
+                   CoreIndex);
+
+        State->ReportedLost = State->LostCount;
+    }
+}
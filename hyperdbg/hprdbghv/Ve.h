@@ -0,0 +1,154 @@
+/**
+ * @file Ve.h
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Headers of the virtualization exceptions (#VE) of EPT violations
+ * @details
+ * @version 0.1
+ * @date 2020-05-11
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#pragma once
+#include <ntddk.h>
+#include "Common.h"
+
+//////////////////////////////////////////////////
+//					Definitions					//
+//////////////////////////////////////////////////
+
+/* The IDT vector of the virtualization exceptions */
+#define VE_VECTOR 20
+
+/* The IDT vector of the debug exceptions */
+#define VE_DEBUG_VECTOR 1
+
+/* Value of the busy field of the information area when it's in use (next #VEs are vm-exits) */
+#define VE_INFORMATION_AREA_BUSY 0xffffffff
+
+/* Count of the records in the ring of the accesses of each core (power of 2) */
+#define VE_RECORDS_PER_CORE 256
+
+/* The information class of NtQuerySystemInformation for the KVA shadow */
+#define VE_SYSTEM_KERNEL_VA_SHADOW_INFORMATION 196
+
+/* Single-step bit of DR6 */
+#define VE_DR6_BS (1 << 14)
+
+/* Breakpoint condition bits (B0 - B3) of DR6 */
+#define VE_DR6_BREAKPOINTS 0xf
+
+//////////////////////////////////////////////////
+//					Structures					//
+//////////////////////////////////////////////////
+
+/**
+ * @brief The virtualization-exception information area
+ * @see Vol3C[25.5.6.2(Convertible EPT Violations)]
+ *
+ */
+typedef struct _VE_INFORMATION_AREA
+{
+    UINT32 ExitReason;           // Always EXIT_REASON_EPT_VIOLATION
+    UINT32 Busy;                 // VE_INFORMATION_AREA_BUSY after a #VE, no #VE is delivered until it's cleared
+    UINT64 ExitQualification;    // Same as the exit qualification of EPT violation
+    UINT64 GuestLinearAddress;   // Guest linear address that caused the #VE
+    UINT64 GuestPhysicalAddress; // Guest physical address that caused the #VE
+    UINT16 EptpIndex;            // Index of the EPTP of the #VE in the EPTP list
+
+} VE_INFORMATION_AREA, *PVE_INFORMATION_AREA;
+
+/**
+ * @brief The frame that the processor pushes for an interrupt in 64-bit mode
+ *
+ */
+typedef struct _VE_INTERRUPT_FRAME
+{
+    UINT64 Rip;
+    UINT64 Cs;
+    UINT64 Rflags;
+    UINT64 Rsp;
+    UINT64 Ss;
+
+} VE_INTERRUPT_FRAME, *PVE_INTERRUPT_FRAME;
+
+/**
+ * @brief A 64-bit gate descriptor of IDT
+ *
+ */
+typedef struct _VE_IDT_GATE_DESCRIPTOR
+{
+    UINT16 OffsetLow;
+    UINT16 Selector;
+    UINT16 Attributes; // IST, type, DPL and P
+    UINT16 OffsetMiddle;
+    UINT32 OffsetHigh;
+    UINT32 Reserved;
+
+} VE_IDT_GATE_DESCRIPTOR, *PVE_IDT_GATE_DESCRIPTOR;
+
+/**
+ * @brief An access that is delivered as a #VE
+ *
+ */
+typedef struct _VE_ACCESS_RECORD
+{
+    UINT64 GuestRip;
+    UINT64 GuestLinearAddress;
+    UINT64 GuestPhysicalAddress;
+    UINT64 ExitQualification;
+
+} VE_ACCESS_RECORD, *PVE_ACCESS_RECORD;
+
+/**
+ * @brief The state of the virtualization exceptions of each core
+ * @details The #VE handler of the core is the only producer of the ring and
+ * vmx-root of the same core is the only consumer, the counters are not wrapped
+ * and the index of a record is (Count % VE_RECORDS_PER_CORE)
+ *
+ */
+typedef struct _VE_CORE_STATE
+{
+    DECLSPEC_ALIGN(PAGE_SIZE)
+    VE_INFORMATION_AREA Information;
+
+    UINT64  OriginalVeHandler;    // Handler of VE_VECTOR before installing ours
+    UINT64  OriginalDebugHandler; // Handler of VE_DEBUG_VECTOR before installing ours
+    BOOLEAN IsSingleStepping;     // Whether the instruction of the last #VE is executed in the clean view
+    BOOLEAN GuestTrapFlag;        // Whether the guest was single-stepping before the #VE
+
+    volatile UINT64  WrittenCount;   // Count of the written records (only changed by the #VE handler)
+    volatile UINT64  ReadCount;      // Count of the logged records (only changed by vmx-root)
+    volatile UINT64  LostCount;      // Count of the records that are dropped as the ring was full (only changed by the #VE handler)
+    UINT64           ReportedLost;   // Count of the lost records that are reported (only changed by vmx-root)
+    VE_ACCESS_RECORD Records[VE_RECORDS_PER_CORE];
+
+} VE_CORE_STATE, *PVE_CORE_STATE;
+
+//////////////////////////////////////////////////
+//				Global Variables				//
+//////////////////////////////////////////////////
+
+/* State of each core (null if the #VEs are not supported) */
+VE_CORE_STATE * VeCoreStates;
+
+//////////////////////////////////////////////////
+//					Functions					//
+//////////////////////////////////////////////////
+
+BOOLEAN
+VeInitialize();
+VOID
+VeUninitialize();
+VOID
+VeSetupVmcs(ULONG CoreIndex);
+BOOLEAN
+VeInstallHandlers(ULONG CoreIndex);
+VOID
+VeDpcBroadcastRemoveHandlers(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID
+VeHandleVirtualizationException(PGUEST_REGS Regs, PVE_INTERRUPT_FRAME Frame);
+UINT64
+VeHandleDebugException(PGUEST_REGS Regs, PVE_INTERRUPT_FRAME Frame);
+VOID
+VeDrainRecords(ULONG CoreIndex);
@@ -15,6 +15,13 @@
 #include "Hooks.h"
 #include "Common.h"
 #include "Invept.h"
+#include "Debugger.h"
+#include "Sampling.h"
+#include "Ve.h"
+#include "Pml.h"
+#include "Aggregation.h"
+#include "Benchmark.h"
+#include "GuestMemory.h"
 
 /**
  * @brief Main Vmcall Handler
@@ -73,21 +80,80 @@ VmxVmcallHandler(UINT64 VmcallNumber,
                                         OptionalParam3 /* OrigFunction */,
                                         UnsetRead,
                                         UnsetWrite,
-                                        UnsetExec);
+                                        UnsetExec,
+                                        (AttributeMask & PAGE_ATTRIB_VE) ? TRUE : FALSE,
+                                        0,
+                                        TRUE,
+                                        (AttributeMask & PAGE_ATTRIB_CURRENT_CORE) ? KeGetCurrentProcessorNumber() : DEBUGGER_EVENT_APPLY_TO_ALL_CORES,
+                                        0);
 
         VmcallStatus = (HookResult == TRUE) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 
         break;
     }
+    case VMCALL_CHANGE_PAGE_ATTRIB_BATCH:
+    {
+        HookResult = EptPerformPageHookBatch(OptionalParam1 /* Entries */, OptionalParam2 /* CountOfEntries */) != 0;
+
+        VmcallStatus = (HookResult == TRUE) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+
+        break;
+    }
+    case VMCALL_FLUSH_VE_RECORDS:
+    {
+        VeDrainRecords(KeGetCurrentProcessorNumber());
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_CONFIGURE_DIRTY_PAGE_LOG:
+    {
+        PmlConfigureLogging(KeGetCurrentProcessorNumber(), OptionalParam1 ? TRUE : FALSE);
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_FLUSH_DIRTY_PAGE_LOG:
+    {
+        PmlFlushLog(KeGetCurrentProcessorNumber());
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_COPY_ACCESS_AGGREGATION:
+    {
+        AggregationCopyTable(KeGetCurrentProcessorNumber(), (PAGGREGATION_QUERY_CONTEXT)OptionalParam1);
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_CONFIGURE_SCOPED_HOOKS:
+    {
+        HvSetExitOnCr3Change(OptionalParam1 ? TRUE : FALSE);
+        EptDisarmedViewUpdate(KeGetCurrentProcessorNumber());
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_BENCHMARK:
+    {
+        VmcallStatus = BenchmarkHandleVmcall(OptionalParam1, OptionalParam2);
+        break;
+    }
+    case VMCALL_GUEST_MEMORY_ACCESS:
+    {
+        VmcallStatus = GuestMemoryHandleVmcall((PGUEST_MEMORY_CONTEXT)OptionalParam1);
+        break;
+    }
     case VMCALL_INVEPT_SINGLE_CONTEXT:
     {
         InveptSingleContext(OptionalParam1);
+        EptCleanViewLeave();
         VmcallStatus = STATUS_SUCCESS;
         break;
     }
     case VMCALL_INVEPT_ALL_CONTEXTS:
     {
+        //
+        // The hooks are changed, so the core shouldn't stay in the clean view
+        //
         InveptAllContexts();
+        EptCleanViewLeave();
         VmcallStatus = STATUS_SUCCESS;
         break;
     }
@@ -99,20 +165,55 @@ VmxVmcallHandler(UINT64 VmcallNumber,
     }
     case VMCALL_UNHOOK_SINGLE_PAGE:
     {
-        if (!EptPageUnHookSinglePage(OptionalParam1))
+        if (EptPageUnHookSinglePage(OptionalParam1))
         {
-            VmcallStatus = STATUS_UNSUCCESSFUL;
+            VmcallStatus = STATUS_SUCCESS;
         }
         break;
     }
     case VMCALL_ENABLE_SYSCALL_HOOK_EFER:
     {
         SyscallHookConfigureEFER(TRUE);
+        VmcallStatus = STATUS_SUCCESS;
         break;
     }
     case VMCALL_DISABLE_SYSCALL_HOOK_EFER:
     {
         SyscallHookConfigureEFER(FALSE);
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_FLUSH_LOG_BUFFERS:
+    {
+        //
+        // We're the producer of the vmx-root buffer of this core
+        //
+        LogFlushNonImmediateBuffer(&MessageBufferInformation[LOG_BUFFER_INDEX(KeGetCurrentProcessorNumber(), TRUE)]);
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_UPDATE_MSR_BITMAP:
+    {
+        DebuggerUpdateMsrBitmap();
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_UPDATE_IO_BITMAP:
+    {
+        DebuggerUpdateIoBitmap();
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_CONFIGURE_SAMPLING_TIMER:
+    {
+        SamplingConfigureTimer(OptionalParam1);
+        VmcallStatus = STATUS_SUCCESS;
+        break;
+    }
+    case VMCALL_UPDATE_EXCEPTION_BITMAP:
+    {
+        DebuggerUpdateExceptionBitmap();
+        VmcallStatus = STATUS_SUCCESS;
         break;
     }
     default:
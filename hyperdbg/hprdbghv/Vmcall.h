@@ -25,6 +25,19 @@
 #define VMCALL_UNHOOK_SINGLE_PAGE        0x7 // VMCALL to remove a single physical address from hook list
 #define VMCALL_ENABLE_SYSCALL_HOOK_EFER  0x8 // VMCALL to enable syscall hook using EFER SCE bit
 #define VMCALL_DISABLE_SYSCALL_HOOK_EFER 0x9 // VMCALL to disable syscall hook using EFER SCE bit
+#define VMCALL_FLUSH_LOG_BUFFERS         0xa // VMCALL to flush the non-immediate messages of vmx-root
+#define VMCALL_UPDATE_MSR_BITMAP         0xb // VMCALL to rebuild the MSR bitmap from the msr events
+#define VMCALL_UPDATE_IO_BITMAP          0xc // VMCALL to rebuild the I/O bitmaps from the I/O events
+#define VMCALL_CONFIGURE_SAMPLING_TIMER  0xd // VMCALL to set (or disable if zero) the VMX-preemption timer of sampling
+#define VMCALL_UPDATE_EXCEPTION_BITMAP   0xe // VMCALL to rebuild the exception bitmap and the addresses from the #BP and #DB events
+#define VMCALL_CHANGE_PAGE_ATTRIB_BATCH  0xf // VMCALL to hook a batch of pages with a single invalidation
+#define VMCALL_FLUSH_VE_RECORDS          0x10 // VMCALL to log the accesses that are recorded by the #VE handler of the core
+#define VMCALL_CONFIGURE_DIRTY_PAGE_LOG  0x11 // VMCALL to enable (or disable if zero) the page-modification logging of the core
+#define VMCALL_FLUSH_DIRTY_PAGE_LOG      0x12 // VMCALL to move the page-modification log of the core to the dirty page bitmap
+#define VMCALL_COPY_ACCESS_AGGREGATION   0x13 // VMCALL to copy (and optionally clear) the access counters of the core to a query
+#define VMCALL_CONFIGURE_SCOPED_HOOKS    0x14 // VMCALL to enable (or disable if zero) the cr3-load exits of the scoped hooks and update the view of the core
+#define VMCALL_BENCHMARK                 0x15 // VMCALL of the benchmarks (a round trip without logging or changing the MSR bitmap of the core)
+#define VMCALL_GUEST_MEMORY_ACCESS       0x16 // VMCALL to copy a part of the ranges of a guest memory request
 
 //////////////////////////////////////////////////
 //				    Functions					//
@@ -21,6 +21,8 @@
 #include "Vpid.h"
 #include "Dpc.h"
 #include "Events.h"
+#include "Ve.h"
+#include "Trampoline.h"
 
 /**
  * @brief Initialize VMX Operation
@@ -32,6 +34,7 @@ VmxInitializer()
 {
     int       ProcessorCount;
     KAFFINITY AffinityMask;
+    UINT64    StartTime;
 
     if (!HvIsVmxSupported())
     {
@@ -60,6 +63,7 @@ VmxInitializer()
     // Initialize the list of hooked pages detail
     //
     InitializeListHead(&g_EptState->HookedPagesList);
+    InitializeListHead(&g_EptState->ReleasedSplitsList);
 
     //
     // Check whether EPT is supported or not
@@ -79,23 +83,37 @@ VmxInitializer()
         //
         // Build MTRR Map
         //
+        StartTime = __rdtsc();
+
         if (!EptBuildMtrrMap())
         {
             LogError("Could not build Mtrr memory map");
             return FALSE;
         }
         LogInfo("Mtrr memory map built successfully");
+
+        g_StartupTiming.MtrrCycles = __rdtsc() - StartTime;
     }
 
     //
     // Initialize Pool Manager
     //
+    StartTime = __rdtsc();
+
     if (!PoolManagerInitialize())
     {
         LogError("Could not initialize pool manager");
         return FALSE;
     }
 
+    //
+    // The pages of the trampolines are taken from the pool manager
+    //
+    TrampolineArenaInitialize();
+
+    g_StartupTiming.PoolManagerCycles = __rdtsc() - StartTime;
+    StartTime                         = __rdtsc();
+
     if (!EptLogicalProcessorInitialize())
     {
         //
@@ -105,10 +123,38 @@ VmxInitializer()
     }
 
     //
-    // Allocate and run Vmxon and Vmptrld on all logical cores
+    // The read/write hooks are delivered as #VE if it's supported, otherwise
+    // they're handled in vmx-root
+    //
+    VeInitialize();
+
+    g_StartupTiming.EptCycles = __rdtsc() - StartTime;
+    StartTime                 = __rdtsc();
+
+    //
+    // Allocate and run Vmxon and Vmptrld on all logical cores, each core also allocates
+    // its stack and bitmaps so the allocations of the cores are done in parallel
     //
     KeGenericCallDpc(VmxDpcBroadcastAllocateVmxonRegions, 0x0);
 
+    g_StartupTiming.RegionsCycles = __rdtsc() - StartTime;
+
+    //
+    // The cores don't stop the broadcast if they fail, the regions of all of them
+    // should be checked here
+    //
+    ProcessorCount = KeQueryActiveProcessorCount(0);
+
+    for (int i = 0; i < ProcessorCount; i++)
+    {
+        if (!g_GuestState[i].VmcsRegionVirtualAddress || !g_GuestState[i].VmmStack ||
+            !g_GuestState[i].MsrBitmapVirtualAddress || !g_GuestState[i].IoBitmapVirtualAddressB)
+        {
+            LogWarning("Vmx regions of logical core %d are not allocated", i);
+            return FALSE;
+        }
+    }
+
     //
     // Everything is ok, let's return true
     //
@@ -194,19 +240,14 @@ VmxVirtualizeCurrentSystem(PVOID GuestStack)
 BOOLEAN
 VmxTerminate()
 {
-    NTSTATUS Status           = STATUS_SUCCESS;
-    INT      CurrentCoreIndex = 0;
+    INT CurrentCoreIndex = 0;
 
     //
     // Get the current core index
     //
     CurrentCoreIndex = KeGetCurrentProcessorNumber();
 
-    //
-    // Execute Vmcall to to turn off vmx from Vmx root mode
-    //
-    Status = AsmVmxVmcall(VMCALL_VMXOFF, NULL, NULL, NULL);
-    if (Status == STATUS_SUCCESS)
+    if (VmxSuspend())
     {
         LogInfo("VMX Terminated on logical core %d\n", CurrentCoreIndex);
 
@@ -217,6 +258,8 @@ VmxTerminate()
         MmFreeContiguousMemory(g_GuestState[CurrentCoreIndex].VmcsRegionVirtualAddress);
         ExFreePoolWithTag(g_GuestState[CurrentCoreIndex].VmmStack, POOLTAG);
         ExFreePoolWithTag(g_GuestState[CurrentCoreIndex].MsrBitmapVirtualAddress, POOLTAG);
+        ExFreePoolWithTag(g_GuestState[CurrentCoreIndex].IoBitmapVirtualAddressA, POOLTAG);
+        ExFreePoolWithTag(g_GuestState[CurrentCoreIndex].IoBitmapVirtualAddressB, POOLTAG);
 
         return TRUE;
     }
@@ -224,6 +267,23 @@ VmxTerminate()
     return FALSE;
 }
 
+/**
+ * @brief Turn off vmx on the current core without freeing its regions
+ * @details The VMCS is cleared by VMXOFF, so it can be loaded again by
+ * VmxVirtualizeCurrentSystem after VmxReuseVmxonRegion
+ * 
+ * @return BOOLEAN Returns true if vmxoff successfully executed in vmcall or otherwise
+ * returns false
+ */
+BOOLEAN
+VmxSuspend()
+{
+    //
+    // Execute Vmcall to to turn off vmx from Vmx root mode
+    //
+    return AsmVmxVmcall(VMCALL_VMXOFF, NULL, NULL, NULL) == STATUS_SUCCESS;
+}
+
 /**
  * @brief Implementation of VMPTRST instruction
  * 
@@ -308,6 +368,9 @@ VmxSetupVmcs(VIRTUAL_MACHINE_STATE * CurrentGuestState, PVOID GuestStack)
     ULONG64            GdtBase         = 0;
     SEGMENT_SELECTOR   SegmentSelector = {0};
     IA32_VMX_BASIC_MSR VmxBasicMsr     = {0};
+    BOOLEAN            EnableVmfunc    = FALSE;
+    BOOLEAN            EnableVe        = FALSE;
+    BOOLEAN            EnableSpp       = FALSE;
 
     //
     // Reading IA32_VMX_BASIC_MSR
@@ -358,7 +421,12 @@ VmxSetupVmcs(VIRTUAL_MACHINE_STATE * CurrentGuestState, PVOID GuestStack)
     __vmx_vmwrite(GUEST_FS_BASE, __readmsr(MSR_FS_BASE));
     __vmx_vmwrite(GUEST_GS_BASE, __readmsr(MSR_GS_BASE));
 
-    CpuBasedVmExecControls = HvAdjustControls(CPU_BASED_ACTIVATE_MSR_BITMAP | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS,
+    //
+    // The cr3 loads exit while there are hooks that are scoped to a process
+    // (e.g, the hooks before launching or resuming vmx)
+    //
+    CpuBasedVmExecControls = HvAdjustControls(CPU_BASED_ACTIVATE_MSR_BITMAP | CPU_BASED_ACTIVATE_IO_BITMAP | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS |
+                                                  (g_EptState->CountOfScopedHooks != 0 ? CPU_BASED_CR3_LOAD_EXITING : 0),
                                               VmxBasicMsr.Fields.VmxCapabilityHint ? MSR_IA32_VMX_TRUE_PROCBASED_CTLS : MSR_IA32_VMX_PROCBASED_CTLS);
 
     __vmx_vmwrite(CPU_BASED_VM_EXEC_CONTROL, CpuBasedVmExecControls);
@@ -367,9 +435,27 @@ VmxSetupVmcs(VIRTUAL_MACHINE_STATE * CurrentGuestState, PVOID GuestStack)
             VmxBasicMsr.Fields.VmxCapabilityHint ? "MSR_IA32_VMX_TRUE_PROCBASED_CTLS" : "MSR_IA32_VMX_PROCBASED_CTLS",
             CpuBasedVmExecControls);
 
+    //
+    // EPTP switching needs the clean view for the second entry of the EPTP list
+    //
+    EnableVmfunc = g_EptpSwitchingSupport && g_EptState->CleanView != NULL;
+
+    //
+    // The #VE handler single-steps the instruction in the clean view using VMFUNC
+    //
+    EnableVe = EnableVmfunc && VeCoreStates != NULL && VeInstallHandlers(KeGetCurrentProcessorNumber());
+
+    //
+    // The write watches of a byte range use the sub-page permission table
+    //
+    EnableSpp = g_EptState->SppTable != NULL;
+
     SecondaryProcBasedVmExecControls = HvAdjustControls(CPU_BASED_CTL2_RDTSCP |
                                                             CPU_BASED_CTL2_ENABLE_EPT | CPU_BASED_CTL2_ENABLE_INVPCID |
-                                                            CPU_BASED_CTL2_ENABLE_XSAVE_XRSTORS | CPU_BASED_CTL2_ENABLE_VPID,
+                                                            CPU_BASED_CTL2_ENABLE_XSAVE_XRSTORS | CPU_BASED_CTL2_ENABLE_VPID |
+                                                            (EnableVmfunc ? CPU_BASED_CTL2_ENABLE_VMFUNC : 0) |
+                                                            (EnableVe ? CPU_BASED_CTL2_EPT_VE : 0) |
+                                                            (EnableSpp ? CPU_BASED_CTL2_SUB_PAGE_WRITE_PERMISSIONS : 0),
                                                         MSR_IA32_VMX_PROCBASED_CTLS2);
 
     __vmx_vmwrite(SECONDARY_VM_EXEC_CONTROL, SecondaryProcBasedVmExecControls);
@@ -432,6 +518,12 @@ VmxSetupVmcs(VIRTUAL_MACHINE_STATE * CurrentGuestState, PVOID GuestStack)
     //
     __vmx_vmwrite(MSR_BITMAP, CurrentGuestState->MsrBitmapPhysicalAddress);
 
+    //
+    // Set I/O Bitmaps
+    //
+    __vmx_vmwrite(IO_BITMAP_A, CurrentGuestState->IoBitmapPhysicalAddressA);
+    __vmx_vmwrite(IO_BITMAP_B, CurrentGuestState->IoBitmapPhysicalAddressB);
+
     //
     // Set exception bitmap to hook division by zero (bit 1 of EXCEPTION_BITMAP)
     // __vmx_vmwrite(EXCEPTION_BITMAP, 0x8); // breakpoint 3nd bit
@@ -441,7 +533,32 @@ VmxSetupVmcs(VIRTUAL_MACHINE_STATE * CurrentGuestState, PVOID GuestStack)
     //
     // Set up EPT
     //
-    __vmx_vmwrite(EPT_POINTER, g_EptState->EptPointer.Flags);
+    __vmx_vmwrite(EPT_POINTER, EptGetEptPointerOfCore(KeGetCurrentProcessorNumber()));
+
+    //
+    // Set up the sub-page permission table (shared by all the views)
+    //
+    if (EnableSpp)
+    {
+        __vmx_vmwrite(SPP_TABLE_POINTER, VirtualAddressToPhysicalAddress(g_EptState->SppTable));
+    }
+
+    //
+    // Set up EPTP switching (VM function 0) with the EPTP list of this core
+    //
+    if (EnableVmfunc)
+    {
+        __vmx_vmwrite(VM_FUNCTION_CONTROL, 1);
+        __vmx_vmwrite(EPTP_LIST_ADDR, VirtualAddressToPhysicalAddress(&g_EptState->CoreViews[KeGetCurrentProcessorNumber()].EptpList[0]));
+    }
+
+    //
+    // Set up the information area of virtualization exceptions
+    //
+    if (EnableVe)
+    {
+        VeSetupVmcs(KeGetCurrentProcessorNumber());
+    }
 
     //
     // Set up VPID
@@ -508,11 +625,13 @@ VmxVmresume()
 VOID
 VmxVmxoff()
 {
-    INT    CurrentProcessorIndex = 0;
-    UINT64 GuestRSP              = 0; // Save a pointer to guest rsp for times that we want to return to previous guest stateS
-    UINT64 GuestRIP              = 0; // Save a pointer to guest rip for times that we want to return to previous guest state
-    UINT64 GuestCr3              = 0;
-    UINT64 ExitInstructionLength = 0;
+    INT      CurrentProcessorIndex = 0;
+    UINT64   GuestRSP              = 0; // Save a pointer to guest rsp for times that we want to return to previous guest stateS
+    UINT64   GuestRIP              = 0; // Save a pointer to guest rip for times that we want to return to previous guest state
+    UINT64   GuestCr3              = 0;
+    UINT64   ExitInstructionLength = 0;
+    UINT32   VmEntryControls       = 0;
+    EFER_MSR MsrValue;
 
     CurrentProcessorIndex = KeGetCurrentProcessorNumber();
 
@@ -533,13 +652,13 @@ VmxVmxoff()
     //
     // Read guest rsp and rip
     //
-    __vmx_vmread(GUEST_RIP, &GuestRIP);
-    __vmx_vmread(GUEST_RSP, &GuestRSP);
+    GuestRIP = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RIP);
+    GuestRSP = HvGetExitContextField(VMX_EXIT_CONTEXT_GUEST_RSP);
 
     //
     // Read instruction length
     //
-    __vmx_vmread(VM_EXIT_INSTRUCTION_LEN, &ExitInstructionLength);
+    ExitInstructionLength = HvGetExitContextField(VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH);
     GuestRIP += ExitInstructionLength;
 
     //
@@ -553,6 +672,21 @@ VmxVmxoff()
     //
     g_GuestState[CurrentProcessorIndex].VmxoffState.IsVmxoffExecuted = TRUE;
 
+    //
+    // The EFER syscall hook loads an EFER without the SCE bit, the syscalls
+    // should work after turning off vmx
+    //
+    __vmx_vmread(VM_ENTRY_CONTROLS, &VmEntryControls);
+
+    g_GuestState[CurrentProcessorIndex].VmxoffState.IsEferSyscallHookEnabled = (VmEntryControls & VM_ENTRY_LOAD_IA32_EFER) != 0;
+
+    if (g_GuestState[CurrentProcessorIndex].VmxoffState.IsEferSyscallHookEnabled)
+    {
+        MsrValue.Flags         = __readmsr(MSR_EFER);
+        MsrValue.SyscallEnable = TRUE;
+        __writemsr(MSR_EFER, MsrValue.Flags);
+    }
+
     //
     // Restore the previous FS, GS , GDTR and IDTR register as patchguard might find the modified
     //
@@ -26,10 +26,10 @@
 
 /* PIN-Based Execution */
 #define PIN_BASED_VM_EXECUTION_CONTROLS_EXTERNAL_INTERRUPT        0x00000001
-#define PIN_BASED_VM_EXECUTION_CONTROLS_NMI_EXITING               0x00000004
-#define PIN_BASED_VM_EXECUTION_CONTROLS_VIRTUAL_NMI               0x00000010
-#define PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER          0x00000020
-#define PIN_BASED_VM_EXECUTION_CONTROLS_PROCESS_POSTED_INTERRUPTS 0x00000040
+#define PIN_BASED_VM_EXECUTION_CONTROLS_NMI_EXITING               0x00000008
+#define PIN_BASED_VM_EXECUTION_CONTROLS_VIRTUAL_NMI               0x00000020
+#define PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER          0x00000040
+#define PIN_BASED_VM_EXECUTION_CONTROLS_PROCESS_POSTED_INTERRUPTS 0x00000080
 
 /* CPU-Based Controls */
 #define CPU_BASED_VIRTUAL_INTR_PENDING        0x00000004
@@ -62,7 +62,10 @@
 #define CPU_BASED_CTL2_VIRTUAL_INTERRUPT_DELIVERY 0x200
 #define CPU_BASED_CTL2_ENABLE_INVPCID             0x1000
 #define CPU_BASED_CTL2_ENABLE_VMFUNC              0x2000
+#define CPU_BASED_CTL2_ENABLE_PML                 0x20000
+#define CPU_BASED_CTL2_EPT_VE                     0x40000
 #define CPU_BASED_CTL2_ENABLE_XSAVE_XRSTORS       0x100000
+#define CPU_BASED_CTL2_SUB_PAGE_WRITE_PERMISSIONS 0x800000
 
 /* VM-exit Control Bits */
 #define VM_EXIT_SAVE_DEBUG_CONTROLS        0x00000004
@@ -145,6 +148,7 @@
 #define EXIT_REASON_XSAVES                       63
 #define EXIT_REASON_XRSTORS                      64
 #define EXIT_REASON_PCOMMIT                      65
+#define EXIT_REASON_SPP_EVENT                    66
 
 /* CPUID RCX(s) - Based on Hyper-V */
 #define HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS 0x40000000
@@ -166,6 +170,15 @@
 /* Stack size */
 #define VMM_STACK_SIZE 0x8000
 
+/* Count of the cached CPUID results of each core (should be a power of 2) */
+#define CPUID_CACHE_ENTRIES 32
+
+/* Maximum count of the elements of a REP INS or REP OUTS that are emulated in one vm-exit */
+#define IO_STRING_MAXIMUM_ELEMENTS 4096
+
+/* Count of the handlers of the dispatch table of each core (0 to EXIT_REASON_SPP_EVENT) */
+#define VMEXIT_HANDLERS_COUNT 67
+
 //////////////////////////////////////////////////
 //					Enums						//
 //////////////////////////////////////////////////
@@ -217,6 +230,7 @@ typedef enum _VMCS_FIELDS
     VMWRITE_BITMAP           = 0x00002028,
     VIRT_EXCEPTION_INFO      = 0x0000202a,
     XSS_EXIT_BITMAP          = 0x0000202c,
+    SPP_TABLE_POINTER        = 0x00002030,
     TSC_MULTIPLIER           = 0x00002032,
     GUEST_PHYSICAL_ADDRESS   = 0x00002400,
     VMCS_LINK_POINTER        = 0x00002800,
@@ -328,22 +342,78 @@ typedef enum _VMCS_FIELDS
     HOST_RIP                     = 0x00006c16,
 };
 
+/**
+ * @brief The VMCS fields that are cached for each vm-exit
+ * 
+ */
+typedef enum _VMX_EXIT_CONTEXT_FIELD
+{
+    VMX_EXIT_CONTEXT_GUEST_RIP,
+    VMX_EXIT_CONTEXT_GUEST_RSP,
+    VMX_EXIT_CONTEXT_GUEST_RFLAGS,
+    VMX_EXIT_CONTEXT_EXIT_QUALIFICATION,      // read-only
+    VMX_EXIT_CONTEXT_INSTRUCTION_LENGTH,      // read-only
+    VMX_EXIT_CONTEXT_GUEST_PHYSICAL_ADDRESS,  // read-only
+    VMX_EXIT_CONTEXT_MAXIMUM_FIELDS
+
+} VMX_EXIT_CONTEXT_FIELD;
+
 //////////////////////////////////////////////////
 //			 Structures & Unions				//
 //////////////////////////////////////////////////
 
+/**
+ * @brief Cache of the VMCS fields of the current vm-exit
+ * @details The fields are read from the VMCS the first time that they're used
+ * in each vm-exit, the modified fields are written to the VMCS before VMRESUME
+ * 
+ */
+typedef struct _VMX_EXIT_CONTEXT
+{
+    UINT32 ValidFields;                             // Bit of each VMX_EXIT_CONTEXT_FIELD that is read
+    UINT32 DirtyFields;                             // Bit of each VMX_EXIT_CONTEXT_FIELD that should be written back
+    UINT64 Values[VMX_EXIT_CONTEXT_MAXIMUM_FIELDS]; // Values of the fields
+
+} VMX_EXIT_CONTEXT, *PVMX_EXIT_CONTEXT;
+
+/**
+ * @brief The result of a CPUID (leaf, subleaf) after applying the
+ * modifications of the hypervisor
+ * 
+ */
+typedef struct _CPUID_CACHE_ENTRY
+{
+    BOOLEAN Valid;
+    UINT32  Leaf;         // EAX
+    UINT32  Subleaf;      // ECX
+    INT32   Registers[4]; // EAX, EBX, ECX, EDX
+
+} CPUID_CACHE_ENTRY, *PCPUID_CACHE_ENTRY;
+
 /**
  * @brief Save the state of core in the case of VMXOFF
  * 
  */
 typedef struct _VMX_VMXOFF_STATE
 {
-    BOOLEAN IsVmxoffExecuted; // Shows whether the VMXOFF executed or not
-    UINT64  GuestRip;         // Rip address of guest to return
-    UINT64  GuestRsp;         // Rsp address of guest to return
+    BOOLEAN IsVmxoffExecuted;         // Shows whether the VMXOFF executed or not
+    BOOLEAN IsEferSyscallHookEnabled; // Shows whether the EFER syscall hook was enabled (it's enabled again after resuming)
+    UINT64  GuestRip;                 // Rip address of guest to return
+    UINT64  GuestRsp;                 // Rsp address of guest to return
 
 } VMX_VMXOFF_STATE, *PVMX_VMXOFF_STATE;
 
+/**
+ * @brief Handler of an exit reason in the dispatch table of a core
+ * @details Called in vmx-root, the RIP is incremented after the handler
+ * unless it sets IncrementRip to FALSE
+ * 
+ */
+typedef VOID
+VMEXIT_HANDLER(PGUEST_REGS GuestRegs, UINT32 CoreIndex, UINT32 ExitReason);
+
+typedef VMEXIT_HANDLER * PVMEXIT_HANDLER;
+
 /**
  * @brief The status of each core after and before VMX
  * 
@@ -360,10 +430,21 @@ typedef struct _VIRTUAL_MACHINE_STATE
     UINT64                    VmmStack;                   // Stack for VMM in VM-Exit State
     UINT64                    MsrBitmapVirtualAddress;    // Msr Bitmap Virtual Address
     UINT64                    MsrBitmapPhysicalAddress;   // Msr Bitmap Physical Address
+    UINT64                    IoBitmapVirtualAddressA;    // I/O Bitmap A (ports 0x0000 - 0x7fff) Virtual Address
+    UINT64                    IoBitmapPhysicalAddressA;   // I/O Bitmap A (ports 0x0000 - 0x7fff) Physical Address
+    UINT64                    IoBitmapVirtualAddressB;    // I/O Bitmap B (ports 0x8000 - 0xffff) Virtual Address
+    UINT64                    IoBitmapPhysicalAddressB;   // I/O Bitmap B (ports 0x8000 - 0xffff) Physical Address
     PROCESSOR_DEBUGGING_STATE DebuggingState;             // Holds the debugging state of the processor (used by HyperDbg to execute commands)
     VMX_VMXOFF_STATE          VmxoffState;                // Shows the vmxoff state of the guest
     PEPT_HOOKED_PAGE_DETAIL   MtfEptHookRestorePoint;     // It shows the detail of the hooked paged that should be restore in MTF vm-exit
     DEBUGGER_CORE_EVENTS      Events;                     // Core specific events (for debugger)
+    volatile UINT64           VmexitEpoch;                // Incremented at the start and the end of each vm-exit (odd in vmx-root)
+    VMX_EXIT_CONTEXT          ExitContext;                // Cached VMCS fields of the current vm-exit
+    CPUID_CACHE_ENTRY         CpuidCache[CPUID_CACHE_ENTRIES]; // Cached results of the CPUIDs of this core
+    PVMEXIT_HANDLER           ExitHandlers[VMEXIT_HANDLERS_COUNT]; // Dispatch table of the exit reasons of this core
+    UINT64                    MemoryMapperVirtualAddress; // Reserved address to map the pages of the guest in vmx-root
+    PUINT64                   MemoryMapperPte;            // Page table entry of the reserved address
+    VMX_STARTUP_CORE_TIMING   StartupTiming;              // The cycles of the bring-up of this core
 } VIRTUAL_MACHINE_STATE, *PVIRTUAL_MACHINE_STATE;
 
 /**
@@ -420,16 +501,27 @@ VmxInitializer();
 /* Terminate VMX Operation */
 BOOLEAN
 VmxTerminate();
+/* Turn off VMX Operation and keep the regions of the core */
+BOOLEAN
+VmxSuspend();
 
 /* Allocate VMX Regions */
 BOOLEAN
 VmxAllocateVmxonRegion(VIRTUAL_MACHINE_STATE * CurrentGuestState);
 BOOLEAN
+VmxReuseVmxonRegion(VIRTUAL_MACHINE_STATE * CurrentGuestState);
+BOOLEAN
 VmxAllocateVmcsRegion(VIRTUAL_MACHINE_STATE * CurrentGuestState);
 BOOLEAN
 VmxAllocateVmmStack(INT ProcessorID);
 BOOLEAN
 VmxAllocateMsrBitmap(INT ProcessorID);
+BOOLEAN
+VmxAllocateIoBitmaps(INT ProcessorID);
+BOOLEAN
+VmxAllocateMemoryMapper(INT ProcessorID);
+VOID
+VmxFreeMemoryMapper(INT ProcessorID);
 
 /* VMX Instructions */
 VOID
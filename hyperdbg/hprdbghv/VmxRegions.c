@@ -22,7 +22,10 @@
 #include "Invept.h"
 
 /**
- * @brief Allocates Vmx regions for all logical cores (Vmxon region and Vmcs region)
+ * @brief Allocates Vmx regions for all logical cores (Vmxon region, Vmcs region,
+ * Vmm stack, Msr bitmap and I/O bitmaps)
+ * @details The cores allocate their regions in parallel, a core that fails leaves
+ * its regions NULL and still signals the DPC so the other cores are not blocked
  * 
  * @param Dpc 
  * @param DeferredContext 
@@ -33,7 +36,9 @@
 BOOLEAN
 VmxDpcBroadcastAllocateVmxonRegions(KDPC * Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
 {
-    int CurrentProcessorNumber = KeGetCurrentProcessorNumber();
+    int     CurrentProcessorNumber = KeGetCurrentProcessorNumber();
+    UINT64  StartTime              = __rdtsc();
+    BOOLEAN Result                 = FALSE;
 
     LogInfo("Allocating Vmx Regions for logical core %d", CurrentProcessorNumber);
 
@@ -47,13 +52,19 @@ VmxDpcBroadcastAllocateVmxonRegions(KDPC * Dpc, PVOID DeferredContext, PVOID Sys
     if (!VmxAllocateVmxonRegion(&g_GuestState[CurrentProcessorNumber]))
     {
         LogError("Error in allocating memory for Vmxon region");
-        return FALSE;
     }
-    if (!VmxAllocateVmcsRegion(&g_GuestState[CurrentProcessorNumber]))
+    else if (!VmxAllocateVmcsRegion(&g_GuestState[CurrentProcessorNumber]))
     {
         LogError("Error in allocating memory for Vmcs region");
-        return FALSE;
     }
+    else if (VmxAllocateVmmStack(CurrentProcessorNumber) &&
+             VmxAllocateMsrBitmap(CurrentProcessorNumber) &&
+             VmxAllocateIoBitmaps(CurrentProcessorNumber))
+    {
+        Result = TRUE;
+    }
+
+    g_GuestState[CurrentProcessorNumber].StartupTiming.RegionsCycles = __rdtsc() - StartTime;
 
     //
     // Wait for all DPCs to synchronize at this point
@@ -65,7 +76,7 @@ VmxDpcBroadcastAllocateVmxonRegions(KDPC * Dpc, PVOID DeferredContext, PVOID Sys
     //
     KeSignalCallDpcDone(SystemArgument1);
 
-    return TRUE;
+    return Result;
 }
 
 /**
@@ -155,6 +166,37 @@ VmxAllocateVmxonRegion(VIRTUAL_MACHINE_STATE * CurrentGuestState)
     return TRUE;
 }
 
+/**
+ * @brief Execute Vmxon on the region that is kept while the vmx is suspended
+ * 
+ * @param CurrentGuestState 
+ * @return BOOLEAN Returns true if vmxon executed without error otherwise returns false
+ */
+BOOLEAN
+VmxReuseVmxonRegion(VIRTUAL_MACHINE_STATE * CurrentGuestState)
+{
+    IA32_VMX_BASIC_MSR VmxBasicMsr = {0};
+    int                VmxonStatus;
+    UINT64             AlignedVmxonRegion;
+
+    AlignedVmxonRegion = ((UINT64)CurrentGuestState->VmxonRegionVirtualAddress + ALIGNMENT_PAGE_SIZE - 1) & ~(ALIGNMENT_PAGE_SIZE - 1);
+
+    //
+    // The region is zeroed by the allocation, only the revision identifier is written again
+    //
+    VmxBasicMsr.All               = __readmsr(MSR_IA32_VMX_BASIC);
+    *(UINT64 *)AlignedVmxonRegion = VmxBasicMsr.Fields.RevisionIdentifier;
+
+    VmxonStatus = __vmx_on(&CurrentGuestState->VmxonRegionPhysicalAddress);
+    if (VmxonStatus)
+    {
+        LogError("Executing Vmxon instruction failed with status : %d", VmxonStatus);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /**
  * @brief Allocate Vmcs region and set the Revision ID based on IA32_VMX_BASIC_MSR
  * 
@@ -288,3 +330,104 @@ VmxAllocateMsrBitmap(INT ProcessorID)
 
     return TRUE;
 }
+
+/**
+ * @brief Allocate the buffers for I/O Bitmaps (A and B)
+ * @details The bitmaps are empty so no I/O instruction causes vm-exit
+ * until a port is watched
+ * 
+ * @param ProcessorID 
+ * @return BOOLEAN Returns true if allocation was successfull otherwise returns false
+ */
+BOOLEAN
+VmxAllocateIoBitmaps(INT ProcessorID)
+{
+    //
+    // Allocate memory for I/O Bitmap (A)
+    //
+    g_GuestState[ProcessorID].IoBitmapVirtualAddressA = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, POOLTAG); // should be aligned
+
+    if (g_GuestState[ProcessorID].IoBitmapVirtualAddressA == NULL)
+    {
+        LogWarning("Insufficient memory in allocationg I/O Bitmaps A");
+        return FALSE;
+    }
+    RtlZeroMemory(g_GuestState[ProcessorID].IoBitmapVirtualAddressA, PAGE_SIZE);
+
+    g_GuestState[ProcessorID].IoBitmapPhysicalAddressA = VirtualAddressToPhysicalAddress(g_GuestState[ProcessorID].IoBitmapVirtualAddressA);
+
+    //
+    // Allocate memory for I/O Bitmap (B)
+    //
+    g_GuestState[ProcessorID].IoBitmapVirtualAddressB = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, POOLTAG); // should be aligned
+
+    if (g_GuestState[ProcessorID].IoBitmapVirtualAddressB == NULL)
+    {
+        ExFreePoolWithTag(g_GuestState[ProcessorID].IoBitmapVirtualAddressA, POOLTAG);
+        LogWarning("Insufficient memory in allocationg I/O Bitmaps B");
+        return FALSE;
+    }
+    RtlZeroMemory(g_GuestState[ProcessorID].IoBitmapVirtualAddressB, PAGE_SIZE);
+
+    g_GuestState[ProcessorID].IoBitmapPhysicalAddressB = VirtualAddressToPhysicalAddress(g_GuestState[ProcessorID].IoBitmapVirtualAddressB);
+
+    LogInfo("I/O Bitmap A Virtual Address : 0x%llx", g_GuestState[ProcessorID].IoBitmapVirtualAddressA);
+    LogInfo("I/O Bitmap B Virtual Address : 0x%llx", g_GuestState[ProcessorID].IoBitmapVirtualAddressB);
+
+    return TRUE;
+}
+
+/**
+ * @brief Reserve an address to map the pages of the guest in vmx-root
+ * @details Only a range of system addresses is reserved, the entry of the
+ * page table is changed in vmx-root (see CopyGuestPhysicalMemory), it's a
+ * kernel address so its entry is found by the tables of the system
+ *
+ * @param ProcessorID Logical Core Id
+ * @return BOOLEAN Returns true if allocation was successfull otherwise returns false
+ */
+BOOLEAN
+VmxAllocateMemoryMapper(INT ProcessorID)
+{
+    PVOID VirtualAddress;
+
+    VirtualAddress = MmAllocateMappingAddress(PAGE_SIZE, POOLTAG);
+
+    if (VirtualAddress == NULL)
+    {
+        LogWarning("Insufficient system addresses in reserving the memory mapper");
+        return FALSE;
+    }
+
+    g_GuestState[ProcessorID].MemoryMapperVirtualAddress = (UINT64)VirtualAddress;
+    g_GuestState[ProcessorID].MemoryMapperPte            = GetPageTableEntry(FindSystemDirectoryTableBase(), (UINT64)VirtualAddress);
+
+    if (g_GuestState[ProcessorID].MemoryMapperPte == NULL)
+    {
+        MmFreeMappingAddress(VirtualAddress, POOLTAG);
+        g_GuestState[ProcessorID].MemoryMapperVirtualAddress = NULL;
+
+        LogWarning("Could not find the page table entry of the memory mapper");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Free the reserved address of the memory mapper of a core
+ * @details It's safe to be called for a core that its address is not reserved
+ *
+ * @param ProcessorID Logical Core Id
+ * @return VOID
+ */
+VOID
+VmxFreeMemoryMapper(INT ProcessorID)
+{
+    if (g_GuestState[ProcessorID].MemoryMapperVirtualAddress)
+    {
+        MmFreeMappingAddress((PVOID)g_GuestState[ProcessorID].MemoryMapperVirtualAddress, POOLTAG);
+        g_GuestState[ProcessorID].MemoryMapperVirtualAddress = NULL;
+        g_GuestState[ProcessorID].MemoryMapperPte            = NULL;
+    }
+}
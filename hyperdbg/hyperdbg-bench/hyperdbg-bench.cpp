@@ -0,0 +1,422 @@
+/**
+ * @file hyperdbg-bench.cpp
+ * @author Sina Karvandi (sina@rayanfam.com)
+ * @brief Micro-benchmarks of the vm-exits and the hooks of the hypervisor
+ * @details The hypervisor should be loaded (e.g. by hyperdbg-cli), the kernel
+ * tests are performed by the driver on the pinned core and the syscalls are
+ * measured here on a thread that is pinned to the same core
+ * @version 0.1
+ * @date 2020-05-24
+ *
+ * @copyright This project is released under the GNU Public License v3.
+ *
+ */
+#include <Windows.h>
+#include <intrin.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include "Definition.h"
+
+using namespace std;
+
+/**
+ * @brief NtQueryPerformanceCounter (the measured syscall)
+ *
+ */
+typedef LONG(NTAPI* NT_QUERY_PERFORMANCE_COUNTER)(PLARGE_INTEGER PerformanceCounter, PLARGE_INTEGER PerformanceFrequency);
+
+/**
+ * @brief A test of the benchmark
+ *
+ */
+typedef struct _BENCHMARK_TEST_DETAILS {
+	const char* Name;
+	BENCHMARK_TEST Test;
+	bool IsSyscall;       // Measured in user-mode
+	bool NeedsEferHook;   // The EFER syscall hook is enabled while measuring
+
+} BENCHMARK_TEST_DETAILS, * PBENCHMARK_TEST_DETAILS;
+
+/**
+ * @brief The statistics of the samples of a test on a core
+ *
+ */
+typedef struct _BENCHMARK_RESULT {
+	const char* Name;
+	UINT32 CoreId;
+	UINT32 CountOfSamples;
+	UINT64 Minimum;
+	UINT64 Median;
+	UINT64 Percentile90;
+	UINT64 Percentile99;
+	UINT64 Percentile999;
+	UINT64 Maximum;
+	double Mean;
+
+} BENCHMARK_RESULT, * PBENCHMARK_RESULT;
+
+BENCHMARK_TEST_DETAILS BenchmarkTests[] = {
+	{ "baseline", BENCHMARK_TEST_BASELINE, false, false },
+	{ "cpuid", BENCHMARK_TEST_CPUID, false, false },
+	{ "rdmsr_bitmap_hit", BENCHMARK_TEST_RDMSR_BITMAP_HIT, false, false },
+	{ "rdmsr_bitmap_miss", BENCHMARK_TEST_RDMSR_BITMAP_MISS, false, false },
+	{ "vmcall", BENCHMARK_TEST_VMCALL, false, false },
+	{ "ept_read_hook_hit", BENCHMARK_TEST_EPT_READ_HOOK_HIT, false, false },
+	{ "ept_write_hook_hit", BENCHMARK_TEST_EPT_WRITE_HOOK_HIT, false, false },
+	{ "ept_exec_hook_hit", BENCHMARK_TEST_EPT_EXEC_HOOK_HIT, false, false },
+	{ "detour_hook_call", BENCHMARK_TEST_DETOUR_HOOK_CALL, false, false },
+	{ "syscall", BENCHMARK_TEST_BASELINE, true, false },
+	{ "syscall_efer_hook", BENCHMARK_TEST_BASELINE, true, true },
+};
+
+HANDLE Handle;
+NT_QUERY_PERFORMANCE_COUNTER NtQueryPerformanceCounterRoutine;
+
+void ShowUsage() {
+	fprintf(stderr, "usage : hyperdbg-bench [-core <id | all>] [-samples <count>] [-warmup <count>] [-test <name>] [-format <csv | json>]\n\n");
+	fprintf(stderr, "\t-core : the core that the tests are pinned to, or all the cores (default : 0)\n");
+	fprintf(stderr, "\t-samples : count of the samples of each test (default : 10000, up to %d)\n", BENCHMARK_MAXIMUM_SAMPLES);
+	fprintf(stderr, "\t-warmup : count of the iterations before the samples (default : 1000)\n");
+	fprintf(stderr, "\t-test : only perform a test (can be used more than once, default : all the tests)\n");
+	fprintf(stderr, "\t-format : the output format (default : csv)\n\n");
+	fprintf(stderr, "tests :");
+
+	for (auto& Test : BenchmarkTests) {
+		fprintf(stderr, " %s", Test.Name);
+	}
+
+	fprintf(stderr, "\n\nthe hypervisor should be loaded, the cycles are the time-stamp counter ticks between the time stamps (the baseline is the overhead of measuring)\n");
+}
+
+/**
+ * @brief Send a request of the benchmarks to the driver
+ *
+ * @param Test The test
+ * @param CoreId The core
+ * @param CountOfWarmups Count of the iterations before the samples
+ * @param CountOfSamples Count of the samples
+ * @param Samples Receives the samples
+ * @param TimeStampCounterFrequency Receives the frequency of the time-stamp counter
+ * @return bool Whether the test was performed or not
+ */
+bool BenchmarkSendRequest(BENCHMARK_TEST Test, UINT32 CoreId, UINT32 CountOfWarmups, UINT32 CountOfSamples, vector<UINT64>& Samples, UINT64* TimeStampCounterFrequency) {
+
+	BOOL Status;
+	ULONG ReturnedLength;
+	UINT32 BufferSize = sizeof(BENCHMARK_REQUEST) + CountOfSamples * sizeof(UINT64);
+	vector<BYTE> Buffer(BufferSize);
+	PBENCHMARK_REQUEST Request = (PBENCHMARK_REQUEST)Buffer.data();
+
+	Request->Test = Test;
+	Request->CoreId = CoreId;
+	Request->CountOfWarmups = CountOfWarmups;
+	Request->CountOfSamples = CountOfSamples;
+
+	Status = DeviceIoControl(
+		Handle,								// Handle to device
+		IOCTL_PERFORM_BENCHMARK,			// IO Control code
+		Buffer.data(),						// Input Buffer to driver.
+		sizeof(BENCHMARK_REQUEST),			// Length of input buffer in bytes.
+		Buffer.data(),						// Output Buffer from driver.
+		BufferSize,							// Length of output buffer in bytes.
+		&ReturnedLength,					// Bytes placed in buffer.
+		NULL								// synchronous call
+	);
+
+	if (!Status) {
+		fprintf(stderr, "ioctl failed with code 0x%x\n", GetLastError());
+		return false;
+	}
+
+	if (TimeStampCounterFrequency) {
+		*TimeStampCounterFrequency = Request->TimeStampCounterFrequency;
+	}
+
+	Samples.assign((PUINT64)(Buffer.data() + sizeof(BENCHMARK_REQUEST)), (PUINT64)(Buffer.data() + sizeof(BENCHMARK_REQUEST)) + Request->CountOfSamples);
+
+	return true;
+}
+
+/**
+ * @brief Measure the syscalls on the current thread
+ * @details The thread is pinned to the core, the samples are fenced the same
+ * as the kernel tests
+ *
+ * @param CoreId The core
+ * @param CountOfWarmups Count of the iterations before the samples
+ * @param CountOfSamples Count of the samples
+ * @param Samples Receives the samples
+ * @return bool Whether the thread was pinned or not
+ */
+bool BenchmarkMeasureSyscalls(UINT32 CoreId, UINT32 CountOfWarmups, UINT32 CountOfSamples, vector<UINT64>& Samples) {
+
+	LARGE_INTEGER Counter;
+	DWORD_PTR PreviousAffinity;
+	unsigned int Aux;
+	UINT64 Start;
+	UINT64 End;
+
+	PreviousAffinity = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << CoreId);
+
+	if (!PreviousAffinity) {
+		fprintf(stderr, "unable to pin the thread to the core %d (0x%x)\n", CoreId, GetLastError());
+		return false;
+	}
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+	//
+	// Make sure that the thread is running on the core
+	//
+	Sleep(0);
+
+	Samples.resize(CountOfSamples);
+
+	for (UINT32 i = 0; i < CountOfWarmups + CountOfSamples; i++) {
+
+		_mm_lfence();
+		Start = __rdtsc();
+		_mm_lfence();
+
+		NtQueryPerformanceCounterRoutine(&Counter, NULL);
+
+		End = __rdtscp(&Aux);
+		_mm_lfence();
+
+		if (i >= CountOfWarmups) {
+			Samples[i - CountOfWarmups] = End - Start;
+		}
+	}
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+	SetThreadAffinityMask(GetCurrentThread(), PreviousAffinity);
+
+	return true;
+}
+
+/**
+ * @brief Compute the statistics of the samples
+ *
+ * @param Samples The samples (they're sorted)
+ * @param Result Receives the statistics
+ * @return VOID
+ */
+void BenchmarkComputeResult(vector<UINT64>& Samples, PBENCHMARK_RESULT Result) {
+
+	UINT64 Sum = 0;
+	size_t Count = Samples.size();
+
+	sort(Samples.begin(), Samples.end());
+
+	for (auto Sample : Samples) {
+		Sum += Sample;
+	}
+
+	//
+	// The nearest-rank percentiles
+	//
+	auto Percentile = [&](double Rank) -> UINT64 {
+		size_t Index = (size_t)(Rank * Count);
+		return Samples[Index < Count ? Index : Count - 1];
+	};
+
+	Result->CountOfSamples = (UINT32)Count;
+	Result->Minimum = Samples.front();
+	Result->Median = Percentile(0.5);
+	Result->Percentile90 = Percentile(0.9);
+	Result->Percentile99 = Percentile(0.99);
+	Result->Percentile999 = Percentile(0.999);
+	Result->Maximum = Samples.back();
+	Result->Mean = (double)Sum / Count;
+}
+
+/**
+ * @brief Show the results in the format
+ *
+ * @param Results The results
+ * @param IsJson Whether to show them in json or csv
+ * @param TimeStampCounterFrequency Frequency of the time-stamp counter
+ * @return VOID
+ */
+void BenchmarkShowResults(vector<BENCHMARK_RESULT>& Results, bool IsJson, UINT64 TimeStampCounterFrequency) {
+
+	if (IsJson) {
+		printf("{\n  \"tsc_frequency\": %llu,\n  \"results\": [\n", TimeStampCounterFrequency);
+
+		for (size_t i = 0; i < Results.size(); i++) {
+			printf("    { \"test\": \"%s\", \"core\": %u, \"samples\": %u, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %.2f }%s\n",
+				Results[i].Name, Results[i].CoreId, Results[i].CountOfSamples, Results[i].Minimum, Results[i].Median, Results[i].Percentile90,
+				Results[i].Percentile99, Results[i].Percentile999, Results[i].Maximum, Results[i].Mean, i + 1 == Results.size() ? "" : ",");
+		}
+
+		printf("  ]\n}\n");
+	}
+	else {
+		printf("test,core,samples,min,p50,p90,p99,p999,max,mean,tsc_frequency\n");
+
+		for (auto& Result : Results) {
+			printf("%s,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%.2f,%llu\n",
+				Result.Name, Result.CoreId, Result.CountOfSamples, Result.Minimum, Result.Median, Result.Percentile90,
+				Result.Percentile99, Result.Percentile999, Result.Maximum, Result.Mean, TimeStampCounterFrequency);
+		}
+	}
+}
+
+/**
+ * @brief Benchmark main function
+ *
+ * @return int
+ */
+int main(int argc, char* argv[])
+{
+	vector<UINT32> Cores;
+	vector<PBENCHMARK_TEST_DETAILS> Tests;
+	vector<BENCHMARK_RESULT> Results;
+	vector<UINT64> Samples;
+	vector<UINT64> NoSamples;
+	UINT32 CountOfSamples = 10000;
+	UINT32 CountOfWarmups = 1000;
+	UINT64 TimeStampCounterFrequency = 0;
+	bool IsJson = false;
+	bool AllCores = false;
+	UINT32 CountOfCores;
+	SYSTEM_INFO SystemInfo;
+
+	GetSystemInfo(&SystemInfo);
+	CountOfCores = min(SystemInfo.dwNumberOfProcessors, (DWORD)64);
+
+	for (int i = 1; i < argc; i++) {
+
+		string Option = argv[i];
+
+		if (i + 1 == argc) {
+			ShowUsage();
+			return 1;
+		}
+
+		string Value = argv[++i];
+
+		if (!Option.compare("-core")) {
+			if (!Value.compare("all")) {
+				AllCores = true;
+			}
+			else {
+				Cores.push_back(strtoul(Value.c_str(), NULL, 0));
+			}
+		}
+		else if (!Option.compare("-samples")) {
+			CountOfSamples = min(strtoul(Value.c_str(), NULL, 0), (unsigned long)BENCHMARK_MAXIMUM_SAMPLES);
+		}
+		else if (!Option.compare("-warmup")) {
+			CountOfWarmups = strtoul(Value.c_str(), NULL, 0);
+		}
+		else if (!Option.compare("-format") && (!Value.compare("csv") || !Value.compare("json"))) {
+			IsJson = !Value.compare("json");
+		}
+		else if (!Option.compare("-test")) {
+			auto Found = find_if(begin(BenchmarkTests), end(BenchmarkTests), [&](BENCHMARK_TEST_DETAILS& Test) { return !Value.compare(Test.Name); });
+
+			if (Found == end(BenchmarkTests)) {
+				fprintf(stderr, "unknown test '%s'\n\n", Value.c_str());
+				ShowUsage();
+				return 1;
+			}
+
+			Tests.push_back(&*Found);
+		}
+		else {
+			ShowUsage();
+			return 1;
+		}
+	}
+
+	if (CountOfSamples == 0) {
+		ShowUsage();
+		return 1;
+	}
+
+	if (AllCores) {
+		Cores.clear();
+
+		for (UINT32 i = 0; i < CountOfCores; i++) {
+			Cores.push_back(i);
+		}
+	}
+	else if (Cores.empty()) {
+		Cores.push_back(0);
+	}
+
+	if (Tests.empty()) {
+		for (auto& Test : BenchmarkTests) {
+			Tests.push_back(&Test);
+		}
+	}
+
+	for (auto CoreId : Cores) {
+		if (CoreId >= CountOfCores) {
+			fprintf(stderr, "invalid core %d\n", CoreId);
+			return 1;
+		}
+	}
+
+	NtQueryPerformanceCounterRoutine = (NT_QUERY_PERFORMANCE_COUNTER)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQueryPerformanceCounter");
+
+	Handle = CreateFileA("\\\\.\\HyperdbgHypervisorDevice",
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, /// lpSecurityAttirbutes
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL); /// lpTemplateFile
+
+	if (Handle == INVALID_HANDLE_VALUE || !NtQueryPerformanceCounterRoutine) {
+		fprintf(stderr, "unable to open the device (0x%x), probably the hypervisor is not loaded\n", GetLastError());
+		return 1;
+	}
+
+	for (auto CoreId : Cores) {
+		for (auto Test : Tests) {
+
+			BENCHMARK_RESULT Result = { 0 };
+
+			if (Test->IsSyscall) {
+
+				if (Test->NeedsEferHook && !BenchmarkSendRequest(BENCHMARK_TEST_ENABLE_SYSCALL_HOOK_EFER, CoreId, 0, 0, NoSamples, NULL)) {
+					continue;
+				}
+
+				bool IsMeasured = BenchmarkMeasureSyscalls(CoreId, CountOfWarmups, CountOfSamples, Samples);
+
+				if (Test->NeedsEferHook) {
+					BenchmarkSendRequest(BENCHMARK_TEST_DISABLE_SYSCALL_HOOK_EFER, CoreId, 0, 0, NoSamples, NULL);
+				}
+
+				if (!IsMeasured) {
+					continue;
+				}
+			}
+			else if (!BenchmarkSendRequest(Test->Test, CoreId, CountOfWarmups, CountOfSamples, Samples, &TimeStampCounterFrequency)) {
+				fprintf(stderr, "the test '%s' is not performed on the core %d\n", Test->Name, CoreId);
+				continue;
+			}
+
+			if (Samples.empty()) {
+				continue;
+			}
+
+			Result.Name = Test->Name;
+			Result.CoreId = CoreId;
+
+			BenchmarkComputeResult(Samples, &Result);
+			Results.push_back(Result);
+		}
+	}
+
+	CloseHandle(Handle);
+
+	BenchmarkShowResults(Results, IsJson, TimeStampCounterFrequency);
+
+	return Results.empty() ? 1 : 0;
+}
@@ -33,6 +33,7 @@ extern "C"
 	__declspec (dllimport) int __cdecl  HyperdbgUninstallDriver();
 	__declspec (dllimport) int __cdecl  HyperdbgInterpreter(const char* Command);
 	__declspec (dllimport) void __stdcall HyperdbgSetTextMessageCallback(Callback handler);
+	__declspec (dllimport) void __stdcall HyperdbgSetBatchMessageCallback(BatchCallback handler, UINT32 Flags);
 
 }
 
@@ -1,4 +1,7 @@
-﻿using System.Windows.Forms;
+﻿using System;
+using System.Runtime.InteropServices;
+using System.Text;
+using System.Windows.Forms;
 
 namespace hyperdbg_gui
 {
@@ -9,6 +12,33 @@ public CommandWindow()
             InitializeComponent();
         }
 
+        // Append a batch of messages with one update of the text box
+        public int AppendMessages(KernelAffairs.CtrlNativeCallbacks.MessageEntry[] entries, uint count)
+        {
+            StringBuilder Text = new StringBuilder();
+
+            // the data is only valid in the callback, so the text is made here
+            for (uint i = 0; i < count; i++)
+            {
+                if ((entries[i].Flags & KernelAffairs.CtrlNativeCallbacks.MessageEntryBinary) == 0)
+                {
+                    Text.Append(Marshal.PtrToStringAnsi(entries[i].Data, (int)entries[i].Length));
+                }
+            }
+
+            if (Text.Length == 0)
+            {
+                return 0;
+            }
+
+            // don't wait for the UI thread, the library delivers the next batches in the meantime
+            string Messages = Text.ToString();
+            richTextBox1.BeginInvoke(new Action(() => {
+                richTextBox1.AppendText(Messages);
+            }));
+            return 0;
+        }
+
         private void richTextBox1_TextChanged(object sender, System.EventArgs e)
         {
             // set the current caret position to the end
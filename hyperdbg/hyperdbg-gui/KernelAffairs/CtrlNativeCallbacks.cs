@@ -1,4 +1,5 @@
-﻿using System.Runtime.InteropServices;
+﻿using System;
+using System.Runtime.InteropServices;
 
 namespace hyperdbg_gui.KernelAffairs
 {
@@ -15,5 +16,32 @@ public static void SetCallback(Callback callback)
             HyperdbgSetTextMessageCallback(callback);
         }
 
+        [DllImport("HPRDBGCTRL.dll")]
+        private static extern void HyperdbgSetBatchMessageCallback(BatchCallback fn, uint flags);
+
+        public const uint MessageEntryBinary = 0x1;    // HYPERDBG_MESSAGE_ENTRY_BINARY
+
+        // Same as HYPERDBG_MESSAGE_ENTRY, Data is only valid in the callback
+        [StructLayout(LayoutKind.Sequential)]
+        public struct MessageEntry
+        {
+            public uint OperationCode;
+            public uint Flags;
+            public ulong Tag;
+            public ulong TimeStampCounter;
+            public uint Length;
+            public uint Reserved;
+            public IntPtr Data;
+        }
+
+        public delegate int BatchCallback([MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)] MessageEntry[] entries, uint count);
+        private static BatchCallback mBatchInstance;   // Ensure it doesn't get garbage collected
+
+        public static void SetBatchCallback(BatchCallback callback)
+        {
+            mBatchInstance = callback;
+            HyperdbgSetBatchMessageCallback(callback, 0);
+        }
+
     }
 }
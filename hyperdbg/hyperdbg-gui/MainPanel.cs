@@ -132,18 +132,15 @@ private void toolStripMenuItem2_Click(object sender, EventArgs e)
             MessageBox.Show("Not yet supported, support will be available in the future versions");
         }
 
-        private int ReceivedMessagesHandler(string Text)
+        private int ReceivedMessagesHandler(hyperdbg_gui.KernelAffairs.CtrlNativeCallbacks.MessageEntry[] Entries, uint Count)
         {
-            hyperdbg_gui.Details.GlobalVariables.CommandWindow.richTextBox1.Invoke(new Action(() => {
-                hyperdbg_gui.Details.GlobalVariables.CommandWindow.richTextBox1.AppendText(Text);  
-            }));
-            return 0;
+            return hyperdbg_gui.Details.GlobalVariables.CommandWindow.AppendMessages(Entries, Count);
         }
 
 
         public void LoadDriver()
         {
-            hyperdbg_gui.KernelAffairs.CtrlNativeCallbacks.SetCallback(ReceivedMessagesHandler);
+            hyperdbg_gui.KernelAffairs.CtrlNativeCallbacks.SetBatchCallback(ReceivedMessagesHandler);
 
             if (hyperdbg_gui.KernelmodeRequests.KernelRequests.HyperdbgDriverInstaller() != 0)
             {